@@ -0,0 +1,382 @@
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static std::vector<std::string> autoDllErrors;
+#ifdef _WIN32
+#define CUDA_DLL L"nvcuda.dll","nvcuda.dll",autoDllErrors
+#else
+#define CUDA_DLL "libcuda.so.1",autoDllErrors
+#endif
+#include "../ngx/cuda.h"
+
+#include "cambicuda.h"
+
+namespace {
+
+#define CUDA_CHECK(x) do { \
+    CUresult r = (x); \
+    if (r != CUDA_SUCCESS) \
+        throw std::runtime_error(std::string{ "CUDA call " #x " failed: " } + std::to_string(r)); \
+} while (0)
+
+// One thread per pixel, in blocks of 32x8 that first load the samples of all
+// their windows into shared memory, with 0xffff for those outside the frame or
+// the mask. Each thread then counts the samples within 4 of its own value in
+// its window, 16 bits per count: value - 4 + k at bit 16k of %rd5 for k < 4,
+// at bit 16(k - 4) of %rd6 for k < 8, and value + 4 in %rd7. The shifts
+// select the register by clamping: PTX shifts by more than 64 give 0, and
+// farther samples are counted as k = 9, past the bits that are read. These
+// are the counts of the sliding histograms of the CPU, and the c-value is
+// computed from them with the same integer products and float division, so
+// the results are identical.
+const char cValuesPtx[] = R"(
+.version 6.0
+.target sm_50
+.address_size 64
+
+.extern .shared .align 4 .b8 tile[];
+
+.visible .entry cambi_c_values(
+    .param .u64 p_image,
+    .param .u64 p_mask,
+    .param .u32 p_pitch,
+    .param .u64 p_out,
+    .param .u32 p_opitch,
+    .param .u32 p_width,
+    .param .u32 p_height,
+    .param .u32 p_pad,
+    .param .u32 p_tvi0,
+    .param .u32 p_tvi1,
+    .param .u32 p_tvi2,
+    .param .u32 p_tvi3)
+{
+    .reg .pred %p<3>;
+    .reg .b32 %r<40>;
+    .reg .b64 %rd<12>;
+    .reg .f32 %f<4>;
+
+    ld.param.u64 %rd1, [p_image];
+    cvta.to.global.u64 %rd1, %rd1;
+    ld.param.u64 %rd2, [p_mask];
+    cvta.to.global.u64 %rd2, %rd2;
+    ld.param.u32 %r1, [p_pitch];
+    ld.param.u32 %r2, [p_width];
+    ld.param.u32 %r3, [p_height];
+    ld.param.u32 %r4, [p_pad];
+    mov.u32 %r5, %tid.x;
+    mov.u32 %r6, %tid.y;
+    mov.u32 %r7, %ctaid.x;
+    shl.b32 %r7, %r7, 5;
+    mov.u32 %r8, %ctaid.y;
+    shl.b32 %r8, %r8, 3;
+    shl.b32 %r9, %r4, 1;
+    add.u32 %r10, %r9, 32;
+    add.u32 %r11, %r9, 8;
+    mul.lo.u32 %r11, %r11, %r10;
+    mov.u32 %r12, tile;
+
+    shl.b32 %r13, %r6, 5;
+    add.u32 %r13, %r13, %r5;
+LOAD:
+    setp.ge.u32 %p1, %r13, %r11;
+    @%p1 bra LOADED;
+    div.u32 %r14, %r13, %r10;
+    mul.lo.u32 %r15, %r14, %r10;
+    sub.u32 %r15, %r13, %r15;
+    add.u32 %r15, %r15, %r7;
+    sub.u32 %r15, %r15, %r4;
+    add.u32 %r14, %r14, %r8;
+    sub.u32 %r14, %r14, %r4;
+    mov.u32 %r16, 65535;
+    setp.ge.u32 %p1, %r15, %r2;
+    setp.ge.or.u32 %p1, %r14, %r3, %p1;
+    @%p1 bra STORE;
+    mul.wide.u32 %rd3, %r14, %r1;
+    mul.wide.u32 %rd4, %r15, 2;
+    add.u64 %rd3, %rd3, %rd4;
+    add.u64 %rd4, %rd2, %rd3;
+    ld.global.u16 %r17, [%rd4];
+    setp.eq.u32 %p1, %r17, 0;
+    @%p1 bra STORE;
+    add.u64 %rd4, %rd1, %rd3;
+    ld.global.u16 %r16, [%rd4];
+STORE:
+    shl.b32 %r17, %r13, 1;
+    add.u32 %r17, %r17, %r12;
+    st.shared.u16 [%r17], %r16;
+    add.u32 %r13, %r13, 256;
+    bra LOAD;
+LOADED:
+    bar.sync 0;
+
+    add.u32 %r18, %r7, %r5;
+    add.u32 %r19, %r8, %r6;
+    setp.ge.u32 %p1, %r18, %r2;
+    setp.ge.or.u32 %p1, %r19, %r3, %p1;
+    @%p1 bra DONE;
+    mul.lo.u32 %r20, %r6, %r10;
+    add.u32 %r20, %r20, %r5;
+    shl.b32 %r20, %r20, 1;
+    add.u32 %r20, %r20, %r12;
+    mad.lo.u32 %r21, %r4, %r10, %r4;
+    shl.b32 %r21, %r21, 1;
+    add.u32 %r21, %r21, %r20;
+    ld.shared.u16 %r22, [%r21];
+    mov.f32 %f1, 0f00000000;
+    setp.eq.u32 %p1, %r22, 65535;
+    @%p1 bra WRITE;
+
+    mov.b64 %rd5, 0;
+    mov.b64 %rd6, 0;
+    mov.b64 %rd7, 0;
+    mov.b64 %rd8, 1;
+    neg.s32 %r23, %r22;
+    add.u32 %r23, %r23, 4;
+    add.u32 %r24, %r9, 1;
+    shl.b32 %r25, %r10, 1;
+    shl.b32 %r26, %r24, 1;
+    mov.u32 %r27, 0;
+ROWS:
+    mov.u32 %r28, %r20;
+    add.u32 %r29, %r20, %r26;
+COLS:
+    ld.shared.u16 %r30, [%r28];
+    add.u32 %r30, %r30, %r23;
+    min.u32 %r30, %r30, 9;
+    shl.b32 %r30, %r30, 4;
+    shl.b64 %rd9, %rd8, %r30;
+    add.u64 %rd5, %rd5, %rd9;
+    sub.u32 %r31, %r30, 64;
+    shl.b64 %rd9, %rd8, %r31;
+    add.u64 %rd6, %rd6, %rd9;
+    sub.u32 %r31, %r30, 128;
+    shl.b64 %rd9, %rd8, %r31;
+    add.u64 %rd7, %rd7, %rd9;
+    add.u32 %r28, %r28, 2;
+    setp.lt.u32 %p1, %r28, %r29;
+    @%p1 bra COLS;
+    add.u32 %r20, %r20, %r25;
+    add.u32 %r27, %r27, 1;
+    setp.lt.u32 %p1, %r27, %r24;
+    @%p1 bra ROWS;
+
+    cvt.u32.u64 %r32, %rd6;
+    and.b32 %r32, %r32, 65535;
+    add.u32 %r33, %r22, 4;
+)"
+// The diffs 1 to 4: the counts of value + diff and value - diff, and the
+// weight of the diff.
+#define CAMBI_DIFF_PTX(tvi, hi, hiShift, lo, loShift, weight) \
+    "    ld.param.u32 %r34, [" tvi "];\n" \
+    "    setp.gt.u32 %p2, %r33, %r34;\n" \
+    "    shr.b64 %rd9, " hi ", " hiShift ";\n" \
+    "    cvt.u32.u64 %r35, %rd9;\n" \
+    "    and.b32 %r35, %r35, 65535;\n" \
+    "    shr.b64 %rd9, " lo ", " loShift ";\n" \
+    "    cvt.u32.u64 %r36, %rd9;\n" \
+    "    and.b32 %r36, %r36, 65535;\n" \
+    "    max.u32 %r35, %r35, %r36;\n" \
+    "    mul.lo.u32 %r36, %r35, %r32;\n" \
+    "    mul.lo.u32 %r36, %r36, " weight ";\n" \
+    "    add.u32 %r35, %r35, %r32;\n" \
+    "    cvt.rn.f32.u32 %f2, %r36;\n" \
+    "    cvt.rn.f32.u32 %f3, %r35;\n" \
+    "    div.rn.f32 %f2, %f2, %f3;\n" \
+    "    max.f32 %f2, %f1, %f2;\n" \
+    "    selp.f32 %f1, %f1, %f2, %p2;\n"
+    CAMBI_DIFF_PTX("p_tvi0", "%rd6", "16", "%rd5", "48", "1")
+    CAMBI_DIFF_PTX("p_tvi1", "%rd6", "32", "%rd5", "32", "2")
+    CAMBI_DIFF_PTX("p_tvi2", "%rd6", "48", "%rd5", "16", "3")
+    CAMBI_DIFF_PTX("p_tvi3", "%rd7", "0", "%rd5", "0", "4")
+#undef CAMBI_DIFF_PTX
+R"(
+WRITE:
+    ld.param.u64 %rd10, [p_out];
+    cvta.to.global.u64 %rd10, %rd10;
+    ld.param.u32 %r37, [p_opitch];
+    mul.wide.u32 %rd11, %r19, %r37;
+    add.u64 %rd10, %rd10, %rd11;
+    mul.wide.u32 %rd11, %r18, 4;
+    add.u64 %rd10, %rd10, %rd11;
+    st.global.f32 [%rd10], %f1;
+DONE:
+    ret;
+}
+)";
+
+// The buffers of one scale on the GPU, along with the stream it is processed on.
+struct CambiCudaSlot {
+    CUstream stream = nullptr;
+    CUdeviceptr image = nullptr, mask = nullptr, out = nullptr;
+};
+
+} // namespace
+
+struct CambiCuda {
+    CUdevice device = 0;
+    CUcontext ctx = nullptr; // the primary context of device, retained
+    CUmodule module = nullptr;
+    CUfunction fn = nullptr;
+    FilterStats *perf = nullptr;
+    unsigned width = 0, height = 0;
+    size_t pitch = 0, outPitch = 0; // of the image and mask, and of the c-values
+
+    std::mutex lock;
+    std::condition_variable slotFree;
+    std::unique_ptr<CambiCudaSlot[]> slots;
+    int numSlots = 0;
+    std::vector<CambiCudaSlot *> freeSlots; // guarded by lock
+
+    ~CambiCuda() {
+        if (!ctx)
+            return;
+        cuCtxPushCurrent_v2(ctx);
+        for (int i = 0; i < numSlots; i++) {
+            auto &s = slots[i];
+            if (s.image) cuMemFree_v2(s.image);
+            if (s.mask) cuMemFree_v2(s.mask);
+            if (s.out) cuMemFree_v2(s.out);
+            if (s.stream) cuStreamDestroy_v2(s.stream);
+        }
+        if (module) cuModuleUnload(module);
+        cuCtxPopCurrent_v2(nullptr);
+        cuDevicePrimaryCtxRelease(device);
+    }
+
+    CambiCudaSlot *acquire() {
+        std::unique_lock<std::mutex> guard(lock);
+        slotFree.wait(guard, [this]() { return !freeSlots.empty(); });
+        auto s = freeSlots.back();
+        freeSlots.pop_back();
+        return s;
+    }
+
+    void release(CambiCudaSlot *s) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            freeSlots.push_back(s);
+        }
+        slotFree.notify_one();
+    }
+};
+
+static void createCuda(CambiCuda *c, int device, int numSlots) {
+    if (!autoDllErrors.empty())
+        throw std::runtime_error("the cuda backend is unavailable: " + autoDllErrors.front());
+    CUDA_CHECK(cuInit(0));
+    int count = 0;
+    CUDA_CHECK(cuDeviceGetCount(&count));
+    if (device < 0 || device >= count)
+        throw std::runtime_error("device_id " + std::to_string(device) + " is out of range, there are " + std::to_string(count) + " devices");
+    CUDA_CHECK(cuDeviceGet(&c->device, device));
+    CUDA_CHECK(cuDevicePrimaryCtxRetain(&c->ctx, c->device));
+    CUDA_CHECK(cuCtxPushCurrent_v2(c->ctx));
+    struct Pop { ~Pop() { cuCtxPopCurrent_v2(nullptr); } } pop;
+
+    char log[4096] = {};
+    CUjit_option options[] = { 5 /* CU_JIT_ERROR_LOG_BUFFER */, 6 /* CU_JIT_ERROR_LOG_BUFFER_SIZE_BYTES */ };
+    void *values[] = { log, reinterpret_cast<void *>((uintptr_t)sizeof log) };
+    if (cuModuleLoadDataEx(&c->module, cValuesPtx, 2, options, values) != CUDA_SUCCESS)
+        throw std::runtime_error(std::string{ "unable to compile the kernel: " } + log);
+    CUDA_CHECK(cuModuleGetFunction(&c->fn, c->module, "cambi_c_values"));
+
+    c->pitch = (c->width * sizeof(uint16_t) + 255) & ~(size_t)255;
+    c->outPitch = (c->width * sizeof(float) + 255) & ~(size_t)255;
+    c->numSlots = numSlots;
+    c->slots.reset(new CambiCudaSlot[numSlots]);
+    for (int k = 0; k < numSlots; k++) {
+        auto &s = c->slots[k];
+        CUDA_CHECK(cuStreamCreate(&s.stream, CU_STREAM_NON_BLOCKING));
+        CUDA_CHECK(cuMemAlloc_v2(&s.image, c->pitch * c->height));
+        CUDA_CHECK(cuMemAlloc_v2(&s.mask, c->pitch * c->height));
+        CUDA_CHECK(cuMemAlloc_v2(&s.out, c->outPitch * c->height));
+        filterStatsBytes(c->perf, (2 * c->pitch + c->outPitch) * c->height);
+        c->freeSlots.push_back(&s);
+    }
+}
+
+CambiCuda *cambiCudaCreate(int device, int numStreams, unsigned width, unsigned height, FilterStats *perf, char *errmsg, size_t errmsgSize) {
+    auto c = std::make_unique<CambiCuda>();
+    c->perf = perf;
+    c->width = width;
+    c->height = height;
+    try {
+        createCuda(c.get(), device, numStreams);
+    } catch (std::runtime_error &e) {
+        snprintf(errmsg, errmsgSize, "Cambi: %s", e.what());
+        return nullptr;
+    }
+    return c.release();
+}
+
+void cambiCudaFree(CambiCuda *c) {
+    delete c;
+}
+
+// Copies a plane of width x height samples of bytesPerSample between the
+// host and the device.
+static void copyPlane(CUdeviceptr dev, size_t devPitch, void *host, size_t hostPitch, int width, int height, size_t bytesPerSample, bool upload, CUstream stream) {
+    CUDA_MEMCPY2D mcp2d {};
+    if (upload) {
+        mcp2d.srcMemoryType = CU_MEMORYTYPE_HOST;
+        mcp2d.srcHost = host;
+        mcp2d.srcPitch = hostPitch;
+        mcp2d.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+        mcp2d.dstDevice = dev;
+        mcp2d.dstPitch = devPitch;
+    } else {
+        mcp2d.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+        mcp2d.srcDevice = dev;
+        mcp2d.srcPitch = devPitch;
+        mcp2d.dstMemoryType = CU_MEMORYTYPE_HOST;
+        mcp2d.dstHost = host;
+        mcp2d.dstPitch = hostPitch;
+    }
+    mcp2d.WidthInBytes = width * bytesPerSample;
+    mcp2d.Height = height;
+    CUDA_CHECK(cuMemcpy2DAsync_v2(&mcp2d, stream));
+}
+
+int cambiCudaCValues(void *ctx, const uint16_t *image, const uint16_t *mask, ptrdiff_t stride,
+                     float *c_values, ptrdiff_t c_values_stride, int width, int height,
+                     uint16_t window_size, const uint16_t *tvi_for_diff) {
+    CambiCuda *c = static_cast<CambiCuda *>(ctx);
+    if ((unsigned)width > c->width || (unsigned)height > c->height)
+        return -EINVAL;
+
+    struct Slot {
+        CambiCuda *c;
+        CambiCudaSlot *s;
+        ~Slot() {
+            cuStreamSynchronize(s->stream);
+            cuCtxPopCurrent_v2(nullptr);
+            c->release(s);
+        }
+    } slot{ c, c->acquire() };
+    try {
+        CUDA_CHECK(cuCtxPushCurrent_v2(c->ctx));
+        CambiCudaSlot *s = slot.s;
+        copyPlane(s->image, c->pitch, const_cast<uint16_t *>(image), stride * sizeof(uint16_t), width, height, sizeof(uint16_t), true, s->stream);
+        copyPlane(s->mask, c->pitch, const_cast<uint16_t *>(mask), stride * sizeof(uint16_t), width, height, sizeof(uint16_t), true, s->stream);
+
+        unsigned pitch = c->pitch, outPitch = c->outPitch, w = width, h = height, pad = window_size >> 1;
+        unsigned tvi[4] = { tvi_for_diff[0], tvi_for_diff[1], tvi_for_diff[2], tvi_for_diff[3] };
+        void *args[] = { &s->image, &s->mask, &pitch, &s->out, &outPitch, &w, &h, &pad, &tvi[0], &tvi[1], &tvi[2], &tvi[3] };
+        const unsigned shared = (32 + 2 * pad) * (8 + 2 * pad) * sizeof(uint16_t);
+        CUDA_CHECK(cuLaunchKernel(c->fn, (w + 31) / 32, (h + 7) / 8, 1, 32, 8, 1, shared, s->stream, args, nullptr));
+        copyPlane(s->out, c->outPitch, c_values, c_values_stride * sizeof(float), width, height, sizeof(float), false, s->stream);
+
+        int64_t start = filterStatsNow();
+        CUDA_CHECK(cuStreamSynchronize(s->stream));
+        filterStatsGpuWait(c->perf, filterStatsNow() - start);
+    } catch (std::runtime_error &) {
+        return -EIO;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef BANDING_CAMBICUDA_H
+#define BANDING_CAMBICUDA_H
+
+// The c-value pass of Cambi on an NVIDIA GPU (backend="cuda"), plugged into
+// CambiState as its c_values_fn. Only built with HAVE_CUDA.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../filterstats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct CambiCuda CambiCuda;
+
+// Loads the kernel on device and allocates the buffers of numStreams scales
+// processed concurrently, of up to width x height pixels each. Returns NULL
+// with the reason in errmsg on failure.
+CambiCuda *cambiCudaCreate(int device, int numStreams, unsigned width, unsigned height, FilterStats *perf, char *errmsg, size_t errmsgSize);
+void cambiCudaFree(CambiCuda *c);
+
+// A CambiCValuesFn, with ctx the CambiCuda.
+int cambiCudaCValues(void *ctx, const uint16_t *image, const uint16_t *mask, ptrdiff_t stride,
+                     float *c_values, ptrdiff_t c_values_stride, int width, int height,
+                     uint16_t window_size, const uint16_t *tvi_for_diff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BANDING_CAMBICUDA_H
@@ -1,90 +1,435 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "internalfilters.h"
+#include "../filterstats.h"
+#include "../scratch.h"
+#include "../workpool.h"
 #include "libvmaf/picture.h"
 #include "libvmaf/cambi.h"
+#include "cambicuda.h"
 
 #include "VapourSynth4.h"
 #include "VSHelper4.h"
 
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK CambiLock;
+#define cambiLockInit(l) InitializeSRWLock(l)
+#define cambiLock(l) AcquireSRWLockExclusive(l)
+#define cambiUnlock(l) ReleaseSRWLockExclusive(l)
+#define cambiLockDestroy(l) ((void)0)
+#define CAMBI_LOCK_INITIALIZER SRWLOCK_INIT
+#else
+#include <pthread.h>
+typedef pthread_mutex_t CambiLock;
+#define cambiLockInit(l) pthread_mutex_init(l, NULL)
+#define cambiLock(l) pthread_mutex_lock(l)
+#define cambiUnlock(l) pthread_mutex_unlock(l)
+#define cambiLockDestroy(l) pthread_mutex_destroy(l)
+#define CAMBI_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#endif
+
+// An initialised CambiState, reused across frames so that they need not allocate.
+typedef struct CambiPoolEntry {
+    CambiState s;
+    unsigned width, height; // of the pictures it was initialised for
+    struct CambiPoolEntry *next;
+} CambiPoolEntry;
+
+// Regions scored instead of the whole frame with roi or grid.
+#define CAMBI_MAX_TILES 256
+#define CAMBI_MIN_TILE 64
+
+typedef struct {
+    int x, y, width, height;
+} CambiTile;
+
+// Recent results kept by temporal=1.
+#define CAMBI_RESULTS 4
+
+// The score and c-score frames measured for the luma plane of src.
+typedef struct {
+    const VSFrame *src;
+    double score;
+    const VSFrame *scales[NUM_SCALES];
+    double tiles[CAMBI_MAX_TILES];
+} CambiResult;
+
+// Source scores of the full-reference mode, shared by all instances with the
+// same ref node and settings (e.g. the rungs of an encode ladder).
+#define CAMBI_SOURCE_RESULTS 64
+
+typedef struct CambiSourceCache {
+    // key; the node stays valid as every user holds a reference to it
+    VSNode *node;
+    uint16_t window_size;
+    double topk;
+    double tvi_threshold;
+    int numTiles;
+    CambiTile tiles[CAMBI_MAX_TILES];
+
+    int users; // guarded by sourceCachesLock
+    CambiLock lock;
+    int frames[CAMBI_SOURCE_RESULTS]; // guarded by lock, -1 if unused
+    double scores[CAMBI_SOURCE_RESULTS];
+    int next;
+    struct CambiSourceCache *nextCache;
+} CambiSourceCache;
+
+static CambiLock sourceCachesLock = CAMBI_LOCK_INITIALIZER;
+static CambiSourceCache *sourceCaches;
+
 typedef struct {
     VSNode *node;
+    VSNode *ref; // source clip of the full-reference mode, or NULL
+    int refBpc;
+    CambiSourceCache *sourceCache;
     VSVideoInfo vi;
-    CambiState s;
+    CambiState s; // template of the pooled states
     int bpc;
     int scores;
     float scaling;
+    CambiLock lock;
+    CambiPoolEntry *pool; // idle states
+    int temporal;
+    CambiResult results[CAMBI_RESULTS]; // guarded by lock
+    int nextResult;
+    int numTiles; // 0 to score the whole frame
+    CambiTile tiles[CAMBI_MAX_TILES];
+    FilterStats *perf;
+    CambiCuda *cuda; // computes the c-values with backend="cuda"
 } CambiData;
 
-static const VSFrame *VS_CC cambiGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    CambiData *d = (CambiData *) instanceData;
+static void freeEntry(CambiPoolEntry *e) {
+    cambi_close(&e->s);
+    free(e);
+}
 
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        const VSFrame *src = vsapi->getFrameFilter(n, d->node, frameCtx);
-        const unsigned int width = vsapi->getFrameWidth(src, 0);
-        const unsigned int height = vsapi->getFrameHeight(src, 0);
-        VSFrame *dst = vsapi->copyFrame(src, core);
+// Takes an idle state for width x height pictures from the pool, or creates
+// one if all are in use (at most one per concurrent frame and tile size).
+// Returns NULL on allocation failure.
+static CambiPoolEntry *acquireState(CambiData *d, unsigned width, unsigned height) {
+    cambiLock(&d->lock);
+    CambiPoolEntry **link = &d->pool;
+    while (*link && ((*link)->width != width || (*link)->height != height))
+        link = &(*link)->next;
+    CambiPoolEntry *e = *link;
+    if (e)
+        *link = e->next;
+    cambiUnlock(&d->lock);
+    if (e)
+        return e;
+
+    e = calloc(1, sizeof *e);
+    if (!e)
+        return NULL;
+    e->s = d->s;
+    e->width = width;
+    e->height = height;
+    if (d->numTiles) {
+        // A tile keeps the window size and spatial mask of the (working size of
+        // the) whole frame, so that its score is comparable to a full measurement.
+        e->s.enc_width = e->s.enc_height = 0;
+        e->s.ref_width = d->s.pics[0].w[0];
+        e->s.ref_height = d->s.pics[0].h[0];
+    }
+    if (cambi_init(&e->s, width, height) != 0) {
+        freeEntry(e);
+        return NULL;
+    }
+    return e;
+}
+
+static void releaseState(CambiData *d, CambiPoolEntry *e) {
+    cambiLock(&d->lock);
+    e->next = d->pool;
+    d->pool = e;
+    cambiUnlock(&d->lock);
+}
 
+// Whether both frames have bit-identical luma planes.
+static int sameLuma(const VSFrame *a, const VSFrame *b, int bytesPerSample, const VSAPI *vsapi) {
+    if (a == b)
+        return 1;
+    const size_t rowSize = (size_t)vsapi->getFrameWidth(a, 0) * bytesPerSample;
+    const int height = vsapi->getFrameHeight(a, 0);
+    const ptrdiff_t strideA = vsapi->getStride(a, 0), strideB = vsapi->getStride(b, 0);
+    const uint8_t *pa = vsapi->getReadPtr(a, 0), *pb = vsapi->getReadPtr(b, 0);
+    for (int y = 0; y < height; y++, pa += strideA, pb += strideB) {
+        if (memcmp(pa, pb, rowSize))
+            return 0;
+    }
+    return 1;
+}
+
+static void freeResult(CambiResult *r, const VSAPI *vsapi) {
+    vsapi->freeFrame(r->src);
+    for (int i = 0; i < NUM_SCALES; i++)
+        vsapi->freeFrame(r->scales[i]);
+    memset(r, 0, sizeof *r);
+}
+
+// Looks for a cached result of a frame with the same luma as src, and returns
+// it with its own references. The comparisons run outside of the lock.
+static int findResult(CambiData *d, const VSFrame *src, CambiResult *r, const VSAPI *vsapi) {
+    CambiResult candidates[CAMBI_RESULTS];
+    cambiLock(&d->lock);
+    for (int i = 0; i < CAMBI_RESULTS; i++) {
+        candidates[i] = d->results[i];
+        if (candidates[i].src)
+            vsapi->addFrameRef(candidates[i].src);
+        for (int j = 0; j < NUM_SCALES; j++) {
+            if (candidates[i].scales[j])
+                vsapi->addFrameRef(candidates[i].scales[j]);
+        }
+    }
+    cambiUnlock(&d->lock);
+
+    int found = 0;
+    for (int i = 0; i < CAMBI_RESULTS; i++) {
+        if (!found && candidates[i].src && sameLuma(candidates[i].src, src, d->vi.format.bytesPerSample, vsapi)) {
+            *r = candidates[i];
+            found = 1;
+        } else {
+            freeResult(&candidates[i], vsapi);
+        }
+    }
+    return found;
+}
+
+// Takes over the references of r, replacing the oldest cached result.
+static void storeResult(CambiData *d, CambiResult *r, const VSAPI *vsapi) {
+    cambiLock(&d->lock);
+    CambiResult old = d->results[d->nextResult];
+    d->results[d->nextResult] = *r;
+    d->nextResult = (d->nextResult + 1) % CAMBI_RESULTS;
+    cambiUnlock(&d->lock);
+    freeResult(&old, vsapi);
+}
+
+// Scores every tile of src into r, with their mean as the frame score.
+static int measureTiles(CambiData *d, const VSFrame *src, int bpc, CambiResult *r, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+    const ptrdiff_t stride = vsapi->getStride(src, 0);
+    const uint8_t *srcp = vsapi->getReadPtr(src, 0);
+    double sum = 0;
+    for (int i = 0; i < d->numTiles; i++) {
+        const CambiTile *t = &d->tiles[i];
         VmafPicture pic; // shares memory with src
         pic.pix_fmt = VMAF_PIX_FMT_YUV400P; // GRAY
-        pic.bpc = d->bpc;
-        pic.w[0] = width;
-        pic.h[0] = height;
-        pic.stride[0] = vsapi->getStride(src, 0);
-        pic.data[0] = (uint8_t *)vsapi->getReadPtr(src, 0);
+        pic.bpc = bpc;
+        pic.w[0] = t->width;
+        pic.h[0] = t->height;
+        pic.stride[0] = stride;
+        pic.data[0] = (uint8_t *)srcp + t->y * stride + t->x * (bpc > 8 ? 2 : 1);
         pic.ref = NULL;
 
-        double score;
-        CambiState s = d->s; // cambiGetFrame might be called concurrently
-        int err = cambi_init(&s, pic.w[0], pic.h[0]);
-        assert(err == 0);
+        CambiPoolEntry *e = acquireState(d, t->width, t->height);
+        if (!e) {
+            vsapi->setFilterError("Cambi: failed to allocate state", frameCtx);
+            return 0;
+        }
+        int err = cambi_extract(&e->s, &pic, &r->tiles[i], NULL);
+        releaseState(d, e);
+        if (err) {
+            vsapi->setFilterError("Cambi: failed to compute the c-values on the GPU", frameCtx);
+            return 0;
+        }
+        sum += r->tiles[i];
+    }
+    r->score = sum / d->numTiles;
+    return 1;
+}
 
-        float *c_values[NUM_SCALES];
-        if (d->scores) {
-            unsigned int w = width, h = height;
-            for (int i = 0; i < NUM_SCALES; i++) {
-                c_values[i] = calloc(w * h, sizeof *c_values[i]);
-                scale_dimension(&w, 1);
-                scale_dimension(&h, 1);
+// Computes the score (and c-score frames if withScores) of src into r.
+static int measure(CambiData *d, const VSFrame *src, int bpc, int withScores, CambiResult *r, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    if (d->numTiles)
+        return measureTiles(d, src, bpc, r, frameCtx, vsapi);
+
+    const unsigned int width = vsapi->getFrameWidth(src, 0);
+    const unsigned int height = vsapi->getFrameHeight(src, 0);
+
+    VmafPicture pic; // shares memory with src
+    pic.pix_fmt = VMAF_PIX_FMT_YUV400P; // GRAY
+    pic.bpc = bpc;
+    pic.w[0] = width;
+    pic.h[0] = height;
+    pic.stride[0] = vsapi->getStride(src, 0);
+    pic.data[0] = (uint8_t *)vsapi->getReadPtr(src, 0);
+    pic.ref = NULL;
+
+    CambiPoolEntry *e = acquireState(d, width, height); // cambiGetFrame might be called concurrently
+    if (!e) {
+        vsapi->setFilterError("Cambi: failed to allocate state", frameCtx);
+        return 0;
+    }
+    // The c-scores are written straight into the output frames, at the working
+    // size (which is halved for frames wider than 4096).
+    CambiScales scales;
+    if (withScores) {
+        VSVideoFormat grays;
+        vsapi->getVideoFormatByID(&grays, pfGrayS, core);
+        unsigned int w = e->s.pics[0].w[0], h = e->s.pics[0].h[0];
+        for (int i = 0; i < NUM_SCALES; i++) {
+            VSFrame *f = vsapi->newVideoFrame(&grays, w, h, src, core);
+            filterStatsBytes(d->perf, filterStatsFrameSize(f, vsapi));
+            scales.data[i] = (float *)vsapi->getWritePtr(f, 0);
+            scales.stride[i] = vsapi->getStride(f, 0) / sizeof(float);
+            r->scales[i] = f;
+            scale_dimension(&w, 1);
+            scale_dimension(&h, 1);
+        }
+        scales.scaling = d->scaling;
+    }
+    int err = cambi_extract(&e->s, &pic, &r->score, withScores ? &scales : NULL);
+    releaseState(d, e);
+    if (err) {
+        vsapi->setFilterError("Cambi: failed to compute the c-values on the GPU", frameCtx);
+        return 0;
+    }
+    return 1;
+}
+
+// Finds or creates the source cache shared with other instances of the same
+// settings. Returns NULL on allocation failure.
+static CambiSourceCache *acquireSourceCache(const CambiData *d, uint16_t window_size) {
+    cambiLock(&sourceCachesLock);
+    CambiSourceCache *c = sourceCaches;
+    while (c && (c->node != d->ref || c->window_size != window_size || c->topk != d->s.topk ||
+                 c->tvi_threshold != d->s.tvi_threshold || c->numTiles != d->numTiles ||
+                 memcmp(c->tiles, d->tiles, d->numTiles * sizeof(CambiTile))))
+        c = c->nextCache;
+    if (!c && (c = calloc(1, sizeof *c))) {
+        c->node = d->ref;
+        c->window_size = window_size;
+        c->topk = d->s.topk;
+        c->tvi_threshold = d->s.tvi_threshold;
+        c->numTiles = d->numTiles;
+        memcpy(c->tiles, d->tiles, d->numTiles * sizeof(CambiTile));
+        cambiLockInit(&c->lock);
+        for (int i = 0; i < CAMBI_SOURCE_RESULTS; i++)
+            c->frames[i] = -1;
+        c->nextCache = sourceCaches;
+        sourceCaches = c;
+    }
+    if (c)
+        c->users++;
+    cambiUnlock(&sourceCachesLock);
+    return c;
+}
+
+static void releaseSourceCache(CambiSourceCache *c) {
+    cambiLock(&sourceCachesLock);
+    if (--c->users == 0) {
+        CambiSourceCache **link = &sourceCaches;
+        while (*link != c)
+            link = &(*link)->nextCache;
+        *link = c->nextCache;
+        cambiLockDestroy(&c->lock);
+        free(c);
+    }
+    cambiUnlock(&sourceCachesLock);
+}
+
+// Returns the score of frame n of the ref clip, measured by whichever instance
+// sharing the cache asked for it first. Concurrent first requests may both
+// measure it, with identical results.
+static int sourceScore(CambiData *d, int n, const VSFrame *src, double *score, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    CambiSourceCache *c = d->sourceCache;
+    int found = 0;
+    cambiLock(&c->lock);
+    for (int i = 0; i < CAMBI_SOURCE_RESULTS && !found; i++) {
+        if (c->frames[i] == n) {
+            *score = c->scores[i];
+            found = 1;
+        }
+    }
+    cambiUnlock(&c->lock);
+    if (found) {
+        filterStatsCacheHits(d->perf, 1);
+        return 1;
+    }
+
+    CambiResult r = {0};
+    if (!measure(d, src, d->refBpc, 0, &r, frameCtx, core, vsapi))
+        return 0;
+    *score = r.score;
+
+    cambiLock(&c->lock);
+    c->frames[c->next] = n;
+    c->scores[c->next] = r.score;
+    c->next = (c->next + 1) % CAMBI_SOURCE_RESULTS;
+    cambiUnlock(&c->lock);
+    return 1;
+}
+
+static const VSFrame *VS_CC cambiServe(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    CambiData *d = (CambiData *) instanceData;
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+        if (d->ref)
+            vsapi->requestFrameFilter(n, d->ref, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrame *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+
+        double source = 0;
+        if (d->ref) {
+            const VSFrame *ref = vsapi->getFrameFilter(n, d->ref, frameCtx);
+            int ok = sourceScore(d, n, ref, &source, frameCtx, core, vsapi);
+            vsapi->freeFrame(ref);
+            if (!ok) {
+                vsapi->freeFrame(src);
+                return NULL;
             }
         }
-        err = cambi_extract(&s, &pic, &score, d->scores ? c_values : NULL);
-        cambi_close(&s);
 
+        // With temporal=1, a frame whose luma is identical to a recently measured
+        // one takes its results. Matching by content keeps this exact for any
+        // request order.
+        CambiResult r = {0};
+        int cached = d->temporal && findResult(d, src, &r, vsapi);
+        if (cached)
+            filterStatsCacheHits(d->perf, 1);
+        if (!cached && !measure(d, src, d->bpc, d->scores, &r, frameCtx, core, vsapi)) {
+            freeResult(&r, vsapi);
+            vsapi->freeFrame(src);
+            return NULL;
+        }
+
+        // The output only carries properties, so it references the planes of
+        // src rather than going through copyFrame.
+        const VSFrame *planeSrc[3] = { src, src, src };
+        const int planes[3] = { 0, 1, 2 };
+        VSFrame *dst = vsapi->newVideoFrame2(vsapi->getVideoFrameFormat(src), vsapi->getFrameWidth(src, 0), vsapi->getFrameHeight(src, 0), planeSrc, planes, src, core);
         VSMap *prop = vsapi->getFramePropertiesRW(dst);
         if (d->scores) {
-            VSVideoFormat grays;
-            vsapi->getVideoFormatByID(&grays, pfGrayS, core);
-            unsigned int w = width, h = height;
             for (int i = 0; i < NUM_SCALES; i++) {
-                VSFrame *f = vsapi->newVideoFrame(&grays, w, h, src, core);
-                float *dst = (float *)vsapi->getWritePtr(f, 0);
-                float *src = c_values[i];
-                uintptr_t stride = vsapi->getStride(f, 0) / sizeof *dst;
-                for (int y = 0; y < h; y++) {
-                        for (int x = 0; x < w; x++)
-                                dst[x] = src[x] * d->scaling;
-                        src += w;
-                        dst += stride;
-                }
-                free(c_values[i]);
-                scale_dimension(&w, 1);
-                scale_dimension(&h, 1);
                 char name[16];
                 sprintf(name, "CAMBI_SCALE%d", i);
-                vsapi->mapSetFrame(prop, name, f, maReplace);
-                vsapi->freeFrame(f);
+                vsapi->mapSetFrame(prop, name, r.scales[i], maReplace);
             }
         }
-        vsapi->freeFrame(src);
+        int err = vsapi->mapSetFloat(prop, "CAMBI", r.score, maReplace);
         assert(err == 0);
+        if (d->numTiles) {
+            err = vsapi->mapSetFloatArray(prop, "CAMBI_TILES", r.tiles, d->numTiles);
+            assert(err == 0);
+        }
+        if (d->ref) {
+            vsapi->mapSetFloat(prop, "CAMBI_SOURCE", source, maReplace);
+            vsapi->mapSetFloat(prop, "CAMBI_FULL_REFERENCE", r.score > source ? r.score - source : 0.0, maReplace);
+        }
 
-        err = vsapi->mapSetFloat(prop, "CAMBI", score, maReplace);
-        assert(err == 0);
+        if (d->temporal && !cached) {
+            r.src = src;
+            storeResult(d, &r, vsapi);
+        } else {
+            freeResult(&r, vsapi);
+            vsapi->freeFrame(src);
+        }
 
         return dst;
     }
@@ -92,24 +437,114 @@ static const VSFrame *VS_CC cambiGetFrame(int n, int activationReason, void *ins
     return NULL;
 }
 
+// cambiServe, recording its calls in d->perf. Like timedGetFrame, it frees
+// what the call allocates from the scratch arena once it returns.
+static const VSFrame *VS_CC cambiGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    ScratchMark scratch = scratchMark();
+    int64_t start = filterStatsNow();
+    const VSFrame *f = cambiServe(n, activationReason, instanceData, frameData, frameCtx, core, vsapi);
+    filterStatsFrame(((CambiData *)instanceData)->perf, start, f != NULL);
+    scratchRelease(scratch);
+    return f;
+}
+
 static void VS_CC cambiFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     CambiData *d = (CambiData *)instanceData;
+    filterStatsFree(d->perf);
     vsapi->freeNode(d->node);
+    if (d->ref) {
+        releaseSourceCache(d->sourceCache);
+        vsapi->freeNode(d->ref);
+    }
+    while (d->pool) {
+        CambiPoolEntry *e = d->pool;
+        d->pool = e->next;
+        freeEntry(e);
+    }
+    for (int i = 0; i < CAMBI_RESULTS; i++)
+        freeResult(&d->results[i], vsapi);
+    cambiLockDestroy(&d->lock);
     cambi_close(&d->s);
+#ifdef HAVE_CUDA
+    if (d->cuda)
+        cambiCudaFree(d->cuda);
+#endif
     free(d);
 }
 
+// Fills d->tiles from the roi or grid argument. Returns 0 with an error set on
+// invalid arguments.
+static int parseTiles(CambiData *d, const VSMap *in, VSMap *out, const VSAPI *vsapi) {
+    const int numRoi = vsapi->mapNumElements(in, "roi");
+    const int numGrid = vsapi->mapNumElements(in, "grid");
+    if (numRoi > 0 && numGrid > 0) {
+        vsapi->mapSetError(out, "Cambi: roi and grid are mutually exclusive");
+        return 0;
+    }
+
+    if (numRoi > 0) {
+        const int64_t *roi = vsapi->mapGetIntArray(in, "roi", NULL);
+        if (numRoi % 4 != 0 || numRoi / 4 > CAMBI_MAX_TILES) {
+            vsapi->mapSetError(out, "Cambi: roi must be a list of at most 256 [x, y, width, height] rectangles");
+            return 0;
+        }
+        for (int i = 0; i < numRoi / 4; i++) {
+            const int64_t *r = roi + 4 * i;
+            if (r[0] < 0 || r[1] < 0 || r[2] < CAMBI_MIN_TILE || r[3] < CAMBI_MIN_TILE ||
+                r[0] + r[2] > d->vi.width || r[1] + r[3] > d->vi.height) {
+                char errmsg[256];
+                snprintf(errmsg, sizeof errmsg, "Cambi: roi rectangle %d must be at least %dx%d and lie within the frame", i, CAMBI_MIN_TILE, CAMBI_MIN_TILE);
+                vsapi->mapSetError(out, errmsg);
+                return 0;
+            }
+            d->tiles[i] = (CambiTile){ (int)r[0], (int)r[1], (int)r[2], (int)r[3] };
+        }
+        d->numTiles = numRoi / 4;
+    } else if (numGrid > 0) {
+        const int64_t *g = vsapi->mapGetIntArray(in, "grid", NULL);
+        if (numGrid != 4 || g[0] < 1 || g[1] < 1 || g[0] * g[1] > CAMBI_MAX_TILES) {
+            vsapi->mapSetError(out, "Cambi: grid must be [columns, rows, tile_width, tile_height] with at most 256 tiles");
+            return 0;
+        }
+        if (g[2] < CAMBI_MIN_TILE || g[3] < CAMBI_MIN_TILE || g[2] > d->vi.width || g[3] > d->vi.height) {
+            char errmsg[256];
+            snprintf(errmsg, sizeof errmsg, "Cambi: grid tiles must be at least %dx%d and fit within the frame", CAMBI_MIN_TILE, CAMBI_MIN_TILE);
+            vsapi->mapSetError(out, errmsg);
+            return 0;
+        }
+        // Tiles are spread evenly, the outer ones touching the frame edges.
+        const int cols = (int)g[0], rows = (int)g[1], tw = (int)g[2], th = (int)g[3];
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                CambiTile *t = &d->tiles[i * cols + j];
+                t->x = cols > 1 ? (int)((int64_t)(d->vi.width - tw) * j / (cols - 1)) : (d->vi.width - tw) / 2;
+                t->y = rows > 1 ? (int)((int64_t)(d->vi.height - th) * i / (rows - 1)) : (d->vi.height - th) / 2;
+                t->width = tw;
+                t->height = th;
+            }
+        }
+        d->numTiles = cols * rows;
+    }
+
+    if (d->numTiles && d->scores) {
+        vsapi->mapSetError(out, "Cambi: scores is not supported with roi or grid");
+        return 0;
+    }
+    return 1;
+}
+
 // This function is responsible for validating arguments and creating a new filter
 static void VS_CC cambiCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     CambiData d;
+    int err;
 
     d.node = vsapi->mapGetNode(in, "clip", 0, 0);
     d.vi = *vsapi->getVideoInfo(d.node);
 
     if (!vsh_isConstantVideoFormat(&d.vi) || d.vi.format.sampleType != stInteger ||
         (d.vi.format.colorFamily != cfGray && d.vi.format.colorFamily != cfYUV) ||
-        (d.vi.format.bitsPerSample != 8 && d.vi.format.bitsPerSample != 10)) {
-        vsapi->mapSetError(out, "Cambi: only constant Gray/YUV format with 8/10bit integer samples supported");
+        d.vi.format.bitsPerSample < 8 || d.vi.format.bitsPerSample > 16) {
+        vsapi->mapSetError(out, "Cambi: only constant Gray/YUV format with 8-16bit integer samples supported");
         vsapi->freeNode(d.node);
         return;
     }
@@ -133,31 +568,125 @@ static void VS_CC cambiCreate(const VSMap *in, VSMap *out, void *userData, VSCor
     GETARG(int, d.s, window_size, mapGetInt, 15, 127);
     GETARG(double, d.s, topk, mapGetFloat, 0.0001, 1);
     GETARG(double, d.s, tvi_threshold, mapGetFloat, 0.0001, 1);
+    GETARG(int, d.s, threads, mapGetInt, 1, CAMBI_MAX_THREADS);
+    d.s.parallel_for = workPoolRun;
+    d.s.scratch = scratchAlloc;
+    if (d.s.threads > 1)
+        workPoolReserve(core, vsapi);
     d.scores = 0;
     GETARG(int, d, scores, mapGetInt, 0, 1);
     d.scaling = 1.0f / d.s.window_size;
     GETARG(int, d, scaling, mapGetFloat, 0, 1);
+    d.temporal = 0;
+    GETARG(int, d, temporal, mapGetInt, 0, 1);
 #undef GETARG
 
-    int err = cambi_init(&d.s, d.vi.width, d.vi.height);
+    const char *backend = vsapi->mapGetData(in, "backend", 0, &err);
+    const int cuda = !err && !strcmp(backend, "cuda");
+    if (!err && !cuda && strcmp(backend, "cpu")) {
+        vsapi->mapSetError(out, "Cambi: backend must be \"cpu\" or \"cuda\"");
+        vsapi->freeNode(d.node);
+        return;
+    }
+#ifndef HAVE_CUDA
+    if (cuda) {
+        vsapi->mapSetError(out, "Cambi: the cuda backend is not available in this build");
+        vsapi->freeNode(d.node);
+        return;
+    }
+#endif
+    int device = vsapi->mapGetIntSaturated(in, "device_id", 0, &err);
+    if (err) device = 0;
+    int numStreams = vsapi->mapGetIntSaturated(in, "num_streams", 0, &err);
+    if (err) numStreams = 2;
+    if (numStreams < 1) {
+        vsapi->mapSetError(out, "Cambi: num_streams must be at least 1");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.numTiles = 0;
+    if (!parseTiles(&d, in, out, vsapi)) {
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.ref = vsapi->mapGetNode(in, "ref", 0, &err);
+    d.refBpc = d.bpc;
+    d.sourceCache = NULL;
+    if (d.ref) {
+        const VSVideoInfo *rvi = vsapi->getVideoInfo(d.ref);
+        if (!vsh_isConstantVideoFormat(rvi) || rvi->format.sampleType != stInteger ||
+            (rvi->format.colorFamily != cfGray && rvi->format.colorFamily != cfYUV) ||
+            rvi->format.bitsPerSample < 8 || rvi->format.bitsPerSample > 16 ||
+            rvi->width != d.vi.width || rvi->height != d.vi.height || rvi->numFrames != d.vi.numFrames) {
+            vsapi->mapSetError(out, "Cambi: ref must be a constant Gray/YUV clip with 8-16bit integer samples and the same dimensions and length as clip");
+            vsapi->freeNode(d.ref);
+            vsapi->freeNode(d.node);
+            return;
+        }
+        d.refBpc = rvi->format.bitsPerSample;
+        d.sourceCache = acquireSourceCache(&d, d.s.window_size);
+        if (!d.sourceCache) {
+            vsapi->mapSetError(out, "Cambi: failed to allocate source cache");
+            vsapi->freeNode(d.ref);
+            vsapi->freeNode(d.node);
+            return;
+        }
+    }
+
+    err = cambi_init(&d.s, d.vi.width, d.vi.height);
     if (err != 0) {
         vsapi->mapSetError(out, "cambi_init failure");
+        if (d.ref) {
+            releaseSourceCache(d.sourceCache);
+            vsapi->freeNode(d.ref);
+        }
         vsapi->freeNode(d.node);
         return;
     }
 
     CambiData *data = malloc(sizeof(d));
     *data = d;
+    cambiLockInit(&data->lock);
+    data->pool = NULL;
+    memset(data->results, 0, sizeof data->results);
+    data->nextResult = 0;
+    data->perf = filterStatsCreate("Cambi");
+    data->cuda = NULL;
+#ifdef HAVE_CUDA
+    if (cuda) {
+        // The kernel is compiled by the driver, so check it on this GPU once.
+        char errmsg[512];
+        data->cuda = cambiCudaCreate(device, numStreams, d.s.pics[0].w[0], d.s.pics[0].h[0], data->perf, errmsg, sizeof errmsg);
+        if (data->cuda) {
+            data->s.c_values_fn = cambiCudaCValues;
+            data->s.c_values_ctx = data->cuda;
+            if (cambi_verify_c_values(&data->s)) {
+                snprintf(errmsg, sizeof errmsg, "Cambi: the c-values of the cuda backend differ from the CPU");
+                cambiCudaFree(data->cuda);
+                data->cuda = NULL;
+            }
+        }
+        if (!data->cuda) {
+            vsapi->mapSetError(out, errmsg);
+            cambiFree(data, core, vsapi);
+            return;
+        }
+    }
+#else
+    (void)device;
+#endif
 
-    VSFilterDependency deps[] = {{d.node, rpStrictSpatial}};
+    VSFilterDependency deps[] = {{d.node, rpStrictSpatial}, {d.ref, rpStrictSpatial}};
 
-    vsapi->createVideoFilter(out, "Cambi", &d.vi, cambiGetFrame, cambiFree, fmParallel, deps, 1, data, core);
+    vsapi->createVideoFilter(out, "Cambi", &d.vi, cambiGetFrame, cambiFree, fmParallel, deps, d.ref ? 2 : 1, data, core);
 }
 
 void bandingInitialize(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
     vsapi->registerFunction(
         "Cambi",
-        "clip:vnode;window_size:int:opt;topk:float:opt;tvi_threshold:float:opt;scores:int:opt;scaling:float:opt;",
+        "clip:vnode;window_size:int:opt;topk:float:opt;tvi_threshold:float:opt;scores:int:opt;scaling:float:opt;threads:int:opt;temporal:int:opt;roi:int[]:opt;grid:int[]:opt;ref:vnode:opt;backend:data:opt;device_id:int:opt;num_streams:int:opt;",
         "clip:vnode",
         cambiCreate,
         0,
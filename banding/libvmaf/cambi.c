@@ -19,8 +19,25 @@
 #include <errno.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CAMBI_X86 1
+#define CAMBI_AVX2 __attribute__((target("avx2")))
+#define CAMBI_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CAMBI_ARM 1
+#endif
+
 #include "common/macros.h"
 #include "feature_collector.h"
 #include "feature_extractor.h"
@@ -44,6 +61,12 @@
 #define CAMBI_4K_WIDTH (3840)
 #define CAMBI_4K_HEIGHT (2160)
 
+/* Minimum width of a column strip of the c-value pass */
+#define CAMBI_MIN_STRIP_WIDTH (128)
+
+/* Radix buckets of each spatial pooling pass, one per 16 bits of a c-value */
+#define POOLING_BUCKETS (1 << 16)
+
 #define NUM_ALL_DIFFS (2 * NUM_DIFFS + 1)
 static const int g_all_diffs[NUM_ALL_DIFFS] = {-4, -3, -2, -1, 0, 1, 2, 3, 4};
 static const uint16_t g_c_value_histogram_offset = 4; // = -g_all_diffs[0]
@@ -51,12 +74,6 @@ static const uint16_t g_c_value_histogram_offset = 4; // = -g_all_diffs[0]
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define CLAMP(x, low, high) (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
-#define SWAP_FLOATS(x, y) \
-    {                     \
-        float temp = x;   \
-        x = y;            \
-        y = temp;         \
-    }
 #define SWAP_PICS(x, y)      \
     {                        \
         uint16_t *temp = x;  \
@@ -66,6 +83,57 @@ static const uint16_t g_c_value_histogram_offset = 4; // = -g_all_diffs[0]
 
 #define MASK_FILTER_SIZE 7
 
+// A strip of the c-value pass covers columns [x0, x1) and owns (x1 - x0)
+// histograms. Pixels up to pad_size columns outside the strip still feed its
+// histograms, so strips are independent and give the same result as one pass.
+typedef struct CValuesStrip {
+    uint16_t *image;
+    uint16_t *mask;
+    float *c_values;
+    ptrdiff_t c_values_stride;
+    uint16_t *histograms;
+    const uint16_t *tvi_for_diff;
+    ptrdiff_t stride;
+    int width, height;
+    int x0, x1;
+    uint16_t pad_size;
+    const struct CambiKernels *kernels;
+} CValuesStrip;
+
+/* Instruction sets with dedicated kernels */
+enum CambiIsa {
+    CAMBI_ISA_C,
+    CAMBI_ISA_NEON,
+    CAMBI_ISA_AVX2,
+    CAMBI_ISA_AVX512,
+};
+
+// Row kernels of the banding detection, selected at runtime by cambi_kernels().
+typedef struct CambiKernels {
+    void (*decimate_row)(uint16_t *dst, const uint16_t *src, unsigned width);
+    void (*mode_row)(uint16_t *dst, const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                     int width, uint8_t *hist);
+    void (*derivative_row)(uint16_t *dst, const uint16_t *row, const uint16_t *below, int width);
+    void (*mask_row)(uint16_t *dst, const uint32_t *top, const uint32_t *bottom, int width, int span,
+                     uint16_t mask_index);
+    void (*c_values_strip)(const CValuesStrip *s);
+} CambiKernels;
+
+static const CambiKernels *cambi_kernels(int isa);
+
+static int cambi_cpu_isa(void) {
+#if CAMBI_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw"))
+        return CAMBI_ISA_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return CAMBI_ISA_AVX2;
+#elif CAMBI_ARM
+    return CAMBI_ISA_NEON;
+#endif
+    return CAMBI_ISA_C;
+}
+
 static const VmafOption options[] = {
     {
         .name = "enc_width",
@@ -228,6 +296,7 @@ void cambi_config(CambiState *s)
     s->window_size = DEFAULT_CAMBI_WINDOW_SIZE;
     s->topk = DEFAULT_CAMBI_TOPK_POOLING;
     s->tvi_threshold = DEFAULT_CAMBI_TVI;
+    s->threads = 1;
 }
 
 int cambi_init(CambiState *s, unsigned w, unsigned h)
@@ -240,7 +309,13 @@ int cambi_init(CambiState *s, unsigned w, unsigned h)
     w = s->enc_width;
     h = s->enc_height;
 
-    if (w < CAMBI_MIN_WIDTH || w > CAMBI_MAX_WIDTH)
+    // Wider frames are halved until supported; cambi_preprocessing decimates
+    // to this size in the same pass as the depth conversion.
+    while (w > CAMBI_MAX_WIDTH) {
+        scale_dimension(&w, 1);
+        scale_dimension(&h, 1);
+    }
+    if ((s->ref_width ? s->ref_width : w) < CAMBI_MIN_WIDTH)
         return -EINVAL;
     int err = 0;
     for (unsigned i = 0; i < PICS_BUFFER_SIZE; i++)
@@ -253,7 +328,7 @@ int cambi_init(CambiState *s, unsigned w, unsigned h)
         s->tvi_for_diff[d] += g_c_value_histogram_offset;
     }
 
-    adjust_window_size(&s->window_size, w);
+    adjust_window_size(&s->window_size, s->ref_width ? s->ref_width : w);
     s->c_values = aligned_malloc(ALIGN_CEIL(w * sizeof(float)) * h, 32);
 
     const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
@@ -264,6 +339,10 @@ int cambi_init(CambiState *s, unsigned w, unsigned h)
     int dp_height = 2 * pad_size + 2;
     s->mask_dp = aligned_malloc(ALIGN_CEIL(dp_height * dp_width * sizeof(uint32_t)), 32);
 
+    s->pooling_histogram = aligned_malloc(2 * POOLING_BUCKETS * sizeof(uint32_t), 32);
+    if (s->pooling_histogram)
+        memset(s->pooling_histogram, 0, 2 * POOLING_BUCKETS * sizeof(uint32_t));
+
     return err;
 }
 
@@ -350,6 +429,52 @@ static void decimate_generic_8b_and_convert_to_10b(const VmafPicture *pic, VmafP
     }
 }
 
+// Requantizes a sample of any other integer depth to 10 bits, rounding to nearest.
+static FORCE_INLINE inline uint16_t convert_to_10b(uint16_t value, unsigned bpc) {
+    if (bpc < 10)
+        return value << (10 - bpc);
+    unsigned shift = bpc - 10;
+    return MIN((value + (1u << shift >> 1)) >> shift, 1023u);
+}
+
+static void decimate_generic_and_convert_to_10b(const VmafPicture *pic, VmafPicture *out_pic) {
+    uint16_t *data = pic->data[0];
+    uint16_t *out_data = out_pic->data[0];
+    ptrdiff_t stride = pic->stride[0] >> 1;
+    ptrdiff_t out_stride = out_pic->stride[0] >> 1;
+    unsigned bpc = pic->bpc;
+    unsigned in_w = pic->w[0];
+    unsigned in_h = pic->h[0];
+    unsigned out_w = out_pic->w[0];
+    unsigned out_h = out_pic->h[0];
+
+    // if the input and output sizes are the same
+    if (in_w == out_w && in_h == out_h) {
+        for (unsigned i = 0; i < out_h; i++)
+            for (unsigned j = 0; j < out_w; j++)
+                out_data[i * out_stride + j] = convert_to_10b(data[i * stride + j], bpc);
+        return;
+    }
+
+    float ratio_x = (float)in_w / out_w;
+    float ratio_y = (float)in_h / out_h;
+
+    float start_x = ratio_x / 2 - 0.5;
+    float start_y = ratio_y / 2 - 0.5;
+
+    float y = start_y;
+    for (unsigned i = 0; i < out_h; i++) {
+        unsigned ori_y = (int)(y + 0.5);
+        float x = start_x;
+        for (unsigned j = 0; j < out_w; j++) {
+            unsigned ori_x = (int)(x + 0.5);
+            out_data[i * out_stride + j] = convert_to_10b(data[ori_y * stride + ori_x], bpc);
+            x += ratio_x;
+        }
+        y += ratio_y;
+    }
+}
+
 static void anti_dithering_filter(VmafPicture *pic) {
     uint16_t *data = pic->data[0];
     int stride = pic->stride[0] >> 1;
@@ -381,21 +506,56 @@ int cambi_preprocessing(const VmafPicture *image, VmafPicture *preprocessed) {
         decimate_generic_8b_and_convert_to_10b(image, preprocessed);
         anti_dithering_filter(preprocessed);
     }
-    else {
+    else if (image->bpc == 10) {
         decimate_generic_10b(image, preprocessed);
     }
+    else {
+        decimate_generic_and_convert_to_10b(image, preprocessed);
+    }
 
     return 0;
 }
 
 /* Banding detection functions */
+// Decimation runs in place: row i is built from row 2i, and each vector is
+// loaded before the (lower) output columns it overwrites are stored.
+static FORCE_INLINE inline void decimate_row_c(uint16_t *dst, const uint16_t *src, unsigned width) {
+    for (unsigned j = 0; j < width; j++) {
+        dst[j] = src[j << 1];
+    }
+}
+
+#if CAMBI_X86
+CAMBI_AVX2 static void decimate_row_avx2(uint16_t *dst, const uint16_t *src, unsigned width) {
+    const __m256i low = _mm256_set1_epi32(0xffff);
+    unsigned j = 0;
+    for (; j + 16 <= width; j += 16) {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 2 * j)), low);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + 2 * j + 16)), low);
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *)(dst + j), r);
+    }
+    decimate_row_c(dst + j, src + 2 * j, width - j);
+}
+#endif
+
+#if CAMBI_ARM
+static void decimate_row_neon(uint16_t *dst, const uint16_t *src, unsigned width) {
+    unsigned j = 0;
+    for (; j + 8 <= width; j += 8) {
+        uint16x8x2_t v = vld2q_u16(src + 2 * j);
+        vst1q_u16(dst + j, v.val[0]);
+    }
+    decimate_row_c(dst + j, src + 2 * j, width - j);
+}
+#endif
+
 static void decimate(VmafPicture *image, unsigned width, unsigned height) {
+    const CambiKernels *k = cambi_kernels(cambi_cpu_isa());
     uint16_t *data = image->data[0];
     ptrdiff_t stride = image->stride[0] >> 1;
     for (unsigned i = 0; i < height; i++) {
-        for (unsigned j = 0; j < width; j++) {
-            data[i * stride + j] = data[(i << 1) * stride + (j << 1)];
-        }
+        k->decimate_row(data + i * stride, data + (i << 1) * stride, width);
     }
 }
 
@@ -422,25 +582,136 @@ static FORCE_INLINE inline uint16_t mode_selection(uint16_t *elems, uint8_t *his
     return max_mode;
 }
 
-static void filter_mode(const VmafPicture *image, int width, int height) {
+static FORCE_INLINE inline uint16_t mode_pixel(const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                                               int j, int width, uint8_t *hist) {
+    const uint16_t *rows[3] = {above, row, below};
+    uint16_t curr[9];
+    // Get the 9 elements into an array for cache optimization
+    for (int r = 0; r < 3; r++) {
+        for (int col = 0; col < 3; col++) {
+            int clamped_col = CLAMP(j + col - 1, 0, width - 1);
+            curr[3 * r + col] = rows[r][clamped_col];
+        }
+    }
+    return mode_selection(curr, hist);
+}
+
+static void mode_row_c(uint16_t *dst, const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                       int width, uint8_t *hist) {
+    for (int j = 0; j < width; j++) {
+        dst[j] = mode_pixel(above, row, below, j, width, hist);
+    }
+}
+
+/*
+* The vector mode filters count, for each of the 9 elements, how many elements are equal to it,
+* and select the element with the highest count, preferring the lowest value on ties.
+* This is exactly what mode_selection() computes (a value seen 5 times always has the highest count).
+* The first and last columns need clamping and are done by mode_pixel().
+*/
+#if CAMBI_X86
+CAMBI_AVX2 static void mode_row_avx2(uint16_t *dst, const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                                     int width, uint8_t *hist) {
+    const uint16_t *rows[3] = {above, row, below};
+    int j = 0;
+    if (width > 0) {
+        dst[0] = mode_pixel(above, row, below, 0, width, hist);
+        j = 1;
+    }
+    for (; j + 17 <= width; j += 16) {
+        __m256i e[9], count[9];
+        for (int r = 0; r < 3; r++) {
+            for (int col = 0; col < 3; col++) {
+                e[3 * r + col] = _mm256_loadu_si256((const __m256i *)(rows[r] + j + col - 1));
+                count[3 * r + col] = _mm256_set1_epi16(1);
+            }
+        }
+        for (int a = 0; a < 9; a++) {
+            for (int b = a + 1; b < 9; b++) {
+                __m256i eq = _mm256_cmpeq_epi16(e[a], e[b]);
+                count[a] = _mm256_sub_epi16(count[a], eq);
+                count[b] = _mm256_sub_epi16(count[b], eq);
+            }
+        }
+        __m256i mode = e[0], max_count = count[0];
+        for (int a = 1; a < 9; a++) {
+            __m256i better = _mm256_or_si256(
+                _mm256_cmpgt_epi16(count[a], max_count),
+                _mm256_and_si256(_mm256_cmpeq_epi16(count[a], max_count), _mm256_cmpgt_epi16(mode, e[a])));
+            mode = _mm256_blendv_epi8(mode, e[a], better);
+            max_count = _mm256_blendv_epi8(max_count, count[a], better);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + j), mode);
+    }
+    for (; j < width; j++) {
+        dst[j] = mode_pixel(above, row, below, j, width, hist);
+    }
+}
+#endif
+
+#if CAMBI_ARM
+static void mode_row_neon(uint16_t *dst, const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                          int width, uint8_t *hist) {
+    const uint16_t *rows[3] = {above, row, below};
+    int j = 0;
+    if (width > 0) {
+        dst[0] = mode_pixel(above, row, below, 0, width, hist);
+        j = 1;
+    }
+    for (; j + 9 <= width; j += 8) {
+        uint16x8_t e[9], count[9];
+        for (int r = 0; r < 3; r++) {
+            for (int col = 0; col < 3; col++) {
+                e[3 * r + col] = vld1q_u16(rows[r] + j + col - 1);
+                count[3 * r + col] = vdupq_n_u16(1);
+            }
+        }
+        for (int a = 0; a < 9; a++) {
+            for (int b = a + 1; b < 9; b++) {
+                uint16x8_t eq = vceqq_u16(e[a], e[b]);
+                count[a] = vsubq_u16(count[a], eq);
+                count[b] = vsubq_u16(count[b], eq);
+            }
+        }
+        uint16x8_t mode = e[0], max_count = count[0];
+        for (int a = 1; a < 9; a++) {
+            uint16x8_t better = vorrq_u16(
+                vcgtq_u16(count[a], max_count),
+                vandq_u16(vceqq_u16(count[a], max_count), vcltq_u16(e[a], mode)));
+            mode = vbslq_u16(better, e[a], mode);
+            max_count = vbslq_u16(better, count[a], max_count);
+        }
+        vst1q_u16(dst + j, mode);
+    }
+    for (; j < width; j++) {
+        dst[j] = mode_pixel(above, row, below, j, width, hist);
+    }
+}
+#endif
+
+// A per-frame buffer from scratch if set, or the heap.
+static void *scratch_alloc(CambiScratchFn scratch, size_t size) {
+    return scratch ? scratch(size) : malloc(size);
+}
+
+static void scratch_free(CambiScratchFn scratch, void *p) {
+    if (!scratch)
+        free(p);
+}
+
+static void filter_mode_with(const VmafPicture *image, int width, int height, CambiScratchFn scratch) {
+    const CambiKernels *k = cambi_kernels(cambi_cpu_isa());
     uint16_t *data = image->data[0];
     ptrdiff_t stride = image->stride[0] >> 1;
-    uint16_t curr[9];
-    uint8_t *hist = malloc(1024 * sizeof(uint8_t));
-    uint16_t *buffer = malloc(3 * width * sizeof(uint16_t));
+    uint8_t *hist = scratch_alloc(scratch, 1024 * sizeof(uint8_t));
+    uint16_t *buffer = scratch_alloc(scratch, 3 * width * sizeof(uint16_t));
     for (int i = 0; i < height + 2; i++) {
         if (i < height) {
-            for (int j = 0; j < width; j++) {
-                // Get the 9 elements into an array for cache optimization
-                for (int row = 0; row < 3; row++) {
-                    for (int col = 0; col < 3; col++) {
-                        int clamped_row = CLAMP(i + row - 1, 0, height - 1);
-                        int clamped_col = CLAMP(j + col - 1, 0, width - 1);
-                        curr[3 * row + col] = data[clamped_row * stride + clamped_col];
-                    }
-                }
-                buffer[(i % 3) * width + j] = mode_selection(curr, hist);
-            }
+            k->mode_row(buffer + (i % 3) * width,
+                        data + CLAMP(i - 1, 0, height - 1) * stride,
+                        data + i * stride,
+                        data + CLAMP(i + 1, 0, height - 1) * stride,
+                        width, hist);
         }
         if (i >= 2) {
             uint16_t *dest = data + (i - 2) * stride;
@@ -449,8 +720,12 @@ static void filter_mode(const VmafPicture *image, int width, int height) {
         }
     }
 
-    free(hist);
-    free(buffer);
+    scratch_free(scratch, hist);
+    scratch_free(scratch, buffer);
+}
+
+static void filter_mode(const VmafPicture *image, int width, int height) {
+    filter_mode_with(image, width, height, NULL);
 }
 
 static FORCE_INLINE inline uint16_t get_mask_index(unsigned input_width, unsigned input_height,
@@ -461,9 +736,93 @@ static FORCE_INLINE inline uint16_t get_mask_index(unsigned input_width, unsigne
     return (uint16_t)(floor(pow(filter_size, 2) / 2) - slope * (resolution_ratio - 1));
 }
 
-static FORCE_INLINE inline bool get_derivative_data(const uint16_t *data, int width, int height, int i, int j, ptrdiff_t stride) {
-    return (i == height - 1 || (data[i * stride + j] == data[(i + 1) * stride + j])) &&
-           (j == width - 1 || (data[i * stride + j] == data[i * stride + j + 1]));
+// A pixel has zero derivative if it equals its right and bottom neighbours.
+// For the last row, below points to the row itself.
+static FORCE_INLINE inline void derivative_row_c(uint16_t *dst, const uint16_t *row, const uint16_t *below, int width) {
+    for (int j = 0; j < width; j++) {
+        dst[j] = row[j] == below[j] && (j == width - 1 || row[j] == row[j + 1]);
+    }
+}
+
+// Square sums from the dp rows at the top and bottom of the window, thresholded by mask_index
+static FORCE_INLINE inline void mask_row_c(uint16_t *dst, const uint32_t *top, const uint32_t *bottom, int width, int span,
+                                           uint16_t mask_index) {
+    for (int j = 0; j < width; j++) {
+        int result = bottom[j + span] - bottom[j] - top[j + span] + top[j];
+        dst[j] = (result > mask_index);
+    }
+}
+
+#if CAMBI_X86
+CAMBI_AVX2 static void derivative_row_avx2(uint16_t *dst, const uint16_t *row, const uint16_t *below, int width) {
+    const __m256i one = _mm256_set1_epi16(1);
+    int j = 0;
+    for (; j + 17 <= width; j += 16) {
+        __m256i r = _mm256_loadu_si256((const __m256i *)(row + j));
+        __m256i eq = _mm256_and_si256(_mm256_cmpeq_epi16(r, _mm256_loadu_si256((const __m256i *)(below + j))),
+                                      _mm256_cmpeq_epi16(r, _mm256_loadu_si256((const __m256i *)(row + j + 1))));
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_and_si256(eq, one));
+    }
+    derivative_row_c(dst + j, row + j, below + j, width - j);
+}
+
+CAMBI_AVX2 static void mask_row_avx2(uint16_t *dst, const uint32_t *top, const uint32_t *bottom, int width, int span,
+                                     uint16_t mask_index) {
+    const __m256i threshold = _mm256_set1_epi32(mask_index);
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        __m256i m[2];
+        for (int h = 0; h < 2; h++) {
+            const int o = j + 8 * h;
+            __m256i r = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(bottom + o + span)),
+                                         _mm256_loadu_si256((const __m256i *)(bottom + o)));
+            r = _mm256_sub_epi32(r, _mm256_loadu_si256((const __m256i *)(top + o + span)));
+            r = _mm256_add_epi32(r, _mm256_loadu_si256((const __m256i *)(top + o)));
+            m[h] = _mm256_srli_epi32(_mm256_cmpgt_epi32(r, threshold), 31);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_permute4x64_epi64(_mm256_packus_epi32(m[0], m[1]), 0xD8));
+    }
+    mask_row_c(dst + j, top + j, bottom + j, width - j, span, mask_index);
+}
+#endif
+
+#if CAMBI_ARM
+static void derivative_row_neon(uint16_t *dst, const uint16_t *row, const uint16_t *below, int width) {
+    int j = 0;
+    for (; j + 9 <= width; j += 8) {
+        uint16x8_t r = vld1q_u16(row + j);
+        uint16x8_t eq = vandq_u16(vceqq_u16(r, vld1q_u16(below + j)), vceqq_u16(r, vld1q_u16(row + j + 1)));
+        vst1q_u16(dst + j, vshrq_n_u16(eq, 15));
+    }
+    derivative_row_c(dst + j, row + j, below + j, width - j);
+}
+
+static void mask_row_neon(uint16_t *dst, const uint32_t *top, const uint32_t *bottom, int width, int span,
+                          uint16_t mask_index) {
+    const int32x4_t threshold = vdupq_n_s32(mask_index);
+    int j = 0;
+    for (; j + 8 <= width; j += 8) {
+        uint16x4_t m[2];
+        for (int h = 0; h < 2; h++) {
+            const int o = j + 4 * h;
+            uint32x4_t r = vsubq_u32(vld1q_u32(bottom + o + span), vld1q_u32(bottom + o));
+            r = vsubq_u32(r, vld1q_u32(top + o + span));
+            r = vaddq_u32(r, vld1q_u32(top + o));
+            m[h] = vmovn_u32(vshrq_n_u32(vcgtq_s32(vreinterpretq_s32_u32(r), threshold), 31));
+        }
+        vst1q_u16(dst + j, vcombine_u16(m[0], m[1]));
+    }
+    mask_row_c(dst + j, top + j, bottom + j, width - j, span, mask_index);
+}
+#endif
+
+static FORCE_INLINE inline void get_derivative_row(const CambiKernels *k, uint16_t *derivative, const uint16_t *data,
+                                                   int i, int width, int height, ptrdiff_t stride) {
+    if (i < height) {
+        k->derivative_row(derivative, data + i * stride, data + MIN(i + 1, height - 1) * stride, width);
+    } else {
+        memset(derivative, 0, width * sizeof(uint16_t));
+    }
 }
 
 /*
@@ -474,9 +833,10 @@ static FORCE_INLINE inline bool get_derivative_data(const uint16_t *data, int wi
 * To calculate the square sums, it uses a dynamic programming algorithm based on inclusion-exclusion.
 * To save memory, it uses a DP matrix of only the necessary size, rather than the full matrix, and indexes its rows cyclically.
 */
-static void get_spatial_mask_for_index(const VmafPicture *image, VmafPicture *mask,
-                                       uint32_t *dp, uint16_t mask_index, uint16_t filter_size,
-                                       int width, int height) {
+static void get_spatial_mask_for_index_with(const VmafPicture *image, VmafPicture *mask,
+                                            uint32_t *dp, uint16_t mask_index, uint16_t filter_size,
+                                            int width, int height, CambiScratchFn scratch) {
+    const CambiKernels *k = cambi_kernels(cambi_cpu_isa());
     uint16_t pad_size = filter_size >> 1;
     uint16_t *image_data = image->data[0];
     uint16_t *mask_data = mask->data[0];
@@ -486,10 +846,15 @@ static void get_spatial_mask_for_index(const VmafPicture *image, VmafPicture *ma
     int dp_height = 2 * pad_size + 2;
     memset(dp, 0, dp_width * dp_height * sizeof(uint32_t));
 
+    // Zero derivatives of the current row, followed by pad_size zeros
+    uint16_t *derivative = scratch_alloc(scratch, (width + pad_size) * sizeof(uint16_t));
+    memset(derivative, 0, (width + pad_size) * sizeof(uint16_t));
+
     // Initial computation: fill dp except for the last row
     for (int i = 0; i < pad_size; i++) {
+        get_derivative_row(k, derivative, image_data, i, width, height, stride);
         for (int j = 0; j < width + pad_size; j++) {
-            int value = (i < height && j < width ? get_derivative_data(image_data, width, height, i, j, stride) : 0);
+            int value = derivative[j];
             int curr_row = i + pad_size + 1;
             int curr_col = j + pad_size + 1;
             dp[curr_row * dp_width + curr_col] =
@@ -505,8 +870,9 @@ static void get_spatial_mask_for_index(const VmafPicture *image, VmafPicture *ma
     int curr_compute = pad_size + 1;
     for (int i = pad_size; i < height + pad_size; i++) {
         // First compute the values of dp for curr_row
+        get_derivative_row(k, derivative, image_data, i, width, height, stride);
         for (int j = 0; j < width + pad_size; j++) {
-            int value = (i < height && j < width ? get_derivative_data(image_data, width, height, i, j, stride) : 0);
+            int value = derivative[j];
             int curr_col = j + pad_size + 1;
             int prev_row = (curr_row + dp_height - 1) % dp_height;
             dp[curr_row * dp_width + curr_col] =
@@ -518,29 +884,35 @@ static void get_spatial_mask_for_index(const VmafPicture *image, VmafPicture *ma
         curr_row = (curr_row + 1) % dp_height;
 
         // Then use the values to compute the square sum for the curr_compute row.
-        for (int j = 0; j < width; j++) {
-            int curr_col = j + pad_size + 1;
-            int bottom = (curr_compute + pad_size) % dp_height;
-            int top = (curr_compute + dp_height - pad_size - 1) % dp_height;
-            int right = curr_col + pad_size;
-            int left = curr_col - pad_size - 1;
-            int result =
-                dp[bottom * dp_width + right]
-                - dp[bottom * dp_width + left]
-                - dp[top * dp_width + right]
-                + dp[top * dp_width + left];
-            mask_data[(i - pad_size) * stride + j] = (result > mask_index);
-        }
+        // The window of column j spans dp columns [j, j + 2 * pad_size + 1].
+        int bottom = (curr_compute + pad_size) % dp_height;
+        int top = (curr_compute + dp_height - pad_size - 1) % dp_height;
+        k->mask_row(mask_data + (i - pad_size) * stride, dp + top * dp_width, dp + bottom * dp_width,
+                    width, 2 * pad_size + 1, mask_index);
         curr_compute = (curr_compute + 1) % dp_height;
     }
+
+    scratch_free(scratch, derivative);
 }
 
-static void get_spatial_mask(const VmafPicture *image, VmafPicture *mask,
-                             uint32_t *dp, unsigned width, unsigned height) {
-    unsigned input_width = image->w[0];
-    unsigned input_height = image->h[0];
+static void get_spatial_mask_for_index(const VmafPicture *image, VmafPicture *mask,
+                                       uint32_t *dp, uint16_t mask_index, uint16_t filter_size,
+                                       int width, int height) {
+    get_spatial_mask_for_index_with(image, mask, dp, mask_index, filter_size, width, height, NULL);
+}
+
+static void get_spatial_mask_with(const VmafPicture *image, VmafPicture *mask, uint32_t *dp,
+                                  unsigned width, unsigned height, unsigned ref_width, unsigned ref_height,
+                                  CambiScratchFn scratch) {
+    unsigned input_width = ref_width ? ref_width : image->w[0];
+    unsigned input_height = ref_height ? ref_height : image->h[0];
     uint16_t mask_index = get_mask_index(input_width, input_height, MASK_FILTER_SIZE);
-    get_spatial_mask_for_index(image, mask, dp, mask_index, MASK_FILTER_SIZE, width, height);
+    get_spatial_mask_for_index_with(image, mask, dp, mask_index, MASK_FILTER_SIZE, width, height, scratch);
+}
+
+static void get_spatial_mask(const VmafPicture *image, VmafPicture *mask, uint32_t *dp,
+                             unsigned width, unsigned height, unsigned ref_width, unsigned ref_height) {
+    get_spatial_mask_with(image, mask, dp, width, height, ref_width, ref_height, NULL);
 }
 
 static float c_value_pixel(const uint16_t *histograms, uint16_t value, const int *diff_weights,
@@ -567,138 +939,398 @@ static float c_value_pixel(const uint16_t *histograms, uint16_t value, const int
     return c_value;
 }
 
-static FORCE_INLINE inline void update_histogram_subtract(uint16_t *histograms, uint16_t *image, uint16_t *mask,
-                                                          int i, int j, int width, ptrdiff_t stride, uint16_t pad_size) {
-    uint16_t mask_val = mask[(i - pad_size - 1) * stride + j];
-    if (mask_val) {
-        uint16_t val = image[(i - pad_size - 1) * stride + j] + g_c_value_histogram_offset;
-        for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-            histograms[val * width + col]--;
-        }
+static FORCE_INLINE inline void update_range_c(uint16_t *arr, int left, int right, int delta) {
+    for (int col = left; col < right; col++) {
+        arr[col] += delta;
     }
 }
 
-static FORCE_INLINE inline void update_histogram_add(uint16_t *histograms, uint16_t *image, uint16_t *mask,
-                                                     int i, int j, int width, ptrdiff_t stride, uint16_t pad_size) {
-    uint16_t mask_val = mask[(i + pad_size) * stride + j];
-    if (mask_val) {
-        uint16_t val = image[(i + pad_size) * stride + j] + g_c_value_histogram_offset;
-        for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-            histograms[val * width + col]++;
+static FORCE_INLINE inline void calculate_c_values_row_c(const CValuesStrip *s, int row) {
+    for (int col = s->x0; col < s->x1; col++) {
+        if (s->mask[row * s->stride + col]) {
+            s->c_values[row * s->c_values_stride + col] = c_value_pixel(
+                s->histograms, s->image[row * s->stride + col] + g_c_value_histogram_offset, g_diffs_weights, g_all_diffs, NUM_DIFFS, s->tvi_for_diff, col - s->x0, s->x1 - s->x0
+            );
         }
     }
 }
 
-static FORCE_INLINE inline void calculate_c_values_row(float *c_values, uint16_t *histograms, uint16_t *image,
-                                                       uint16_t *mask, int row, int width, ptrdiff_t stride,
-                                                       const uint16_t *tvi_for_diff) {
-    for (int col = 0; col < width; col++) {
-        if (mask[row * stride + col]) {
-            c_values[row * width + col] = c_value_pixel(
-                histograms, image[row * stride + col] + g_c_value_histogram_offset, g_diffs_weights, g_all_diffs, NUM_DIFFS, tvi_for_diff, col, width
-            );
-        }
+#if CAMBI_X86
+CAMBI_AVX2 static inline void update_range_avx2(uint16_t *arr, int left, int right, int delta) {
+    const __m256i d = _mm256_set1_epi16(delta);
+    int col = left;
+    for (; col + 16 <= right; col += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(arr + col));
+        _mm256_storeu_si256((__m256i *)(arr + col), _mm256_add_epi16(v, d));
     }
+    update_range_c(arr, col, right, delta);
 }
 
-static void calculate_c_values(VmafPicture *pic, const VmafPicture *mask_pic,
-                               float *c_values, uint16_t *histograms, uint16_t window_size,
-                               const uint16_t *tvi_for_diff, int width, int height) {
-    uint16_t pad_size = window_size >> 1;
-    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+CAMBI_AVX512 static inline void update_range_avx512(uint16_t *arr, int left, int right, int delta) {
+    const __m512i d = _mm512_set1_epi16(delta);
+    int col = left;
+    for (; col + 32 <= right; col += 32) {
+        __m512i v = _mm512_loadu_si512(arr + col);
+        _mm512_storeu_si512(arr + col, _mm512_add_epi16(v, d));
+    }
+    if (col < right) {
+        __mmask32 m = _cvtu32_mask32((1u << (right - col)) - 1);
+        __m512i v = _mm512_maskz_loadu_epi16(m, arr + col);
+        _mm512_mask_storeu_epi16(arr + col, m, _mm512_add_epi16(v, d));
+    }
+}
 
-    uint16_t *image = pic->data[0];
-    uint16_t *mask = mask_pic->data[0];
-    ptrdiff_t stride = pic->stride[0] >> 1;
+// Histogram entries are gathered as 32-bit words at even offsets from the start of the
+// strip's histograms, which has an even number of entries, so no lane reads outside it.
+CAMBI_AVX2 static inline __m256i gather_histogram_avx2(const uint16_t *histograms, __m256i index) {
+    __m256i words = _mm256_i32gather_epi32((const int *)histograms, _mm256_srli_epi32(index, 1), 4);
+    __m256i shift = _mm256_slli_epi32(_mm256_and_si256(index, _mm256_set1_epi32(1)), 4);
+    return _mm256_and_si256(_mm256_srlv_epi32(words, shift), _mm256_set1_epi32(0xffff));
+}
 
-    memset(c_values, 0.0, sizeof(float) * width * height);
+// Same arithmetic as c_value_pixel(): the products and sums are exact integers,
+// so converting and dividing per lane gives identical floats.
+CAMBI_AVX2 static void calculate_c_values_row_avx2(const CValuesStrip *s, int row) {
+    const int histogram_width = s->x1 - s->x0;
+    const uint16_t *image = s->image + row * s->stride;
+    const uint16_t *mask = s->mask + row * s->stride;
+    float *c_values = s->c_values + row * s->c_values_stride;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int col = s->x0;
+    for (; col + 8 <= s->x1; col += 8) {
+        __m128i mask16 = _mm_loadu_si128((const __m128i *)(mask + col));
+        if (_mm_testz_si128(mask16, mask16))
+            continue;
+        __m256i masked = _mm256_cmpgt_epi32(_mm256_cvtepu16_epi32(mask16), zero);
+        __m256i value = _mm256_add_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(image + col))),
+                                         _mm256_set1_epi32(g_c_value_histogram_offset));
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(value, _mm256_set1_epi32(histogram_width)),
+                                         _mm256_add_epi32(_mm256_set1_epi32(col - s->x0), lanes));
+        __m256i p_0 = gather_histogram_avx2(s->histograms, index);
+        __m256 c_value = _mm256_setzero_ps();
+        for (int d = 0; d < NUM_DIFFS; d++) {
+            __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(s->tvi_for_diff[d] + 1), value);
+            if (_mm256_testz_si256(active, active))
+                continue;
+            __m256i offset = _mm256_set1_epi32(g_all_diffs[NUM_DIFFS + d + 1] * histogram_width);
+            __m256i p_1 = gather_histogram_avx2(s->histograms, _mm256_add_epi32(index, offset));
+            __m256i p_2 = gather_histogram_avx2(s->histograms, _mm256_sub_epi32(index, offset));
+            __m256i p = _mm256_max_epi32(p_1, p_2);
+            __m256 num = _mm256_cvtepi32_ps(_mm256_mullo_epi32(_mm256_set1_epi32(g_diffs_weights[d]), _mm256_mullo_epi32(p_0, p)));
+            __m256 val = _mm256_div_ps(num, _mm256_cvtepi32_ps(_mm256_add_epi32(p, p_0)));
+            c_value = _mm256_blendv_ps(c_value, _mm256_max_ps(c_value, val), _mm256_castsi256_ps(active));
+        }
+        _mm256_storeu_ps(c_values + col, _mm256_and_ps(c_value, _mm256_castsi256_ps(masked)));
+    }
+    for (; col < s->x1; col++) {
+        if (mask[col]) {
+            c_values[col] = c_value_pixel(
+                s->histograms, image[col] + g_c_value_histogram_offset, g_diffs_weights, g_all_diffs, NUM_DIFFS, s->tvi_for_diff, col - s->x0, histogram_width
+            );
+        }
+    }
+}
+#endif
+
+#if CAMBI_ARM
+static inline void update_range_neon(uint16_t *arr, int left, int right, int delta) {
+    const uint16x8_t d = vdupq_n_u16((uint16_t)delta);
+    int col = left;
+    for (; col + 8 <= right; col += 8) {
+        vst1q_u16(arr + col, vaddq_u16(vld1q_u16(arr + col), d));
+    }
+    update_range_c(arr, col, right, delta);
+}
+#endif
 
-    // Use a histogram for each pixel in width
-    // histograms[i * width + j] accesses the j'th histogram, i'th value
+static FORCE_INLINE inline void update_histogram(const CValuesStrip *s, int row, int j, int delta,
+                                                 void (*update_range)(uint16_t *, int, int, int)) {
+    uint16_t mask_val = s->mask[row * s->stride + j];
+    if (mask_val) {
+        uint16_t val = s->image[row * s->stride + j] + g_c_value_histogram_offset;
+        int histogram_width = s->x1 - s->x0;
+        update_range(s->histograms + val * histogram_width - s->x0,
+                     MAX(j - s->pad_size, s->x0), MIN(j + s->pad_size + 1, s->x1), delta);
+    }
+}
+
+// Instantiated once per instruction set with constant kernels, which get inlined.
+static FORCE_INLINE inline void calculate_c_values_strip_impl(const CValuesStrip *s,
+                                                              void (*update_range)(uint16_t *, int, int, int),
+                                                              void (*c_values_row)(const CValuesStrip *, int)) {
+    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    uint16_t pad_size = s->pad_size;
+    int height = s->height;
+    // Source columns whose window overlaps the strip
+    int j0 = MAX(s->x0 - pad_size, 0);
+    int j1 = MIN(s->x1 + pad_size, s->width);
+
+    // Use a histogram for each pixel in the strip
+    // histograms[i * strip_width + j] accesses the j'th histogram, i'th value
     // This is done for cache optimization reasons
-    memset(histograms, 0, width * num_bins * sizeof(uint16_t));
+    memset(s->histograms, 0, (s->x1 - s->x0) * num_bins * sizeof(uint16_t));
 
     // First pass: first pad_size rows
     for (int i = 0; i < pad_size; i++) {
-        for (int j = 0; j < width; j++) {
-            uint16_t mask_val = mask[i * stride + j];
-            if (mask_val) {
-                uint16_t val = image[i * stride + j] + g_c_value_histogram_offset;
-                for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-                    histograms[val * width + col]++;
-                }
-            }
+        for (int j = j0; j < j1; j++) {
+            update_histogram(s, i, j, 1, update_range);
         }
     }
 
     // Iterate over all rows, unrolled into 3 loops to avoid conditions
     for (int i = 0; i < pad_size + 1; i++) {
         if (i + pad_size < height) {
-            for (int j = 0; j < width; j++) {
-                update_histogram_add(histograms, image, mask, i, j, width, stride, pad_size);
+            for (int j = j0; j < j1; j++) {
+                update_histogram(s, i + pad_size, j, 1, update_range);
             }
         }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+        c_values_row(s, i);
     }
     for (int i = pad_size + 1; i < height - pad_size; i++) {
-        for (int j = 0; j < width; j++) {
-            update_histogram_subtract(histograms, image, mask, i, j, width, stride, pad_size);
-            update_histogram_add(histograms, image, mask, i, j, width, stride, pad_size);
+        for (int j = j0; j < j1; j++) {
+            update_histogram(s, i - pad_size - 1, j, -1, update_range);
+            update_histogram(s, i + pad_size, j, 1, update_range);
         }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+        c_values_row(s, i);
     }
     for (int i = height - pad_size; i < height; i++) {
         if (i - pad_size - 1 >= 0) {
-            for (int j = 0; j < width; j++) {
-                update_histogram_subtract(histograms, image, mask, i, j, width, stride, pad_size);
+            for (int j = j0; j < j1; j++) {
+                update_histogram(s, i - pad_size - 1, j, -1, update_range);
             }
         }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+        c_values_row(s, i);
     }
 }
 
-static double average_topk_elements(const float *arr, int topk_elements) {
-    double sum = 0;
-    for (int i = 0; i < topk_elements; i++)
-        sum += arr[i];
+static void calculate_c_values_strip_c(const CValuesStrip *s) {
+    calculate_c_values_strip_impl(s, update_range_c, calculate_c_values_row_c);
+}
 
-    return (double)sum / topk_elements;
+#if CAMBI_X86
+CAMBI_AVX2 static void calculate_c_values_strip_avx2(const CValuesStrip *s) {
+    calculate_c_values_strip_impl(s, update_range_avx2, calculate_c_values_row_avx2);
 }
 
-static void quick_select(float *arr, int n, int k) {
-    int left = 0;
-    int right = n - 1;
-    while (left < right) {
-        float pivot = arr[k];
-        int i = left;
-        int j = right;
-        do {
-            while (arr[i] > pivot) {
-                i++;
-            }
-            while (arr[j] < pivot) {
-                j--;
-            }
-            if (i <= j) {
-                SWAP_FLOATS(arr[i], arr[j]);
-                i++;
-                j--;
-            }
-        } while (i <= j);
-        if (j < k) {
-            left = i;
-        }
-        if (k < i) {
-            right = j;
+CAMBI_AVX512 static void calculate_c_values_strip_avx512(const CValuesStrip *s) {
+    calculate_c_values_strip_impl(s, update_range_avx512, calculate_c_values_row_avx2);
+}
+#endif
+
+#if CAMBI_ARM
+static void calculate_c_values_strip_neon(const CValuesStrip *s) {
+    calculate_c_values_strip_impl(s, update_range_neon, calculate_c_values_row_c);
+}
+#endif
+
+static const CambiKernels *cambi_kernels(int isa) {
+    static const CambiKernels kernels_c = {
+        decimate_row_c, mode_row_c, derivative_row_c, mask_row_c, calculate_c_values_strip_c,
+    };
+#if CAMBI_X86
+    static const CambiKernels kernels_avx2 = {
+        decimate_row_avx2, mode_row_avx2, derivative_row_avx2, mask_row_avx2, calculate_c_values_strip_avx2,
+    };
+    static const CambiKernels kernels_avx512 = {
+        decimate_row_avx2, mode_row_avx2, derivative_row_avx2, mask_row_avx2, calculate_c_values_strip_avx512,
+    };
+    if (isa >= CAMBI_ISA_AVX512)
+        return &kernels_avx512;
+    if (isa >= CAMBI_ISA_AVX2)
+        return &kernels_avx2;
+#elif CAMBI_ARM
+    static const CambiKernels kernels_neon = {
+        decimate_row_neon, mode_row_neon, derivative_row_neon, mask_row_neon, calculate_c_values_strip_neon,
+    };
+    if (isa >= CAMBI_ISA_NEON)
+        return &kernels_neon;
+#endif
+    return &kernels_c;
+}
+
+static void calculate_c_values_strip(const CValuesStrip *s) {
+    s->kernels->c_values_strip(s);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI c_values_worker(LPVOID arg) {
+    calculate_c_values_strip(arg);
+    return 0;
+}
+#else
+static void *c_values_worker(void *arg) {
+    calculate_c_values_strip(arg);
+    return NULL;
+}
+#endif
+
+static void c_values_strip_task(void *strips, int k) {
+    calculate_c_values_strip((const CValuesStrip *)strips + k);
+}
+
+// c_values_stride is in floats
+static void calculate_c_values_on(VmafPicture *pic, const VmafPicture *mask_pic,
+                                  float *c_values, ptrdiff_t c_values_stride, uint16_t *histograms, uint16_t window_size,
+                                  const uint16_t *tvi_for_diff, int width, int height, unsigned threads,
+                                  CambiParallelFor parallel_for) {
+    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    const CambiKernels *kernels = cambi_kernels(cambi_cpu_isa());
+    CValuesStrip strips[CAMBI_MAX_THREADS];
+
+    for (int i = 0; i < height; i++)
+        memset(c_values + i * c_values_stride, 0, sizeof(float) * width);
+
+    // Narrow strips spend most of their time on the halo.
+    int num_strips = CLAMP(width / CAMBI_MIN_STRIP_WIDTH, 1, (int)MAX(threads, 1u));
+    for (int k = 0; k < num_strips; k++) {
+        CValuesStrip *s = &strips[k];
+        s->image = pic->data[0];
+        s->mask = mask_pic->data[0];
+        s->c_values = c_values;
+        s->c_values_stride = c_values_stride;
+        s->tvi_for_diff = tvi_for_diff;
+        s->stride = pic->stride[0] >> 1;
+        s->width = width;
+        s->height = height;
+        s->x0 = (int)((int64_t)width * k / num_strips);
+        s->x1 = (int)((int64_t)width * (k + 1) / num_strips);
+        s->pad_size = window_size >> 1;
+        s->kernels = kernels;
+        // The strips partition the full-width histogram buffer
+        s->histograms = histograms + (size_t)s->x0 * num_bins;
+    }
+
+    if (parallel_for) {
+        parallel_for(num_strips, c_values_strip_task, strips);
+        return;
+    }
+
+    // The calling thread takes the first strip; a strip whose worker could
+    // not be started is run inline afterwards.
+#ifdef _WIN32
+    HANDLE workers[CAMBI_MAX_THREADS];
+    for (int k = 1; k < num_strips; k++)
+        workers[k] = CreateThread(NULL, 0, c_values_worker, &strips[k], 0, NULL);
+    calculate_c_values_strip(&strips[0]);
+    for (int k = 1; k < num_strips; k++) {
+        if (workers[k]) {
+            WaitForSingleObject(workers[k], INFINITE);
+            CloseHandle(workers[k]);
+        } else {
+            calculate_c_values_strip(&strips[k]);
         }
     }
+#else
+    pthread_t workers[CAMBI_MAX_THREADS];
+    int started[CAMBI_MAX_THREADS] = {0};
+    for (int k = 1; k < num_strips; k++)
+        started[k] = !pthread_create(&workers[k], NULL, c_values_worker, &strips[k]);
+    calculate_c_values_strip(&strips[0]);
+    for (int k = 1; k < num_strips; k++) {
+        if (started[k])
+            pthread_join(workers[k], NULL);
+        else
+            calculate_c_values_strip(&strips[k]);
+    }
+#endif
 }
 
-static double spatial_pooling(float *c_values, double topk, unsigned width, unsigned height) {
+static void calculate_c_values(VmafPicture *pic, const VmafPicture *mask_pic,
+                               float *c_values, ptrdiff_t c_values_stride, uint16_t *histograms, uint16_t window_size,
+                               const uint16_t *tvi_for_diff, int width, int height, unsigned threads) {
+    calculate_c_values_on(pic, mask_pic, c_values, c_values_stride, histograms, window_size,
+                          tvi_for_diff, width, height, threads, NULL);
+}
+
+static FORCE_INLINE inline uint32_t c_value_bits(const float *c_values, int i) {
+    uint32_t bits;
+    memcpy(&bits, &c_values[i], sizeof bits);
+    return bits;
+}
+
+// Restores the zeroed buckets, by revisiting the elements when there are fewer of them.
+static void clear_pooling_buckets(uint32_t *histogram, const float *c_values, unsigned width, unsigned height,
+                                  ptrdiff_t stride, int shift) {
+    if (width * height < POOLING_BUCKETS) {
+        for (unsigned y = 0; y < height; y++, c_values += stride)
+            for (unsigned x = 0; x < width; x++)
+                histogram[(c_value_bits(c_values, x) >> shift) & (POOLING_BUCKETS - 1)] = 0;
+    } else {
+        memset(histogram, 0, POOLING_BUCKETS * sizeof(uint32_t));
+    }
+}
+
+/*
+* Mean of the topk_num_elements largest c-values, leaving c_values untouched.
+* Non-negative floats are ordered like their bit patterns, so a radix select on the upper
+* and then the lower 16 bits finds the k-th largest value t in two streaming passes.
+* The mean is taken over all values above t plus as many copies of t as needed.
+* histogram holds 2 * POOLING_BUCKETS counts, which must be zero and are left zeroed.
+* The c-values come from few distinct ratios, so the counts and sums are split over
+* independent copies to avoid serializing on the same bucket.
+* stride is in floats.
+*/
+static double spatial_pooling(const float *c_values, double topk, unsigned width, unsigned height,
+                              ptrdiff_t stride, uint32_t *histogram) {
     int num_elements = height * width;
     int topk_num_elements = clip(topk * num_elements, 1, num_elements);
-    quick_select(c_values, num_elements, topk_num_elements);
-    return average_topk_elements(c_values, topk_num_elements);
+    uint32_t *histogram_odd = histogram + POOLING_BUCKETS;
+
+    // First pass: bucket by the upper bits and find the bucket holding the k-th largest value
+    uint32_t max_bits = 0;
+    const float *row = c_values;
+    for (unsigned y = 0; y < height; y++, row += stride) {
+        unsigned x = 0;
+        for (; x + 2 <= width; x += 2) {
+            uint32_t bits_even = c_value_bits(row, x);
+            uint32_t bits_odd = c_value_bits(row, x + 1);
+            histogram[bits_even >> 16]++;
+            histogram_odd[bits_odd >> 16]++;
+            max_bits = MAX(max_bits, MAX(bits_even, bits_odd));
+        }
+        if (x < width) {
+            uint32_t bits = c_value_bits(row, x);
+            histogram[bits >> 16]++;
+            max_bits = MAX(max_bits, bits);
+        }
+    }
+    int needed = topk_num_elements;
+    uint32_t upper = max_bits >> 16;
+    while ((int)(histogram[upper] + histogram_odd[upper]) < needed) {
+        needed -= histogram[upper] + histogram_odd[upper];
+        upper--;
+    }
+    clear_pooling_buckets(histogram, c_values, width, height, stride, 16);
+    clear_pooling_buckets(histogram_odd, c_values, width, height, stride, 16);
+
+    // Second pass: sum the values in higher buckets and refine the k-th bucket by the lower bits
+    double sums[4] = {0, 0, 0, 0};
+    uint32_t max_lower = 0;
+    row = c_values;
+    for (unsigned y = 0; y < height; y++, row += stride) {
+        for (unsigned x = 0; x < width; x++) {
+            uint32_t bits = c_value_bits(row, x);
+            if ((bits >> 16) > upper) {
+                sums[x & 3] += row[x];
+            } else if ((bits >> 16) == upper) {
+                histogram[bits & (POOLING_BUCKETS - 1)]++;
+                max_lower = MAX(max_lower, bits & (POOLING_BUCKETS - 1));
+            }
+        }
+    }
+    double sum = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    for (uint32_t lower = max_lower; needed > 0; lower--) {
+        uint32_t bits = upper << 16 | lower;
+        float value;
+        memcpy(&value, &bits, sizeof value);
+        int count = MIN((int)histogram[lower], needed);
+        sum += (double)count * value;
+        needed -= count;
+    }
+    clear_pooling_buckets(histogram, c_values, width, height, stride, 0);
+
+    return sum / topk_num_elements;
 }
 
 static FORCE_INLINE inline uint16_t get_pixels_in_window(uint16_t window_length) {
@@ -716,7 +1348,9 @@ static FORCE_INLINE inline double weight_scores_per_scale(double *scores_per_sca
 
 static int cambi_score(VmafPicture *pics, uint32_t *mask_dp, uint16_t window_size, double topk,
                        const uint16_t *tvi_for_diff, float *c_values, uint16_t *c_values_histograms, double *score,
-                       float **c_values_ret) {
+                       const CambiScales *scales, unsigned threads, uint32_t *pooling_histogram,
+                       unsigned ref_width, unsigned ref_height, CambiCValuesFn c_values_fn, void *c_values_ctx,
+                       CambiParallelFor parallel_for, CambiScratchFn scratch) {
     double scores_per_scale[NUM_SCALES];
     VmafPicture *image = &pics[0];
     VmafPicture *mask = &pics[1];
@@ -730,19 +1364,36 @@ static int cambi_score(VmafPicture *pics, uint32_t *mask_dp, uint16_t window_siz
             decimate(image, scaled_width, scaled_height);
             decimate(mask, scaled_width, scaled_height);
         } else {
-            get_spatial_mask(image, mask, mask_dp, scaled_width, scaled_height);
+            get_spatial_mask_with(image, mask, mask_dp, scaled_width, scaled_height, ref_width, ref_height, scratch);
         }
 
-        filter_mode(image, scaled_width, scaled_height);
-
-        calculate_c_values(image, mask, c_values, c_values_histograms, window_size,
-                           tvi_for_diff, scaled_width, scaled_height);
+        filter_mode_with(image, scaled_width, scaled_height, scratch);
 
-        if (c_values_ret && c_values_ret[scale])
-            memcpy(c_values_ret[scale], c_values, scaled_width * scaled_height * sizeof *c_values);
+        // Pooling does not modify the c-values, so requested ones are computed in place
+        // and scaled afterwards.
+        float *scale_c_values = c_values;
+        ptrdiff_t c_values_stride = scaled_width;
+        if (scales && scales->data[scale]) {
+            scale_c_values = scales->data[scale];
+            c_values_stride = scales->stride[scale];
+        }
+        if (c_values_fn) {
+            int err = c_values_fn(c_values_ctx, image->data[0], mask->data[0], image->stride[0] >> 1,
+                                  scale_c_values, c_values_stride, scaled_width, scaled_height, window_size, tvi_for_diff);
+            if (err) return err;
+        } else {
+            calculate_c_values_on(image, mask, scale_c_values, c_values_stride, c_values_histograms, window_size,
+                                  tvi_for_diff, scaled_width, scaled_height, threads, parallel_for);
+        }
 
         scores_per_scale[scale] =
-            spatial_pooling(c_values, topk, scaled_width, scaled_height);
+            spatial_pooling(scale_c_values, topk, scaled_width, scaled_height, c_values_stride, pooling_histogram);
+
+        if (scale_c_values != c_values && scales->scaling != 1.0f) {
+            for (unsigned i = 0; i < scaled_height; i++)
+                for (unsigned j = 0; j < scaled_width; j++)
+                    scale_c_values[i * c_values_stride + j] *= scales->scaling;
+        }
     }
 
     uint16_t pixels_in_window = get_pixels_in_window(window_size);
@@ -750,16 +1401,59 @@ static int cambi_score(VmafPicture *pics, uint32_t *mask_dp, uint16_t window_siz
     return 0;
 }
 
-int cambi_extract(CambiState *s, VmafPicture *pic, double *score, float **c_values) {
+int cambi_extract(CambiState *s, VmafPicture *pic, double *score, const CambiScales *scales) {
     int err = cambi_preprocessing(pic, &s->pics[0]);
     if (err) return err;
 
-    err = cambi_score(s->pics, s->mask_dp, s->window_size, s->topk, s->tvi_for_diff, s->c_values, s->c_values_histograms, score, c_values);
+    err = cambi_score(s->pics, s->mask_dp, s->window_size, s->topk, s->tvi_for_diff, s->c_values, s->c_values_histograms, score, scales, s->threads, s->pooling_histogram,
+                      s->ref_width, s->ref_height, s->c_values_fn, s->c_values_ctx, s->parallel_for, s->scratch);
     if (err) return err;
 
     return 0;
 }
 
+int cambi_verify_c_values(const CambiState *s) {
+    // Smooth ramps with a little noise, so that every diff occurs, and a sparse
+    // mask. The size is not a multiple of any block or strip size.
+    const int width = 2 * CAMBI_MIN_STRIP_WIDTH + 45, height = 2 * s->window_size + 19;
+    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    uint16_t *image = malloc((size_t)width * height * sizeof(uint16_t));
+    uint16_t *mask = malloc((size_t)width * height * sizeof(uint16_t));
+    float *expected = malloc((size_t)width * height * sizeof(float));
+    float *c_values = malloc((size_t)width * height * sizeof(float));
+    uint16_t *histograms = malloc((size_t)width * num_bins * sizeof(uint16_t));
+    int err = -ENOMEM;
+    if (image && mask && expected && c_values && histograms) {
+        uint32_t seed = 1;
+        for (int i = 0; i < height; i++) {
+            for (int j = 0; j < width; j++) {
+                seed = seed * 1103515245 + 12345;
+                image[i * width + j] = (uint16_t)(40 + (3 * j + 5 * i) / 11 + ((seed >> 16) & 3));
+                mask[i * width + j] = ((seed >> 20) & 7) != 0;
+            }
+        }
+        VmafPicture pic = {0}, mask_pic = {0};
+        pic.data[0] = image;
+        mask_pic.data[0] = mask;
+        pic.stride[0] = mask_pic.stride[0] = width * sizeof(uint16_t);
+        pic.w[0] = mask_pic.w[0] = width;
+        pic.h[0] = mask_pic.h[0] = height;
+        calculate_c_values(&pic, &mask_pic, expected, width, histograms, s->window_size,
+                           s->tvi_for_diff, width, height, 1);
+        err = s->c_values_fn(s->c_values_ctx, image, mask, width, c_values, width, width, height,
+                             s->window_size, s->tvi_for_diff);
+        if (!err)
+            err = memcmp(c_values, expected, (size_t)width * height * sizeof(float)) != 0;
+    }
+
+    free(image);
+    free(mask);
+    free(expected);
+    free(c_values);
+    free(histograms);
+    return err;
+}
+
 static int extract(VmafFeatureExtractor *fex,
                    VmafPicture *ref_pic, VmafPicture *ref_pic_90,
                    VmafPicture *dist_pic, VmafPicture *dist_pic_90,
@@ -786,6 +1480,7 @@ int cambi_close(CambiState *s) {
     aligned_free(s->c_values);
     aligned_free(s->c_values_histograms);
     aligned_free(s->mask_dp);
+    aligned_free(s->pooling_histogram);
     return err;
 }
 
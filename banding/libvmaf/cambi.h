@@ -2,6 +2,7 @@
 #define __VMAF_CAMBI_H__
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,6 +10,7 @@ extern "C" {
 
 #define NUM_SCALES 5
 #define NUM_DIFFS 4
+#define CAMBI_MAX_THREADS 64
 #ifdef CAMBI_IMPL
 static const int g_scale_weights[NUM_SCALES] = {16, 8, 4, 2, 1};
 static const int g_diffs_to_consider[NUM_DIFFS] = {1, 2, 3, 4};
@@ -17,23 +19,59 @@ static const int g_diffs_weights[NUM_DIFFS] = {1, 2, 3, 4};
 
 #define PICS_BUFFER_SIZE 2
 
+/* Calls fn(ctx, i) for every 0 <= i < count, possibly concurrently, and returns once all
+ * calls have finished. */
+typedef void (*CambiParallelFor)(int count, void (*fn)(void *ctx, int i), void *ctx);
+
+/* Computes the c-values of one scale instead of the CPU, e.g. on a GPU, from the 10-bit
+ * image and the spatial mask (both stride elements apart), and must give identical results.
+ * c_values_stride is in floats; unmasked pixels get 0. Returns 0 on success. */
+typedef int (*CambiCValuesFn)(void *ctx, const uint16_t *image, const uint16_t *mask, ptrdiff_t stride,
+                              float *c_values, ptrdiff_t c_values_stride, int width, int height,
+                              uint16_t window_size, const uint16_t *tvi_for_diff);
+
+/* Returns size bytes of memory aligned to 64 bytes that stays valid until the current
+ * cambi_extract returns, for the per-frame line buffers. It is not freed by cambi. */
+typedef void *(*CambiScratchFn)(size_t size);
+
 typedef struct CambiState {
     VmafPicture pics[PICS_BUFFER_SIZE];
     unsigned enc_width;
     unsigned enc_height;
+    // Resolution that the window size and spatial mask are tuned for, to score a
+    // crop like the frame it was taken from. Zero means the picture size.
+    unsigned ref_width;
+    unsigned ref_height;
     uint16_t tvi_for_diff[NUM_DIFFS];
     uint16_t window_size;
     double topk;
     double tvi_threshold;
+    unsigned threads; // column strips of the c-value pass run concurrently
+    CambiParallelFor parallel_for; // runs the strips if set, instead of native threads
+    CambiCValuesFn c_values_fn; // replaces the c-value pass of every scale if set
+    void *c_values_ctx;
+    CambiScratchFn scratch; // allocates the per-frame line buffers if set, instead of malloc
     float *c_values;
     uint16_t *c_values_histograms;
     uint32_t *mask_dp;
+    uint32_t *pooling_histogram;
 } CambiState;
 
+/* Destination of the c-values of each scale, such as the planes of output frames.
+ * Scales with NULL data are not returned. */
+typedef struct CambiScales {
+    float *data[NUM_SCALES];
+    ptrdiff_t stride[NUM_SCALES]; // in floats
+    float scaling;                // applied to the returned c-values
+} CambiScales;
+
 void cambi_config(CambiState *s);
 int cambi_init(CambiState *s, unsigned w, unsigned h);
-int cambi_extract(CambiState *s, VmafPicture *pic, double *score, float **c_values);
+int cambi_extract(CambiState *s, VmafPicture *pic, double *score, const CambiScales *scales);
 int cambi_close(CambiState *s);
+/* Compares s->c_values_fn with the CPU on a synthetic picture at the window size of the
+ * initialised s. Returns 0 if the c-values are identical. */
+int cambi_verify_c_values(const CambiState *s);
 
 static inline void scale_dimension(unsigned *width, unsigned int scale) {
     for (unsigned i = 0; i < scale; i++)
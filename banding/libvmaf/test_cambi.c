@@ -196,6 +196,53 @@ static char *test_decimate_generic()
     mu_assert("decimate generic 8b to 10b wrong pixel value (1,0)", data[stride]==8);
     mu_assert("decimate generic 8b to 10b wrong pixel value (1,1)", data[1+stride]==400);
 
+    VmafPicture pic_12b;
+    err = vmaf_picture_alloc(&pic_12b, VMAF_PIX_FMT_YUV400P, 12, 4, 4);
+    (void)err;
+    uint16_t *data_12b = pic_12b.data[0], *data_10b = pic.data[0];
+    ptrdiff_t stride_12b = pic_12b.stride[0] >> 1;
+    for (unsigned i = 0; i < 4; i++)
+        for (unsigned j = 0; j < 4; j++)
+            data_12b[i * stride_12b + j] = data_10b[i * (pic.stride[0] >> 1) + j] * 4 + 1;
+
+    decimate_generic_and_convert_to_10b(&pic_12b, &out_pic);
+
+    mu_assert("decimate generic 12b to 10b wrong pixel value (0,0)", data[0]==2);
+    mu_assert("decimate generic 12b to 10b wrong pixel value (0,1)", data[1]==100);
+
+    decimate_generic_and_convert_to_10b(&pic_12b, &out_pic_4x4);
+
+    mu_assert("decimate generic 12b to 10b wrong for same dimensions", pic_data_equality(&pic, &out_pic_4x4));
+
+    mu_assert("convert 16b to 10b rounds to nearest", convert_to_10b(0x1020, 16)==0x41);
+    mu_assert("convert 16b to 10b clamps", convert_to_10b(0xffff, 16)==1023);
+    mu_assert("convert 9b to 10b", convert_to_10b(511, 9)==1022);
+
+    return NULL;
+}
+
+static char *test_init_wide()
+{
+    // Frames wider than CAMBI_MAX_WIDTH are processed at half resolution
+    CambiState s;
+    cambi_config(&s);
+    mu_assert("cambi_init rejects 8K frames", cambi_init(&s, 7680, 4320)==0);
+    mu_assert("cambi_init working width for 8K", s.pics[0].w[0]==3840);
+    mu_assert("cambi_init working height for 8K", s.pics[0].h[0]==2160);
+    cambi_close(&s);
+
+    cambi_config(&s);
+    mu_assert("cambi_init accepts narrow frames", cambi_init(&s, 319, 240)==-EINVAL);
+
+    // Crops keep the window size of the frame they were taken from
+    cambi_config(&s);
+    s.ref_width = 1920;
+    s.ref_height = 1080;
+    mu_assert("cambi_init rejects narrow crops", cambi_init(&s, 128, 96)==0);
+    mu_assert("cambi_init crop working width", s.pics[0].w[0]==128);
+    mu_assert("cambi_init crop window size", s.window_size==31);
+    cambi_close(&s);
+
     return NULL;
 }
 
@@ -299,8 +346,8 @@ static char *test_calculate_c_values()
 
     get_sample_image(&input, 0);
     get_sample_image(&mask, 8);
-    calculate_c_values(&input, &mask, combined_c_values, histograms,
-                       window_size, tvi_for_diff, width, height);
+    calculate_c_values(&input, &mask, combined_c_values, width, histograms,
+                       window_size, tvi_for_diff, width, height, 1);
 
     for (unsigned i=0; i<16; i++) {
         mu_assert("calculate_c_values error ws=3",
@@ -313,8 +360,8 @@ static char *test_calculate_c_values()
     get_sample_image_8x8(&mask_8x8, 1);
     window_size = 9;
     uint16_t histograms_8x8[8*1032];
-    calculate_c_values(&input_8x8, &mask_8x8, combined_c_values_8x8, histograms_8x8,
-                       window_size, tvi_for_diff, 8, 8);
+    calculate_c_values(&input_8x8, &mask_8x8, combined_c_values_8x8, 8, histograms_8x8,
+                       window_size, tvi_for_diff, 8, 8, 1);
 
     double sum = 0;
     for (unsigned i=0; i<64; i++)
@@ -324,6 +371,168 @@ static char *test_calculate_c_values()
     return NULL;
 }
 
+static char *test_calculate_c_values_strips()
+{
+    // Wide enough for several column strips; the result must not depend on
+    // how many strips run concurrently.
+    VmafPicture input, mask;
+    unsigned width = 4 * CAMBI_MIN_STRIP_WIDTH + 17, height = 24;
+    uint16_t tvi_for_diff[4] = {178, 305, 432, 559};
+    uint16_t window_size = 9;
+    int err = vmaf_picture_alloc(&input, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    err |= vmaf_picture_alloc(&mask, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    assert(err == 0);
+    uint16_t *data = input.data[0], *mask_data = mask.data[0];
+    ptrdiff_t stride = input.stride[0] >> 1;
+    for (unsigned i = 0; i < height; i++) {
+        for (unsigned j = 0; j < width; j++) {
+            data[i * stride + j] = (i * 7 + j * 13 + (i * j) % 5) % 9;
+            mask_data[i * stride + j] = (i + j) % 4 != 0;
+        }
+    }
+
+    uint16_t *histograms = malloc(width * 1032 * sizeof(uint16_t));
+    float *expected = malloc(width * height * sizeof(float));
+    float *c_values = malloc(width * height * sizeof(float));
+    calculate_c_values(&input, &mask, expected, width, histograms,
+                       window_size, tvi_for_diff, width, height, 1);
+    for (unsigned threads = 2; threads <= 6; threads++) {
+        calculate_c_values(&input, &mask, c_values, width, histograms,
+                           window_size, tvi_for_diff, width, height, threads);
+        mu_assert("calculate_c_values strips differ from a single pass",
+            !memcmp(c_values, expected, width * height * sizeof(float)));
+    }
+
+    free(histograms);
+    free(expected);
+    free(c_values);
+    vmaf_picture_unref(&input);
+    vmaf_picture_unref(&mask);
+    return NULL;
+}
+
+// Counts the window of every pixel directly, which is how a GPU computes the
+// c-values; ctx is a flag to corrupt one of them.
+static int window_c_values(void *ctx, const uint16_t *image, const uint16_t *mask, ptrdiff_t stride,
+                           float *c_values, ptrdiff_t c_values_stride, int width, int height,
+                           uint16_t window_size, const uint16_t *tvi_for_diff)
+{
+    const int pad = window_size >> 1;
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            float *c = &c_values[i * c_values_stride + j];
+            *c = 0;
+            if (!mask[i * stride + j])
+                continue;
+            int v = image[i * stride + j], counts[NUM_ALL_DIFFS] = {0};
+            for (int y = MAX(i - pad, 0); y <= MIN(i + pad, height - 1); y++)
+                for (int x = MAX(j - pad, 0); x <= MIN(j + pad, width - 1); x++)
+                    if (mask[y * stride + x] && abs(image[y * stride + x] - v) <= NUM_DIFFS)
+                        counts[image[y * stride + x] - v + NUM_DIFFS]++;
+            int p_0 = counts[NUM_DIFFS];
+            for (int d = 0; d < NUM_DIFFS; d++) {
+                if (v + g_c_value_histogram_offset > tvi_for_diff[d])
+                    continue;
+                int p = MAX(counts[NUM_DIFFS + d + 1], counts[NUM_DIFFS - d - 1]);
+                float val = (float)(g_diffs_weights[d] * p_0 * p) / (p + p_0);
+                *c = MAX(*c, val);
+            }
+        }
+    }
+    if (ctx)
+        c_values[(height / 2) * c_values_stride + width / 2] += 1;
+    return 0;
+}
+
+static char *test_verify_c_values()
+{
+    CambiState s;
+    cambi_config(&s);
+    int err = cambi_init(&s, 1920, 1080);
+    assert(err == 0);
+    int corrupt = 1;
+    s.c_values_fn = window_c_values;
+    s.c_values_ctx = NULL;
+    mu_assert("per pixel window counts differ from the sliding histograms", cambi_verify_c_values(&s) == 0);
+    s.c_values_ctx = &corrupt;
+    mu_assert("cambi_verify_c_values missed a wrong c-value", cambi_verify_c_values(&s) != 0);
+    cambi_close(&s);
+    return NULL;
+}
+
+static char *test_kernels()
+{
+    // Every kernel the host supports must match the C kernels exactly.
+    const CambiKernels *ref = cambi_kernels(CAMBI_ISA_C);
+    const int width = 203, height = 19, span = 7;
+    uint16_t rows[3][203], expected[203], out[203];
+    uint32_t top[203 + 7], bottom[203 + 7];
+    uint8_t hist[1024];
+    unsigned seed = 1;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < width; j++)
+            rows[i][j] = (seed = seed * 1103515245 + 12345) >> 16 & 3;
+    for (int j = 0; j < width + span; j++) {
+        top[j] = j * 2 + ((seed = seed * 1103515245 + 12345) >> 16 & 1);
+        bottom[j] = top[j] + j + ((seed >> 8) & 3);
+    }
+
+    VmafPicture input, mask;
+    int err = vmaf_picture_alloc(&input, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    err |= vmaf_picture_alloc(&mask, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    assert(err == 0);
+    ptrdiff_t stride = input.stride[0] >> 1;
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            ((uint16_t *)input.data[0])[i * stride + j] = 1015 + ((seed = seed * 1103515245 + 12345) >> 16) % 9;
+            ((uint16_t *)mask.data[0])[i * stride + j] = (seed >> 20) % 5 != 0;
+        }
+    }
+    uint16_t tvi_for_diff[4] = {1025, 1022, 1030, 1040};
+    uint16_t *histograms = malloc(width * 1032 * sizeof(uint16_t));
+    float *expected_c = calloc(width * height, sizeof(float));
+    float *c_values = calloc(width * height, sizeof(float));
+    CValuesStrip strip = {
+        .image = input.data[0], .mask = mask.data[0], .c_values = expected_c, .c_values_stride = width,
+        .histograms = histograms, .tvi_for_diff = tvi_for_diff, .stride = stride,
+        .width = width, .height = height, .x0 = 0, .x1 = width, .pad_size = 4, .kernels = ref,
+    };
+    ref->c_values_strip(&strip);
+
+    for (int isa = CAMBI_ISA_C + 1; isa <= cambi_cpu_isa(); isa++) {
+        const CambiKernels *k = cambi_kernels(isa);
+        if (k == ref)
+            continue;
+        for (int w = 1; w <= width; w += 29) {
+            ref->decimate_row(expected, rows[0], w / 2);
+            k->decimate_row(out, rows[0], w / 2);
+            mu_assert("decimate_row kernel mismatch", !memcmp(out, expected, w / 2 * sizeof(uint16_t)));
+            ref->mode_row(expected, rows[0], rows[1], rows[2], w, hist);
+            k->mode_row(out, rows[0], rows[1], rows[2], w, hist);
+            mu_assert("mode_row kernel mismatch", !memcmp(out, expected, w * sizeof(uint16_t)));
+            ref->derivative_row(expected, rows[1], rows[2], w);
+            k->derivative_row(out, rows[1], rows[2], w);
+            mu_assert("derivative_row kernel mismatch", !memcmp(out, expected, w * sizeof(uint16_t)));
+            ref->mask_row(expected, top, bottom, w, span, 8);
+            k->mask_row(out, top, bottom, w, span, 8);
+            mu_assert("mask_row kernel mismatch", !memcmp(out, expected, w * sizeof(uint16_t)));
+        }
+        memset(c_values, 0, width * height * sizeof(float));
+        strip.c_values = c_values;
+        strip.kernels = k;
+        k->c_values_strip(&strip);
+        mu_assert("c_values_strip kernel mismatch", !memcmp(c_values, expected_c, width * height * sizeof(float)));
+        strip.c_values = expected_c;
+    }
+
+    free(histograms);
+    free(expected_c);
+    free(c_values);
+    vmaf_picture_unref(&input);
+    vmaf_picture_unref(&mask);
+    return NULL;
+}
+
 static char *test_c_value_pixel()
 {
     uint16_t histogram[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
@@ -351,54 +560,61 @@ static char *test_c_value_pixel()
 static char *test_spatial_pooling()
 {
     float arr[12] = {0, 1, 2, 3, 4, 5, 10, 7, 8, 9, 6, 11};
+    uint32_t *histogram = calloc(2 * POOLING_BUCKETS, sizeof(uint32_t));
 
-    double average = spatial_pooling(arr, 0, 4, 3);
+    double average = spatial_pooling(arr, 0, 4, 3, 4, histogram);
     mu_assert("spatial_pooling for topk=0", average==11);
 
-    average = spatial_pooling(arr, 0.1, 4, 3);
+    average = spatial_pooling(arr, 0.1, 4, 3, 4, histogram);
     mu_assert("spatial_pooling for topk=0.1", average==11);
 
-    average = spatial_pooling(arr, 0.2, 4, 3);
+    average = spatial_pooling(arr, 0.2, 4, 3, 4, histogram);
     mu_assert("spatial_pooling for topk=0.2", average==10.5);
 
-    average = spatial_pooling(arr, 1.0, 4, 3);
+    average = spatial_pooling(arr, 1.0, 4, 3, 4, histogram);
     mu_assert("spatial_pooling for topk=1.0", average==5.5);
 
+    float copy[12];
+    memcpy(copy, arr, sizeof arr);
+    spatial_pooling(arr, 0.5, 4, 3, 4, histogram);
+    mu_assert("spatial_pooling modified its input", !memcmp(copy, arr, sizeof arr));
+
+    free(histogram);
     return NULL;
 }
 
-static char *test_quick_select()
+static int compare_floats_descending(const void *a, const void *b)
 {
-    float arr[12] = {0, 1, 2, 3, 4, 5, 10, 7, 8, 9, 6, 11};
-    int kth = 5;
-
-    quick_select(arr, 12, 5);
-
-    mu_assert("quick_select error value entry kth=5", arr[kth]==6);
-    for (int i=0; i<kth; i++)
-        mu_assert("quick_select larger values for index<kth", arr[i]>=arr[kth]);
-
-    for (int i=kth+1; i<12; i++)
-        mu_assert("quick_select smaller values for index>kth", arr[i]<=arr[kth]);
-
-
-    return NULL;
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x < y) - (x > y);
 }
 
-static char *test_average_topk_elements()
+static char *test_spatial_pooling_ties()
 {
-    float arr[12] = {11, 10, 9, 8, 7, 6, 1, 2, 3, 4, 5, 0};
-    double average;
-
-    average = average_topk_elements(arr, 1);
-    mu_assert("average_topk_elements topk_elements=1", average==11);
-
-    average = average_topk_elements(arr, 2);
-    mu_assert("average_topk_elements topk_elements=2", average==10.5);
-
-    average = average_topk_elements(arr, 12);
-    mu_assert("average_topk_elements topk_elements=12", average==5.5);
+    // Many repeated values sharing upper bits, as produced by the c-value ratios
+    enum { n = 5000 };
+    float arr[n], sorted[n];
+    uint32_t *histogram = calloc(2 * POOLING_BUCKETS, sizeof(uint32_t));
+    unsigned seed = 7;
+    for (int i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        int p = (seed >> 16) % 13;
+        arr[i] = p ? (float)(4 * p * 3) / (p + 3) + (seed >> 28) * 0x1p-20f : 0;
+    }
+    memcpy(sorted, arr, sizeof arr);
+    qsort(sorted, n, sizeof *sorted, compare_floats_descending);
+
+    double topks[] = {0.0001, 0.01, 0.25, 0.6, 0.999, 1.0};
+    for (unsigned t = 0; t < sizeof topks / sizeof *topks; t++) {
+        int k = clip(topks[t] * n, 1, n);
+        double sum = 0;
+        for (int i = 0; i < k; i++)
+            sum += sorted[i];
+        mu_assert("spatial_pooling differs from sorting",
+            almost_equal(spatial_pooling(arr, topks[t], n, 1, n, histogram), sum / k));
+    }
 
+    free(histogram);
     return NULL;
 }
 
@@ -567,6 +783,7 @@ char *run_tests()
     /* Preprocessing functions */
     mu_run_test(test_anti_dithering_filter);
     mu_run_test(test_decimate_generic);
+    mu_run_test(test_init_wide);
 
     /* Banding detection functions */
     mu_run_test(test_decimate);
@@ -576,11 +793,13 @@ char *run_tests()
     mu_run_test(test_get_spatial_mask_for_index);
 
     mu_run_test(test_calculate_c_values);
+    mu_run_test(test_calculate_c_values_strips);
+    mu_run_test(test_kernels);
+    mu_run_test(test_verify_c_values);
     mu_run_test(test_c_value_pixel);
 
     mu_run_test(test_spatial_pooling);
-    mu_run_test(test_quick_select);
-    mu_run_test(test_average_topk_elements);
+    mu_run_test(test_spatial_pooling_ties);
 
     mu_run_test(test_get_pixels_in_window);
     mu_run_test(test_weight_scores_per_scale);
@@ -0,0 +1,87 @@
+/*
+ * Synthetic source clip shared by the benchmarks.
+ *
+ * Every request returns the same pregenerated frame, so that only the filters
+ * under test are timed.
+ */
+
+#ifndef BENCH_BENCHSOURCE_H
+#define BENCH_BENCHSOURCE_H
+
+#include <cstdint>
+#include <random>
+
+#include "VapourSynth4.h"
+
+namespace bench {
+
+enum class Pattern {
+    Noise, // uniform noise over the whole range (0-1 for float)
+    Gradient, // a horizontal gradient of 64 steps with a little noise, so that Cambi finds bands
+};
+
+struct SourceData {
+    const VSFrame *frame;
+    bool benchValue;
+};
+
+// With benchValue, every request gets a copy of the frame with the frame
+// property BenchValue set to n % 17, so that property readers see changing
+// values.
+inline const VSFrame *VS_CC sourceGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    SourceData *d = static_cast<SourceData *>(instanceData);
+    if (activationReason != arInitial)
+        return nullptr;
+    if (!d->benchValue)
+        return vsapi->addFrameRef(d->frame);
+    VSFrame *f = vsapi->copyFrame(d->frame, core);
+    vsapi->mapSetFloat(vsapi->getFramePropertiesRW(f), "BenchValue", n % 17, maReplace);
+    return f;
+}
+
+inline void VS_CC sourceFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    SourceData *d = static_cast<SourceData *>(instanceData);
+    vsapi->freeFrame(d->frame);
+    delete d;
+}
+
+// Gradient only supports integer formats.
+inline VSNode *createSource(const VSVideoFormat &format, int width, int height, int numFrames, Pattern pattern, bool benchValue, unsigned seed, VSCore *core, const VSAPI *vsapi) {
+    VSFrame *frame = vsapi->newVideoFrame(&format, width, height, nullptr, core);
+    std::mt19937 rng(seed);
+    for (int plane = 0; plane < format.numPlanes; plane++) {
+        uint8_t *p = vsapi->getWritePtr(frame, plane);
+        const ptrdiff_t stride = vsapi->getStride(frame, plane);
+        const int w = vsapi->getFrameWidth(frame, plane), h = vsapi->getFrameHeight(frame, plane);
+        for (int y = 0; y < h; y++, p += stride) {
+            for (int x = 0; x < w; x++) {
+                if (pattern == Pattern::Gradient) {
+                    const unsigned v = (static_cast<unsigned>(x) * 63 / w) + (rng() & 1);
+                    if (format.bytesPerSample == 2)
+                        reinterpret_cast<uint16_t *>(p)[x] = static_cast<uint16_t>(v << (format.bitsPerSample - 6));
+                    else
+                        p[x] = static_cast<uint8_t>(v << 2);
+                } else if (format.sampleType == stFloat) {
+                    reinterpret_cast<float *>(p)[x] = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+                } else if (format.bytesPerSample == 2) {
+                    reinterpret_cast<uint16_t *>(p)[x] = static_cast<uint16_t>(rng() & ((1u << format.bitsPerSample) - 1));
+                } else {
+                    p[x] = static_cast<uint8_t>(rng());
+                }
+            }
+        }
+    }
+
+    VSVideoInfo vi = {};
+    vi.format = format;
+    vi.fpsNum = 25;
+    vi.fpsDen = 1;
+    vi.width = width;
+    vi.height = height;
+    vi.numFrames = numFrames;
+    return vsapi->createVideoFilter2("BenchSource", &vi, sourceGetFrame, sourceFree, fmParallel, nullptr, 0, new SourceData{ frame, benchValue }, core);
+}
+
+} // namespace bench
+
+#endif // BENCH_BENCHSOURCE_H
@@ -0,0 +1,187 @@
+/*
+ * Cambi micro-benchmark.
+ *
+ * Scores synthetic banded gradients at 1080p and 4K in 8 and 10 bits,
+ * checks each score against its reference value and reports the throughput
+ * of the whole measurement along with the time spent in every stage.
+ *
+ *   cambibench [-n frames] [-t threads]
+ *
+ * The stages are timed by replaying cambi_score step by step; the replayed
+ * score must match cambi_extract, so the breakdown cannot drift from the
+ * real pipeline. Exits with a non-zero status if any score is off.
+ */
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../banding/libvmaf/cambi.c"
+
+#ifdef _WIN32
+static double now(void) {
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return (double)t.QuadPart / f.QuadPart;
+}
+#else
+#include <time.h>
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#endif
+
+enum { PREPROCESS, MASK, DECIMATE, MODE, C_VALUES, POOLING, NUM_STAGES };
+
+static const char *const stageNames[NUM_STAGES] = {
+    "preprocess", "mask", "decimate", "mode", "c_values", "pooling",
+};
+
+typedef struct {
+    const char *name;
+    unsigned width;
+    unsigned height;
+    int bpc;
+    double score; // reference score with the default settings
+} Case;
+
+static const Case cases[] = {
+    { "1080p 8-bit", 1920, 1080, 8, 12.908874745 },
+    { "1080p 10-bit", 1920, 1080, 10, 13.329527675 },
+    { "4K 8-bit", 3840, 2160, 8, 12.835204460 },
+    { "4K 10-bit", 3840, 2160, 10, 13.455633006 },
+};
+
+// A shallow two-dimensional ramp, quantised into visible bands, with sparse
+// single-step dither so that the mask does not reject the whole frame.
+static void fill_gradient(VmafPicture *pic) {
+    const unsigned w = pic->w[0], h = pic->h[0];
+    const int shift = pic->bpc - 8;
+    for (unsigned y = 0; y < h; y++) {
+        uint8_t *row = (uint8_t *)pic->data[0] + y * pic->stride[0];
+        for (unsigned x = 0; x < w; x++) {
+            unsigned v = (40 + x * 12 / w + y * 3 / h + ((x * 7 + y * 13) % 29 == 0)) << shift;
+            if (pic->bpc > 8)
+                ((uint16_t *)row)[x] = v;
+            else
+                row[x] = v;
+        }
+    }
+}
+
+// cambi_score split into its stages, accumulating their run time.
+static double timed_score(CambiState *s, VmafPicture *pic, double *times) {
+    double scores_per_scale[NUM_SCALES];
+    VmafPicture *image = &s->pics[0];
+    VmafPicture *mask = &s->pics[1];
+
+    double t = now(), t1;
+    cambi_preprocessing(pic, image);
+    t1 = now(); times[PREPROCESS] += t1 - t; t = t1;
+
+    unsigned scaled_width = image->w[0];
+    unsigned scaled_height = image->h[0];
+    for (unsigned scale = 0; scale < NUM_SCALES; scale++) {
+        if (scale > 0) {
+            scale_dimension(&scaled_width, 1);
+            scale_dimension(&scaled_height, 1);
+            decimate(image, scaled_width, scaled_height);
+            decimate(mask, scaled_width, scaled_height);
+            t1 = now(); times[DECIMATE] += t1 - t; t = t1;
+        } else {
+            get_spatial_mask(image, mask, s->mask_dp, scaled_width, scaled_height, s->ref_width, s->ref_height);
+            t1 = now(); times[MASK] += t1 - t; t = t1;
+        }
+
+        filter_mode(image, scaled_width, scaled_height);
+        t1 = now(); times[MODE] += t1 - t; t = t1;
+
+        calculate_c_values(image, mask, s->c_values, scaled_width, s->c_values_histograms, s->window_size,
+                           s->tvi_for_diff, scaled_width, scaled_height, s->threads);
+        t1 = now(); times[C_VALUES] += t1 - t; t = t1;
+
+        scores_per_scale[scale] = spatial_pooling(s->c_values, s->topk, scaled_width, scaled_height,
+                                                  scaled_width, s->pooling_histogram);
+        t1 = now(); times[POOLING] += t1 - t; t = t1;
+    }
+
+    return weight_scores_per_scale(scores_per_scale, get_pixels_in_window(s->window_size));
+}
+
+int main(int argc, char **argv) {
+    int frames = 20;
+    unsigned threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else {
+            frames = 0;
+            break;
+        }
+    }
+    if (frames < 1 || threads < 1 || threads > CAMBI_MAX_THREADS) {
+        fprintf(stderr, "usage: %s [-n frames] [-t threads]\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    printf("%-13s %12s %9s", "case", "score", "Mpix/s");
+    for (int i = 0; i < NUM_STAGES; i++)
+        printf(" %10s", stageNames[i]);
+    printf("  (ms/frame)\n");
+
+    for (size_t c = 0; c < sizeof cases / sizeof cases[0]; c++) {
+        const Case *k = &cases[c];
+        VmafPicture pic;
+        CambiState s;
+        cambi_config(&s);
+        s.threads = threads;
+        if (vmaf_picture_alloc(&pic, VMAF_PIX_FMT_YUV400P, k->bpc, k->width, k->height) ||
+            cambi_init(&s, k->width, k->height)) {
+            fprintf(stderr, "%s: allocation failed\n", k->name);
+            return 1;
+        }
+        fill_gradient(&pic);
+
+        double score;
+        cambi_extract(&s, &pic, &score, NULL); // warm up
+        double start = now();
+        for (int n = 0; n < frames; n++)
+            cambi_extract(&s, &pic, &score, NULL);
+        double elapsed = now() - start;
+
+        double times[NUM_STAGES] = { 0 };
+        double staged = 0;
+        for (int n = 0; n < frames; n++)
+            staged = timed_score(&s, &pic, times);
+
+        const char *status = "";
+        if (staged != score) {
+            status = "  STAGES DIFFER";
+            failed = 1;
+        } else if (fabs(score - k->score) > 1e-6) {
+            status = "  SCORE MISMATCH";
+            failed = 1;
+        }
+
+        printf("%-13s %12.9f %9.1f", k->name, score, (double)k->width * k->height * frames / elapsed / 1e6);
+        for (int i = 0; i < NUM_STAGES; i++)
+            printf(" %10.3f", times[i] / frames * 1e3);
+        printf("%s\n", status);
+        fflush(stdout);
+
+        cambi_close(&s);
+        vmaf_picture_unref(&pic);
+    }
+    return failed;
+}
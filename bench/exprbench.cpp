@@ -0,0 +1,209 @@
+/*
+ * Expr micro-benchmark.
+ *
+ * Loads one or more builds of the plugin (e.g. an LLVM build and an asmjit
+ * build, which cannot share a core as they use the same identifier), runs a
+ * library of representative expressions on synthetic frames of several
+ * formats and sizes, and reports the throughput of every backend variant in
+ * Mpix/s.
+ *
+ *   exprbench [-n frames] [-e name] plugin [plugin ...]
+ *
+ * The legacy backend picks its ISA level from the CPU_LEVEL environment
+ * variable (0 runs the interpreter), so run it once per level of interest.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "VapourSynth4.h"
+
+#include "benchsource.h"
+
+namespace {
+
+struct Benchmark {
+    const char *name;
+    const char *expr;
+    int inputs;
+};
+
+// Each entry stresses a different part of the code generators.
+const Benchmark benchmarks[] = {
+    { "arith", "x y + 2 /", 2 },
+    { "lerp", "x y - 0.25 * y + 1.5 pow", 2 },
+    { "rel", "x[-1,0] x[1,0] + x[0,-1] + x[0,1] + x 4 * - abs", 1 },
+    { "sort", "x[-1,-1] x[0,-1] x[1,-1] x[-1,0] x x[1,0] x[-1,1] x[0,1] x[1,1] sort9 drop4 swap4 drop4", 1 },
+    { "transcendental", "x 1000 / exp x 1 + log + x 0.01 * sin +", 1 },
+    { "many", "x y + z + a + b + c + d + e + 8 /", 8 },
+};
+
+struct Format {
+    const char *name;
+    int sampleType;
+    int bits;
+};
+
+const Format formats[] = {
+    { "Gray8", stInteger, 8 },
+    { "Gray16", stInteger, 16 },
+    { "GrayS", stFloat, 32 },
+};
+
+struct Size {
+    int width;
+    int height;
+};
+
+const Size sizes[] = {
+    { 640, 360 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+// A backend variant is the set of extra arguments passed to Expr.
+struct Variant {
+    const char *name;
+    const char *key;
+    int value;
+};
+
+const Variant expr2Variants[] = {
+    { "lanes=4", "lanes", 4 },
+    { "lanes=8", "lanes", 8 },
+};
+
+const Variant legacyVariants[] = {
+    { "default", nullptr, 0 },
+};
+
+const int numFrames = 1 << 20;
+
+// Returns the throughput in Mpix/s, or a negative value with error filled in
+// if Expr rejected the expression.
+double run(const Benchmark &b, const Format &f, const Size &s, const Variant &v, int frames, VSPlugin *akarin, VSCore *core, const VSAPI *vsapi, std::string &error) {
+    VSVideoFormat format;
+    vsapi->queryVideoFormat(&format, cfGray, f.sampleType, f.bits, 0, 0, core);
+
+    VSMap *args = vsapi->createMap();
+    for (int i = 0; i < b.inputs; i++)
+        vsapi->mapConsumeNode(args, "clips", bench::createSource(format, s.width, s.height, numFrames, bench::Pattern::Noise, false, 1234 + i, core, vsapi), maAppend);
+    vsapi->mapSetData(args, "expr", b.expr, -1, dtUtf8, maReplace);
+    if (v.key)
+        vsapi->mapSetInt(args, v.key, v.value, maReplace);
+    VSMap *ret = vsapi->invoke(akarin, "Expr", args);
+    vsapi->freeMap(args);
+    if (const char *err = vsapi->mapGetError(ret)) {
+        error = err;
+        vsapi->freeMap(ret);
+        return -1;
+    }
+    VSNode *node = vsapi->mapGetNode(ret, "clip", 0, nullptr);
+    vsapi->freeMap(ret);
+
+    // The first frame includes compilation (or the wait for it with async).
+    char errMsg[1024];
+    const VSFrame *frame = vsapi->getFrame(0, node, errMsg, sizeof(errMsg));
+    if (!frame) {
+        error = errMsg;
+        vsapi->freeNode(node);
+        return -1;
+    }
+    vsapi->freeFrame(frame);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 1; n <= frames; n++) {
+        frame = vsapi->getFrame(n, node, errMsg, sizeof(errMsg));
+        if (!frame) {
+            error = errMsg;
+            vsapi->freeNode(node);
+            return -1;
+        }
+        vsapi->freeFrame(frame);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    vsapi->freeNode(node);
+    return static_cast<double>(s.width) * s.height * frames / elapsed.count() / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    int frames = 50;
+    const char *only = nullptr;
+    std::vector<const char *> plugins;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+            only = argv[++i];
+        else
+            plugins.push_back(argv[i]);
+    }
+    if (plugins.empty() || frames < 1) {
+        fprintf(stderr, "usage: %s [-n frames] [-e name] plugin [plugin ...]\n", argv[0]);
+        return 1;
+    }
+
+    const VSAPI *vsapi = getVapourSynthAPI(VAPOURSYNTH_API_VERSION);
+    if (!vsapi) {
+        fprintf(stderr, "failed to initialize VapourSynth\n");
+        return 1;
+    }
+
+    printf("%-8s %-9s %-16s %-7s %-10s %10s\n", "backend", "variant", "expr", "format", "size", "Mpix/s");
+    for (const char *path : plugins) {
+        // Single threaded so that the numbers reflect the generated code.
+        VSCore *core = vsapi->createCore(ccfDisableAutoLoading);
+        vsapi->setThreadCount(1, core);
+
+        VSMap *args = vsapi->createMap();
+        vsapi->mapSetData(args, "path", path, -1, dtUtf8, maReplace);
+        VSMap *ret = vsapi->invoke(vsapi->getPluginByID("com.vapoursynth.std", core), "LoadPlugin", args);
+        vsapi->freeMap(args);
+        if (const char *err = vsapi->mapGetError(ret)) {
+            fprintf(stderr, "%s: %s\n", path, err);
+            vsapi->freeMap(ret);
+            vsapi->freeCore(core);
+            return 1;
+        }
+        vsapi->freeMap(ret);
+
+        VSPlugin *akarin = vsapi->getPluginByID("info.akarin.vsplugin", core);
+        args = vsapi->createMap();
+        ret = vsapi->invoke(akarin, "Version", args);
+        vsapi->freeMap(args);
+        std::string backend = vsapi->mapGetData(ret, "expr_backend", 0, nullptr);
+        vsapi->freeMap(ret);
+
+        const bool legacy = backend == "jitasm";
+        const Variant *variants = legacy ? legacyVariants : expr2Variants;
+        const size_t numVariants = legacy ? std::size(legacyVariants) : std::size(expr2Variants);
+
+        for (const auto &b : benchmarks) {
+            if (only && strcmp(only, b.name))
+                continue;
+            for (const auto &f : formats) {
+                for (const auto &s : sizes) {
+                    for (size_t i = 0; i < numVariants; i++) {
+                        std::string error;
+                        double mpix = run(b, f, s, variants[i], frames, akarin, core, vsapi, error);
+                        std::string size = std::to_string(s.width) + "x" + std::to_string(s.height);
+                        if (mpix < 0)
+                            printf("%-8s %-9s %-16s %-7s %-10s %10s  (%s)\n", backend.c_str(), variants[i].name, b.name, f.name, size.c_str(), "-", error.c_str());
+                        else
+                            printf("%-8s %-9s %-16s %-7s %-10s %10.1f\n", backend.c_str(), variants[i].name, b.name, f.name, size.c_str(), mpix);
+                        fflush(stdout);
+                    }
+                }
+            }
+        }
+        vsapi->freeCore(core);
+    }
+    return 0;
+}
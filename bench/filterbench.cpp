@@ -0,0 +1,373 @@
+/*
+ * End-to-end filter benchmark.
+ *
+ * Loads a build of the plugin into a VapourSynth core and runs Expr, Select,
+ * PropExpr, Text, Tmpl and Cambi with representative arguments over synthetic
+ * clips at several sizes and thread counts. Frames are requested the way
+ * vspipe does, keeping as many requests in flight as the core has threads.
+ * The results are written as JSON: the throughput in fps, percentiles of the
+ * time from request to delivery of a frame, and the peak resident set size.
+ *
+ *   filterbench [-n frames] [-t threads,...] [-f filter] [-o out.json] plugin
+ *
+ * Every case runs on a core of its own, after a few untimed frames (which
+ * include the compilation of Expr). The peak RSS is that of the whole process
+ * when a case ends, so it only grows from one case to the next; use -f to
+ * measure the filters in isolation. Exits with a non-zero status if a case
+ * fails.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "VapourSynth4.h"
+
+#include "benchsource.h"
+
+namespace {
+
+const int warmupFrames = 4;
+const int numClipFrames = 1 << 20;
+
+void VS_CC propExprDict(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    vsapi->mapSetData(out, "Scaled", "x.BenchValue 2 * 1 +", -1, dtUtf8, maReplace);
+    vsapi->mapSetData(out, "Phase", "N 3 %", -1, dtUtf8, maReplace);
+    vsapi->mapSetData(out, "Average", "x[-2..2].BenchValue:avg", -1, dtUtf8, maReplace);
+}
+
+// Sets the arguments of the filter, which takes the clips of the case.
+typedef void (*SetArgs)(VSMap *args, const std::vector<VSNode *> &clips, VSCore *core, const VSAPI *vsapi);
+
+struct Case {
+    const char *filter;
+    const char *name;
+    int inputs;
+    int bits;
+    SetArgs setArgs;
+};
+
+void setClips(VSMap *args, const char *key, const std::vector<VSNode *> &clips, const VSAPI *vsapi) {
+    for (auto node : clips)
+        vsapi->mapSetNode(args, key, node, maAppend);
+}
+
+const Case cases[] = {
+    { "Expr", "arith", 2, 8, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        setClips(args, "clips", clips, vsapi);
+        vsapi->mapSetData(args, "expr", "x y + 2 /", -1, dtUtf8, maReplace);
+    } },
+    { "Expr", "rel", 1, 8, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        setClips(args, "clips", clips, vsapi);
+        vsapi->mapSetData(args, "expr", "x[-1,0] x[1,0] + x[0,-1] + x[0,1] + x 4 * - abs", -1, dtUtf8, maReplace);
+    } },
+    { "Expr", "props16", 1, 16, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        setClips(args, "clips", clips, vsapi);
+        vsapi->mapSetData(args, "expr", "x x.BenchValue 256 * + 0.5 pow 256 *", -1, dtUtf8, maReplace);
+    } },
+    { "Select", "expr", 2, 8, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        setClips(args, "clip_src", clips, vsapi);
+        vsapi->mapSetNode(args, "prop_src", clips[0], maAppend);
+        vsapi->mapSetData(args, "expr", "x.BenchValue 8 > 1 0 ?", -1, dtUtf8, maReplace);
+    } },
+    { "PropExpr", "dict", 1, 8, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *core, const VSAPI *vsapi) {
+        setClips(args, "clips", clips, vsapi);
+        vsapi->mapConsumeFunction(args, "dict", vsapi->createFunction(propExprDict, nullptr, nullptr, core), maReplace);
+    } },
+    { "Text", "draw", 1, 8, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        setClips(args, "clips", clips, vsapi);
+        vsapi->mapSetData(args, "text", "frame {N}: {BenchValue:.2f}", -1, dtUtf8, maReplace);
+    } },
+    { "Text", "prop", 1, 8, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        setClips(args, "clips", clips, vsapi);
+        vsapi->mapSetData(args, "text", "frame {N}: {BenchValue:.2f}", -1, dtUtf8, maReplace);
+        vsapi->mapSetData(args, "prop", "BenchText", -1, dtUtf8, maReplace);
+    } },
+    { "Tmpl", "prop", 1, 8, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        setClips(args, "clips", clips, vsapi);
+        vsapi->mapSetData(args, "prop", "BenchText", -1, dtUtf8, maReplace);
+        vsapi->mapSetData(args, "text", "frame {{ N }}: {% if x.BenchValue > 8 %}high{% else %}low{% endif %}", -1, dtUtf8, maReplace);
+    } },
+    { "Cambi", "8bit", 1, 8, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        vsapi->mapSetNode(args, "clip", clips[0], maReplace);
+    } },
+    { "Cambi", "10bit", 1, 10, [](VSMap *args, const std::vector<VSNode *> &clips, VSCore *, const VSAPI *vsapi) {
+        vsapi->mapSetNode(args, "clip", clips[0], maReplace);
+    } },
+};
+
+struct Size {
+    int width;
+    int height;
+};
+
+const Size sizes[] = {
+    { 1280, 720 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+struct Result {
+    double fps = 0;
+    double p50 = 0, p90 = 0, p99 = 0, max = 0; // ms
+    double peakRss = 0; // MiB
+    std::string error;
+};
+
+double peakRssMiB() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.PeakWorkingSetSize / 1048576.0;
+#else
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru))
+        return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1048576.0; // bytes
+#else
+    return ru.ru_maxrss / 1024.0; // KiB
+#endif
+#endif
+}
+
+using Clock = std::chrono::steady_clock;
+
+// The frames of one timed run, delivered by getFrameAsync.
+struct Requests {
+    std::mutex lock;
+    std::condition_variable done;
+    std::vector<Clock::time_point> issued;
+    std::vector<double> latency; // ms
+    int pending = 0;
+    std::string error;
+    const VSAPI *vsapi;
+};
+
+void VS_CC frameDone(void *userData, const VSFrame *f, int n, VSNode *node, const char *errorMsg) {
+    Requests *r = static_cast<Requests *>(userData);
+    const auto now = Clock::now();
+    r->vsapi->freeFrame(f);
+    std::lock_guard<std::mutex> guard(r->lock);
+    r->latency[n] = std::chrono::duration<double, std::milli>(now - r->issued[n]).count();
+    if (!f && r->error.empty())
+        r->error = errorMsg ? errorMsg : "frame request failed";
+    r->pending--;
+    r->done.notify_one();
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    const size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p * (sorted.size() - 1) + 0.5));
+    return sorted[i];
+}
+
+Result run(const Case &c, const Size &s, int threads, int frames, const char *path, const VSAPI *vsapi) {
+    Result res;
+    VSCore *core = vsapi->createCore(ccfDisableAutoLoading);
+    vsapi->setThreadCount(threads, core);
+
+    VSMap *args = vsapi->createMap();
+    vsapi->mapSetData(args, "path", path, -1, dtUtf8, maReplace);
+    VSMap *ret = vsapi->invoke(vsapi->getPluginByID("com.vapoursynth.std", core), "LoadPlugin", args);
+    vsapi->freeMap(args);
+    if (const char *err = vsapi->mapGetError(ret)) {
+        res.error = err;
+        vsapi->freeMap(ret);
+        vsapi->freeCore(core);
+        return res;
+    }
+    vsapi->freeMap(ret);
+    VSPlugin *akarin = vsapi->getPluginByID("info.akarin.vsplugin", core);
+
+    VSVideoFormat format;
+    vsapi->queryVideoFormat(&format, cfYUV, stInteger, c.bits, 1, 1, core);
+    std::vector<VSNode *> clips;
+    for (int i = 0; i < c.inputs; i++)
+        clips.push_back(bench::createSource(format, s.width, s.height, numClipFrames, bench::Pattern::Gradient, true, 1234 + i, core, vsapi));
+    args = vsapi->createMap();
+    c.setArgs(args, clips, core, vsapi);
+    for (auto node : clips)
+        vsapi->freeNode(node);
+    ret = vsapi->invoke(akarin, c.filter, args);
+    vsapi->freeMap(args);
+    if (const char *err = vsapi->mapGetError(ret)) {
+        res.error = err;
+        vsapi->freeMap(ret);
+        vsapi->freeCore(core);
+        return res;
+    }
+    VSNode *node = vsapi->mapGetNode(ret, "clip", 0, nullptr);
+    vsapi->freeMap(ret);
+
+    char errMsg[1024];
+    for (int n = 0; n < warmupFrames; n++) {
+        const VSFrame *f = vsapi->getFrame(n, node, errMsg, sizeof(errMsg));
+        if (!f) {
+            res.error = errMsg;
+            vsapi->freeNode(node);
+            vsapi->freeCore(core);
+            return res;
+        }
+        vsapi->freeFrame(f);
+    }
+
+    Requests r;
+    r.vsapi = vsapi;
+    r.issued.resize(warmupFrames + frames);
+    r.latency.resize(warmupFrames + frames);
+    const auto start = Clock::now();
+    {
+        std::unique_lock<std::mutex> guard(r.lock);
+        for (int n = warmupFrames; n < warmupFrames + frames; n++) {
+            r.done.wait(guard, [&] { return r.pending < threads; });
+            r.issued[n] = Clock::now();
+            r.pending++;
+            guard.unlock();
+            vsapi->getFrameAsync(n, node, frameDone, &r);
+            guard.lock();
+        }
+        r.done.wait(guard, [&] { return r.pending == 0; });
+    }
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    vsapi->freeNode(node);
+    vsapi->freeCore(core);
+
+    if (!r.error.empty()) {
+        res.error = r.error;
+        return res;
+    }
+    std::vector<double> latency(r.latency.begin() + warmupFrames, r.latency.end());
+    std::sort(latency.begin(), latency.end());
+    res.fps = frames / elapsed;
+    res.p50 = percentile(latency, 0.5);
+    res.p90 = percentile(latency, 0.9);
+    res.p99 = percentile(latency, 0.99);
+    res.max = latency.back();
+    res.peakRss = peakRssMiB();
+    return res;
+}
+
+std::string jsonString(const std::string &s) {
+    std::string out = "\"";
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (static_cast<unsigned char>(ch) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            out += buf;
+        } else {
+            out += ch;
+        }
+    }
+    return out + "\"";
+}
+
+std::string pluginVersion(const char *path, const VSAPI *vsapi) {
+    std::string version;
+    VSCore *core = vsapi->createCore(ccfDisableAutoLoading);
+    VSMap *args = vsapi->createMap();
+    vsapi->mapSetData(args, "path", path, -1, dtUtf8, maReplace);
+    VSMap *ret = vsapi->invoke(vsapi->getPluginByID("com.vapoursynth.std", core), "LoadPlugin", args);
+    vsapi->freeMap(args);
+    if (!vsapi->mapGetError(ret)) {
+        vsapi->freeMap(ret);
+        args = vsapi->createMap();
+        ret = vsapi->invoke(vsapi->getPluginByID("info.akarin.vsplugin", core), "Version", args);
+        vsapi->freeMap(args);
+        if (const char *v = vsapi->mapGetData(ret, "version", 0, nullptr))
+            version = v;
+    }
+    vsapi->freeMap(ret);
+    vsapi->freeCore(core);
+    return version;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    int frames = 100;
+    const char *only = nullptr, *output = nullptr, *path = nullptr;
+    std::vector<int> threadCounts;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            char *p = argv[++i];
+            do {
+                threadCounts.push_back(static_cast<int>(strtol(p, &p, 10)));
+            } while (*p++ == ',');
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            only = argv[++i];
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            path = argv[i];
+        }
+    }
+    if (threadCounts.empty())
+        threadCounts = { 1, static_cast<int>(std::max(1u, std::thread::hardware_concurrency())) };
+    if (!path || frames < 1 || *std::min_element(threadCounts.begin(), threadCounts.end()) < 1) {
+        fprintf(stderr, "usage: %s [-n frames] [-t threads,...] [-f filter] [-o out.json] plugin\n", argv[0]);
+        return 1;
+    }
+    threadCounts.erase(std::unique(threadCounts.begin(), threadCounts.end()), threadCounts.end());
+
+    const VSAPI *vsapi = getVapourSynthAPI(VAPOURSYNTH_API_VERSION);
+    if (!vsapi) {
+        fprintf(stderr, "failed to initialize VapourSynth\n");
+        return 1;
+    }
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "cannot open %s\n", output);
+        return 1;
+    }
+
+    bool failed = false;
+    fprintf(out, "{\n  \"plugin\": %s,\n  \"version\": %s,\n  \"frames\": %d,\n  \"results\": [", jsonString(path).c_str(), jsonString(pluginVersion(path, vsapi)).c_str(), frames);
+    const char *sep = "\n";
+    for (const auto &c : cases) {
+        if (only && strcmp(only, c.filter))
+            continue;
+        for (const auto &s : sizes) {
+            for (int threads : threadCounts) {
+                Result r = run(c, s, threads, frames, path, vsapi);
+                fprintf(out, "%s    {\"filter\": \"%s\", \"case\": \"%s\", \"width\": %d, \"height\": %d, \"bits\": %d, \"threads\": %d, ",
+                        sep, c.filter, c.name, s.width, s.height, c.bits, threads);
+                if (r.error.empty()) {
+                    fprintf(out, "\"fps\": %.2f, \"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}, \"peak_rss_mib\": %.1f}",
+                            r.fps, r.p50, r.p90, r.p99, r.max, r.peakRss);
+                } else {
+                    fprintf(out, "\"error\": %s}", jsonString(r.error).c_str());
+                    fprintf(stderr, "%s %s %dx%d threads=%d: %s\n", c.filter, c.name, s.width, s.height, threads, r.error.c_str());
+                    failed = true;
+                }
+                sep = ",\n";
+                fflush(out);
+            }
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (output)
+        fclose(out);
+    return failed ? 1 : 0;
+}
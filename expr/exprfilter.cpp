@@ -19,6 +19,7 @@
 */
 
 #include <algorithm>
+#include <charconv>
 #include <cmath>
 #include <functional>
 #include <iostream>
@@ -26,7 +27,9 @@
 #include <locale>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <numbers>
+#include <regex>
 #include <set>
 #include <sstream>
 #include <stdexcept>
@@ -54,8 +57,6 @@
 
 namespace {
 
-#define MAX_EXPR_INPUTS 26
-
 enum class ExprOpType {
     // Terminals.
     MEM_LOAD_U8, MEM_LOAD_U16, MEM_LOAD_F16, MEM_LOAD_F32, CONSTANT, MEM_LOAD_CONST,
@@ -86,6 +87,7 @@ enum class ExprOpType {
 
 std::vector<std::string> features = {
     "sin", "cos", "N", "X", "Y", "%", "trunc", "round", "x.property", "pi",
+    "x[x,y]", "x[x,y]:m", "srcN",
 };
 
 enum class FMAType {
@@ -109,7 +111,7 @@ enum MemConstIndex {
     CONST_Y = 1, // the current row
     CONST_FIRST_PROP = 2, // first property
 
-    CLIP_X = MAX_EXPR_INPUTS, // sentinel clip index for the list of X coordinates
+    CLIP_X = 0x7FFFFFFF, // sentinel clip index for the list of X coordinates
 };
 
 // Technically we only want to avoid clang-cl
@@ -159,11 +161,42 @@ bool operator<(const PropAccess &lhs, const PropAccess &rhs) {
     return lhs.name < rhs.name;
 }
 
+// A static relative pixel access x[x,y]. Each distinct access is handed to the
+// generated code as an extra input, a pointer at its offset into the padded
+// rows of its RelSource.
+struct RelAccess {
+    int clip;
+    int x;
+    int y;
+    int boundary; // -1 (unspecified, use the filter default), 0 (clamped) or 1 (mirrored)
+
+    RelAccess(int i = -1, int x = 0, int y = 0, int bc = -1) : clip(i), x(x), y(y), boundary(bc) {}
+};
+
+bool operator<(const RelAccess &lhs, const RelAccess &rhs) {
+    return std::tie(lhs.clip, lhs.x, lhs.y, lhs.boundary) < std::tie(rhs.clip, rhs.x, rhs.y, rhs.boundary);
+}
+
+// A plane read by relative accesses. getFrame copies it row by row into a
+// ring of 2 * padY + 1 rows, which extend padX pixels past either side of the
+// plane with their edges clamped or mirrored, and which hold the rows at
+// vertical offsets -padY...padY of the current one (resolved at the top and
+// bottom edges the same way). The accesses then read the ring at their
+// offset, so the plane is copied once per frame however many accesses there
+// are, and the ring stays in cache.
+struct RelSource {
+    int clip;
+    int boundary;
+    int padX;
+    int padY;
+};
+
 struct Token {
     ExprOp op;
     PropAccess prop;
+    RelAccess rel;
 
-    Token(ExprOpType type, ExprUnion param = {}, PropAccess pa = {}) : op(type, param), prop(pa) {}
+    Token(ExprOpType type, ExprUnion param = {}, PropAccess pa = {}, RelAccess ra = {}) : op(type, param), prop(pa), rel(ra) {}
 };
 
 bool operator==(const Token &lhs, const Token &rhs) { return lhs.op == rhs.op && lhs.prop == rhs.prop; }
@@ -183,34 +216,74 @@ enum PlaneOp {
     poProcess, poCopy, poUndefined
 };
 
-struct ExprData {
-    VSNode *node[MAX_EXPR_INPUTS];
-    VSVideoInfo vi;
-    std::vector<ExprInstruction> bytecode[3];
-    std::vector<PropAccess> pa[3];
-    int plane[3];
-    int numInputs;
-    typedef void (*ProcessLineProc)(void *rwptrs, intptr_t ptroff[MAX_EXPR_INPUTS + 1], float *consts, intptr_t niter);
-    ProcessLineProc proc[3];
-    size_t procSize[3];
-
-    ExprData() : node(), vi(), plane(), numInputs(), proc() {}
-
-    ~ExprData() {
+// The compiled form of one plane expression. Programs are immutable once built
+// and shared between all nodes that use the same expression and formats.
+struct ExprProgram {
+    std::vector<ExprInstruction> bytecode;
+    std::vector<PropAccess> pa;
+    std::vector<RelAccess> rel; // extra inputs, following the clips
+    std::vector<RelSource> relSources;
+    std::vector<int> relSource; // index into relSources of every entry of rel
+    // Processes nrows rows of niter steps each. After every step, each of the
+    // pointers in rwptrs is advanced by the matching entry of ptroff, and after
+    // every row by rowadj, and consts[CONST_Y] is incremented.
+    typedef void (*ProcessPlaneProc)(void *rwptrs, intptr_t ptroff[], float *consts, intptr_t niter, intptr_t rowadj[], intptr_t nrows);
+    ProcessPlaneProc proc;
+    size_t procSize;
+    int step; // pixels per step of proc
+    // Output samples for every combination of input values if the program is
+    // applied as a lookup table, indexed by the pixel of lutClip[0], or by
+    // (lutClip[0] << 8) | lutClip[1] for two 8 bit clips.
+    std::vector<uint8_t> lut;
+    int lutClip[2];
+
+    ExprProgram() : proc(), procSize(), step(8), lutClip() {}
+    ExprProgram(const ExprProgram &) = delete;
+    ExprProgram &operator=(const ExprProgram &) = delete;
+
+    ~ExprProgram() {
 #ifdef VS_TARGET_CPU_X86
-        for (int i = 0; i < 3; i++) {
-            if (proc[i]) {
+        if (proc) {
 #ifdef VS_TARGET_OS_WINDOWS
-                VirtualFree((LPVOID)proc[i], 0, MEM_RELEASE);
+            VirtualFree((LPVOID)proc, 0, MEM_RELEASE);
 #else
-                munmap((void *)proc[i], procSize[i]);
+            munmap((void *)proc, procSize);
 #endif
-            }
         }
 #endif
     }
 };
 
+struct ExprData {
+    std::vector<VSNode *> node;
+    VSVideoInfo vi;
+    std::shared_ptr<const ExprProgram> program[3];
+    int plane[3];
+    int numInputs;
+    typedef ExprProgram::ProcessPlaneProc ProcessPlaneProc;
+
+    // Memory for the rings of RelSource rows, kept across frames. Each frame
+    // in flight takes one buffer, which only ever grows.
+    std::mutex ringLock;
+    std::vector<std::unique_ptr<std::vector<uint8_t>>> idleRings;
+
+    std::unique_ptr<std::vector<uint8_t>> acquireRing() {
+        std::lock_guard<std::mutex> guard(ringLock);
+        if (idleRings.empty())
+            return std::make_unique<std::vector<uint8_t>>();
+        auto ring = std::move(idleRings.back());
+        idleRings.pop_back();
+        return ring;
+    }
+
+    void releaseRing(std::unique_ptr<std::vector<uint8_t>> ring) {
+        std::lock_guard<std::mutex> guard(ringLock);
+        idleRings.push_back(std::move(ring));
+    }
+
+    ExprData() : vi(), plane(), numInputs() {}
+};
+
 #ifdef VS_TARGET_CPU_X86
 class ExprCompiler {
     virtual void load8(const ExprInstruction &insn) = 0;
@@ -298,13 +371,15 @@ public:
     }
 
     virtual ~ExprCompiler() {}
-    virtual std::pair<ExprData::ProcessLineProc, size_t> getCode() = 0;
+    // Pixels processed per step of the routine.
+    virtual int pixelsPerStep() const { return 8; }
+    virtual std::pair<ExprData::ProcessPlaneProc, size_t> getCode() = 0;
 };
 
-class ExprCompiler128 : public ExprCompiler, private jitasm::function<void, ExprCompiler128, uint8_t *, const intptr_t *, const float *, intptr_t> {
-    typedef jitasm::function<void, ExprCompiler128, uint8_t *, const intptr_t *, const float *, intptr_t> jit;
-    friend struct jitasm::function<void, ExprCompiler128, uint8_t *, const intptr_t *, const float *, intptr_t>;
-    friend struct jitasm::function_cdecl<void, ExprCompiler128, uint8_t *, const intptr_t *, const float *, intptr_t>;
+class ExprCompiler128 : public ExprCompiler, private jitasm::function<void, ExprCompiler128, uint8_t *, const intptr_t *, float *, intptr_t, const intptr_t *, intptr_t> {
+    typedef jitasm::function<void, ExprCompiler128, uint8_t *, const intptr_t *, float *, intptr_t, const intptr_t *, intptr_t> jit;
+    friend struct jitasm::function<void, ExprCompiler128, uint8_t *, const intptr_t *, float *, intptr_t, const intptr_t *, intptr_t>;
+    friend struct jitasm::function_cdecl<void, ExprCompiler128, uint8_t *, const intptr_t *, float *, intptr_t, const intptr_t *, intptr_t>;
 
 #define SPLAT(x) { (x), (x), (x), (x) }
     static constexpr ExprUnion constData alignas(16)[56][4] = {
@@ -511,7 +586,7 @@ do { \
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
             mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            VEX1(movdqa, t1.first, xmmword_ptr[a]);
+            VEX1(movdqu, t1.first, xmmword_ptr[a]);
             VEX2(punpckhwd, t1.second, t1.first, zero);
             VEX2(punpcklwd, t1.first, t1.first, zero);
             VEX1(cvtdq2ps, t1.first, t1.first);
@@ -542,8 +617,8 @@ do { \
                 VEX1(movdqa, t1.second, regXs.second);
             } else {
                 mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-                VEX1(movdqa, t1.first, xmmword_ptr[a]);
-                VEX1(movdqa, t1.second, xmmword_ptr[a + 16]);
+                VEX1(movdqu, t1.first, xmmword_ptr[a]);
+                VEX1(movdqu, t1.second, xmmword_ptr[a + 16]);
             }
         });
     }
@@ -1277,7 +1352,29 @@ do { \
         sincos(false, insn);
     }
 
-    void main(Reg regptrs, Reg regoffs, Reg fconsts, Reg niter)
+    // Adds the pointer sized offsets in regoffs to the pointers in regptrs.
+    void advancePointers(Reg regptrs, Reg regoffs)
+    {
+#if UINTPTR_MAX > UINT32_MAX
+        for (int i = 0; i < numInputs / 2 + 1; i++) {
+            XmmReg r1, r2;
+            VEX1(movdqu, r1, xmmword_ptr[regptrs + 16 * i]);
+            VEX1(movdqu, r2, xmmword_ptr[regoffs + 16 * i]);
+            VEX2(paddq, r1, r1, r2);
+            VEX1(movdqu, xmmword_ptr[regptrs + 16 * i], r1);
+        }
+#else
+        for (int i = 0; i < numInputs / 4 + 1; i++) {
+            XmmReg r1, r2;
+            VEX1(movdqu, r1, xmmword_ptr[regptrs + 16 * i]);
+            VEX1(movdqu, r2, xmmword_ptr[regoffs + 16 * i]);
+            VEX2(paddd, r1, r1, r2);
+            VEX1(movdqu, xmmword_ptr[regptrs + 16 * i], r1);
+        }
+#endif
+    }
+
+    void main(Reg regptrs, Reg regoffs, Reg fconsts, Reg niter, Reg regadj, Reg nrows)
     {
         std::unordered_map<int, std::pair<XmmReg, XmmReg>> bytecodeRegs;
         XmmReg zero;
@@ -1288,6 +1385,10 @@ do { \
         auto regXs = std::make_pair(XmmReg(), XmmReg());
         XmmReg eight;
 
+        L("hloop");
+
+        Reg count;
+        mov(count, niter);
         for (const auto &f : prolog) {
             f(regptrs, zero, constants, regXs, eight, fconsts, bytecodeRegs);
         }
@@ -1297,27 +1398,21 @@ do { \
         for (const auto &f : deferred) {
             f(regptrs, zero, constants, regXs, eight, fconsts, bytecodeRegs);
         }
+        advancePointers(regptrs, regoffs);
 
-#if UINTPTR_MAX > UINT32_MAX
-        for (int i = 0; i < numInputs / 2 + 1; i++) {
-            XmmReg r1, r2;
-            VEX1(movdqu, r1, xmmword_ptr[regptrs + 16 * i]);
-            VEX1(movdqu, r2, xmmword_ptr[regoffs + 16 * i]);
-            VEX2(paddq, r1, r1, r2);
-            VEX1(movdqu, xmmword_ptr[regptrs + 16 * i], r1);
-        }
-#else
-        for (int i = 0; i < numInputs / 4 + 1; i++) {
-            XmmReg r1, r2;
-            VEX1(movdqu, r1, xmmword_ptr[regptrs + 16 * i]);
-            VEX1(movdqu, r2, xmmword_ptr[regoffs + 16 * i]);
-            VEX2(paddd, r1, r1, r2);
-            VEX1(movdqu, xmmword_ptr[regptrs + 16 * i], r1);
-        }
-#endif
-
-        jit::sub(niter, 1);
+        jit::sub(count, 1);
         jnz("wloop");
+
+        advancePointers(regptrs, regadj);
+        XmmReg y;
+        VEX1(movss, y, dword_ptr[fconsts + sizeof(float) * CONST_Y]);
+        XmmReg one;
+        VEX1(movss, one, dword_ptr[constants + ConstantIndex::float_one * 16]);
+        VEX2(addss, y, y, one);
+        VEX1(movss, dword_ptr[fconsts + sizeof(float) * CONST_Y], y);
+
+        jit::sub(nrows, 1);
+        jnz("hloop");
     }
 
     void prologue(const std::vector<ExprInstruction> &bytecode) override {
@@ -1353,7 +1448,7 @@ do { \
 public:
     explicit ExprCompiler128(int numInputs) : cpuFeatures(*getCPUFeatures()), numInputs(numInputs), curLabel(), usedX(false) {}
 
-    std::pair<ExprData::ProcessLineProc, size_t> getCode() override
+    std::pair<ExprData::ProcessPlaneProc, size_t> getCode() override
     {
         size_t size;
         if (jit::GetCode() && (size = GetCodeSize())) {
@@ -1363,7 +1458,7 @@ public:
             void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, 0, 0);
 #endif
             memcpy(ptr, jit::GetCode(), size);
-            return {reinterpret_cast<ExprData::ProcessLineProc>(ptr), size};
+            return {reinterpret_cast<ExprData::ProcessPlaneProc>(ptr), size};
         }
         return {nullptr, 0};
     }
@@ -1376,10 +1471,10 @@ public:
 
 constexpr ExprUnion ExprCompiler128::constData alignas(16)[56][4];
 
-class ExprCompiler256 : public ExprCompiler, private jitasm::function<void, ExprCompiler256, uint8_t *, const intptr_t *, const float *, intptr_t> {
-    typedef jitasm::function<void, ExprCompiler256, uint8_t *, const intptr_t *, const float *, intptr_t> jit;
-    friend struct jitasm::function<void, ExprCompiler256, uint8_t *, const intptr_t *, const float *, intptr_t>;
-    friend struct jitasm::function_cdecl<void, ExprCompiler256, uint8_t *, const intptr_t *, const float *, intptr_t>;
+class ExprCompiler256 : public ExprCompiler, private jitasm::function<void, ExprCompiler256, uint8_t *, const intptr_t *, float *, intptr_t, const intptr_t *, intptr_t> {
+    typedef jitasm::function<void, ExprCompiler256, uint8_t *, const intptr_t *, float *, intptr_t, const intptr_t *, intptr_t> jit;
+    friend struct jitasm::function<void, ExprCompiler256, uint8_t *, const intptr_t *, float *, intptr_t, const intptr_t *, intptr_t>;
+    friend struct jitasm::function_cdecl<void, ExprCompiler256, uint8_t *, const intptr_t *, float *, intptr_t, const intptr_t *, intptr_t>;
 
 #define SPLAT(x) { (x), (x), (x), (x), (x), (x), (x), (x) }
     static constexpr ExprUnion constData alignas(32)[55][8] = {
@@ -1556,7 +1651,7 @@ class ExprCompiler256 : public ExprCompiler, private jitasm::function<void, Expr
             } else {
                 Reg a;
                 mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-                vmovaps(t1, ymmword_ptr[a]);
+                vmovups(t1, ymmword_ptr[a]);
             }
         });
     }
@@ -2063,25 +2158,9 @@ do { \
         });
     }
 
-    void main(Reg regptrs, Reg regoffs, Reg frame_consts, Reg niter)
+    // Adds the pointer sized offsets in regoffs to the pointers in regptrs.
+    void advancePointers(Reg regptrs, Reg regoffs)
     {
-        std::unordered_map<int, YmmReg> bytecodeRegs;
-        YmmReg zero;
-        vpxor(zero, zero, zero);
-        Reg constants;
-        mov(constants, (uintptr_t)constData);
-        YmmReg regXs, eight;
-
-        for (const auto &f : prolog) {
-            f(regptrs, zero, constants, regXs, eight, frame_consts, bytecodeRegs);
-        }
-
-        L("wloop");
-
-        for (const auto &f : deferred) {
-            f(regptrs, zero, constants, regXs, eight, frame_consts, bytecodeRegs);
-        }
-
 #if UINTPTR_MAX > UINT32_MAX
         for (int i = 0; i < numInputs / 4 + 1; i++) {
             YmmReg r1, r2;
@@ -2099,9 +2178,43 @@ do { \
             vmovdqu(ymmword_ptr[regptrs + 32 * i], r1);
         }
 #endif
+    }
+
+    void main(Reg regptrs, Reg regoffs, Reg frame_consts, Reg niter, Reg regadj, Reg nrows)
+    {
+        std::unordered_map<int, YmmReg> bytecodeRegs;
+        YmmReg zero;
+        vpxor(zero, zero, zero);
+        Reg constants;
+        mov(constants, (uintptr_t)constData);
+        YmmReg regXs, eight;
+
+        L("hloop");
+
+        Reg count;
+        mov(count, niter);
+        for (const auto &f : prolog) {
+            f(regptrs, zero, constants, regXs, eight, frame_consts, bytecodeRegs);
+        }
+
+        L("wloop");
+
+        for (const auto &f : deferred) {
+            f(regptrs, zero, constants, regXs, eight, frame_consts, bytecodeRegs);
+        }
+        advancePointers(regptrs, regoffs);
 
-        jit::sub(niter, 1);
+        jit::sub(count, 1);
         jnz("wloop");
+
+        advancePointers(regptrs, regadj);
+        XmmReg y;
+        vmovss(y, dword_ptr[frame_consts + sizeof(float) * CONST_Y]);
+        vaddss(y, y, dword_ptr[constants + ConstantIndex::float_one * 32]);
+        vmovss(dword_ptr[frame_consts + sizeof(float) * CONST_Y], y);
+
+        jit::sub(nrows, 1);
+        jnz("hloop");
     }
 
     void prologue(const std::vector<ExprInstruction> &bytecode) override {
@@ -2135,7 +2248,7 @@ do { \
 public:
     explicit ExprCompiler256(int numInputs) : cpuFeatures(*getCPUFeatures()), numInputs(numInputs), usedX(false) {}
 
-    std::pair<ExprData::ProcessLineProc, size_t> getCode() override
+    std::pair<ExprData::ProcessPlaneProc, size_t> getCode() override
     {
         size_t size;
         if (jit::GetCode(true) && (size = GetCodeSize())) {
@@ -2145,7 +2258,7 @@ public:
             void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, 0, 0);
 #endif
             memcpy(ptr, jit::GetCode(true), size);
-            return {reinterpret_cast<ExprData::ProcessLineProc>(ptr), size};
+            return {reinterpret_cast<ExprData::ProcessPlaneProc>(ptr), size};
         }
         return {nullptr, 0};
     }
@@ -2154,8 +2267,462 @@ public:
 
 constexpr ExprUnion ExprCompiler256::constData alignas(32)[55][8];
 
-std::unique_ptr<ExprCompiler> make_compiler(int numInputs, int cpulevel)
+#if UINTPTR_MAX > UINT32_MAX
+// Generates AVX-512F code processing 16 pixels per step, with comparisons and
+// ternaries done in opmask registers. jitasm has no EVEX encoder, so the
+// routine is assembled here directly. Every value lives in its own zmm
+// register; programs that need more registers than there are, or that use the
+// transcendental functions, are left to ExprCompiler256 (see supports()).
+class ExprCompiler512 : public ExprCompiler {
+    enum { rax = 0, rcx = 1, rdx = 2, rsp = 4, rsi = 6, rdi = 7, r8 = 8, r9 = 9, r10 = 10 };
+    // The arguments (in the System V registers, moved there on Windows) and
+    // the step counter.
+    static constexpr int regptrs = rdi, regoffs = rsi, fconsts = rdx, niter = rcx, regadj = r8, nrows = r9, count = r10;
+
+    // Fixed vector registers. The rest are given to bytecode registers
+    // (pool); zmm6-15 are callee-saved on Windows and left alone.
+    static constexpr int zero = 0, one = 1, regXs = 2, tmp0 = 3, tmp1 = 4;
+    static constexpr int pool[] = { 5, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 };
+
+    enum { ppNone = 0, pp66 = 1, ppF3 = 2 };
+    enum { map0F = 1, map0F38 = 2, map0F3A = 3 };
+
+    // A memory operand, either [base + disp] or, with base < 0, the
+    // constant pool entry disp.
+    struct Mem {
+        int base;
+        int32_t disp;
+    };
+
+    std::vector<uint8_t> code;
+    std::vector<uint32_t> constants;
+    std::vector<std::pair<size_t, size_t>> fixups; // (disp32 offset, end of instruction) of pool references
+    std::unordered_map<int, int> zmm;
+    int numInputs;
+    bool usedX;
+    size_t hloop, wloop;
+
+    static bool isTranscendental(ExprOpType type)
+    {
+        return type == ExprOpType::EXP || type == ExprOpType::LOG || type == ExprOpType::POW || type == ExprOpType::SIN || type == ExprOpType::COS;
+    }
+
+    static int numRegisters(const std::vector<ExprInstruction> &bytecode)
+    {
+        std::unordered_set<int> regs;
+        for (const auto &insn : bytecode) {
+            for (int r : { insn.dst, insn.src1, insn.src2, insn.src3 })
+                if (r >= 0)
+                    regs.insert(r);
+        }
+        return static_cast<int>(regs.size());
+    }
+
+    void imm32(uint32_t v)
+    {
+        for (int i = 0; i < 4; i++)
+            code.push_back(static_cast<uint8_t>(v >> (8 * i)));
+    }
+
+    Mem poolConst(uint32_t v)
+    {
+        auto it = std::find(constants.begin(), constants.end(), v);
+        if (it == constants.end())
+            it = constants.insert(constants.end(), v);
+        return { -1, static_cast<int32_t>(it - constants.begin()) };
+    }
+
+    Mem poolConst(float f) { return poolConst(ExprUnion(f).u); }
+
+    // EVEX encoded instruction with register rm. reg and rm are zmm or
+    // opmask numbers, vvvv is 0 when unused, and aaa/z select the write mask.
+    void evex(int pp, int map, int w, uint8_t opcode, int reg, int vvvv, int rm, int aaa = 0, bool z = false, int imm = -1, int ll = 2)
+    {
+        code.push_back(0x62);
+        code.push_back(static_cast<uint8_t>((((~reg >> 3) & 1) << 7) | (((~rm >> 4) & 1) << 6) | (((~rm >> 3) & 1) << 5) | (((~reg >> 4) & 1) << 4) | map));
+        code.push_back(static_cast<uint8_t>((w << 7) | ((~vvvv & 15) << 3) | 4 | pp));
+        code.push_back(static_cast<uint8_t>((z << 7) | (ll << 5) | (((~vvvv >> 4) & 1) << 3) | aaa));
+        code.push_back(opcode);
+        code.push_back(static_cast<uint8_t>(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+        if (imm >= 0)
+            code.push_back(static_cast<uint8_t>(imm));
+    }
+
+    // EVEX encoded instruction with a memory operand, which is broadcast from
+    // a single float with bcst. Displacements are always 32 bit, so that the
+    // compressed disp8 of EVEX never applies.
+    void evex(int pp, int map, int w, uint8_t opcode, int reg, int vvvv, const Mem &m, bool bcst = false, int imm = -1, int ll = 2)
+    {
+        const int base = m.base < 0 ? 0 : m.base;
+        code.push_back(0x62);
+        code.push_back(static_cast<uint8_t>((((~reg >> 3) & 1) << 7) | (1 << 6) | (((~base >> 3) & 1) << 5) | (((~reg >> 4) & 1) << 4) | map));
+        code.push_back(static_cast<uint8_t>((w << 7) | ((~vvvv & 15) << 3) | 4 | pp));
+        code.push_back(static_cast<uint8_t>((ll << 5) | (bcst << 4) | (((~vvvv >> 4) & 1) << 3)));
+        code.push_back(opcode);
+        size_t disp = 0;
+        if (m.base < 0) {
+            code.push_back(static_cast<uint8_t>(((reg & 7) << 3) | 5));
+            disp = code.size();
+            imm32(m.disp);
+        } else {
+            code.push_back(static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)));
+            imm32(m.disp);
+        }
+        if (imm >= 0)
+            code.push_back(static_cast<uint8_t>(imm));
+        if (m.base < 0)
+            fixups.push_back({ disp, code.size() });
+    }
+
+    void rex(int reg, int base)
+    {
+        code.push_back(static_cast<uint8_t>(0x48 | (((reg >> 3) & 1) << 2) | ((base >> 3) & 1)));
+    }
+
+    void modrmDisp32(int reg, int base, int32_t disp)
+    {
+        code.push_back(static_cast<uint8_t>(0x80 | ((reg & 7) << 3) | (base & 7)));
+        if ((base & 7) == rsp)
+            code.push_back(0x24);
+        imm32(disp);
+    }
+
+    // mov reg, [base + disp]
+    void movLoad(int reg, int base, int32_t disp)
+    {
+        rex(reg, base);
+        code.push_back(0x8B);
+        modrmDisp32(reg, base, disp);
+    }
+
+    // mov dst, src
+    void movReg(int dst, int src)
+    {
+        rex(src, dst);
+        code.push_back(0x89);
+        code.push_back(static_cast<uint8_t>(0xC0 | ((src & 7) << 3) | (dst & 7)));
+    }
+
+    // sub reg, 1; jnz target
+    void loopBack(int reg, size_t target)
+    {
+        rex(0, reg);
+        code.push_back(0x83);
+        code.push_back(static_cast<uint8_t>(0xE8 | (reg & 7)));
+        code.push_back(1);
+        code.push_back(0x0F);
+        code.push_back(0x85);
+        imm32(static_cast<uint32_t>(static_cast<int32_t>(target - (code.size() + 4))));
+    }
+
+    int reg(int r) { return zmm.at(r); }
+
+    void vmovaps(int dst, int src, int k = 0, bool z = false) { evex(ppNone, map0F, 0, 0x28, dst, 0, src, k, z); }
+
+    // rax = the pointer of clip i (0 is the output).
+    void loadPointer(int i) { movLoad(rax, regptrs, static_cast<int32_t>(sizeof(void *) * i)); }
+
+    // Adds the pointer sized offsets in offs to the pointers in regptrs.
+    void advancePointers(int offs)
+    {
+        for (int i = 0; i < (numInputs + 2 + 7) / 8; i++) {
+            evex(ppF3, map0F, 1, 0x6F, tmp0, 0, Mem{ regptrs, 64 * i }); // vmovdqu64
+            evex(pp66, map0F, 1, 0xD4, tmp0, tmp0, Mem{ offs, 64 * i }); // vpaddq
+            evex(ppF3, map0F, 1, 0x7F, tmp0, 0, Mem{ regptrs, 64 * i }); // vmovdqu64
+        }
+    }
+
+    // dst = 1.0 where opmask k1 is set, 0.0 elsewhere.
+    void maskToFloat(int dst) { vmovaps(dst, one, 1, true); }
+
+    // vcmpps k, src, zero, _CMP_NLE_US
+    void isTrue(int k, int src) { evex(ppNone, map0F, 0, 0xC2, k, src, zero, 0, false, _CMP_NLE_US); }
+
+    void load8(const ExprInstruction &insn) override
+    {
+        loadPointer(insn.op.imm.u + 1);
+        evex(pp66, map0F38, 0, 0x31, reg(insn.dst), 0, Mem{ rax, 0 }); // vpmovzxbd
+        evex(ppNone, map0F, 0, 0x5B, reg(insn.dst), 0, reg(insn.dst)); // vcvtdq2ps
+    }
+
+    void load16(const ExprInstruction &insn) override
+    {
+        loadPointer(insn.op.imm.u + 1);
+        evex(pp66, map0F38, 0, 0x33, reg(insn.dst), 0, Mem{ rax, 0 }); // vpmovzxwd
+        evex(ppNone, map0F, 0, 0x5B, reg(insn.dst), 0, reg(insn.dst)); // vcvtdq2ps
+    }
+
+    void loadF16(const ExprInstruction &insn) override
+    {
+        loadPointer(insn.op.imm.u + 1);
+        evex(pp66, map0F38, 0, 0x13, reg(insn.dst), 0, Mem{ rax, 0 }); // vcvtph2ps
+    }
+
+    void loadF32(const ExprInstruction &insn) override
+    {
+        if (insn.op.imm.u == CLIP_X) {
+            vmovaps(reg(insn.dst), regXs);
+        } else {
+            loadPointer(insn.op.imm.u + 1);
+            evex(ppNone, map0F, 0, 0x10, reg(insn.dst), 0, Mem{ rax, 0 }); // vmovups
+        }
+    }
+
+    void loadConst(const ExprInstruction &insn) override
+    {
+        if (insn.op.imm.f == 0.0f)
+            vmovaps(reg(insn.dst), zero);
+        else
+            evex(pp66, map0F38, 0, 0x18, reg(insn.dst), 0, poolConst(insn.op.imm.u)); // vbroadcastss
+    }
+
+    void loadMemConst(const ExprInstruction &insn) override
+    {
+        evex(pp66, map0F38, 0, 0x18, reg(insn.dst), 0, Mem{ fconsts, static_cast<int32_t>(sizeof(float) * insn.op.imm.u) }); // vbroadcastss
+    }
+
+    // tmp0 = src clamped to [0, maxval] (NaN becoming maxval, as in
+    // ExprCompiler256) and converted to integers.
+    void clampToInt(int src, float maxval)
+    {
+        evex(ppNone, map0F, 0, 0x5D, tmp0, src, poolConst(maxval), true); // vminps
+        evex(ppNone, map0F, 0, 0x5F, tmp0, tmp0, zero); // vmaxps
+        evex(pp66, map0F, 0, 0x5B, tmp0, 0, tmp0); // vcvtps2dq
+    }
+
+    void store8(const ExprInstruction &insn) override
+    {
+        clampToInt(reg(insn.src1), 255.0f);
+        loadPointer(0);
+        evex(ppF3, map0F38, 0, 0x31, tmp0, 0, Mem{ rax, 0 }); // vpmovdb
+    }
+
+    void store16(const ExprInstruction &insn) override
+    {
+        clampToInt(reg(insn.src1), static_cast<float>((1 << insn.op.imm.u) - 1));
+        loadPointer(0);
+        evex(ppF3, map0F38, 0, 0x33, tmp0, 0, Mem{ rax, 0 }); // vpmovdw
+    }
+
+    void storeF16(const ExprInstruction &insn) override
+    {
+        loadPointer(0);
+        evex(pp66, map0F3A, 0, 0x1D, reg(insn.src1), 0, Mem{ rax, 0 }, false, 0); // vcvtps2ph
+    }
+
+    void storeF32(const ExprInstruction &insn) override
+    {
+        loadPointer(0);
+        evex(ppNone, map0F, 0, 0x11, reg(insn.src1), 0, Mem{ rax, 0 }); // vmovups
+    }
+
+    void binary(uint8_t opcode, const ExprInstruction &insn) { evex(ppNone, map0F, 0, opcode, reg(insn.dst), reg(insn.src1), reg(insn.src2)); }
+
+    void add(const ExprInstruction &insn) override { binary(0x58, insn); }
+    void sub(const ExprInstruction &insn) override { binary(0x5C, insn); }
+    void mul(const ExprInstruction &insn) override { binary(0x59, insn); }
+    void div(const ExprInstruction &insn) override { binary(0x5E, insn); }
+    void max(const ExprInstruction &insn) override { binary(0x5F, insn); }
+    void min(const ExprInstruction &insn) override { binary(0x5D, insn); }
+
+    void mod(const ExprInstruction &insn) override
+    {
+        vmovaps(tmp1, reg(insn.src2));
+        evex(ppNone, map0F, 0, 0x5E, tmp0, reg(insn.src1), tmp1); // vdivps
+        evex(ppF3, map0F, 0, 0x5B, tmp0, 0, tmp0); // vcvttps2dq
+        evex(ppNone, map0F, 0, 0x5B, tmp0, 0, tmp0); // vcvtdq2ps
+        vmovaps(reg(insn.dst), reg(insn.src1));
+        evex(pp66, map0F38, 0, 0xBC, reg(insn.dst), tmp0, tmp1); // vfnmadd231ps
+    }
+
+    void fma(const ExprInstruction &insn) override
+    {
+        // vfmadd132ps, vfmsub132ps, vfnmadd132ps and vfnmsub132ps; the 213
+        // and 231 forms follow at + 0x10 and + 0x20.
+        static constexpr uint8_t form132[] = { 0x98, 0x9A, 0x9C, 0x9E };
+        const uint8_t op = form132[insn.op.imm.u];
+
+        // src1 + src2 * src3
+        const int t1 = reg(insn.src1), t2 = reg(insn.src2), t3 = reg(insn.src3), t4 = reg(insn.dst);
+        if (insn.dst == insn.src1) {
+            evex(pp66, map0F38, 0, op + 0x20, t1, t2, t3);
+        } else if (insn.dst == insn.src2) {
+            evex(pp66, map0F38, 0, op, t2, t1, t3);
+        } else if (insn.dst == insn.src3) {
+            evex(pp66, map0F38, 0, op, t3, t1, t2);
+        } else {
+            vmovaps(t4, t1);
+            evex(pp66, map0F38, 0, op + 0x20, t4, t2, t3);
+        }
+    }
+
+    void sqrt(const ExprInstruction &insn) override
+    {
+        evex(ppNone, map0F, 0, 0x5F, reg(insn.dst), reg(insn.src1), zero); // vmaxps
+        evex(ppNone, map0F, 0, 0x51, reg(insn.dst), 0, reg(insn.dst)); // vsqrtps
+    }
+
+    void abs(const ExprInstruction &insn) override
+    {
+        evex(pp66, map0F, 0, 0xDB, reg(insn.dst), reg(insn.src1), poolConst(0x7FFFFFFFu), true); // vpandd
+    }
+
+    void neg(const ExprInstruction &insn) override
+    {
+        evex(pp66, map0F, 0, 0xEF, reg(insn.dst), reg(insn.src1), poolConst(0x80000000u), true); // vpxord
+    }
+
+    void not_(const ExprInstruction &insn) override
+    {
+        evex(ppNone, map0F, 0, 0xC2, 1, reg(insn.src1), zero, 0, false, _CMP_LE_OS); // vcmpps
+        maskToFloat(reg(insn.dst));
+    }
+
+    // k1 = op(src1 > 0, src2 > 0) for kandw, korw or kxorw.
+    void logic(uint8_t opcode, const ExprInstruction &insn)
+    {
+        isTrue(1, reg(insn.src1));
+        isTrue(2, reg(insn.src2));
+        // VEX.L1.0F.W0 opcode k1, k1, k2
+        code.push_back(0xC5);
+        code.push_back(static_cast<uint8_t>(0x80 | ((~1 & 15) << 3) | 4));
+        code.push_back(opcode);
+        code.push_back(static_cast<uint8_t>(0xC0 | (1 << 3) | 2));
+        maskToFloat(reg(insn.dst));
+    }
+
+    void and_(const ExprInstruction &insn) override { logic(0x41, insn); }
+    void or_(const ExprInstruction &insn) override { logic(0x45, insn); }
+    void xor_(const ExprInstruction &insn) override { logic(0x47, insn); }
+
+    void cmp(const ExprInstruction &insn) override
+    {
+        evex(ppNone, map0F, 0, 0xC2, 1, reg(insn.src1), reg(insn.src2), 0, false, insn.op.imm.u); // vcmpps
+        maskToFloat(reg(insn.dst));
+    }
+
+    void ternary(const ExprInstruction &insn) override
+    {
+        isTrue(1, reg(insn.src1));
+        evex(pp66, map0F38, 0, 0x65, reg(insn.dst), reg(insn.src3), reg(insn.src2), 1); // vblendmps
+    }
+
+    void trunc(const ExprInstruction &insn) override
+    {
+        evex(ppF3, map0F, 0, 0x5B, reg(insn.dst), 0, reg(insn.src1)); // vcvttps2dq
+        evex(ppNone, map0F, 0, 0x5B, reg(insn.dst), 0, reg(insn.dst)); // vcvtdq2ps
+    }
+
+    void round(const ExprInstruction &insn) override
+    {
+        evex(pp66, map0F, 0, 0x5B, reg(insn.dst), 0, reg(insn.src1)); // vcvtps2dq
+        evex(ppNone, map0F, 0, 0x5B, reg(insn.dst), 0, reg(insn.dst)); // vcvtdq2ps
+    }
+
+    // Excluded by supports().
+    void exp(const ExprInstruction &insn) override { vsFatal("illegal opcode"); }
+    void log(const ExprInstruction &insn) override { vsFatal("illegal opcode"); }
+    void pow(const ExprInstruction &insn) override { vsFatal("illegal opcode"); }
+    void sin(const ExprInstruction &insn) override { vsFatal("illegal opcode"); }
+    void cos(const ExprInstruction &insn) override { vsFatal("illegal opcode"); }
+
+    void prologue(const std::vector<ExprInstruction> &bytecode) override
+    {
+        for (const auto &insn : bytecode) {
+            if (insn.op.type == ExprOpType::MEM_LOAD_F32 && insn.op.imm.u == CLIP_X)
+                usedX = true;
+            for (int r : { insn.dst, insn.src1, insn.src2, insn.src3 })
+                if (r >= 0 && !zmm.count(r))
+                    zmm.emplace(r, pool[zmm.size()]);
+        }
+
+#ifdef VS_TARGET_OS_WINDOWS
+        code.push_back(0x56); // push rsi
+        code.push_back(0x57); // push rdi
+        movReg(rdi, rcx);
+        movReg(rsi, rdx);
+        movReg(rdx, r8);
+        movReg(rcx, r9);
+        movLoad(r8, rsp, 56);
+        movLoad(r9, rsp, 64);
+#endif
+        evex(pp66, map0F, 0, 0xEF, zero, zero, zero); // vpxord
+        evex(pp66, map0F38, 0, 0x18, one, 0, poolConst(1.0f)); // vbroadcastss
+
+        hloop = code.size();
+        movReg(count, niter);
+        if (usedX) {
+            for (int i = 0; i < 16; i++)
+                constants.push_back(ExprUnion(static_cast<float>(i)).u);
+            evex(ppNone, map0F, 0, 0x10, regXs, 0, Mem{ -1, static_cast<int32_t>(constants.size() - 16) }); // vmovups
+        }
+        wloop = code.size();
+    }
+
+    void epilogue(const std::vector<ExprInstruction> &bytecode) override
+    {
+        if (usedX)
+            evex(ppNone, map0F, 0, 0x58, regXs, regXs, poolConst(16.0f), true); // vaddps
+        advancePointers(regoffs);
+        loopBack(count, wloop);
+
+        advancePointers(regadj);
+        const Mem y{ fconsts, static_cast<int32_t>(sizeof(float) * CONST_Y) };
+        evex(ppF3, map0F, 0, 0x10, tmp0, 0, y, false, -1, 0); // vmovss
+        evex(ppF3, map0F, 0, 0x58, tmp0, tmp0, one, 0, false, -1, 0); // vaddss
+        evex(ppF3, map0F, 0, 0x11, tmp0, 0, y, false, -1, 0); // vmovss
+        loopBack(nrows, hloop);
+
+        code.insert(code.end(), { 0xC5, 0xF8, 0x77 }); // vzeroupper
+#ifdef VS_TARGET_OS_WINDOWS
+        code.push_back(0x5F); // pop rdi
+        code.push_back(0x5E); // pop rsi
+#endif
+        code.push_back(0xC3); // ret
+    }
+
+public:
+    explicit ExprCompiler512(int numInputs) : numInputs(numInputs), usedX(false), hloop(), wloop() {}
+
+    // Whether the bytecode can be compiled by this class.
+    static bool supports(const std::vector<ExprInstruction> &bytecode)
+    {
+        for (const auto &insn : bytecode)
+            if (isTranscendental(insn.op.type))
+                return false;
+        return numRegisters(bytecode) <= static_cast<int>(std::size(pool));
+    }
+
+    int pixelsPerStep() const override { return 16; }
+
+    std::pair<ExprData::ProcessPlaneProc, size_t> getCode() override
+    {
+        // The constant pool follows the code, 64 byte aligned.
+        const size_t poolOffset = (code.size() + 63) & ~static_cast<size_t>(63);
+        for (const auto &f : fixups) {
+            const int32_t index = static_cast<int32_t>(code[f.first] | code[f.first + 1] << 8 | code[f.first + 2] << 16 | code[f.first + 3] << 24);
+            const int32_t disp = static_cast<int32_t>(poolOffset + sizeof(uint32_t) * index - f.second);
+            memcpy(&code[f.first], &disp, sizeof(disp));
+        }
+        const size_t size = poolOffset + sizeof(uint32_t) * constants.size();
+#ifdef VS_TARGET_OS_WINDOWS
+        void *ptr = VirtualAlloc(nullptr, size, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+#else
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, 0, 0);
+#endif
+        memcpy(ptr, code.data(), code.size());
+        memcpy(static_cast<uint8_t *>(ptr) + poolOffset, constants.data(), sizeof(uint32_t) * constants.size());
+        return {reinterpret_cast<ExprData::ProcessPlaneProc>(ptr), size};
+    }
+};
+#endif
+
+std::unique_ptr<ExprCompiler> make_compiler(int numInputs, int cpulevel, const std::vector<ExprInstruction> &bytecode)
 {
+#if UINTPTR_MAX > UINT32_MAX
+    if (getCPUFeatures()->avx512_f && cpulevel >= VS_CPU_LEVEL_AVX512 && ExprCompiler512::supports(bytecode))
+        return std::unique_ptr<ExprCompiler>(new ExprCompiler512(numInputs));
+#endif
     if (getCPUFeatures()->avx2 && cpulevel >= VS_CPU_LEVEL_AVX2)
         return std::unique_ptr<ExprCompiler>(new ExprCompiler256(numInputs));
     else
@@ -2163,7 +2730,14 @@ std::unique_ptr<ExprCompiler> make_compiler(int numInputs, int cpulevel)
 }
 #endif
 
+// Evaluates the bytecode over a block of up to blockSize consecutive pixels of
+// a row at a time. Each register holds one value per pixel of the block, so
+// every instruction is dispatched once per block and its inner loop is a plain
+// array operation the compiler can vectorise.
 class ExprInterpreter {
+public:
+    static constexpr int blockSize = 256;
+private:
     const ExprInstruction *bytecode;
     size_t numInsns;
     std::vector<float> registers;
@@ -2177,6 +2751,8 @@ class ExprInterpreter {
 
     static float bool2float(bool x) { return x ? 1.0f : 0.0f; }
     static bool float2bool(float x) { return x > 0.0f; }
+
+    float *reg(int i) { return registers.data() + static_cast<size_t>(i) * blockSize; }
 public:
     ExprInterpreter(const ExprInstruction *bytecode, size_t numInsns) : bytecode(bytecode), numInsns(numInsns)
     {
@@ -2184,80 +2760,105 @@ public:
         for (size_t i = 0; i < numInsns; ++i) {
             maxreg = std::max(maxreg, bytecode[i].dst);
         }
-        registers.resize(maxreg + 1);
+        registers.resize(static_cast<size_t>(maxreg + 1) * blockSize);
     }
 
-    void eval(const uint8_t * const *srcp, uint8_t *dstp, const float *consts, int x)
+    // Processes pixels [x, x + count) of the current row, count <= blockSize.
+    void eval(const uint8_t * const *srcp, uint8_t *dstp, const float *consts, int x, int count)
     {
         for (size_t i = 0; i < numInsns; ++i) {
             const ExprInstruction &insn = bytecode[i];
-
-#define SRC1 registers[insn.src1]
-#define SRC2 registers[insn.src2]
-#define SRC3 registers[insn.src3]
-#define DST registers[insn.dst]
+            float *dst = insn.dst >= 0 ? reg(insn.dst) : nullptr;
+            const float *src1 = insn.src1 >= 0 ? reg(insn.src1) : nullptr;
+            const float *src2 = insn.src2 >= 0 ? reg(insn.src2) : nullptr;
+            const float *src3 = insn.src3 >= 0 ? reg(insn.src3) : nullptr;
+
+#define LOOP(expr) for (int j = 0; j < count; j++) { expr; } break
+#define SRC1 src1[j]
+#define SRC2 src2[j]
+#define SRC3 src3[j]
+#define DST dst[j]
             switch (insn.op.type) {
-            case ExprOpType::MEM_LOAD_U8: DST = reinterpret_cast<const uint8_t *>(srcp[insn.op.imm.u])[x]; break;
-            case ExprOpType::MEM_LOAD_U16: DST = reinterpret_cast<const uint16_t *>(srcp[insn.op.imm.u])[x]; break;
-            case ExprOpType::MEM_LOAD_F16: DST = 0; break;
+            case ExprOpType::MEM_LOAD_U8: { const uint8_t *p = reinterpret_cast<const uint8_t *>(srcp[insn.op.imm.u]) + x; LOOP(DST = p[j]); }
+            case ExprOpType::MEM_LOAD_U16: { const uint16_t *p = reinterpret_cast<const uint16_t *>(srcp[insn.op.imm.u]) + x; LOOP(DST = p[j]); }
+            case ExprOpType::MEM_LOAD_F16: LOOP(DST = 0);
             case ExprOpType::MEM_LOAD_F32:
-                if (insn.op.imm.u == CLIP_X)
-                    DST = x;
-                else
-                    DST = reinterpret_cast<const float *>(srcp[insn.op.imm.u])[x];
-                break;
-            case ExprOpType::CONSTANT: DST = insn.op.imm.f; break;
-            case ExprOpType::MEM_LOAD_CONST: DST = consts[insn.op.imm.u]; break;
-            case ExprOpType::ADD: DST = SRC1 + SRC2; break;
-            case ExprOpType::SUB: DST = SRC1 - SRC2; break;
-            case ExprOpType::MUL: DST = SRC1 * SRC2; break;
-            case ExprOpType::DIV: DST = SRC1 / SRC2; break;
-            case ExprOpType::MOD: DST = std::fmod(SRC1, SRC2); break;
+                if (insn.op.imm.u == CLIP_X) {
+                    LOOP(DST = static_cast<float>(x + j));
+                } else {
+                    const float *p = reinterpret_cast<const float *>(srcp[insn.op.imm.u]) + x;
+                    LOOP(DST = p[j]);
+                }
+            case ExprOpType::CONSTANT: { float c = insn.op.imm.f; LOOP(DST = c); }
+            case ExprOpType::MEM_LOAD_CONST: { float c = consts[insn.op.imm.u]; LOOP(DST = c); }
+            case ExprOpType::ADD: LOOP(DST = SRC1 + SRC2);
+            case ExprOpType::SUB: LOOP(DST = SRC1 - SRC2);
+            case ExprOpType::MUL: LOOP(DST = SRC1 * SRC2);
+            case ExprOpType::DIV: LOOP(DST = SRC1 / SRC2);
+            case ExprOpType::MOD: LOOP(DST = std::fmod(SRC1, SRC2));
             case ExprOpType::FMA:
                 switch (static_cast<FMAType>(insn.op.imm.u)) {
-                case FMAType::FMADD: DST = SRC2 * SRC3 + SRC1; break;
-                case FMAType::FMSUB: DST = SRC2 * SRC3 - SRC1; break;
-                case FMAType::FNMADD: DST = -(SRC2 * SRC3) + SRC1; break;
-                case FMAType::FNMSUB: DST = -(SRC2 * SRC3) - SRC1; break;
+                case FMAType::FMADD: LOOP(DST = SRC2 * SRC3 + SRC1);
+                case FMAType::FMSUB: LOOP(DST = SRC2 * SRC3 - SRC1);
+                case FMAType::FNMADD: LOOP(DST = -(SRC2 * SRC3) + SRC1);
+                case FMAType::FNMSUB: LOOP(DST = -(SRC2 * SRC3) - SRC1);
                 };
                 break;
-            case ExprOpType::MAX: DST = std::max(SRC1, SRC2); break;
-            case ExprOpType::MIN: DST = std::min(SRC1, SRC2); break;
-            case ExprOpType::EXP: DST = std::exp(SRC1); break;
-            case ExprOpType::LOG: DST = std::log(SRC1); break;
-            case ExprOpType::POW: DST = std::pow(SRC1, SRC2); break;
-            case ExprOpType::SQRT: DST = std::sqrt(SRC1); break;
-            case ExprOpType::SIN: DST = std::sin(SRC1); break;
-            case ExprOpType::COS: DST = std::cos(SRC1); break;
-            case ExprOpType::ABS: DST = std::fabs(SRC1); break;
-            case ExprOpType::NEG: DST = -SRC1; break;
+            case ExprOpType::MAX: LOOP(DST = std::max(SRC1, SRC2));
+            case ExprOpType::MIN: LOOP(DST = std::min(SRC1, SRC2));
+            case ExprOpType::EXP: LOOP(DST = std::exp(SRC1));
+            case ExprOpType::LOG: LOOP(DST = std::log(SRC1));
+            case ExprOpType::POW: LOOP(DST = std::pow(SRC1, SRC2));
+            case ExprOpType::SQRT: LOOP(DST = std::sqrt(SRC1));
+            case ExprOpType::SIN: LOOP(DST = std::sin(SRC1));
+            case ExprOpType::COS: LOOP(DST = std::cos(SRC1));
+            case ExprOpType::ABS: LOOP(DST = std::fabs(SRC1));
+            case ExprOpType::NEG: LOOP(DST = -SRC1);
             case ExprOpType::CMP:
                 switch (static_cast<ComparisonType>(insn.op.imm.u)) {
-                case ComparisonType::EQ: DST = bool2float(SRC1 == SRC2); break;
-                case ComparisonType::LT: DST = bool2float(SRC1 < SRC2); break;
-                case ComparisonType::LE: DST = bool2float(SRC1 <= SRC2); break;
-                case ComparisonType::NEQ: DST = bool2float(SRC1 != SRC2); break;
-                case ComparisonType::NLT: DST = bool2float(SRC1 >= SRC2); break;
-                case ComparisonType::NLE: DST = bool2float(SRC1 > SRC2); break;
+                case ComparisonType::EQ: LOOP(DST = bool2float(SRC1 == SRC2));
+                case ComparisonType::LT: LOOP(DST = bool2float(SRC1 < SRC2));
+                case ComparisonType::LE: LOOP(DST = bool2float(SRC1 <= SRC2));
+                case ComparisonType::NEQ: LOOP(DST = bool2float(SRC1 != SRC2));
+                case ComparisonType::NLT: LOOP(DST = bool2float(SRC1 >= SRC2));
+                case ComparisonType::NLE: LOOP(DST = bool2float(SRC1 > SRC2));
                 }
                 break;
-            case ExprOpType::TRUNC: DST = std::trunc(SRC1); break;
-            case ExprOpType::ROUND: DST = std::round(SRC1); break;
-            case ExprOpType::TERNARY: DST = float2bool(SRC1) ? SRC2 : SRC3; break;
-            case ExprOpType::AND: DST = bool2float((float2bool(SRC1) && float2bool(SRC2))); break;
-            case ExprOpType::OR:  DST = bool2float((float2bool(SRC1) || float2bool(SRC2))); break;
-            case ExprOpType::XOR: DST = bool2float((float2bool(SRC1) != float2bool(SRC2))); break;
-            case ExprOpType::NOT: DST = bool2float(!float2bool(SRC1)); break;
-            case ExprOpType::MEM_STORE_U8:  reinterpret_cast<uint8_t *>(dstp)[x] = clamp_int<uint8_t>(SRC1); return;
-            case ExprOpType::MEM_STORE_U16: reinterpret_cast<uint16_t *>(dstp)[x] = clamp_int<uint16_t>(SRC1, insn.op.imm.u); return;
-            case ExprOpType::MEM_STORE_F16: reinterpret_cast<uint16_t *>(dstp)[x] = 0; return;
-            case ExprOpType::MEM_STORE_F32: reinterpret_cast<float *>(dstp)[x] = SRC1; return;
+            case ExprOpType::TRUNC: LOOP(DST = std::trunc(SRC1));
+            case ExprOpType::ROUND: LOOP(DST = std::round(SRC1));
+            case ExprOpType::TERNARY: LOOP(DST = float2bool(SRC1) ? SRC2 : SRC3);
+            case ExprOpType::AND: LOOP(DST = bool2float((float2bool(SRC1) && float2bool(SRC2))));
+            case ExprOpType::OR:  LOOP(DST = bool2float((float2bool(SRC1) || float2bool(SRC2))));
+            case ExprOpType::XOR: LOOP(DST = bool2float((float2bool(SRC1) != float2bool(SRC2))));
+            case ExprOpType::NOT: LOOP(DST = bool2float(!float2bool(SRC1)));
+            case ExprOpType::MEM_STORE_U8: {
+                uint8_t *p = reinterpret_cast<uint8_t *>(dstp) + x;
+                for (int j = 0; j < count; j++) p[j] = clamp_int<uint8_t>(SRC1);
+                return;
+            }
+            case ExprOpType::MEM_STORE_U16: {
+                uint16_t *p = reinterpret_cast<uint16_t *>(dstp) + x;
+                int depth = insn.op.imm.u;
+                for (int j = 0; j < count; j++) p[j] = clamp_int<uint16_t>(SRC1, depth);
+                return;
+            }
+            case ExprOpType::MEM_STORE_F16: {
+                uint16_t *p = reinterpret_cast<uint16_t *>(dstp) + x;
+                for (int j = 0; j < count; j++) p[j] = 0;
+                return;
+            }
+            case ExprOpType::MEM_STORE_F32: {
+                float *p = reinterpret_cast<float *>(dstp) + x;
+                for (int j = 0; j < count; j++) p[j] = SRC1;
+                return;
+            }
             default: vsFatal("illegal opcode"); return;
             }
 #undef DST
 #undef SRC3
 #undef SRC2
 #undef SRC1
+#undef LOOP
         }
     }
 };
@@ -2320,6 +2921,7 @@ class ExpressionTree {
     std::vector<std::unique_ptr<ExpressionTreeNode>> nodes;
     ExpressionTreeNode *root;
     std::map<PropAccess, int> prop_map;
+    std::map<RelAccess, int> rel_map;
 public:
     ExpressionTree() : root() {}
 
@@ -2342,6 +2944,21 @@ public:
         return pa;
     }
 
+    int addRelAccess(const RelAccess &ra) {
+        auto search = rel_map.find(ra);
+        if (search != rel_map.end())
+            return search->second;
+        int idx = static_cast<int>(rel_map.size());
+        rel_map.insert({ra, idx});
+        return idx;
+    }
+    std::vector<RelAccess> getRelAccess() const {
+        std::vector<RelAccess> ra(rel_map.size());
+        for (const auto &it: rel_map)
+            ra[it.second] = it.first;
+        return ra;
+    }
+
     ExpressionTreeNode *makeNode(ExprOp data)
     {
         nodes.push_back(std::unique_ptr<ExpressionTreeNode>(new ExpressionTreeNode(data)));
@@ -2437,11 +3054,34 @@ Token decodeToken(const std::string &token)
         { "swap", { ExprOpType::SWAP, 1 } },
     };
 
+    static const std::regex clipNameRe { "^([a-z]|src[0-9]+)$" };
+    static const std::regex relpixelRe { "^([a-z]|src[0-9]+)\\[(-?[0-9]+),(-?[0-9]+)\\](:[cm])?$" };
+    static const std::regex framePropRe { "^([a-z]|src[0-9]+)\\.([^\\[\\]]+)$" };
+    std::smatch match;
+
+    auto extractClipId = [](const std::string &name) -> int {
+        if (name.size() == 1)
+            return name[0] >= 'x' ? name[0] - 'x' : name[0] - 'a' + 3;
+        int idx = -1;
+        auto result = std::from_chars(name.c_str() + 3, name.c_str() + name.size(), idx);
+        if (result.ec != std::errc())
+            throw std::runtime_error("invalid clip name: " + name);
+        return idx;
+    };
+
     auto it = simple.find(token);
     if (it != simple.end()) {
         return it->second;
-    } else if (token.size() == 1 && token[0] >= 'a' && token[0] <= 'z') {
-        return{ ExprOpType::MEM_LOAD_U8, token[0] >= 'x' ? token[0] - 'x' : token[0] - 'a' + 3 };
+    } else if (std::regex_match(token, match, clipNameRe)) {
+        return{ ExprOpType::MEM_LOAD_U8, extractClipId(token) };
+    } else if (std::regex_match(token, match, relpixelRe)) {
+        int x = 0, y = 0;
+        auto sx = match[2].str(), sy = match[3].str(), flag = match[4].str();
+        if (std::from_chars(sx.c_str(), sx.c_str() + sx.size(), x).ec != std::errc() ||
+            std::from_chars(sy.c_str(), sy.c_str() + sy.size(), y).ec != std::errc())
+            throw std::runtime_error("illegal token: " + token);
+        int bc = flag.empty() ? -1 : flag[1] == 'm';
+        return{ ExprOpType::MEM_LOAD_U8, extractClipId(match[1].str()), {}, { -1, x, y, bc } };
     } else if (token.substr(0, 3) == "dup" || token.substr(0, 4) == "swap") {
         size_t prefix = token[0] == 'd' ? 3 : 4;
         size_t count = 0;
@@ -2456,9 +3096,9 @@ Token decodeToken(const std::string &token)
         if (idx < 0 || prefix + count != token.size())
             throw std::runtime_error("illegal token: " + token);
         return{ token[0] == 'd' ? ExprOpType::DUP : ExprOpType::SWAP, idx };
-    } else if (token.size() >= 3 && token[0] >= 'a' && token[0] <= 'z' && token[1] == '.') {
+    } else if (std::regex_match(token, match, framePropRe)) {
         // frame property access
-        return{ ExprOpType::MEM_LOAD_CONST, CONST_FIRST_PROP, { token[0] >= 'x' ? token[0] - 'x' : token[0] - 'a' + 3, token.substr(2) } };
+        return{ ExprOpType::MEM_LOAD_CONST, CONST_FIRST_PROP, { extractClipId(match[1].str()), match[2].str() } };
     }  else {
         if (token.size() == 1) {
             switch (token[0]) {
@@ -2482,7 +3122,7 @@ Token decodeToken(const std::string &token)
     }
 }
 
-ExpressionTree parseExpr(const std::string &expr, const VSVideoInfo * const *vi, int numInputs)
+ExpressionTree parseExpr(const std::string &expr, const VSVideoInfo * const *vi, int numInputs, bool mirror)
 {
     constexpr unsigned char numOperands[] = {
         0, // MEM_LOAD_U8
@@ -2551,7 +3191,16 @@ ExpressionTree parseExpr(const std::string &expr, const VSVideoInfo * const *vi,
 
         // Rename load operations with the correct data type.
         if (op.type == ExprOpType::MEM_LOAD_U8) {
-            const VSFormat *format = vi[op.imm.i]->format;
+            const VSVideoFormat *format = &vi[op.imm.i]->format;
+
+            // Relative accesses load from extra inputs numbered after the clips.
+            if (token.rel.x != 0 || token.rel.y != 0) {
+                RelAccess ra = token.rel;
+                ra.clip = op.imm.i;
+                if (ra.boundary < 0)
+                    ra.boundary = mirror;
+                op.imm.i = numInputs + tree.addRelAccess(ra);
+            }
 
             if (format->sampleType == stInteger && format->bytesPerSample == 1)
                 op.type = ExprOpType::MEM_LOAD_U8;
@@ -3660,7 +4309,25 @@ void renameRegisters(std::vector<ExprInstruction> &code)
     }
 }
 
-std::vector<ExprInstruction> compile(ExpressionTree &tree, const VSFormat *format)
+// Returns the value operands of node in instruction order, looking through
+// the MUX holding the branches of a ternary.
+std::vector<ExpressionTreeNode *> operands(ExpressionTreeNode &node)
+{
+    std::vector<ExpressionTreeNode *> children;
+    if (node.left)
+        children.push_back(node.left);
+    if (node.right) {
+        if (node.right->op.type == ExprOpType::MUX) {
+            children.push_back(node.right->left);
+            children.push_back(node.right->right);
+        } else {
+            children.push_back(node.right);
+        }
+    }
+    return children;
+}
+
+std::vector<ExprInstruction> compile(ExpressionTree &tree, const VSVideoFormat *format)
 {
     std::vector<ExprInstruction> code;
     std::unordered_set<int> found;
@@ -3678,35 +4345,67 @@ std::vector<ExprInstruction> compile(ExpressionTree &tree, const VSFormat *forma
 
     applyValueNumbering(tree);
 
+    // Number of registers needed to evaluate each subtree (Sethi-Ullman
+    // number). Operands are emitted in decreasing order of it, so that the
+    // values already computed occupy as few registers as possible while the
+    // next subtree is evaluated.
+    std::unordered_map<const ExpressionTreeNode *, int> need;
+    int nextReg = 0;
     tree.getRoot()->postorder([&](ExpressionTreeNode &node)
     {
-        if (node.op.type == ExprOpType::MUX)
-            return;
+        nextReg = std::max(nextReg, node.valueNum + 1);
+        std::vector<int> n;
+        for (const ExpressionTreeNode *child : operands(node))
+            n.push_back(need[child]);
+        std::sort(n.begin(), n.end(), std::greater<int>());
+        int r = 1;
+        for (size_t i = 0; i < n.size(); ++i)
+            r = std::max(r, n[i] + static_cast<int>(i));
+        need[&node] = r;
+    });
+
+    // Constants are rematerialized right before every use instead of being
+    // kept in a register (and spilled) for the lifetime of the expression.
+    auto rematerializable = [](const ExpressionTreeNode *node) {
+        return node->op.type == ExprOpType::CONSTANT || node->op.type == ExprOpType::MEM_LOAD_CONST;
+    };
+
+    std::function<void(ExpressionTreeNode &)> emit = [&](ExpressionTreeNode &node)
+    {
         if (found.find(node.valueNum) != found.end())
             return;
 
-        ExprInstruction opcode(node.op);
-        opcode.dst = node.valueNum;
-
-        if (node.left) {
-            assert(node.left->valueNum >= 0);
-            opcode.src1 = node.left->valueNum;
+        std::vector<ExpressionTreeNode *> children = operands(node);
+        std::vector<ExpressionTreeNode *> order = children;
+        std::stable_sort(order.begin(), order.end(), [&](const ExpressionTreeNode *a, const ExpressionTreeNode *b) { return need[a] > need[b]; });
+        for (ExpressionTreeNode *child : order) {
+            if (!rematerializable(child))
+                emit(*child);
         }
-        if (node.right) {
-            if (node.right->op.type == ExprOpType::MUX) {
-                assert(node.right->left->valueNum >= 0);
-                assert(node.right->right->valueNum >= 0);
-                opcode.src2 = node.right->left->valueNum;
-                opcode.src3 = node.right->right->valueNum;
+
+        int srcs[3] = { -1, -1, -1 };
+        for (size_t i = 0; i < children.size(); ++i) {
+            const ExpressionTreeNode *child = children[i];
+            assert(child->valueNum >= 0);
+            if (rematerializable(child)) {
+                ExprInstruction opcode(child->op);
+                opcode.dst = nextReg++;
+                code.push_back(opcode);
+                srcs[i] = opcode.dst;
             } else {
-                assert(node.right->valueNum >= 0);
-                opcode.src2 = node.right->valueNum;
+                srcs[i] = child->valueNum;
             }
         }
 
+        ExprInstruction opcode(node.op);
+        opcode.dst = node.valueNum;
+        opcode.src1 = srcs[0];
+        opcode.src2 = srcs[1];
+        opcode.src3 = srcs[2];
         code.push_back(opcode);
         found.insert(node.valueNum);
-    });
+    };
+    emit(*tree.getRoot());
 
     ExprInstruction store(ExprOpType::MEM_STORE_U8);
 
@@ -3730,103 +4429,354 @@ std::vector<ExprInstruction> compile(ExpressionTree &tree, const VSFormat *forma
     return code;
 }
 
-static void VS_CC exprInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
-    ExprData *d = static_cast<ExprData *>(*instanceData);
-    vsapi->setVideoInfo(&d->vi, 1, node);
+// Resolves coordinate v along n pixels, clamped or mirrored at the edges.
+static int edgeCoord(int v, int n, bool mirror)
+{
+    if (mirror)
+        v = v < 0 ? -1 - v : (v >= n ? 2 * n - 1 - v : v);
+    return std::min(std::max(v, 0), n - 1);
+}
+
+// Fills dstp with count pixels of the row at srcp (of w pixels), starting at
+// x = -padX, with offscreen pixels clamped or mirrored from the respective edge.
+template <class T>
+static void padRow(const uint8_t *srcp, uint8_t *dstp, int w, int padX, int count, bool mirror)
+{
+    const T *s = reinterpret_cast<const T *>(srcp);
+    T *d = reinterpret_cast<T *>(dstp);
+    // Pixels [x0, x1) of dstp read from inside the source row.
+    int x0 = std::min(padX, count);
+    int x1 = std::min(padX + w, count);
+    for (int i = 0; i < x0; i++)
+        d[i] = s[edgeCoord(i - padX, w, mirror)];
+    memcpy(d + x0, s, (x1 - x0) * sizeof(T));
+    for (int i = x1; i < count; i++)
+        d[i] = s[edgeCoord(i - padX, w, mirror)];
+}
+
+// Largest number of input bits for which lookup tables are built, and the
+// smallest weighted instruction count of a program worth replacing with one.
+#define EXPR_LUT_MAX_BITS 16
+#define EXPR_LUT_MIN_COST 16
+
+// Fills in program.lut if the program only reads the current pixel of one or
+// two integer clips with at most EXPR_LUT_MAX_BITS bits in total and is
+// expensive enough. The table is evaluated by program.proc if it was
+// assembled, or else by the interpreter, i.e. by whatever would otherwise
+// process the plane, so that both give the same samples.
+static bool buildLut(ExprProgram &program, const VSVideoInfo * const *vi, int numInputs, const VSVideoFormat *format)
+{
+    int nclips = 0;
+    int cost = 0;
+    for (const ExprInstruction &insn : program.bytecode) {
+        switch (insn.op.type) {
+        case ExprOpType::MEM_LOAD_U8:
+        case ExprOpType::MEM_LOAD_U16:
+            if (insn.op.imm.u >= static_cast<unsigned>(numInputs))
+                return false;
+            if (std::find(program.lutClip, program.lutClip + nclips, static_cast<int>(insn.op.imm.u)) != program.lutClip + nclips)
+                break;
+            if (nclips == 2)
+                return false;
+            program.lutClip[nclips++] = insn.op.imm.u;
+            break;
+        case ExprOpType::MEM_LOAD_F16:
+        case ExprOpType::MEM_LOAD_F32:
+        case ExprOpType::MEM_LOAD_CONST:
+        case ExprOpType::MEM_STORE_F16:
+            return false;
+        case ExprOpType::DIV: case ExprOpType::MOD: case ExprOpType::SQRT:
+            cost += 4;
+            break;
+        case ExprOpType::EXP: case ExprOpType::LOG:
+            cost += 20;
+            break;
+        case ExprOpType::SIN: case ExprOpType::COS:
+            cost += 25;
+            break;
+        case ExprOpType::POW:
+            cost += 40;
+            break;
+        default:
+            cost += 1;
+            break;
+        }
+    }
+    if (nclips == 0 || cost < EXPR_LUT_MIN_COST || !program.rel.empty())
+        return false;
+    int bits[2] = {};
+    for (int k = 0; k < nclips; k++)
+        bits[k] = vi[program.lutClip[k]]->format.bitsPerSample;
+    if (bits[0] + bits[1] > EXPR_LUT_MAX_BITS || (nclips == 2 && (bits[0] != 8 || bits[1] != 8)))
+        return false;
+    if (nclips == 1)
+        program.lutClip[1] = program.lutClip[0];
+
+    // Every combination of input values becomes one pixel of a single row,
+    // aligned like the planes of a frame for the routine.
+    const int size = 1 << (bits[0] + bits[1]);
+    constexpr size_t align = 64;
+    auto aligned = [](std::vector<uint8_t> &buf, size_t bytes) {
+        buf.resize(bytes + align);
+        return buf.data() + (align - reinterpret_cast<uintptr_t>(buf.data()) % align) % align;
+    };
+    std::vector<uint8_t> planes[2], out;
+    std::vector<const uint8_t *> srcp(numInputs);
+    for (int k = 0; k < nclips; k++) {
+        const int bytes = vi[program.lutClip[k]]->format.bytesPerSample;
+        uint8_t *p = aligned(planes[k], static_cast<size_t>(size) * bytes);
+        for (int v = 0; v < size; v++) {
+            unsigned val = nclips == 2 ? (k == 0 ? v >> 8 : v & 0xFF) : v;
+            if (bytes == 1)
+                p[v] = static_cast<uint8_t>(val);
+            else
+                reinterpret_cast<uint16_t *>(p)[v] = static_cast<uint16_t>(val);
+        }
+        srcp[program.lutClip[k]] = p;
+    }
+
+    const size_t lutBytes = static_cast<size_t>(size) * format->bytesPerSample;
+    uint8_t *dstp = aligned(out, lutBytes);
+    std::vector<float> consts(CONST_FIRST_PROP, 0.0f);
+    if (program.proc) {
+        // One row of size / step steps, see exprGetFrame.
+        std::vector<intptr_t> ptroffsets(((numInputs + 2) + 7) & ~7);
+        ptroffsets[0] = format->bytesPerSample * program.step;
+        for (int i = 0; i < numInputs; i++)
+            ptroffsets[i + 1] = vi[i]->format.bytesPerSample * program.step;
+        ptroffsets[numInputs + 1] = program.step * sizeof(float);
+        std::vector<uint8_t *> rwptrs(ptroffsets.size());
+        std::vector<intptr_t> rowadj(ptroffsets.size());
+        rwptrs[0] = dstp;
+        for (int i = 0; i < numInputs; i++)
+            rwptrs[i + 1] = const_cast<uint8_t *>(srcp[i]);
+        program.proc(rwptrs.data(), ptroffsets.data(), consts.data(), size / program.step, rowadj.data(), 1);
+    } else {
+        ExprInterpreter interpreter(program.bytecode.data(), program.bytecode.size());
+        for (int x = 0; x < size; x += ExprInterpreter::blockSize)
+            interpreter.eval(srcp.data(), dstp, consts.data(), x, std::min(ExprInterpreter::blockSize, size - x));
+    }
+    program.lut.assign(dstp, dstp + lutBytes);
+    return true;
+}
+
+template <class TI, class TO>
+static void applyLut(const uint8_t *srcp, ptrdiff_t src_stride, uint8_t *dstp, ptrdiff_t dst_stride, int w, int h, const std::vector<uint8_t> &lut)
+{
+    const TO *table = reinterpret_cast<const TO *>(lut.data());
+    const unsigned last = static_cast<unsigned>(lut.size() / sizeof(TO)) - 1;
+    for (int y = 0; y < h; y++) {
+        const TI *s = reinterpret_cast<const TI *>(srcp + y * src_stride);
+        TO *t = reinterpret_cast<TO *>(dstp + y * dst_stride);
+        for (int x = 0; x < w; x++)
+            t[x] = table[std::min<unsigned>(s[x], last)];
+    }
+}
+
+template <class TO>
+static void applyLut2(const uint8_t *srcp0, ptrdiff_t src_stride0, const uint8_t *srcp1, ptrdiff_t src_stride1, uint8_t *dstp, ptrdiff_t dst_stride, int w, int h, const std::vector<uint8_t> &lut)
+{
+    const TO *table = reinterpret_cast<const TO *>(lut.data());
+    for (int y = 0; y < h; y++) {
+        const uint8_t *s0 = srcp0 + y * src_stride0;
+        const uint8_t *s1 = srcp1 + y * src_stride1;
+        TO *t = reinterpret_cast<TO *>(dstp + y * dst_stride);
+        for (int x = 0; x < w; x++)
+            t[x] = table[(s0[x] << 8) | s1[x]];
+    }
 }
 
-static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    ExprData *d = static_cast<ExprData *>(*instanceData);
+static void lutPlane(const ExprProgram &program, const VSFrame * const *src, int plane, uint8_t *dstp, ptrdiff_t dst_stride, int w, int h, int outBytes, const VSAPI *vsapi)
+{
+    const VSFrame *f = src[program.lutClip[0]];
+    const uint8_t *srcp = vsapi->getReadPtr(f, plane);
+    ptrdiff_t src_stride = vsapi->getStride(f, plane);
+    if (program.lutClip[1] != program.lutClip[0]) {
+        const VSFrame *f1 = src[program.lutClip[1]];
+        const uint8_t *srcp1 = vsapi->getReadPtr(f1, plane);
+        ptrdiff_t src_stride1 = vsapi->getStride(f1, plane);
+        if (outBytes == 1)
+            applyLut2<uint8_t>(srcp, src_stride, srcp1, src_stride1, dstp, dst_stride, w, h, program.lut);
+        else if (outBytes == 2)
+            applyLut2<uint16_t>(srcp, src_stride, srcp1, src_stride1, dstp, dst_stride, w, h, program.lut);
+        else
+            applyLut2<uint32_t>(srcp, src_stride, srcp1, src_stride1, dstp, dst_stride, w, h, program.lut);
+        return;
+    }
+    bool in8 = vsapi->getVideoFrameFormat(f)->bytesPerSample == 1;
+    if (outBytes == 1) {
+        if (in8) applyLut<uint8_t, uint8_t>(srcp, src_stride, dstp, dst_stride, w, h, program.lut);
+        else applyLut<uint16_t, uint8_t>(srcp, src_stride, dstp, dst_stride, w, h, program.lut);
+    } else if (outBytes == 2) {
+        if (in8) applyLut<uint8_t, uint16_t>(srcp, src_stride, dstp, dst_stride, w, h, program.lut);
+        else applyLut<uint16_t, uint16_t>(srcp, src_stride, dstp, dst_stride, w, h, program.lut);
+    } else {
+        if (in8) applyLut<uint8_t, uint32_t>(srcp, src_stride, dstp, dst_stride, w, h, program.lut);
+        else applyLut<uint16_t, uint32_t>(srcp, src_stride, dstp, dst_stride, w, h, program.lut);
+    }
+}
+
+static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    ExprData *d = static_cast<ExprData *>(instanceData);
     int numInputs = d->numInputs;
 
     if (activationReason == arInitial) {
         for (int i = 0; i < numInputs; i++)
             vsapi->requestFrameFilter(n, d->node[i], frameCtx);
     } else if (activationReason == arAllFramesReady) {
-        const VSFrame *src[MAX_EXPR_INPUTS] = {};
+        std::vector<const VSFrame *> src(numInputs);
         for (int i = 0; i < numInputs; i++)
             src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
 
-        const VSFormat *fi = d->vi.format;
+        const VSVideoFormat *fi = &d->vi.format;
         int height = vsapi->getFrameHeight(src[0], 0);
         int width = vsapi->getFrameWidth(src[0], 0);
         int planes[3] = { 0, 1, 2 };
         const VSFrame *srcf[3] = { d->plane[0] != poCopy ? nullptr : src[0], d->plane[1] != poCopy ? nullptr : src[0], d->plane[2] != poCopy ? nullptr : src[0] };
         VSFrame *dst = vsapi->newVideoFrame2(fi, width, height, srcf, planes, src[0], core);
 
-        const uint8_t *srcp[MAX_EXPR_INPUTS] = {};
-        int src_stride[MAX_EXPR_INPUTS] = {};
-        alignas(32) intptr_t ptroffsets[((MAX_EXPR_INPUTS + 1) + 7) & ~7] = { d->vi.format->bytesPerSample * 8 };
-
-        for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
+        for (int plane = 0; plane < d->vi.format.numPlanes; plane++) {
             if (d->plane[plane] != poProcess)
                 continue;
 
+            const ExprProgram &program = *d->program[plane];
+            if (!program.lut.empty()) {
+                lutPlane(program, src.data(), plane, vsapi->getWritePtr(dst, plane), vsapi->getStride(dst, plane),
+                         vsapi->getFrameWidth(dst, plane), vsapi->getFrameHeight(dst, plane), d->vi.format.bytesPerSample, vsapi);
+                continue;
+            }
+
+            int numRel = static_cast<int>(program.rel.size());
+            int numSrcs = numInputs + numRel;
+
+            std::vector<const uint8_t *> srcp(numSrcs);
+            std::vector<int> src_stride(numSrcs);
+            std::vector<intptr_t> ptroffsets(((numSrcs + 2) + 7) & ~7);
+            ptroffsets[0] = d->vi.format.bytesPerSample * program.step;
+
             for (int i = 0; i < numInputs; i++) {
-                if (d->node[i]) {
-                    srcp[i] = vsapi->getReadPtr(src[i], plane);
-                    src_stride[i] = vsapi->getStride(src[i], plane);
-                    ptroffsets[i + 1] = vsapi->getFrameFormat(src[i])->bytesPerSample * 8;
-                }
+                srcp[i] = vsapi->getReadPtr(src[i], plane);
+                src_stride[i] = vsapi->getStride(src[i], plane);
+                ptroffsets[i + 1] = vsapi->getVideoFrameFormat(src[i])->bytesPerSample * program.step;
             }
+            for (int k = 0; k < numRel; k++)
+                ptroffsets[numInputs + k + 1] = ptroffsets[program.rel[k].clip + 1];
 
             uint8_t *dstp = vsapi->getWritePtr(dst, plane);
             int dst_stride = vsapi->getStride(dst, plane);
             int h = vsapi->getFrameHeight(dst, plane);
             int w = vsapi->getFrameWidth(dst, plane);
+            int niterations = (w + program.step - 1) / program.step;
 
             // reserved slots: [0] is current frame number, [1] is current row.
             std::vector<float> frame_consts(CONST_FIRST_PROP, 0.0f);
             frame_consts[CONST_N] = n;
-            frame_consts.reserve(CONST_FIRST_PROP + d->pa[plane].size());
-            for (const auto &pa : d->pa[plane]) {
-                auto m = vsapi->getFramePropsRO(src[pa.clip]);
+            frame_consts.reserve(CONST_FIRST_PROP + program.pa.size());
+            for (const auto &pa : program.pa) {
+                auto m = vsapi->getFramePropertiesRO(src[pa.clip]);
                 int err = 0;
-                float val = vsapi->propGetInt(m, pa.name.c_str(), 0, &err);
+                float val = vsapi->mapGetInt(m, pa.name.c_str(), 0, &err);
                 if (err == peType)
-                    val = vsapi->propGetFloat(m, pa.name.c_str(), 0, &err);
+                    val = vsapi->mapGetFloat(m, pa.name.c_str(), 0, &err);
                 if (err != 0)
                     val = std::nanf(""); // XXX: should we warn the user?
                 frame_consts.push_back(val);
             }
 
-            if (d->proc[plane]) {
-                ExprData::ProcessLineProc proc = d->proc[plane];
-                int niterations = (w + 7) / 8;
-
-                for (int i = 0; i < numInputs; i++) {
-                    if (d->node[i])
-                        ptroffsets[i + 1] = vsapi->getFrameFormat(src[i])->bytesPerSample * 8;
-                }
-                ptroffsets[numInputs + 1] = 8 * sizeof(float);
-
-                for (int y = 0; y < h; y++) {
-                    frame_consts[CONST_Y] = y;
-                    alignas(32) uint8_t *rwptrs[((MAX_EXPR_INPUTS + 1 + 1) + 7) & ~7] = { dstp + dst_stride * y };
-                    for (int i = 0; i < numInputs; i++) {
-                        rwptrs[i + 1] = const_cast<uint8_t *>(srcp[i] + src_stride[i] * y);
+            // Processes rows [y, y + rows) from the current pointers, and
+            // advances those of the clips and dstp past them.
+            auto processRows = [&](int y, int rows) {
+                frame_consts[CONST_Y] = static_cast<float>(y);
+                if (program.proc) {
+                    ptroffsets[numSrcs + 1] = program.step * sizeof(float);
+
+                    // The routine walks the rows, moving each pointer from
+                    // the end of a row to the start of the next one by rowadj.
+                    std::vector<uint8_t *> rwptrs(ptroffsets.size());
+                    std::vector<intptr_t> rowadj(ptroffsets.size());
+                    rwptrs[0] = dstp;
+                    rowadj[0] = dst_stride - ptroffsets[0] * niterations;
+                    for (int i = 0; i < numSrcs; i++) {
+                        rwptrs[i + 1] = const_cast<uint8_t *>(srcp[i]);
+                        rowadj[i + 1] = src_stride[i] - ptroffsets[i + 1] * niterations;
                     }
-                    proc(rwptrs, ptroffsets, &frame_consts[0], niterations);
-                }
-            } else {
-                ExprInterpreter interpreter(d->bytecode[plane].data(), d->bytecode[plane].size());
-
-                for (int y = 0; y < h; y++) {
-                    frame_consts[CONST_Y] = y;
-                    for (int x = 0; x < w; x++) {
-                        interpreter.eval(srcp, dstp, &frame_consts[0], x);
+                    rowadj[numSrcs + 1] = -ptroffsets[numSrcs + 1] * niterations;
+                    program.proc(rwptrs.data(), ptroffsets.data(), &frame_consts[0], niterations, rowadj.data(), rows);
+                } else {
+                    ExprInterpreter interpreter(program.bytecode.data(), program.bytecode.size());
+                    std::vector<const uint8_t *> rowp = srcp;
+                    for (int i = 0; i < rows; i++) {
+                        frame_consts[CONST_Y] = static_cast<float>(y + i);
+                        for (int x = 0; x < w; x += ExprInterpreter::blockSize)
+                            interpreter.eval(rowp.data(), dstp + static_cast<ptrdiff_t>(dst_stride) * i, &frame_consts[0], x, std::min(ExprInterpreter::blockSize, w - x));
+                        for (int k = 0; k < numSrcs; k++)
+                            rowp[k] += src_stride[k];
                     }
+                }
+                for (int i = 0; i < numInputs; i++)
+                    srcp[i] += static_cast<ptrdiff_t>(src_stride[i]) * rows;
+                dstp += static_cast<ptrdiff_t>(dst_stride) * rows;
+            };
+
+            if (numRel == 0) {
+                if (h > 0)
+                    processRows(0, h);
+                continue;
+            }
 
-                    for (int i = 0; i < numInputs; i++) {
-                        srcp[i] += src_stride[i];
-                    }
-                    dstp += dst_stride;
+            // Relative accesses read the rings of padded rows of their
+            // RelSource, one row at a time (see RelSource).
+            const int numSources = static_cast<int>(program.relSources.size());
+            const std::vector<const uint8_t *> planeStart(srcp.begin(), srcp.begin() + numInputs);
+            std::vector<size_t> ringOffset(numSources), rowBytes(numSources);
+            std::vector<int> ringRows(numSources), bps(numSources);
+            size_t total = 0;
+            for (int s = 0; s < numSources; s++) {
+                const RelSource &rs = program.relSources[s];
+                bps[s] = vsapi->getVideoFrameFormat(src[rs.clip])->bytesPerSample;
+                rowBytes[s] = ((static_cast<size_t>(program.step) * niterations + 2 * rs.padX) * bps[s] + 31) & ~static_cast<size_t>(31);
+                ringRows[s] = 2 * rs.padY + 1;
+                ringOffset[s] = total;
+                total += rowBytes[s] * ringRows[s];
+            }
+            std::unique_ptr<std::vector<uint8_t>> ring = d->acquireRing();
+            if (ring->size() < total + 31)
+                ring->resize(total + 31);
+            uint8_t *base = reinterpret_cast<uint8_t *>((reinterpret_cast<uintptr_t>(ring->data()) + 31) & ~static_cast<uintptr_t>(31));
+
+            // Copies row r (which may be past the top or bottom edge) of source s into its ring.
+            auto fillRow = [&](int s, int r) {
+                const RelSource &rs = program.relSources[s];
+                const uint8_t *row = planeStart[rs.clip] + static_cast<ptrdiff_t>(src_stride[rs.clip]) * edgeCoord(r, h, rs.boundary);
+                uint8_t *out = base + ringOffset[s] + rowBytes[s] * ((r + rs.padY) % ringRows[s]);
+                int count = program.step * niterations + 2 * rs.padX;
+                if (bps[s] == 1)
+                    padRow<uint8_t>(row, out, w, rs.padX, count, rs.boundary);
+                else if (bps[s] == 2)
+                    padRow<uint16_t>(row, out, w, rs.padX, count, rs.boundary);
+                else
+                    padRow<float>(row, out, w, rs.padX, count, rs.boundary);
+            };
+            for (int s = 0; s < numSources; s++)
+                for (int r = -program.relSources[s].padY; r < program.relSources[s].padY; r++)
+                    fillRow(s, r);
+
+            for (int y = 0; y < h; y++) {
+                for (int s = 0; s < numSources; s++)
+                    fillRow(s, y + program.relSources[s].padY);
+                for (int k = 0; k < numRel; k++) {
+                    const RelAccess &ra = program.rel[k];
+                    const int s = program.relSource[k];
+                    const RelSource &rs = program.relSources[s];
+                    srcp[numInputs + k] = base + ringOffset[s] + rowBytes[s] * ((y + ra.y + rs.padY) % ringRows[s]) + static_cast<ptrdiff_t>(rs.padX + ra.x) * bps[s];
                 }
+                processRows(y, 1);
             }
+            d->releaseRing(std::move(ring));
         }
 
-        for (int i = 0; i < MAX_EXPR_INPUTS; i++) {
-            vsapi->freeFrame(src[i]);
+        for (auto f : src) {
+            vsapi->freeFrame(f);
         }
         return dst;
     }
@@ -3836,11 +4786,72 @@ static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void **ins
 
 static void VS_CC exprFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(instanceData);
-    for (int i = 0; i < MAX_EXPR_INPUTS; i++)
-        vsapi->freeNode(d->node[i]);
+    for (auto node : d->node)
+        vsapi->freeNode(node);
     delete d;
 }
 
+// Programs are cached by everything that affects tokenization, optimization and
+// code generation, so that nodes created with an already seen expression (e.g.
+// the same Expr applied to many clips in a script) skip straight to the shared
+// routine. Entries are weak so that the code is released with the last node.
+static std::mutex programCacheLock;
+static std::unordered_map<std::string, std::weak_ptr<const ExprProgram>> programCache;
+
+static std::shared_ptr<const ExprProgram> getProgram(const std::string &expr, const VSVideoInfo * const *vi, int numInputs, const VSVideoFormat *format, int cpulevel, bool mirror)
+{
+    std::string key = "cpu=" + std::to_string(cpulevel) + "|mirror=" + std::to_string(mirror);
+    key += "|out=" + std::to_string(format->sampleType) + ":" + std::to_string(format->bitsPerSample);
+    for (int i = 0; i < numInputs; i++)
+        key += "|" + std::to_string(vi[i]->format.sampleType) + ":" + std::to_string(vi[i]->format.bitsPerSample);
+    key += "|expr=" + expr;
+
+    // Compilation happens under the lock so that concurrent creation of
+    // identical nodes assembles the routine only once.
+    std::lock_guard<std::mutex> guard(programCacheLock);
+    auto it = programCache.find(key);
+    if (it != programCache.end()) {
+        if (auto program = it->second.lock())
+            return program;
+    }
+
+    auto tree = parseExpr(expr, vi, numInputs, mirror);
+    auto program = std::make_shared<ExprProgram>();
+    program->bytecode = compile(tree, format);
+    program->pa = tree.getPropAccess();
+    program->rel = tree.getRelAccess();
+    for (const auto &ra : program->rel) {
+        auto it = std::find_if(program->relSources.begin(), program->relSources.end(), [&](const RelSource &rs) {
+            return rs.clip == ra.clip && rs.boundary == ra.boundary;
+        });
+        if (it == program->relSources.end())
+            it = program->relSources.insert(program->relSources.end(), { ra.clip, ra.boundary, 0, 0 });
+        it->padX = std::max(it->padX, std::abs(ra.x));
+        it->padY = std::max(it->padY, std::abs(ra.y));
+        program->relSource.push_back(static_cast<int>(it - program->relSources.begin()));
+    }
+
+    if (cpulevel > VS_CPU_LEVEL_NONE) {
+#ifdef VS_TARGET_CPU_X86
+        std::unique_ptr<ExprCompiler> compiler = make_compiler(numInputs + static_cast<int>(program->rel.size()), cpulevel, program->bytecode);
+        compiler->addInstructions(program->bytecode);
+        std::tie(program->proc, program->procSize) = compiler->getCode();
+        program->step = compiler->pixelsPerStep();
+#endif
+    }
+    // Expensive programs of one or two low bit depth pixels are then applied as tables.
+    buildLut(*program, vi, numInputs, format);
+
+    for (auto i = programCache.begin(); i != programCache.end();) {
+        if (i->second.expired())
+            i = programCache.erase(i);
+        else
+            ++i;
+    }
+    programCache[key] = program;
+    return program;
+}
+
 static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<ExprData> d(new ExprData);
     int err;
@@ -3854,25 +4865,23 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
 
     try {
         d->numInputs = vsapi->mapNumElements(in, "clips");
-        if (d->numInputs > 26)
-            throw std::runtime_error("More than 26 input clips provided");
 
         for (int i = 0; i < d->numInputs; i++) {
-            d->node[i] = vsapi->propGetNode(in, "clips", i, &err);
+            d->node.push_back(vsapi->mapGetNode(in, "clips", i, &err));
         }
 
-        const VSVideoInfo *vi[MAX_EXPR_INPUTS] = {};
+        std::vector<const VSVideoInfo *> vi(d->numInputs);
         for (int i = 0; i < d->numInputs; i++) {
             if (d->node[i])
                 vi[i] = vsapi->getVideoInfo(d->node[i]);
         }
 
         for (int i = 0; i < d->numInputs; i++) {
-            if (!isConstantFormat(vi[i]))
+            if (!vsh::isConstantVideoFormat(vi[i]))
                 throw std::runtime_error("Only clips with constant format and dimensions allowed");
-            if (vi[0]->format->numPlanes != vi[i]->format->numPlanes
-                || vi[0]->format->subSamplingW != vi[i]->format->subSamplingW
-                || vi[0]->format->subSamplingH != vi[i]->format->subSamplingH
+            if (vi[0]->format.numPlanes != vi[i]->format.numPlanes
+                || vi[0]->format.subSamplingW != vi[i]->format.subSamplingW
+                || vi[0]->format.subSamplingH != vi[i]->format.subSamplingH
                 || vi[0]->width != vi[i]->width
                 || vi[0]->height != vi[i]->height)
             {
@@ -3880,31 +4889,33 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             }
 
             if (EXPR_F16C_TEST) {
-                if ((vi[i]->format->bitsPerSample > 16 && vi[i]->format->sampleType == stInteger)
-                    || (vi[i]->format->bitsPerSample != 16 && vi[i]->format->bitsPerSample != 32 && vi[i]->format->sampleType == stFloat))
+                if ((vi[i]->format.bitsPerSample > 16 && vi[i]->format.sampleType == stInteger)
+                    || (vi[i]->format.bitsPerSample != 16 && vi[i]->format.bitsPerSample != 32 && vi[i]->format.sampleType == stFloat))
                     throw std::runtime_error("Input clips must be 8-16 bit integer or 16/32 bit float format");
             } else {
-                if ((vi[i]->format->bitsPerSample > 16 && vi[i]->format->sampleType == stInteger)
-                    || (vi[i]->format->bitsPerSample != 32 && vi[i]->format->sampleType == stFloat))
+                if ((vi[i]->format.bitsPerSample > 16 && vi[i]->format.sampleType == stInteger)
+                    || (vi[i]->format.bitsPerSample != 32 && vi[i]->format.sampleType == stFloat))
                     throw std::runtime_error("Input clips must be 8-16 bit integer or 32 bit float format");
             }
         }
 
         d->vi = *vi[0];
-        int format = int64ToIntS(vsapi->propGetInt(in, "format", 0, &err));
+        int format = vsh::int64ToIntS(vsapi->mapGetInt(in, "format", 0, &err));
         if (!err) {
-            const VSFormat *f = vsapi->getFormatPreset(format, core);
-            if (f) {
-                if (d->vi.format->colorFamily == cmCompat)
-                    throw std::runtime_error("No compat formats allowed");
-                if (d->vi.format->numPlanes != f->numPlanes)
+            VSVideoFormat f;
+            if (vsapi->getVideoFormatByID(&f, format, core)) {
+                if (d->vi.format.numPlanes != f.numPlanes)
                     throw std::runtime_error("The number of planes in the inputs and output must match");
-                d->vi.format = vsapi->registerFormat(d->vi.format->colorFamily, f->sampleType, f->bitsPerSample, d->vi.format->subSamplingW, d->vi.format->subSamplingH, core);
+                vsapi->queryVideoFormat(&d->vi.format, d->vi.format.colorFamily, f.sampleType, f.bitsPerSample, d->vi.format.subSamplingW, d->vi.format.subSamplingH, core);
             }
         }
 
+        int mirror = vsh::int64ToIntS(vsapi->mapGetInt(in, "boundary", 0, &err));
+        if (err)
+            mirror = 0;
+
         int nexpr = vsapi->mapNumElements(in, "expr");
-        if (nexpr > d->vi.format->numPlanes)
+        if (nexpr > d->vi.format.numPlanes)
             throw std::runtime_error("More expressions given than there are planes");
 
         std::string expr[3];
@@ -3915,11 +4926,11 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             expr[i] = expr[nexpr - 1];
         }
 
-        for (int i = 0; i < d->vi.format->numPlanes; i++) {
+        for (int i = 0; i < d->vi.format.numPlanes; i++) {
             if (!expr[i].empty()) {
                 d->plane[i] = poProcess;
             } else {
-                if (d->vi.format->bitsPerSample == vi[0]->format->bitsPerSample && d->vi.format->sampleType == vi[0]->format->sampleType)
+                if (d->vi.format.bitsPerSample == vi[0]->format.bitsPerSample && d->vi.format.sampleType == vi[0]->format.sampleType)
                     d->plane[i] = poCopy;
                 else
                     d->plane[i] = poUndefined;
@@ -3928,38 +4939,31 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             if (d->plane[i] != poProcess)
                 continue;
 
-            auto tree = parseExpr(expr[i], vi, d->numInputs);
-            d->bytecode[i] = compile(tree, d->vi.format);
-            d->pa[i] = tree.getPropAccess();
-
-            int cpulevel = vs_get_cpulevel(core);
-            if (cpulevel > VS_CPU_LEVEL_NONE) {
-#ifdef VS_TARGET_CPU_X86
-                std::unique_ptr<ExprCompiler> compiler = make_compiler(d->numInputs, cpulevel);
-                compiler->addInstructions(d->bytecode[i]);
-                std::tie(d->proc[i], d->procSize[i]) = compiler->getCode();
-#endif
-            }
+            d->program[i] = getProgram(expr[i], vi.data(), d->numInputs, &d->vi.format, vs_get_cpulevel(core), mirror);
         }
 #ifdef VS_TARGET_OS_WINDOWS
         FlushInstructionCache(GetCurrentProcess(), nullptr, 0);
 #endif
     } catch (std::runtime_error &e) {
-        for (int i = 0; i < MAX_EXPR_INPUTS; i++) {
-            vsapi->freeNode(d->node[i]);
+        for (auto node : d->node) {
+            vsapi->freeNode(node);
         }
-        vsapi->setError(out, (std::string{ "Expr: " } + e.what()).c_str());
+        vsapi->mapSetError(out, (std::string{ "Expr: " } + e.what()).c_str());
         return;
     }
 
-    vsapi->createFilter(in, out, "Expr", exprInit, exprGetFrame, exprFree, fmParallel, 0, d.release(), core);
+    std::vector<VSFilterDependency> deps;
+    for (auto node : d->node)
+        deps.push_back({ node, rpStrictSpatial });
+    const VSVideoInfo vi = d->vi;
+    vsapi->createVideoFilter(out, "Expr", &vi, exprGetFrame, exprFree, fmParallel, deps.data(), static_cast<int>(deps.size()), d.release(), core);
 }
 
 void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi)
 {
-    vsapi->mapSetData(out, "expr_backend", "jitasm", -1, maAppend);
+    vsapi->mapSetData(out, "expr_backend", "jitasm", -1, dtUtf8, maAppend);
     for (const auto &f : features)
-        vsapi->mapSetData(out, "expr_features", f.c_str(), -1, maAppend);
+        vsapi->mapSetData(out, "expr_features", f.c_str(), -1, dtUtf8, maAppend);
 }
 
 } // namespace
@@ -3969,7 +4973,7 @@ void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *c
 // Init
 
 void VS_CC exprInitialize(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
-    vsapi->registerFunction("Expr", "clips:vnode[];expr:data[];format:int:opt;", "clip:vnode;", exprCreate, nullptr, plugin);
+    vsapi->registerFunction("Expr", "clips:vnode[];expr:data[];format:int:opt;boundary:int:opt;", "clip:vnode;", exprCreate, nullptr, plugin);
 
     registerVersionFunc(versionCreate);
 }
@@ -26,6 +26,8 @@
 #include "VapourSynth4.h"
 #include "VapourSynth3.h"
 
+#include <stdlib.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -39,4 +41,10 @@ void vsLog3(vs3::VSMessageType type, const char *msg, ...);
 }
 #endif
 
+#define vsDebug(...) vsLog3(vs3::mtDebug, __VA_ARGS__)
+#define vsWarning(...) vsLog3(vs3::mtWarning, __VA_ARGS__)
+#define vsCritical(...) vsLog3(vs3::mtCritical, __VA_ARGS__)
+// Unlike the others, also terminates the process.
+#define vsFatal(...) (vsLog3(vs3::mtFatal, __VA_ARGS__), abort())
+
 #endif
@@ -20,38 +20,88 @@
 #define USE_EXPR_CACHE
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
 #include <charconv>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cctype>
 #include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <limits>
+#include <list>
+#include <locale>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <numbers>
 #include <numeric>
 #include <regex>
 #include <set>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 #include "VapourSynth4.h"
 #include "VSHelper4.h"
+#include "../filterstats.h"
 #include "../plugin.h"
+#include "../propsnapshot.h"
+#include "../workpool.h"
+#include "version.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "Module.hpp"
+#include "CPUID.hpp"
 #include "Debug.hpp"
 
-namespace {
+#ifdef HAVE_CUDA
+static std::vector<std::string> autoDllErrors;
+#ifdef _WIN32
+#define CUDA_DLL L"nvcuda.dll","nvcuda.dll",autoDllErrors
+#else
+#define CUDA_DLL "libcuda.so.1",autoDllErrors
+#endif
+#include "../ngx/cuda.h"
+#include "../ngx/devframe.h"
+#endif
 
-#define LANES 8
-#define UNROLL 1
+namespace {
 
 #define ALIGNMENT 32 /* VapourSynth should guarantee at least this for all data */
 
+#define BLOCK_CACHE_BYTES (128 << 10) /* working set target of column-blocked loops, about half of a typical L2 */
+
+#define EXPR_CACHE_LIMIT (64 << 20) /* bytes of executable memory kept alive by the compile cache */
+
+#define PREFETCH_MIN_STREAMS 8 /* input rows the hardware prefetchers can be expected to track on their own */
+
+#define PREFETCH_BYTES (4 << 10) /* minimum distance software prefetches should reach ahead */
+
+#define BRANCH_MIN_COST 16 /* estimated cost of a ternary operand worth branching around */
+
 enum class ExprOpType {
     // Terminals.
     MEM_LOAD, MEM_LOAD_VAR,
@@ -102,10 +152,17 @@ std::vector<std::string> features = {
     "drop",
     "sort",
     "x[]",
+    "x[]:b",
     "bitand", "bitor", "bitxor", "bitnot",
     clipNamePrefix + "0", clipNamePrefix + "26",
     "first-byte-of-bytes-property",
     "fp16",
+    "accuracy",
+    "x.property[N]",
+    "outputs",
+    "x{N}",
+    "x[conv]",
+    "branch",
 };
 
 std::vector<std::string> selectFeatures = {
@@ -120,8 +177,10 @@ std::vector<std::string> selectFeatures = {
     "bitand", "bitor", "bitxor", "bitnot",
     clipNamePrefix + "0", clipNamePrefix + "26",
     "first-byte-of-bytes-property",
+    "x.property[N]",
     // extended features only available for Select.
     "argmin", "argmax", "argsort",
+    "x[-1].property",
 };
 
 enum class ComparisonType {
@@ -182,8 +241,22 @@ bool operator==(const ExprOp &lhs, const ExprOp &rhs) {
 }
 bool operator!=(const ExprOp &lhs, const ExprOp &rhs) { return !(lhs == rhs); }
 
+// ops prepared by prepareInterpret() for repeated evaluation by interpret():
+// variables are numbered slots and the stack depth is known in advance, so
+// evaluation needs no allocation. The first error interpret() reports is
+// found beforehand and raised once evaluation reaches errorAt.
+struct InterpProgram {
+    std::vector<ExprOp> ops; // VAR_LOAD and VAR_STORE hold their slot in imm.u
+    size_t numVars = 0;
+    size_t maxDepth = 0;
+    size_t maxSort = 0; // largest argsortN
+    size_t errorAt = SIZE_MAX; // ops.size() if the expression as a whole is malformed
+    std::string error;
+};
+
 enum PlaneOp {
-    poProcess, poCopy, poUndefined
+    poProcess, poCopy, poUndefined,
+    poLut, // mapped through ExprData::lut
 };
 
 struct Compiled {
@@ -193,18 +266,639 @@ struct Compiled {
         std::string name;
     };
     std::vector<PropAccess> propAccess;
+    // The result does not depend on the position of a pixel, so a plane whose
+    // rows are contiguous in every clip may be processed as fewer, longer rows.
+    bool mergeRows = false;
+    // How the routine was obtained, reported with stats=1.
+    struct Stats {
+        double parseTime = 0; // tokenizing, decoding and optimizing the expressions
+        double optimizeTime = 0; // LLVM IR optimization
+        double codegenTime = 0; // LLVM machine code generation
+        size_t codeBytes = 0;
+        bool cacheHit = false; // found in the in-memory or disk cache
+    } stats;
+};
+
+// Frame properties whose values are compiled into a routine as constants,
+// keyed by (clip, property name).
+using Uniforms = std::map<std::pair<int, std::string>, float>;
+
+// With a reduction, the values of a plane's expression are folded into a
+// frame property instead of being stored. The routine then writes one float
+// per row to the plane's destination pointer, combining it with the value
+// already there; rows can thus be visited in several column blocks.
+enum class ReduceMode { None, Sum, Average, Min, Max };
+
+#define EXPR_SPECIALIZE_LIMIT 8 // distinct property value sets compiled per Expr instance
+#define EXPR_TIER_FRAMES 16 // frames requested before opt_level=-1 recompiles at opt_level=3
+
+// The frame properties a filter instance reads, registered when the filter is
+// created. They are read from the PropSnapshot of the frame, which is decoded
+// once for all the filters of the plugin reading it.
+//
+// A name may end in an element index, "Prop[3]" reading the 4th element of
+// Prop, or in "[]", which reads the element given to read(); neither can be
+// part of a property key.
+class PropertyReader {
+public:
+    // Returns the slot of (clip, name), adding it if needed.
+    int add(int clip, const std::string &name) {
+        auto it = index.emplace(std::make_pair(clip, name), (int)slots.size());
+        if (it.second) {
+            slots.emplace_back(clip, name);
+            if (slots.back().element < 0)
+                arraySlots.push_back(it.first->second);
+        }
+        return it.first->second;
+    }
+    int find(int clip, const std::string &name) const {
+        auto it = index.find({ clip, name });
+        return it == index.end() ? -1 : it->second;
+    }
+    size_t size() const { return slots.size(); }
+    int clip(int slot) const { return slots[slot].clip; }
+    // The slots whose name ends in "[]".
+    const std::vector<int> &arrays() const { return arraySlots; }
+
+    // Returns the value of the property in slot on props, or missing if it is
+    // not set. Data properties yield their bytes. element is used by "[]" slots.
+    float read(int slot, const PropSnapshot &props, float missing, int element = 0, bool *found = nullptr) const {
+        const Slot &s = slots[slot];
+        if (s.element >= 0)
+            element = s.element;
+        const PropValue *p = props.find(s.key);
+        bool ok = p != nullptr && element >= 0;
+        float val = 0.0f;
+        if (ok && p->type == ptInt) {
+            ok = element < p->count;
+            if (ok)
+                val = p->ints[element];
+        } else if (ok && p->type == ptFloat) {
+            ok = element < p->count;
+            if (ok)
+                val = p->floats[element];
+        } else if (ok && p->type == ptData) {
+            ok = p->count > 0 && (element == 0 || element < (int)p->data[0].size());
+            if (ok)
+                val = p->data[0][element];
+        } else {
+            ok = false;
+        }
+        if (found)
+            *found = ok;
+        return ok ? val : missing;
+    }
+
+    // The number of elements of the property in slot on props (bytes for
+    // data), 0 if it is not set.
+    int length(int slot, const PropSnapshot &props) const {
+        const PropValue *p = props.find(slots[slot].key);
+        if (p && p->type == ptData)
+            return p->count > 0 ? (int)p->data[0].size() : 0;
+        if (p && (p->type == ptInt || p->type == ptFloat))
+            return p->count;
+        return 0;
+    }
+
+private:
+    struct Slot {
+        int clip;
+        std::string name;
+        std::string key; // name without the element index
+        int element = 0; // -1 for "[]"
+        Slot(int clip, const std::string &name) : clip(clip), name(name), key(name) {
+            size_t pos = name.find('[');
+            if (pos != std::string::npos && name.back() == ']') {
+                key = name.substr(0, pos);
+                element = pos + 2 == name.size() ? -1 : atoi(name.c_str() + pos + 1);
+            }
+        }
+    };
+    std::deque<Slot> slots;
+    std::map<std::pair<int, std::string>, int> index;
+    std::vector<int> arraySlots;
+};
+
+// The properties of one frame request, each read at most once.
+class FrameProperties {
+public:
+    // keys identify frames, for sharing their snapshots.
+    FrameProperties(const PropertyReader &reader, const std::vector<const VSFrame *> &frames, FrameKeys keys, float missing, const VSAPI *vsapi) :
+        reader(reader), snapshots(std::move(keys), frames.data(), vsapi), missing(missing), values(reader.size()), done(reader.size()), absent(reader.size()) {}
+
+    float get(int slot) {
+        if (!done[slot]) {
+            bool found = false;
+            values[slot] = reader.read(slot, snapshots[reader.clip(slot)], missing, element, &found);
+            done[slot] = true;
+            absent[slot] = !found;
+        }
+        return values[slot];
+    }
+    // Whether slot was read and not set.
+    bool isMissing(int slot) const { return done[slot] && absent[slot]; }
+    float get(int clip, const std::string &name) {
+        int slot = reader.find(clip, name);
+        if (slot >= 0)
+            return get(slot);
+        PropertyReader once; // not registered when the filter was created
+        return once.read(once.add(clip, name), snapshots[clip], missing, element);
+    }
+
+    int length(int slot) const { return reader.length(slot, snapshots[reader.clip(slot)]); }
+    // Provides the value of a slot not read from the frames.
+    void set(int slot, float v) {
+        values[slot] = v;
+        done[slot] = true;
+        absent[slot] = false;
+    }
+    // Sets the element read by "[]" slots.
+    void setElement(int i) {
+        element = i;
+        for (int slot: reader.arrays())
+            done[slot] = false;
+    }
+
+private:
+    const PropertyReader &reader;
+    mutable PropSnapshots snapshots;
+    const float missing;
+    ScratchVector<float> values;
+    ScratchVector<char> done;
+    ScratchVector<char> absent;
+    int element = 0;
+};
+
+// The slots of reader that ops reads.
+static std::vector<int> propertySlots(const PropertyReader &reader, const std::vector<ExprOp> &ops) {
+    constexpr int last = static_cast<int>(LoadConstType::LAST);
+    std::vector<int> slots;
+    for (const auto &op: ops) {
+        if (op.type != ExprOpType::CONST_LOAD || op.imm.i < last)
+            continue;
+        int slot = reader.find(op.imm.i - last, op.name);
+        if (slot >= 0 && std::find(slots.begin(), slots.end(), slot) == slots.end())
+            slots.push_back(slot);
+    }
+    return slots;
+}
+
+// What an expression of Select or PropExpr cost so far, with stats=1.
+struct ExprCounters {
+    std::atomic<uint64_t> evaluations{ 0 }, nanoseconds{ 0 }, missing{ 0 }, errors{ 0 };
+
+    // Accounts an evaluation that started at start and read the properties
+    // in slots.
+    void add(std::chrono::steady_clock::time_point start, const FrameProperties &props, const std::vector<int> &slots, bool error) {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        evaluations.fetch_add(1, std::memory_order_relaxed);
+        nanoseconds.fetch_add(ns, std::memory_order_relaxed);
+        missing.fetch_add(std::count_if(slots.begin(), slots.end(), [&](int slot) { return props.isMissing(slot); }), std::memory_order_relaxed);
+        if (error)
+            errors.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+// Stores the counters as ExprEvaluations, ExprTime (seconds), ExprMissingProps
+// and ExprErrors, one element per expression.
+static void setCounterProps(VSMap *map, const std::deque<ExprCounters> &counters, const VSAPI *vsapi) {
+    for (const char *key: { "ExprEvaluations", "ExprTime", "ExprMissingProps", "ExprErrors" })
+        vsapi->mapDeleteKey(map, key);
+    for (const auto &c: counters) {
+        vsapi->mapSetInt(map, "ExprEvaluations", c.evaluations.load(std::memory_order_relaxed), maAppend);
+        vsapi->mapSetFloat(map, "ExprTime", c.nanoseconds.load(std::memory_order_relaxed) * 1e-9, maAppend);
+        vsapi->mapSetInt(map, "ExprMissingProps", c.missing.load(std::memory_order_relaxed), maAppend);
+        vsapi->mapSetInt(map, "ExprErrors", c.errors.load(std::memory_order_relaxed), maAppend);
+    }
+}
+
+static void logCounters(const std::string &filter, const std::vector<std::string> &names, const std::deque<ExprCounters> &counters, VSCore *core, const VSAPI *vsapi) {
+    for (size_t i = 0; i < counters.size(); i++) {
+        const auto &c = counters[i];
+        std::ostringstream ss;
+        ss << filter << ": " << names[i] << ": " << c.evaluations << " evaluations, "
+            << std::fixed << std::setprecision(3) << c.nanoseconds * 1e-6 << " ms, "
+            << c.missing << " missing properties, " << c.errors << " errors";
+        vsapi->logMessage(mtInformation, ss.str().c_str(), core);
+    }
+}
+
+// Registers the properties of the first numInputs clips that ops reads.
+static void addProperties(PropertyReader &reader, const std::vector<ExprOp> &ops, int numInputs) {
+    constexpr int last = static_cast<int>(LoadConstType::LAST);
+    for (const auto &op: ops)
+        if (op.type == ExprOpType::CONST_LOAD && op.imm.i >= last && op.imm.i - last < numInputs)
+            reader.add(op.imm.i - last, op.name);
+}
+
+// Frame property loads at a temporal offset (x[-1].Prop, Select and PropExpr
+// only) read frame n+offset of the clip, clamped to its length. Every distinct
+// (clip, offset) is a frame source, and bind() rewrites the loads to use the
+// source index in place of the clip index; the first sources are the clips
+// themselves at offset 0, so loads without an offset are left as they are.
+// Frames at other offsets are kept in a small ring, as neighbouring requests
+// share most of their window.
+class PropFrames {
+public:
+    void init(const std::vector<VSNode *> &nodes, const VSAPI *vsapi) {
+        this->nodes = nodes;
+        for (int i = 0; i < (int)nodes.size(); i++) {
+            sources.push_back({ i, 0 });
+            numFrames.push_back(vsapi->getVideoInfo(nodes[i])->numFrames);
+        }
+    }
+    void free(const VSAPI *vsapi) {
+        for (auto &e: ring)
+            vsapi->freeFrame(e.f);
+        ring.clear();
+    }
+
+    size_t size() const { return sources.size(); }
+
+    void bind(std::vector<ExprOp> &ops) {
+        constexpr int last = static_cast<int>(LoadConstType::LAST);
+        for (auto &op: ops) {
+            if (op.type != ExprOpType::CONST_LOAD || op.imm.i < last)
+                continue;
+            const int clip = op.imm.i - last;
+            if (clip >= (int)nodes.size())
+                throw std::runtime_error("property access clip out of range");
+            if (op.y == 0)
+                continue;
+            auto it = std::find(sources.begin(), sources.end(), std::make_pair(clip, op.y));
+            if (it == sources.end()) {
+                sources.push_back({ clip, op.y });
+                it = sources.end() - 1;
+                ring.resize(std::min<size_t>(2 * (sources.size() - nodes.size()), 16));
+            }
+            op.imm.i = last + (int)(it - sources.begin());
+            op.y = 0;
+        }
+    }
+
+    // arInitial: requests the frames of every source, except those that are
+    // in the ring, which are returned. The rest is filled in by fetch().
+    std::vector<const VSFrame *> request(int n, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+        std::vector<const VSFrame *> frames(sources.size(), nullptr);
+        for (size_t i = 0; i < sources.size(); i++) {
+            const int clip = sources[i].first, fn = frameNumber(n, i);
+            if (i >= nodes.size()) {
+                if (fn == n)
+                    continue; // the same frame as source clip
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto &e: ring)
+                    if (e.f && e.clip == clip && e.n == fn)
+                        frames[i] = vsapi->addFrameRef(e.f);
+                if (frames[i])
+                    continue;
+            }
+            vsapi->requestFrameFilter(fn, nodes[clip], frameCtx);
+        }
+        return frames;
+    }
+
+    // The keys of the frames of request n, in source order.
+    FrameKeys keys(int n) const {
+        FrameKeys k;
+        for (size_t i = 0; i < sources.size(); i++)
+            k.push_back({ nodes[sources[i].first], frameNumber(n, i) });
+        return k;
+    }
+
+    // arAllFramesReady: gets the frames request() did not return.
+    void fetch(int n, std::vector<const VSFrame *> &frames, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+        for (size_t i = 0; i < sources.size(); i++) {
+            if (frames[i])
+                continue;
+            const int clip = sources[i].first, fn = frameNumber(n, i);
+            if (i >= nodes.size() && fn == n) {
+                frames[i] = vsapi->addFrameRef(frames[clip]);
+                continue;
+            }
+            frames[i] = vsapi->getFrameFilter(fn, nodes[clip], frameCtx);
+            if (i >= nodes.size()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                Entry &e = ring[next];
+                next = (next + 1) % ring.size();
+                if (e.f)
+                    vsapi->freeFrame(e.f);
+                e = { clip, fn, vsapi->addFrameRef(frames[i]) };
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        int clip, n;
+        const VSFrame *f;
+    };
+    std::vector<VSNode *> nodes; // not owned
+    std::vector<int> numFrames;
+    std::vector<std::pair<int, int>> sources; // (clip, offset)
+    std::mutex mutex;
+    std::vector<Entry> ring;
+    size_t next = 0;
+
+    int frameNumber(int n, size_t source) const {
+        const auto &src = sources[source];
+        return std::clamp(n + src.second, 0, numFrames[src.first] - 1);
+    }
+};
+
+// Aggregates of a frame property over a window of frames, x[a..b].Prop:mode
+// (PropExpr only), where frame n+j is clamped to the clip's length as in
+// temporal access. The property values are cached, so that a request only
+// needs the frames that entered the window since nearby requests, and when
+// requests are sequential the previous aggregate is updated with the frame
+// that left the window and the one that entered it (running sum, monotonic
+// deques) instead of being recomputed. bind() rewrites the loads to read
+// "clip" base+i, whose property slot is set to the value of aggregate i.
+class PropWindows {
+public:
+    static constexpr int base = 1 << 24;
+
+    void init(const std::vector<VSNode *> &nodes, const VSAPI *vsapi) {
+        this->nodes = nodes;
+        for (auto *node: nodes)
+            numFrames.push_back(vsapi->getVideoInfo(node)->numFrames);
+    }
+
+    size_t size() const { return aggregates.size(); }
+    // The rewritten (clip, name) of aggregate i.
+    std::pair<int, std::string> key(size_t i) const { return { base + (int)i, aggregates[i].name }; }
+
+    void bind(std::vector<ExprOp> &ops) {
+        constexpr int last = static_cast<int>(LoadConstType::LAST);
+        for (auto &op: ops) {
+            size_t pos = op.name.rfind(':');
+            if (op.type != ExprOpType::CONST_LOAD || op.imm.i < last || pos == std::string::npos)
+                continue;
+            const int clip = op.imm.i - last;
+            if (clip >= (int)nodes.size())
+                throw std::runtime_error("property access clip out of range");
+            const std::string mode = op.name.substr(pos + 1);
+            Aggregate agg;
+            agg.name = op.name;
+            agg.series = series(clip, op.name.substr(0, pos));
+            agg.from = op.x;
+            agg.to = op.y;
+            agg.mode = mode == "sum" ? ReduceMode::Sum : mode == "avg" ? ReduceMode::Average : mode == "min" ? ReduceMode::Min : ReduceMode::Max;
+            size_t i = 0;
+            while (i < aggregates.size() && !(aggregates[i].name == agg.name && aggregates[i].series == agg.series && aggregates[i].from == agg.from && aggregates[i].to == agg.to))
+                i++;
+            if (i == aggregates.size())
+                aggregates.push_back(std::move(agg));
+            op.imm.i = last + base + (int)i;
+            op.x = op.y = 0;
+        }
+    }
+
+    // arInitial: requests the frames whose values are not cached, which are
+    // returned as (clip, frame number).
+    std::vector<std::pair<int, int>> request(int n, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+        std::vector<std::pair<int, int>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto &agg: aggregates) {
+                const Series &s = seriesList[agg.series];
+                for (int j = n + agg.from; j <= n + agg.to; j++) {
+                    const int fn = frameNumber(s.clip, j);
+                    if (!s.values.count(fn) && std::find(pending.begin(), pending.end(), std::make_pair(s.clip, fn)) == pending.end())
+                        pending.push_back({ s.clip, fn });
+                }
+            }
+        }
+        for (const auto &p: pending)
+            vsapi->requestFrameFilter(p.second, nodes[p.first], frameCtx);
+        return pending;
+    }
+
+    // arAllFramesReady: caches the values of the pending frames, and computes
+    // the aggregates of request n into out. Returns false, with the frames of
+    // values that were evicted in the meantime requested and put in pending,
+    // if another round is needed.
+    bool compute(int n, std::vector<std::pair<int, int>> &pending, float *out, VSFrameContext *frameCtx, const VSAPI *vsapi) {
+        std::vector<std::tuple<size_t, int, float>> read; // (series, frame, value)
+        for (const auto &p: pending) {
+            const VSFrame *f = vsapi->getFrameFilter(p.second, nodes[p.first], frameCtx);
+            auto snapshot = propSnapshot({ nodes[p.first], p.second }, f, vsapi);
+            for (size_t i = 0; i < seriesList.size(); i++)
+                if (seriesList[i].clip == p.first)
+                    read.emplace_back(i, p.second, props.read(seriesList[i].slot, *snapshot, 0.0f)); // XXX: non-existant property defaults to 0.
+            vsapi->freeFrame(f);
+        }
+        pending.clear();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &[i, fn, v]: read)
+            insert(seriesList[i], fn, v, n);
+
+        for (auto &agg: aggregates) {
+            const Series &s = seriesList[agg.series];
+            for (int j = n + agg.from; j <= n + agg.to; j++) {
+                const int fn = frameNumber(s.clip, j);
+                if (!s.values.count(fn) && std::find(pending.begin(), pending.end(), std::make_pair(s.clip, fn)) == pending.end())
+                    pending.push_back({ s.clip, fn });
+            }
+        }
+        if (!pending.empty()) {
+            for (const auto &p: pending)
+                vsapi->requestFrameFilter(p.second, nodes[p.first], frameCtx);
+            return false;
+        }
+
+        for (size_t i = 0; i < aggregates.size(); i++)
+            out[i] = update(aggregates[i], n);
+        return true;
+    }
+
+private:
+    struct Series {
+        int clip;
+        int slot; // in props
+        std::map<int, float> values; // by frame number
+    };
+    struct Aggregate {
+        std::string name;
+        size_t series;
+        int from, to;
+        ReduceMode mode;
+        // The window of the last computed request.
+        int last = std::numeric_limits<int>::min();
+        double sum = 0;
+        std::deque<std::pair<int, float>> queue; // (position, value), monotonic
+    };
+
+    std::vector<VSNode *> nodes; // not owned
+    std::vector<int> numFrames;
+    PropertyReader props;
+    std::vector<Series> seriesList;
+    std::vector<Aggregate> aggregates;
+    std::mutex mutex;
+
+    int frameNumber(int clip, int j) const { return std::clamp(j, 0, numFrames[clip] - 1); }
+
+    size_t series(int clip, const std::string &name) {
+        const int slot = props.add(clip, name);
+        for (size_t i = 0; i < seriesList.size(); i++)
+            if (seriesList[i].slot == slot)
+                return i;
+        seriesList.push_back({ clip, slot, {} });
+        return seriesList.size() - 1;
+    }
+
+    // Keeps about two windows of values around the requests, evicting the
+    // frames farthest from n.
+    void insert(Series &s, int fn, float v, int n) {
+        s.values[fn] = v;
+        size_t capacity = 64;
+        for (const auto &agg: aggregates)
+            if (&seriesList[agg.series] == &s)
+                capacity = std::max(capacity, 2 * (size_t)(agg.to - agg.from + 1) + 64);
+        while (s.values.size() > capacity) {
+            auto first = s.values.begin(), back = std::prev(s.values.end());
+            if (n - first->first > back->first - n)
+                s.values.erase(first);
+            else
+                s.values.erase(back);
+        }
+    }
+
+    // As the values of the window are cached, the aggregate is valid;
+    // incremental updates also need the value that left the window.
+    float update(Aggregate &agg, int n) {
+        const Series &s = seriesList[agg.series];
+        auto value = [&](int j) { return s.values.at(frameNumber(s.clip, j)); };
+        const bool minMode = agg.mode == ReduceMode::Min;
+        auto push = [&](int j) {
+            const float v = value(j);
+            while (!agg.queue.empty() && (minMode ? !(agg.queue.back().second < v) : !(agg.queue.back().second > v)))
+                agg.queue.pop_back();
+            agg.queue.push_back({ j, v });
+        };
+        const bool sum = agg.mode == ReduceMode::Sum || agg.mode == ReduceMode::Average;
+        const int leaving = n + agg.from - 1;
+        if (agg.last == n - 1 && s.values.count(frameNumber(s.clip, leaving)) && (!sum || std::isfinite(agg.sum))) {
+            if (sum) {
+                agg.sum += (double)value(n + agg.to) - value(leaving);
+            } else {
+                while (!agg.queue.empty() && agg.queue.front().first <= leaving)
+                    agg.queue.pop_front();
+                push(n + agg.to);
+            }
+        } else {
+            agg.sum = 0;
+            agg.queue.clear();
+            for (int j = n + agg.from; j <= n + agg.to; j++) {
+                if (sum)
+                    agg.sum += value(j);
+                else
+                    push(j);
+            }
+        }
+        agg.last = n;
+        if (agg.mode == ReduceMode::Average)
+            return (float)(agg.sum / (agg.to - agg.from + 1));
+        if (sum)
+            return (float)agg.sum;
+        return agg.queue.front().second;
+    }
 };
 
+#ifdef HAVE_CUDA
+struct ExprCuda;
+#endif
+
 struct ExprData {
     std::vector<VSNode *> node;
     VSVideoInfo vi;
     int plane[3];
     int numInputs;
     Compiled compiled[3];
-    typedef void (*ProcessProc)(void *rwptrs, int *strides, float *props, int width, int height);
+    typedef void (*ProcessProc)(void *rwptrs, int *strides, float *props, int width, int height, int ystart, int yend);
     ProcessProc proc[3];
+    bool fused; // compiled[0] processes all planes marked poProcess
+    int threads; // number of horizontal strips each plane is split into
+    ReduceMode reduce[3]; // reduced planes are copied from the first clip
+    bool stats; // attach Compiled::Stats of the routines used to every frame
+    int outputs; // clips written by every routine, see ExprOutputData
+
+    // Inputs past the clips are temporal taps (see bindTemporal), further
+    // references to the node of their clip read at a frame offset.
+    std::vector<int> offset; // of every input, 0 for the clips
+    std::vector<int> length; // frames of every input
+    // The first clip with the same node as each input, whose frames are used
+    // instead of requesting them again (see bindDuplicates).
+    std::vector<int> alias;
+    int frameOf(int input, int n) const { return std::clamp(n + offset[input], 0, length[input] - 1); }
+
+    // The last inputs, from firstPass on, are the horizontal passes of
+    // separable convolutions (see bindSeparable): float planes of the rows of
+    // input convolved with weights, which are computed per frame, a band of
+    // rows at a time (see runPasses), and read with vertical relative accesses
+    // of up to radius rows by the routines of planes.
+    struct SeparablePass {
+        int input;
+        std::vector<float> weights;
+        BoundaryCondition bc;
+        int radius = 0;
+        int planes = 0; // bit mask of expressions
+    };
+    std::vector<SeparablePass> passes;
+    std::vector<VSVideoInfo> passVi; // the format of every pass
+    int firstPass = 0;
+
+    // Routines specialised on the values of the properties in uniforms,
+    // compiled on demand outside of specLock. Entries are never removed, so
+    // pointers to them stay valid for the lifetime of the instance.
+    struct Specialization {
+        std::vector<float> values;
+        Compiled compiled[3];
+        ProcessProc proc[3];
+    };
+    std::vector<std::pair<int, std::string>> uniforms;
+    std::function<void(const Uniforms &, Compiled *, ProcessProc *)> specialize;
+    PropertyReader props; // every property the processed planes may read
+    std::mutex specLock;
+    std::condition_variable specReady; // signalled whenever a claim in specPending is resolved
+    std::list<Specialization> specs;
+    std::vector<std::vector<float>> specPending; // values being compiled by some frame
+
+    // With async=1, compiled and proc are filled in by the compiler thread,
+    // and frames are interpreted using ops until ready is set.
+    std::atomic<bool> ready{ true };
+    std::thread compiler;
+    std::string compileError; // set before ready if the compiler thread failed
+    InterpProgram ops[3];
+
+    // With opt_level=-1, retier compiles the routines again at opt_level=3
+    // into tiered on the compiler thread, started once EXPR_TIER_FRAMES
+    // frames have been requested; they are used instead of compiled and proc
+    // from when tieredReady is set. Specializations keep the first level.
+    std::function<void()> retier;
+    std::atomic<int> hot{ 0 };
+    std::atomic<bool> tieredReady{ false };
+    Compiled tiered[3];
+    ProcessProc tieredProc[3] = {};
+
+    // Output samples of poLut planes, indexed by the value of the pixel of
+    // lutClip[0], or by (lutClip[0] << 8) | lutClip[1] for two 8 bit clips.
+    std::vector<uint8_t> lut[3];
+    int lutClip[3][2] = {};
+
+    ScopedFilterStats perf{ "Expr" };
+
+#ifdef HAVE_CUDA
+    // With backend="cuda", the processed planes are computed by these
+    // kernels instead of compiled and proc.
+    std::shared_ptr<ExprCuda> cuda;
+#endif
 
-    ExprData() : node(), vi(), plane(), numInputs(), proc() {}
+    ExprData() : node(), vi(), plane(), numInputs(), proc(), fused(), threads(1), reduce(), stats(), outputs(1) {}
+    ~ExprData() {
+        if (compiler.joinable())
+            compiler.join();
+    }
 };
 
 std::vector<std::string> tokenize(const std::string &expr)
@@ -229,6 +923,27 @@ std::vector<std::string> tokenize(const std::string &expr)
     return tokens;
 }
 
+// Returns the index of the clip called name (x, y, z, a-w or srcN).
+static int clipIndex(const std::string &name)
+{
+    if (name.size() == 1)
+        return name[0] >= 'x' ? name[0] - 'x' : name[0] - 'a' + 3;
+    int idx = -1;
+
+    auto result = std::from_chars(name.c_str() + clipNamePrefix.size(), name.c_str() + name.length(), idx);
+    if (result.ec != std::errc()) {
+        throw std::runtime_error("invalid clip name: " + name);
+    }
+
+    return idx;
+}
+
+static const std::regex &temporalPixelRe()
+{
+    static const std::regex re { "^([a-z]|" + clipNamePrefix + "[0-9]+)\\{([+-]?[0-9]+)\\}(.*)$" };
+    return re;
+}
+
 ExprOp decodeToken(const std::string &token, bool extended = false)
 {
     static const std::unordered_map<std::string, ExprOp> simple{
@@ -279,22 +994,12 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
     const std::string clipNameRePrefix { "^([a-z]|" + clipNamePrefix + "[0-9]+)" };
     static const std::regex clipNameRe { clipNameRePrefix + "$" };
     static const std::regex relpixelRe { clipNameRePrefix + "\\[(-?[0-9]+),(-?[0-9]+)\\](:[cm])?$" };
-    static const std::regex abspixelRe { clipNameRePrefix + "\\[\\]$" };
-    static const std::regex framePropRe { clipNameRePrefix + "\\.([^\\[\\]]*)$" };
+    static const std::regex abspixelRe { clipNameRePrefix + "\\[\\](:b)?$" };
+    static const std::regex windowPropRe { clipNameRePrefix + "\\[([+-]?[0-9]+)\\.\\.([+-]?[0-9]+)\\]\\.([^\\[\\]:]*):(sum|avg|min|max)$" };
+    static const std::regex framePropRe { clipNameRePrefix + "(?:\\[(-?[0-9]+)\\])?\\.([^\\[\\]:]*)(\\[[0-9]*\\])?$" };
     std::smatch match;
 
-    auto extractClipId = [](const std::string &name) -> int {
-        if (name.size() == 1)
-            return name[0] >= 'x' ? name[0] - 'x' : name[0] - 'a' + 3;
-        int idx = -1;
-
-        auto result = std::from_chars(name.c_str() + clipNamePrefix.size(), name.c_str() + name.length(), idx);
-        if (result.ec != std::errc()) {
-            throw std::runtime_error("invalid clip name: " + name);
-        }
-
-        return idx;
-    };
+    auto extractClipId = clipIndex;
 
     auto it = simple.find(token);
     if (it != simple.end()) {
@@ -345,11 +1050,31 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
         else //if (token[4] == 'a')
             return{ ExprOpType::ARGMAX, idx };
     } else if (std::regex_match(token, match, framePropRe)) {
-        // frame property access
-        ASSERT(match.size() == 3);
-        auto clip = match[1].str(), name = match[2].str();
+        // frame property access, y is the temporal offset. An element index
+        // stays part of the name (see PropertyReader).
+        ASSERT(match.size() == 5);
+        auto clip = match[1].str(), offset = match[2].str(), name = match[3].str(), element = match[4].str();
         int clipi = static_cast<int>(LoadConstType::LAST) + extractClipId(clip);
-        return{ ExprOpType::CONST_LOAD, clipi, name, 0 };
+        int dn = offset.empty() ? 0 : atoi(offset.c_str());
+        if (dn != 0 && !extended)
+            throw std::runtime_error("temporal frame property access is only supported by Select and PropExpr: " + token);
+        if (element == "[]" && !extended)
+            throw std::runtime_error("array frame property access is only supported by PropExpr: " + token);
+        if (element.size() > 2)
+            name += "[" + std::to_string(atoi(element.c_str() + 1)) + "]";
+        else
+            name += element;
+        return{ ExprOpType::CONST_LOAD, clipi, name, 0, dn };
+    } else if (std::regex_match(token, match, windowPropRe)) {
+        // window aggregate, x..y is the window (see PropWindows)
+        ASSERT(match.size() == 6);
+        if (!extended)
+            throw std::runtime_error("window aggregates are only supported by PropExpr: " + token);
+        int clipi = static_cast<int>(LoadConstType::LAST) + extractClipId(match[1].str());
+        int from = atoi(match[2].str().c_str()), to = atoi(match[3].str().c_str());
+        if (from > to)
+            throw std::runtime_error("empty window: " + token);
+        return{ ExprOpType::CONST_LOAD, clipi, match[4].str() + ":" + match[5].str(), from, to };
     } else if (std::regex_match(token, match, relpixelRe)) {
         ASSERT(match.size() == 5);
         auto clip = match[1].str(), sx = match[2].str(), sy = match[3].str(), flag = match[4].str();
@@ -357,9 +1082,13 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
             (flag[1] == 'm' ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped);
         return{ ExprOpType::MEM_LOAD, extractClipId(clip), "", atoi(sx.c_str()), atoi(sy.c_str()), bc };
     } else if (std::regex_match(token, match, abspixelRe)) {
-        ASSERT(match.size() == 2);
+        ASSERT(match.size() == 3);
         auto clip = match[1].str();
-        return{ ExprOpType::MEM_LOAD_VAR, extractClipId(clip) };
+        // x is set for bilinear interpolation.
+        return{ ExprOpType::MEM_LOAD_VAR, extractClipId(clip), "", match[2].length() > 0 };
+    } else if (std::regex_match(token, temporalPixelRe())) {
+        // rewritten by bindTemporal() in Expr
+        throw std::runtime_error("temporal pixel access is only supported by Expr: " + token);
     } else {
         size_t pos = 0;
         long long l = 0;
@@ -391,6 +1120,10 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
     }
 }
 
+InterpProgram prepareInterpret(const std::vector<ExprOp> &ops);
+float interpret(const InterpProgram &prog, int N, int width, int height, int Y, int X, const std::function<float(const ExprOp &op, int y, int x)> &pixelGet, const std::function<float(int idx, const std::string &name)> &propGet);
+float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, int Y, int X, const std::function<float(const ExprOp &op, int y, int x)> &pixelGet, const std::function<float(int idx, const std::string &name)> &propGet, std::vector<float> *rstk = nullptr);
+
 template<int lanes>
 struct VectorTypes {
     typedef rr::Void Byte;
@@ -418,994 +1151,3988 @@ public:
     typedef uint32_t SwizzleMask;
 };
 
-static std::unordered_map<std::string, Compiled> exprCache;
+// The key of a routine that the holder is compiling, see ExprCache::find().
+// The claim is dropped when it goes out of scope unless done() was called
+// after the routine was inserted, e.g. because the expression failed to parse.
+struct ExprCacheClaim {
+    std::string key; // empty if nothing is claimed
 
-template<int lanes>
-class Compiler {
-    struct Context {
-        const std::string expr;
-        std::vector<std::string> tokens;
-        std::vector<ExprOp> ops;
-        const VSVideoInfo *vo;
-        const VSVideoInfo * const *vi;
-        const VSAPI *vsapi;
-        int numInputs;
-        int optMask;
-        bool mirror;
-        bool cached;
-        Context(
-            const std::string &expr, 
-            const VSVideoInfo *vo, 
-            const VSVideoInfo *const *vi, 
-            const VSAPI *vsapi,
-            int numInputs, 
-            int opt, 
-            int mirror
-        ):
-            expr(expr), vo(vo), vi(vi), vsapi(vsapi), numInputs(numInputs), optMask(opt), mirror(!!mirror), cached(false) {
-            auto iter = exprCache.find(key());
-            if (iter != exprCache.end()) {
-                cached = true;
-                return;
-            }
+    ExprCacheClaim() = default;
+    ExprCacheClaim(const ExprCacheClaim &) = delete;
+    ExprCacheClaim &operator=(const ExprCacheClaim &) = delete;
+    ~ExprCacheClaim();
 
-            tokens = tokenize(expr);
-            for (const auto &tok: tokens) {
-                auto op = decodeToken(tok);
-                if (op.bc == BoundaryCondition::Unspecified)
-                    op.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
-                ops.push_back(op);
+    void done() { key.clear(); }
+};
+
+// ExprCache is a thread-safe LRU cache of compiled routines keyed by
+// Compiler::Context::key(). It is bounded by the executable memory held by the
+// cached routines; evicting an entry never invalidates filters that still use it.
+class ExprCache {
+    using Entry = std::pair<std::string, Compiled>;
+
+    std::mutex lock;
+    std::condition_variable ready; // signalled whenever a claim is resolved
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::unordered_set<std::string> pending; // claimed keys being compiled
+    size_t bytes = 0;
+    int64_t hits = 0, misses = 0, evictions = 0, evictedBytes = 0;
+
+    static size_t charge(const Compiled &c) {
+        // Routines of unknown size are charged one page so that the entry count is bounded too.
+        return std::max<size_t>(c.routine ? c.routine->getMemorySize() : 0, 4096);
+    }
+
+public:
+    struct Stats {
+        int64_t hits, misses, evictions, evictedBytes, bytes, entries;
+    };
+
+    // On a miss with claim given, the caller is to compile the routine and
+    // insert it. Until then, other lookups of key that pass a claim wait for
+    // it instead of compiling the same routine again, so that identical planes
+    // and nodes compiled at the same time are only compiled once.
+    bool find(const std::string &key, Compiled &out, ExprCacheClaim *claim = nullptr) {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            auto it = index.find(key);
+            if (it != index.end()) {
+                hits++;
+                lru.splice(lru.begin(), lru, it->second);
+                out = it->second->second;
+                return true;
             }
+            if (!claim || !pending.count(key))
+                break;
+            ready.wait(guard);
         }
-        enum {
-            flagUseInteger = 1<<0,
-        };
-        static std::string videoInfoKey(const VSVideoInfo *vi, const VSAPI *vsapi) {
-            std::array<char, 32> name{};
-            vsapi->getVideoFormatName(&vi->format, name.data());
-            return std::string(name.data()) + ";";
-        }
-        std::string key() const {
-            std::stringstream ss;
-            ss << "n=" << numInputs << "|opt=" << optMask << "|mirror=" << mirror
-                << "|expr=" << expr << "|vo=" << videoInfoKey(vo, vsapi);
-            for (int i = 0; i < numInputs; i++)
-                ss << "|vi" << i << "=" << videoInfoKey(vi[i], vsapi);
-            return ss.str();
+        misses++;
+        if (claim) {
+            pending.insert(key);
+            claim->key = key;
         }
-        Compiled getCached() { return exprCache[key()]; }
+        return false;
+    }
 
-        bool forceFloat() const { return !(optMask & flagUseInteger); }
-    } ctx;
+    void abandon(const std::string &key) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (pending.erase(key))
+            ready.notify_all();
+    }
 
-    using pointer = rr::Pointer<rr::Byte>;
-    using Types = VectorTypes<lanes>;
-    using ByteV = typename Types::Byte;
-    using UShortV = typename Types::UShort;
-    using IntV = typename Types::Int;
-    using FloatV = typename Types::Float;
+    void insert(const std::string &key, const Compiled &c) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (pending.erase(key))
+            ready.notify_all();
+        if (index.count(key))
+            return; // compiled concurrently by another thread
+        lru.emplace_front(key, c);
+        index.emplace(key, lru.begin());
+        bytes += charge(c);
+        while (bytes > EXPR_CACHE_LIMIT && lru.size() > 1) {
+            const Entry &last = lru.back();
+            size_t n = charge(last.second);
+            bytes -= n;
+            evictions++;
+            evictedBytes += n;
+            index.erase(last.first);
+            lru.pop_back();
+        }
+    }
 
-    struct Helper {
-        using ftype = rr::ModuleFunction<FloatV(FloatV)>;
-        using ftype2 = rr::ModuleFunction<FloatV(FloatV, FloatV)>;
-        std::unique_ptr<ftype> Exp;
-        std::unique_ptr<ftype> Log;
-        std::unique_ptr<ftype> Sin;
-        std::unique_ptr<ftype> Cos;
-        std::unique_ptr<ftype2> Pow;
-    };
-    rr::RValue<FloatV> Exp_(rr::RValue<FloatV>);
-    rr::RValue<FloatV> Log_(rr::RValue<FloatV>);
-    rr::RValue<FloatV> SinCos_(rr::RValue<FloatV>, bool issin);
-    rr::RValue<FloatV> FP16To32(rr::RValue<UShortV>);
-    rr::RValue<UShortV> FP32To16(rr::RValue<FloatV>);
+    Stats stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        return Stats{ hits, misses, evictions, evictedBytes, (int64_t)bytes, (int64_t)lru.size() };
+    }
+};
 
-    class Value {
-        std::variant<IntV, FloatV> v;
-        bool constant;
+static ExprCache exprCache;
 
-    public:
-        bool isFloat() { return std::holds_alternative<FloatV>(v); }
-        bool isConst() { return constant; }
+ExprCacheClaim::~ExprCacheClaim() {
+    if (!key.empty())
+        exprCache.abandon(key);
+}
 
-        Value(int x) : v(IntV(x)), constant(true) {}
-        Value(float x) : v(FloatV(x)), constant(true) {}
+// DiskCache backs exprCache with object files stored under the directory named
+// by the AKARIN_EXPR_CACHE_DIR environment variable. Each file is named after a
+// hash of the full key (expression key, host target and plugin version) and
+// starts with the full key, so that hash collisions and objects produced for a
+// different CPU or plugin build are never loaded.
+class DiskCache : public rr::ObjectCache {
+    std::filesystem::path path;
+    std::string header;
 
-        Value(IntV i) : v(i), constant(false) {}
-        Value(rr::RValue<IntV> i) : v(IntV(i)), constant(false) {}
-        Value(rr::Reference<IntV> i) : v(IntV(i)), constant(false) {}
-        Value(FloatV f) : v(f), constant(false) {}
-        Value(rr::RValue<FloatV> f) : v(FloatV(f)), constant(false) {}
-        Value(rr::Reference<FloatV> f) : v(FloatV(f)), constant(false) {}
+    DiskCache(std::filesystem::path path, std::string header): path(std::move(path)), header(std::move(header)) {}
 
-        FloatV f() { return std::get<FloatV>(v); }
-        IntV i() { return std::get<IntV>(v); }
+public:
+    static std::unique_ptr<DiskCache> open(const std::string &exprKey) {
+        const char *dir = std::getenv("AKARIN_EXPR_CACHE_DIR");
+        if (dir == nullptr || *dir == '\0')
+            return nullptr;
+
+        std::string key = exprKey + "|target=" + rr::Nucleus::getTargetDescription() + "|version=" + VERSION;
+        uint64_t hash = 14695981039346656037ull; // FNV-1a
+        for (unsigned char c: key) {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        char name[32];
+        snprintf(name, sizeof name, "%016llx.o", (unsigned long long)hash);
 
-        FloatV ensureFloat() { return isFloat() ? f() : FloatV(i()); }
-        IntV ensureInt() { return isFloat() ? IntV(RoundInt(f())) : i(); }
+        std::string header = "akarin-expr\n" + std::to_string(key.size()) + "\n" + key;
+        return std::unique_ptr<DiskCache>(new DiskCache(std::filesystem::path(dir) / name, std::move(header)));
+    }
 
-        Value Max(Value &rhs) { return (isFloat() || rhs.isFloat()) ? Value(rr::Max(f(), rhs.f())) : Value(rr::Max(i(), rhs.i())); }
-        Value Min(Value &rhs) { return (isFloat() || rhs.isFloat()) ? Value(rr::Min(f(), rhs.f())) : Value(rr::Min(i(), rhs.i())); }
-    };
+    std::vector<uint8_t> load() override {
+        std::ifstream f(path, std::ios::binary);
+        if (!f)
+            return {};
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        if (data.size() <= header.size() || !std::equal(header.begin(), header.end(), data.begin()))
+            return {};
+        data.erase(data.begin(), data.begin() + header.size());
+        return data;
+    }
+
+    void store(const void *data, size_t size) override {
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+
+        // Write to a private temporary file first so that concurrent processes never observe partial objects.
+        std::filesystem::path tmp = path;
+        tmp += "." + std::to_string(reinterpret_cast<uintptr_t>(this)) + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+            if (!f)
+                return;
+            f.write(header.data(), header.size());
+            f.write(static_cast<const char *>(data), size);
+            if (!f) {
+                f.close();
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+        std::filesystem::rename(tmp, path, ec);
+        if (ec)
+            std::filesystem::remove(tmp, ec);
+    }
+};
+
+// SimdConfig describes the vector shape Expr compiles for by default on this host.
+struct SimdConfig {
+    int lanes;
+    int unroll;
+    const char *isa;
+};
+
+static const SimdConfig &hostSimd() {
+    static const SimdConfig config = []() -> SimdConfig {
+#if defined(__i386__) || defined(__x86_64__)
+        // Reactor has no 16-lane vector types, so AVX-512 hosts use two 8-lane vectors per iteration instead.
+        if (rr::CPUID::supportsAVX512F())
+            return { 8, 2, "avx512" };
+        if (rr::CPUID::supportsAVX2())
+            return { 8, 1, "avx2" };
+        return { 4, 1, "sse" };
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+        return { 4, 2, "neon" };
+#else
+        return { 4, 1, "generic" };
+#endif
+    }();
+    return config;
+}
+
+// Size in bytes of the largest CPU cache, or a typical 8 MiB if it can't be determined.
+static size_t lastLevelCacheSize() {
+    static const size_t size = []() -> size_t {
+        size_t size = 0;
+#ifdef _WIN32
+        DWORD len = 0;
+        GetLogicalProcessorInformation(nullptr, &len);
+        std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+        if (!info.empty() && GetLogicalProcessorInformation(info.data(), &len)) {
+            for (const auto &i : info)
+                if (i.Relationship == RelationCache)
+                    size = std::max<size_t>(size, i.Cache.Size);
+        }
+#elif defined(__APPLE__)
+        for (const char *name : { "hw.l3cachesize", "hw.l2cachesize" }) {
+            int64_t v = 0;
+            size_t len = sizeof(v);
+            if (sysctlbyname(name, &v, &len, nullptr, 0) == 0 && v > 0) {
+                size = (size_t)v;
+                break;
+            }
+        }
+#elif defined(_SC_LEVEL3_CACHE_SIZE)
+        for (int name : { _SC_LEVEL3_CACHE_SIZE, _SC_LEVEL2_CACHE_SIZE }) {
+            long v = sysconf(name);
+            if (v > 0) {
+                size = (size_t)v;
+                break;
+            }
+        }
+#endif
+        return size ? size : 8 << 20;
+    }();
+    return size;
+}
+
+// Number of stack operands consumed by each op, excluding the ones with an
+// operand count given by the op itself (SORT, DUP, SWAP and DROP).
+constexpr unsigned char numOperands[] = {
+    0, // MEM_LOAD
+    2, // MEM_LOAD_VAR
+    0, // CONSTANTI
+    0, // CONSTANTF
+    0, // CONST_LOAD
+    0, // VAR_LOAD
+    1, // VAR_STORE
+    2, // ADD
+    2, // SUB
+    2, // MUL
+    2, // DIV
+    2, // MOD
+    1, // SQRT
+    1, // ABS
+    2, // MAX
+    2, // MIN
+    3, // CLAMP
+    2, // CMP
+    1, // TRUNC
+    1, // ROUND
+    1, // FLOOR
+    2, // AND
+    2, // OR
+    2, // XOR
+    1, // NOT
+    2, // BITAND
+    2, // BITOR
+    2, // BITXOR
+    1, // BITNOT
+    1, // EXP
+    1, // LOG
+    2, // POW
+    1, // SIN
+    1, // COS
+    3, // TERNARY
+    0, // SORT
+    0, // DUP
+    0, // SWAP
+    0, // DROP
+};
+static_assert(sizeof(numOperands) == static_cast<unsigned>(ExprOpType::LAST) + 1, "invalid table");
+
+// Front-end optimiser for Expr. The RPN program is evaluated symbolically
+// into a DAG with hash-consing, which removes common subexpressions together
+// with all stack shuffling and variable traffic, folds constants (also
+// across var! / var@) and simplifies a few algebraic identities. The DAG is
+// then emitted back as RPN, keeping every value used more than once in a
+// variable.
+//
+// Programs the compiler would reject are left unchanged, so that it still
+// reports the original error.
+class ExprOptimizer {
+    struct Node {
+        ExprOp op;
+        std::vector<int> args;
+        int output; // which result of the SORT node in args[0], -1 otherwise
+        std::string token;
+    };
+    using Key = std::tuple<int, uint32_t, std::string, int, int, int, int, std::vector<int>>;
+
+    std::vector<Node> nodes;
+    std::map<Key, int> index;
+    const int numInputs;
+    const bool integerMul;
+
+    int intern(Node n) {
+        Key key{ static_cast<int>(n.op.type), n.op.imm.u, n.op.name, n.op.x, n.op.y, static_cast<int>(n.op.bc), n.output, n.args };
+        auto it = index.find(key);
+        if (it != index.end())
+            return it->second;
+        nodes.push_back(std::move(n));
+        index.emplace(std::move(key), (int)nodes.size() - 1);
+        return (int)nodes.size() - 1;
+    }
+
+    // Constants are only folded where integer and float evaluation agree,
+    // so that the result does not depend on how the compiler types them.
+    static bool foldable(float v) {
+        return std::isfinite(v) && (v != std::trunc(v) || std::abs(v) <= (1 << 24));
+    }
+    bool constant(int id, float &v) const {
+        const ExprOp &op = nodes[id].op;
+        if (op.type == ExprOpType::CONSTANTI)
+            v = (float)op.imm.i;
+        else if (op.type == ExprOpType::CONSTANTF)
+            v = op.imm.f;
+        else
+            return false;
+        return foldable(v);
+    }
+    bool isConstant(int id, float c) const {
+        float v;
+        return constant(id, v) && v == c;
+    }
+    int makeConstant(float v) {
+        std::ostringstream ss;
+        ss.imbue(std::locale::classic());
+        ss << std::setprecision(9) << v;
+        return intern({ ExprOp(ExprOpType::CONSTANTF, v), {}, -1, ss.str() });
+    }
+    int makeOp(ExprOpType type, std::vector<int> args, const std::string &token) {
+        return intern({ ExprOp(type), std::move(args), -1, token });
+    }
+    // Whether the value is known to be >= 0, where sqrt agrees with pow.
+    bool nonNegative(int id) const {
+        const Node &n = nodes[id];
+        float v;
+        if (constant(id, v))
+            return v >= 0;
+        switch (n.op.type) {
+        case ExprOpType::SQRT: case ExprOpType::ABS: case ExprOpType::EXP:
+        case ExprOpType::CMP: case ExprOpType::AND: case ExprOpType::OR: case ExprOpType::XOR: case ExprOpType::NOT:
+            return true;
+        case ExprOpType::MUL:
+            return n.args[0] == n.args[1] || (nonNegative(n.args[0]) && nonNegative(n.args[1]));
+        case ExprOpType::ADD: case ExprOpType::MIN:
+            return nonNegative(n.args[0]) && nonNegative(n.args[1]);
+        case ExprOpType::MAX:
+            return nonNegative(n.args[0]) || nonNegative(n.args[1]);
+        case ExprOpType::TERNARY:
+            return nonNegative(n.args[1]) && nonNegative(n.args[2]);
+        default:
+            return false;
+        }
+    }
+
+    // Returns the folded value of op applied to args, or -1 if it can't be simplified.
+    int simplify(const ExprOp &op, const std::vector<int> &args) {
+        const int a = args.size() > 0 ? args[0] : -1, b = args.size() > 1 ? args[1] : -1;
+        switch (op.type) {
+        case ExprOpType::ADD:
+            if (isConstant(b, 0)) return a;
+            if (isConstant(a, 0)) return b;
+            break;
+        case ExprOpType::SUB:
+            if (isConstant(b, 0)) return a;
+            break;
+        case ExprOpType::MUL:
+            if (isConstant(b, 1)) return a;
+            if (isConstant(a, 1)) return b;
+            break;
+        case ExprOpType::TERNARY: {
+            float c;
+            if (constant(a, c)) return c > 0 ? b : args[2];
+            if (b == args[2]) return b;
+            break;
+        }
+        case ExprOpType::POW:
+            // Integer exponents are already lowered to multiplications by the compiler.
+            if (isConstant(b, 0)) return makeConstant(1);
+            if (isConstant(b, 1)) return a;
+            // sqrt clamps negative bases to 0 where pow returns NaN.
+            if (isConstant(b, 0.5f) && nonNegative(a)) return makeOp(ExprOpType::SQRT, { a }, "sqrt");
+            if (isConstant(b, -0.5f) && nonNegative(a)) return makeOp(ExprOpType::DIV, { makeConstant(1), makeOp(ExprOpType::SQRT, { a }, "sqrt") }, "/");
+            if (isConstant(b, 2) && !integerMul) return makeOp(ExprOpType::MUL, { a, a }, "*");
+            break;
+        default:
+            break;
+        }
+
+        float v[3];
+        for (size_t i = 0; i < args.size(); i++)
+            if (!constant(args[i], v[i]))
+                return -1;
+        auto toInt = [](float x) { return (int32_t)std::nearbyint(x); };
+        float r;
+        switch (op.type) {
+        case ExprOpType::ADD: r = v[0] + v[1]; break;
+        case ExprOpType::SUB: r = v[0] - v[1]; break;
+        case ExprOpType::MUL: r = v[0] * v[1]; break;
+        case ExprOpType::DIV: r = v[0] / v[1]; break;
+        case ExprOpType::SQRT: r = std::sqrt(std::max(v[0], 0.0f)); break;
+        case ExprOpType::ABS: r = std::abs(v[0]); break;
+        case ExprOpType::MAX: r = std::max(v[0], v[1]); break;
+        case ExprOpType::MIN: r = std::min(v[0], v[1]); break;
+        case ExprOpType::CLAMP: r = std::max(std::min(v[0], v[2]), v[1]); break;
+        case ExprOpType::CMP:
+            switch (static_cast<ComparisonType>(op.imm.u)) {
+            case ComparisonType::EQ: r = v[0] == v[1]; break;
+            case ComparisonType::LT: r = v[0] < v[1]; break;
+            case ComparisonType::LE: r = v[0] <= v[1]; break;
+            case ComparisonType::NEQ: r = v[0] != v[1]; break;
+            case ComparisonType::NLT: r = !(v[0] < v[1]); break;
+            case ComparisonType::NLE: r = !(v[0] <= v[1]); break;
+            default: return -1;
+            }
+            break;
+        case ExprOpType::TRUNC: r = std::trunc(v[0]); break;
+        case ExprOpType::ROUND: r = std::nearbyint(v[0]); break;
+        case ExprOpType::FLOOR: r = std::floor(v[0]); break;
+        case ExprOpType::AND: r = (v[0] > 0) && (v[1] > 0); break;
+        case ExprOpType::OR: r = (v[0] > 0) || (v[1] > 0); break;
+        case ExprOpType::XOR: r = (v[0] > 0) != (v[1] > 0); break;
+        case ExprOpType::NOT: r = !(v[0] > 0); break;
+        case ExprOpType::BITAND: r = (float)(toInt(v[0]) & toInt(v[1])); break;
+        case ExprOpType::BITOR: r = (float)(toInt(v[0]) | toInt(v[1])); break;
+        case ExprOpType::BITXOR: r = (float)(toInt(v[0]) ^ toInt(v[1])); break;
+        case ExprOpType::BITNOT: r = (float)~toInt(v[0]); break;
+        default: return -1; // the transcendental functions use approximations
+        }
+        return foldable(r) ? makeConstant(r) : -1;
+    }
+
+    // Builds the DAG, returning the nodes of the values left on the stack, or
+    // nothing if ops is invalid or does not leave exactly results values.
+    std::vector<int> build(const std::vector<ExprOp> &ops, const std::vector<std::string> &tokens, size_t results = 1) {
+        std::vector<int> stack;
+        std::map<std::string, int> vars;
+        constexpr int last = static_cast<int>(LoadConstType::LAST);
+
+        for (size_t i = 0; i < ops.size(); i++) {
+            const ExprOp &op = ops[i];
+            if (op.type > ExprOpType::LAST)
+                return {};
+            if ((op.type == ExprOpType::MEM_LOAD || op.type == ExprOpType::MEM_LOAD_VAR) && op.imm.i >= numInputs)
+                return {};
+            if (op.type == ExprOpType::CONST_LOAD && op.imm.i >= last && op.imm.i - last >= numInputs)
+                return {};
+            if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
+                return {};
+            if ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT) && op.imm.u > stack.size())
+                return {};
+            if (stack.size() < numOperands[static_cast<size_t>(op.type)])
+                return {};
+
+            switch (op.type) {
+            case ExprOpType::DUP:
+                stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+                continue;
+            case ExprOpType::SWAP:
+                std::swap(stack.back(), stack[stack.size() - 1 - op.imm.u]);
+                continue;
+            case ExprOpType::DROP:
+                stack.resize(stack.size() - op.imm.u);
+                continue;
+            case ExprOpType::VAR_STORE:
+                vars[op.name] = stack.back();
+                stack.pop_back();
+                continue;
+            case ExprOpType::VAR_LOAD: {
+                auto it = vars.find(op.name);
+                if (it == vars.end())
+                    return {};
+                stack.push_back(it->second);
+                continue;
+            }
+            case ExprOpType::SORT: {
+                std::vector<int> args(stack.end() - op.imm.u, stack.end());
+                stack.resize(stack.size() - op.imm.u);
+                int group = intern({ op, std::move(args), -1, tokens[i] });
+                for (unsigned k = 0; k < op.imm.u; k++)
+                    stack.push_back(intern({ op, { group }, (int)k, tokens[i] }));
+                continue;
+            }
+            default:
+                break;
+            }
+
+            const size_t n = numOperands[static_cast<size_t>(op.type)];
+            std::vector<int> args(stack.end() - n, stack.end());
+            stack.resize(stack.size() - n);
+            int id = simplify(op, args);
+            if (id < 0)
+                id = intern({ op, std::move(args), -1, tokens[i] });
+            stack.push_back(id);
+        }
+        return stack.size() == results ? stack : std::vector<int>{};
+    }
+
+    static std::string varName(int id, int output = -1) {
+        // Contains a space, so it can't clash with any variable in the expression.
+        return "cse " + std::to_string(id) + (output >= 0 ? "." + std::to_string(output) : "");
+    }
+
+    // Emits the values of roots, leaving them on the stack in that order.
+    void emit(const std::vector<int> &roots, std::vector<ExprOp> &ops, std::vector<std::string> &tokens) {
+        std::vector<int> uses(nodes.size(), 0);
+        std::vector<int> work(roots);
+        while (!work.empty()) {
+            int id = work.back();
+            work.pop_back();
+            if (uses[id]++ == 0)
+                work.insert(work.end(), nodes[id].args.begin(), nodes[id].args.end());
+        }
+
+        // Range of sort results (as positions from the top of the stack) that are actually used.
+        std::map<int, std::pair<int, int>> live;
+        for (size_t id = 0; id < nodes.size(); id++) {
+            const Node &n = nodes[id];
+            if (n.output < 0 || !uses[id])
+                continue;
+            int pos = (int)n.op.imm.u - 1 - n.output;
+            auto it = live.try_emplace(n.args[0], pos, pos + 1).first;
+            it->second = { std::min(it->second.first, pos), std::max(it->second.second, pos + 1) };
+        }
+
+        auto push = [&](ExprOp op, std::string token) {
+            ops.push_back(std::move(op));
+            tokens.push_back(std::move(token));
+        };
+        auto load = [&](const std::string &name) { push(ExprOp(ExprOpType::VAR_LOAD, {}, name), name + "@"); };
+        auto store = [&](const std::string &name) { push(ExprOp(ExprOpType::VAR_STORE, {}, name), name + "!"); };
+
+        // Post-order walk; a value is stored in a variable when first computed if it is used again later.
+        std::vector<bool> stored(nodes.size(), false);
+        std::vector<std::pair<int, bool>> todo;
+        for (auto it = roots.rbegin(); it != roots.rend(); ++it)
+            todo.push_back({ *it, false });
+        while (!todo.empty()) {
+            auto [id, expanded] = todo.back();
+            todo.pop_back();
+            const Node &n = nodes[id];
+            if (n.output >= 0) {
+                int group = n.args[0];
+                if (stored[group]) {
+                    load(varName(group, n.output));
+                } else {
+                    todo.push_back({ id, false });
+                    todo.push_back({ group, false });
+                }
+                continue;
+            }
+            if (stored[id]) {
+                load(varName(id));
+                continue;
+            }
+            if (!expanded) {
+                todo.push_back({ id, true });
+                for (auto it = n.args.rbegin(); it != n.args.rend(); ++it)
+                    todo.push_back({ *it, false });
+                continue;
+            }
+
+            if (n.op.type == ExprOpType::SORT) {
+                // The results of a sort are only ever accessed through
+                // variables, and only the used ranks need to be computed.
+                auto [lo, hi] = live.at(id);
+                ExprOp op = n.op;
+                if (hi - lo < (int)op.imm.u)
+                    op.x = lo, op.y = hi;
+                push(op, n.token);
+                for (int pos = 0; pos < (int)n.op.imm.u; pos++) {
+                    if (pos >= lo && pos < hi)
+                        store(varName(id, (int)n.op.imm.u - 1 - pos));
+                    else
+                        push(ExprOp(ExprOpType::DROP, 1u), "drop1");
+                }
+                stored[id] = true;
+                continue;
+            }
+            push(n.op, n.token);
+            if (uses[id] > 1 && n.op.type != ExprOpType::CONSTANTI && n.op.type != ExprOpType::CONSTANTF) {
+                store(varName(id));
+                load(varName(id));
+                stored[id] = true;
+            }
+        }
+    }
+
+public:
+    ExprOptimizer(int numInputs, bool integerMul) : numInputs(numInputs), integerMul(integerMul) {}
+
+    // Returns false if the compiler would reject ops.
+    static bool valid(const std::vector<ExprOp> &ops, const std::vector<std::string> &tokens, int numInputs) {
+        return !ExprOptimizer(numInputs, false).build(ops, tokens).empty();
+    }
+
+    // integerMul must be set if integer multiplications may wrap around (opt=1).
+    // ops must leave results values on the stack, one per output clip.
+    static void run(std::vector<ExprOp> &ops, std::vector<std::string> &tokens, int numInputs, bool integerMul, int results = 1) {
+        ExprOptimizer opt(numInputs, integerMul);
+        std::vector<int> roots = opt.build(ops, tokens, results);
+        if (roots.empty())
+            return;
+        std::vector<ExprOp> newOps;
+        std::vector<std::string> newTokens;
+        opt.emit(roots, newOps, newTokens);
+        ops = std::move(newOps);
+        tokens = std::move(newTokens);
+    }
+};
+
+// Returns true if evaluating ops with integer arithmetic wherever the operands
+// are integers (i.e. opt=1) provably gives the same result as the default
+// float evaluation. This is the case when every integer-typed intermediate
+// value stays within +-2^24, where int32 arithmetic does not overflow and
+// every value is exactly representable as a float.
+static bool exactInInteger(const std::vector<ExprOp> &ops, const VSVideoInfo *vo, const VSVideoInfo * const *vi, int numInputs) {
+    constexpr double limit = 1 << 24;
+    struct Range {
+        bool isInt;
+        double lo, hi;
+    };
+    const Range floating{ false, 0, 0 };
+    auto integer = [](double lo, double hi) { return Range{ true, std::min(lo, hi), std::max(lo, hi) }; };
+    auto clipRange = [&](int clip) -> Range {
+        if (clip < 0 || clip >= numInputs || vi[clip]->format.sampleType == stFloat)
+            return floating;
+        return integer(0, std::ldexp(1.0, vi[clip]->format.bitsPerSample) - 1);
+    };
+
+    std::vector<Range> stack;
+    std::map<std::string, Range> vars;
+    for (const auto &op: ops) {
+        size_t need = 0;
+        switch (op.type) {
+        case ExprOpType::MEM_LOAD_VAR: need = 2; break;
+        case ExprOpType::DUP: case ExprOpType::SWAP: need = op.imm.u + 1; break;
+        case ExprOpType::DROP: case ExprOpType::SORT: need = op.imm.u; break;
+        case ExprOpType::CLAMP: case ExprOpType::TERNARY: need = 3; break;
+        case ExprOpType::ADD: case ExprOpType::SUB: case ExprOpType::MUL: case ExprOpType::DIV: case ExprOpType::MOD:
+        case ExprOpType::MAX: case ExprOpType::MIN: case ExprOpType::CMP: case ExprOpType::POW:
+        case ExprOpType::AND: case ExprOpType::OR: case ExprOpType::XOR:
+        case ExprOpType::BITAND: case ExprOpType::BITOR: case ExprOpType::BITXOR:
+            need = 2; break;
+        case ExprOpType::MEM_LOAD: case ExprOpType::CONSTANTI: case ExprOpType::CONSTANTF:
+        case ExprOpType::CONST_LOAD: case ExprOpType::VAR_LOAD:
+            need = 0; break;
+        default: need = 1; break;
+        }
+        if (stack.size() < need)
+            return false; // malformed, diagnosed by the compiler
+
+        auto pop = [&stack]() { Range r = stack.back(); stack.pop_back(); return r; };
+        Range r = floating;
+        switch (op.type) {
+        case ExprOpType::MEM_LOAD: r = clipRange(op.imm.i); break;
+        case ExprOpType::MEM_LOAD_VAR: pop(); pop(); r = op.x ? floating : clipRange(op.imm.i); break;
+        case ExprOpType::CONSTANTI: r = integer(op.imm.i, op.imm.i); break;
+        case ExprOpType::CONSTANTF:
+            r = op.imm.f == (float)(int)op.imm.f ? integer(op.imm.f, op.imm.f) : floating;
+            break;
+        case ExprOpType::CONST_LOAD:
+            switch (static_cast<LoadConstType>(op.imm.i)) {
+            case LoadConstType::N: r = integer(0, std::max(vo->numFrames, 1) - 1); break;
+            case LoadConstType::X: r = integer(0, vo->width - 1); break;
+            case LoadConstType::Y: r = integer(0, vo->height - 1); break;
+            case LoadConstType::Width: r = integer(0, vo->width); break;
+            case LoadConstType::Height: r = integer(0, vo->height); break;
+            default: r = floating; break; // frame properties are always floats
+            }
+            break;
+        case ExprOpType::VAR_LOAD: {
+            auto it = vars.find(op.name);
+            if (it == vars.end())
+                return false;
+            r = it->second;
+            break;
+        }
+        case ExprOpType::VAR_STORE: vars[op.name] = pop(); continue;
+        case ExprOpType::DUP: stack.push_back(stack[stack.size() - 1 - op.imm.u]); continue;
+        case ExprOpType::SWAP: std::swap(stack.back(), stack[stack.size() - 1 - op.imm.u]); continue;
+        case ExprOpType::DROP: stack.resize(stack.size() - op.imm.u); continue;
+        case ExprOpType::SORT: {
+            Range u{ true, limit, -limit };
+            bool isInt = true;
+            for (size_t i = stack.size() - op.imm.u; i < stack.size(); i++) {
+                isInt = isInt && stack[i].isInt;
+                u.lo = std::min(u.lo, stack[i].lo);
+                u.hi = std::max(u.hi, stack[i].hi);
+            }
+            for (size_t i = stack.size() - op.imm.u; i < stack.size(); i++)
+                stack[i] = isInt ? u : floating;
+            continue;
+        }
+        case ExprOpType::ADD: case ExprOpType::SUB: case ExprOpType::MUL: {
+            Range b = pop(), a = pop();
+            if (!a.isInt || !b.isInt)
+                break;
+            if (op.type == ExprOpType::ADD)
+                r = integer(a.lo + b.lo, a.hi + b.hi);
+            else if (op.type == ExprOpType::SUB)
+                r = integer(a.lo - b.hi, a.hi - b.lo);
+            else {
+                double p[] = { a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi };
+                r = integer(*std::min_element(p, p + 4), *std::max_element(p, p + 4));
+            }
+            break;
+        }
+        case ExprOpType::MAX: case ExprOpType::MIN: {
+            Range b = pop(), a = pop();
+            if (!a.isInt || !b.isInt)
+                break;
+            if (op.type == ExprOpType::MAX)
+                r = integer(std::max(a.lo, b.lo), std::max(a.hi, b.hi));
+            else
+                r = integer(std::min(a.lo, b.lo), std::min(a.hi, b.hi));
+            break;
+        }
+        case ExprOpType::ABS: {
+            Range a = pop();
+            if (a.isInt)
+                r = integer(a.lo <= 0 && a.hi >= 0 ? 0 : std::min(std::abs(a.lo), std::abs(a.hi)), std::max(std::abs(a.lo), std::abs(a.hi)));
+            break;
+        }
+        case ExprOpType::CLAMP: {
+            Range mx = pop(), mn = pop(), x = pop();
+            if (x.isInt && mn.isInt && mx.isInt)
+                r = integer(std::max(std::min(x.lo, mx.lo), mn.lo), std::max(std::min(x.hi, mx.hi), mn.hi));
+            break;
+        }
+        case ExprOpType::TERNARY: {
+            Range f = pop(), t = pop();
+            pop();
+            if (t.isInt && f.isInt)
+                r = integer(std::min(t.lo, f.lo), std::max(t.hi, f.hi));
+            break;
+        }
+        case ExprOpType::CMP: case ExprOpType::AND: case ExprOpType::OR: case ExprOpType::XOR:
+            pop(); pop();
+            r = integer(0, 1);
+            break;
+        case ExprOpType::NOT: pop(); r = integer(0, 1); break;
+        case ExprOpType::BITAND: case ExprOpType::BITOR: case ExprOpType::BITXOR: case ExprOpType::BITNOT: {
+            bool unary = op.type == ExprOpType::BITNOT;
+            Range b = unary ? integer(0, 0) : pop(), a = pop();
+            if (!a.isInt || !b.isInt)
+                return false; // operands are rounded to integers, with unknown range
+            double m = std::max({ std::abs(a.lo), std::abs(a.hi), std::abs(b.lo), std::abs(b.hi) });
+            double bound = std::exp2(std::ceil(std::log2(m + 1)));
+            if (unary)
+                r = integer(-a.hi - 1, -a.lo - 1);
+            else if (a.lo >= 0 && b.lo >= 0)
+                r = integer(0, bound - 1);
+            else
+                r = integer(-bound, bound - 1);
+            break;
+        }
+        default: // DIV, MOD, SQRT, TRUNC, ROUND, FLOOR, EXP, LOG, POW, SIN, COS and others always produce floats
+            for (size_t i = 0; i < need; i++)
+                pop();
+            r = floating;
+            break;
+        }
+        if (r.isInt && (r.lo < -limit || r.hi > limit))
+            return false;
+        stack.push_back(r);
+    }
+    return true;
+}
+
+// Returns true if ops can be evaluated entirely in half precision vectors:
+// every clip and the output are 16-bit float, and only the operators that
+// map directly onto half arithmetic are used.
+static bool halfExpressible(const std::vector<ExprOp> &ops, const VSVideoInfo *vo, const VSVideoInfo * const *vi, int numInputs) {
+    auto isHalf = [](const VSVideoInfo *v) { return v->format.sampleType == stFloat && v->format.bytesPerSample == 2; };
+    if (!isHalf(vo))
+        return false;
+    for (int i = 0; i < numInputs; i++)
+        if (vi[i] && !isHalf(vi[i]))
+            return false;
+    for (const auto &op: ops) {
+        switch (op.type) {
+        case ExprOpType::MEM_LOAD: case ExprOpType::CONSTANTI: case ExprOpType::CONSTANTF:
+        case ExprOpType::ADD: case ExprOpType::SUB: case ExprOpType::MUL: case ExprOpType::DIV:
+        case ExprOpType::ABS: case ExprOpType::MAX: case ExprOpType::MIN: case ExprOpType::CMP:
+        case ExprOpType::TERNARY: case ExprOpType::DUP: case ExprOpType::SWAP: case ExprOpType::DROP:
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns true if the value of ops at a pixel does not depend on its position,
+// only on the pixels at the same position in each clip.
+static bool positionIndependent(const std::vector<ExprOp> &ops) {
+    for (const auto &op: ops) {
+        if (op.type == ExprOpType::MEM_LOAD && (op.x != 0 || op.y != 0))
+            return false;
+        if (op.type == ExprOpType::MEM_LOAD_VAR)
+            return false;
+        if (op.type == ExprOpType::CONST_LOAD && op.imm.i != static_cast<int>(LoadConstType::N) && op.imm.i < static_cast<int>(LoadConstType::LAST))
+            return false;
+    }
+    return true;
+}
+
+// Rough per-vector cost of an expression, in units of a simple vector ALU operation.
+static int estimateCost(const std::vector<ExprOp> &ops) {
+    int cost = 0;
+    for (const auto &op: ops) {
+        switch (op.type) {
+        case ExprOpType::MEM_LOAD:
+            cost += op.bc == BoundaryCondition::Mirrored && op.x != 0 ? 8 : 2;
+            break;
+        case ExprOpType::MEM_LOAD_VAR: cost += op.x ? 64 : 16; break; // gathers
+        case ExprOpType::DIV: case ExprOpType::SQRT: case ExprOpType::MOD: cost += 4; break;
+        case ExprOpType::EXP: case ExprOpType::LOG: cost += 20; break;
+        case ExprOpType::SIN: case ExprOpType::COS: cost += 25; break;
+        case ExprOpType::POW: cost += 40; break;
+        case ExprOpType::SORT: cost += (int)op.imm.u * 2; break;
+        case ExprOpType::DUP: case ExprOpType::SWAP: case ExprOpType::DROP:
+        case ExprOpType::VAR_LOAD: case ExprOpType::VAR_STORE:
+            break; // register moves only
+        default: cost += 1; break;
+        }
+    }
+    return cost;
+}
+
+// Picks the number of vectors per loop iteration for an expression of the
+// given cost: cheap expressions are dominated by loop overhead and load
+// latency and benefit from more independent work per iteration, while
+// expensive ones already have plenty and would only spill registers.
+static int autoUnroll(int cost) {
+    int unroll = cost <= 12 ? 4 : cost <= 40 ? 2 : 1;
+    return std::min(std::max(unroll, hostSimd().unroll), 4);
+}
+
+template<int lanes>
+class Compiler {
+    struct Context {
+        const std::string expr;
+        std::vector<std::string> tokens;
+        std::vector<ExprOp> ops;
+        const VSVideoInfo *vo;
+        const VSVideoInfo * const *vi;
+        const VSAPI *vsapi;
+        int numInputs;
+        int optMask;
+        bool mirror;
+        int unroll;
+        int prefetch;
+        Uniforms uniforms;
+        ReduceMode reduce;
+        int outputs; // values left on the stack, one per output clip
+        bool cached;
+        bool exactInteger = false;
+        bool halfArith = false; // evaluate in half precision, see buildOneIterHalf
+        double parseTime = 0; // seconds spent in the constructor
+        Compiled cachedValue;
+#ifdef USE_EXPR_CACHE
+        ExprCacheClaim claim;
+#endif
+        Context(
+            const std::string &expr, 
+            const VSVideoInfo *vo, 
+            const VSVideoInfo *const *vi, 
+            const VSAPI *vsapi,
+            int numInputs, 
+            int opt, 
+            int mirror,
+            int unroll,
+            int prefetch,
+            const Uniforms &uniforms,
+            ReduceMode reduce,
+            bool lookup,
+            int outputs
+        ):
+            expr(expr), vo(vo), vi(vi), vsapi(vsapi), numInputs(numInputs), optMask(opt), mirror(!!mirror), unroll(unroll), prefetch(prefetch), uniforms(uniforms), reduce(reduce), outputs(outputs), cached(false) {
+            auto start = std::chrono::steady_clock::now();
+#ifdef USE_EXPR_CACHE
+            if (lookup && exprCache.find(key(), cachedValue, &claim)) {
+                cached = true;
+                parseTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                return;
+            }
+#endif
+
+            tokens = tokenize(expr);
+            for (const auto &tok: tokens) {
+                auto op = decodeToken(tok);
+                if (op.bc == BoundaryCondition::Unspecified)
+                    op.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
+                if (op.type == ExprOpType::CONST_LOAD && op.imm.i >= static_cast<int>(LoadConstType::LAST)) {
+                    auto it = uniforms.find({ op.imm.i - static_cast<int>(LoadConstType::LAST), op.name });
+                    if (it != uniforms.end())
+                        op = ExprOp(ExprOpType::CONSTANTF, it->second);
+                }
+                ops.push_back(op);
+            }
+            ExprOptimizer::run(ops, tokens, numInputs, optMask & flagUseInteger, outputs);
+            exactInteger = exactInInteger(ops, vo, vi, numInputs);
+            halfArith = (optMask & flagHalfArith) && lanes == 8 && reduce == ReduceMode::None && outputs == 1
+                && rr::SupportsNativeHalf() && halfExpressible(ops, vo, vi, numInputs) && ExprOptimizer::valid(ops, tokens, numInputs);
+            parseTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        enum {
+            flagUseInteger = 1<<0,
+            flagFusePlanes = 1<<1,
+            flagStreamStores = 1<<2, // set from the stream argument, not part of the user visible opt
+            flagHalfArith = 1<<3, // set from the fp16 argument
+            flagFastMath = 1<<4, // set from accuracy=0
+            flagPreciseMath = 1<<5, // set from accuracy=2
+            optLevelShift = 6, // 2 bits holding 3 - opt_level, so that 0 is the default
+            flagNoBranch = 1<<8, // set from branch=0
+        };
+        static std::string videoInfoKey(const VSVideoInfo *vi, const VSAPI *vsapi) {
+            std::array<char, 32> name{};
+            vsapi->getVideoFormatName(&vi->format, name.data());
+            return std::string(name.data()) + ";";
+        }
+        std::string key() const {
+            std::stringstream ss;
+            ss << "n=" << numInputs << "|opt=" << optMask << "|mirror=" << mirror
+                << "|simd=" << lanes << "x" << unroll << "|prefetch=" << prefetch << "|reduce=" << static_cast<int>(reduce) << "|expr=" << expr << "|vo=" << videoInfoKey(vo, vsapi);
+            for (int i = 0; i < numInputs; i++)
+                ss << "|vi" << i << "=" << videoInfoKey(vi[i], vsapi);
+            for (const auto &u: uniforms)
+                ss << "|uniform" << u.first.first << "." << u.first.second << "=" << std::hexfloat << u.second;
+            if (outputs > 1)
+                ss << "|outputs=" << outputs;
+            return ss.str();
+        }
+        Compiled getCached() const { return cachedValue; }
+
+        // Use integer arithmetic if requested, or if it gives bit-exact results anyway.
+        bool forceFloat() const { return !(optMask & flagUseInteger) && !exactInteger; }
+    } ctx;
+
+    using pointer = rr::Pointer<rr::Byte>;
+    using Types = VectorTypes<lanes>;
+    using ByteV = typename Types::Byte;
+    using UShortV = typename Types::UShort;
+    using IntV = typename Types::Int;
+    using FloatV = typename Types::Float;
+
+    struct Helper {
+        using ftype = rr::ModuleFunction<FloatV(FloatV)>;
+        using ftype2 = rr::ModuleFunction<FloatV(FloatV, FloatV)>;
+        std::unique_ptr<ftype> Exp;
+        std::unique_ptr<ftype> Log;
+        std::unique_ptr<ftype> Sin;
+        std::unique_ptr<ftype> Cos;
+        std::unique_ptr<ftype2> Pow;
+    };
+    rr::RValue<FloatV> Exp_(rr::RValue<FloatV>);
+    rr::RValue<FloatV> Log_(rr::RValue<FloatV>, FloatV *lo = nullptr);
+    rr::RValue<FloatV> SinCos_(rr::RValue<FloatV>, bool issin);
+    rr::RValue<FloatV> FP16To32(rr::RValue<UShortV>);
+    rr::RValue<UShortV> FP32To16(rr::RValue<FloatV>);
+    bool fastMath() const { return ctx.optMask & Context::flagFastMath; }
+    bool preciseMath() const { return ctx.optMask & Context::flagPreciseMath; }
+    // Routines with accuracy=2 are built without fast-math flags, which would
+    // otherwise allow LLVM to reassociate away the compensated sums in Pow.
+    // Below opt_level=3, fewer passes and a cheaper codegen level are used,
+    // trading the speed of the routine for the time to compile it.
+    static rr::Config::Edit routineConfig(int optMask) {
+        using rr::Optimization;
+        rr::Config::Edit edit;
+        if (optMask & Context::flagPreciseMath)
+            edit.set(Optimization::FMF::NoFastMath);
+        static const Optimization::Level levels[] = {
+            Optimization::Level::None, Optimization::Level::Less, Optimization::Level::Default, Optimization::Level::Aggressive,
+        };
+        int level = 3 - ((optMask >> Context::optLevelShift) & 3);
+        if (level < 3) {
+            edit.set(levels[level]).clearOptimizationPasses().add(Optimization::Pass::ScalarReplAggregates);
+            if (level >= 1)
+                edit.add(Optimization::Pass::InstructionCombining).add(Optimization::Pass::CFGSimplification);
+            if (level >= 2)
+                edit.add(Optimization::Pass::EarlyCSEPass).add(Optimization::Pass::GVN).add(Optimization::Pass::LICM);
+        }
+        return edit;
+    }
+
+    class Value {
+        std::variant<IntV, FloatV> v;
+        bool constant;
+
+    public:
+        bool isFloat() { return std::holds_alternative<FloatV>(v); }
+        bool isConst() { return constant; }
+
+        Value(int x) : v(IntV(x)), constant(true) {}
+        Value(float x) : v(FloatV(x)), constant(true) {}
+
+        Value(IntV i) : v(i), constant(false) {}
+        Value(rr::RValue<IntV> i) : v(IntV(i)), constant(false) {}
+        Value(rr::Reference<IntV> i) : v(IntV(i)), constant(false) {}
+        Value(FloatV f) : v(f), constant(false) {}
+        Value(rr::RValue<FloatV> f) : v(FloatV(f)), constant(false) {}
+        Value(rr::Reference<FloatV> f) : v(FloatV(f)), constant(false) {}
+
+        FloatV f() { return std::get<FloatV>(v); }
+        IntV i() { return std::get<IntV>(v); }
+
+        FloatV ensureFloat() { return isFloat() ? f() : FloatV(i()); }
+        IntV ensureInt() { return isFloat() ? IntV(RoundInt(f())) : i(); }
+
+        Value Max(Value &rhs) { return (isFloat() || rhs.isFloat()) ? Value(rr::Max(ensureFloat(), rhs.ensureFloat())) : Value(rr::Max(i(), rhs.i())); }
+        Value Min(Value &rhs) { return (isFloat() || rhs.isFloat()) ? Value(rr::Min(ensureFloat(), rhs.ensureFloat())) : Value(rr::Min(i(), rhs.i())); }
+    };
 
     struct State {
         std::vector<pointer> wptrs;
         std::vector<rr::Int> strides;
         rr::Pointer<rr::Float> consts;
+        // Frame constants, loaded once before the loops so that everything
+        // depending only on them can be hoisted out of the pixel loop.
+        IntV n;
+        std::vector<FloatV> props;
         rr::Int width;
         rr::Int height;
         IntV xvec;
 
-        rr::Int y;
-        rr::Int x;
+        rr::Int y;
+        rr::Int x;
+
+        std::vector<Value> variables;
+
+        // Running per-lane reduction of the current row, if any.
+        FloatV acc;
+
+        // Set while emitting the interior loop body, where relative accesses need no boundary handling.
+        bool interior = false;
+        // Set while emitting the last vector of a row if it extends past the
+        // width; its lanes beyond the row must not be stored.
+        bool tail = false;
+    };
+
+    using PropMap = std::map<std::pair<int, std::string>, int>;
+    int numVariables = 0;
+    int numProps = 0;
+
+    // A ternary whose operands are emitted behind branches, so that only the
+    // operand its condition selects is computed when all lanes agree.
+    struct Branch {
+        size_t falseBegin; // the true operand ends there
+        size_t ternary; // the false operand ends there
+    };
+    std::map<size_t, Branch> branches; // by the first op of the true operand
+
+    Helper buildHelpers(rr::Module &mod);
+    void prepare(PropMap &paMap);
+    void bindState(State &state, pointer rwptrs, rr::Pointer<rr::Int> strides, int group);
+    void findBranches();
+    void buildOneIter(const Helper &helpers, State &state);
+    void buildOps(const Helper &helpers, State &state, std::vector<Value> &stack, size_t begin, size_t end, size_t noBranchAt);
+    void buildBranch(const Helper &helpers, State &state, std::vector<Value> &stack, size_t begin, const Branch &b);
+    void buildOneIterHalf(State &state);
+    pointer relativeAddress(State &state, const ExprOp &op, rr::Int &x, IntV &offsets);
+    template<typename V> void storeOutput(State &state, rr::RValue<V> v, int output = 0);
+    void storeResult(State &state, Value res, int output);
+    static IntV tailMask(State &state);
+    struct Margins {
+        int left = 0, right = 0, top = 0, bottom = 0;
+        bool any() const { return left || right || top || bottom; }
+    };
+    static void buildLoops(State &state, rr::Int ystart, rr::Int yend, int unroll, int blockWidth, const Margins &m, const std::function<void(bool, int)> &body, const std::function<void()> &rowEnd = {});
+    float reduceIdentity() const;
+    template<typename T> rr::RValue<T> reduceCombine(rr::RValue<T> a, rr::RValue<T> b) const;
+    void buildRowReduce(State &state);
+    static Margins relativeMargins(const std::vector<Compiler *> &comps);
+    static int columnBlockWidth(const std::vector<Compiler *> &comps, int unroll);
+    static int prefetchRows(const std::vector<Compiler *> &comps, int prefetch);
+    void buildPrefetch(State &state, int rows);
+    static std::vector<Compiled::PropAccess> propAccess(const PropMap &paMap);
+    static Compiled::Stats routineStats(double parseTime, const rr::Routine &routine) {
+        return { parseTime, routine.optimizeTime, routine.codegenTime, routine.getMemorySize(), routine.fromObjectCache };
+    }
+
+public:
+    Compiler(
+        const std::string &expr,
+        const VSVideoInfo *vo, 
+        const VSVideoInfo * const *vi, 
+        const VSAPI *vsapi,
+        int numInputs, 
+        int opt = 0, 
+        int mirror = 0,
+        int unroll = 1,
+        int prefetch = 0,
+        const Uniforms &uniforms = {},
+        ReduceMode reduce = ReduceMode::None,
+        bool lookup = true,
+        int outputs = 1
+    ) : ctx(expr, vo, vi, vsapi, numInputs, opt, mirror, unroll, prefetch, uniforms, reduce, lookup, outputs) {}
+
+    Compiled compile();
+
+    // Compiles all given expressions into a single routine that processes
+    // one plane per expression in the same row loop. All planes must have
+    // the same dimensions. rwptrs and strides hold numInputs+1 entries per
+    // plane, in the order of exprs.
+    static Compiled compileFused(
+        const std::vector<std::string> &exprs,
+        const VSVideoInfo *vo,
+        const VSVideoInfo * const *vi,
+        const VSAPI *vsapi,
+        int numInputs,
+        int opt = 0,
+        int mirror = 0,
+        int unroll = 1,
+        int prefetch = 0,
+        const Uniforms &uniforms = {}
+    );
+};
+
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Exp_(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+{
+    FloatV x = x_;
+    using namespace rr;
+    const float exp_hi = 88.3762626647949f, exp_lo = -88.3762626647949f, log2e  = 1.44269504088896341f,
+          exp_c1 = 0.693359375f, exp_c2 = -2.12194440e-4f, exp_p0 = 1.9875691500E-4f, exp_p1 = 1.3981999507E-3f,
+          exp_p2 = 8.3334519073E-3f, exp_p3 = 4.1665795894E-2f, exp_p4 = 1.6666665459E-1f, exp_p5 = 5.0000001201E-1f;
+    x = Min(x, FloatV(exp_hi));
+    x = Max(x, FloatV(exp_lo));
+    FloatV fx = FloatV(log2e);
+    fx = FMA(fx, x, FloatV(0.5f));
+    IntV emm0 = RoundInt(fx);
+    FloatV etmp = FloatV(emm0);
+    FloatV mask = As<FloatV>(As<IntV>(FloatV(1.0f)) & CmpGT(etmp, fx));
+    fx = etmp - mask;
+    x = FMA(fx, FloatV(-exp_c1), x);
+    x = FMA(fx, FloatV(-exp_c2), x);
+    FloatV z = x * x;
+    FloatV y;
+    if (fastMath()) {
+        // degree 4 fit, relative error below 6e-6.
+        y = FloatV(4.1277747601E-02f);
+        y = FMA(y, x, FloatV(1.6753514111E-01f));
+        y = FMA(y, x, FloatV(5.0005114079E-01f));
+    } else {
+        y = FloatV(exp_p0);
+        y = FMA(y, x, FloatV(exp_p1));
+        y = FMA(y, x, FloatV(exp_p2));
+        y = FMA(y, x, FloatV(exp_p3));
+        y = FMA(y, x, FloatV(exp_p4));
+        y = FMA(y, x, FloatV(exp_p5));
+    }
+    y = FMA(y, z, x);
+    y = y + FloatV(1.0f);
+    emm0 = RoundInt(fx);
+    emm0 = emm0 + IntV(0x7f);
+    emm0 = emm0 << 23;
+    x = y * As<FloatV>(emm0);
+    return x;
+}
+
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Log_(rr::RValue<typename Compiler<lanes>::FloatV> x_, FloatV *lo)
+{
+    FloatV x = x_;
+    using namespace rr;
+    const uint32_t min_norm_pos = 0x00800000, inv_mant_mask = ~0x7F800000;
+    const float float_half = 0.5f, sqrt_1_2 = 0.707106781186547524f, log_p0 = 7.0376836292E-2f, log_p1 = -1.1514610310E-1f,
+          log_p2 = 1.1676998740E-1f, log_p3 = -1.2420140846E-1f, log_p4 = +1.4249322787E-1f, log_p5 = -1.6668057665E-1f,
+          log_p6 = +2.0000714765E-1f, log_p7 = -2.4999993993E-1f, log_p8 = +3.3333331174E-1f, log_q2 = 0.693359375f,
+          log_q1 = -2.12194440e-4f;
+    const float zero = 0.0f, one = 1.0f;
+    IntV invalid_mask = CmpLE(x, FloatV(zero));
+    x = Max(x, As<FloatV>(IntV(min_norm_pos)));
+    IntV emm0i = As<IntV>(x) >> 23;
+    x = As<FloatV>(As<IntV>(x) & IntV(inv_mant_mask));
+    x = As<FloatV>(As<IntV>(x) | As<IntV>(FloatV(float_half)));
+    emm0i = emm0i - IntV(0x7f);
+    FloatV emm0 = FloatV(emm0i);
+    emm0 = emm0 + FloatV(one);
+    IntV mask = CmpLT(x, FloatV(sqrt_1_2));
+    FloatV etmp = As<FloatV>(mask & As<IntV>(x));
+    x = x - FloatV(one);
+    FloatV maskf = As<FloatV>(mask & As<IntV>(FloatV(one)));
+    emm0 = emm0 - maskf;
+    x = x + etmp;
+    FloatV z = x * x;
+    FloatV y;
+    if (fastMath()) {
+        // degree 6 fit, relative error below 1.5e-5.
+        y = FloatV(-1.4592510462E-01f);
+        y = FMA(y, x, FloatV(2.1776509285E-01f));
+        y = FMA(y, x, FloatV(-2.5244998932E-01f));
+        y = FMA(y, x, FloatV(3.3285471797E-01f));
+    } else {
+        y = FloatV(log_p0);
+        y = FMA(y, x, FloatV(log_p1));
+        y = FMA(y, x, FloatV(log_p2));
+        y = FMA(y, x, FloatV(log_p3));
+        y = FMA(y, x, FloatV(log_p4));
+        y = FMA(y, x, FloatV(log_p5));
+        y = FMA(y, x, FloatV(log_p6));
+        y = FMA(y, x, FloatV(log_p7));
+        y = FMA(y, x, FloatV(log_p8));
+    }
+    y = y * x;
+    y = y * z;
+    y = FMA(emm0, FloatV(log_q1), y);
+    y = FMA(z, FloatV(-float_half), y);
+    if (lo) {
+        // Split the result into hi + lo, where the rounding errors of the
+        // final two additions are carried in lo (emm0 * log_q2 is exact).
+        FloatV s = x + y;
+        FloatV e = y - (s - x);
+        FloatV a = emm0 * FloatV(log_q2);
+        FloatV hi = a + s;
+        FloatV bb = hi - a;
+        *lo = (a - (hi - bb)) + (s - bb) + e;
+        x = hi;
+    } else {
+        x = x + y;
+        x = FMA(emm0, FloatV(log_q2), x);
+    }
+    x = As<FloatV>(invalid_mask | As<IntV>(x));
+    return x;
+}
+
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::SinCos_(rr::RValue<typename Compiler<lanes>::FloatV> x_, bool issin)
+{
+    FloatV x = x_;
+    using namespace rr;
+    auto conv = [](uint32_t x) -> FloatV { return As<FloatV>(IntV(x)); };
+    IntV absmask = IntV(0x7FFFFFFF);
+    FloatV float_invpi = conv(0x3ea2f983),
+           float_rintf = conv(0x4b400000),
+           float_pi1 = conv(0x40490000),
+           float_pi2 = conv(0x3a7da000),
+           float_pi3 = conv(0x34222000),
+           float_pi4 = conv(0x2cb4611a),
+           float_sinC3 = conv(0xbe2aaaa6),
+           float_sinC5 = conv(0x3c08876a),
+           float_sinC7 = conv(0xb94fb7ff),
+           float_sinC9 = conv(0x362edef8),
+           float_cosC2 = conv(0xBEFFFFE2),
+           float_cosC4 = conv(0x3D2AA73C),
+           float_cosC6 = conv(0XBAB58D50),
+           float_cosC8 = conv(0x37C1AD76);
+    IntV sign;
+    if (issin)
+        sign = As<IntV>(x) & ~absmask;
+    else
+        sign = IntV(0);
+    FloatV t1 = Abs(x);
+    // Range reduction
+    FloatV t2 = t1 * float_invpi;
+    IntV t2i = RoundInt(t2);
+    IntV t4 = t2i << 31;
+    sign = sign ^ t4;
+    t2 = FloatV(t2i);
+
+    t1 = FMA(t2, -float_pi1, t1);
+    t1 = FMA(t2, -float_pi2, t1);
+    t1 = FMA(t2, -float_pi3, t1);
+    t1 = FMA(t2, -float_pi4, t1);
+
+    if (fastMath()) {
+        // degree 5 (sin) and 6 (cos) fits on the same interval, absolute
+        // error below 1.2e-4 and 8e-6 respectively.
+        if (issin) {
+            t2 = t1 * t1;
+            FloatV t3 = FMA(t2, FloatV(7.6337731443E-03f), FloatV(-1.6607862711E-01f));
+            t3 = t3 * t2;
+            t3 = t3 * t1;
+            t1 = t1 + t3;
+        } else {
+            t1 = t1 * t1;
+            FloatV t2 = FMA(t1, FloatV(-1.2757519726E-03f), FloatV(4.1507065296E-02f));
+            t2 = FMA(t2, t1, FloatV(-4.9993562698E-01f));
+            t1 = FMA(t2, t1, FloatV(1.0f));
+        }
+    } else if (issin) {
+        // minimax polynomial for sin(x) in [-pi/2, pi/2] interval.
+        // compute X + X * X^2 * (C3 + X^2 * (C5 + X^2 * (C7 + X^2 * C9)))
+        t2 = t1 * t1;
+        FloatV t3 = FMA(t2, float_sinC9, float_sinC7);
+        t3 = FMA(t3, t2, float_sinC5);
+        t3 = FMA(t3, t2, float_sinC3);
+        t3 = t3 * t2;
+        t3 = t3 * t1;
+        t1 = t1 + t3;
+    } else {
+        // minimax polynomial for cos(x) in [-pi/2, pi/2] interval.
+        // compute 1 + X^2 * (C2 + X^2 * (C4 + X^2 * (C6 + X^2 * C8)))
+        t1 = t1 * t1;
+        FloatV t2 = FMA(t1, float_cosC8, float_cosC6);
+        t2 = FMA(t2, t1, float_cosC4);
+        t2 = FMA(t2, t1, float_cosC2);
+        t1 = FMA(t2, t1, FloatV(1.0f));
+    }
+    // Apply sign.
+    return As<FloatV>(sign ^ As<IntV>(t1));
+}
+
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::FP16To32(rr::RValue<typename Compiler<lanes>::UShortV> x_)
+{
+    if constexpr (lanes == 8) { // native conversions are only available for 8-lane vectors
+        bool ok;
+        FloatV r = rr::TryFP16To32(x_, ok);
+        if (ok) return r;
+    }
+
+    using namespace rr;
+    FloatV magic = As<FloatV>(IntV((254 - 15) << 23));
+    FloatV inf16 = As<FloatV>(IntV((127 + 16) << 23));
+    IntV ti = IntV(x_);
+    IntV sign = (ti & IntV(0x8000)) << 16;
+    ti = (ti & IntV(0x7fff)) << 13;
+    FloatV tf = As<FloatV>(ti) * magic;
+    ti = As<IntV>(tf);
+    IntV infmask = CmpGE(tf, inf16);
+    infmask = infmask & IntV(255 << 23);
+    ti = ti | infmask | sign;
+    return As<FloatV>(ti);
+}
+
+template<int lanes>
+rr::RValue<typename Compiler<lanes>::UShortV> Compiler<lanes>::FP32To16(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+{
+    if constexpr (lanes == 8) {
+        bool ok;
+        UShortV r = rr::TryFP32To16(x_, ok);
+        if (ok) return r;
+    }
+
+    using namespace rr;
+    IntV f32infty = IntV(255 << 23);
+    FloatV f16max = As<FloatV>(IntV((127 + 16) << 23));
+    FloatV magic = As<FloatV>(IntV(15 << 23));
+    IntV expinf = IntV((255 ^ 31) << 23);
+    IntV ti = As<IntV>(x_);
+    IntV signmask = IntV(0x80000000);
+    IntV sign = ti & signmask;
+    ti = ti ^ sign;
+    sign = sign >> 16;
+    IntV nanmask = CmpEQ(ti & f32infty, f32infty);
+    IntV ifnan = ti ^ expinf;
+    IntV normal = As<IntV>(Min(As<FloatV>(ti), f16max) * magic);
+    ti = (nanmask & ifnan) | (~nanmask & normal);
+    return UShortV((ti >> 13) | sign);
+}
+
+template<int lanes, typename VType>
+static VType relativeAccessAdjust(rr::Int &x, rr::Int &alignedx, rr::Int &width, const ExprOp &op, VType v)
+{
+    using namespace rr;
+    if (op.x == 0)
+        return v;
+    else if (op.bc == BoundaryCondition::Mirrored)
+        return v;
+    else if (op.bc == BoundaryCondition::Clamped) {
+        BasicBlock *contBb = Nucleus::createBasicBlock();
+        if (op.x < 0) {
+            int absx = std::abs(op.x);
+            SwitchCases *switchCases = Nucleus::createSwitch(alignedx.loadValue(), contBb, (absx + lanes - 1) / lanes);
+            for (int i = 0; i < absx; i += lanes) {
+                BasicBlock *bb = Nucleus::createBasicBlock();
+                Nucleus::addSwitchCase(switchCases, i, bb);
+                Nucleus::setInsertBlock(bb);
+                typename VectorTypes<lanes>::SwizzleMask select = 0;
+                for (int j = 0; j < lanes; j++) {
+                    select <<= 4;
+                    select |= std::max(i + j + op.x, 0) % lanes;
+                }
+                v = Swizzle(v, select);
+                Nucleus::createBr(contBb);
+            }
+        } else {
+            Int dist = x + lanes - width;
+            BasicBlock *switchBb = Nucleus::createBasicBlock();
+            rr::Bool cond = dist > 0;
+            Nucleus::createCondBr(cond.loadValue(), switchBb, contBb);
+            Nucleus::setInsertBlock(switchBb);
+            BasicBlock *defaultBb = Nucleus::createBasicBlock();
+            SwitchCases *switchCases = Nucleus::createSwitch(dist.loadValue(), defaultBb, lanes-2);
+            for (int i = 1; i < lanes-1; i++) {
+                BasicBlock *bb = Nucleus::createBasicBlock();
+                Nucleus::addSwitchCase(switchCases, i, bb);
+                Nucleus::setInsertBlock(bb);
+                typename VectorTypes<lanes>::SwizzleMask select = 0, last = 0;
+                for (int j = 0; j < lanes; j++) {
+                    last = select & 0xf;
+                    select <<= 4;
+                    if (j + i < lanes)
+                        select |= j;
+                    else
+                        select |= last;
+                }
+                v = Swizzle(v, select);
+                Nucleus::createBr(contBb);
+            }
+            Nucleus::setInsertBlock(defaultBb);
+            v = Swizzle(v, 0);
+            Nucleus::createBr(contBb);
+        }
+        Nucleus::setInsertBlock(contBb);
+    }
+    return v;
+}
+
+typedef std::vector<std::pair<int, int>> SortingNetwork;
+static const SortingNetwork &buildSortNet(int n) {
+    static std::mutex lock;
+    static std::map<int, SortingNetwork> built;
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = built.find(n);
+    if (it != built.end()) return it->second;
+
+    built.insert({ n, {} });
+    auto &sn = built.find(n)->second;
+
+    int t = 0;
+    while (n > (1<<t)) t++;
+    int p = 1 << (t - 1);
+    while (p > 0) {
+        int q = 1 << (t - 1), r = 0, d = p;
+        while (d > 0) {
+            for (int i = 0; i < n - d; i++)
+                if ((i & p) == r)
+                    sn.emplace_back(i, i+d);
+            d = q - p;
+            q >>= 1;
+            r = p;
+        }
+        p >>= 1;
+    }
+    return sn;
+}
+
+// The comparators of buildSortNet(n) that contribute to the sorted values at
+// positions [lo, hi) from the top of the stack, and which of their two
+// results are needed. When only a few ranks are consumed (e.g. a median),
+// this skips a good part of the network.
+struct SelectComparator {
+    int a, b;
+    bool min, max;
+};
+typedef std::vector<SelectComparator> SelectionNetwork;
+static const SelectionNetwork &buildSelectNet(int n, int lo, int hi) {
+    static std::mutex lock;
+    static std::map<std::tuple<int, int, int>, SelectionNetwork> built;
+    const SortingNetwork &sn = buildSortNet(n);
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = built.find({ n, lo, hi });
+    if (it != built.end()) return it->second;
+
+    auto &net = built[{ n, lo, hi }];
+    std::vector<bool> live(n, false);
+    for (int i = lo; i < hi; i++)
+        live[i] = true;
+    for (auto cmp = sn.rbegin(); cmp != sn.rend(); ++cmp) {
+        bool min = live[cmp->first], max = live[cmp->second];
+        if (!min && !max)
+            continue;
+        net.push_back({ cmp->first, cmp->second, min, max });
+        live[cmp->first] = live[cmp->second] = true;
+    }
+    std::reverse(net.begin(), net.end());
+    return net;
+}
+
+// Returns the address of the vector for the relative access op at the
+// current position, applying its boundary condition. x receives the column
+// the vector starts at. If the lanes are not consecutive (mirrored at the
+// left or right edge), the address is the start of the row and offsets
+// holds the byte offset of each lane instead.
+template<int lanes>
+typename Compiler<lanes>::pointer Compiler<lanes>::relativeAddress(State &state, const ExprOp &op, rr::Int &x, IntV &offsets)
+{
+    using namespace rr;
+    Pointer<Byte> p = state.wptrs[op.imm.i + 1];
+    const VSVideoFormat format = ctx.vi[op.imm.i]->format;
+    Int y = state.y;
+    x = state.x;
+    offsets = IntV(0);
+    if (state.interior) { // all neighbours are known to be inside the plane
+        if (op.y != 0)
+            y = state.y + op.y;
+        if (op.x != 0)
+            x = state.x + op.x;
+    } else if (op.bc == BoundaryCondition::Clamped) {
+        if (op.y != 0)
+            y = Clamp(state.y + op.y, 0, state.height-1);
+        if (op.x != 0)
+            x = Clamp(state.x + op.x, 0, state.width-1);
+    } else { // Mirrored
+        if (op.y != 0) {
+            Int sy = state.y + Clamp(op.y, -state.height, state.height);
+            y = IfThenElse(sy < 0, -1 - sy,
+                    IfThenElse(sy >= state.height, 2*state.height-1 - sy, sy));
+        }
+        if (op.x != 0) {
+            Int cx = Clamp(op.x, -state.width, state.width);
+            Int w2m1 = 2 * state.width - 1;
+            for (int i = 0; i < lanes; i++) {
+                Int sx = x + i + cx;
+                Int xi = IfThenElse(sx < 0, -1 - sx,
+                            IfThenElse(sx >= state.width, w2m1 - sx, sx));
+                offsets = Insert(offsets, xi, i);
+            }
+            offsets = offsets * IntV(format.bytesPerSample);
+            x = 0;
+        }
+    }
+    return p + (y * state.strides[op.imm.i + 1] + x * format.bytesPerSample);
+}
+
+// Stores v as the vector of the given output clip at the current position.
+// The pointers of outputs past the first follow those of the inputs.
+template<int lanes>
+template<typename V>
+void Compiler<lanes>::storeOutput(State &state, rr::RValue<V> v, int output)
+{
+    using namespace rr;
+    auto format = ctx.vo->format;
+    const int slot = output ? ctx.numInputs + output : 0;
+    Pointer<Byte> p = state.wptrs[slot];
+    p += state.y * state.strides[slot] + state.x * format.bytesPerSample;
+    // Streaming stores only pay off for whole cache lines worth of vectors;
+    // narrower ones are emulated piecewise anyway.
+    const unsigned align = lanes * format.bytesPerSample;
+    const bool stream = (ctx.optMask & Context::flagStreamStores) && align >= 16;
+    if (state.tail)
+        MaskedStore(RValue<Pointer<V>>(Pointer<V>(p, align)), v, RValue<IntV>(tailMask(state)), align);
+    else if (stream)
+        StoreNonTemporal(v, RValue<Pointer<V>>(Pointer<V>(p, align)), align);
+    else
+        *Pointer<V>(p, align) = v;
+}
+
+// Returns a mask of the lanes of the vector at the current position that are
+// inside the row.
+template<int lanes>
+typename Compiler<lanes>::IntV Compiler<lanes>::tailMask(State &state)
+{
+    using namespace rr;
+    return CmpLT(state.xvec + IntV(state.x), IntV(state.width));
+}
+
+// Emits one iteration of an expression for which halfArith is set (which
+// implies it is valid), keeping every intermediate value in half precision
+// vectors. This needs neither the
+// widening on load nor the narrowing on store, and on hosts with native half
+// arithmetic each instruction handles twice as many values as in float.
+template<int lanes>
+void Compiler<lanes>::buildOneIterHalf(State &state)
+{
+    using namespace rr;
+    if constexpr (lanes != 8) {
+        assert(0 && "Context only sets halfArith with 8 lanes");
+    } else {
+        std::vector<UShortV> stack;
+        auto constant = [](float f) {
+            bool ok;
+            return UShortV(TryFP32To16(FloatV(f), ok));
+        };
+        auto pop = [&]() {
+            UShortV v = stack.back();
+            stack.pop_back();
+            return v;
+        };
+        auto binary = [&](HalfOp h) {
+            UShortV r = pop(), l = pop();
+            stack.push_back(HalfArith(h, l, r));
+        };
+
+        for (const auto &op: ctx.ops) {
+            switch (op.type) {
+            case ExprOpType::MEM_LOAD: {
+                Int x;
+                IntV offsets;
+                Pointer<Byte> p = relativeAddress(state, op, x, offsets);
+                UShortV v;
+                if (state.interior || op.bc != BoundaryCondition::Mirrored || op.x == 0)
+                    v = *Pointer<UShortV>(p, (op.x != 0 ? 1 : lanes) * sizeof(uint16_t));
+                else
+                    v = Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t));
+                if (!state.interior)
+                    v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
+                stack.push_back(v);
+                break;
+            }
+            case ExprOpType::CONSTANTI: stack.push_back(constant((float)op.imm.i)); break;
+            case ExprOpType::CONSTANTF: stack.push_back(constant(op.imm.f)); break;
+            case ExprOpType::ADD: binary(HalfOp::Add); break;
+            case ExprOpType::SUB: binary(HalfOp::Sub); break;
+            case ExprOpType::MUL: binary(HalfOp::Mul); break;
+            case ExprOpType::DIV: binary(HalfOp::Div); break;
+            case ExprOpType::MAX: binary(HalfOp::Max); break;
+            case ExprOpType::MIN: binary(HalfOp::Min); break;
+            case ExprOpType::ABS: stack.push_back(pop() & UShortV(0x7fff)); break;
+            case ExprOpType::CMP:
+                switch (static_cast<ComparisonType>(op.imm.u)) {
+                case ComparisonType::EQ:  binary(HalfOp::CmpEQ);  break;
+                case ComparisonType::LT:  binary(HalfOp::CmpLT);  break;
+                case ComparisonType::LE:  binary(HalfOp::CmpLE);  break;
+                case ComparisonType::NEQ: binary(HalfOp::CmpNEQ); break;
+                case ComparisonType::NLT: binary(HalfOp::CmpNLT); break;
+                case ComparisonType::NLE: binary(HalfOp::CmpNLE); break;
+                }
+                break;
+            case ExprOpType::TERNARY: {
+                UShortV f = pop(), t = pop(), c = pop();
+                stack.push_back(HalfSelect(c, t, f));
+                break;
+            }
+            case ExprOpType::DUP:
+                stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+                break;
+            case ExprOpType::SWAP:
+                std::swap(stack.back(), stack[stack.size() - 1 - op.imm.u]);
+                break;
+            case ExprOpType::DROP:
+                stack.resize(stack.size() - op.imm.u);
+                break;
+            default:
+                assert(0 && "rejected by halfExpressible");
+                break;
+            }
+        }
+        storeOutput<UShortV>(state, stack.back());
+    }
+}
+
+template<int lanes>
+void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
+{
+    using namespace rr;
+    if (ctx.halfArith) {
+        buildOneIterHalf(state);
+        return;
+    }
+    std::vector<Value> stack;
+    buildOps(helpers, state, stack, 0, ctx.ops.size(), SIZE_MAX);
+
+    if (ctx.outputs > 1 && stack.size() != (size_t)ctx.outputs)
+        throw std::runtime_error(std::to_string(stack.size()) + " values on stack for " + std::to_string(ctx.outputs) + " outputs: " + ctx.expr);
+    if (stack.empty())
+        throw std::runtime_error("empty expression: " + ctx.expr);
+    if (stack.size() > 1 && ctx.outputs == 1)
+        throw std::runtime_error(std::to_string(stack.size()) + " unconsumed values on stack: " + ctx.expr);
+
+    for (int k = 0; k < ctx.outputs; k++)
+        storeResult(state, stack[k], k);
+}
+
+// Emits the ternary whose true operand starts at begin, with the condition on
+// top of stack, and leaves its result there instead. Vectors whose lanes all
+// select the same operand only compute that operand; lanes past the row do
+// not count.
+template<int lanes>
+void Compiler<lanes>::buildBranch(const Helper &helpers, State &state, std::vector<Value> &stack, size_t begin, const Branch &b)
+{
+    using namespace rr;
+    Value c = stack.back();
+    IntV ci = c.isFloat() ? CmpGT(c.f(), FloatV(0.0f)) : CmpGT(c.i(), IntV(0));
+    IntV valid = state.tail ? tailMask(state) : IntV(~0);
+    IntV anyv = ci & valid, allv = ci | ~valid;
+    Int any = Extract(anyv, 0), all = Extract(allv, 0);
+    for (int i = 1; i < lanes; i++) {
+        any = any | Extract(anyv, i);
+        all = all & Extract(allv, i);
+    }
+
+    // The mixed case is emitted first, as it determines the type of the result.
+    IntV ri;
+    FloatV rf;
+    bool isFloat = false;
+    If(any != 0 && all != -1) {
+        std::vector<Value> s = stack;
+        buildOps(helpers, state, s, begin, b.ternary + 1, begin);
+        Value r = s.back();
+        isFloat = r.isFloat();
+        if (isFloat)
+            rf = r.f();
+        else
+            ri = r.i();
+    } Else {
+        // Each operand gets its own copy of the stack, and assigns the result
+        // inside its own block.
+        const auto assign = [&](Value r) {
+            if (isFloat)
+                rf = r.ensureFloat();
+            else
+                ri = r.i();
+        };
+        If(any != 0) {
+            std::vector<Value> s = stack;
+            buildOps(helpers, state, s, begin, b.falseBegin, begin);
+            assign(s.back());
+        } Else {
+            std::vector<Value> s = stack;
+            buildOps(helpers, state, s, b.falseBegin, b.ternary, SIZE_MAX);
+            assign(s.back());
+        }
+    }
+    stack.pop_back();
+    if (isFloat)
+        stack.push_back(rf);
+    else
+        stack.push_back(ri);
+}
+
+// Emits ops [begin, end) onto stack, branching around the operands of the
+// ternaries in branches, except for one whose true operand starts at noBranchAt.
+template<int lanes>
+void Compiler<lanes>::buildOps(const Helper &helpers, State &state, std::vector<Value> &stack, size_t begin, size_t end, size_t noBranchAt)
+{
+    using namespace rr;
+    for (size_t i = begin; i < end; i++) {
+        const std::string &tok = ctx.tokens[i];
+        const ExprOp &op = ctx.ops[i];
+
+        if (i != noBranchAt) {
+            auto it = branches.find(i);
+            if (it != branches.end()) {
+                buildBranch(helpers, state, stack, i, it->second);
+                i = it->second.ternary;
+                continue;
+            }
+        }
+
+        // Check validity.
+        if (op.type == ExprOpType::MEM_LOAD && op.imm.i >= ctx.numInputs)
+            throw std::runtime_error("reference to undefined clip: " + tok);
+        if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
+            throw std::runtime_error("insufficient values on stack: " + tok);
+        if ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT) && op.imm.u > stack.size())
+            throw std::runtime_error("insufficient values on stack: " + tok);
+        if (stack.size() < numOperands[static_cast<size_t>(op.type)])
+            throw std::runtime_error("insufficient values on stack: " + tok);
+
+#define OUT(x) stack.push_back(x)
+        switch (op.type) {
+        case ExprOpType::DUP:
+            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+            break;
+        case ExprOpType::SWAP: {
+            std::swap(stack[stack.size()-1], stack[stack.size() - 1 - op.imm.u]);
+            break;
+        }
+        case ExprOpType::DROP: {
+            for (unsigned i = 0; i < op.imm.u; i++)
+                stack.pop_back();
+            break;
+        }
+
+        case ExprOpType::SORT: {
+            // "3 7 1 2 0 4 6 5 sort8" -> "7 6 5 4 3 2 1 0"
+            auto at = [&stack](int i) -> Value& { return stack.at(stack.size() - 1 - i); };
+            if (op.y > 0) { // only positions [op.x, op.y) are used afterwards
+                for (auto cmp: buildSelectNet(op.imm.u, op.x, op.y)) {
+                    auto &a = at(cmp.a), &b = at(cmp.b);
+                    if (cmp.min && cmp.max) {
+                        Value min = a.Min(b), max = a.Max(b);
+                        a = min, b = max;
+                    } else if (cmp.min)
+                        a = a.Min(b);
+                    else
+                        b = a.Max(b);
+                }
+                break;
+            }
+            const auto &sn = buildSortNet(op.imm.u);
+            for (auto cmp: sn) {
+                auto &a = at(cmp.first), &b = at(cmp.second);
+                Value min = a.Min(b), max = a.Max(b);
+                a = min, b = max;
+            }
+            break;
+        }
+
+        case ExprOpType::MEM_LOAD: {
+            const VSVideoFormat format = ctx.vi[op.imm.i]->format;
+            const bool unaligned = op.x != 0;
+            Int x;
+            IntV offsets;
+            Pointer<Byte> p = relativeAddress(state, op, x, offsets);
+            const bool regularLoad = state.interior || op.bc != BoundaryCondition::Mirrored || op.x == 0;
+            if (format.sampleType == stInteger) {
+                IntV v;
+                if (format.bytesPerSample == 1) {
+                    if (regularLoad)
+                        v = IntV(*Pointer<ByteV>(p, (unaligned ? 1:lanes)*sizeof(uint8_t)));
+                    else
+                        v = IntV(Gather(Pointer<Byte>(p), offsets, IntV(~0), sizeof(uint8_t)));
+                } else if (format.bytesPerSample == 2) {
+                    if (regularLoad)
+                        v = IntV(*Pointer<UShortV>(p, (unaligned ? 1:lanes)*sizeof(uint16_t)));
+                    else
+                        v = IntV(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t)));
+                } else if (format.bytesPerSample == 4) {
+                    if (regularLoad)
+                        v = IntV(*Pointer<IntV>(p, (unaligned ? 1:lanes)*sizeof(uint32_t)));
+                    else
+                        v = IntV(Gather(Pointer<Int>(p), offsets, IntV(~0), sizeof(uint32_t)));
+                }
+                if (!state.interior)
+                    v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
+                if (ctx.forceFloat())
+                    OUT(FloatV(v));
+                else
+                    OUT(v);
+            } else if (format.sampleType == stFloat) {
+                FloatV v;
+                if (format.bytesPerSample == 2) {
+                    UShortV vi;
+                    if (regularLoad)
+                        vi = *Pointer<UShortV>(p, (unaligned ? 1:lanes)*sizeof(uint16_t));
+                    else
+                        vi = Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t));
+                    v = FP16To32(vi);
+                } else if (format.bytesPerSample == 4) {
+                    if (regularLoad)
+                        v = *Pointer<FloatV>(p, (unaligned ? 1:lanes)*sizeof(float));
+                    else
+                        v = Gather(Pointer<Float>(p), offsets, IntV(~0), sizeof(float));
+                }
+                if (!state.interior)
+                    v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
+                OUT(v);
+            }
+            break;
+        }
+        case ExprOpType::CONSTANTI:
+            OUT((int)op.imm.i);
+            break;
+        case ExprOpType::CONSTANTF:
+            if (op.imm.f == (float)(int)op.imm.f)
+                OUT((int)op.imm.f);
+            else
+                OUT(op.imm.f);
+            break;
+        case ExprOpType::CONST_LOAD: {
+            switch (static_cast<LoadConstType>(op.imm.i)) {
+            case LoadConstType::N:
+                OUT(state.n);
+                break;
+            case LoadConstType::Y:
+                OUT(IntV(state.y));
+                break;
+            case LoadConstType::X:
+                OUT(state.xvec + IntV(state.x));
+                break;
+            case LoadConstType::Width:
+                OUT(IntV(state.width));
+                break;
+            case LoadConstType::Height:
+                OUT(IntV(state.height));
+                break;
+            default:
+                OUT(state.props[op.imm.i - static_cast<int>(LoadConstType::LAST)]);
+            }
+            break;
+        }
+
+#define LOAD1(x) \
+            Value x = stack.back(); stack.pop_back()
+#define LOAD2(l, r) \
+            LOAD1(r); \
+            LOAD1(l)
+#define BINARYOP(op, forceFloat) { \
+            LOAD2(l, r); \
+            if (l.isFloat() && r.isFloat()) \
+                OUT(op(l.f(), r.f())); \
+            else if (l.isFloat()) \
+                OUT(op(l.f(), FloatV(r.i()))); \
+            else if (r.isFloat()) \
+                OUT(op(FloatV(l.i()), r.f())); \
+            else if (forceFloat) \
+                OUT(op(FloatV(l.i()), FloatV(r.i()))); \
+            else \
+                OUT(op(l.i(), r.i())); \
+            break; \
+        }
+#define BINARYOPF(op) { \
+            LOAD2(l, r); \
+            OUT(op(l.ensureFloat(), r.ensureFloat())); \
+            break; \
+        }
+#define UNARYOP(op, forceFloat) { \
+            LOAD1(x); \
+            if (x.isFloat()) \
+                OUT(op(x.f())); \
+            else if (forceFloat) \
+                OUT(op(FloatV(x.i()))); \
+            else \
+                OUT(op(x.i())); \
+            break; \
+        }
+#define UNARYOPF(op) { \
+            LOAD1(x); \
+            OUT(op(x.ensureFloat())); \
+            break; \
+        }
+#define LOGICOP(op) { \
+            LOAD2(l, r); \
+            IntV li = l.isFloat() ? CmpGT(l.f(), FloatV(0.0)) : CmpGT(l.i(), IntV(0)); \
+            IntV ri = r.isFloat() ? CmpGT(r.f(), FloatV(0.0)) : CmpGT(r.i(), IntV(0)); \
+            auto x = op(li, ri); \
+            OUT(x & IntV(1)); \
+            break; \
+        }
+
+        case ExprOpType::MEM_LOAD_VAR: {
+            LOAD2(absx_, absy_);
+
+            const VSVideoFormat format = ctx.vi[op.imm.i]->format;
+            Pointer<Byte> p = state.wptrs[op.imm.i + 1];
+            Int stride = state.strides[op.imm.i + 1];
+            // Loads the pixels at the given coordinates, clamped to the plane.
+            auto load = [&](IntV absx, IntV absy) -> Value {
+                absx = Min(Max(absx, IntV(0)), IntV(state.width-1));
+                absy = Min(Max(absy, IntV(0)), IntV(state.height-1));
+                IntV offsets = absy * IntV(stride) + absx * IntV(format.bytesPerSample);
+
+                // Remaps and warps mostly read consecutive pixels of a single
+                // row, which a plain vector load handles much faster than a gather.
+                Int x0 = Extract(absx, 0), y0 = Extract(absy, 0);
+                IntV mismatch = (absy - IntV(y0)) | (absx - (IntV(x0) + state.xvec));
+                Int any = Extract(mismatch, 0);
+                for (int i = 1; i < lanes; i++)
+                    any = any | Extract(mismatch, i);
+                Bool contiguous = any == 0;
+                Pointer<Byte> row = p + y0 * stride + x0 * format.bytesPerSample;
+
+                if (format.sampleType == stInteger) {
+                    IntV v;
+                    if (format.bytesPerSample == 1) {
+                        If(contiguous) { v = IntV(*Pointer<ByteV>(row, 1)); }
+                        Else { v = IntV(Gather(Pointer<Byte>(p), offsets, IntV(~0), sizeof(uint8_t))); }
+                    } else if (format.bytesPerSample == 2) {
+                        If(contiguous) { v = IntV(*Pointer<UShortV>(row, 1)); }
+                        Else { v = IntV(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t))); }
+                    } else if (format.bytesPerSample == 4) {
+                        If(contiguous) { v = *Pointer<IntV>(row, 1); }
+                        Else { v = IntV(Gather(Pointer<Int>(p), offsets, IntV(~0), sizeof(uint32_t))); }
+                    }
+                    return v;
+                }
+                FloatV v;
+                if (format.bytesPerSample == 2) {
+                    UShortV vi;
+                    If(contiguous) { vi = *Pointer<UShortV>(row, 1); }
+                    Else { vi = Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t)); }
+                    v = FP16To32(vi);
+                } else if (format.bytesPerSample == 4) {
+                    If(contiguous) { v = *Pointer<FloatV>(row, 1); }
+                    Else { v = Gather(Pointer<Float>(p), offsets, IntV(~0), sizeof(float)); }
+                }
+                return v;
+            };
+
+            if (op.x) { // bilinear interpolation between the four surrounding pixels
+                FloatV fx = absx_.ensureFloat(), fy = absy_.ensureFloat();
+                FloatV x0 = Floor(fx), y0 = Floor(fy);
+                FloatV wx = fx - x0, wy = fy - y0;
+                IntV ix = RoundInt(x0), iy = RoundInt(y0);
+                FloatV p00 = load(ix, iy).ensureFloat(), p01 = load(ix + IntV(1), iy).ensureFloat();
+                FloatV p10 = load(ix, iy + IntV(1)).ensureFloat(), p11 = load(ix + IntV(1), iy + IntV(1)).ensureFloat();
+                FloatV top = p00 + (p01 - p00) * wx;
+                FloatV bottom = p10 + (p11 - p10) * wx;
+                OUT(top + (bottom - top) * wy);
+                break;
+            }
+            Value v = load(absx_.ensureInt(), absy_.ensureInt());
+            if (ctx.forceFloat())
+                OUT(v.ensureFloat());
+            else
+                OUT(v);
+            break;
+        }
+
+        case ExprOpType::VAR_LOAD:
+            OUT(state.variables[op.imm.i]);
+            break;
+        case ExprOpType::VAR_STORE: {
+            LOAD1(x);
+            state.variables[op.imm.i] = x;
+            break;
+        }
+
+        case ExprOpType::ADD: BINARYOP(operator +, false);
+        case ExprOpType::SUB: BINARYOP(operator -, false);
+        case ExprOpType::MUL: BINARYOP(operator *, false);
+        case ExprOpType::DIV: BINARYOP(operator /, true);
+        case ExprOpType::MOD: BINARYOP(operator %, true);
+        case ExprOpType::SQRT: UNARYOPF([](RValue<FloatV> x) -> FloatV { return Sqrt(Max(x, FloatV(0.0))); });
+        case ExprOpType::ABS: UNARYOP(Abs, ctx.forceFloat());
+        case ExprOpType::MAX: BINARYOP(Max, ctx.forceFloat());
+        case ExprOpType::MIN: BINARYOP(Min, ctx.forceFloat());
+        case ExprOpType::CLAMP: {
+            LOAD2(min, max);
+            LOAD1(x);
+            if (x.isFloat() || min.isFloat() || max.isFloat() || ctx.forceFloat()) {
+                FloatV xf = x.ensureFloat();
+                FloatV minf = min.ensureFloat();
+                FloatV maxf = max.ensureFloat();
+                OUT(Max(Min(xf, maxf), minf));
+            } else
+                OUT(Max(Min(x.i(), max.i()), min.i()));
+            break;
+        }
+#define CMP(l, r) \
+            switch (static_cast<ComparisonType>(op.imm.u)) { \
+            case ComparisonType::EQ:  x = CmpEQ(l, r);  break; \
+            case ComparisonType::LT:  x = CmpLT(l, r);  break; \
+            case ComparisonType::LE:  x = CmpLE(l, r);  break; \
+            case ComparisonType::NEQ: x = CmpNEQ(l, r); break; \
+            case ComparisonType::NLT: x = CmpNLT(l, r); break; \
+            case ComparisonType::NLE: x = CmpNLE(l, r); break; \
+            }
+        case ExprOpType::CMP: {
+            LOAD2(l, r);
+            IntV x;
+            if (l.isFloat() || r.isFloat()) {
+                FloatV lf = l.ensureFloat();
+                FloatV rf = r.ensureFloat();
+                CMP(lf, rf);
+            } else {
+                CMP(l.i(), r.i());
+            }
+            OUT(x & IntV(1));
+            break;
+        }
+#undef CMP
+
+        case ExprOpType::AND: LOGICOP(operator &);
+        case ExprOpType::OR: LOGICOP(operator |);
+        case ExprOpType::XOR: LOGICOP(operator ^);
+        case ExprOpType::NOT: {
+            LOAD1(x);
+            IntV xi = x.isFloat() ? CmpLE(x.f(), FloatV(0.0f)) : CmpLE(x.i(), IntV(0));
+            OUT(xi & IntV(1));
+            break;
+        }
 
-        std::vector<Value> variables;
+#define BITWISEOP(op) { \
+            LOAD2(l, r); \
+            IntV li = l.ensureInt(); \
+            IntV ri = r.ensureInt(); \
+            auto x = op(li, ri); \
+            OUT(x); \
+            break; \
+        }
+        case ExprOpType::BITAND: BITWISEOP(operator &);
+        case ExprOpType::BITOR: BITWISEOP(operator |);
+        case ExprOpType::BITXOR: BITWISEOP(operator ^);
+        case ExprOpType::BITNOT: {
+            LOAD1(x);
+            IntV xi = x.ensureInt();
+            OUT(~xi);
+            break;
+        }
+
+        case ExprOpType::TRUNC: UNARYOPF(Trunc);
+        case ExprOpType::ROUND: UNARYOPF(Round);
+        case ExprOpType::FLOOR: UNARYOPF(Floor);
+
+        case ExprOpType::EXP: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Exp->Call(x); });
+        case ExprOpType::LOG: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Log->Call(x); });
+        case ExprOpType::POW: {
+            LOAD2(l, r);
+            if (!r.isFloat()) {
+                OUT(IfThenElse(RValue<IntV>(r.i()).IsConstant(),
+                        BuiltinPow(l.ensureFloat(), FloatV(r.i())),
+                        helpers.Pow->Call(l.ensureFloat(), r.ensureFloat())));
+            } else {
+                OUT(helpers.Pow->Call(l.ensureFloat(), r.ensureFloat()));
+            }
+            break;
+        }
+        case ExprOpType::SIN: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Sin->Call(x); });
+        case ExprOpType::COS: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Cos->Call(x); });
+
+        case ExprOpType::TERNARY: {
+            LOAD2(t, f);
+            LOAD1(c);
+            auto ci = c.isFloat() ? CmpGT(c.f(), FloatV(0.0f)) : CmpGT(c.i(), IntV(0));
+            if (t.isFloat() || f.isFloat()) {
+                FloatV tf = t.ensureFloat();
+                FloatV ff = f.ensureFloat();
+                OUT(As<FloatV>((As<IntV>(tf) & ci) | (As<IntV>(ff) & ~ci)));
+            } else
+                OUT((t.i() & ci) | (f.i() & ~ci));
+            break;
+        }
+#undef BITWISEOP
+#undef LOGICOP
+#undef UNARYOPF
+#undef UNARYOP
+#undef BINARYOPF
+#undef BINARYOP
+#undef OUT
+#undef LOAD2
+#undef LOAD1
+
+        // Unsupported operators, shouldn't happen
+        case ExprOpType::ARGMIN:
+        case ExprOpType::ARGMAX:
+        case ExprOpType::ARGSORT:
+            assert(0 && "shouldn't happen");
+            break;
+        } // switch
+    }
+}
+
+// Converts res to the output format and stores it to the given output clip,
+// or folds it into the reduction.
+template<int lanes>
+void Compiler<lanes>::storeResult(State &state, Value res, int output)
+{
+    using namespace rr;
+    if (ctx.reduce != ReduceMode::None) {
+        FloatV v = res.ensureFloat();
+        if (state.tail) { // lanes past the end of the row must not contribute
+            IntV inside = tailMask(state);
+            v = As<FloatV>((As<IntV>(v) & inside) | (As<IntV>(FloatV(reduceIdentity())) & ~inside));
+        }
+        state.acc = reduceCombine<FloatV>(state.acc, v);
+        return;
+    }
+
+    auto format = ctx.vo->format;
+    auto store = [&](auto v) {
+        using V = decltype(v);
+        storeOutput<V>(state, v, output);
+    };
+    if (format.sampleType == stInteger) {
+        IntV rounded;
+        const int64_t maxval = (1ll << format.bitsPerSample) - 1;
+        if (res.isFloat() && format.bitsPerSample <= 24) {
+            FloatV clamped = Min(Max(res.f(), FloatV(0)), FloatV((float)maxval));
+            rounded = RoundInt(clamped);
+        } else if (res.isFloat()) {
+            // maxval is not a float here and would round up to 2^bits, so
+            // values from there on saturate in integer space, and the rest are
+            // clamped to the largest float below it.
+            const float top = std::ldexp(1.0f, format.bitsPerSample);
+            FloatV clamped = Min(Max(res.f(), FloatV(0)), FloatV(std::nextafter(top, 0.0f)));
+            if (format.bitsPerSample == 32) {
+                // Converted as signed, with the samples from 2^31 on offset by it.
+                IntV high = CmpGE(clamped, FloatV(2147483648.0f));
+                rounded = RoundInt(clamped - As<FloatV>(high & As<IntV>(FloatV(2147483648.0f)))) + (high & IntV(INT32_MIN));
+            } else
+                rounded = RoundInt(clamped);
+            IntV saturated = CmpGE(res.f(), FloatV(top));
+            rounded = (rounded & ~saturated) | (IntV((int)(uint32_t)maxval) & saturated);
+        } else if (format.bitsPerSample < 32)
+            rounded = Min(Max(res.i(), IntV(0)), IntV((int)maxval));
+        else
+            rounded = res.i();
+        if (format.bytesPerSample == 1)
+            store(ByteV(UShortV(rounded)));
+        else if (format.bytesPerSample == 2)
+            store(UShortV(rounded));
+        else if (format.bytesPerSample == 4)
+            store(rounded);
+    } else if (format.sampleType == stFloat) {
+        if (format.bytesPerSample == 2)
+            store(UShortV(FP32To16(res.ensureFloat())));
+        else if (format.bytesPerSample == 4)
+            store(res.ensureFloat());
+    }
+}
+
+template<int lanes>
+typename Compiler<lanes>::Helper Compiler<lanes>::buildHelpers(rr::Module &mod)
+{
+    Helper h;
+    using ftype = typename Compiler<lanes>::Helper::ftype;
+    using ftype2 = typename Compiler<lanes>::Helper::ftype2;
+    h.Sin = std::make_unique<ftype>(mod, "vsin");
+    h.Sin->setPure();
+    {
+        FloatV x = h.Sin->template Arg<0>();
+        Return(SinCos_(x, true));
+    }
+    h.Cos = std::make_unique<ftype>(mod, "vcos");
+    h.Cos->setPure();
+    {
+        FloatV x = h.Sin->template Arg<0>();
+        Return(SinCos_(x, false));
+    }
+    h.Exp = std::make_unique<ftype>(mod, "vexp");
+    h.Exp->setPure();
+    {
+        FloatV x = h.Sin->template Arg<0>();
+        Return(Exp_(x));
+    }
+    h.Log = std::make_unique<ftype>(mod, "vlog");
+    h.Log->setPure();
+    {
+        FloatV x = h.Sin->template Arg<0>();
+        Return(Log_(x));
+    }
+    h.Pow = std::make_unique<ftype2>(mod, "vpow");
+    h.Pow->setPure();
+    {
+        FloatV x = h.Pow->template Arg<0>();
+        FloatV y = h.Pow->template Arg<1>();
+        if (preciseMath()) {
+            // exp(t + dt) with t + dt = log(x) * y carried in two floats, as
+            // the rounding error of t is otherwise amplified by |t|.
+            FloatV lo;
+            FloatV hi = Log_(x, std::addressof(lo));
+            FloatV t = hi * y;
+            FloatV dt = FMA(hi, y, -t) + lo * y;
+            FloatV r = h.Exp->Call(t);
+            Return(FMA(r, dt, r));
+        } else
+            Return(h.Exp->Call(h.Log->Call(x) * y));
+    }
+
+    return h;
+}
+
+template<int lanes>
+void Compiler<lanes>::prepare(PropMap &paMap)
+{
+    for (size_t i = 0; i < ctx.ops.size(); i++) {
+        const std::string &tok = ctx.tokens[i];
+        ExprOp &op = ctx.ops[i];
+
+        constexpr int last = static_cast<int>(LoadConstType::LAST);
+        if (op.type != ExprOpType::CONST_LOAD || op.imm.i < last) continue;
+
+        int id = op.imm.i - last;
+        if (id >= ctx.numInputs)
+            throw std::runtime_error("reference to undefined clip: " + tok);
+
+        auto key = std::make_pair(id, op.name);
+        auto it = paMap.find(key);
+        if (it == paMap.end())
+            paMap.insert({key, (int)paMap.size()});
+        op.imm.i = last + paMap.at(key);
+    }
+    numProps = (int)paMap.size();
+
+    std::map<std::string, int> varMap;
+    for (size_t i = 0; i < ctx.ops.size(); i++) {
+        const std::string &tok = ctx.tokens[i];
+        ExprOp &op = ctx.ops[i];
+
+        if (op.type != ExprOpType::VAR_LOAD && op.type != ExprOpType::VAR_STORE) continue;
+        auto it = varMap.find(op.name);
+        if (it == varMap.end()) {
+            if (op.type == ExprOpType::VAR_LOAD)
+                throw std::runtime_error("reference to uninitialized variable: " + tok);
+            varMap.insert({ op.name, (int)varMap.size() });
+        }
+        op.imm.i = varMap.at(op.name);
+    }
+    numVariables = (int)varMap.size();
+
+    if (!(ctx.optMask & Context::flagNoBranch) && !ctx.halfArith)
+        findBranches();
+}
+
+// Finds the ternaries worth branching around: those with an expensive operand
+// whose ops only touch the values they push themselves, and keep the
+// variables they store to to themselves, so that they can be skipped.
+template<int lanes>
+void Compiler<lanes>::findBranches()
+{
+    const auto &ops = ctx.ops;
+    // The stack depth before each op, and how far below the top it reaches.
+    std::vector<int> depth(ops.size() + 1), reach(ops.size());
+    int d = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+        const ExprOp &op = ops[i];
+        if (op.type > ExprOpType::LAST)
+            return;
+        int pops, pushes = 1;
+        switch (op.type) {
+        case ExprOpType::DUP: reach[i] = op.imm.u + 1; pops = 0; break;
+        case ExprOpType::SWAP: reach[i] = op.imm.u + 1; pops = pushes = 0; break;
+        case ExprOpType::DROP: reach[i] = pops = op.imm.u; pushes = 0; break;
+        case ExprOpType::SORT: reach[i] = op.imm.u; pops = pushes = 0; break;
+        case ExprOpType::VAR_STORE: reach[i] = pops = 1; pushes = 0; break;
+        default: reach[i] = pops = numOperands[static_cast<size_t>(op.type)]; break;
+        }
+        depth[i] = d;
+        if (d < reach[i])
+            return; // malformed, reported by buildOneIter
+        d += pushes - pops;
+    }
+    depth[ops.size()] = d;
+
+    auto selfContained = [&](size_t begin, size_t end) {
+        const int base = depth[begin];
+        if (depth[end] != base + 1)
+            return false;
+        for (size_t i = begin; i < end; i++) {
+            if (depth[i] - reach[i] < base)
+                return false;
+            if (ops[i].type != ExprOpType::VAR_STORE)
+                continue;
+            for (size_t j = end; j < ops.size(); j++)
+                if ((ops[j].type == ExprOpType::VAR_LOAD || ops[j].type == ExprOpType::VAR_STORE) && ops[j].imm.i == ops[i].imm.i)
+                    return false;
+        }
+        return true;
+    };
+    // The last op before end at which the stack held depth values.
+    auto start = [&](size_t end, int depthBefore) -> size_t {
+        for (size_t i = end; i-- > 0; )
+            if (depth[i] == depthBefore)
+                return i;
+        return SIZE_MAX;
+    };
+
+    for (size_t k = 0; k < ops.size(); k++) {
+        if (ops[k].type != ExprOpType::TERNARY)
+            continue;
+        const size_t f = start(k, depth[k] - 1);
+        const size_t t = f == SIZE_MAX ? SIZE_MAX : start(f, depth[k] - 2);
+        if (t == SIZE_MAX || !selfContained(t, f) || !selfContained(f, k))
+            continue;
+        const int cost = std::max(estimateCost({ ops.begin() + t, ops.begin() + f }), estimateCost({ ops.begin() + f, ops.begin() + k }));
+        if (cost >= BRANCH_MIN_COST)
+            branches.emplace(t, Branch{ f, k });
+    }
+}
+
+template<int lanes>
+std::vector<Compiled::PropAccess> Compiler<lanes>::propAccess(const PropMap &paMap)
+{
+    std::vector<Compiled::PropAccess> pa(paMap.size());
+    for (const auto &item: paMap) {
+        pa[item.second] = Compiled::PropAccess{ item.first.first, item.first.second };
+    }
+    return pa;
+}
+
+template<int lanes>
+void Compiler<lanes>::bindState(State &state, pointer rwptrs, rr::Pointer<rr::Int> strides, int group)
+{
+    using namespace rr;
+    for (int i = 0; i < numVariables; i++)
+        state.variables.push_back(Value(IntV(0)));
+
+    for (int i = 0; i < lanes; i++)
+        state.xvec = Insert(state.xvec, i, i);
+
+    state.n = IntV(Pointer<Int>(state.consts)[static_cast<int>(LoadConstIndex::N)]);
+    state.props.reserve(numProps);
+    for (int i = 0; i < numProps; i++)
+        state.props.emplace_back(state.consts[static_cast<int>(LoadConstIndex::LAST) + i]);
+
+    int base = group * (ctx.numInputs + 1);
+    for (int i = 0; i < ctx.numInputs + ctx.outputs; i++) {
+        state.wptrs.push_back(*Pointer<Pointer<Byte>>(rwptrs + sizeof(void *) * (base + i)));
+        state.strides.push_back(Int(strides[base + i]));
+    }
+}
+
+// Emits the row/column loops over [ystart, yend). If blockWidth is non-zero,
+// the plane is walked in column blocks of that many pixels, so that all rows
+// touched by vertical relative accesses stay cache resident while a block is
+// processed top to bottom.
+//
+// Pixels at least m away from every edge are emitted with body(true, n),
+// which may load neighbours without any boundary handling; the remaining
+// border pixels use body(false, n). n is the number of consecutive vectors
+// (starting at state.x) the body must process: full steps of unroll vectors
+// are used where possible, and single vectors for the remainder of a row.
+// A final partial vector is emitted with state.tail set.
+// rowEnd, if given, is emitted after each row (of each column block).
+template<int lanes>
+void Compiler<lanes>::buildLoops(State &state, rr::Int ystart, rr::Int yend, int unroll, int blockWidth, const Margins &m, const std::function<void(bool, int)> &body, const std::function<void()> &rowEnd)
+{
+    using namespace rr;
+    const int step = lanes * unroll;
+    auto &y = state.y, &x = state.x;
+
+    auto columns = [&](RValue<Int> xbegin, RValue<Int> xend_, bool interiorRow) {
+        Int xend = xend_;
+        x = xbegin;
+        if (!interiorRow) {
+            if (unroll > 1) {
+                For((void)0, x + step <= xend, x += step)
+                    body(false, unroll);
+            }
+        } else {
+            // The first interior vector starts at a multiple of step, so that the
+            // remaining vectors keep the same alignment as in the plain loop.
+            Int xlo = Min(Int((m.left + step - 1) / step * step), xend);
+            For((void)0, x + lanes <= xlo, x += lanes)
+                body(false, 1);
+            For((void)0, x + step <= xend && x + (step + m.right) <= state.width, x += step)
+                body(true, unroll);
+        }
+        For((void)0, x + lanes <= xend, x += lanes)
+            body(false, 1);
+        If(x < xend) {
+            state.tail = true;
+            body(false, 1);
+            state.tail = false;
+        }
     };
 
-    Helper buildHelpers(rr::Module &mod);
-    void buildOneIter(const Helper &helpers, State &state);
+    auto rows = [&](RValue<Int> xbegin, RValue<Int> xend) {
+        Int xb = xbegin, xe = xend;
+        For(y = ystart, y < yend, y++)
+        {
+            if (!m.any()) {
+                columns(xb, xe, false);
+            } else {
+                If(y >= m.top && y < state.height - m.bottom) {
+                    columns(xb, xe, true);
+                } Else {
+                    columns(xb, xe, false);
+                }
+            }
+            if (rowEnd)
+                rowEnd();
+        }
+    };
 
-public:
-    Compiler(
-        const std::string &expr,
-        const VSVideoInfo *vo, 
-        const VSVideoInfo * const *vi, 
-        const VSAPI *vsapi,
-        int numInputs, 
-        int opt = 0, 
-        int mirror = 0
-    ) : ctx(expr, vo, vi, vsapi, numInputs, opt, mirror) {}
+    if (blockWidth == 0) {
+        rows(Int(0), state.width);
+        return;
+    }
 
-    Compiled compile();
-};
+    Int x0;
+    For(x0 = 0, x0 < state.width, x0 += blockWidth)
+    {
+        rows(x0, Min(x0 + blockWidth, state.width));
+    }
+}
 
 template<int lanes>
-rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Exp_(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+float Compiler<lanes>::reduceIdentity() const
 {
-    FloatV x = x_;
-    using namespace rr;
-    const float exp_hi = 88.3762626647949f, exp_lo = -88.3762626647949f, log2e  = 1.44269504088896341f,
-          exp_c1 = 0.693359375f, exp_c2 = -2.12194440e-4f, exp_p0 = 1.9875691500E-4f, exp_p1 = 1.3981999507E-3f,
-          exp_p2 = 8.3334519073E-3f, exp_p3 = 4.1665795894E-2f, exp_p4 = 1.6666665459E-1f, exp_p5 = 5.0000001201E-1f;
-    x = Min(x, FloatV(exp_hi));
-    x = Max(x, FloatV(exp_lo));
-    FloatV fx = FloatV(log2e);
-    fx = FMA(fx, x, FloatV(0.5f));
-    IntV emm0 = RoundInt(fx);
-    FloatV etmp = FloatV(emm0);
-    FloatV mask = As<FloatV>(As<IntV>(FloatV(1.0f)) & CmpGT(etmp, fx));
-    fx = etmp - mask;
-    x = FMA(fx, FloatV(-exp_c1), x);
-    x = FMA(fx, FloatV(-exp_c2), x);
-    FloatV z = x * x;
-    FloatV y = FloatV(exp_p0);
-    y = FMA(y, x, FloatV(exp_p1));
-    y = FMA(y, x, FloatV(exp_p2));
-    y = FMA(y, x, FloatV(exp_p3));
-    y = FMA(y, x, FloatV(exp_p4));
-    y = FMA(y, x, FloatV(exp_p5));
-    y = FMA(y, z, x);
-    y = y + FloatV(1.0f);
-    emm0 = RoundInt(fx);
-    emm0 = emm0 + IntV(0x7f);
-    emm0 = emm0 << 23;
-    x = y * As<FloatV>(emm0);
-    return x;
+    switch (ctx.reduce) {
+    case ReduceMode::Min: return std::numeric_limits<float>::infinity();
+    case ReduceMode::Max: return -std::numeric_limits<float>::infinity();
+    default: return 0.0f;
+    }
 }
 
 template<int lanes>
-rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::Log_(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+template<typename T>
+rr::RValue<T> Compiler<lanes>::reduceCombine(rr::RValue<T> a, rr::RValue<T> b) const
 {
-    FloatV x = x_;
-    using namespace rr;
-    const uint32_t min_norm_pos = 0x00800000, inv_mant_mask = ~0x7F800000;
-    const float float_half = 0.5f, sqrt_1_2 = 0.707106781186547524f, log_p0 = 7.0376836292E-2f, log_p1 = -1.1514610310E-1f,
-          log_p2 = 1.1676998740E-1f, log_p3 = -1.2420140846E-1f, log_p4 = +1.4249322787E-1f, log_p5 = -1.6668057665E-1f,
-          log_p6 = +2.0000714765E-1f, log_p7 = -2.4999993993E-1f, log_p8 = +3.3333331174E-1f, log_q2 = 0.693359375f,
-          log_q1 = -2.12194440e-4f;
-    const float zero = 0.0f, one = 1.0f;
-    IntV invalid_mask = CmpLE(x, FloatV(zero));
-    x = Max(x, As<FloatV>(IntV(min_norm_pos)));
-    IntV emm0i = As<IntV>(x) >> 23;
-    x = As<FloatV>(As<IntV>(x) & IntV(inv_mant_mask));
-    x = As<FloatV>(As<IntV>(x) | As<IntV>(FloatV(float_half)));
-    emm0i = emm0i - IntV(0x7f);
-    FloatV emm0 = FloatV(emm0i);
-    emm0 = emm0 + FloatV(one);
-    IntV mask = CmpLT(x, FloatV(sqrt_1_2));
-    FloatV etmp = As<FloatV>(mask & As<IntV>(x));
-    x = x - FloatV(one);
-    FloatV maskf = As<FloatV>(mask & As<IntV>(FloatV(one)));
-    emm0 = emm0 - maskf;
-    x = x + etmp;
-    FloatV z = x * x;
-    FloatV y = FloatV(log_p0);
-    y = FMA(y, x, FloatV(log_p1));
-    y = FMA(y, x, FloatV(log_p2));
-    y = FMA(y, x, FloatV(log_p3));
-    y = FMA(y, x, FloatV(log_p4));
-    y = FMA(y, x, FloatV(log_p5));
-    y = FMA(y, x, FloatV(log_p6));
-    y = FMA(y, x, FloatV(log_p7));
-    y = FMA(y, x, FloatV(log_p8));
-    y = y * x;
-    y = y * z;
-    y = FMA(emm0, FloatV(log_q1), y);
-    y = FMA(z, FloatV(-float_half), y);
-    x = x + y;
-    x = FMA(emm0, FloatV(log_q2), x);
-    x = As<FloatV>(invalid_mask | As<IntV>(x));
-    return x;
+    switch (ctx.reduce) {
+    case ReduceMode::Min: return rr::Min(a, b);
+    case ReduceMode::Max: return rr::Max(a, b);
+    default: return a + b;
+    }
 }
 
+// Folds the lanes of the row accumulator into the row's destination entry
+// and resets the accumulator for the next row.
 template<int lanes>
-rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::SinCos_(rr::RValue<typename Compiler<lanes>::FloatV> x_, bool issin)
+void Compiler<lanes>::buildRowReduce(State &state)
 {
-    FloatV x = x_;
     using namespace rr;
-    auto conv = [](uint32_t x) -> FloatV { return As<FloatV>(IntV(x)); };
-    IntV absmask = IntV(0x7FFFFFFF);
-    FloatV float_invpi = conv(0x3ea2f983),
-           float_rintf = conv(0x4b400000),
-           float_pi1 = conv(0x40490000),
-           float_pi2 = conv(0x3a7da000),
-           float_pi3 = conv(0x34222000),
-           float_pi4 = conv(0x2cb4611a),
-           float_sinC3 = conv(0xbe2aaaa6),
-           float_sinC5 = conv(0x3c08876a),
-           float_sinC7 = conv(0xb94fb7ff),
-           float_sinC9 = conv(0x362edef8),
-           float_cosC2 = conv(0xBEFFFFE2),
-           float_cosC4 = conv(0x3D2AA73C),
-           float_cosC6 = conv(0XBAB58D50),
-           float_cosC8 = conv(0x37C1AD76);
-    IntV sign;
-    if (issin)
-        sign = As<IntV>(x) & ~absmask;
-    else
-        sign = IntV(0);
-    FloatV t1 = Abs(x);
-    // Range reduction
-    FloatV t2 = t1 * float_invpi;
-    IntV t2i = RoundInt(t2);
-    IntV t4 = t2i << 31;
-    sign = sign ^ t4;
-    t2 = FloatV(t2i);
-
-    t1 = FMA(t2, -float_pi1, t1);
-    t1 = FMA(t2, -float_pi2, t1);
-    t1 = FMA(t2, -float_pi3, t1);
-    t1 = FMA(t2, -float_pi4, t1);
+    Float r = Extract(state.acc, 0);
+    for (int i = 1; i < lanes; i++)
+        r = reduceCombine<Float>(r, Extract(state.acc, i));
+    Pointer<Float> rows = Pointer<Float>(state.wptrs[0]);
+    rows[state.y] = reduceCombine<Float>(rows[state.y], r);
+    state.acc = FloatV(reduceIdentity());
+}
 
-    if (issin) {
-        // minimax polynomial for sin(x) in [-pi/2, pi/2] interval.
-        // compute X + X * X^2 * (C3 + X^2 * (C5 + X^2 * (C7 + X^2 * C9)))
-        t2 = t1 * t1;
-        FloatV t3 = FMA(t2, float_sinC9, float_sinC7);
-        t3 = FMA(t3, t2, float_sinC5);
-        t3 = FMA(t3, t2, float_sinC3);
-        t3 = t3 * t2;
-        t3 = t3 * t1;
-        t1 = t1 + t3;
-    } else {
-        // minimax polynomial for cos(x) in [-pi/2, pi/2] interval.
-        // compute 1 + X^2 * (C2 + X^2 * (C4 + X^2 * (C6 + X^2 * C8)))
-        t1 = t1 * t1;
-        FloatV t2 = FMA(t1, float_cosC8, float_cosC6);
-        t2 = FMA(t2, t1, float_cosC4);
-        t2 = FMA(t2, t1, float_cosC2);
-        t1 = FMA(t2, t1, FloatV(1.0f));
+// Returns how far (in pixels) the given expressions reach beyond the current
+// pixel in each direction through static relative accesses.
+template<int lanes>
+typename Compiler<lanes>::Margins Compiler<lanes>::relativeMargins(const std::vector<Compiler *> &comps)
+{
+    Margins m;
+    for (const Compiler *c: comps) {
+        for (const auto &op: c->ctx.ops) {
+            if (op.type != ExprOpType::MEM_LOAD)
+                continue;
+            m.left = std::max(m.left, -op.x);
+            m.right = std::max(m.right, op.x);
+            m.top = std::max(m.top, -op.y);
+            m.bottom = std::max(m.bottom, op.y);
+        }
     }
-    // Apply sign.
-    return As<FloatV>(sign ^ As<IntV>(t1));
+    return m;
 }
 
+// Returns the column block width for the given expressions, or 0 if none of
+// them reads pixels from other rows (in which case rows are streamed whole).
 template<int lanes>
-rr::RValue<typename Compiler<lanes>::FloatV> Compiler<lanes>::FP16To32(rr::RValue<typename Compiler<lanes>::UShortV> x_)
+int Compiler<lanes>::columnBlockWidth(const std::vector<Compiler *> &comps, int unroll)
 {
-    bool ok;
-    FloatV r = rr::TryFP16To32(x_, ok);
-    if (ok) return r;
+    size_t columnBytes = 0;
+    bool vertical = false;
+    for (const Compiler *c: comps) {
+        std::map<int, std::pair<int, int>> window; // clip -> [min y, max y]
+        for (const auto &op: c->ctx.ops) {
+            if (op.type != ExprOpType::MEM_LOAD || op.imm.i >= c->ctx.numInputs)
+                continue; // invalid references are diagnosed by buildOneIter
+            auto it = window.emplace(op.imm.i, std::make_pair(op.y, op.y)).first;
+            it->second.first = std::min(it->second.first, op.y);
+            it->second.second = std::max(it->second.second, op.y);
+            vertical = vertical || op.y != 0;
+        }
+        for (const auto &w: window)
+            columnBytes += (size_t)(w.second.second - w.second.first + 1) * c->ctx.vi[w.first]->format.bytesPerSample;
+        columnBytes += c->ctx.vo->format.bytesPerSample;
+    }
+    if (!vertical)
+        return 0;
 
-    using namespace rr;
-    FloatV magic = As<FloatV>(IntV((254 - 15) << 23));
-    FloatV inf16 = As<FloatV>(IntV((127 + 16) << 23));
-    IntV ti = IntV(x_);
-    IntV sign = (ti & IntV(0x8000)) << 16;
-    ti = (ti & IntV(0x7fff)) << 13;
-    FloatV tf = As<FloatV>(ti) * magic;
-    ti = As<IntV>(tf);
-    IntV infmask = CmpGE(tf, inf16);
-    infmask = infmask & IntV(255 << 23);
-    ti = ti | infmask | sign;
-    return As<FloatV>(ti);
+    const int step = lanes * unroll;
+    int width = (int)(BLOCK_CACHE_BYTES / columnBytes) / step * step;
+    return std::max(width, step * 8);
 }
 
+// Returns how many rows ahead of the current one the input streams should be
+// prefetched, or 0 to leave it to the hardware. By default, rows are only
+// prefetched when there are more input rows than the hardware prefetchers
+// can track, and far enough ahead to cover at least PREFETCH_BYTES.
 template<int lanes>
-rr::RValue<typename Compiler<lanes>::UShortV> Compiler<lanes>::FP32To16(rr::RValue<typename Compiler<lanes>::FloatV> x_)
+int Compiler<lanes>::prefetchRows(const std::vector<Compiler *> &comps, int prefetch)
 {
-    bool ok;
-    UShortV r = rr::TryFP32To16(x_, ok);
-    if (ok) return r;
-
-    using namespace rr;
-    IntV f32infty = IntV(255 << 23);
-    FloatV f16max = As<FloatV>(IntV((127 + 16) << 23));
-    FloatV magic = As<FloatV>(IntV(15 << 23));
-    IntV expinf = IntV((255 ^ 31) << 23);
-    IntV ti = As<IntV>(x_);
-    IntV signmask = IntV(0x80000000);
-    IntV sign = ti & signmask;
-    ti = ti ^ sign;
-    sign = sign >> 16;
-    IntV nanmask = CmpEQ(ti & f32infty, f32infty);
-    IntV ifnan = ti ^ expinf;
-    IntV normal = As<IntV>(Min(As<FloatV>(ti), f16max) * magic);
-    ti = (nanmask & ifnan) | (~nanmask & normal);
-    return UShortV((ti >> 13) | sign);
+    if (prefetch >= 0)
+        return prefetch;
+
+    std::set<std::tuple<const Compiler *, int, int>> streams;
+    size_t rowBytes = 0;
+    for (const auto *c: comps) {
+        for (const auto &op: c->ctx.ops) {
+            if (op.type != ExprOpType::MEM_LOAD || op.imm.i >= c->ctx.numInputs)
+                continue;
+            streams.insert({ c, op.imm.i, op.y });
+            rowBytes = std::max(rowBytes, (size_t)c->ctx.vo->width * c->ctx.vi[op.imm.i]->format.bytesPerSample);
+        }
+    }
+    if (streams.size() < PREFETCH_MIN_STREAMS || rowBytes == 0)
+        return 0;
+    return (int)((PREFETCH_BYTES + rowBytes - 1) / rowBytes);
 }
 
-template<int lanes, typename VType>
-static VType relativeAccessAdjust(rr::Int &x, rr::Int &alignedx, rr::Int &width, const ExprOp &op, VType v)
+// Prefetches the pixels at the current position rows below every input row
+// that is read, so they are cached by the time the loop reaches them.
+template<int lanes>
+void Compiler<lanes>::buildPrefetch(State &state, int rows)
 {
     using namespace rr;
-    if (op.x == 0)
-        return v;
-    else if (op.bc == BoundaryCondition::Mirrored)
-        return v;
-    else if (op.bc == BoundaryCondition::Clamped) {
-        BasicBlock *contBb = Nucleus::createBasicBlock();
-        if (op.x < 0) {
-            int absx = std::abs(op.x);
-            SwitchCases *switchCases = Nucleus::createSwitch(alignedx.loadValue(), contBb, (absx + lanes - 1) / lanes);
-            for (int i = 0; i < absx; i += lanes) {
-                BasicBlock *bb = Nucleus::createBasicBlock();
-                Nucleus::addSwitchCase(switchCases, i, bb);
-                Nucleus::setInsertBlock(bb);
-                typename VectorTypes<lanes>::SwizzleMask select = 0;
-                for (int j = 0; j < lanes; j++) {
-                    select <<= 4;
-                    select |= std::max(i + j + op.x, 0) % lanes;
-                }
-                v = Swizzle(v, select);
-                Nucleus::createBr(contBb);
-            }
-        } else {
-            Int dist = x + lanes - width;
-            BasicBlock *switchBb = Nucleus::createBasicBlock();
-            rr::Bool cond = dist > 0;
-            Nucleus::createCondBr(cond.loadValue(), switchBb, contBb);
-            Nucleus::setInsertBlock(switchBb);
-            BasicBlock *defaultBb = Nucleus::createBasicBlock();
-            SwitchCases *switchCases = Nucleus::createSwitch(dist.loadValue(), defaultBb, lanes-2);
-            for (int i = 1; i < lanes-1; i++) {
-                BasicBlock *bb = Nucleus::createBasicBlock();
-                Nucleus::addSwitchCase(switchCases, i, bb);
-                Nucleus::setInsertBlock(bb);
-                typename VectorTypes<lanes>::SwizzleMask select = 0, last = 0;
-                for (int j = 0; j < lanes; j++) {
-                    last = select & 0xf;
-                    select <<= 4;
-                    if (j + i < lanes)
-                        select |= j;
-                    else
-                        select |= last;
-                }
-                v = Swizzle(v, select);
-                Nucleus::createBr(contBb);
-            }
-            Nucleus::setInsertBlock(defaultBb);
-            v = Swizzle(v, 0);
-            Nucleus::createBr(contBb);
-        }
-        Nucleus::setInsertBlock(contBb);
+    std::set<std::pair<int, int>> streams;
+    for (const auto &op: ctx.ops)
+        if (op.type == ExprOpType::MEM_LOAD && op.imm.i < ctx.numInputs)
+            streams.insert({ op.imm.i, op.y });
+    for (const auto &[clip, dy]: streams) {
+        Pointer<Byte> p = state.wptrs[clip + 1];
+        p += (state.y + (dy + rows)) * state.strides[clip + 1] + state.x * ctx.vi[clip]->format.bytesPerSample;
+        Prefetch(p);
     }
-    return v;
 }
 
-typedef std::vector<std::pair<int, int>> SortingNetwork;
-static const SortingNetwork &buildSortNet(int n) {
-    static std::map<int, SortingNetwork> built;
-    auto it = built.find(n);
-    if (it != built.end()) return it->second;
-
-    built.insert({ n, {} });
-    auto &sn = built.find(n)->second;
-
-    int t = 0;
-    while (n > (1<<t)) t++;
-    int p = 1 << (t - 1);
-    while (p > 0) {
-        int q = 1 << (t - 1), r = 0, d = p;
-        while (d > 0) {
-            for (int i = 0; i < n - d; i++)
-                if ((i & p) == r)
-                    sn.emplace_back(i, i+d);
-            d = q - p;
-            q >>= 1;
-            r = p;
-        }
-        p >>= 1;
+template<int lanes>
+Compiled Compiler<lanes>::compile()
+{
+    if (ctx.cached) {
+        Compiled r = ctx.getCached();
+        r.stats = { ctx.parseTime, 0, 0, r.stats.codeBytes, true };
+        return r;
     }
-    return sn;
+
+    using namespace rr;
+    Module mod(routineConfig(ctx.optMask));
+
+    PropMap paMap;
+    prepare(paMap);
+    std::vector<Compiled::PropAccess> pa = propAccess(paMap);
+
+    Helper helpers = buildHelpers(mod);
+
+    //            void *rwptrs, int strides[], float *props, int width, int height, int ystart, int yend
+    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int, Int, Int)> function(mod, "procPlane");
+
+    State state;
+    pointer rwptrs = function.Arg<0>();
+    Pointer<Int> strides = Pointer<Int>(Pointer<Byte>(function.Arg<1>()));
+    state.consts = Pointer<Float>(Pointer<Byte>(function.Arg<2>()));
+    state.width = function.Arg<3>();
+    state.height = function.Arg<4>();
+    bindState(state, rwptrs, strides, 0);
+
+    const int unroll = ctx.unroll ? ctx.unroll : autoUnroll(estimateCost(ctx.ops));
+    const int rows = prefetchRows({ this }, ctx.prefetch);
+    std::function<void()> rowEnd;
+    if (ctx.reduce != ReduceMode::None) {
+        state.acc = FloatV(reduceIdentity());
+        rowEnd = [&]() { buildRowReduce(state); };
+    }
+    buildLoops(state, function.Arg<5>(), function.Arg<6>(), unroll, columnBlockWidth({ this }, unroll), relativeMargins({ this }), [&](bool interior, int count) {
+        state.interior = interior;
+        if (rows && count == unroll)
+            buildPrefetch(state, rows);
+        Int xbase = state.x;
+        for (int k = 0; k < count; k++) {
+            state.x = xbase + k * lanes;
+            buildOneIter(helpers, state);
+        }
+        state.x = xbase;
+    }, rowEnd);
+    if (ctx.optMask & Context::flagStreamStores && ctx.reduce == ReduceMode::None)
+        Fence(std::memory_order_seq_cst); // order the streaming stores before the caller's synchronisation
+    Return();
+
+#ifdef USE_EXPR_CACHE
+    std::unique_ptr<DiskCache> disk = DiskCache::open(ctx.key());
+    Compiled r { mod.acquire("proc", rr::Config::Edit::None, disk.get()), pa, positionIndependent(ctx.ops) };
+    r.stats = routineStats(ctx.parseTime, *r.routine);
+    exprCache.insert(ctx.key(), r);
+    ctx.claim.done();
+#else
+    Compiled r { mod.acquire("proc"), pa, positionIndependent(ctx.ops) };
+    r.stats = routineStats(ctx.parseTime, *r.routine);
+#endif
+    return r;
 }
 
 template<int lanes>
-void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
-{
-    constexpr unsigned char numOperands[] = {
-        0, // MEM_LOAD
-        2, // MEM_LOAD_VAR
-        0, // CONSTANTI
-        0, // CONSTANTF
-        0, // CONST_LOAD
-        0, // VAR_LOAD
-        1, // VAR_STORE
-        2, // ADD
-        2, // SUB
-        2, // MUL
-        2, // DIV
-        2, // MOD
-        1, // SQRT
-        1, // ABS
-        2, // MAX
-        2, // MIN
-        3, // CLAMP
-        2, // CMP
-        1, // TRUNC
-        1, // ROUND
-        1, // FLOOR
-        2, // AND
-        2, // OR
-        2, // XOR
-        1, // NOT
-        2, // BITAND
-        2, // BITOR
-        2, // BITXOR
-        1, // BITNOT
-        1, // EXP
-        1, // LOG
-        2, // POW
-        1, // SIN
-        1, // COS
-        3, // TERNARY
-        0, // SORT
-        0, // DUP
-        0, // SWAP
-        0, // DROP
-    };
-    static_assert(sizeof(numOperands) == static_cast<unsigned>(ExprOpType::LAST) + 1, "invalid table");
+Compiled Compiler<lanes>::compileFused(
+    const std::vector<std::string> &exprs,
+    const VSVideoInfo *vo,
+    const VSVideoInfo * const *vi,
+    const VSAPI *vsapi,
+    int numInputs,
+    int opt,
+    int mirror,
+    int unroll,
+    int prefetch,
+    const Uniforms &uniforms
+) {
+    std::vector<std::unique_ptr<Compiler>> comps;
+    std::string key = "fused";
+    for (const auto &expr: exprs) {
+        comps.emplace_back(new Compiler(expr, vo, vi, vsapi, numInputs, opt, mirror, unroll, prefetch, uniforms, ReduceMode::None, false));
+        key += "||" + comps.back()->ctx.key();
+    }
+
+#ifdef USE_EXPR_CACHE
+    Compiled cached;
+    ExprCacheClaim claim;
+    if (exprCache.find(key, cached, &claim)) {
+        cached.stats = { 0, 0, 0, cached.stats.codeBytes, true };
+        for (auto &c: comps)
+            cached.stats.parseTime += c->ctx.parseTime;
+        return cached;
+    }
+#endif
 
     using namespace rr;
-    std::vector<Value> stack;
+    Module mod(routineConfig(comps[0]->ctx.optMask));
 
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        const ExprOp &op = ctx.ops[i];
+    // Property loads are shared by all planes.
+    PropMap paMap;
+    for (auto &c: comps)
+        c->prepare(paMap);
+    std::vector<Compiled::PropAccess> pa = propAccess(paMap);
 
-        // Check validity.
-        if (op.type == ExprOpType::MEM_LOAD && op.imm.i >= ctx.numInputs)
-            throw std::runtime_error("reference to undefined clip: " + tok);
-        if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
-            throw std::runtime_error("insufficient values on stack: " + tok);
-        if ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT) && op.imm.u > stack.size())
-            throw std::runtime_error("insufficient values on stack: " + tok);
-        if (stack.size() < numOperands[static_cast<size_t>(op.type)])
-            throw std::runtime_error("insufficient values on stack: " + tok);
+    Helper helpers = comps[0]->buildHelpers(mod);
 
-#define OUT(x) stack.push_back(x)
-        switch (op.type) {
-        case ExprOpType::DUP:
-            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
-            break;
-        case ExprOpType::SWAP: {
-            std::swap(stack[stack.size()-1], stack[stack.size() - 1 - op.imm.u]);
-            break;
-        }
-        case ExprOpType::DROP: {
-            for (unsigned i = 0; i < op.imm.u; i++)
-                stack.pop_back();
-            break;
-        }
+    //            void *rwptrs, int strides[], float *props, int width, int height, int ystart, int yend
+    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int, Int, Int)> function(mod, "procPlanes");
 
-        case ExprOpType::SORT: {
-            // "3 7 1 2 0 4 6 5 sort8" -> "7 6 5 4 3 2 1 0"
-            auto at = [&stack](int i) -> Value& { return stack.at(stack.size() - 1 - i); };
-            const auto &sn = buildSortNet(op.imm.u);
-            for (auto cmp: sn) {
-                auto &a = at(cmp.first), &b = at(cmp.second);
-                Value min = a.Min(b), max = a.Max(b);
-                a = min, b = max;
-            }
-            break;
-        }
+    pointer rwptrs = function.Arg<0>();
+    Pointer<Int> strides = Pointer<Int>(Pointer<Byte>(function.Arg<1>()));
+    std::vector<State> states(comps.size());
+    for (size_t k = 0; k < comps.size(); k++) {
+        State &state = states[k];
+        state.consts = Pointer<Float>(Pointer<Byte>(function.Arg<2>()));
+        state.width = function.Arg<3>();
+        state.height = function.Arg<4>();
+        comps[k]->bindState(state, rwptrs, strides, (int)k);
+    }
 
-        case ExprOpType::MEM_LOAD: {
-            Pointer<Byte> p = state.wptrs[op.imm.i + 1];
-            const VSVideoFormat format = ctx.vi[op.imm.i]->format;
-            const bool unaligned = op.x != 0;
-            Int y = state.y, x = state.x;
-            IntV offsets = 0;
-            if (op.bc == BoundaryCondition::Clamped) {
-                if (op.y != 0)
-                    y = Clamp(state.y + op.y, 0, state.height-1);
-                if (op.x != 0)
-                    x = Clamp(state.x + op.x, 0, state.width-1);
-            } else { // Mirrored
-                if (op.y != 0) {
-                    Int sy = state.y + Clamp(op.y, -state.height, state.height);
-                    y = IfThenElse(sy < 0, -1 - sy,
-                            IfThenElse(sy >= state.height, 2*state.height-1 - sy, sy));
-                }
-                if (op.x != 0) {
-                    Int cx = Clamp(op.x, -state.width, state.width);
-                    Int w2m1 = 2 * state.width - 1;
-                    for (int i = 0; i < lanes; i++) {
-                        Int sx = x + i + cx;
-                        Int xi = IfThenElse(sx < 0, -1 - sx,
-                                    IfThenElse(sx >= state.width, w2m1 - sx, sx));
-                        offsets = Insert(offsets, xi, i);
-                    }
-                    offsets = offsets * IntV(format.bytesPerSample);
-                    x = 0;
-                }
-            }
-            p += y * state.strides[op.imm.i + 1] + x * format.bytesPerSample;
-            const bool regularLoad = op.bc != BoundaryCondition::Mirrored || op.x == 0;
-            if (format.sampleType == stInteger) {
-                IntV v;
-                if (format.bytesPerSample == 1) {
-                    if (regularLoad)
-                        v = IntV(*Pointer<ByteV>(p, (unaligned ? 1:lanes)*sizeof(uint8_t)));
-                    else
-                        v = IntV(Gather(Pointer<Byte>(p), offsets, IntV(~0), sizeof(uint8_t)));
-                } else if (format.bytesPerSample == 2) {
-                    if (regularLoad)
-                        v = IntV(*Pointer<UShortV>(p, (unaligned ? 1:lanes)*sizeof(uint16_t)));
-                    else
-                        v = IntV(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t)));
-                } else if (format.bytesPerSample == 4) {
-                    if (regularLoad)
-                        v = IntV(*Pointer<IntV>(p, (unaligned ? 1:lanes)*sizeof(uint32_t)));
-                    else
-                        v = IntV(Gather(Pointer<Int>(p), offsets, IntV(~0), sizeof(uint32_t)));
-                }
-                v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
-                if (ctx.forceFloat())
-                    OUT(FloatV(v));
-                else
-                    OUT(v);
-            } else if (format.sampleType == stFloat) {
-                FloatV v;
-                if (format.bytesPerSample == 2) {
-                    UShortV vi;
-                    if (regularLoad)
-                        vi = *Pointer<UShortV>(p, (unaligned ? 1:lanes)*sizeof(uint16_t));
-                    else
-                        vi = Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t));
-                    v = FP16To32(vi);
-                } else if (format.bytesPerSample == 4) {
-                    if (regularLoad)
-                        v = *Pointer<FloatV>(p, (unaligned ? 1:lanes)*sizeof(float));
-                    else
-                        v = Gather(Pointer<Float>(p), offsets, IntV(~0), sizeof(float));
-                }
-                v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
-                OUT(v);
+    std::vector<Compiler *> planes;
+    int cost = 0;
+    for (auto &c: comps) {
+        planes.push_back(c.get());
+        cost += estimateCost(c->ctx.ops);
+    }
+    if (unroll == 0)
+        unroll = autoUnroll(cost);
+    const int rows = prefetchRows(planes, prefetch);
+    buildLoops(states[0], function.Arg<5>(), function.Arg<6>(), unroll, columnBlockWidth(planes, unroll), relativeMargins(planes), [&](bool interior, int count) {
+        Int xbase = states[0].x;
+        if (rows && count == unroll) {
+            for (size_t p = 0; p < comps.size(); p++) {
+                states[p].y = states[0].y;
+                states[p].x = xbase;
+                comps[p]->buildPrefetch(states[p], rows);
             }
-            break;
         }
-        case ExprOpType::CONSTANTI:
-            OUT((int)op.imm.i);
-            break;
-        case ExprOpType::CONSTANTF:
-            if (op.imm.f == (float)(int)op.imm.f)
-                OUT((int)op.imm.f);
-            else
-                OUT(op.imm.f);
-            break;
-        case ExprOpType::CONST_LOAD: {
-            switch (static_cast<LoadConstType>(op.imm.i)) {
-            case LoadConstType::N:
-                OUT(IntV(Pointer<Int>(state.consts)[static_cast<int>(LoadConstIndex::N)]));
-                break;
-            case LoadConstType::Y:
-                OUT(IntV(state.y));
-                break;
-            case LoadConstType::X:
-                OUT(state.xvec + IntV(state.x));
-                break;
-            case LoadConstType::Width:
-                OUT(IntV(state.width));
-                break;
-            case LoadConstType::Height:
-                OUT(IntV(state.height));
-                break;
-            default: {
-                constexpr int bias = static_cast<int>(LoadConstIndex::LAST) - static_cast<int>(LoadConstType::LAST);
-                OUT(FloatV(state.consts[op.imm.i + bias]));
+        for (int k = 0; k < count; k++) {
+            for (size_t p = 0; p < comps.size(); p++) {
+                states[p].interior = interior;
+                states[p].tail = states[0].tail;
+                states[p].y = states[0].y;
+                states[p].x = xbase + k * lanes;
+                comps[p]->buildOneIter(helpers, states[p]);
             }
-            }
-            break;
-        }
-
-#define LOAD1(x) \
-            Value x = stack.back(); stack.pop_back()
-#define LOAD2(l, r) \
-            LOAD1(r); \
-            LOAD1(l)
-#define BINARYOP(op, forceFloat) { \
-            LOAD2(l, r); \
-            if (l.isFloat() && r.isFloat()) \
-                OUT(op(l.f(), r.f())); \
-            else if (l.isFloat()) \
-                OUT(op(l.f(), FloatV(r.i()))); \
-            else if (r.isFloat()) \
-                OUT(op(FloatV(l.i()), r.f())); \
-            else if (forceFloat) \
-                OUT(op(FloatV(l.i()), FloatV(r.i()))); \
-            else \
-                OUT(op(l.i(), r.i())); \
-            break; \
-        }
-#define BINARYOPF(op) { \
-            LOAD2(l, r); \
-            OUT(op(l.ensureFloat(), r.ensureFloat())); \
-            break; \
-        }
-#define UNARYOP(op, forceFloat) { \
-            LOAD1(x); \
-            if (x.isFloat()) \
-                OUT(op(x.f())); \
-            else if (forceFloat) \
-                OUT(op(FloatV(x.i()))); \
-            else \
-                OUT(op(x.i())); \
-            break; \
-        }
-#define UNARYOPF(op) { \
-            LOAD1(x); \
-            OUT(op(x.ensureFloat())); \
-            break; \
-        }
-#define LOGICOP(op) { \
-            LOAD2(l, r); \
-            IntV li = l.isFloat() ? CmpGT(l.f(), FloatV(0.0)) : CmpGT(l.i(), IntV(0)); \
-            IntV ri = r.isFloat() ? CmpGT(r.f(), FloatV(0.0)) : CmpGT(r.i(), IntV(0)); \
-            auto x = op(li, ri); \
-            OUT(x & IntV(1)); \
-            break; \
         }
+        states[0].x = xbase;
+    });
+    if (opt & Context::flagStreamStores)
+        Fence(std::memory_order_seq_cst); // order the streaming stores before the caller's synchronisation
+    Return();
 
-        case ExprOpType::MEM_LOAD_VAR: {
-            LOAD2(absx_, absy_);
+    bool mergeRows = std::all_of(comps.begin(), comps.end(), [](const auto &c) { return positionIndependent(c->ctx.ops); });
+    double parseTime = 0;
+    for (auto &c: comps)
+        parseTime += c->ctx.parseTime;
+#ifdef USE_EXPR_CACHE
+    std::unique_ptr<DiskCache> disk = DiskCache::open(key);
+    Compiled r { mod.acquire("proc", rr::Config::Edit::None, disk.get()), pa, mergeRows };
+    r.stats = routineStats(parseTime, *r.routine);
+    exprCache.insert(key, r);
+    claim.done();
+#else
+    Compiled r { mod.acquire("proc"), pa, mergeRows };
+    r.stats = routineStats(parseTime, *r.routine);
+#endif
+    return r;
+}
 
-            const VSVideoFormat format = ctx.vi[op.imm.i]->format;
-            Pointer<Byte> p = state.wptrs[op.imm.i + 1];
-            IntV stride = state.strides[op.imm.i + 1], size = format.bytesPerSample;
-            IntV absx = Min(Max(absx_.ensureInt(), IntV(0)), IntV(state.width-1));
-            IntV absy = Min(Max(absy_.ensureInt(), IntV(0)), IntV(state.height-1));
-            IntV offsets = absy * stride + absx * size;
+static void runStrips(ExprData::ProcessProc proc, int threads, void *rwptrs, int *strides, float *props, int width, int height) {
+    int strips = std::min(threads, height);
+    if (strips <= 1) {
+        proc(rwptrs, strides, props, width, height, 0, height);
+        return;
+    }
+    int rows = (height + strips - 1) / strips;
+    parallelFor(strips, [&](int i) {
+        int ystart = i * rows;
+        proc(rwptrs, strides, props, width, height, ystart, std::min(ystart + rows, height));
+    });
+}
 
-            if (format.sampleType == stInteger) {
-                IntV v;
-                if (format.bytesPerSample == 1)
-                    v = IntV(Gather(Pointer<Byte>(p), offsets, IntV(~0), sizeof(uint8_t)));
-                else if (format.bytesPerSample == 2)
-                    v = IntV(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t)));
-                else if (format.bytesPerSample == 4)
-                    v = IntV(Gather(Pointer<Int>(p), offsets, IntV(~0), sizeof(uint32_t)));
-                if (ctx.forceFloat())
-                    OUT(FloatV(v));
-                else
-                    OUT(v);
-            } else if (format.sampleType == stFloat) {
-                FloatV v;
-                if (format.bytesPerSample == 2) {
-                    UShortV vi = Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t));
-                    v = FP16To32(vi);
-                } else if (format.bytesPerSample == 4)
-                    v = Gather(Pointer<Float>(p), offsets, IntV(~0), sizeof(float));
-                OUT(v);
-            }
-            break;
-        }
+static float halfToFloat(uint16_t h) {
+    // Same algorithm as Compiler::FP16To32.
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16, bits = (uint32_t)(h & 0x7fff) << 13;
+    float f = std::bit_cast<float>(bits) * std::bit_cast<float>((uint32_t)(254 - 15) << 23);
+    bits = std::bit_cast<uint32_t>(f);
+    if (f >= std::bit_cast<float>((uint32_t)(127 + 16) << 23))
+        bits |= 255 << 23;
+    return std::bit_cast<float>(bits | sign);
+}
 
-        case ExprOpType::VAR_LOAD:
-            OUT(state.variables[op.imm.i]);
-            break;
-        case ExprOpType::VAR_STORE: {
-            LOAD1(x);
-            state.variables[op.imm.i] = x;
-            break;
-        }
+static uint16_t floatToHalf(float f) {
+    // Same algorithm as Compiler::FP32To16.
+    uint32_t bits = std::bit_cast<uint32_t>(f), sign = bits & 0x80000000;
+    bits ^= sign;
+    if ((bits & (255u << 23)) == (255u << 23))
+        bits ^= (255 ^ 31) << 23;
+    else
+        bits = std::bit_cast<uint32_t>(std::min(std::bit_cast<float>(bits), std::bit_cast<float>((uint32_t)(127 + 16) << 23)) * std::bit_cast<float>((uint32_t)15 << 23));
+    return (uint16_t)((bits >> 13) | (sign >> 16));
+}
 
-        case ExprOpType::ADD: BINARYOP(operator +, false);
-        case ExprOpType::SUB: BINARYOP(operator -, false);
-        case ExprOpType::MUL: BINARYOP(operator *, false);
-        case ExprOpType::DIV: BINARYOP(operator /, true);
-        case ExprOpType::MOD: BINARYOP(operator %, true);
-        case ExprOpType::SQRT: UNARYOPF([](RValue<FloatV> x) -> FloatV { return Sqrt(Max(x, FloatV(0.0))); });
-        case ExprOpType::ABS: UNARYOP(Abs, ctx.forceFloat());
-        case ExprOpType::MAX: BINARYOP(Max, ctx.forceFloat());
-        case ExprOpType::MIN: BINARYOP(Min, ctx.forceFloat());
-        case ExprOpType::CLAMP: {
-            LOAD2(min, max);
-            LOAD1(x);
-            if (x.isFloat() || min.isFloat() || max.isFloat() || ctx.forceFloat()) {
-                FloatV xf = x.ensureFloat();
-                FloatV minf = min.ensureFloat();
-                FloatV maxf = max.ensureFloat();
-                OUT(Max(Min(xf, maxf), minf));
-            } else
-                OUT(Max(Min(x.i(), max.i()), min.i()));
-            break;
+// Stores v as sample x of row in format fo, rounding and clamping integers
+// like the compiled routines do.
+static void storeSample(const VSVideoFormat &fo, uint8_t *row, int x, float v) {
+    if (fo.sampleType == stFloat) {
+        if (fo.bytesPerSample == 2)
+            reinterpret_cast<uint16_t *>(row)[x] = floatToHalf(v);
+        else
+            reinterpret_cast<float *>(row)[x] = v;
+        return;
+    }
+    // In double, where maxval of 25-32 bits is exact.
+    const double maxval = (double)((1ll << fo.bitsPerSample) - 1);
+    uint32_t i = (uint32_t)std::nearbyint(std::clamp((double)v, 0.0, maxval));
+    if (fo.bytesPerSample == 1)
+        row[x] = (uint8_t)i;
+    else if (fo.bytesPerSample == 2)
+        reinterpret_cast<uint16_t *>(row)[x] = (uint16_t)i;
+    else
+        reinterpret_cast<uint32_t *>(row)[x] = i;
+}
+
+// Byte stride of the rows of the horizontal passes of planes width pixels wide.
+static ptrdiff_t passStride(int width) {
+    return ((size_t)width * sizeof(float) + 63) & ~(size_t)63;
+}
+
+// Computes rows [y0, y1) of the horizontal pass p of plane from the frame of
+// its input, storing row y at dstp + (y - y0) * stride.
+static void computePass(const ExprData::SeparablePass &p, const VSFrame *src, int plane, int y0, int y1, uint8_t *dstp, ptrdiff_t stride, const VSAPI *vsapi) {
+    const int width = vsapi->getFrameWidth(src, plane);
+    const int taps = (int)p.weights.size(), rx = taps / 2;
+    const VSVideoFormat &f = *vsapi->getVideoFrameFormat(src);
+    const uint8_t *srcp = vsapi->getReadPtr(src, plane);
+    const ptrdiff_t srcStride = vsapi->getStride(src, plane);
+
+    // The row with rx pixels resolved past either edge, as relative accesses
+    // do. Mirrored offsets beyond the width are clamped to it first, which
+    // makes the pixel depend on x as well; such rows are summed directly.
+    thread_local std::vector<float> line;
+    line.resize((size_t)width + 2 * rx);
+    auto edge = [&](int x, int offset) {
+        if (p.bc == BoundaryCondition::Mirrored) {
+            const int v = x + std::clamp(offset, -width, width);
+            return v < 0 ? -1 - v : v >= width ? 2 * width - 1 - v : v;
         }
-#define CMP(l, r) \
-            switch (static_cast<ComparisonType>(op.imm.u)) { \
-            case ComparisonType::EQ:  x = CmpEQ(l, r);  break; \
-            case ComparisonType::LT:  x = CmpLT(l, r);  break; \
-            case ComparisonType::LE:  x = CmpLE(l, r);  break; \
-            case ComparisonType::NEQ: x = CmpNEQ(l, r); break; \
-            case ComparisonType::NLT: x = CmpNLT(l, r); break; \
-            case ComparisonType::NLE: x = CmpNLE(l, r); break; \
-            }
-        case ExprOpType::CMP: {
-            LOAD2(l, r);
-            IntV x;
-            if (l.isFloat() || r.isFloat()) {
-                FloatV lf = l.ensureFloat();
-                FloatV rf = r.ensureFloat();
-                CMP(lf, rf);
-            } else {
-                CMP(l.i(), r.i());
+        return std::clamp(x + offset, 0, width - 1);
+    };
+    const bool direct = p.bc == BoundaryCondition::Mirrored && rx > width;
+    for (int y = y0; y < y1; y++) {
+        const uint8_t *row = srcp + y * srcStride;
+        float *in = line.data() + rx;
+        if (f.sampleType == stFloat && f.bytesPerSample == 2) {
+            for (int x = 0; x < width; x++)
+                in[x] = halfToFloat(reinterpret_cast<const uint16_t *>(row)[x]);
+        } else if (f.sampleType == stFloat) {
+            std::memcpy(in, row, (size_t)width * sizeof(float));
+        } else if (f.bytesPerSample == 1) {
+            for (int x = 0; x < width; x++)
+                in[x] = row[x];
+        } else if (f.bytesPerSample == 2) {
+            for (int x = 0; x < width; x++)
+                in[x] = reinterpret_cast<const uint16_t *>(row)[x];
+        } else {
+            for (int x = 0; x < width; x++)
+                in[x] = (float)reinterpret_cast<const uint32_t *>(row)[x];
+        }
+        float *out = reinterpret_cast<float *>(dstp + (y - y0) * stride);
+        if (direct) {
+            for (int x = 0; x < width; x++) {
+                float sum = 0.0f;
+                for (int t = 0; t < taps; t++)
+                    sum += p.weights[t] * in[edge(x, t - rx)];
+                out[x] = sum;
             }
-            OUT(x & IntV(1));
-            break;
+            continue;
         }
-#undef CMP
-
-        case ExprOpType::AND: LOGICOP(operator &);
-        case ExprOpType::OR: LOGICOP(operator |);
-        case ExprOpType::XOR: LOGICOP(operator ^);
-        case ExprOpType::NOT: {
-            LOAD1(x);
-            IntV xi = x.isFloat() ? CmpLE(x.f(), FloatV(0.0f)) : CmpLE(x.i(), IntV(0));
-            OUT(xi & IntV(1));
-            break;
+        for (int x = 1; x <= rx; x++) {
+            in[-x] = in[edge(0, -x)];
+            in[width - 1 + x] = in[edge(width - 1, x)];
         }
 
-#define BITWISEOP(op) { \
-            LOAD2(l, r); \
-            IntV li = l.ensureInt(); \
-            IntV ri = r.ensureInt(); \
-            auto x = op(li, ri); \
-            OUT(x); \
-            break; \
+        // Tap by tap over the whole row, which vectorises.
+        const float w0 = p.weights[0];
+        for (int x = 0; x < width; x++)
+            out[x] = w0 * line[x];
+        for (int t = 1; t < taps; t++) {
+            const float w = p.weights[t];
+            const float *tap = line.data() + t;
+            for (int x = 0; x < width; x++)
+                out[x] += w * tap[x];
         }
-        case ExprOpType::BITAND: BITWISEOP(operator &);
-        case ExprOpType::BITOR: BITWISEOP(operator |);
-        case ExprOpType::BITXOR: BITWISEOP(operator ^);
-        case ExprOpType::BITNOT: {
-            LOAD1(x);
-            IntV xi = x.ensureInt();
-            OUT(~xi);
-            break;
+    }
+}
+
+#define EXPR_PASS_CACHE_BYTES (256 << 10) // of the band of rows of the horizontal passes of a strip
+#define EXPR_PASS_MIN_ROWS 16
+
+// Like runStrips, for routines that read horizontal passes. Each strip
+// processes its rows in bands: the rows of the passes that a band needs
+// (including radius rows above and below it) are kept in a buffer that stays
+// in cache, which slides down the strip, so that each row of a pass is
+// computed once per strip. groupPlanes lists the planes of the groups of
+// pointers in rwptrs (one, unless the routine is fused), count is its size.
+static void runPasses(const ExprData *d, ExprData::ProcessProc proc, const std::vector<int> &groupPlanes, uint8_t *const *rwptrs, int *strides, size_t count, float *props, int width, int height, const std::vector<const VSFrame *> &src, const VSAPI *vsapi) {
+    const int numPasses = (int)d->passes.size(), groups = (int)groupPlanes.size(), base = d->numInputs + 1;
+    int radius = 0;
+    for (const auto &p: d->passes)
+        radius = std::max(radius, p.radius);
+    const ptrdiff_t stride = passStride(width);
+    const int band = std::max(EXPR_PASS_MIN_ROWS, (int)(EXPR_PASS_CACHE_BYTES / (stride * numPasses * groups)) - 2 * radius);
+    const size_t bufferBytes = (size_t)(band + 2 * radius) * stride;
+    for (int g = 0; g < groups; g++)
+        for (int k = 0; k < numPasses; k++)
+            strides[g * base + d->firstPass + k + 1] = (int)stride;
+
+    // Allocated on this thread, whose arena is released after the frame.
+    const int strips = std::clamp(d->threads, 1, height);
+    const int rows = (height + strips - 1) / strips;
+    ScratchArena &arena = scratchArena();
+    std::vector<uint8_t **> ptrs(strips);
+    std::vector<uint8_t *> buffers(strips);
+    for (int s = 0; s < strips; s++) {
+        ptrs[s] = static_cast<uint8_t **>(arena.allocate(count * sizeof(uint8_t *), alignof(uint8_t *)));
+        std::copy(rwptrs, rwptrs + count, ptrs[s]);
+        buffers[s] = static_cast<uint8_t *>(arena.allocate(bufferBytes * numPasses * groups, ScratchArena::chunkAlign));
+    }
+
+    auto strip = [&](int s) {
+        const int ystart = s * rows, yend = std::min(ystart + rows, height);
+        int lo = 0, hi = 0; // rows of the passes in the buffers
+        for (int y0 = ystart; y0 < yend; y0 += band) {
+            const int y1 = std::min(y0 + band, yend);
+            const int needLo = std::max(y0 - radius, 0), needHi = std::min(y1 + radius, height);
+            const int keep = std::max(hi - needLo, 0);
+            for (int g = 0; g < groups; g++) {
+                for (int k = 0; k < numPasses; k++) {
+                    const auto &p = d->passes[k];
+                    if (!(p.planes & (1 << groupPlanes[g])))
+                        continue;
+                    uint8_t *buf = buffers[s] + (g * numPasses + k) * bufferBytes;
+                    if (keep && needLo > lo)
+                        std::memmove(buf, buf + (needLo - lo) * stride, keep * stride);
+                    const int from = std::max(hi, needLo);
+                    computePass(p, src[p.input], groupPlanes[g], from, needHi, buf + (from - needLo) * stride, stride, vsapi);
+                    // Row y of the pass is at the address of row y of a plane starting here.
+                    ptrs[s][g * base + d->firstPass + k + 1] = reinterpret_cast<uint8_t *>(reinterpret_cast<uintptr_t>(buf) - (uintptr_t)needLo * stride);
+                }
+            }
+            lo = needLo;
+            hi = needHi;
+            proc(ptrs[s], strides, props, width, height, y0, y1);
         }
+    };
+    if (strips == 1)
+        strip(0);
+    else
+        parallelFor(strips, strip);
+}
 
-        case ExprOpType::TRUNC: UNARYOPF(Trunc);
-        case ExprOpType::ROUND: UNARYOPF(Round);
-        case ExprOpType::FLOOR: UNARYOPF(Floor);
+// Evaluates a plane with the interpreter, for use while the routines are
+// still being compiled. Transcendental functions and rounding may differ
+// slightly from the compiled code. Reduced planes accumulate into rowReduce
+// like the compiled routines do.
+static void interpretPlane(const ExprData *d, int plane, int n, const std::vector<const VSFrame *> &src, VSFrame *dst, float *rowReduce, const std::function<float(int, const std::string &)> &propGet, const VSAPI *vsapi) {
+    const int width = vsapi->getFrameWidth(dst, plane), height = vsapi->getFrameHeight(dst, plane);
+    std::vector<const uint8_t *> srcp(d->numInputs);
+    std::vector<ptrdiff_t> strides(d->numInputs);
+    std::vector<const VSVideoFormat *> formats(d->numInputs);
+    for (int i = 0; i < d->firstPass; i++) {
+        srcp[i] = vsapi->getReadPtr(src[i], plane);
+        strides[i] = vsapi->getStride(src[i], plane);
+        formats[i] = vsapi->getVideoFrameFormat(src[i]);
+    }
+    // The horizontal passes are computed for the whole plane.
+    std::vector<std::vector<uint8_t>> passes(d->passes.size());
+    for (size_t k = 0; k < d->passes.size(); k++) {
+        const int i = d->firstPass + (int)k;
+        strides[i] = passStride(width);
+        formats[i] = &d->passVi[k].format;
+        if (!(d->passes[k].planes & (1 << plane)))
+            continue;
+        passes[k].resize(strides[i] * height);
+        computePass(d->passes[k], src[i], plane, 0, height, passes[k].data(), strides[i], vsapi);
+        srcp[i] = passes[k].data();
+    }
 
-        case ExprOpType::EXP: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Exp->Call(x); });
-        case ExprOpType::LOG: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Log->Call(x); });
-        case ExprOpType::POW: {
-            LOAD2(l, r);
-            if (!r.isFloat()) {
-                OUT(IfThenElse(RValue<IntV>(r.i()).IsConstant(),
-                        BuiltinPow(l.ensureFloat(), FloatV(r.i())),
-                        helpers.Pow->Call(l.ensureFloat(), r.ensureFloat())));
-            } else {
-                OUT(helpers.Pow->Call(l.ensureFloat(), r.ensureFloat()));
+    auto coord = [](int v, int offset, int size, BoundaryCondition bc) {
+        if (bc == BoundaryCondition::Mirrored) {
+            v += std::clamp(offset, -size, size);
+            return v < 0 ? -1 - v : v >= size ? 2 * size - 1 - v : v;
+        }
+        return std::clamp(v + offset, 0, size - 1);
+    };
+    auto pixelGet = [&](const ExprOp &op, int y, int x) -> float {
+        if (op.type == ExprOpType::MEM_LOAD_VAR) {
+            y = std::clamp(y, 0, height - 1);
+            x = std::clamp(x, 0, width - 1);
+        } else {
+            y = coord(y, op.y, height, op.bc);
+            x = coord(x, op.x, width, op.bc);
+        }
+        const VSVideoFormat &f = *formats[op.imm.i];
+        const uint8_t *p = srcp[op.imm.i] + y * strides[op.imm.i] + x * f.bytesPerSample;
+        if (f.sampleType == stFloat)
+            return f.bytesPerSample == 2 ? halfToFloat(*reinterpret_cast<const uint16_t *>(p)) : *reinterpret_cast<const float *>(p);
+        if (f.bytesPerSample == 1)
+            return *p;
+        if (f.bytesPerSample == 2)
+            return *reinterpret_cast<const uint16_t *>(p);
+        return (float)*reinterpret_cast<const uint32_t *>(p);
+    };
+
+    const VSVideoFormat &fo = d->vi.format;
+    uint8_t *dstp = vsapi->getWritePtr(dst, plane);
+    const ptrdiff_t stride = vsapi->getStride(dst, plane);
+    const std::function<float(const ExprOp &, int, int)> pixelFn = pixelGet;
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = dstp + y * stride;
+        for (int x = 0; x < width; x++) {
+            float v = interpret(d->ops[plane], n, width, height, y, x, pixelFn, propGet);
+            if (d->reduce[plane] != ReduceMode::None) {
+                float &r = rowReduce[y];
+                r = d->reduce[plane] == ReduceMode::Min ? std::min(r, v) : d->reduce[plane] == ReduceMode::Max ? std::max(r, v) : r + v;
+                continue;
             }
-            break;
+            storeSample(fo, row, x, v);
         }
-        case ExprOpType::SIN: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Sin->Call(x); });
-        case ExprOpType::COS: UNARYOPF([&helpers](RValue<FloatV> x) -> FloatV { return helpers.Cos->Call(x); });
+    }
+}
 
-        case ExprOpType::TERNARY: {
-            LOAD2(t, f);
-            LOAD1(c);
-            auto ci = c.isFloat() ? CmpGT(c.f(), FloatV(0.0f)) : CmpGT(c.i(), IntV(0));
-            if (t.isFloat() || f.isFloat()) {
-                FloatV tf = t.ensureFloat();
-                FloatV ff = f.ensureFloat();
-                OUT(As<FloatV>((As<IntV>(tf) & ci) | (As<IntV>(ff) & ~ci)));
-            } else
-                OUT((t.i() & ci) | (f.i() & ~ci));
+// Largest number of input bits for which lookup tables are built, and the
+// smallest estimated cost of an expression worth replacing with one.
+#define EXPR_LUT_MAX_BITS 16
+#define EXPR_LUT_MIN_COST 16
+
+// Returns the output samples of ops for every combination of its input values
+// if the plane is better computed with a lookup table, i.e. ops is a function
+// of a single pixel of one or two integer clips with at most EXPR_LUT_MAX_BITS
+// bits in total and is expensive enough. The table is computed by the same
+// routine the plane would otherwise be processed with, run over a single row
+// holding every combination, so that both paths give the same samples.
+template<int lanes>
+static bool buildLut(const std::string &expr, const std::vector<ExprOp> &ops, const std::vector<std::string> &tokens, const VSVideoInfo * const *vi, const VSVideoFormat &fo, int numInputs,
+                     int optMask, int mirror, int unroll, std::vector<uint8_t> &lut, int clip[2], VSCore *core, const VSAPI *vsapi) {
+    int nclips = 0;
+    for (const auto &op: ops) {
+        switch (op.type) {
+        case ExprOpType::MEM_LOAD:
+            if (op.x != 0 || op.y != 0 || op.imm.i < 0 || op.imm.i >= numInputs)
+                return false;
+            if (std::find(clip, clip + nclips, op.imm.i) != clip + nclips)
+                break;
+            if (nclips == 2)
+                return false;
+            clip[nclips++] = op.imm.i;
+            break;
+        case ExprOpType::MEM_LOAD_VAR:
+        case ExprOpType::CONST_LOAD:
+            return false;
+        default:
             break;
         }
-#undef BITWISEOP
-#undef LOGICOP
-#undef UNARYOPF
-#undef UNARYOP
-#undef BINARYOPF
-#undef BINARYOP
-#undef OUT
-#undef LOAD2
-#undef LOAD1
+    }
+    if (nclips == 0 || estimateCost(ops) < EXPR_LUT_MIN_COST || !ExprOptimizer::valid(ops, tokens, numInputs))
+        return false;
+    int bits[2] = {};
+    for (int k = 0; k < nclips; k++) {
+        const VSVideoFormat &fi = vi[clip[k]]->format;
+        if (fi.sampleType != stInteger)
+            return false;
+        bits[k] = fi.bitsPerSample;
+    }
+    if (bits[0] + bits[1] > EXPR_LUT_MAX_BITS || (nclips == 2 && (bits[0] != 8 || bits[1] != 8)))
+        return false;
+    if (nclips == 1)
+        clip[1] = clip[0];
+
+    // The row of every input value, as Gray clips of the input and output formats.
+    const int size = 1 << (bits[0] + bits[1]);
+    const int mask1 = (1 << bits[1]) - 1;
+    auto grayInfo = [&](const VSVideoFormat &f) {
+        VSVideoInfo info = {};
+        vsapi->queryVideoFormat(&info.format, cfGray, f.sampleType, f.bitsPerSample, 0, 0, core);
+        info.width = size;
+        info.height = 1;
+        return info;
+    };
+    const VSVideoInfo vo = grayInfo(fo);
+    std::vector<VSVideoInfo> rowInfo(numInputs);
+    std::vector<const VSVideoInfo *> rowVi(numInputs);
+    for (int i = 0; i < numInputs; i++) {
+        if (vi[i]) {
+            rowInfo[i] = grayInfo(vi[i]->format);
+            rowVi[i] = &rowInfo[i];
+        }
+    }
+    Compiled compiled = Compiler<lanes>(expr, &vo, rowVi.data(), vsapi, numInputs, optMask, mirror, unroll).compile();
+    auto proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(compiled.routine->getEntry()));
+
+    VSFrame *dst = vsapi->newVideoFrame(&vo.format, size, 1, nullptr, core);
+    VSFrame *src[2] = {};
+    std::vector<uint8_t *> rwptrs(numInputs + 1, nullptr);
+    std::vector<int> strides(numInputs + 1, 0);
+    rwptrs[0] = vsapi->getWritePtr(dst, 0);
+    strides[0] = (int)vsapi->getStride(dst, 0);
+    for (int k = 0; k < (nclips == 2 ? 2 : 1); k++) {
+        src[k] = vsapi->newVideoFrame(&rowInfo[clip[k]].format, size, 1, nullptr, core);
+        uint8_t *p = vsapi->getWritePtr(src[k], 0);
+        for (int v = 0; v < size; v++) {
+            const int val = nclips == 2 ? (k == 0 ? v >> bits[1] : v & mask1) : v;
+            if (rowInfo[clip[k]].format.bytesPerSample == 1)
+                p[v] = (uint8_t)val;
+            else
+                reinterpret_cast<uint16_t *>(p)[v] = (uint16_t)val;
+        }
+        rwptrs[clip[k] + 1] = p;
+        strides[clip[k] + 1] = (int)vsapi->getStride(src[k], 0);
+    }
+    float consts[1] = {}; // N
+    proc(rwptrs.data(), strides.data(), consts, size, 1, 0, 1);
+
+    const uint8_t *row = vsapi->getReadPtr(dst, 0);
+    lut.assign(row, row + (size_t)size * fo.bytesPerSample);
+    vsapi->freeFrame(dst);
+    for (auto f: src)
+        vsapi->freeFrame(f);
+    return true;
+}
 
-        // Unsupported operators, shouldn't happen
-        case ExprOpType::ARGMIN:
-        case ExprOpType::ARGMAX:
-        case ExprOpType::ARGSORT:
-            assert(0 && "shouldn't happen");
-            break;
-        } // switch
+template<typename TI, typename TO>
+static void applyLut(const uint8_t *srcp, ptrdiff_t srcStride, uint8_t *dstp, ptrdiff_t dstStride, int width, int height, const std::vector<uint8_t> &lut) {
+    const TO *table = reinterpret_cast<const TO *>(lut.data());
+    const unsigned last = (unsigned)(lut.size() / sizeof(TO)) - 1;
+    for (int y = 0; y < height; y++) {
+        const TI *s = reinterpret_cast<const TI *>(srcp + y * srcStride);
+        TO *t = reinterpret_cast<TO *>(dstp + y * dstStride);
+        for (int x = 0; x < width; x++)
+            t[x] = table[std::min<unsigned>(s[x], last)];
     }
+}
 
-    if (stack.empty())
-        throw std::runtime_error("empty expression: " + ctx.expr);
-    if (stack.size() > 1)
-        throw std::runtime_error(std::to_string(stack.size()) + " unconsumed values on stack: " + ctx.expr);
+template<typename TO>
+static void applyLut2(const uint8_t *srcp0, ptrdiff_t srcStride0, const uint8_t *srcp1, ptrdiff_t srcStride1, uint8_t *dstp, ptrdiff_t dstStride, int width, int height, const std::vector<uint8_t> &lut) {
+    const TO *table = reinterpret_cast<const TO *>(lut.data());
+    for (int y = 0; y < height; y++) {
+        const uint8_t *s0 = srcp0 + y * srcStride0;
+        const uint8_t *s1 = srcp1 + y * srcStride1;
+        TO *t = reinterpret_cast<TO *>(dstp + y * dstStride);
+        for (int x = 0; x < width; x++)
+            t[x] = table[(s0[x] << 8) | s1[x]];
+    }
+}
 
-    auto res = stack.back();
-    auto format = ctx.vo->format;
-    Pointer<Byte> p = state.wptrs[0];
-    p += state.y * state.strides[0] + state.x * format.bytesPerSample;
-    if (format.sampleType == stInteger) {
-        IntV rounded;
-        const int maxval = (1<<format.bitsPerSample) - 1;
-        if (res.isFloat()) {
-            FloatV clamped = Min(Max(res.f(), FloatV(0)), FloatV(maxval));
-            rounded = RoundInt(clamped);
-        } else if (format.bitsPerSample < 32)
-            rounded = Min(Max(res.i(), IntV(0)), IntV(maxval));
-        else
-            rounded = res.i();
-        if (format.bytesPerSample == 1)
-            *Pointer<ByteV>(p, lanes*sizeof(uint8_t)) = ByteV(UShortV(rounded));
-        else if (format.bytesPerSample == 2)
-            *Pointer<UShortV>(p, lanes*sizeof(uint16_t)) = UShortV(rounded);
-        else if (format.bytesPerSample == 4)
-            *Pointer<IntV>(p, lanes*sizeof(uint32_t)) = rounded;
-    } else if (format.sampleType == stFloat) {
-        if (format.bytesPerSample == 2) {
-            UShortV vi = FP32To16(res.ensureFloat());
-            *Pointer<UShortV>(p, lanes*sizeof(uint16_t)) = vi;
-        } else if (format.bytesPerSample == 4)
-            *Pointer<FloatV>(p, lanes*sizeof(float)) = res.ensureFloat();
+static void lutPlane(const ExprData *d, int plane, const std::vector<const VSFrame *> &src, VSFrame *dst, const VSAPI *vsapi) {
+    const VSFrame *f = src[d->lutClip[plane][0]];
+    const uint8_t *srcp = vsapi->getReadPtr(f, plane);
+    ptrdiff_t srcStride = vsapi->getStride(f, plane);
+    uint8_t *dstp = vsapi->getWritePtr(dst, plane);
+    ptrdiff_t dstStride = vsapi->getStride(dst, plane);
+    int width = vsapi->getFrameWidth(dst, plane), height = vsapi->getFrameHeight(dst, plane);
+    const auto &lut = d->lut[plane];
+    if (d->lutClip[plane][1] != d->lutClip[plane][0]) {
+        const VSFrame *f1 = src[d->lutClip[plane][1]];
+        const uint8_t *srcp1 = vsapi->getReadPtr(f1, plane);
+        ptrdiff_t srcStride1 = vsapi->getStride(f1, plane);
+        switch (d->vi.format.bytesPerSample) {
+        case 1: applyLut2<uint8_t>(srcp, srcStride, srcp1, srcStride1, dstp, dstStride, width, height, lut); break;
+        case 2: applyLut2<uint16_t>(srcp, srcStride, srcp1, srcStride1, dstp, dstStride, width, height, lut); break;
+        default: applyLut2<uint32_t>(srcp, srcStride, srcp1, srcStride1, dstp, dstStride, width, height, lut); break;
+        }
+        return;
+    }
+    bool in8 = vsapi->getVideoFrameFormat(f)->bytesPerSample == 1;
+    switch (d->vi.format.bytesPerSample) {
+    case 1:
+        if (in8) applyLut<uint8_t, uint8_t>(srcp, srcStride, dstp, dstStride, width, height, lut);
+        else applyLut<uint16_t, uint8_t>(srcp, srcStride, dstp, dstStride, width, height, lut);
+        break;
+    case 2:
+        if (in8) applyLut<uint8_t, uint16_t>(srcp, srcStride, dstp, dstStride, width, height, lut);
+        else applyLut<uint16_t, uint16_t>(srcp, srcStride, dstp, dstStride, width, height, lut);
+        break;
+    default:
+        if (in8) applyLut<uint8_t, uint32_t>(srcp, srcStride, dstp, dstStride, width, height, lut);
+        else applyLut<uint16_t, uint32_t>(srcp, srcStride, dstp, dstStride, width, height, lut);
+        break;
     }
 }
 
-template<int lanes>
-typename Compiler<lanes>::Helper Compiler<lanes>::buildHelpers(rr::Module &mod)
-{
-    Helper h;
-    using ftype = typename Compiler<lanes>::Helper::ftype;
-    using ftype2 = typename Compiler<lanes>::Helper::ftype2;
-    h.Sin = std::make_unique<ftype>(mod, "vsin");
-    h.Sin->setPure();
-    {
-        FloatV x = h.Sin->template Arg<0>();
-        Return(SinCos_(x, true));
+// Reshapes a plane processed by a position independent routine into as few
+// rows as the strips allow if its rows are contiguous in every clip, so that
+// narrow planes neither pay the per-row overhead nor compute a partial vector
+// at the end of each row. bytes holds the sample size of every entry of
+// strides, or 0 for entries that need not be contiguous.
+static void mergeRows(int *strides, const int *bytes, size_t count, int threads, int &width, int &height) {
+    for (size_t i = 0; i < count; i++)
+        if (bytes[i] && strides[i] != width * bytes[i])
+            return;
+    int rows = std::clamp(threads, 1, height);
+    while (height % rows)
+        rows--;
+    width *= height / rows;
+    height = rows;
+    for (size_t i = 0; i < count; i++)
+        if (bytes[i])
+            strides[i] = width * bytes[i];
+}
+
+#ifdef HAVE_CUDA
+// The CUDA backend (backend="cuda") generates a PTX kernel per processed
+// plane from the same op list as the CPU routines, one thread per pixel, and
+// has the driver compile it. Values live in registers: the stack and the
+// variables are resolved while generating, so the kernel is straight-line
+// code whose only branch is the bounds check. Transcendental functions use the
+// hardware approximations, so results may differ slightly from the CPU.
+
+#define CUDA_CHECK(x) do { \
+    CUresult r = (x); \
+    if (r != CUDA_SUCCESS) \
+        throw std::runtime_error(std::string{ "CUDA call " #x " failed: " } + std::to_string(r)); \
+} while (0)
+
+class PtxGenerator {
+public:
+    // Props lists the frame properties the kernel takes as parameters after
+    // the clips, in order, and reads the clips it loads from.
+    std::vector<std::pair<int, std::string>> props;
+    std::vector<bool> reads;
+
+    PtxGenerator(const std::vector<ExprOp> &ops, const std::string &entry, const VSVideoFormat &out, const VSVideoInfo * const *vi, int numInputs, int width, int height)
+        : reads(numInputs), vi(vi), numInputs(numInputs), width(width), height(height) {
+        // Before generating anything, so that the usual errors are reported.
+        const InterpProgram prog = prepareInterpret(ops);
+        if (prog.errorAt != SIZE_MAX)
+            throw std::runtime_error(prog.error);
+
+        x = R();
+        y = R();
+        threadIndex("x", x);
+        threadIndex("y", y);
+        auto outside = P();
+        line("setp.ge.u32 " + outside + ", " + x + ", " + std::to_string(width));
+        line("setp.ge.or.u32 " + outside + ", " + y + ", " + std::to_string(height) + ", " + outside);
+        line("@" + outside + " bra DONE");
+
+        std::vector<std::string> stack;
+        std::map<std::string, std::string> vars;
+        auto pop = [&]() {
+            auto v = stack.back();
+            stack.pop_back();
+            return v;
+        };
+        auto unary = [&](const std::string &insn) {
+            auto a = pop(), d = F();
+            line(insn + " " + d + ", " + a);
+            stack.push_back(d);
+        };
+        auto binary = [&](const std::string &insn) {
+            auto r = pop(), l = pop(), d = F();
+            line(insn + " " + d + ", " + l + ", " + r);
+            stack.push_back(d);
+        };
+        auto boolean = [&](const std::string &p) {
+            auto d = F();
+            line("selp.f32 " + d + ", " + fimm(1) + ", " + fimm(0) + ", " + p);
+            stack.push_back(d);
+        };
+        auto positive = [&](const std::string &v) {
+            auto p = P();
+            line("setp.gt.f32 " + p + ", " + v + ", " + fimm(0));
+            return p;
+        };
+
+        for (const auto &op : prog.ops) {
+            switch (op.type) {
+            case ExprOpType::MEM_LOAD:
+                stack.push_back(relativeLoad(op));
+                break;
+            case ExprOpType::MEM_LOAD_VAR: {
+                auto absy = pop(), absx = pop();
+                stack.push_back(op.x ? bilinearLoad(op.imm.i, absx, absy) : nearestLoad(op.imm.i, absx, absy));
+                break;
+            }
+            case ExprOpType::CONSTANTI:
+                stack.push_back(constant((float)op.imm.i));
+                break;
+            case ExprOpType::CONSTANTF:
+                stack.push_back(constant(op.imm.f));
+                break;
+            case ExprOpType::CONST_LOAD:
+                stack.push_back(constLoad(op));
+                break;
+            case ExprOpType::VAR_LOAD:
+                stack.push_back(vars.at(op.name));
+                break;
+            case ExprOpType::VAR_STORE:
+                vars[op.name] = pop();
+                break;
+
+            case ExprOpType::ADD: binary("add.f32"); break;
+            case ExprOpType::SUB: binary("sub.f32"); break;
+            case ExprOpType::MUL: binary("mul.f32"); break;
+            case ExprOpType::DIV: binary("div.rn.f32"); break;
+            case ExprOpType::MOD: {
+                // l - trunc(l / r) * r
+                auto r = pop(), l = pop(), q = F(), d = F();
+                line("div.rn.f32 " + q + ", " + l + ", " + r);
+                line("cvt.rzi.f32.f32 " + q + ", " + q);
+                line("neg.f32 " + q + ", " + q);
+                line("fma.rn.f32 " + d + ", " + q + ", " + r + ", " + l);
+                stack.push_back(d);
+                break;
+            }
+            case ExprOpType::SQRT: {
+                auto a = pop(), t = F(), d = F();
+                line("max.f32 " + t + ", " + a + ", " + fimm(0));
+                line("sqrt.rn.f32 " + d + ", " + t);
+                stack.push_back(d);
+                break;
+            }
+            case ExprOpType::ABS: unary("abs.f32"); break;
+            case ExprOpType::MAX: binary("max.f32"); break;
+            case ExprOpType::MIN: binary("min.f32"); break;
+            case ExprOpType::CLAMP: {
+                auto hi = pop(), lo = pop(), v = pop(), t = F(), d = F();
+                line("min.f32 " + t + ", " + v + ", " + hi);
+                line("max.f32 " + d + ", " + t + ", " + lo);
+                stack.push_back(d);
+                break;
+            }
+            case ExprOpType::CMP: {
+                static const std::map<ComparisonType, std::string> cmps = {
+                    { ComparisonType::EQ, "eq" }, { ComparisonType::LT, "lt" }, { ComparisonType::LE, "le" },
+                    { ComparisonType::NEQ, "neu" }, { ComparisonType::NLT, "ge" }, { ComparisonType::NLE, "gt" },
+                };
+                auto r = pop(), l = pop(), p = P();
+                line("setp." + cmps.at(static_cast<ComparisonType>(op.imm.u)) + ".f32 " + p + ", " + l + ", " + r);
+                boolean(p);
+                break;
+            }
+
+            case ExprOpType::TRUNC: unary("cvt.rzi.f32.f32"); break;
+            case ExprOpType::ROUND: stack.push_back(round(pop())); break;
+            case ExprOpType::FLOOR: unary("cvt.rmi.f32.f32"); break;
+
+            case ExprOpType::AND: case ExprOpType::OR: case ExprOpType::XOR: {
+                auto r = positive(pop()), l = positive(pop()), p = P();
+                const char *insn = op.type == ExprOpType::AND ? "and" : op.type == ExprOpType::OR ? "or" : "xor";
+                line(std::string{ insn } + ".pred " + p + ", " + l + ", " + r);
+                boolean(p);
+                break;
+            }
+            case ExprOpType::NOT: {
+                auto p = P();
+                line("setp.le.f32 " + p + ", " + pop() + ", " + fimm(0));
+                boolean(p);
+                break;
+            }
+
+            case ExprOpType::BITAND: case ExprOpType::BITOR: case ExprOpType::BITXOR: {
+                auto r = toInt(pop()), l = toInt(pop()), i = R(), d = F();
+                const char *insn = op.type == ExprOpType::BITAND ? "and" : op.type == ExprOpType::BITOR ? "or" : "xor";
+                line(std::string{ insn } + ".b32 " + i + ", " + l + ", " + r);
+                line("cvt.rn.f32.s32 " + d + ", " + i);
+                stack.push_back(d);
+                break;
+            }
+            case ExprOpType::BITNOT: {
+                auto a = toInt(pop()), i = R(), d = F();
+                line("not.b32 " + i + ", " + a);
+                line("cvt.rn.f32.s32 " + d + ", " + i);
+                stack.push_back(d);
+                break;
+            }
+
+            case ExprOpType::EXP: {
+                auto a = pop(), t = F(), d = F();
+                line("mul.f32 " + t + ", " + a + ", " + fimm(std::numbers::log2e_v<float>));
+                line("ex2.approx.f32 " + d + ", " + t);
+                stack.push_back(d);
+                break;
+            }
+            case ExprOpType::LOG: {
+                auto a = pop(), t = F(), d = F();
+                line("lg2.approx.f32 " + t + ", " + a);
+                line("mul.f32 " + d + ", " + t + ", " + fimm(std::numbers::ln2_v<float>));
+                stack.push_back(d);
+                break;
+            }
+            case ExprOpType::POW: {
+                auto r = pop(), l = pop();
+                stack.push_back(pow(l, r));
+                break;
+            }
+            case ExprOpType::SIN: unary("sin.approx.f32"); break;
+            case ExprOpType::COS: unary("cos.approx.f32"); break;
+
+            case ExprOpType::TERNARY: {
+                auto f = pop(), t = pop(), c = positive(pop()), d = F();
+                line("selp.f32 " + d + ", " + t + ", " + f + ", " + c);
+                stack.push_back(d);
+                break;
+            }
+
+            case ExprOpType::SORT: {
+                // Largest first from the bottom, so the top is the smallest.
+                const size_t n = op.imm.u, base = stack.size() - n;
+                if (n < 2)
+                    break;
+                for (const auto &c : buildSortNet(n)) {
+                    auto a = stack[base + c.first], b = stack[base + c.second], hi = F(), lo = F();
+                    line("max.f32 " + hi + ", " + a + ", " + b);
+                    line("min.f32 " + lo + ", " + a + ", " + b);
+                    stack[base + c.first] = hi;
+                    stack[base + c.second] = lo;
+                }
+                break;
+            }
+
+            case ExprOpType::DUP:
+                stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+                break;
+            case ExprOpType::SWAP:
+                std::swap(stack.back(), stack[stack.size() - 1 - op.imm.u]);
+                break;
+            case ExprOpType::DROP:
+                stack.resize(stack.size() - op.imm.u);
+                break;
+
+            default:
+                throw std::runtime_error("operator not supported by the cuda backend");
+            }
+        }
+
+        store(out, stack.back());
+
+        std::ostringstream ss;
+        ss << ".visible .entry " << entry << "(\n    .param .u64 p_dst, .param .u32 p_dpitch, .param .f32 p_n";
+        for (int i = 0; i < numInputs; i++)
+            ss << ",\n    .param .u64 p_src" << i << ", .param .u32 p_pitch" << i;
+        for (size_t i = 0; i < props.size(); i++)
+            ss << ",\n    .param .f32 p_c" << i;
+        ss << ")\n{\n";
+        ss << "    .reg .pred %p<" << np + 1 << ">;\n";
+        ss << "    .reg .b16 %h<" << nh + 1 << ">;\n";
+        ss << "    .reg .b32 %r<" << nr + 1 << ">;\n";
+        ss << "    .reg .b64 %rd<" << nrd + 1 << ">;\n";
+        ss << "    .reg .f32 %f<" << nf + 1 << ">;\n\n";
+        ss << code.str() << "DONE:\n    ret;\n}\n";
+        ptx = ss.str();
     }
-    h.Cos = std::make_unique<ftype>(mod, "vcos");
-    h.Cos->setPure();
-    {
-        FloatV x = h.Sin->template Arg<0>();
-        Return(SinCos_(x, false));
+
+    const std::string &str() const { return ptx; }
+
+private:
+    const VSVideoInfo * const *vi;
+    int numInputs, width, height;
+    std::ostringstream code;
+    std::string ptx;
+    int nf = 0, nr = 0, nrd = 0, np = 0, nh = 0;
+    std::string x, y, xf, yf, n;
+    std::map<int, std::pair<std::string, std::string>> clips; // base address and pitch
+    std::map<std::tuple<int, int, int, int>, std::string> loads;
+    std::map<uint32_t, std::string> constants;
+
+    std::string F() { return "%f" + std::to_string(nf++); }
+    std::string R() { return "%r" + std::to_string(nr++); }
+    std::string RD() { return "%rd" + std::to_string(nrd++); }
+    std::string P() { return "%p" + std::to_string(np++); }
+    std::string H() { return "%h" + std::to_string(nh++); }
+    void line(const std::string &s) { code << "    " << s << ";\n"; }
+
+    static std::string fimm(float v) {
+        char buf[16];
+        snprintf(buf, sizeof buf, "0f%08X", std::bit_cast<uint32_t>(v));
+        return buf;
     }
-    h.Exp = std::make_unique<ftype>(mod, "vexp");
-    h.Exp->setPure();
-    {
-        FloatV x = h.Sin->template Arg<0>();
-        Return(Exp_(x));
+
+    void threadIndex(const char *dim, const std::string &d) {
+        auto a = R(), b = R(), c = R();
+        line(std::string{ "mov.u32 " } + a + ", %ctaid." + dim);
+        line(std::string{ "mov.u32 " } + b + ", %ntid." + dim);
+        line(std::string{ "mov.u32 " } + c + ", %tid." + dim);
+        line("mad.lo.u32 " + d + ", " + a + ", " + b + ", " + c);
     }
-    h.Log = std::make_unique<ftype>(mod, "vlog");
-    h.Log->setPure();
-    {
-        FloatV x = h.Sin->template Arg<0>();
-        Return(Log_(x));
+
+    std::string constant(float v) {
+        auto &c = constants[std::bit_cast<uint32_t>(v)];
+        if (c.empty()) {
+            c = F();
+            line("mov.f32 " + c + ", " + fimm(v));
+        }
+        return c;
     }
-    h.Pow = std::make_unique<ftype2>(mod, "vpow");
-    h.Pow->setPure();
-    {
-        FloatV x = h.Pow->template Arg<0>();
-        FloatV y = h.Pow->template Arg<1>();
-        Return(h.Exp->Call(h.Log->Call(x) * y));
+
+    std::string constLoad(const ExprOp &op) {
+        switch (static_cast<LoadConstType>(op.imm.i)) {
+        case LoadConstType::N:
+            if (n.empty()) {
+                n = F();
+                line("ld.param.f32 " + n + ", [p_n]");
+            }
+            return n;
+        case LoadConstType::X:
+            if (xf.empty()) {
+                xf = F();
+                line("cvt.rn.f32.u32 " + xf + ", " + x);
+            }
+            return xf;
+        case LoadConstType::Y:
+            if (yf.empty()) {
+                yf = F();
+                line("cvt.rn.f32.u32 " + yf + ", " + y);
+            }
+            return yf;
+        case LoadConstType::Width:
+            return constant((float)width);
+        case LoadConstType::Height:
+            return constant((float)height);
+        default: {
+            const std::pair<int, std::string> key{ op.imm.i - static_cast<int>(LoadConstType::LAST), op.name };
+            if (key.first >= numInputs)
+                throw std::runtime_error("reference to undefined clip: " + op.name);
+            auto it = std::find(props.begin(), props.end(), key);
+            auto d = F();
+            line("ld.param.f32 " + d + ", [p_c" + std::to_string(it - props.begin()) + "]");
+            if (it == props.end())
+                props.push_back(key);
+            return d;
+        }
+        }
+    }
+
+    // Rounds half away from zero, like std::round.
+    std::string round(const std::string &v) {
+        auto a = F(), d = F();
+        line("abs.f32 " + a + ", " + v);
+        line("add.f32 " + a + ", " + a + ", " + fimm(0.5f));
+        line("cvt.rmi.f32.f32 " + a + ", " + a);
+        line("copysign.f32 " + d + ", " + v + ", " + a);
+        return d;
     }
 
-    return h;
-}
+    std::string toInt(const std::string &v) {
+        auto i = R();
+        line("cvt.rzi.s32.f32 " + i + ", " + round(v));
+        return i;
+    }
 
-template<int lanes>
-Compiled Compiler<lanes>::compile()
-{
-    if (ctx.cached) {
-        return ctx.getCached();
+    // exp2(r * log2(|l|)), negated for negative l and odd integer r, NaN for
+    // negative l and any other r, and 1 for r = 0.
+    std::string pow(const std::string &l, const std::string &r) {
+        auto a = F(), t = F(), neg = F(), d = F();
+        auto nonint = P(), odd = P(), negl = P(), q = P(), zero = P();
+        line("abs.f32 " + a + ", " + l);
+        line("lg2.approx.f32 " + a + ", " + a);
+        line("mul.f32 " + a + ", " + a + ", " + r);
+        line("ex2.approx.f32 " + a + ", " + a);
+        line("cvt.rzi.f32.f32 " + t + ", " + r);
+        line("setp.neu.f32 " + nonint + ", " + t + ", " + r);
+        line("mul.f32 " + t + ", " + r + ", " + fimm(0.5f));
+        line("cvt.rzi.f32.f32 " + neg + ", " + t);
+        line("setp.neu.f32 " + odd + ", " + neg + ", " + t);
+        line("setp.lt.f32 " + negl + ", " + l + ", " + fimm(0));
+        line("neg.f32 " + neg + ", " + a);
+        line("and.pred " + q + ", " + negl + ", " + odd);
+        line("selp.f32 " + a + ", " + neg + ", " + a + ", " + q);
+        line("and.pred " + q + ", " + negl + ", " + nonint);
+        line("selp.f32 " + a + ", " + fimm(std::numeric_limits<float>::quiet_NaN()) + ", " + a + ", " + q);
+        line("setp.eq.f32 " + zero + ", " + r + ", " + fimm(0));
+        line("selp.f32 " + d + ", " + fimm(1) + ", " + a + ", " + zero);
+        return d;
     }
 
-    using namespace rr;
-    Module mod;
+    const std::pair<std::string, std::string> &clip(int i) {
+        if (i < 0 || i >= numInputs || !vi[i])
+            throw std::runtime_error("reference to undefined clip: src" + std::to_string(i));
+        reads[i] = true;
+        auto &c = clips[i];
+        if (c.first.empty()) {
+            c.first = RD();
+            c.second = R();
+            line("ld.param.u64 " + c.first + ", [p_src" + std::to_string(i) + "]");
+            line("cvta.to.global.u64 " + c.first + ", " + c.first);
+            line("ld.param.u32 " + c.second + ", [p_pitch" + std::to_string(i) + "]");
+        }
+        return c;
+    }
 
-    std::map<std::pair<int, std::string>, int> paMap;
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        ExprOp &op = ctx.ops[i];
+    // Loads sample (xi, yi) of clip i, which must be within the plane.
+    std::string load(int i, const std::string &xi, const std::string &yi) {
+        const auto &c = clip(i);
+        const VSVideoFormat &f = vi[i]->format;
+        auto a = RD(), o = RD(), d = F();
+        line("mul.wide.u32 " + a + ", " + yi + ", " + c.second);
+        line("add.u64 " + a + ", " + a + ", " + c.first);
+        line("mul.wide.u32 " + o + ", " + xi + ", " + std::to_string(f.bytesPerSample));
+        line("add.u64 " + a + ", " + a + ", " + o);
+        if (f.sampleType == stFloat && f.bytesPerSample == 2) {
+            auto h = H();
+            line("ld.global.b16 " + h + ", [" + a + "]");
+            line("cvt.f32.f16 " + d + ", " + h);
+        } else if (f.sampleType == stFloat) {
+            line("ld.global.f32 " + d + ", [" + a + "]");
+        } else {
+            auto v = R();
+            line(std::string{ "ld.global." } + (f.bytesPerSample == 1 ? "u8 " : f.bytesPerSample == 2 ? "u16 " : "u32 ") + v + ", [" + a + "]");
+            line("cvt.rn.f32.u32 " + d + ", " + v);
+        }
+        return d;
+    }
 
-        constexpr int last = static_cast<int>(LoadConstType::LAST);
-        if (op.type != ExprOpType::CONST_LOAD || op.imm.i < last) continue;
+    // v + offset within [0, size), clamped or mirrored at the edges.
+    std::string coord(const std::string &v, int offset, int size, BoundaryCondition bc) {
+        if (offset == 0)
+            return v;
+        auto t = R();
+        if (bc == BoundaryCondition::Mirrored) {
+            auto u = R(), p = P();
+            line("add.s32 " + t + ", " + v + ", " + std::to_string(std::clamp(offset, -size, size)));
+            line("not.b32 " + u + ", " + t);
+            line("setp.lt.s32 " + p + ", " + t + ", 0");
+            line("selp.b32 " + t + ", " + u + ", " + t + ", " + p);
+            line("neg.s32 " + u + ", " + t);
+            line("add.s32 " + u + ", " + u + ", " + std::to_string(2 * size - 1));
+            line("setp.ge.s32 " + p + ", " + t + ", " + std::to_string(size));
+            line("selp.b32 " + t + ", " + u + ", " + t + ", " + p);
+        } else {
+            line("add.s32 " + t + ", " + v + ", " + std::to_string(offset));
+            line("max.s32 " + t + ", " + t + ", 0");
+            line("min.s32 " + t + ", " + t + ", " + std::to_string(size - 1));
+        }
+        return t;
+    }
 
-        int id = op.imm.i - last;
-        if (id >= ctx.numInputs)
-            throw std::runtime_error("reference to undefined clip: " + tok);
+    std::string relativeLoad(const ExprOp &op) {
+        auto &v = loads[{ op.imm.i, op.x, op.y, static_cast<int>(op.bc) }];
+        if (v.empty())
+            v = load(op.imm.i, coord(x, op.x, width, op.bc), coord(y, op.y, height, op.bc));
+        return v;
+    }
 
-        auto key = std::make_pair(id, op.name);
-        auto it = paMap.find(key);
-        if (it == paMap.end())
-            paMap.insert({key, (int)paMap.size()});
-        op.imm.i = last + paMap.at(key);
+    std::string clampInt(const std::string &i, int size) {
+        auto t = R();
+        line("max.s32 " + t + ", " + i + ", 0");
+        line("min.s32 " + t + ", " + t + ", " + std::to_string(size - 1));
+        return t;
     }
-    std::vector<Compiled::PropAccess> pa(paMap.size());
-    for (const auto &item: paMap) {
-        pa[item.second] = Compiled::PropAccess{ item.first.first, item.first.second };
+
+    std::string nearestLoad(int i, const std::string &absx, const std::string &absy) {
+        auto xi = R(), yi = R();
+        line("cvt.rni.s32.f32 " + xi + ", " + absx);
+        line("cvt.rni.s32.f32 " + yi + ", " + absy);
+        return load(i, clampInt(xi, width), clampInt(yi, height));
     }
 
-    std::map<std::string, int> varMap;
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        ExprOp &op = ctx.ops[i];
+    std::string bilinearLoad(int i, const std::string &absx, const std::string &absy) {
+        auto x0 = F(), y0 = F(), wx = F(), wy = F(), xi = R(), yi = R(), x1 = R(), y1 = R();
+        line("cvt.rmi.f32.f32 " + x0 + ", " + absx);
+        line("cvt.rmi.f32.f32 " + y0 + ", " + absy);
+        line("sub.f32 " + wx + ", " + absx + ", " + x0);
+        line("sub.f32 " + wy + ", " + absy + ", " + y0);
+        line("cvt.rzi.s32.f32 " + xi + ", " + x0);
+        line("cvt.rzi.s32.f32 " + yi + ", " + y0);
+        line("add.s32 " + x1 + ", " + xi + ", 1");
+        line("add.s32 " + y1 + ", " + yi + ", 1");
+        auto cx0 = clampInt(xi, width), cx1 = clampInt(x1, width), cy0 = clampInt(yi, height), cy1 = clampInt(y1, height);
+        auto lerp = [&](const std::string &a, const std::string &b, const std::string &w) {
+            auto t = F(), d = F();
+            line("sub.f32 " + t + ", " + b + ", " + a);
+            line("fma.rn.f32 " + d + ", " + t + ", " + w + ", " + a);
+            return d;
+        };
+        auto top = lerp(load(i, cx0, cy0), load(i, cx1, cy0), wx);
+        auto bottom = lerp(load(i, cx0, cy1), load(i, cx1, cy1), wx);
+        return lerp(top, bottom, wy);
+    }
 
-        if (op.type != ExprOpType::VAR_LOAD && op.type != ExprOpType::VAR_STORE) continue;
-        auto it = varMap.find(op.name);
-        if (it == varMap.end()) {
-            if (op.type == ExprOpType::VAR_LOAD)
-                throw std::runtime_error("reference to uninitialized variable: " + tok);
-            varMap.insert({ op.name, (int)varMap.size() });
+    // Stores v at (x, y) of the output, rounding and clamping integers like
+    // storeSample.
+    void store(const VSVideoFormat &f, const std::string &v) {
+        auto base = RD(), pitch = R(), a = RD(), o = RD();
+        line("ld.param.u64 " + base + ", [p_dst]");
+        line("cvta.to.global.u64 " + base + ", " + base);
+        line("ld.param.u32 " + pitch + ", [p_dpitch]");
+        line("mul.wide.u32 " + a + ", " + y + ", " + pitch);
+        line("add.u64 " + a + ", " + a + ", " + base);
+        line("mul.wide.u32 " + o + ", " + x + ", " + std::to_string(f.bytesPerSample));
+        line("add.u64 " + a + ", " + a + ", " + o);
+        if (f.sampleType == stFloat && f.bytesPerSample == 2) {
+            auto h = H();
+            line("cvt.rn.f16.f32 " + h + ", " + v);
+            line("st.global.b16 [" + a + "], " + h);
+        } else if (f.sampleType == stFloat) {
+            line("st.global.f32 [" + a + "], " + v);
+        } else {
+            auto t = F(), i = R();
+            line("max.f32 " + t + ", " + v + ", " + fimm(0));
+            line("min.f32 " + t + ", " + t + ", " + fimm((float)((1ll << f.bitsPerSample) - 1)));
+            line("cvt.rni.u32.f32 " + i + ", " + t); // saturates, unlike on the CPU
+            if (f.bitsPerSample > 24 && f.bitsPerSample < 32) // the float bound rounds up to 2^bits
+                line("min.u32 " + i + ", " + i + ", " + std::to_string((1ll << f.bitsPerSample) - 1));
+            line(std::string{ "st.global." } + (f.bytesPerSample == 1 ? "u8" : f.bytesPerSample == 2 ? "u16" : "u32") + " [" + a + "], " + i);
         }
-        op.imm.i = varMap.at(op.name);
     }
+};
 
-    Helper helpers = buildHelpers(mod);
+// The planes of one frame of every clip a kernel reads, and of the output,
+// on the GPU, along with the stream the frame is processed on.
+struct ExprCudaSlot {
+    CUstream stream = nullptr;
+    std::vector<CUdeviceptr> in; // per clip, nullptr unless read
+    CUdeviceptr out = nullptr;
+};
 
-    //            void *rwptrs, int strides[], float *props, int width, int height
-    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int)> function(mod, "procPlane");
+struct ExprCuda {
+    CUdevice device = 0;
+    CUcontext ctx = nullptr; // the primary context of device, retained
+    CUmodule module = nullptr;
+    struct Kernel {
+        CUfunction fn = nullptr;
+        std::vector<std::pair<int, std::string>> props;
+        std::vector<bool> reads;
+    } kernels[3];
+    bool gpuOutput = false;
+
+    // Plane p of clip i is offset[i][p] bytes into its buffer, with rows
+    // pitch[i][p] bytes apart; the output is clip numInputs.
+    std::vector<std::array<size_t, 3>> offset, pitch;
+    std::vector<size_t> size;
+
+    std::mutex lock;
+    std::condition_variable slotFree;
+    std::unique_ptr<ExprCudaSlot[]> slots;
+    int numSlots = 0;
+    std::vector<ExprCudaSlot *> freeSlots; // guarded by lock
+
+    ~ExprCuda() {
+        if (!ctx)
+            return;
+        cuCtxPushCurrent_v2(ctx);
+        for (int i = 0; i < numSlots; i++) {
+            auto &s = slots[i];
+            for (auto p : s.in)
+                if (p) cuMemFree_v2(p);
+            if (s.out) cuMemFree_v2(s.out);
+            if (s.stream) cuStreamDestroy_v2(s.stream);
+        }
+        if (module) cuModuleUnload(module);
+        cuCtxPopCurrent_v2(nullptr);
+        cuDevicePrimaryCtxRelease(device);
+    }
 
-    State state;
-    pointer rwptrs = function.Arg<0>();
-    Pointer<Int> strides = Pointer<Int>(Pointer<Byte>(function.Arg<1>()));
-    state.consts = Pointer<Float>(Pointer<Byte>(function.Arg<2>()));
-    state.width = function.Arg<3>();
-    state.height = function.Arg<4>();
+    ExprCudaSlot *acquire() {
+        std::unique_lock<std::mutex> guard(lock);
+        slotFree.wait(guard, [this]() { return !freeSlots.empty(); });
+        auto s = freeSlots.back();
+        freeSlots.pop_back();
+        return s;
+    }
 
-    for (size_t i = 0; i < varMap.size(); i++)
-        state.variables.push_back(Value(IntV(0)));
+    void release(ExprCudaSlot *s) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            freeSlots.push_back(s);
+        }
+        slotFree.notify_one();
+    }
+};
 
-    for (int i = 0; i < lanes; i++)
-        state.xvec = Insert(state.xvec, i, i);
+// Compiles the expressions of the processed planes of d into one module on
+// device, and allocates the buffers of numSlots frames in flight.
+static std::shared_ptr<ExprCuda> compileCuda(const ExprData *d, const std::string expr[3], const VSVideoInfo * const *vi, int mirror, int device, int numSlots, bool gpuOutput) {
+    if (!autoDllErrors.empty())
+        throw std::runtime_error("the cuda backend is unavailable: " + autoDllErrors.front());
+    auto cuda = std::make_shared<ExprCuda>();
+    cuda->gpuOutput = gpuOutput;
+
+    const VSVideoFormat &fo = d->vi.format;
+    std::string ptx = ".version 6.0\n.target sm_50\n.address_size 64\n\n";
+    for (int p = 0; p < fo.numPlanes; p++) {
+        if (d->plane[p] != poProcess)
+            continue;
+        auto tokens = tokenize(expr[p]);
+        std::vector<ExprOp> ops;
+        for (const auto &tok : tokens) {
+            auto op = decodeToken(tok);
+            if (op.bc == BoundaryCondition::Unspecified)
+                op.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
+            ops.push_back(op);
+        }
+        ExprOptimizer::run(ops, tokens, d->numInputs, false);
+        const int w = d->vi.width >> (p ? fo.subSamplingW : 0), h = d->vi.height >> (p ? fo.subSamplingH : 0);
+        PtxGenerator gen(ops, "expr" + std::to_string(p), fo, vi, d->numInputs, w, h);
+        ptx += gen.str() + "\n";
+        cuda->kernels[p].props = gen.props;
+        cuda->kernels[p].reads = gen.reads;
+    }
 
-    for (int i = 0; i < ctx.numInputs + 1; i++) {
-        state.wptrs.push_back(*Pointer<Pointer<Byte>>(rwptrs + sizeof(void *) * i));
-        state.strides.push_back(Int(strides[i]));
+    CUDA_CHECK(cuInit(0));
+    int count = 0;
+    CUDA_CHECK(cuDeviceGetCount(&count));
+    if (device < 0 || device >= count)
+        throw std::runtime_error("device_id " + std::to_string(device) + " is out of range, there are " + std::to_string(count) + " devices");
+    CUDA_CHECK(cuDeviceGet(&cuda->device, device));
+    CUDA_CHECK(cuDevicePrimaryCtxRetain(&cuda->ctx, cuda->device));
+    CUDA_CHECK(cuCtxPushCurrent_v2(cuda->ctx));
+    struct Pop { ~Pop() { cuCtxPopCurrent_v2(nullptr); } } pop;
+
+    char log[4096] = {};
+    CUjit_option options[] = { 5 /* CU_JIT_ERROR_LOG_BUFFER */, 6 /* CU_JIT_ERROR_LOG_BUFFER_SIZE_BYTES */ };
+    void *values[] = { log, reinterpret_cast<void *>((uintptr_t)sizeof log) };
+    if (cuModuleLoadDataEx(&cuda->module, ptx.c_str(), 2, options, values) != CUDA_SUCCESS)
+        throw std::runtime_error(std::string{ "unable to compile the kernels: " } + log);
+    for (int p = 0; p < fo.numPlanes; p++)
+        if (d->plane[p] == poProcess)
+            CUDA_CHECK(cuModuleGetFunction(&cuda->kernels[p].fn, cuda->module, ("expr" + std::to_string(p)).c_str()));
+
+    const int numClips = d->numInputs + 1;
+    cuda->offset.resize(numClips);
+    cuda->pitch.resize(numClips);
+    cuda->size.assign(numClips, 0);
+    for (int i = 0; i < numClips; i++) {
+        const VSVideoFormat &f = i < d->numInputs ? vi[i]->format : fo;
+        for (int p = 0; p < fo.numPlanes; p++) {
+            const size_t w = d->vi.width >> (p ? fo.subSamplingW : 0), h = d->vi.height >> (p ? fo.subSamplingH : 0);
+            cuda->pitch[i][p] = (w * f.bytesPerSample + 255) & ~(size_t)255;
+            cuda->offset[i][p] = cuda->size[i];
+            cuda->size[i] += cuda->pitch[i][p] * h;
+        }
     }
 
-    auto &y = state.y, &x = state.x;
-    For(y = 0, y < state.height, y++)
-    {
-        For(x = 0, x < state.width, x+=LANES*UNROLL)
-        {
-            for (int k = 0; k < UNROLL; k++)
-                buildOneIter(helpers, state);
+    cuda->numSlots = numSlots;
+    cuda->slots.reset(new ExprCudaSlot[numSlots]);
+    for (int k = 0; k < numSlots; k++) {
+        auto &s = cuda->slots[k];
+        CUDA_CHECK(cuStreamCreate(&s.stream, CU_STREAM_NON_BLOCKING));
+        s.in.assign(d->numInputs, nullptr);
+        for (int i = 0; i < d->numInputs; i++) {
+            bool read = false;
+            for (int p = 0; p < fo.numPlanes; p++)
+                read |= d->plane[p] == poProcess && cuda->kernels[p].reads[i];
+            if (read) {
+                CUDA_CHECK(cuMemAlloc_v2(&s.in[i], cuda->size[i]));
+                filterStatsBytes(d->perf, cuda->size[i]);
+            }
         }
+        if (!gpuOutput) {
+            CUDA_CHECK(cuMemAlloc_v2(&s.out, cuda->size[d->numInputs]));
+            filterStatsBytes(d->perf, cuda->size[d->numInputs]);
+        }
+        cuda->freeSlots.push_back(&s);
     }
-    Return();
+    return cuda;
+}
 
-    Compiled r { mod.acquire("proc"), pa };
-#ifdef USE_EXPR_CACHE
-    exprCache.insert({ctx.key(), r});
-#endif
-    return r;
+// Copies plane p of a frame, from the host or from its device frame df, to
+// the device at dst.
+static void uploadPlane(const VSFrame *f, const DeviceFrame *df, int p, CUdeviceptr dst, size_t pitch, CUstream stream, const VSAPI *vsapi) {
+    CUDA_MEMCPY2D mcp2d {};
+    if (df) {
+        mcp2d.srcMemoryType = CU_MEMORYTYPE_UNIFIED;
+        mcp2d.srcDevice = (CUdeviceptr)(static_cast<uint8_t *>(df->ptr) + df->offset[p]);
+        mcp2d.srcPitch = df->pitch[p];
+    } else {
+        mcp2d.srcMemoryType = CU_MEMORYTYPE_HOST;
+        mcp2d.srcHost = vsapi->getReadPtr(f, p);
+        mcp2d.srcPitch = vsapi->getStride(f, p);
+    }
+    mcp2d.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+    mcp2d.dstDevice = dst;
+    mcp2d.dstPitch = pitch;
+    mcp2d.WidthInBytes = vsapi->getFrameWidth(f, p) * vsapi->getVideoFrameFormat(f)->bytesPerSample;
+    mcp2d.Height = vsapi->getFrameHeight(f, p);
+    CUDA_CHECK(cuMemcpy2DAsync_v2(&mcp2d, stream));
+}
+
+// Computes the processed planes of dst on the GPU. With gpu_output, the
+// output and the planes copied from the first clip are left on the GPU.
+static void cudaProcess(const ExprData *d, int n, const std::vector<const VSFrame *> &src, VSFrame *dst, const std::function<float(int, const std::string &)> &getProp, VSCore *core, const VSAPI *vsapi) {
+    ExprCuda *cuda = d->cuda.get();
+    const VSVideoFormat &fo = d->vi.format;
+    std::vector<const DeviceFrame *> dfs(d->numInputs);
+    for (int i = 0; i < d->numInputs; i++)
+        dfs[i] = findDeviceFrame(src[i], vsapi);
+
+    struct Slot {
+        ExprCuda *cuda;
+        ExprCudaSlot *s;
+        ~Slot() {
+            cuStreamSynchronize(s->stream);
+            cuCtxPopCurrent_v2(nullptr);
+            cuda->release(s);
+        }
+    } slot{ cuda, cuda->acquire() };
+    CUDA_CHECK(cuCtxPushCurrent_v2(cuda->ctx));
+    ExprCudaSlot *s = slot.s;
+
+    std::unique_ptr<DeviceFrame> out;
+    CUdeviceptr outBuf = s->out;
+    if (cuda->gpuOutput) {
+        out.reset(new DeviceFrame);
+        out->ctx = cuda->ctx;
+        CUDA_CHECK(cuMemAlloc_v2(&out->ptr, cuda->size[d->numInputs]));
+        filterStatsBytes(d->perf, cuda->size[d->numInputs]);
+        CUcontext primary;
+        CUDA_CHECK(cuDevicePrimaryCtxRetain(&primary, cuda->device));
+        out->primary = cuda->device;
+        for (int p = 0; p < 3; p++) {
+            out->offset[p] = cuda->offset[d->numInputs][p];
+            out->pitch[p] = cuda->pitch[d->numInputs][p];
+            out->rows[p] = p < fo.numPlanes ? vsapi->getFrameHeight(dst, p) : 0;
+            out->rowBytes[p] = p < fo.numPlanes ? vsapi->getFrameWidth(dst, p) * fo.bytesPerSample : 0;
+        }
+        outBuf = out->ptr;
+    }
+    auto plane = [](CUdeviceptr base, size_t offset) { return (CUdeviceptr)(static_cast<uint8_t *>(base) + offset); };
+
+    for (int p = 0; p < fo.numPlanes; p++) {
+        const size_t dstPitch = cuda->pitch[d->numInputs][p];
+        CUdeviceptr dstPlane = plane(outBuf, cuda->offset[d->numInputs][p]);
+        if (d->plane[p] == poCopy && (out || dfs[0])) {
+            // The host planes of device frames are not written.
+            if (out) {
+                uploadPlane(src[0], dfs[0], p, dstPlane, dstPitch, s->stream, vsapi);
+            } else {
+                CUDA_MEMCPY2D mcp2d {};
+                mcp2d.srcMemoryType = CU_MEMORYTYPE_UNIFIED;
+                mcp2d.srcDevice = plane(dfs[0]->ptr, dfs[0]->offset[p]);
+                mcp2d.srcPitch = dfs[0]->pitch[p];
+                mcp2d.dstMemoryType = CU_MEMORYTYPE_HOST;
+                mcp2d.dstHost = vsapi->getWritePtr(dst, p);
+                mcp2d.dstPitch = vsapi->getStride(dst, p);
+                mcp2d.WidthInBytes = dfs[0]->rowBytes[p];
+                mcp2d.Height = dfs[0]->rows[p];
+                CUDA_CHECK(cuMemcpy2DAsync_v2(&mcp2d, s->stream));
+            }
+            continue;
+        }
+        if (d->plane[p] != poProcess)
+            continue;
+
+        const auto &k = cuda->kernels[p];
+        std::vector<CUdeviceptr> srcPlanes(d->numInputs, nullptr);
+        std::vector<unsigned> pitches(d->numInputs, 0);
+        for (int i = 0; i < d->numInputs; i++) {
+            if (!k.reads[i])
+                continue;
+            if (dfs[i] && dfs[i]->ctx == cuda->ctx) {
+                // Already in this context.
+                srcPlanes[i] = plane(dfs[i]->ptr, dfs[i]->offset[p]);
+                pitches[i] = dfs[i]->pitch[p];
+                continue;
+            }
+            srcPlanes[i] = plane(s->in[i], cuda->offset[i][p]);
+            pitches[i] = cuda->pitch[i][p];
+            uploadPlane(src[i], dfs[i], p, srcPlanes[i], pitches[i], s->stream, vsapi);
+        }
+
+        float fn = (float)n;
+        unsigned dpitch = dstPitch;
+        std::vector<float> consts;
+        for (const auto &pa : k.props)
+            consts.push_back(getProp(pa.first, pa.second));
+        std::vector<void *> args = { &dstPlane, &dpitch, &fn };
+        for (int i = 0; i < d->numInputs; i++) {
+            args.push_back(&srcPlanes[i]);
+            args.push_back(&pitches[i]);
+        }
+        for (auto &c : consts)
+            args.push_back(&c);
+        const unsigned w = vsapi->getFrameWidth(dst, p), h = vsapi->getFrameHeight(dst, p);
+        CUDA_CHECK(cuLaunchKernel(k.fn, (w + 31) / 32, (h + 7) / 8, 1, 32, 8, 1, 0, s->stream, args.data(), nullptr));
+
+        if (!out) {
+            CUDA_MEMCPY2D mcp2d {};
+            mcp2d.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+            mcp2d.srcDevice = dstPlane;
+            mcp2d.srcPitch = dstPitch;
+            mcp2d.dstMemoryType = CU_MEMORYTYPE_HOST;
+            mcp2d.dstHost = vsapi->getWritePtr(dst, p);
+            mcp2d.dstPitch = vsapi->getStride(dst, p);
+            mcp2d.WidthInBytes = w * fo.bytesPerSample;
+            mcp2d.Height = h;
+            CUDA_CHECK(cuMemcpy2DAsync_v2(&mcp2d, s->stream));
+        }
+    }
+    {
+        GpuWaitTimer wait(d->perf);
+        CUDA_CHECK(cuStreamSynchronize(s->stream));
+    }
+    setDeviceFrame(dst, out.release(), core, vsapi);
+}
+#endif // HAVE_CUDA
+
+static void countCacheHits(const ExprData *d, const Compiled *compiled) {
+    for (int i = 0; i < 3; i++)
+        if (compiled[i].routine && compiled[i].stats.cacheHit)
+            filterStatsCacheHits(d->perf, 1);
+}
+
+// The property of the frames of the hidden node of Expr with outputs > 1 that
+// holds the frame of the given output.
+static std::string exprOutputKey(int output) {
+    return "_ExprOutput" + std::to_string(output);
 }
 
 static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
@@ -1414,62 +5141,287 @@ static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void *inst
 
     if (activationReason == arInitial) {
         for (int i = 0; i < numInputs; i++)
-            vsapi->requestFrameFilter(n, d->node[i], frameCtx);
+            if (d->alias[i] == i)
+                vsapi->requestFrameFilter(d->frameOf(i, n), d->node[i], frameCtx);
     } else if (activationReason == arAllFramesReady) {
-        std::vector<const VSFrame *> src(numInputs, nullptr);
+        // The buffers of the per-frame setup are grown once per thread, so
+        // that the setup does not allocate; tiny frames are dominated by it.
+        thread_local std::vector<const VSFrame *> src;
+        src.assign(numInputs, nullptr);
         for (int i = 0; i < numInputs; i++)
-            src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
+            src[i] = d->alias[i] == i ? vsapi->getFrameFilter(d->frameOf(i, n), d->node[i], frameCtx) : vsapi->addFrameRef(src[d->alias[i]]);
 
         const VSVideoFormat fi = d->vi.format;
         int height = vsapi->getFrameHeight(src[0], 0);
         int width = vsapi->getFrameWidth(src[0], 0);
         int planes[3] = { 0, 1, 2 };
-        const VSFrame *srcf[3] = { d->plane[0] != poCopy ? nullptr : src[0], d->plane[1] != poCopy ? nullptr : src[0], d->plane[2] != poCopy ? nullptr : src[0] };
+        const VSFrame *srcf[3];
+        for (int i = 0; i < 3; i++)
+            srcf[i] = d->plane[i] == poCopy || d->reduce[i] != ReduceMode::None ? src[0] : nullptr;
         VSFrame *dst = vsapi->newVideoFrame2(&fi, width, height, srcf, planes, src[0], core);
+        filterStatsBytes(d->perf, filterStatsFrameSize(dst, vsapi));
+
+        union U {
+            int i;
+            float f;
+            U(int i = 0) : i(i) {}
+            U(float f) : f(f) {}
+        };
+        // XXX: should we warn the user about missing properties?
+        // Every property the routines load is in d->props, so frames need no
+        // snapshots without them. Each property is read once per frame, however
+        // many planes load it.
+        FrameKeys keys;
+        if (d->props.size()) {
+            keys.reserve(numInputs);
+            for (int i = 0; i < numInputs; i++)
+                keys.push_back({ d->node[i], d->frameOf(i, n) });
+        }
+        FrameProperties frameProps(d->props, src, std::move(keys), std::nanf(""), vsapi);
+        auto getProp = [&](int clip, const std::string &name) { return frameProps.get(clip, name); };
+        thread_local std::vector<U> consts;
+        auto loadConsts = [&](const Compiled &compiled) {
+            consts.assign(1, U(n));
+            for (const auto &pa : compiled.propAccess)
+                consts.push_back(getProp(pa.clip, pa.name));
+            return reinterpret_cast<float *>(consts.data());
+        };
+
+        // Reduced planes write one partial result per row, which are folded
+        // into a frame property once the plane is done.
+        std::vector<float> rowReduce[3];
+        auto beginReduce = [&](int plane) -> float * {
+            if (d->reduce[plane] == ReduceMode::None)
+                return nullptr;
+            float identity = d->reduce[plane] == ReduceMode::Min ? std::numeric_limits<float>::infinity()
+                : d->reduce[plane] == ReduceMode::Max ? -std::numeric_limits<float>::infinity() : 0.0f;
+            rowReduce[plane].assign(vsapi->getFrameHeight(dst, plane), identity);
+            return rowReduce[plane].data();
+        };
+        auto endReduce = [&]() {
+            VSMap *props = vsapi->getFramePropertiesRW(dst);
+            for (int plane = 0; plane < d->vi.format.numPlanes; plane++) {
+                const auto &rows = rowReduce[plane];
+                if (d->reduce[plane] == ReduceMode::None)
+                    continue;
+                double r;
+                if (d->reduce[plane] == ReduceMode::Min)
+                    r = *std::min_element(rows.begin(), rows.end());
+                else if (d->reduce[plane] == ReduceMode::Max)
+                    r = *std::max_element(rows.begin(), rows.end());
+                else
+                    r = std::accumulate(rows.begin(), rows.end(), 0.0);
+                if (d->reduce[plane] == ReduceMode::Average)
+                    r /= (double)vsapi->getFrameWidth(dst, plane) * vsapi->getFrameHeight(dst, plane);
+                vsapi->mapSetFloat(props, ("ExprReduce" + std::to_string(plane)).c_str(), r, maReplace);
+            }
+        };
+
+        for (int plane = 0; plane < d->vi.format.numPlanes; plane++)
+            if (d->plane[plane] == poLut)
+                lutPlane(d, plane, src, dst, vsapi);
+
+#ifdef HAVE_CUDA
+        if (d->cuda) {
+            try {
+                cudaProcess(d, n, src, dst, getProp, core, vsapi);
+            } catch (std::runtime_error &e) {
+                vsapi->setFilterError((std::string{ "Expr: " } + e.what()).c_str(), frameCtx);
+                vsapi->freeFrame(dst);
+                dst = nullptr;
+            }
+            for (int i = 0; i < numInputs; i++)
+                vsapi->freeFrame(src[i]);
+            return dst;
+        }
+#endif
+
+        if (!d->ready.load(std::memory_order_acquire)) {
+            for (int plane = 0; plane < d->vi.format.numPlanes; plane++)
+                if (d->plane[plane] == poProcess)
+                    interpretPlane(d, plane, n, src, dst, beginReduce(plane), getProp, vsapi);
+            endReduce();
+            for (int i = 0; i < numInputs; i++)
+                vsapi->freeFrame(src[i]);
+            return dst;
+        }
+        if (!d->compileError.empty()) {
+            vsapi->setFilterError(d->compileError.c_str(), frameCtx);
+            for (int i = 0; i < numInputs; i++)
+                vsapi->freeFrame(src[i]);
+            vsapi->freeFrame(dst);
+            return nullptr;
+        }
+
+        // Pick the routines specialised on this frame's property values,
+        // compiling them if this set of values has not been seen before.
+        const Compiled *compiled = d->compiled;
+        const ExprData::ProcessProc *proc = d->proc;
+        if (d->retier) {
+            if (d->tieredReady.load(std::memory_order_acquire)) {
+                compiled = d->tiered;
+                proc = d->tieredProc;
+            } else if (d->hot.fetch_add(1, std::memory_order_relaxed) + 1 == EXPR_TIER_FRAMES) {
+                // Keeps using the first routines if the recompilation fails.
+                d->compiler = std::thread([d]() {
+                    try {
+                        d->retier();
+                        d->tieredReady.store(true, std::memory_order_release);
+                    } catch (...) {
+                    }
+                });
+            }
+        }
+        if (!d->uniforms.empty()) {
+            thread_local std::vector<float> values;
+            values.clear();
+            for (const auto &u: d->uniforms)
+                values.push_back(getProp(u.first, u.second));
+
+            auto same = [&](const std::vector<float> &v) {
+                return std::memcmp(v.data(), values.data(), values.size() * sizeof(float)) == 0;
+            };
+            auto find = [&]() {
+                return std::find_if(d->specs.begin(), d->specs.end(), [&](const ExprData::Specialization &s) { return same(s.values); });
+            };
+            // Frames with values that another frame is compiling wait for it,
+            // like claims of exprCache; the compilation itself runs unlocked.
+            std::unique_lock<std::mutex> guard(d->specLock);
+            auto it = find();
+            while (it == d->specs.end() && std::any_of(d->specPending.begin(), d->specPending.end(), same)) {
+                d->specReady.wait(guard);
+                it = find();
+            }
+            if (it == d->specs.end() && d->specs.size() + d->specPending.size() < EXPR_SPECIALIZE_LIMIT) {
+                d->specPending.push_back(values);
+                guard.unlock();
+                Uniforms uniforms;
+                for (size_t i = 0; i < values.size(); i++)
+                    uniforms[d->uniforms[i]] = values[i];
+                ExprData::Specialization spec{ values };
+                std::string error;
+                try {
+                    d->specialize(uniforms, spec.compiled, spec.proc);
+                    countCacheHits(d, spec.compiled);
+                } catch (std::exception &e) {
+                    error = e.what();
+                } catch (...) {
+                    error = "compilation failed";
+                }
+                guard.lock();
+                d->specPending.erase(std::find_if(d->specPending.begin(), d->specPending.end(), same));
+                if (error.empty())
+                    it = d->specs.insert(d->specs.end(), std::move(spec));
+                d->specReady.notify_all();
+                if (!error.empty()) {
+                    guard.unlock();
+                    vsapi->setFilterError((std::string{ "Expr: " } + error).c_str(), frameCtx);
+                    for (int i = 0; i < numInputs; i++)
+                        vsapi->freeFrame(src[i]);
+                    vsapi->freeFrame(dst);
+                    return nullptr;
+                }
+            }
+            guard.unlock();
+            // Beyond the limit, the property probably isn't discrete; use the generic routines.
+            if (it != d->specs.end()) {
+                compiled = it->compiled;
+                proc = it->proc;
+            }
+        }
 
-        std::vector<uint8_t *> rwptrs(numInputs + 1, nullptr);
-        std::vector<int> strides(numInputs + 1, 0);
+        // The frames of the outputs past the first, written by the same
+        // routines and handed over attached to dst.
+        std::vector<VSFrame *> extra;
+        for (int k = 1; k < d->outputs; k++) {
+            extra.push_back(vsapi->newVideoFrame2(&fi, width, height, srcf, planes, src[0], core));
+            filterStatsBytes(d->perf, filterStatsFrameSize(extra.back(), vsapi));
+        }
 
+        // A fused routine takes numInputs+1 pointers per processed plane, and
+        // the pointers of the extra outputs follow those of the inputs.
+        int groups = d->fused ? d->vi.format.numPlanes : 1;
+        thread_local std::vector<uint8_t *> rwptrs;
+        thread_local std::vector<int> strides, bytes;
+        rwptrs.assign((numInputs + 1) * groups + extra.size(), nullptr);
+        strides.assign(rwptrs.size(), 0);
+        bytes.assign(rwptrs.size(), 0);
+
+        // Planes that read horizontal passes, of the groups when fused.
+        std::vector<int> groupPlanes;
+        int passPlanes = 0;
+        for (const auto &p: d->passes)
+            passPlanes |= p.planes;
+
+        int group = 0;
         for (int plane = 0; plane < d->vi.format.numPlanes; plane++) {
             if (d->plane[plane] != poProcess)
                 continue;
 
-            strides[0] = vsapi->getStride(dst, plane);
-            for (int i = 0; i < numInputs; i++) {
+            int base = group * (numInputs + 1);
+            strides[base] = vsapi->getStride(dst, plane);
+            for (int i = 0; i < d->firstPass; i++) {
                 if (d->node[i]) {
-                    rwptrs[i + 1] = (uint8_t *)vsapi->getReadPtr(src[i], plane);
-                    strides[i + 1] = vsapi->getStride(src[i], plane);
+                    rwptrs[base + i + 1] = (uint8_t *)vsapi->getReadPtr(src[i], plane);
+                    strides[base + i + 1] = vsapi->getStride(src[i], plane);
+                    bytes[base + i + 1] = vsapi->getVideoFrameFormat(src[i])->bytesPerSample;
                 }
             }
 
-            rwptrs[0] = vsapi->getWritePtr(dst, plane);
+            // Reduced planes write one entry per row instead.
+            rwptrs[base] = d->reduce[plane] != ReduceMode::None ? reinterpret_cast<uint8_t *>(beginReduce(plane)) : vsapi->getWritePtr(dst, plane);
+            if (d->reduce[plane] == ReduceMode::None)
+                bytes[base] = fi.bytesPerSample;
+            for (size_t k = 0; k < extra.size(); k++) {
+                rwptrs[numInputs + 1 + k] = vsapi->getWritePtr(extra[k], plane);
+                strides[numInputs + 1 + k] = vsapi->getStride(extra[k], plane);
+                bytes[numInputs + 1 + k] = fi.bytesPerSample;
+            }
             int h = vsapi->getFrameHeight(dst, plane);
             int w = vsapi->getFrameWidth(dst, plane);
 
-            union U {
-                int i;
-                float f;
-                U(int i = 0) : i(i) {}
-                U(float f) : f(f) {}
-            };
-            std::vector<U> consts = { n };
-            for (const auto &pa : d->compiled[plane].propAccess) {
-                auto m = vsapi->getFramePropertiesRO(src[pa.clip]);
-                int err = 0;
-                float val = vsapi->mapGetInt(m, pa.name.c_str(), 0, &err);
-                if (err == peType)
-                    val = vsapi->mapGetFloat(m, pa.name.c_str(), 0, &err);
-                if (err == peType) {
-                    auto d = vsapi->mapGetData(m, pa.name.c_str(), 0, &err);
-                    if (d) val = d[0];
-                }
-                if (err != 0)
-                    val = std::nanf(""); // XXX: should we warn the user?
-                consts.push_back(val);
+            if (d->fused) {
+                groupPlanes.push_back(plane);
+                group++;
+                continue;
+            }
+
+            if (passPlanes & (1 << plane)) {
+                runPasses(d, proc[plane], { plane }, &rwptrs[0], &strides[0], rwptrs.size(), loadConsts(compiled[plane]), w, h, src, vsapi);
+                continue;
             }
+            if (compiled[plane].mergeRows)
+                mergeRows(&strides[base], &bytes[base], numInputs + d->outputs, d->threads, w, h);
+            runStrips(proc[plane], d->threads, &rwptrs[0], &strides[0], loadConsts(compiled[plane]), w, h);
+        }
 
-            ExprData::ProcessProc proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(d->compiled[plane].routine->getEntry()));
-            proc(&rwptrs[0], &strides[0], reinterpret_cast<float*>(&consts[0]), w, h);
+        if (d->fused) {
+            int w = d->vi.width, h = d->vi.height;
+            if (passPlanes) {
+                runPasses(d, proc[0], groupPlanes, &rwptrs[0], &strides[0], rwptrs.size(), loadConsts(compiled[0]), w, h, src, vsapi);
+            } else {
+                if (compiled[0].mergeRows)
+                    mergeRows(&strides[0], &bytes[0], bytes.size(), d->threads, w, h);
+                runStrips(proc[0], d->threads, &rwptrs[0], &strides[0], loadConsts(compiled[0]), w, h);
+            }
+        }
+        endReduce();
+
+        for (size_t k = 0; k < extra.size(); k++)
+            vsapi->mapConsumeFrame(vsapi->getFramePropertiesRW(dst), exprOutputKey((int)k + 1).c_str(), extra[k], maReplace);
+
+        if (d->stats) {
+            VSMap *props = vsapi->getFramePropertiesRW(dst);
+            for (int i = 0; i < (d->fused ? 1 : d->vi.format.numPlanes); i++) {
+                if (!compiled[i].routine)
+                    continue;
+                const Compiled::Stats &st = compiled[i].stats;
+                vsapi->mapSetFloat(props, "ExprParseTime", st.parseTime, maAppend);
+                vsapi->mapSetFloat(props, "ExprOptimizeTime", st.optimizeTime, maAppend);
+                vsapi->mapSetFloat(props, "ExprCodegenTime", st.codegenTime, maAppend);
+                vsapi->mapSetInt(props, "ExprCodeSize", (int64_t)st.codeBytes, maAppend);
+                vsapi->mapSetInt(props, "ExprCacheHit", st.cacheHit, maAppend);
+            }
         }
 
         for (int i = 0; i < numInputs; i++) {
@@ -1481,16 +5433,344 @@ static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void *inst
     return nullptr;
 }
 
+// Rewrites the references to clips whose node is also an earlier clip (e.g.
+// clips=[c, c, mask]) to that clip, where canonical[i] is the first clip with
+// the node of clip i, so that the compiled code loads the pixels once.
+static std::string bindDuplicates(const std::string &expr, const std::vector<int> &canonical) {
+    static const std::regex clipRefRe { "^([a-z]|" + clipNamePrefix + "[0-9]+)([\\[.{].*)?$" };
+    std::string out;
+    for (const auto &tok: tokenize(expr)) {
+        std::smatch match;
+        std::string t = tok;
+        if (std::regex_match(tok, match, clipRefRe)) {
+            int clip = clipIndex(match[1].str());
+            if (clip >= 0 && clip < (int)canonical.size() && canonical[clip] != clip)
+                t = clipNamePrefix + std::to_string(canonical[clip]) + match[2].str();
+        }
+        if (!out.empty())
+            out += ' ';
+        out += t;
+    }
+    return out;
+}
+
+// Returns the RPN sum of the given (weight, expression) terms, with the
+// expressions of equal weight added before they are multiplied, and those of
+// weight 0 left out. Empty if all are.
+static std::string weightedSum(const std::vector<std::pair<float, std::string>> &terms) {
+    std::vector<std::pair<float, std::string>> groups;
+    for (const auto &[w, e]: terms) {
+        if (w == 0.0f || e.empty())
+            continue;
+        auto it = std::find_if(groups.begin(), groups.end(), [w = w](const auto &g) { return g.first == w; });
+        if (it == groups.end())
+            groups.push_back({ w, e });
+        else
+            it->second += ' ' + e + " +";
+    }
+    std::string out;
+    for (const auto &[w, e]: groups) {
+        std::string term = e;
+        if (w != 1.0f) {
+            char buf[32];
+            auto r = std::to_chars(buf, buf + sizeof(buf), w);
+            term += ' ' + std::string(buf, r.ptr) + " *";
+        }
+        out += out.empty() ? term : ' ' + term + " +";
+    }
+    return out;
+}
+
+// Parses the kernel spec of the convolution token tok into its matrix of
+// weights. A single row is applied in both directions, i.e. stands for the
+// outer product with itself.
+static std::vector<std::vector<float>> parseKernel(const std::string &spec, const std::string &tok) {
+    std::vector<std::vector<float>> m;
+    size_t begin = 0;
+    do {
+        size_t end = spec.find(';', begin);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::vector<float> row;
+        const char *p = spec.c_str() + begin, *rowEnd = spec.c_str() + end;
+        do {
+            float w;
+            auto r = std::from_chars(p, rowEnd, w);
+            if (r.ec != std::errc() || (r.ptr != rowEnd && *r.ptr != ','))
+                throw std::runtime_error("invalid convolution kernel: " + tok);
+            row.push_back(w);
+            p = r.ptr + 1;
+        } while (p <= rowEnd);
+        if (!m.empty() && row.size() != m[0].size())
+            throw std::runtime_error("convolution kernel rows differ in length: " + tok);
+        m.push_back(std::move(row));
+        begin = end + 1;
+    } while (begin <= spec.size());
+    if (m.size() % 2 == 0 || m[0].size() % 2 == 0)
+        throw std::runtime_error("convolution kernel dimensions must be odd: " + tok);
+
+    if (m.size() == 1) {
+        const std::vector<float> row = m[0];
+        m.assign(row.size(), row);
+        for (size_t j = 0; j < row.size(); j++)
+            for (auto &w: m[j])
+                w *= row[j];
+    }
+    return m;
+}
+
+// Splits m into the outer product of the column v and the row h, if it has
+// rank 1 and is wider and taller than a single pixel, so that it can be
+// applied as a horizontal and a vertical pass (see bindSeparable).
+static bool separateKernel(const std::vector<std::vector<float>> &m, std::vector<float> &h, std::vector<float> &v) {
+    if (m.size() < 3 || m[0].size() < 3)
+        return false;
+    float largest = 0.0f;
+    for (const auto &row: m)
+        for (float w: row)
+            largest = std::max(largest, std::fabs(w));
+    auto pivotRow = std::find_if(m.begin(), m.end(), [](const auto &row) { return std::any_of(row.begin(), row.end(), [](float w) { return w != 0.0f; }); });
+    if (pivotRow == m.end())
+        return false;
+    h = *pivotRow;
+    const size_t k = std::find_if(h.begin(), h.end(), [](float w) { return w != 0.0f; }) - h.begin();
+    v.clear();
+    for (const auto &row: m) {
+        v.push_back(row[k] / h[k]);
+        for (size_t i = 0; i < h.size(); i++)
+            if (std::fabs(row[i] - v.back() * h[i]) > 1e-6f * largest)
+                return false;
+    }
+    return true;
+}
+
+// Returns the RPN of the sum of the (weight, tap) terms of a kernel,
+// normalised to sum to 1 (unless the weights of the kernel, which add up to
+// total, sum to 0).
+static std::string normalisedSum(const std::vector<std::pair<float, std::string>> &taps, float total) {
+    const float scale = total != 0.0f ? 1.0f / total : 1.0f;
+    // Normalised last, so that integer weights keep integer clips in integer arithmetic.
+    const std::string out = weightedSum({ { scale, weightedSum(taps) } });
+    return out.empty() ? "0" : out;
+}
+
+// Rewrites the convolution token tok, i.e. clip[conv:spec]suffix, into
+// relative accesses of clip weighted by the kernel spec.
+static std::string expandConvolution(const std::string &clip, const std::string &spec, const std::string &suffix, const std::string &tok) {
+    const auto m = parseKernel(spec, tok);
+    float total = 0.0f;
+    for (const auto &row: m)
+        total = std::accumulate(row.begin(), row.end(), total);
+    const int rx = (int)m[0].size() / 2, ry = (int)m.size() / 2;
+    std::vector<std::pair<float, std::string>> taps;
+    for (int j = 0; j < (int)m.size(); j++)
+        for (int i = 0; i < (int)m[j].size(); i++)
+            taps.push_back({ m[j][i], clip + "[" + std::to_string(i - rx) + "," + std::to_string(j - ry) + "]" + suffix });
+    return normalisedSum(taps, total);
+}
+
+static const std::regex &convolutionRe() {
+    static const std::regex re { "^((?:[a-z]|" + clipNamePrefix + "[0-9]+)(?:\\{[+-]?[0-9]+\\})?)\\[conv:([^\\]]*)\\](:[cm])?$" };
+    return re;
+}
+
+// Convolution (x[conv:k], Expr only). k is a row of weights applied
+// horizontally and vertically (e.g. x[conv:1,4,6,4,1]) or a matrix with rows
+// separated by ';'. With separable, kernels that separateKernel() splits are
+// left for bindSeparable; all others are rewritten into relative accesses
+// here, one per tap.
+static std::string expandConvolutions(const std::string &expr, bool separable) {
+    std::string out;
+    for (const auto &tok: tokenize(expr)) {
+        std::smatch match;
+        std::string t = tok;
+        if (std::regex_match(tok, match, convolutionRe())) {
+            std::vector<float> h, v;
+            if (!separable || !separateKernel(parseKernel(match[2].str(), tok), h, v))
+                t = expandConvolution(match[1].str(), match[2].str(), match[3].str(), tok);
+        }
+        if (!out.empty())
+            out += ' ';
+        out += t;
+    }
+    return out;
+}
+
+// Separable convolution tokens left by expandConvolutions, by then of the form
+// srcN[conv:k]suffix, are split into a horizontal pass of input N with the
+// row of the kernel, which becomes input first+k for the k-th pass (see
+// ExprData::SeparablePass), and a vertical pass, i.e. relative accesses of
+// that input weighted by the column of the kernel. Convolutions of the same
+// input and row with the same boundary condition share their pass.
+static std::string bindSeparable(const std::string &expr, int plane, int first, std::vector<ExprData::SeparablePass> &passes) {
+    std::string out;
+    for (const auto &tok: tokenize(expr)) {
+        std::smatch match;
+        std::string t = tok;
+        if (std::regex_match(tok, match, convolutionRe())) {
+            std::vector<float> h, v;
+            separateKernel(parseKernel(match[2].str(), tok), h, v);
+            const std::string suffix = match[3].str();
+            const BoundaryCondition bc = suffix == ":m" ? BoundaryCondition::Mirrored : suffix == ":c" ? BoundaryCondition::Clamped : BoundaryCondition::Unspecified;
+            const int input = clipIndex(match[1].str());
+            if (input < 0 || input >= first)
+                throw std::runtime_error("reference to undefined clip: " + tok);
+            auto it = std::find_if(passes.begin(), passes.end(), [&](const ExprData::SeparablePass &p) { return p.input == input && p.weights == h && p.bc == bc; });
+            if (it == passes.end())
+                it = passes.insert(passes.end(), { input, h, bc });
+            const int ry = (int)v.size() / 2;
+            it->radius = std::max(it->radius, ry);
+            it->planes |= 1 << plane;
+
+            const std::string name = clipNamePrefix + std::to_string(first + (it - passes.begin()));
+            std::vector<std::pair<float, std::string>> taps;
+            for (int j = 0; j < (int)v.size(); j++)
+                taps.push_back({ v[j], name + "[0," + std::to_string(j - ry) + "]" + suffix });
+            t = normalisedSum(taps, std::accumulate(h.begin(), h.end(), 0.0f) * std::accumulate(v.begin(), v.end(), 0.0f));
+        }
+        if (!out.empty())
+            out += ' ';
+        out += t;
+    }
+    return out;
+}
+
+// Temporal pixel access (x{N}, x{N}[x,y] and x{N}[], Expr only) reads frame
+// n+N of a clip, clamped to its length. Every distinct (clip, N) with N != 0 is
+// a tap, an extra input after the clips, and the tokens are rewritten to load
+// from the tap as if it were a clip of its own. Unlike clips shifted with
+// std.Trim, the taps share the node, and so the cache, of their clip.
+static std::string bindTemporal(const std::string &expr, int numClips, std::vector<std::pair<int, int>> &taps) {
+    std::string out;
+    for (const auto &tok: tokenize(expr)) {
+        std::smatch match;
+        std::string t = tok;
+        if (std::regex_match(tok, match, temporalPixelRe())) {
+            int clip = clipIndex(match[1].str()), dn = atoi(match[2].str().c_str());
+            if (clip < 0 || clip >= numClips)
+                throw std::runtime_error("reference to undefined clip: " + tok);
+            std::string rest = match[3].str();
+            if (dn == 0) {
+                t = match[1].str() + rest;
+            } else {
+                auto it = std::find(taps.begin(), taps.end(), std::make_pair(clip, dn));
+                if (it == taps.end())
+                    it = taps.insert(taps.end(), { clip, dn });
+                t = clipNamePrefix + std::to_string(numClips + (it - taps.begin())) + rest;
+            }
+        }
+        if (!out.empty())
+            out += ' ';
+        out += t;
+    }
+    return out;
+}
+
 static void VS_CC exprFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(instanceData);
+    propSnapshotRelease(d->node);
     for (auto *p: d->node)
         vsapi->freeNode(p);
     delete d;
 }
 
+// One of the clips returned by Expr with outputs > 1. All outputs are
+// computed together by a hidden Expr node, whose frames carry the frames of
+// the other outputs as properties; that node is cached, so each frame is only
+// computed once however the outputs are requested.
+struct ExprOutputData {
+    VSNode *node;
+    int index;
+    int outputs;
+};
+
+static const VSFrame *VS_CC exprOutputGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    ExprOutputData *d = static_cast<ExprOutputData *>(instanceData);
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrame *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+        const VSFrame *dst;
+        if (d->index == 0) {
+            VSFrame *f = vsapi->copyFrame(src, core);
+            VSMap *props = vsapi->getFramePropertiesRW(f);
+            for (int k = 1; k < d->outputs; k++)
+                vsapi->mapDeleteKey(props, exprOutputKey(k).c_str());
+            dst = f;
+        } else {
+            int err;
+            dst = vsapi->mapGetFrame(vsapi->getFramePropertiesRO(src), exprOutputKey(d->index).c_str(), 0, &err);
+            if (err)
+                vsapi->setFilterError("Expr: output frame missing", frameCtx);
+        }
+        vsapi->freeFrame(src);
+        return dst;
+    }
+
+    return nullptr;
+}
+
+static void VS_CC exprOutputFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    ExprOutputData *d = static_cast<ExprOutputData *>(instanceData);
+    vsapi->freeNode(d->node);
+    delete d;
+}
+
+template<int lanes>
+static void compilePlanes(const ExprData *d, const std::string expr[3], const std::vector<std::string> &processed, const VSVideoInfo * const *vi, const VSAPI *vsapi, int optMask, int mirror, int unroll, int prefetch, const Uniforms &uniforms, Compiled compiled[3], ExprData::ProcessProc proc[3]) {
+    if (d->fused) {
+        compiled[0] = Compiler<lanes>::compileFused(processed, &d->vi, vi, vsapi, d->numInputs, optMask, mirror, unroll, prefetch, uniforms);
+        proc[0] = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(compiled[0].routine->getEntry()));
+        return;
+    }
+    // The planes are compiled in parallel. Identical expressions wait for the
+    // first of them in the compile cache, so they are still compiled once.
+    std::vector<int> planes;
+    for (int i = 0; i < d->vi.format.numPlanes; i++) {
+        if (d->plane[i] == poProcess)
+            planes.push_back(i);
+    }
+    std::exception_ptr errors[3];
+    auto compileOne = [&](int k) {
+        int i = planes[k];
+        try {
+            Compiler<lanes> comp(expr[i], &d->vi, vi, vsapi, d->numInputs, optMask, mirror, unroll, prefetch, uniforms, d->reduce[i], true, d->outputs);
+            compiled[i] = comp.compile();
+            proc[i] = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(compiled[i].routine->getEntry()));
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    if (planes.size() > 1)
+        parallelFor(static_cast<int>(planes.size()), compileOne);
+    else if (!planes.empty())
+        compileOne(0);
+    for (auto &e: errors) {
+        if (e)
+            std::rethrow_exception(e);
+    }
+}
+
+// Returns the (clip, name) pairs of all properties listed in names that are
+// referenced by the given expressions.
+static std::vector<std::pair<int, std::string>> findUniforms(const std::vector<std::string> &exprs, const std::set<std::string> &names, int numInputs) {
+    std::set<std::pair<int, std::string>> found;
+    for (const auto &expr: exprs) {
+        for (const auto &tok: tokenize(expr)) {
+            ExprOp op = decodeToken(tok);
+            constexpr int last = static_cast<int>(LoadConstType::LAST);
+            if (op.type == ExprOpType::CONST_LOAD && op.imm.i >= last && op.imm.i - last < numInputs && names.count(op.name))
+                found.insert({ op.imm.i - last, op.name });
+        }
+    }
+    return { found.begin(), found.end() };
+}
+
 static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<ExprData> d(new ExprData);
     int err;
+    workPoolReserve(core, vsapi);
 
     try {
         d->numInputs = vsapi->mapNumElements(in, "clips");
@@ -1517,10 +5797,12 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
                 throw std::runtime_error("All inputs must have the same number of planes and the same dimensions, subsampling included");
             }
 
+            // Integer samples of any depth are loaded from their 1, 2 or 4 byte
+            // containers directly, so e.g. 20 bit clips need no conversion.
             int bits = vi[i]->format.bitsPerSample;
-            if (((bits > 32 || (bits > 16 && bits < 32)) && vi[i]->format.sampleType == stInteger)
+            if ((bits > 32 && vi[i]->format.sampleType == stInteger)
                 || (bits != 16 && bits != 32 && vi[i]->format.sampleType == stFloat))
-                throw std::runtime_error("Input clips must be 8-16/32 bit integer or 16/32 bit float format");
+                throw std::runtime_error("Input clips must be 8-32 bit integer or 16/32 bit float format");
         }
 
         d->vi = *vi[0];
@@ -1555,28 +5837,291 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             expr[i] = expr[nexpr - 1];
         }
 
+        const int numClips = d->numInputs;
+        for (int i = 0; i < numClips; i++) {
+            int first = 0;
+            while (d->node[first] != d->node[i])
+                first++;
+            d->alias.push_back(first);
+        }
+        std::string backend = "cpu";
+        if (const char *b = vsapi->mapGetData(in, "backend", 0, &err); !err)
+            backend = b;
+        if (backend != "cpu" && backend != "cuda")
+            throw std::runtime_error("backend must be \"cpu\" or \"cuda\"");
+        const bool cuda = backend == "cuda";
+#ifndef HAVE_CUDA
+        if (cuda)
+            throw std::runtime_error("the cuda backend is not available in this build");
+#endif
+
+        // The cuda backend has no horizontal passes, and applies every
+        // convolution tap by tap.
+        std::vector<std::pair<int, int>> taps;
+        for (int i = 0; i < 3; i++)
+            expr[i] = bindTemporal(bindDuplicates(expandConvolutions(expr[i], !cuda), d->alias), numClips, taps);
+        d->firstPass = numClips + (int)taps.size();
+        for (int i = 0; i < 3; i++)
+            expr[i] = bindSeparable(expr[i], i, d->firstPass, d->passes);
+        for (int i = 0; i < numClips; i++) {
+            d->offset.push_back(0);
+            d->length.push_back(vi[i]->numFrames);
+        }
+        for (const auto &[clip, dn]: taps) {
+            d->node.push_back(vsapi->addNodeRef(d->node[clip]));
+            vi.push_back(vi[clip]);
+            d->alias.push_back((int)d->node.size() - 1);
+            d->offset.push_back(dn);
+            d->length.push_back(vi[clip]->numFrames);
+        }
+        // Passes use the frames of their input.
+        for (const auto &p: d->passes) {
+            VSVideoInfo pvi = *vi[p.input];
+            vsapi->queryVideoFormat(&pvi.format, pvi.format.colorFamily, stFloat, 32, pvi.format.subSamplingW, pvi.format.subSamplingH, core);
+            d->passVi.push_back(pvi);
+            d->node.push_back(vsapi->addNodeRef(d->node[p.input]));
+            d->alias.push_back(d->alias[p.input]);
+            d->offset.push_back(d->offset[p.input]);
+            d->length.push_back(d->length[p.input]);
+        }
+        for (const auto &pvi: d->passVi)
+            vi.push_back(&pvi);
+        d->numInputs = (int)d->node.size();
+
         int optMask = vsh::int64ToIntS(vsapi->mapGetInt(in, "opt", 0, &err));
         if (err) optMask = 0;
 
         int mirror = vsh::int64ToIntS(vsapi->mapGetInt(in, "boundary", 0, &err));
         if (err) mirror = 0;
+        for (auto &p: d->passes)
+            if (p.bc == BoundaryCondition::Unspecified)
+                p.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
 
+        d->threads = vsh::int64ToIntS(vsapi->mapGetInt(in, "threads", 0, &err));
+        if (err) d->threads = 1;
+        if (d->threads < 1)
+            throw std::runtime_error("threads must be at least 1");
+
+        d->outputs = vsh::int64ToIntS(vsapi->mapGetInt(in, "outputs", 0, &err));
+        if (err) d->outputs = 1;
+        if (d->outputs < 1)
+            throw std::runtime_error("outputs must be at least 1");
+
+        std::vector<std::string> processed;
         for (int i = 0; i < d->vi.format.numPlanes; i++) {
             if (!expr[i].empty()) {
                 d->plane[i] = poProcess;
+                processed.push_back(expr[i]);
             } else {
                 if (d->vi.format.bitsPerSample == vi[0]->format.bitsPerSample && d->vi.format.sampleType == vi[0]->format.sampleType)
                     d->plane[i] = poCopy;
                 else
                     d->plane[i] = poUndefined;
             }
+        }
+
+        const SimdConfig &host = hostSimd();
+        int lanes = vsh::int64ToIntS(vsapi->mapGetInt(in, "lanes", 0, &err));
+        if (err) lanes = host.lanes;
+        if (lanes != 4 && lanes != 8)
+            throw std::runtime_error("lanes must be 4 or 8");
+        int unroll = vsh::int64ToIntS(vsapi->mapGetInt(in, "unroll", 0, &err));
+        if (err) unroll = 0; // chosen per expression
+        if (unroll != 0 && unroll != 1 && unroll != 2 && unroll != 4)
+            throw std::runtime_error("unroll must be 0 (auto), 1, 2 or 4");
+        int prefetch = vsh::int64ToIntS(vsapi->mapGetInt(in, "prefetch", 0, &err));
+        if (err) prefetch = -1; // chosen per expression
+        if (prefetch < -1)
+            throw std::runtime_error("prefetch must be -1 (auto), 0 (off) or a number of rows");
+
+        // Bypass the caches for output planes that wouldn't stay resident anyway,
+        // leaving the cache to the inputs.
+        int stream = vsh::int64ToIntS(vsapi->mapGetInt(in, "stream", 0, &err));
+        if (err)
+            stream = (size_t)d->vi.width * d->vi.height * d->vi.format.bytesPerSample > lastLevelCacheSize();
+        optMask &= ~4;
+        if (stream)
+            optMask |= 4;
+
+        // Only used where every clip is half float and the host computes in half natively.
+        int fp16 = vsh::int64ToIntS(vsapi->mapGetInt(in, "fp16", 0, &err));
+        optMask &= ~8;
+        if (!err && fp16)
+            optMask |= 8;
+
+        int accuracy = vsh::int64ToIntS(vsapi->mapGetInt(in, "accuracy", 0, &err));
+        if (err) accuracy = 1;
+        if (accuracy < 0 || accuracy > 2)
+            throw std::runtime_error("accuracy must be 0 (fast), 1 (default) or 2 (precise)");
+        optMask &= ~(16 | 32);
+        if (accuracy == 0)
+            optMask |= 16;
+        else if (accuracy == 2)
+            optMask |= 32;
+
+        int branch = vsh::int64ToIntS(vsapi->mapGetInt(in, "branch", 0, &err));
+        optMask &= ~(1 << 8);
+        if (!err && !branch)
+            optMask |= 1 << 8;
+
+        int nreduce = vsapi->mapNumElements(in, "reduce");
+        if (nreduce > d->vi.format.numPlanes)
+            throw std::runtime_error("More reductions given than there are planes");
+        bool reduced = false;
+        for (int i = 0; i < nreduce; i++) {
+            static const std::map<std::string, ReduceMode> modes = {
+                { "", ReduceMode::None }, { "sum", ReduceMode::Sum }, { "avg", ReduceMode::Average },
+                { "min", ReduceMode::Min }, { "max", ReduceMode::Max },
+            };
+            auto it = modes.find(vsapi->mapGetData(in, "reduce", i, nullptr));
+            if (it == modes.end())
+                throw std::runtime_error("reduce must be one of \"\", \"sum\", \"avg\", \"min\" or \"max\"");
+            d->reduce[i] = it->second;
+            if (it->second == ReduceMode::None)
+                continue;
+            if (d->plane[i] != poProcess)
+                throw std::runtime_error("reduce requires an expression for plane " + std::to_string(i));
+            if (d->vi.format.bitsPerSample != vi[0]->format.bitsPerSample || d->vi.format.sampleType != vi[0]->format.sampleType)
+                throw std::runtime_error("reduce requires the output format to match the first clip");
+            reduced = true;
+        }
+
+        if (cuda && reduced)
+            throw std::runtime_error("reduce is not supported by the cuda backend");
+        if (d->outputs > 1 && cuda)
+            throw std::runtime_error("outputs is not supported by the cuda backend");
+        if (d->outputs > 1 && reduced)
+            throw std::runtime_error("reduce cannot be combined with outputs");
+
+        // Expensive expressions that only map a single pixel of one or two
+        // integer clips are evaluated once per combination of input values.
+        processed.clear();
+        for (int i = 0; i < d->vi.format.numPlanes; i++) {
+            if (d->plane[i] != poProcess)
+                continue;
+            if (d->reduce[i] == ReduceMode::None && !cuda && d->outputs == 1) {
+                auto tokens = tokenize(expr[i]);
+                std::vector<ExprOp> ops;
+                for (const auto &tok: tokens)
+                    ops.push_back(decodeToken(tok));
+                auto lutOf = lanes == 4 ? buildLut<4> : buildLut<8>;
+                if (lutOf(expr[i], ops, tokens, &vi[0], d->vi.format, d->numInputs, optMask, mirror, unroll, d->lut[i], d->lutClip[i], core, vsapi)) {
+                    d->plane[i] = poLut;
+                    continue;
+                }
+            }
+            processed.push_back(expr[i]);
+        }
+
+        // Planes can only share a row loop if they all have the same dimensions.
+        d->fused = !reduced && !cuda && d->outputs == 1 && (optMask & 2) && processed.size() > 1 && d->vi.format.subSamplingW == 0 && d->vi.format.subSamplingH == 0;
+        auto compileAll = lanes == 4 ? compilePlanes<4> : compilePlanes<8>;
+
+        int async = vsh::int64ToIntS(vsapi->mapGetInt(in, "async", 0, &err));
+        if (err || cuda || d->outputs > 1) async = 0;
+        if (async) {
+            // Only defer the compilation of valid expressions, so that errors are still reported here.
+            for (int i = 0; i < d->vi.format.numPlanes && async; i++) {
+                if (d->plane[i] != poProcess)
+                    continue;
+                auto tokens = tokenize(expr[i]);
+                std::vector<ExprOp> ops;
+                for (const auto &tok: tokens) {
+                    auto op = decodeToken(tok);
+                    if (op.bc == BoundaryCondition::Unspecified)
+                        op.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
+                    ops.push_back(op);
+                }
+                if (!ExprOptimizer::valid(ops, tokens, d->numInputs))
+                    async = 0;
+                d->ops[i] = prepareInterpret(ops);
+            }
+        }
+        d->stats = !!vsh::int64ToIntS(vsapi->mapGetInt(in, "stats", 0, &err));
+
+        // Tiering recompiles on the same thread async would compile on, so
+        // async simply compiles at opt_level=3.
+        int optLevel = vsh::int64ToIntS(vsapi->mapGetInt(in, "opt_level", 0, &err));
+        if (err) optLevel = 3;
+        if (optLevel < -1 || optLevel > 3)
+            throw std::runtime_error("opt_level must be -1 (tiered) or between 0 and 3");
+        const bool tiered = optLevel == -1 && !cuda && !async;
+        if (optLevel == -1)
+            optLevel = tiered ? 1 : 3;
+        optMask &= ~(3 << 6);
+        optMask |= (3 - optLevel) << 6;
+#ifdef HAVE_CUDA
+        if (cuda) {
+            int device = vsh::int64ToIntS(vsapi->mapGetInt(in, "device_id", 0, &err));
+            if (err) device = 0;
+            int numStreams = vsh::int64ToIntS(vsapi->mapGetInt(in, "num_streams", 0, &err));
+            if (err) numStreams = 2;
+            if (numStreams < 1)
+                throw std::runtime_error("num_streams must be at least 1");
+            bool gpuOutput = !!vsh::int64ToIntS(vsapi->mapGetInt(in, "gpu_output", 0, &err));
+            d->cuda = compileCuda(d.get(), expr, &vi[0], mirror, device, numStreams, gpuOutput);
+        } else
+#endif
+        if (!async) {
+            compileAll(d.get(), expr, processed, &vi[0], vsapi, optMask, mirror, unroll, prefetch, {}, d->compiled, d->proc);
+            countCacheHits(d.get(), d->compiled);
+            for (int i = 0; i < 3 && d->stats; i++) {
+                if (!d->compiled[i].routine)
+                    continue;
+                const Compiled::Stats &st = d->compiled[i].stats;
+                std::stringstream ss;
+                ss << std::fixed << std::setprecision(3) << "Expr: " << (d->fused ? "fused planes" : "plane " + std::to_string(i))
+                    << ": parse " << st.parseTime * 1e3 << " ms, optimize " << st.optimizeTime * 1e3 << " ms, codegen " << st.codegenTime * 1e3
+                    << " ms, " << st.codeBytes << " bytes" << (st.cacheHit ? " (cached)" : "");
+                vsapi->logMessage(mtDebug, ss.str().c_str(), core);
+            }
+        } else
+            d->ready = false;
+
+        std::set<std::string> names;
+        int nspec = vsapi->mapNumElements(in, "specialize");
+        for (int i = 0; i < nspec; i++)
+            names.insert(vsapi->mapGetData(in, "specialize", i, nullptr));
+        if (!cuda)
+            d->uniforms = findUniforms(processed, names, d->numInputs);
+        for (const auto &e: processed) {
+            std::vector<ExprOp> ops;
+            for (const auto &tok: tokenize(e))
+                ops.push_back(decodeToken(tok));
+            addProperties(d->props, ops, d->numInputs);
+        }
+        if (!d->uniforms.empty()) {
+            std::vector<std::string> exprs(expr, expr + 3);
+            const ExprData *data = d.get();
+            d->specialize = [=](const Uniforms &uniforms, Compiled *compiled, ExprData::ProcessProc *proc) {
+                compileAll(data, exprs.data(), processed, vi.data(), vsapi, optMask, mirror, unroll, prefetch, uniforms, compiled, proc);
+            };
+        }
 
-            if (d->plane[i] != poProcess)
-                continue;
+        if (tiered) {
+            std::vector<std::string> exprs(expr, expr + 3);
+            ExprData *data = d.get();
+            const int hotMask = optMask & ~(3 << 6);
+            d->retier = [=]() {
+                compileAll(data, exprs.data(), processed, vi.data(), vsapi, hotMask, mirror, unroll, prefetch, {}, data->tiered, data->tieredProc);
+                countCacheHits(data, data->tiered);
+            };
+        }
 
-            Compiler<LANES> comp(expr[i], &d->vi, &vi[0], vsapi, d->numInputs, optMask, mirror);
-            d->compiled[i] = comp.compile();
-            d->proc[i] = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(d->compiled[i].routine->getEntry()));
+        if (async) {
+            std::vector<std::string> exprs(expr, expr + 3);
+            ExprData *data = d.get();
+            data->compiler = std::thread([=]() {
+                try {
+                    compileAll(data, exprs.data(), processed, vi.data(), vsapi, optMask, mirror, unroll, prefetch, {}, data->compiled, data->proc);
+                    countCacheHits(data, data->compiled);
+                } catch (std::exception &e) {
+                    data->compileError = std::string{ "Expr: " } + e.what();
+                } catch (...) {
+                    data->compileError = "Expr: compilation failed";
+                }
+                data->ready.store(true, std::memory_order_release);
+            });
         }
     } catch (std::runtime_error &e) {
         for (auto p: d->node)
@@ -1585,17 +6130,30 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         return;
     }
 
+    // Taps are requested through the dependencies of their clips.
     std::vector<VSFilterDependency> deps;
-    deps.reserve(d->node.size());
-    std::transform(
-        d->node.begin(),
-        d->node.end(),
-        std::back_inserter(deps),
-        [&](auto *node) { return VSFilterDependency{node, rpStrictSpatial}; }
-    );
+    for (size_t i = 0; i < d->node.size() && d->offset[i] == 0; i++) {
+        if (d->alias[i] != (int)i)
+            continue;
+        bool temporal = false;
+        for (size_t j = i; j < d->node.size(); j++)
+            temporal |= d->node[j] == d->node[i] && d->offset[j] != 0;
+        deps.push_back({ d->node[i], temporal ? rpGeneral : rpStrictSpatial });
+    }
 
-    const VSVideoInfo *vi = &d->vi;
-    vsapi->createVideoFilter(out, "Expr", vi, exprGetFrame, exprFree, fmParallel, deps.data(), deps.size(), d.release(), core);
+    const VSVideoInfo vi = d->vi;
+    const int outputs = d->outputs;
+    if (outputs == 1) {
+        vsapi->createVideoFilter(out, "Expr", &vi, timedGetFrame<ExprData, exprGetFrame>, exprFree, fmParallel, deps.data(), deps.size(), d.release(), core);
+        return;
+    }
+
+    VSNode *node = vsapi->createVideoFilter2("Expr", &vi, timedGetFrame<ExprData, exprGetFrame>, exprFree, fmParallel, deps.data(), deps.size(), d.release(), core);
+    vsapi->setCacheMode(node, cmForceEnable);
+    VSFilterDependency dep{ node, rpStrictSpatial };
+    for (int k = 0; k < outputs; k++)
+        vsapi->createVideoFilter(out, "ExprOutput", &vi, exprOutputGetFrame, exprOutputFree, fmParallel, &dep, 1, new ExprOutputData{ vsapi->addNodeRef(node), k, outputs }, core);
+    vsapi->freeNode(node);
 }
 
 static void initExpr() {
@@ -1619,44 +6177,111 @@ static void initExpr() {
 }
 
 // An interpreter for expr.
-float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, int Y, int X, std::function<float(const ExprOp &op, int y, int x)> pixelGet, std::function<float(int idx, const std::string &name)> propGet, std::vector<float> *rstk = nullptr) {
-    std::vector<float> stack;
-    std::map<std::string, float> vars;
-    auto check_stack = [&stack](int nargs) -> void {
-        int size = stack.size();
-        if (size < nargs)
-            throw std::runtime_error("stack underflow, expecting " + std::to_string(nargs) + " args, but only has " + std::to_string(size) + " elements left on stack");
+InterpProgram prepareInterpret(const std::vector<ExprOp> &ops) {
+    InterpProgram prog;
+    prog.ops = ops;
+    std::map<std::string, unsigned> slots;
+    size_t depth = 0;
+    auto fail = [&prog](size_t at, const std::string &msg) {
+        prog.errorAt = at;
+        prog.error = msg;
+        return prog;
     };
 
-    for (const auto &op: ops) {
-        // Stack operations
+    for (size_t i = 0; i < prog.ops.size(); i++) {
+        ExprOp &op = prog.ops[i];
+        size_t args = 0, results = 1;
         switch (op.type) {
-        case ExprOpType::DUP:
-            check_stack(op.imm.u);
-            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+        case ExprOpType::DUP: args = op.imm.u + 1; results = args + 1; break;
+        case ExprOpType::SWAP: args = results = op.imm.u + 1; break;
+        case ExprOpType::DROP: args = op.imm.u; results = 0; break;
+        case ExprOpType::SORT: args = results = op.imm.u; break;
+        case ExprOpType::ARGSORT: args = results = op.imm.u; prog.maxSort = std::max<size_t>(prog.maxSort, op.imm.u); break;
+        case ExprOpType::ARGMIN: case ExprOpType::ARGMAX:
+            if (op.imm.i < 1)
+                return fail(i, "argmin and argmax need at least one element");
+            args = op.imm.u;
             break;
-        case ExprOpType::SWAP: {
-            check_stack(op.imm.u);
-            std::swap(stack[stack.size()-1], stack[stack.size() - 1 - op.imm.u]);
+        case ExprOpType::MEM_LOAD: case ExprOpType::CONSTANTI: case ExprOpType::CONSTANTF: case ExprOpType::CONST_LOAD: break;
+        case ExprOpType::VAR_LOAD: {
+            auto it = slots.find(op.name);
+            if (it == slots.end())
+                return fail(i, "variable " + op.name + " used before assignment");
+            op.imm.u = it->second;
             break;
         }
-        case ExprOpType::DROP: {
-            check_stack(op.imm.u);
-            for (unsigned i = 0; i < op.imm.u; i++)
-                stack.pop_back();
+        case ExprOpType::VAR_STORE:
+            args = 1;
+            results = 0;
+            op.imm.u = slots.emplace(op.name, (unsigned)slots.size()).first->second;
+            break;
+        case ExprOpType::SQRT: case ExprOpType::ABS: case ExprOpType::TRUNC: case ExprOpType::ROUND: case ExprOpType::FLOOR:
+        case ExprOpType::NOT: case ExprOpType::BITNOT:
+        case ExprOpType::EXP: case ExprOpType::LOG: case ExprOpType::SIN: case ExprOpType::COS:
+            args = 1;
             break;
+        case ExprOpType::CLAMP: case ExprOpType::TERNARY: args = 3; break;
+        default: args = 2; break; // binary operators and MEM_LOAD_VAR
         }
+        if (depth < args)
+            return fail(i, "stack underflow, expecting " + std::to_string(args) + " args, but only has " + std::to_string(depth) + " elements left on stack");
+        depth += results - args;
+        prog.maxDepth = std::max(prog.maxDepth, depth);
+    }
+    prog.numVars = slots.size();
 
-#define OUT(x) stack.push_back(x)
-#define LOAD1(x) float x = stack.back(); stack.pop_back()
+    if (depth == 0)
+        return fail(prog.ops.size(), "empty expression");
+    if (depth > 1)
+        return fail(prog.ops.size(), "unconsumed " + std::to_string(depth) + " values on stack");
+    return prog;
+}
+
+// Runs prog on the given stack and variable storage up to its end or its
+// first error, and returns the final stack depth.
+static size_t evaluate(const InterpProgram &prog, int N, int width, int height, int Y, int X, const std::function<float(const ExprOp &op, int y, int x)> &pixelGet, const std::function<float(int idx, const std::string &name)> &propGet, float *stack, float *vars, int *order) {
+    size_t sp = 0;
+    for (size_t i = 0; i < prog.ops.size(); i++) {
+        if (i == prog.errorAt)
+            throw std::runtime_error(prog.error);
+        const ExprOp &op = prog.ops[i];
+        switch (op.type) {
+        // Stack operations
+        case ExprOpType::DUP:
+            stack[sp] = stack[sp - 1 - op.imm.u];
+            sp++;
+            break;
+        case ExprOpType::SWAP:
+            std::swap(stack[sp - 1], stack[sp - 1 - op.imm.u]);
+            break;
+        case ExprOpType::DROP:
+            sp -= op.imm.u;
+            break;
+
+#define OUT(x) stack[sp++] = (x)
+#define LOAD1(x) float x = stack[--sp]
 #define LOAD2(l, r) \
            LOAD1(r); \
            LOAD1(l)
         // Terminals
         case ExprOpType::MEM_LOAD:
-        case ExprOpType::MEM_LOAD_VAR:
             OUT(pixelGet(op, Y, X));
             break;
+        case ExprOpType::MEM_LOAD_VAR: {
+            // pixelGet receives the absolute coordinates, unclamped.
+            LOAD2(absx, absy);
+            if (op.x) {
+                float x0 = std::floor(absx), y0 = std::floor(absy);
+                float wx = absx - x0, wy = absy - y0;
+                int ix = (int)x0, iy = (int)y0;
+                float top = pixelGet(op, iy, ix) + (pixelGet(op, iy, ix + 1) - pixelGet(op, iy, ix)) * wx;
+                float bottom = pixelGet(op, iy + 1, ix) + (pixelGet(op, iy + 1, ix + 1) - pixelGet(op, iy + 1, ix)) * wx;
+                OUT(top + (bottom - top) * wy);
+                break;
+            }
+            OUT(pixelGet(op, (int)std::nearbyint(absy), (int)std::nearbyint(absx)));
+            break;
+        }
 
         case ExprOpType::CONSTANTI:
             OUT(op.imm.i);
@@ -1687,34 +6312,27 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
             }
             break;
         }
-        case ExprOpType::VAR_LOAD: {
-            auto it = vars.find(op.name);
-            if (it == vars.end())
-                throw std::runtime_error("variable " + op.name + " used before assignment");
-            OUT(it->second);
+        case ExprOpType::VAR_LOAD:
+            OUT(vars[op.imm.u]);
             break;
-        }
         case ExprOpType::VAR_STORE: {
             LOAD1(v);
-            vars.insert_or_assign(op.name, v);
+            vars[op.imm.u] = v;
             break;
         }
 
         // Arithmetic primitives.
 #define BINARYOP(op) { \
-            check_stack(2); \
             LOAD2(l, r); \
             OUT((l) op (r)); \
             break; \
         }
 #define BINARYOPF(op) { \
-            check_stack(2); \
             LOAD2(l, r); \
             OUT(op(l, r)); \
             break; \
         }
 #define UNARYOP(op) { \
-            check_stack(1); \
             LOAD1(x); \
             OUT(op (x)); \
             break; \
@@ -1724,7 +6342,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::MUL: BINARYOP(*);
         case ExprOpType::DIV: BINARYOP(/);
         case ExprOpType::MOD: {
-            check_stack(2);
             LOAD2(l, r);
             OUT(std::fmod(l, r));
             break;
@@ -1734,14 +6351,12 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::MAX: BINARYOPF(std::max);
         case ExprOpType::MIN: BINARYOPF(std::min);
         case ExprOpType::CLAMP: {
-            check_stack(3);
             LOAD2(min, max);
             LOAD1(x);
             OUT(std::max(std::min(x, max), min));
             break;
         }
         case ExprOpType::CMP: {
-            check_stack(2);
             LOAD2(l, r);
             int x;
             switch (static_cast<ComparisonType>(op.imm.u)) {
@@ -1764,7 +6379,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
 
         // Logical operators.
 #define LOGICOP(op) { \
-            check_stack(2); \
             LOAD2(l, r); \
             bool lb = l > 0.0f, rb = r > 0.0f; \
             int x = (lb) op (rb); \
@@ -1775,7 +6389,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::OR: LOGICOP(|);
         case ExprOpType::XOR: LOGICOP(^);
         case ExprOpType::NOT: {
-            check_stack(1); \
             LOAD1(x);
             OUT(x <= 0.0f);
             break;
@@ -1784,7 +6397,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
 
         // Bitwise operators.
 #define BITWISEOP(op) { \
-            check_stack(2); \
             LOAD2(l, r); \
             int li = (int)std::round(l); \
             int ri = (int)std::round(r); \
@@ -1796,7 +6408,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::BITOR: BITWISEOP(|);
         case ExprOpType::BITXOR: BITWISEOP(^);
         case ExprOpType::BITNOT: {
-            check_stack(1);
             LOAD1(x);
             int xi = int(std::round(x));
             OUT(~xi);
@@ -1812,7 +6423,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::COS: UNARYOP(std::cos);
 
         case ExprOpType::TERNARY: {
-            check_stack(3);
             LOAD2(t, f);
             LOAD1(c);
             OUT((c > 0.0f ? t : f));
@@ -1821,14 +6431,12 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
 
         // Rank-order operator
         case ExprOpType::SORT: {
-            check_stack(op.imm.u);
-            std::sort(&stack[stack.size() - op.imm.u], &*stack.end(), [](float l, float r) { return l > r; });
+            std::sort(stack + sp - op.imm.u, stack + sp, [](float l, float r) { return l > r; });
             break;
         }
         case ExprOpType::ARGMIN:
         case ExprOpType::ARGMAX: {
-            check_stack(op.imm.i);
-            const int off = stack.size() - op.imm.u;
+            const size_t off = sp - op.imm.u;
             int idx = 0;
             float cur = stack[off+idx];
             for (int i = 1; i < op.imm.i; i++) {
@@ -1839,37 +6447,301 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
                     idx = i;
                 }
             }
-            stack.resize(off);
+            sp = off;
             OUT(idx);
             break;
         }
         case ExprOpType::ARGSORT: {
-            check_stack(op.imm.u);
-            std::vector<int> idxs(op.imm.u);
-            std::iota(idxs.begin(), idxs.end(), 0);
-            const int off = stack.size() - op.imm.u;
-            std::stable_sort(idxs.begin(), idxs.end(), [&stack, off](int l, int r) { return stack[off+l] > stack[off+r]; });
-            std::copy(idxs.begin(), idxs.end(), &stack[stack.size() - op.imm.u]);
+            // Stable insertion sort of the indices, largest value first.
+            const size_t off = sp - op.imm.u;
+            for (int i = 0; i < (int)op.imm.u; i++) {
+                int j = i;
+                for (; j > 0 && stack[off + i] > stack[off + order[j - 1]]; j--)
+                    order[j] = order[j - 1];
+                order[j] = i;
+            }
+            for (unsigned i = 0; i < op.imm.u; i++)
+                stack[off + i] = order[i];
             break;
         }
         }
 #undef UNARYOP
 #undef BINARYOPF
 #undef BINARYOP
+#undef LOAD2
+#undef LOAD1
 #undef OUT
     }
+    return sp;
+}
+
+float interpret(const InterpProgram &prog, int N, int width, int height, int Y, int X, const std::function<float(const ExprOp &op, int y, int x)> &pixelGet, const std::function<float(int idx, const std::string &name)> &propGet) {
+    // Grown once per thread, so that evaluation does not allocate.
+    thread_local std::vector<float> storage;
+    thread_local std::vector<int> order;
+    if (storage.size() < prog.maxDepth + prog.numVars)
+        storage.resize(prog.maxDepth + prog.numVars);
+    if (order.size() < prog.maxSort)
+        order.resize(prog.maxSort);
+
+    float *stack = storage.data();
+    evaluate(prog, N, width, height, Y, X, pixelGet, propGet, stack, stack + prog.maxDepth, order.data());
+    if (prog.errorAt == prog.ops.size())
+        throw std::runtime_error(prog.error);
+    return stack[0];
+}
+
+float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, int Y, int X, const std::function<float(const ExprOp &op, int y, int x)> &pixelGet, const std::function<float(int idx, const std::string &name)> &propGet, std::vector<float> *rstk) {
+    const InterpProgram prog = prepareInterpret(ops);
+    if (!rstk)
+        return interpret(prog, N, width, height, Y, X, pixelGet, propGet);
+
+    // only for debug
+    std::vector<float> stack(prog.maxDepth + prog.numVars);
+    std::vector<int> order(prog.maxSort);
+    stack.resize(evaluate(prog, N, width, height, Y, X, pixelGet, propGet, stack.data(), stack.data() + prog.maxDepth, order.data()));
+    *rstk = std::move(stack);
+    return 0.0f;
+}
+
+// Select and PropExpr compile their expressions once into a scalar routine
+// that evaluates every output of a frame in a single call. The frame
+// properties the expressions read are fetched into a flat array beforehand,
+// each only once. Expressions that interpret() rejects while evaluating (e.g.
+// on stack underflow or unassigned variables) evaluate to 0, as they do there.
+#define SCALAR_COMPILE_LIMIT 16384 // larger expression sets are interpreted
+
+static float scalarMod(float l, float r) { return std::fmod(l, r); }
+static float scalarRound(float x) { return std::round(x); }
+static float scalarExp(float x) { return std::exp(x); }
+static float scalarLog(float x) { return std::log(x); }
+static float scalarPow(float l, float r) { return std::pow(l, r); }
+static float scalarSin(float x) { return std::sin(x); }
+static float scalarCos(float x) { return std::cos(x); }
+
+class ScalarProgram {
+public:
+    // outputs[k] holds the alternatives for output k, of which the sel
+    // argument of run picks one per frame.
+    ScalarProgram(const std::vector<std::vector<const std::vector<ExprOp> *>> &outputs, int width, int height);
+
+    // The values of these properties are passed to run in this order.
+    const std::vector<Compiled::PropAccess> &propAccess() const { return props; }
+    void run(const float *propValues, const int *sel, float *out, int n) const { proc(propValues, sel, out, n); }
+
+private:
+    typedef void (*Proc)(const float *props, const int *sel, float *out, int n);
+    std::shared_ptr<rr::Routine> routine;
+    Proc proc;
+    std::vector<Compiled::PropAccess> props;
+    std::map<std::pair<int, std::string>, int> propIndex;
+
+    rr::RValue<rr::Float> build(const std::vector<ExprOp> &ops, int width, int height, rr::Pointer<rr::Float> propValues, rr::RValue<rr::Int> n);
+};
+
+rr::RValue<rr::Float> ScalarProgram::build(const std::vector<ExprOp> &ops, int width, int height, rr::Pointer<rr::Float> propValues, rr::RValue<rr::Int> n) {
+    using namespace rr;
+    std::vector<Float> stack;
+    std::map<std::string, Float> vars;
+    auto pop = [&stack]() { Float v = stack.back(); stack.pop_back(); return v; };
+    auto boolean = [](RValue<Bool> c) { return IfThenElse(c, Float(1.0f), Float(0.0f)); };
+    auto truth = [](RValue<Float> x) { return x > Float(0.0f); };
+    auto roundInt = [](RValue<Float> x) { return Int(Call(scalarRound, Float(x))); };
+
+    for (const auto &op: ops) {
+        switch (op.type) {
+        case ExprOpType::DUP: stack.push_back(stack[stack.size() - 1 - op.imm.u]); break;
+        case ExprOpType::SWAP: std::swap(stack.back(), stack[stack.size() - 1 - op.imm.u]); break;
+        case ExprOpType::DROP: stack.resize(stack.size() - op.imm.u); break;
+
+        case ExprOpType::MEM_LOAD: stack.push_back(Float(0.0f)); break; // rejected at creation
+        case ExprOpType::CONSTANTI: stack.push_back(Float((float)op.imm.i)); break;
+        case ExprOpType::CONSTANTF: stack.push_back(Float(op.imm.f)); break;
+        case ExprOpType::CONST_LOAD:
+            switch (static_cast<LoadConstType>(op.imm.i)) {
+            case LoadConstType::N: stack.push_back(Float(n)); break;
+            case LoadConstType::Y: case LoadConstType::X: stack.push_back(Float(-1.0f)); break;
+            case LoadConstType::Width: stack.push_back(Float((float)width)); break;
+            case LoadConstType::Height: stack.push_back(Float((float)height)); break;
+            default: {
+                auto key = std::make_pair(op.imm.i - static_cast<int>(LoadConstType::LAST), op.name);
+                auto it = propIndex.find(key);
+                if (it == propIndex.end()) {
+                    it = propIndex.emplace(key, (int)props.size()).first;
+                    props.push_back({ key.first, key.second });
+                }
+                stack.push_back(Float(propValues[it->second]));
+                break;
+            }
+            }
+            break;
+        case ExprOpType::VAR_LOAD: stack.push_back(vars.at(op.name)); break;
+        case ExprOpType::VAR_STORE: {
+            Float v = pop();
+            vars.insert_or_assign(op.name, v);
+            break;
+        }
+
+#define BINARY(expr) { Float r = pop(); Float l = pop(); stack.push_back(expr); break; }
+#define UNARY(expr) { Float x = pop(); stack.push_back(expr); break; }
+        case ExprOpType::ADD: BINARY(l + r);
+        case ExprOpType::SUB: BINARY(l - r);
+        case ExprOpType::MUL: BINARY(l * r);
+        case ExprOpType::DIV: BINARY(l / r);
+        case ExprOpType::MOD: BINARY(Call(scalarMod, l, r));
+        case ExprOpType::SQRT: UNARY(Sqrt(Max(x, Float(0.0f))));
+        case ExprOpType::ABS: UNARY(Abs(x));
+        // As std::max and std::min, which return the first argument if unordered.
+        case ExprOpType::MAX: BINARY(IfThenElse(l < r, r, l));
+        case ExprOpType::MIN: BINARY(IfThenElse(r < l, r, l));
+        case ExprOpType::CLAMP: {
+            Float hi = pop(), lo = pop(), x = pop();
+            Float m = IfThenElse(hi < x, hi, x);
+            stack.push_back(IfThenElse(m < lo, lo, m));
+            break;
+        }
+        case ExprOpType::CMP: {
+            Float r = pop(), l = pop();
+            switch (static_cast<ComparisonType>(op.imm.u)) {
+            case ComparisonType::EQ: stack.push_back(boolean(l == r)); break;
+            case ComparisonType::LT: stack.push_back(boolean(l < r)); break;
+            case ComparisonType::LE: stack.push_back(boolean(l <= r)); break;
+            case ComparisonType::NEQ: stack.push_back(boolean(!(l == r))); break;
+            case ComparisonType::NLT: stack.push_back(boolean(l >= r)); break;
+            case ComparisonType::NLE: stack.push_back(boolean(l > r)); break;
+            }
+            break;
+        }
+
+        case ExprOpType::TRUNC: UNARY(Trunc(x));
+        case ExprOpType::ROUND: UNARY(Call(scalarRound, x));
+        case ExprOpType::FLOOR: UNARY(Floor(x));
+
+        case ExprOpType::AND: BINARY(boolean(truth(l) && truth(r)));
+        case ExprOpType::OR: BINARY(boolean(truth(l) || truth(r)));
+        case ExprOpType::XOR: BINARY(boolean(truth(l) != truth(r)));
+        case ExprOpType::NOT: UNARY(boolean(!truth(x)));
+
+        case ExprOpType::BITAND: BINARY(Float(roundInt(l) & roundInt(r)));
+        case ExprOpType::BITOR: BINARY(Float(roundInt(l) | roundInt(r)));
+        case ExprOpType::BITXOR: BINARY(Float(roundInt(l) ^ roundInt(r)));
+        case ExprOpType::BITNOT: UNARY(Float(~roundInt(x)));
+
+        case ExprOpType::EXP: UNARY(Call(scalarExp, x));
+        case ExprOpType::LOG: UNARY(Call(scalarLog, x));
+        case ExprOpType::POW: BINARY(Call(scalarPow, l, r));
+        case ExprOpType::SIN: UNARY(Call(scalarSin, x));
+        case ExprOpType::COS: UNARY(Call(scalarCos, x));
+#undef UNARY
+#undef BINARY
 
-    if (rstk) { // only for debug
-        *rstk = std::move(stack);
-        return 0.0f;
+        case ExprOpType::TERNARY: {
+            Float f = pop(), t = pop(), c = pop();
+            stack.push_back(IfThenElse(truth(c), t, f));
+            break;
+        }
+
+        // Odd-even transposition networks; the top ends up the smallest.
+        case ExprOpType::SORT: {
+            const size_t off = stack.size() - op.imm.u;
+            for (unsigned pass = 0; pass < op.imm.u; pass++) {
+                for (size_t j = off + pass % 2; j + 1 < stack.size(); j += 2) {
+                    Float a = stack[j], b = stack[j + 1];
+                    stack[j] = IfThenElse(a < b, b, a);
+                    stack[j + 1] = IfThenElse(a < b, a, b);
+                }
+            }
+            break;
+        }
+        case ExprOpType::ARGSORT: {
+            // Only strictly greater elements move up, which keeps the sort stable.
+            const size_t off = stack.size() - op.imm.u;
+            std::vector<Float> idx;
+            for (unsigned i = 0; i < op.imm.u; i++)
+                idx.push_back(Float((float)i));
+            for (unsigned pass = 0; pass < op.imm.u; pass++) {
+                for (size_t j = off + pass % 2; j + 1 < stack.size(); j += 2) {
+                    Float a = stack[j], b = stack[j + 1];
+                    Float ia = idx[j - off], ib = idx[j + 1 - off];
+                    Bool up = b > a;
+                    stack[j] = IfThenElse(up, b, a);
+                    stack[j + 1] = IfThenElse(up, a, b);
+                    idx[j - off] = IfThenElse(up, ib, ia);
+                    idx[j + 1 - off] = IfThenElse(up, ia, ib);
+                }
+            }
+            for (unsigned i = 0; i < op.imm.u; i++)
+                stack[off + i] = idx[i];
+            break;
+        }
+        case ExprOpType::ARGMIN:
+        case ExprOpType::ARGMAX: {
+            const size_t off = stack.size() - op.imm.u;
+            Float cur = stack[off], best = Float(0.0f);
+            for (int i = 1; i < op.imm.i; i++) {
+                Float x = stack[off + i];
+                Bool better = op.type == ExprOpType::ARGMIN ? x < cur : x > cur;
+                cur = IfThenElse(better, x, cur);
+                best = IfThenElse(better, Float((float)i), best);
+            }
+            stack.resize(off);
+            stack.push_back(best);
+            break;
+        }
+
+        default:
+            stack.push_back(Float(0.0f));
+            break;
+        }
     }
+    return stack.back();
+}
 
-    if (stack.empty())
-        throw std::runtime_error("empty expression");
-    if (stack.size() > 1)
-        throw std::runtime_error("unconsumed " + std::to_string(stack.size()) + " values on stack");
+ScalarProgram::ScalarProgram(const std::vector<std::vector<const std::vector<ExprOp> *>> &outputs, int width, int height) {
+    using namespace rr;
+    Module mod;
 
-    return stack[0];
+    typedef ModuleFunction<Float(Pointer<Float>, Int)> ExprFunction;
+    std::vector<std::vector<std::unique_ptr<ExprFunction>>> functions(outputs.size());
+    for (size_t k = 0; k < outputs.size(); k++) {
+        for (const auto *ops: outputs[k]) {
+            if (!prepareInterpret(*ops).error.empty()) {
+                functions[k].emplace_back();
+                continue;
+            }
+            functions[k].emplace_back(new ExprFunction(mod));
+            ExprFunction &f = *functions[k].back();
+            Return(build(*ops, width, height, f.Arg<0>(), Int(f.Arg<1>())));
+        }
+    }
+
+    //                      props,        sel,        out,          n
+    ModuleFunction<Void(Pointer<Float>, Pointer<Int>, Pointer<Float>, Int)> function(mod, "procScalar");
+    {
+        Pointer<Float> propValues = function.Arg<0>();
+        Pointer<Int> sel = function.Arg<1>();
+        Pointer<Float> out = function.Arg<2>();
+        Int n = function.Arg<3>();
+        for (size_t k = 0; k < outputs.size(); k++) {
+            const auto &alts = functions[k];
+            auto eval = [&](size_t j) { return alts[j] ? alts[j]->Call(propValues, n) : RValue<Float>(Float(0.0f)); };
+            if (alts.size() == 1) {
+                out[(int)k] = eval(0);
+                continue;
+            }
+            out[(int)k] = Float(0.0f);
+            Int s = sel[(int)k];
+            for (size_t j = 0; j < alts.size(); j++) {
+                If(s == Int((int)j)) {
+                    out[(int)k] = eval(j);
+                }
+            }
+        }
+        Return();
+    }
+
+    routine = mod.acquire("procScalar");
+    proc = reinterpret_cast<Proc>(const_cast<void *>(routine->getEntry()));
 }
 
 // Select
@@ -1878,90 +6750,192 @@ struct SelectData {
     std::vector<VSNode *> srcNodes;
     VSVideoInfo vi;
     int numPropInputs;
-    std::vector<ExprOp> ops[3];
-
-    SelectData() : propNodes(), srcNodes(), vi(), numPropInputs(), ops() {}
+    InterpProgram ops[3];
+    std::unique_ptr<ScalarProgram> program; // evaluates every plane's ops, if compiled
+    PropertyReader props;
+    std::vector<int> programProps; // slots of program->propAccess()
+    PropFrames frames;
+    // With speculate, the clip each plane is predicted to select, which is
+    // requested together with the property frames. It follows the selection
+    // of the most recently evaluated frame.
+    bool speculate;
+    std::atomic<int> predicted[3];
+    // Bits per plane for the clip indices that selectGetFrame packs into a
+    // pointer.
+    static constexpr int clipBits = (sizeof(uintptr_t) * 8 - 2) / 3;
+    // With stats, each plane is compiled on its own so that it can be timed.
+    bool stats = false;
+    std::deque<ExprCounters> counters;
+    std::unique_ptr<ScalarProgram> planePrograms[3];
+    std::vector<int> planeProgramProps[3];
+    std::vector<int> planeSlots[3]; // for ExprCounters::add
+    ScopedFilterStats perf{ "Select" };
+
+    SelectData() : propNodes(), srcNodes(), vi(), numPropInputs(), ops(), speculate(), predicted() {}
 };
 
 static const VSFrame *VS_CC selectGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     SelectData *d = static_cast<SelectData *>(instanceData);
-    struct RuntimeData {
-        int selectedClip[3];
+    const int numPlanes = d->vi.format.numPlanes;
 
-        RuntimeData() : selectedClip() {}
+    // The state of a request is the clip of each plane: those requested with
+    // speculate until the selection is made, the selected ones after. It is
+    // packed into frameData itself, tagged by the lowest bit, and only frames
+    // taken from the ring of PropFrames need a RuntimeData.
+    struct State {
+        bool selected;
+        int clip[3];
+    };
+    struct RuntimeData {
+        std::vector<const VSFrame *> props; // by PropFrames source
+        State state;
+    };
+    constexpr int bits = SelectData::clipBits;
+    auto isPacked = [](void *p) { return (reinterpret_cast<uintptr_t>(p) & 1) != 0; };
+    auto pack = [](const State &st) {
+        uintptr_t v = 1 | (uintptr_t)st.selected << 1;
+        for (int i = 0; i < 3; i++)
+            v |= (uintptr_t)st.clip[i] << (2 + i * bits);
+        return reinterpret_cast<void *>(v);
+    };
+    auto unpack = [](void *p) {
+        const uintptr_t v = reinterpret_cast<uintptr_t>(p);
+        State st = { ((v >> 1) & 1) != 0, {} };
+        for (int i = 0; i < 3; i++)
+            st.clip[i] = (int)((v >> (2 + i * bits)) & ((uintptr_t(1) << bits) - 1));
+        return st;
     };
 
-    if (activationReason == arInitial) {
-        for (int i = 0; i < d->numPropInputs; i++)
-            vsapi->requestFrameFilter(n, d->propNodes[i], frameCtx);
-    } else if (activationReason == arAllFramesReady && !*frameData) {
-        std::vector<const VSFrame *> props(d->numPropInputs, nullptr);
-        for (int i = 0; i < d->numPropInputs; i++) {
-            props[i] = vsapi->getFrameFilter(n, d->propNodes[i], frameCtx);
+    // Builds the output once the frames of the selected clips are ready,
+    // getting each distinct clip once. If all planes come from the same clip,
+    // its frame is returned as is.
+    auto assemble = [&](const int *sel) -> const VSFrame * {
+        const VSFrame *srcf[3] = {};
+        bool same = true;
+        for (int i = 0; i < numPlanes; i++) {
+            for (int j = 0; j < i && !srcf[i]; j++)
+                if (sel[j] == sel[i])
+                    srcf[i] = srcf[j];
+            if (!srcf[i])
+                srcf[i] = vsapi->getFrameFilter(n, d->srcNodes[sel[i]], frameCtx);
+            same = same && sel[i] == sel[0];
         }
+        if (same && !d->stats)
+            return srcf[0];
 
-        std::unique_ptr<RuntimeData> rd(new RuntimeData);
+        const VSVideoFormat fi = d->vi.format;
+        int height = vsapi->getFrameHeight(srcf[0], 0);
+        int width = vsapi->getFrameWidth(srcf[0], 0);
+        int planes[3] = { 0, 1, 2 };
+        VSFrame *dst = vsapi->newVideoFrame2(&fi, width, height, srcf, planes, srcf[0], core);
 
-        auto propGet = [&props, vsapi](int idx, const std::string &name) -> float {
-            auto m = vsapi->getFramePropertiesRO(props[idx]);
-            int err = 0;
-            float val = vsapi->mapGetInt(m, name.c_str(), 0, &err);
-            if (err == peType)
-                val = vsapi->mapGetFloat(m, name.c_str(), 0, &err);
-            if (err == peType) {
-                auto d = vsapi->mapGetData(m, name.c_str(), 0, &err);
-                if (d) val = d[0];
-            }
-            if (err != 0)
-                val = 0.0f; // XXX: non-existant property defaults to 0.
-            return val;
-        };
-        for (int i = 0; i < d->vi.format.numPlanes; i++) {
-            float x;
-            try {
-                x = interpret(d->ops[i], n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
-                              [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
-                              propGet);
-            } catch (std::runtime_error &e) {
-                x = 0.0f;
+        for (int i = 0; i < numPlanes; i++) {
+            if (std::find(srcf, srcf + i, srcf[i]) == srcf + i)
+                vsapi->freeFrame(srcf[i]);
+        }
+        if (d->stats)
+            setCounterProps(vsapi->getFramePropertiesRW(dst), d->counters, vsapi);
+
+        return dst;
+    };
+
+    if (activationReason == arInitial) {
+        std::vector<const VSFrame *> props = d->frames.request(n, frameCtx, vsapi);
+        State st = { false, {} };
+        if (d->speculate) {
+            for (int i = 0; i < numPlanes; i++) {
+                st.clip[i] = d->predicted[i].load(std::memory_order_relaxed);
+                if (std::find(st.clip, st.clip + i, st.clip[i]) == st.clip + i)
+                    vsapi->requestFrameFilter(n, d->srcNodes[st.clip[i]], frameCtx);
+            }
+        }
+        if (std::any_of(props.begin(), props.end(), [](const VSFrame *f) { return f != nullptr; }))
+            *frameData = reinterpret_cast<void *>(new RuntimeData{ std::move(props), st });
+        else if (d->speculate)
+            *frameData = pack(st);
+    } else if (activationReason == arAllFramesReady && !(isPacked(*frameData) && unpack(*frameData).selected)) {
+        std::vector<const VSFrame *> props;
+        State st = { false, {} };
+        if (*frameData && !isPacked(*frameData)) {
+            std::unique_ptr<RuntimeData> rd(reinterpret_cast<RuntimeData *>(*frameData));
+            props = std::move(rd->props);
+            st = rd->state;
+        } else {
+            if (*frameData)
+                st = unpack(*frameData);
+            props.resize(d->frames.size());
+        }
+        *frameData = nullptr;
+        d->frames.fetch(n, props, frameCtx, vsapi);
+
+        FrameProperties frameProps(d->props, props, d->frames.keys(n), 0.0f, vsapi); // XXX: non-existant property defaults to 0.
+        auto propGet = [&frameProps](int idx, const std::string &name) -> float { return frameProps.get(idx, name); };
+        float vals[3] = {};
+        if (d->program) {
+            const int sel[3] = {};
+            std::vector<float> propVals;
+            for (int slot: d->programProps)
+                propVals.push_back(frameProps.get(slot));
+            d->program->run(propVals.data(), sel, vals, n);
+        }
+        State selected = { true, {} };
+        for (int i = 0; i < numPlanes; i++) {
+            float x = vals[i];
+            const auto start = std::chrono::steady_clock::now();
+            bool error = !d->ops[i].error.empty();
+            if (d->planePrograms[i]) {
+                const int sel = 0;
+                std::vector<float> propVals;
+                for (int slot: d->planeProgramProps[i])
+                    propVals.push_back(frameProps.get(slot));
+                d->planePrograms[i]->run(propVals.data(), &sel, &x, n);
+            } else if (!d->program) {
+                try {
+                    x = interpret(d->ops[i], n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
+                                  [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
+                                  propGet);
+                    error = false;
+                } catch (std::runtime_error &e) {
+                    x = 0.0f;
+                    error = true;
+                }
             }
+            if (d->stats)
+                d->counters[i].add(start, frameProps, d->planeSlots[i], error);
             x = std::round(x);
-            rd->selectedClip[i] = std::max(0, std::min((int)x, (int)d->srcNodes.size() - 1));
+            selected.clip[i] = std::max(0, std::min((int)x, (int)d->srcNodes.size() - 1));
         }
 
-        for (int i = 0; i < d->numPropInputs; i++) {
-            vsapi->freeFrame(props[i]);
-        }
+        for (auto *p: props)
+            vsapi->freeFrame(p);
 
-        for (int i = 0; i < d->vi.format.numPlanes; i++) {
-            const int sel = rd->selectedClip[i];
-            bool requested = false;
-            for (int j = 0; j < i; j++)
-                if (rd->selectedClip[j] == sel) requested = true;
-            if (!requested)
+        // Only clips that were not predicted need another round trip.
+        bool missing = false;
+        for (int i = 0; i < numPlanes; i++) {
+            const int sel = selected.clip[i];
+            if (d->speculate)
+                d->predicted[i].store(sel, std::memory_order_relaxed);
+            const bool requested = (d->speculate && std::find(st.clip, st.clip + numPlanes, sel) != st.clip + numPlanes) ||
+                std::find(selected.clip, selected.clip + i, sel) != selected.clip + i;
+            if (!requested) {
                 vsapi->requestFrameFilter(n, d->srcNodes[sel], frameCtx);
+                missing = true;
+            }
         }
-        *frameData = reinterpret_cast<void *>(rd.release());
+        if (!missing)
+            return assemble(selected.clip);
+        *frameData = pack(selected);
     } else if (activationReason == arAllFramesReady) {
-        std::unique_ptr<RuntimeData> rd(reinterpret_cast<RuntimeData *>(*frameData));
+        const State st = unpack(*frameData);
         *frameData = nullptr;
-
-        const VSVideoFormat fi = d->vi.format;
-        const VSFrame *srcf[3] = {};
-        for (int i = 0; i < fi.numPlanes; i++) {
-            srcf[i] = vsapi->getFrameFilter(n, d->srcNodes[rd->selectedClip[i]], frameCtx);
-        }
-
-        int height = vsapi->getFrameHeight(srcf[0], 0);
-        int width = vsapi->getFrameWidth(srcf[0], 0);
-        int planes[3] = { 0, 1, 2 };
-        VSFrame *dst = vsapi->newVideoFrame2(&fi, width, height, srcf, planes, srcf[0], core);
-
-        for (int i = 0; i < d->vi.format.numPlanes; i++) {
-            vsapi->freeFrame(srcf[i]);
+        return assemble(st.clip);
+    } else if (activationReason == arError) {
+        if (*frameData && !isPacked(*frameData)) {
+            std::unique_ptr<RuntimeData> rd(reinterpret_cast<RuntimeData *>(*frameData));
+            for (auto *p: rd->props)
+                vsapi->freeFrame(p);
         }
-
-        return dst;
+        *frameData = nullptr;
     }
 
     return nullptr;
@@ -1969,6 +6943,15 @@ static const VSFrame *VS_CC selectGetFrame(int n, int activationReason, void *in
 
 static void VS_CC selectFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     SelectData *d = static_cast<SelectData *>(instanceData);
+    if (d->stats) {
+        std::vector<std::string> names;
+        for (size_t i = 0; i < d->counters.size(); i++)
+            names.push_back("plane " + std::to_string(i));
+        logCounters("Select", names, d->counters, core, vsapi);
+    }
+    d->frames.free(vsapi);
+    propSnapshotRelease(d->propNodes);
+    propSnapshotRelease(d->srcNodes);
     for (auto *p: d->propNodes)
         vsapi->freeNode(p);
     for (auto *p: d->srcNodes)
@@ -1986,6 +6969,8 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
         for (int i = 0; i < numSrcInputs; i++) {
             d->srcNodes.push_back(vsapi->mapGetNode(in, "clip_src", i, &err));
         }
+        if (numSrcInputs > (1 << SelectData::clipBits))
+            throw std::runtime_error("at most " + std::to_string(1 << SelectData::clipBits) + " clip_src clips are supported");
 
         std::vector<const VSVideoInfo *> vi;
         for (auto *p: d->srcNodes) {
@@ -2015,29 +7000,75 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
         for (int i = 0; i < d->numPropInputs; i++) {
             d->propNodes.push_back(vsapi->mapGetNode(in, "prop_src", i, &err));
         }
+        d->frames.init(d->propNodes, vsapi);
 
         d->vi = *vi[0];
 
+        int speculate = vsh::int64ToIntS(vsapi->mapGetInt(in, "speculate", 0, &err));
+        if (err)
+            speculate = -1;
+        if (speculate >= numSrcInputs)
+            throw std::runtime_error("speculate must be -1 (off) or the index of a clip in clip_src");
+        d->speculate = speculate >= 0;
+        for (auto &p: d->predicted)
+            p = std::max(speculate, 0);
+        d->stats = !!vsh::int64ToIntS(vsapi->mapGetInt(in, "stats", 0, &err));
+
         int nexpr = vsapi->mapNumElements(in, "expr");
+        const int nguards = vsapi->mapNumElements(in, "guards");
         const int numPlanes = d->vi.format.numPlanes;
         if (nexpr > numPlanes)
             throw std::runtime_error("More expressions given than there are planes");
+        if (nexpr > 0 && nguards > 0)
+            throw std::runtime_error("expr and guards are mutually exclusive");
+        if (nexpr <= 0 && nguards <= 0)
+            throw std::runtime_error("either expr or guards must be given");
+        if (nguards > numSrcInputs)
+            throw std::runtime_error("More guards given than there are clip_src clips");
 
         std::string expr[3];
         for (int i = 0; i < nexpr; i++) {
             expr[i] = vsapi->mapGetData(in, "expr", i, nullptr);
         }
+        if (nguards > 0) {
+            // Guard i picks clip i, the first one that passes wins and the
+            // clip after the last guard is the fallback. The table becomes
+            // the expression "g0 0 g1 1 ... fallback ? ... ?" for all planes.
+            for (int i = 0; i < nguards; i++) {
+                const std::string guard = vsapi->mapGetData(in, "guards", i, nullptr);
+                std::vector<ExprOp> ops;
+                for (const auto &tok: tokenize(guard))
+                    ops.push_back(decodeToken(tok, true));
+                auto prog = prepareInterpret(ops);
+                if (!prog.error.empty())
+                    throw std::runtime_error("guard " + std::to_string(i) + ": " + prog.error);
+                expr[0] += guard + " " + std::to_string(i) + " ";
+            }
+            expr[0] += std::to_string(std::min(nguards, numSrcInputs - 1));
+            for (int i = 0; i < nguards; i++)
+                expr[0] += " ?";
+            nexpr = 1;
+        }
         for (int i = nexpr; i < 3; ++i) {
             expr[i] = expr[nexpr - 1];
         }
         for (int i = 0; i < numPlanes; i++) {
             auto tokens = tokenize(expr[i]);
+            std::vector<ExprOp> ops;
             for (const auto &tok: tokens) {
                 auto op = decodeToken(tok, true);
-                d->ops[i].push_back(op);
+                ops.push_back(op);
             }
+            for (const auto &op: ops) {
+                if (op.type == ExprOpType::CONST_LOAD && op.name.ends_with("[]"))
+                    throw std::runtime_error("array frame property access is only supported by PropExpr: " + op.name);
+                if (op.type == ExprOpType::CONST_LOAD && op.name.find(':') != std::string::npos)
+                    throw std::runtime_error("window aggregates are only supported by PropExpr: " + op.name);
+            }
+            d->frames.bind(ops);
+            d->ops[i] = prepareInterpret(ops);
             try {
-                const int numPropInputs = d->numPropInputs;
+                const int numPropInputs = (int)d->frames.size();
                 (void)interpret(d->ops[i], 0, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
                           [](const ExprOp &op, int y, int x) -> float { /* pixelGet */
                               throw std::runtime_error("unable to use pixel values in Select");
@@ -2051,6 +7082,29 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
                 throw e;
             }
         }
+
+        std::vector<std::vector<const std::vector<ExprOp> *>> outputs;
+        size_t numOps = 0;
+        for (int i = 0; i < numPlanes; i++) {
+            outputs.push_back({ &d->ops[i].ops });
+            numOps += d->ops[i].ops.size();
+            addProperties(d->props, d->ops[i].ops, (int)d->frames.size());
+        }
+        if (d->stats) {
+            for (int i = 0; i < numPlanes; i++) {
+                d->counters.emplace_back();
+                d->planeSlots[i] = propertySlots(d->props, d->ops[i].ops);
+                if (d->ops[i].ops.size() > SCALAR_COMPILE_LIMIT)
+                    continue;
+                d->planePrograms[i].reset(new ScalarProgram({ outputs[i] }, d->vi.width, d->vi.height));
+                for (const auto &pa: d->planePrograms[i]->propAccess())
+                    d->planeProgramProps[i].push_back(d->props.add(pa.clip, pa.name));
+            }
+        } else if (numOps <= SCALAR_COMPILE_LIMIT) {
+            d->program.reset(new ScalarProgram(outputs, d->vi.width, d->vi.height));
+            for (const auto &pa: d->program->propAccess())
+                d->programProps.push_back(d->props.add(pa.clip, pa.name));
+        }
     } catch (std::runtime_error &e) {
         for (auto *p: d->propNodes)
             vsapi->freeNode(p);
@@ -2070,44 +7124,73 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
     }
 
     const VSVideoInfo *vi = &d->vi;
-    vsapi->createVideoFilter(out, "Select", vi, selectGetFrame, selectFree, fmParallel, deps.data(), deps.size(), d.release(), core);
+    vsapi->createVideoFilter(out, "Select", vi, timedGetFrame<SelectData, selectGetFrame>, selectFree, fmParallel, deps.data(), deps.size(), d.release(), core);
 }
 
 // PropExpr
 struct PropExprData {
     std::vector<VSNode *> nodes;
     VSVideoInfo vi;
-    std::vector<std::pair<std::string, std::vector<std::vector<ExprOp>>>> ops;
+    std::vector<std::pair<std::string, std::vector<InterpProgram>>> ops;
+    std::unique_ptr<ScalarProgram> program; // evaluates every key's ops, if compiled
+    PropertyReader props;
+    std::vector<int> programProps; // slots of program->propAccess()
+    PropFrames frames;
+    // Keys whose expressions read x.Prop[] are evaluated for each element of
+    // the first such property, by their own program if compiled, and written
+    // as arrays. Per key and alternative, the slot of that property or -1.
+    std::vector<std::vector<int>> arraySlots;
+    std::vector<std::unique_ptr<ScalarProgram>> arrayPrograms;
+    std::vector<std::vector<int>> arrayProgramProps;
+    PropWindows windows;
+    std::vector<int> windowSlots; // of each aggregate of windows
+    // With stats, every key is evaluated on its own like array keys, so that
+    // it can be timed. Per key and alternative, the slots it reads.
+    bool stats = false;
+    std::deque<ExprCounters> counters;
+    std::vector<std::vector<std::vector<int>>> statSlots;
+    ScopedFilterStats perf{ "PropExpr" };
 
     PropExprData() : nodes(), vi(), ops() {}
+
+    bool isArray(size_t key) const {
+        return std::any_of(arraySlots[key].begin(), arraySlots[key].end(), [](int slot) { return slot >= 0; });
+    }
+    // Whether key has its own program.
+    bool separate(size_t key) const { return stats || isArray(key); }
 };
 
 static const VSFrame *VS_CC propExprGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     PropExprData *d = static_cast<PropExprData *>(instanceData);
 
+    struct RuntimeData {
+        std::vector<const VSFrame *> props; // by PropFrames source
+        std::vector<std::pair<int, int>> pending; // of PropWindows
+        bool fetched = false; // props is complete
+    };
+
     if (activationReason == arInitial) {
-        for (auto *p: d->nodes)
-            vsapi->requestFrameFilter(n, p, frameCtx);
+        std::unique_ptr<RuntimeData> rd(new RuntimeData);
+        rd->props = d->frames.request(n, frameCtx, vsapi);
+        rd->pending = d->windows.request(n, frameCtx, vsapi);
+        *frameData = reinterpret_cast<void *>(rd.release());
     } else if (activationReason == arAllFramesReady) {
-        std::vector<const VSFrame *> props(d->nodes.size(), nullptr);
-        for (size_t i = 0; i < d->nodes.size(); i++) {
-            props[i] = vsapi->getFrameFilter(n, d->nodes[i], frameCtx);
-        }
-
-        auto propGet = [&props, vsapi](int idx, const std::string &name) -> float {
-            auto m = vsapi->getFramePropertiesRO(props[idx]);
-            int err = 0;
-            float val = vsapi->mapGetInt(m, name.c_str(), 0, &err);
-            if (err == peType)
-                val = vsapi->mapGetFloat(m, name.c_str(), 0, &err);
-            if (err == peType) {
-                auto d = vsapi->mapGetData(m, name.c_str(), 0, &err);
-                if (d) val = d[0];
-            }
-            if (err != 0)
-                val = 0.0f; // XXX: non-existant property defaults to 0.
-            return val;
-        };
+        std::unique_ptr<RuntimeData> rd(reinterpret_cast<RuntimeData *>(*frameData));
+        *frameData = nullptr;
+        auto &props = rd->props;
+        if (!rd->fetched)
+            d->frames.fetch(n, props, frameCtx, vsapi);
+        rd->fetched = true;
+        ScratchVector<float> aggregates(d->windows.size());
+        if (!d->windows.compute(n, rd->pending, aggregates.data(), frameCtx, vsapi)) {
+            *frameData = reinterpret_cast<void *>(rd.release());
+            return nullptr;
+        }
+
+        FrameProperties frameProps(d->props, props, d->frames.keys(n), 0.0f, vsapi); // XXX: non-existant property defaults to 0.
+        auto propGet = [&frameProps](int idx, const std::string &name) -> float { return frameProps.get(idx, name); };
+        for (size_t i = 0; i < aggregates.size(); i++)
+            frameProps.set(d->windowSlots[i], aggregates[i]);
 
         const VSVideoFormat fi = d->vi.format;
         const VSFrame *srcf[3] = { props[0], props[0], props[0] };
@@ -2118,39 +7201,111 @@ static const VSFrame *VS_CC propExprGetFrame(int n, int activationReason, void *
         VSFrame *dst = vsapi->newVideoFrame2(&fi, width, height, srcf, planes, srcf[0], core);
 
         std::vector<float> vals;
-        // Two step atomic update
-        for (const auto &pair: d->ops) {
-            const auto &ops = pair.second[n % pair.second.size()];
-            float x;
-            try {
-                x = interpret(ops, n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
-                              [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
-                              propGet);
-            } catch (std::runtime_error &e) {
-                x = 0.0f;
+        // Two step atomic update; array keys are evaluated below.
+        if (d->program) {
+            std::vector<int> sel;
+            for (const auto &pair: d->ops)
+                sel.push_back(n % pair.second.size());
+            std::vector<float> propVals;
+            for (int slot: d->programProps)
+                propVals.push_back(frameProps.get(slot));
+            vals.resize(d->ops.size());
+            d->program->run(propVals.data(), sel.data(), vals.data(), n);
+        } else {
+            for (size_t i = 0; i < d->ops.size(); i++) {
+                const auto &ops = d->ops[i].second[n % d->ops[i].second.size()];
+                float x = 0.0f;
+                if (d->separate(i)) {
+                    vals.push_back(x);
+                    continue;
+                }
+                try {
+                    x = interpret(ops, n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
+                                  [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
+                                  propGet);
+                } catch (std::runtime_error &e) {
+                    x = 0.0f;
+                }
+                vals.push_back(x);
+            }
+        }
+        std::vector<std::vector<float>> arrays(d->ops.size());
+        for (size_t i = 0; i < d->ops.size(); i++) {
+            if (!d->separate(i))
+                continue;
+            const int j = n % d->ops[i].second.size();
+            const int slot = d->arraySlots[i][j];
+            const int len = slot < 0 ? 1 : frameProps.length(slot);
+            std::vector<float> propVals;
+            for (int k = 0; k < len; k++) {
+                const auto start = std::chrono::steady_clock::now();
+                bool error = !d->ops[i].second[j].error.empty();
+                frameProps.setElement(k);
+                float x = 0.0f;
+                if (d->arrayPrograms[i]) {
+                    propVals.clear();
+                    for (int s: d->arrayProgramProps[i])
+                        propVals.push_back(frameProps.get(s));
+                    d->arrayPrograms[i]->run(propVals.data(), &j, &x, n);
+                } else {
+                    try {
+                        x = interpret(d->ops[i].second[j], n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
+                                      [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
+                                      propGet);
+                        error = false;
+                    } catch (std::runtime_error &e) {
+                        x = 0.0f;
+                        error = true;
+                    }
+                }
+                arrays[i].push_back(x);
+                if (d->stats && d->ops[i].second[j].ops.size() > 0)
+                    d->counters[i].add(start, frameProps, d->statSlots[i][j], error);
             }
-            vals.push_back(x);
+            if (slot < 0)
+                vals[i] = arrays[i][0];
         }
+
         VSMap *map = vsapi->getFramePropertiesRW(dst);
         for (size_t i = 0; i < d->ops.size(); i++) {
             const auto &pair = d->ops[i];
             const auto &name = pair.first;
-            const auto &ops = pair.second[n % pair.second.size()];
+            const int j = n % pair.second.size();
+            const auto &ops = pair.second[j];
             float v = vals[i];
 
             vsapi->mapDeleteKey(map, name.c_str());
-            if (ops.size() > 0) {
+            if (ops.ops.size() > 0 && d->isArray(i) && d->arraySlots[i][j] >= 0) {
+                // Like scalars, integral results are stored as integers.
+                const auto &a = arrays[i];
+                if (a.empty())
+                    continue;
+                if (std::all_of(a.begin(), a.end(), [](float x) { return x == (float)(int64_t)x; })) {
+                    std::vector<int64_t> ints(a.begin(), a.end());
+                    vsapi->mapSetIntArray(map, name.c_str(), ints.data(), (int)ints.size());
+                } else {
+                    std::vector<double> floats(a.begin(), a.end());
+                    vsapi->mapSetFloatArray(map, name.c_str(), floats.data(), (int)floats.size());
+                }
+            } else if (ops.ops.size() > 0) {
                 if (v == (float)(int64_t)v)
                     vsapi->mapSetInt(map, name.c_str(), (int64_t)v, maAppend);
                 else
                     vsapi->mapSetFloat(map, name.c_str(), v, maAppend);
             }
         }
+        if (d->stats)
+            setCounterProps(map, d->counters, vsapi);
 
         for (auto *p: props)
             vsapi->freeFrame(p);
 
         return dst;
+    } else if (activationReason == arError) {
+        std::unique_ptr<RuntimeData> rd(reinterpret_cast<RuntimeData *>(*frameData));
+        *frameData = nullptr;
+        for (auto *p: rd->props)
+            vsapi->freeFrame(p);
     }
 
     return nullptr;
@@ -2158,6 +7313,14 @@ static const VSFrame *VS_CC propExprGetFrame(int n, int activationReason, void *
 
 static void VS_CC propExprFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     PropExprData *d = static_cast<PropExprData *>(instanceData);
+    if (d->stats) {
+        std::vector<std::string> names;
+        for (const auto &pair: d->ops)
+            names.push_back(pair.first);
+        logCounters("PropExpr", names, d->counters, core, vsapi);
+    }
+    d->frames.free(vsapi);
+    propSnapshotRelease(d->nodes);
     for (auto *p: d->nodes)
         vsapi->freeNode(p);
     delete d;
@@ -2180,6 +7343,9 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
         }
 
         d->vi = *vi[0];
+        d->frames.init(d->nodes, vsapi);
+        d->windows.init(d->nodes, vsapi);
+        d->stats = !!vsh::int64ToIntS(vsapi->mapGetInt(in, "stats", 0, &err));
 
         auto func = vsapi->mapGetFunction(in, "dict", 0, nullptr);
         auto in_map = vsapi->createMap();
@@ -2213,23 +7379,30 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
                     throw std::runtime_error("invalid type for key " + std::string(key) + ", only int/float/str are supported");
                 }
 
-                std::vector<std::vector<ExprOp>> opss(exprs.size());
+                std::vector<InterpProgram> opss(exprs.size());
                 for (size_t i = 0; i < exprs.size(); i++) {
                     const auto &expr = exprs[i];
-                    auto &ops = opss[i];
+                    std::vector<ExprOp> ops;
                     if (expr.size() != 0) {
                         auto tokens = tokenize(expr);
                         for (const auto &tok: tokens) {
                             auto op = decodeToken(tok, true);
                             ops.push_back(op);
                         }
+                        try {
+                            d->windows.bind(ops);
+                            d->frames.bind(ops);
+                        } catch (std::runtime_error &e) {
+                            throw std::runtime_error(std::string(key) + ": " + e.what());
+                        }
+                        const int numSources = (int)d->frames.size();
                         try {
                             (void)interpret(ops, 0, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
                                       [key](const ExprOp &op, int y, int x) -> float { /* pixelGet */
                                           throw std::runtime_error(std::string(key) + ": unable to use pixel values in PropExpr");
                                       },
-                                      [key, numInputs](int index, const std::string &name) -> float { /* propGet */
-                                          if (index >= numInputs)
+                                      [key, numSources](int index, const std::string &name) -> float { /* propGet */
+                                          if (index >= numSources && index < PropWindows::base)
                                               throw std::runtime_error(std::string(key) + ": property access clip out of range");
                                           return 0.0f;
                                       });
@@ -2237,6 +7410,7 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
                             throw e;
                         }
                     }
+                    opss[i] = prepareInterpret(ops);
                 }
                 d->ops.emplace_back(key, std::move(opss));
             }
@@ -2249,6 +7423,54 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
         }
 
         vsapi->freeFunction(func);
+
+        for (size_t i = 0; i < d->windows.size(); i++) {
+            auto key = d->windows.key(i);
+            d->windowSlots.push_back(d->props.add(key.first, key.second));
+        }
+
+        std::vector<std::vector<const std::vector<ExprOp> *>> outputs;
+        size_t numOps = 0;
+        static const std::vector<ExprOp> none; // in place of array keys
+        d->arraySlots.resize(d->ops.size());
+        d->arrayPrograms.resize(d->ops.size());
+        d->arrayProgramProps.resize(d->ops.size());
+        for (size_t i = 0; i < d->ops.size(); i++) {
+            std::vector<const std::vector<ExprOp> *> alts;
+            size_t altOps = 0;
+            for (const auto &prog: d->ops[i].second) {
+                alts.push_back(&prog.ops);
+                altOps += prog.ops.size();
+                addProperties(d->props, prog.ops, (int)d->frames.size());
+                auto it = std::find_if(prog.ops.begin(), prog.ops.end(), [](const ExprOp &op) {
+                    return op.type == ExprOpType::CONST_LOAD && op.name.ends_with("[]");
+                });
+                d->arraySlots[i].push_back(it == prog.ops.end() ? -1 :
+                    d->props.add(it->imm.i - static_cast<int>(LoadConstType::LAST), it->name));
+            }
+            if (d->stats) {
+                d->counters.emplace_back();
+                d->statSlots.emplace_back();
+                for (const auto &prog: d->ops[i].second)
+                    d->statSlots.back().push_back(propertySlots(d->props, prog.ops));
+            }
+            if (!d->separate(i)) {
+                outputs.push_back(std::move(alts));
+                numOps += altOps;
+                continue;
+            }
+            outputs.push_back({ &none });
+            if (altOps <= SCALAR_COMPILE_LIMIT) {
+                d->arrayPrograms[i].reset(new ScalarProgram({ alts }, d->vi.width, d->vi.height));
+                for (const auto &pa: d->arrayPrograms[i]->propAccess())
+                    d->arrayProgramProps[i].push_back(d->props.add(pa.clip, pa.name));
+            }
+        }
+        if (numOps <= SCALAR_COMPILE_LIMIT) {
+            d->program.reset(new ScalarProgram(outputs, d->vi.width, d->vi.height));
+            for (const auto &pa: d->program->propAccess())
+                d->programProps.push_back(d->props.add(pa.clip, pa.name));
+        }
     } catch (std::runtime_error &e) {
         for (auto *p: d->nodes)
             vsapi->freeNode(p);
@@ -2266,7 +7488,7 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
     );
 
     const VSVideoInfo *vi = &d->vi;
-    vsapi->createVideoFilter(out, "PropExpr", vi, propExprGetFrame, propExprFree, fmParallel, deps.data(), deps.size(), d.release(), core);
+    vsapi->createVideoFilter(out, "PropExpr", vi, timedGetFrame<PropExprData, propExprGetFrame>, propExprFree, fmParallel, deps.data(), deps.size(), d.release(), core);
 }
 
 void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi)
@@ -2274,8 +7496,19 @@ void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *c
     vsapi->mapSetData(out, "expr_backend", "llvm", -1, dtUtf8, maAppend);
     for (const auto &f : features)
         vsapi->mapSetData(out, "expr_features", f.c_str(), -1, dtUtf8, maAppend);
+    const SimdConfig &host = hostSimd();
+    for (const auto &f : { std::string("isa=") + host.isa, "lanes=" + std::to_string(host.lanes), "unroll=" + std::to_string(host.unroll) })
+        vsapi->mapSetData(out, "expr_features", f.c_str(), -1, dtUtf8, maAppend);
     for (const auto &f : selectFeatures)
         vsapi->mapSetData(out, "select_features", f.c_str(), -1, dtUtf8, maAppend);
+
+    auto stats = exprCache.stats();
+    vsapi->mapSetInt(out, "expr_cache_hits", stats.hits, maReplace);
+    vsapi->mapSetInt(out, "expr_cache_misses", stats.misses, maReplace);
+    vsapi->mapSetInt(out, "expr_cache_evictions", stats.evictions, maReplace);
+    vsapi->mapSetInt(out, "expr_cache_evicted_bytes", stats.evictedBytes, maReplace);
+    vsapi->mapSetInt(out, "expr_cache_bytes", stats.bytes, maReplace);
+    vsapi->mapSetInt(out, "expr_cache_entries", stats.entries, maReplace);
 }
 
 } // namespace
@@ -2285,9 +7518,9 @@ void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *c
 // Init
 
 void VS_CC exprInitialize(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
-    vsapi->registerFunction("Expr", "clips:vnode[];expr:data[];format:int:opt;opt:int:opt;boundary:int:opt;", "clip:vnode;", exprCreate, nullptr, plugin);
-    vsapi->registerFunction("Select", "clip_src:vnode[];prop_src:vnode[];expr:data[];", "clip:vnode;", selectCreate, nullptr, plugin);
-    vsapi->registerFunction("PropExpr", "clips:vnode[];dict:func;", "clip:vnode;", propExprCreate, nullptr, plugin);
+    vsapi->registerFunction("Expr", "clips:vnode[];expr:data[];format:int:opt;opt:int:opt;boundary:int:opt;threads:int:opt;lanes:int:opt;unroll:int:opt;specialize:data[]:opt;stream:int:opt;prefetch:int:opt;async:int:opt;reduce:data[]:opt;fp16:int:opt;stats:int:opt;accuracy:int:opt;backend:data:opt;device_id:int:opt;num_streams:int:opt;gpu_output:int:opt;outputs:int:opt;opt_level:int:opt;branch:int:opt;", "clip:vnode;", exprCreate, nullptr, plugin);
+    vsapi->registerFunction("Select", "clip_src:vnode[];prop_src:vnode[];expr:data[]:opt;speculate:int:opt;guards:data[]:opt;stats:int:opt;", "clip:vnode;", selectCreate, nullptr, plugin);
+    vsapi->registerFunction("PropExpr", "clips:vnode[];dict:func;stats:int:opt;", "clip:vnode;", propExprCreate, nullptr, plugin);
     registerVersionFunc(versionCreate);
     initExpr();
 }
@@ -277,4 +277,34 @@ bool CPUID::supportsAVX2()
 	return (eax_ebx_ecx_edx[1] & 0x00000020) != 0;
 }
 
+bool CPUID::supportsAVX512F()
+{
+	if(!supportsAVX2())
+	{
+		return false;
+	}
+
+	int eax_ebx_ecx_edx[4];
+	cpuid(eax_ebx_ecx_edx, 7, 0);
+	if((eax_ebx_ecx_edx[1] & 0x00010000) == 0)  // Bit 16 (AVX512F) of EBX
+	{
+		return false;
+	}
+
+	// XCR0 bits 1-2 (xmm, ymm) and 5-7 (opmask, zmm0-15 upper halves, zmm16-31) must all be enabled by the OS.
+	unsigned long long xcr0 = 0;
+#if defined(__i386__) || defined(__x86_64__)
+#	if defined(_MSC_VER)
+	xcr0 = _xgetbv(0);
+#	else
+	unsigned int eax, edx;
+	__asm volatile("xgetbv"
+	               : "=a"(eax), "=d"(edx)
+	               : "c"(0));
+	xcr0 = ((unsigned long long)edx << 32) | eax;
+#	endif
+#endif
+	return (xcr0 & 0xe6) == 0xe6;
+}
+
 }  // namespace rr
@@ -37,6 +37,7 @@ public:
 	static bool supportsSSSE3();
 	static bool supportsSSE4_1();
 	static bool supportsAVX2();  // Also ensures support for OSXSAVE and FMA
+	static bool supportsAVX512F();  // Also ensures the OS saves the opmask and zmm registers
 	static bool supportsF16C();
 
 	static void setEnableMMX(bool enable);
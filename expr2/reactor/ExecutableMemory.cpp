@@ -37,7 +37,10 @@
 #	include <sys/prctl.h>
 #endif
 
+#include <map>
 #include <memory.h>
+#include <mutex>
+#include <vector>
 
 #undef allocate
 #undef deallocate
@@ -405,4 +408,150 @@ void deallocateMemoryPages(void *memory, size_t bytes)
 #endif
 }
 
+namespace {
+
+// Pooled pages are carved out of slabs of this size, the size of a huge page
+// on x86-64 and ARM64.
+constexpr size_t slabSize = 2 << 20;
+
+struct Slab
+{
+	unsigned char *base;
+	std::map<size_t, size_t> free;  // runs of free pages, offset -> length
+};
+
+// The slabs of code pages and of data pages. Slabs are never released, as
+// pages freed by one routine are soon reused by the next.
+struct PagePool
+{
+	std::mutex lock;
+	std::vector<Slab> slabs;
+} pools[2];
+
+// Whether the slabs should be backed by transparent huge pages, as asked for
+// by AKARIN_EXPR_HUGEPAGES=1. Only Linux supports this.
+bool useHugePages()
+{
+	static const bool enabled = [] {
+		const char *v = getenv("AKARIN_EXPR_HUGEPAGES");
+		return v != nullptr && *v != '\0' && strcmp(v, "0") != 0;
+	}();
+	return enabled;
+}
+
+void *allocateSlab(bool need_exec)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if(useHugePages())
+	{
+		// Over-allocate and trim to align the slab to a huge page boundary.
+		// A slab can only be backed by a huge page once all its pages have
+		// the same permissions, i.e. once it is full of finished code.
+		void *mapping = mmap(nullptr, 2 * slabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mapping != MAP_FAILED)
+		{
+			uintptr_t start = reinterpret_cast<uintptr_t>(mapping);
+			uintptr_t aligned = roundUp(start, slabSize);
+			if(aligned > start)
+			{
+				munmap(mapping, aligned - start);
+			}
+			munmap(reinterpret_cast<void *>(aligned + slabSize), start + slabSize - aligned);
+			madvise(reinterpret_cast<void *>(aligned), slabSize, MADV_HUGEPAGE);
+			return reinterpret_cast<void *>(aligned);
+		}
+	}
+#endif
+	return allocateMemoryPages(slabSize, PERMISSION_READ | PERMISSION_WRITE, need_exec);
+}
+
+}  // anonymous namespace
+
+void *allocatePooledPages(size_t bytes, int permissions, bool need_exec)
+{
+	size_t length = roundUp(bytes, memoryPageSize());
+	if(length > slabSize / 4)
+	{
+		return allocateMemoryPages(bytes, permissions, need_exec);
+	}
+
+	PagePool &pool = pools[need_exec];
+	std::lock_guard<std::mutex> guard(pool.lock);
+	void *memory = nullptr;
+	for(auto &slab : pool.slabs)
+	{
+		for(auto it = slab.free.begin(); it != slab.free.end(); ++it)
+		{
+			if(it->second < length)
+			{
+				continue;
+			}
+			auto [offset, run] = *it;
+			slab.free.erase(it);
+			if(run > length)
+			{
+				slab.free.emplace(offset + length, run - length);
+			}
+			memory = slab.base + offset;
+			break;
+		}
+		if(memory)
+		{
+			break;
+		}
+	}
+	if(!memory)
+	{
+		auto base = static_cast<unsigned char *>(allocateSlab(need_exec));
+		if(!base)
+		{
+			return nullptr;
+		}
+		pool.slabs.push_back({ base, { { length, slabSize - length } } });
+		memory = base;
+	}
+
+	protectMemoryPages(memory, length, permissions);
+	return memory;
+}
+
+void deallocatePooledPages(void *memory, size_t bytes)
+{
+	size_t length = roundUp(bytes, memoryPageSize());
+	auto address = static_cast<unsigned char *>(memory);
+	for(auto &pool : pools)
+	{
+		std::lock_guard<std::mutex> guard(pool.lock);
+		for(auto &slab : pool.slabs)
+		{
+			if(address < slab.base || address >= slab.base + slabSize)
+			{
+				continue;
+			}
+
+			protectMemoryPages(memory, length, PERMISSION_READ | PERMISSION_WRITE);
+			size_t offset = address - slab.base;
+			auto next = slab.free.lower_bound(offset);
+			if(next != slab.free.end() && next->first == offset + length)
+			{
+				length += next->second;
+				next = slab.free.erase(next);
+			}
+			if(next != slab.free.begin())
+			{
+				auto prev = std::prev(next);
+				if(prev->first + prev->second == offset)
+				{
+					prev->second += length;
+					return;
+				}
+			}
+			slab.free.emplace(offset, length);
+			return;
+		}
+	}
+
+	deallocateMemoryPages(memory, bytes);
+}
+
 }  // namespace rr
@@ -40,6 +40,15 @@ void protectMemoryPages(void *memory, size_t bytes, int permissions);
 // Releases memory allocated with allocateMemoryPages().
 void deallocateMemoryPages(void *memory, size_t bytes);
 
+// Like allocateMemoryPages(), but small allocations share slabs of pages
+// with each other, so that the code of many routines is packed into few
+// mappings. Set AKARIN_EXPR_HUGEPAGES=1 to back the slabs with transparent
+// huge pages on Linux.
+void *allocatePooledPages(size_t bytes, int permissions, bool need_exec);
+
+// Releases memory allocated with allocatePooledPages().
+void deallocatePooledPages(void *memory, size_t bytes);
+
 template<typename P>
 P unaligned_read(P *address)
 {
@@ -26,6 +26,7 @@ __pragma(warning(push))
     __pragma(warning(disable : 4146))  // unary minus operator applied to unsigned type, result still unsigned
 #endif
 
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
@@ -158,6 +159,7 @@ public:
 	llvm::orc::JITTargetMachineBuilder getTargetMachineBuilder(rr::Optimization::Level optLevel) const;
 	const llvm::DataLayout &getDataLayout() const;
 	const llvm::Triple &getTargetTriple() const;
+	std::string getTargetDescription() const;
 
 private:
 	JITGlobals(llvm::orc::JITTargetMachineBuilder &&jitTargetMachineBuilder, llvm::DataLayout &&dataLayout);
@@ -251,6 +253,13 @@ const llvm::Triple &JITGlobals::getTargetTriple() const
 	return jitTargetMachineBuilder.getTargetTriple();
 }
 
+std::string JITGlobals::getTargetDescription() const
+{
+	return jitTargetMachineBuilder.getTargetTriple().str() + ";" +
+	       jitTargetMachineBuilder.getCPU() + ";" +
+	       jitTargetMachineBuilder.getFeatures().getString();
+}
+
 JITGlobals::JITGlobals(llvm::orc::JITTargetMachineBuilder &&jitTargetMachineBuilder, llvm::DataLayout &&dataLayout)
     : jitTargetMachineBuilder(jitTargetMachineBuilder)
     , dataLayout(dataLayout)
@@ -298,10 +307,11 @@ public:
 
 		bool need_exec =
 		    purpose == llvm::SectionMemoryManager::AllocationPurpose::Code;
-		void *addr = rr::allocateMemoryPages(
+		void *addr = rr::allocatePooledPages(
 		    numBytes, flagsToPermissions(flags), need_exec);
 		if(!addr)
 			return llvm::sys::MemoryBlock();
+		allocated += numBytes;
 		return llvm::sys::MemoryBlock(addr, numBytes);
 	}
 
@@ -326,11 +336,19 @@ public:
 	{
 		size_t size = block.allocatedSize();
 
-		rr::deallocateMemoryPages(block.base(), size);
+		rr::deallocatePooledPages(block.base(), size);
+		allocated -= size;
 		return std::error_code();
 	}
 
+	size_t allocatedSize() const
+	{
+		return allocated;
+	}
+
 private:
+	std::atomic<size_t> allocated{ 0 };
+
 	int flagsToPermissions(unsigned flags)
 	{
 		int result = 0;
@@ -736,6 +754,233 @@ struct FatalDiagnosticsHandler : public llvm::DiagnosticHandler
 	bool *fatal;
 };
 
+// ObjectCacheAdapter forwards freshly compiled objects to a rr::ObjectCache.
+// Loading is handled by JITRoutine itself, as it needs to bypass the compile
+// layer entirely.
+class ObjectCacheAdapter final : public llvm::ObjectCache
+{
+public:
+	ObjectCacheAdapter(rr::ObjectCache *cache)
+	    : cache(cache)
+	{}
+
+	void notifyObjectCompiled(const llvm::Module *, llvm::MemoryBufferRef obj) override
+	{
+		cache->store(obj.getBufferStart(), obj.getBufferSize());
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *) override
+	{
+		return nullptr;
+	}
+
+private:
+	rr::ObjectCache *cache;
+};
+
+#if LLVM_VERSION_MAJOR >= 15
+// JITSession is the LLVM JIT session and object layer shared by all routines.
+// Each routine is linked into a JITDylib of its own, which is removed along
+// with the routine, so no routine can see the symbols of another. Setting up
+// a session is costly next to linking the few functions of a routine.
+class JITSession
+{
+public:
+	static JITSession &get()
+	{
+		// Deliberately leaked, as routines may outlive static destruction.
+		static JITSession *instance = new JITSession();
+		return *instance;
+	}
+
+	llvm::orc::ExecutionSession session;
+	llvm::orc::RTDyldObjectLinkingLayer objectLayer;
+
+	// The mapper of the routine whose objects the calling thread is linking.
+	// Objects are linked during the lookups of the routine, on its thread.
+	static thread_local MemoryMapper *currentMapper;
+
+private:
+	JITSession()
+	    : session([]() -> std::unique_ptr<llvm::orc::SelfExecutorProcessControl> {
+		    auto p = llvm::orc::SelfExecutorProcessControl::Create();
+		    if (!p) abort(); // shouldn't fail
+		    return std::move(*p);
+	    }())
+	    , objectLayer(session,
+#if LLVM_VERSION_MAJOR >= 21
+	                  [](const llvm::MemoryBuffer &) {
+		                  return std::make_unique<llvm::SectionMemoryManager>(currentMapper);
+	                  }
+#else
+	                  []() {
+		                  return std::make_unique<llvm::SectionMemoryManager>(currentMapper);
+	                  }
+#endif
+	      )
+	{
+#ifdef ENABLE_RR_DEBUG_INFO
+		// TODO(b/165000222): Update this on next LLVM roll.
+		// https://github.com/llvm/llvm-project/commit/98f2bb4461072347dcca7d2b1b9571b3a6525801
+		// introduces RTDyldObjectLinkingLayer::registerJITEventListener().
+		// The current API does not appear to have any way to bind the
+		// rr::DebugInfo::NotifyFreeingObject event.
+		objectLayer.setNotifyLoaded([](llvm::orc::VModuleKey,
+		                               const llvm::object::ObjectFile &obj,
+		                               const llvm::RuntimeDyld::LoadedObjectInfo &l) {
+			static std::atomic<uint64_t> unique_key{ 0 };
+			rr::DebugInfo::NotifyObjectEmitted(unique_key++, obj, l);
+		});
+#endif  // ENABLE_RR_DEBUG_INFO
+
+		if(JITGlobals::get()->getTargetTriple().isOSBinFormatCOFF())
+		{
+			// Hack to support symbol visibility in COFF.
+			// Matches hack in llvm::orc::LLJIT::createObjectLinkingLayer().
+			// See documentation on these functions for more detail.
+			objectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
+			objectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
+		}
+	}
+};
+
+thread_local MemoryMapper *JITSession::currentMapper = nullptr;
+
+// JITRoutine is a rr::Routine that compiles its module to an object up front,
+// frees the IR and links the object into its own JITDylib of the shared
+// JITSession. Its code and data go to pages pooled with other routines.
+class JITRoutine : public rr::Routine
+{
+public:
+	JITRoutine(
+	    std::unique_ptr<llvm::Module> module,
+	    std::unique_ptr<llvm::LLVMContext> context,
+	    const char *name,
+	    llvm::Function **funcs,
+	    size_t count,
+	    const rr::Config &config,
+	    rr::ObjectCache *cache,
+	    std::vector<uint8_t> object)
+	    : name(name)
+	    , addresses(count)
+	{
+		static std::atomic<uint64_t> unique_id{ 0 };
+
+		auto &jit = JITSession::get();
+		bool fatalCompileIssue = false;
+		context->setDiagnosticHandler(std::make_unique<FatalDiagnosticsHandler>(&fatalCompileIssue), true);
+
+		llvm::SmallVector<llvm::orc::SymbolStringPtr, 8> functionNames(count);
+		llvm::orc::MangleAndInterner mangle(jit.session, JITGlobals::get()->getDataLayout());
+
+		for(size_t i = 0; i < count; i++)
+		{
+			auto func = funcs[i];
+
+			if(!func->hasName())
+			{
+				func->setName("f" + llvm::Twine(i).str());
+			}
+
+			functionNames[i] = mangle(func->getName());
+		}
+
+#ifdef ENABLE_RR_EMIT_ASM_FILE
+		const auto asmFilename = rr::AsmFile::generateFilename(name);
+		rr::AsmFile::emitAsmFile(asmFilename, JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel()), *module);
+#endif
+
+		// The module is freed once compiled.
+		// Make sure funcs are not referenced after this point.
+		funcs = nullptr;
+
+		std::unique_ptr<llvm::MemoryBuffer> buffer;
+		if(!object.empty())
+		{
+			// The cached object was compiled from an identical module, so only its symbol names are needed.
+			buffer = llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(reinterpret_cast<const char *>(object.data()), object.size()), name);
+		}
+		else
+		{
+			ObjectCacheAdapter cacheAdapter(cache);
+			llvm::orc::ConcurrentIRCompiler compiler(JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel()));
+			if(cache)
+			{
+				compiler.setObjectCache(&cacheAdapter);
+			}
+
+			auto compiled = compiler(*module);
+			ASSERT_MSG(compiled, "Failed to compile routine: %s",
+			           llvm::toString(compiled.takeError()).c_str());
+			buffer = std::move(*compiled);
+		}
+
+		// The IR is not needed any more; only the object is linked.
+		module.reset();
+		context.reset();
+
+		if(fatalCompileIssue)
+		{
+			return;
+		}
+
+		dylib = &jit.session.createBareJITDylib("<routine " + std::to_string(unique_id++) + ">");
+		dylib->addGenerator(std::make_unique<ExternalSymbolGenerator>());
+
+		JITSession::currentMapper = &memoryMapper;
+		llvm::cantFail(jit.objectLayer.add(*dylib, std::move(buffer)));
+
+		// Resolve the function addresses.
+		for(size_t i = 0; i < count; i++)
+		{
+			// This is where the object is linked.
+			auto symbol = jit.session.lookup({ dylib }, functionNames[i]);
+
+			ASSERT_MSG(symbol, "Failed to lookup address of routine function %d: %s",
+			           (int)i, llvm::toString(symbol.takeError()).c_str());
+
+#if LLVM_VERSION_MAJOR < 17
+			addresses[i] = reinterpret_cast<void *>(static_cast<intptr_t>(symbol->getAddress()));
+#else
+			addresses[i] = reinterpret_cast<void *>(static_cast<intptr_t>(symbol->getAddress().getValue()));
+#endif
+		}
+		JITSession::currentMapper = nullptr;
+
+#ifdef ENABLE_RR_EMIT_ASM_FILE
+		rr::AsmFile::fixupAsmFile(asmFilename, addresses);
+#endif
+	}
+
+	~JITRoutine()
+	{
+		if(dylib)
+		{
+			auto &session = JITSession::get().session;
+			if(auto err = session.removeJITDylib(*dylib))
+			{
+				session.reportError(std::move(err));
+			}
+		}
+	}
+
+	const void *getEntry(int index) const override
+	{
+		return addresses[index];
+	}
+
+	size_t getMemorySize() const override
+	{
+		return memoryMapper.allocatedSize();
+	}
+
+private:
+	std::string name;
+	MemoryMapper memoryMapper;  // must outlive the removal of dylib
+	llvm::orc::JITDylib *dylib = nullptr;
+	std::vector<const void *> addresses;
+};
+#else
 // JITRoutine is a rr::Routine that holds a LLVM JIT session, compiler and
 // object layer as each routine may require different target machine
 // settings and no Reactor routine directly links against another.
@@ -748,7 +993,9 @@ public:
 	    const char *name,
 	    llvm::Function **funcs,
 	    size_t count,
-	    const rr::Config &config)
+	    const rr::Config &config,
+	    rr::ObjectCache *cache,
+	    std::vector<uint8_t> object)
 	    : name(name)
 #if LLVM_VERSION_MAJOR >= 13
 	    , session([]() -> std::unique_ptr<llvm::orc::SelfExecutorProcessControl> {
@@ -820,11 +1067,27 @@ public:
 		// Make sure funcs are not referenced after this point.
 		funcs = nullptr;
 
-		llvm::orc::IRCompileLayer compileLayer(session, objectLayer, std::make_unique<llvm::orc::ConcurrentIRCompiler>(JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel())));
+		ObjectCacheAdapter cacheAdapter(cache);
+		auto compiler = std::make_unique<llvm::orc::ConcurrentIRCompiler>(JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel()));
+		if(cache)
+		{
+			compiler->setObjectCache(&cacheAdapter);
+		}
+
+		llvm::orc::IRCompileLayer compileLayer(session, objectLayer, std::move(compiler));
 		llvm::orc::JITDylib &dylib(Unwrap(session.createJITDylib("<routine>")));
 		dylib.addGenerator(std::make_unique<ExternalSymbolGenerator>());
 
-		llvm::cantFail(compileLayer.add(dylib, llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
+		if(!object.empty())
+		{
+			// The cached object was compiled from an identical module, so only its symbol names are needed.
+			auto buffer = llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(reinterpret_cast<const char *>(object.data()), object.size()), name);
+			llvm::cantFail(objectLayer.add(dylib, std::move(buffer)));
+		}
+		else
+		{
+			llvm::cantFail(compileLayer.add(dylib, llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
+		}
 
 		// Resolve the function addresses.
 		for(size_t i = 0; i < count; i++)
@@ -871,6 +1134,11 @@ public:
 		return addresses[index];
 	}
 
+	size_t getMemorySize() const override
+	{
+		return memoryMapper.allocatedSize();
+	}
+
 private:
 	std::string name;
 	llvm::orc::ExecutionSession session;
@@ -879,6 +1147,8 @@ private:
 	std::vector<const void *> addresses;
 };
 
+#endif  // LLVM_VERSION_MAJOR >= 15
+
 }  // anonymous namespace
 
 namespace rr {
@@ -1000,10 +1270,16 @@ void JITBuilder::optimize(const rr::Config &cfg)
 	pm.run(*module, mam);
 }
 
-std::shared_ptr<rr::Routine> JITBuilder::acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg)
+std::shared_ptr<rr::Routine> JITBuilder::acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg,
+                                                      rr::ObjectCache *cache, std::vector<uint8_t> object)
 {
 	ASSERT(module);
-	return std::make_shared<JITRoutine>(std::move(module), std::move(context), name, funcs, count, cfg);
+	return std::make_shared<JITRoutine>(std::move(module), std::move(context), name, funcs, count, cfg, cache, std::move(object));
+}
+
+std::string Nucleus::getTargetDescription()
+{
+	return JITGlobals::get()->getTargetDescription();
 }
 
 }  // namespace rr
@@ -27,7 +27,13 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Alignment.h"
 #include "llvm/Support/ManagedStatic.h"
+#if LLVM_VERSION_MAJOR >= 17
+	#include "llvm/TargetParser/Host.h"
+#else
+	#include "llvm/Support/Host.h"
+#endif
 
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -529,6 +535,11 @@ static llvm::Function *createFunction(const char *name, llvm::Type *retTy, const
 }
 
 Nucleus::Nucleus()
+	: Nucleus(Config::Edit::None)
+{
+}
+
+Nucleus::Nucleus(const Config::Edit &cfgEdit)
 {
 #if !__has_feature(memory_sanitizer)
 	// thread_local variables in shared libraries are initialized at load-time,
@@ -538,7 +549,7 @@ Nucleus::Nucleus()
 	ASSERT(Variable::unmaterializedVariables == nullptr);
 #endif
 
-	jit = new JITBuilder(Nucleus::getDefaultConfig());
+	jit = new JITBuilder(cfgEdit.apply(Nucleus::getDefaultConfig()));
 	Variable::unmaterializedVariables = new Variable::UnmaterializedVariables();
 }
 
@@ -570,7 +581,7 @@ Config Nucleus::getDefaultConfig()
 	return ::defaultConfig();
 }
 
-std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */, ObjectCache *cache /* = nullptr */)
 {
 	if(jit->builder->GetInsertBlock()->empty() || !jit->builder->GetInsertBlock()->back().isTerminator())
 	{
@@ -616,7 +627,20 @@ std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config:
 		}
 #endif  // (defined(ENABLE_RR_LLVM_IR_VERIFICATION) || !defined(NDEBUG)) && LLVM_VERSION_MAJOR < 14
 
-		jit->optimize(cfg);
+		// A cached object replaces both the optimization and codegen of the module.
+		std::vector<uint8_t> object;
+		if(cache)
+		{
+			object = cache->load();
+		}
+
+		const bool fromObjectCache = !object.empty();
+		auto start = std::chrono::steady_clock::now();
+		if(!fromObjectCache)
+		{
+			jit->optimize(cfg);
+		}
+		auto optimized = std::chrono::steady_clock::now();
 
 		if(false)
 		{
@@ -625,7 +649,13 @@ std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config:
 			jit->module->print(file, 0);
 		}
 
-		routine = jit->acquireRoutine(name, &jit->function, 1, cfg);
+		routine = jit->acquireRoutine(name, &jit->function, 1, cfg, cache, std::move(object));
+		if(routine)
+		{
+			routine->optimizeTime = std::chrono::duration<double>(optimized - start).count();
+			routine->codegenTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - optimized).count();
+			routine->fromObjectCache = fromObjectCache;
+		}
 	};
 
 #ifdef JIT_IN_SEPARATE_THREAD
@@ -1280,6 +1310,36 @@ void Scatter(RValue<Pointer<Int>> base, RValue<Int4> val, RValue<Int4> offsets,
 	return createScatter(V(base.value()), V(val.value()), V(offsets.value()), V(mask.value()), alignment);
 }
 
+void Nucleus::createNonTemporalStore(Value *value, Value *ptr, Type *type, unsigned int alignment)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+
+	if(asInternalType(type) != Type_LLVM)
+	{
+		// Emulated narrow vectors are stored piecewise; keep them regular.
+		createStore(value, ptr, type, false, alignment);
+		return;
+	}
+
+	auto store = jit->builder->CreateAlignedStore(V(value), V(ptr), llvm::MaybeAlign(alignment));
+	auto one = llvm::ConstantAsMetadata::get(jit->builder->getInt32(1));
+	store->setMetadata(llvm::LLVMContext::MD_nontemporal, llvm::MDNode::get(*jit->context, one));
+}
+
+void Nucleus::createPrefetch(Value *ptr)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+
+	auto i32Ty = llvm::Type::getInt32Ty(*jit->context);
+	auto func = llvm::Intrinsic::getDeclaration(jit->module.get(), llvm::Intrinsic::prefetch, { V(ptr)->getType() });
+	jit->builder->CreateCall(func, {
+	                                   V(ptr),
+	                                   llvm::ConstantInt::get(i32Ty, 0),  // read
+	                                   llvm::ConstantInt::get(i32Ty, 3),  // keep in all cache levels
+	                                   llvm::ConstantInt::get(i32Ty, 1),  // data cache
+	                               });
+}
+
 void Nucleus::createFence(std::memory_order memoryOrder)
 {
 	RR_DEBUG_INFO_UPDATE_LOC();
@@ -4859,7 +4919,7 @@ void Module::add(llvm::Function *f, const char *name)
 		f->setName(name);
 }
 
-std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */, ObjectCache *cache /* = nullptr */)
 {
 	for (auto f: functions) {
 		// Return creates a new basicblock, which we have to terminate with a return instruction.
@@ -4879,7 +4939,7 @@ std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &c
 			}
 		}
 	}
-	return core->acquireRoutine(name, cfgEdit);
+	return core->acquireRoutine(name, cfgEdit, cache);
 }
 
 
@@ -4935,6 +4995,56 @@ RValue<UShort8> TryFP32To16(RValue<Float8> x, bool &ok)
 	return res;
 }
 
+static llvm::Value *halfVector(RValue<UShort8> x)
+{
+	auto halfVecType = llvm::FixedVectorType::get(llvm::Type::getHalfTy(*jit->context), 8);
+	return jit->builder->CreateBitCast(V(x.value()), halfVecType);
+}
+
+RValue<UShort8> HalfArith(HalfOp op, RValue<UShort8> x, RValue<UShort8> y)
+{
+	llvm::Value *a = halfVector(x), *b = halfVector(y);
+	llvm::Value *one = llvm::ConstantFP::get(a->getType(), 1.0), *zero = llvm::ConstantFP::get(a->getType(), 0.0);
+	llvm::Value *r = nullptr;
+	switch(op)
+	{
+	case HalfOp::Add: r = jit->builder->CreateFAdd(a, b); break;
+	case HalfOp::Sub: r = jit->builder->CreateFSub(a, b); break;
+	case HalfOp::Mul: r = jit->builder->CreateFMul(a, b); break;
+	case HalfOp::Div: r = jit->builder->CreateFDiv(a, b); break;
+	case HalfOp::Min: r = jit->builder->CreateSelect(jit->builder->CreateFCmpOLT(a, b), a, b); break;
+	case HalfOp::Max: r = jit->builder->CreateSelect(jit->builder->CreateFCmpOGT(a, b), a, b); break;
+	case HalfOp::CmpEQ: r = jit->builder->CreateSelect(jit->builder->CreateFCmpOEQ(a, b), one, zero); break;
+	case HalfOp::CmpLT: r = jit->builder->CreateSelect(jit->builder->CreateFCmpOLT(a, b), one, zero); break;
+	case HalfOp::CmpLE: r = jit->builder->CreateSelect(jit->builder->CreateFCmpOLE(a, b), one, zero); break;
+	case HalfOp::CmpNEQ: r = jit->builder->CreateSelect(jit->builder->CreateFCmpONE(a, b), one, zero); break;
+	case HalfOp::CmpNLT: r = jit->builder->CreateSelect(jit->builder->CreateFCmpOGE(a, b), one, zero); break;
+	case HalfOp::CmpNLE: r = jit->builder->CreateSelect(jit->builder->CreateFCmpOGT(a, b), one, zero); break;
+	}
+	return As<UShort8>(V(jit->builder->CreateBitCast(r, T(UShort8::type()))));
+}
+
+RValue<UShort8> HalfSelect(RValue<UShort8> cond, RValue<UShort8> x, RValue<UShort8> y)
+{
+	llvm::Value *c = halfVector(cond);
+	llvm::Value *positive = jit->builder->CreateFCmpOGT(c, llvm::ConstantFP::get(c->getType(), 0.0));
+	return As<UShort8>(V(jit->builder->CreateSelect(positive, V(x.value()), V(y.value()))));
+}
+
+bool SupportsNativeHalf()
+{
+	static const bool native = [] {
+#if LLVM_VERSION_MAJOR >= 19
+		auto features = llvm::sys::getHostCPUFeatures();
+#else
+		llvm::StringMap<bool> features;
+		llvm::sys::getHostCPUFeatures(features);
+#endif
+		return features.lookup("avx512fp16") || features.lookup("fullfp16");
+	}();
+	return native;
+}
+
 
 // specialize for all float types
 #define SPECIALIZE(type) \
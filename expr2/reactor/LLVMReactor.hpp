@@ -92,7 +92,8 @@ public:
 
 	void optimize(const rr::Config &cfg);
 
-	std::shared_ptr<rr::Routine> acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg);
+	std::shared_ptr<rr::Routine> acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg,
+	                                            rr::ObjectCache *cache = nullptr, std::vector<uint8_t> object = {});
 
 	const Config config;
 	std::unique_ptr<llvm::LLVMContext> context;
@@ -53,11 +53,12 @@ class Module
 	std::unique_ptr<Nucleus> core;
 public:
 	Module() : core(new Nucleus()) {}
+	explicit Module(const Config::Edit &cfgEdit) : core(new Nucleus(cfgEdit)) {}
 
 	//Nucleus *getCore() { return core.get(); }
 	void add(llvm::Function *f, const char *name);
 
-	std::shared_ptr<Routine> acquire(const char *name, const Config::Edit &cfgEdit = Config::Edit::None);
+	std::shared_ptr<Routine> acquire(const char *name, const Config::Edit &cfgEdit = Config::Edit::None, ObjectCache *cache = nullptr);
 };
 
 // Internal use only.
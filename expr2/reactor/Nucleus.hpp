@@ -171,10 +171,26 @@ private:
 	Optimization optimization;
 };
 
+// ObjectCache lets the user persist the machine code of a routine, so that a
+// later acquireRoutine() with the same cache can skip optimization and codegen.
+// load() returns the previously stored object file, or an empty vector if
+// there is none; store() receives the object file of a freshly compiled routine.
+class ObjectCache
+{
+public:
+	virtual ~ObjectCache() = default;
+
+	virtual std::vector<uint8_t> load() = 0;
+	virtual void store(const void *data, size_t size) = 0;
+};
+
 class Nucleus
 {
 public:
 	Nucleus();
+	// Uses the default configuration with cfgEdit applied for all code
+	// emitted through this instance, e.g. to build it without fast-math flags.
+	explicit Nucleus(const Config::Edit &cfgEdit);
 
 	virtual ~Nucleus();
 
@@ -184,7 +200,11 @@ public:
 	static void adjustDefaultConfig(const Config::Edit &cfgEdit);
 	static Config getDefaultConfig();
 
-	std::shared_ptr<Routine> acquireRoutine(const char *name, const Config::Edit &cfgEdit = Config::Edit::None);
+	// Returns a string identifying the host target (triple, CPU and sub-target
+	// features) that generated code is specialized for.
+	static std::string getTargetDescription();
+
+	std::shared_ptr<Routine> acquireRoutine(const char *name, const Config::Edit &cfgEdit = Config::Edit::None, ObjectCache *cache = nullptr);
 
 	static Value *allocateStackVariable(Type *type, int arraySize = 0);
 	static BasicBlock *createBasicBlock();
@@ -261,6 +281,7 @@ public:
 	static Value *createLoad(Value *ptr, Type *type, bool isVolatile = false, unsigned int alignment = 0, bool atomic = false, std::memory_order memoryOrder = std::memory_order_relaxed);
 	static Value *createStore(Value *value, Value *ptr, Type *type, bool isVolatile = false, unsigned int aligment = 0, bool atomic = false, std::memory_order memoryOrder = std::memory_order_relaxed);
 	static Value *createGEP(Value *ptr, Type *type, Value *index, bool unsignedIndex);
+	static void createNonTemporalStore(Value *value, Value *ptr, Type *type, unsigned int alignment);
 
 	// Masked Load / Store instructions
 	static Value *createMaskedLoad(Value *base, Type *elementType, Value *mask, unsigned int alignment, bool zeroMaskedLanes);
@@ -269,6 +290,9 @@ public:
 	// Barrier instructions
 	static void createFence(std::memory_order memoryOrder);
 
+	// Cache control
+	static void createPrefetch(Value *ptr);
+
 	// Atomic instructions
 	static Value *createAtomicAdd(Value *ptr, Value *value, std::memory_order memoryOrder = std::memory_order_relaxed);
 	static Value *createAtomicSub(Value *ptr, Value *value, std::memory_order memoryOrder = std::memory_order_relaxed);
@@ -5002,6 +5002,11 @@ void Fence(std::memory_order memoryOrder)
 	Nucleus::createFence(memoryOrder);
 }
 
+void Prefetch(RValue<Pointer<Byte>> address)
+{
+	Nucleus::createPrefetch(address.value());
+}
+
 Bool CToReactor<bool>::cast(bool v)
 {
 	return type(v);
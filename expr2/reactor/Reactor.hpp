@@ -2717,6 +2717,16 @@ static inline RValue<Float8> FMA(RValue<Float8> a, RValue<Float8> b, RValue<Floa
 RValue<Float8> TryFP16To32(RValue<UShort8>, bool &ok);
 RValue<UShort8> TryFP32To16(RValue<Float8>, bool &ok);
 
+// Half precision arithmetic on vectors holding IEEE binary16 bit patterns.
+// Comparisons return 1.0 where they hold and 0.0 elsewhere.
+enum class HalfOp { Add, Sub, Mul, Div, Min, Max, CmpEQ, CmpLT, CmpLE, CmpNEQ, CmpNLT, CmpNLE };
+RValue<UShort8> HalfArith(HalfOp op, RValue<UShort8> x, RValue<UShort8> y);
+// Returns x where cond > 0 and y elsewhere.
+RValue<UShort8> HalfSelect(RValue<UShort8> cond, RValue<UShort8> x, RValue<UShort8> y);
+// Whether the host has half precision vector arithmetic (AVX512-FP16 or the
+// ARMv8.2 FP16 extension); elsewhere, half arithmetic is emulated in float.
+bool SupportsNativeHalf();
+
 // Deprecated: use Rcp
 // TODO(b/147516027): Remove when GLES frontend is removed
 //RValue<Float8> Rcp_pp(RValue<Float8> val, bool exactAtPow2 = false);
@@ -2944,6 +2954,12 @@ RValue<Float4> MaskedLoad(RValue<Pointer<Float4>> base, RValue<Int4> mask, unsig
 RValue<Int4> MaskedLoad(RValue<Pointer<Int4>> base, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 void MaskedStore(RValue<Pointer<Float4>> base, RValue<Float4> val, RValue<Int4> mask, unsigned int alignment);
 void MaskedStore(RValue<Pointer<Int4>> base, RValue<Int4> val, RValue<Int4> mask, unsigned int alignment);
+// Stores the lanes of val whose mask element is all ones, for any vector type.
+template<typename T, typename M>
+void MaskedStore(RValue<Pointer<T>> base, RValue<T> val, RValue<M> mask, unsigned int alignment)
+{
+	Nucleus::createMaskedStore(base.value(), val.value(), mask.value(), alignment);
+}
 
 RValue<Float4> Gather(RValue<Pointer<Float>> base, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 RValue<Float8> Gather(RValue<Pointer<Float>> base, RValue<Int8> offsets, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
@@ -2974,12 +2990,25 @@ void Store(T value, Pointer<T> pointer, unsigned int alignment, bool atomic, std
 	Store(RValue<T>(value), RValue<Pointer<T>>(pointer), alignment, atomic, memoryOrder);
 }
 
+// StoreNonTemporal stores value with a hint that it will not be read again
+// soon, so that it may bypass the caches. A Fence is required before other
+// threads may rely on the stored data.
+template<typename T>
+void StoreNonTemporal(RValue<T> value, RValue<Pointer<T>> pointer, unsigned int alignment)
+{
+	Nucleus::createNonTemporalStore(value.value(), pointer.value(), T::type(), alignment);
+}
+
 // Fence adds a memory barrier that enforces ordering constraints on memory
 // operations. memoryOrder can only be one of:
 // std::memory_order_acquire, std::memory_order_release,
 // std::memory_order_acq_rel, or std::memory_order_seq_cst.
 void Fence(std::memory_order memoryOrder);
 
+// Prefetch hints that the cache line containing the given address will be
+// read soon. It never faults, so the address need not be valid.
+void Prefetch(RValue<Pointer<Byte>> address);
+
 template<class T, int S = 1>
 class Array : public LValue<T>
 {
@@ -15,6 +15,7 @@
 #ifndef rr_Routine_hpp
 #define rr_Routine_hpp
 
+#include <cstddef>
 #include <memory>
 
 namespace rr {
@@ -26,6 +27,15 @@ public:
 	virtual ~Routine() = default;
 
 	virtual const void *getEntry(int index = 0) const = 0;
+
+	// Returns the number of bytes of (executable) memory held by the routine, or 0 if unknown.
+	virtual size_t getMemorySize() const { return 0; }
+
+	// Seconds spent optimizing the IR and generating machine code, set by
+	// Nucleus::acquireRoutine. Both are 0 if the code came from an ObjectCache.
+	double optimizeTime = 0;
+	double codegenTime = 0;
+	bool fromObjectCache = false;
 };
 
 // RoutineT is a type-safe wrapper around a Routine and its function entry, returned by FunctionT
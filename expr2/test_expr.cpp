@@ -0,0 +1,240 @@
+/*
+ * Output checks for Expr.
+ *
+ * Loads a build of the plugin into a VapourSynth core and compares the first
+ * row of frames produced by Expr with their expected samples. Only results
+ * that do not depend on the approximations of transcendental functions are
+ * compared with fixed values; other cases compare two ways of computing the
+ * same expression.
+ *
+ *   test_expr plugin
+ *
+ * Exits with a non-zero status if a check fails.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "VapourSynth4.h"
+
+namespace {
+
+const int width = 64, height = 4;
+
+struct Test {
+    const VSAPI *vsapi;
+    VSCore *core;
+    VSPlugin *std;
+    VSPlugin *akarin;
+    int failures = 0;
+
+    int formatID(int sampleType, int bits) const {
+        return vsapi->queryVideoFormatID(cfGray, sampleType, bits, 0, 0, core);
+    }
+
+    // Takes ownership of args and returns the clip, or nullptr on error.
+    VSNode *invoke(VSPlugin *plugin, const char *name, VSMap *args, const std::string &what) {
+        VSMap *ret = vsapi->invoke(plugin, name, args);
+        vsapi->freeMap(args);
+        VSNode *node = nullptr;
+        if (const char *err = vsapi->mapGetError(ret)) {
+            fprintf(stderr, "%s: %s\n", what.c_str(), err);
+            failures++;
+        } else {
+            node = vsapi->mapGetNode(ret, "clip", 0, nullptr);
+        }
+        vsapi->freeMap(ret);
+        return node;
+    }
+
+    // A Gray8 clip whose pixels are given by an expression.
+    VSNode *source(const char *expr) {
+        VSMap *args = vsapi->createMap();
+        vsapi->mapSetInt(args, "format", formatID(stInteger, 8), maReplace);
+        vsapi->mapSetInt(args, "width", width, maReplace);
+        vsapi->mapSetInt(args, "height", height, maReplace);
+        VSNode *blank = invoke(std, "BlankClip", args, "BlankClip");
+        if (!blank)
+            return nullptr;
+        args = vsapi->createMap();
+        vsapi->mapConsumeNode(args, "clips", blank, maReplace);
+        vsapi->mapSetData(args, "expr", expr, -1, dtUtf8, maReplace);
+        return invoke(akarin, "Expr", args, std::string{ "source " } + expr);
+    }
+
+    // The first row of Expr(src, expr, format) with the given extra integer
+    // arguments, or an empty vector on error.
+    std::vector<uint32_t> expr(VSNode *src, const char *expr, int format, const std::vector<std::pair<const char *, int>> &extra = {}) {
+        VSMap *args = vsapi->createMap();
+        vsapi->mapSetNode(args, "clips", src, maReplace);
+        vsapi->mapSetData(args, "expr", expr, -1, dtUtf8, maReplace);
+        vsapi->mapSetInt(args, "format", format, maReplace);
+        for (const auto &e : extra)
+            vsapi->mapSetInt(args, e.first, e.second, maReplace);
+        VSNode *node = invoke(akarin, "Expr", args, expr);
+        if (!node)
+            return {};
+        char errMsg[1024];
+        const VSFrame *f = vsapi->getFrame(0, node, errMsg, sizeof(errMsg));
+        vsapi->freeNode(node);
+        if (!f) {
+            fprintf(stderr, "%s: %s\n", expr, errMsg);
+            failures++;
+            return {};
+        }
+        const int bytes = vsapi->getVideoFrameFormat(f)->bytesPerSample;
+        const uint8_t *p = vsapi->getReadPtr(f, 0);
+        std::vector<uint32_t> row(width);
+        for (int x = 0; x < width; x++)
+            row[x] = bytes == 1 ? p[x] : bytes == 2 ? reinterpret_cast<const uint16_t *>(p)[x] : reinterpret_cast<const uint32_t *>(p)[x];
+        vsapi->freeFrame(f);
+        return row;
+    }
+
+    void check(const std::string &what, const std::vector<uint32_t> &row, const std::vector<uint32_t> &expected) {
+        if (row.empty())
+            return; // already reported
+        for (int x = 0; x < width; x++) {
+            if (row[x] != expected[x]) {
+                fprintf(stderr, "%s: pixel %d is %u, expected %u\n", what.c_str(), x, row[x], expected[x]);
+                failures++;
+                return;
+            }
+        }
+    }
+    void check(const std::string &what, const std::vector<uint32_t> &row, uint32_t expected) {
+        check(what, row, std::vector<uint32_t>(width, expected));
+    }
+};
+
+// Integer outputs beyond 24 bits, whose maximum is not a float.
+void testHighBitDepth(Test &t) {
+    VSNode *src = t.source("0");
+    if (!src)
+        return;
+    const int gray31 = t.formatID(stInteger, 31), gray32 = t.formatID(stInteger, 32);
+    t.check("31 bit saturation", t.expr(src, "x 1e10 +", gray31), 0x7FFFFFFFu);
+    t.check("31 bit below 2^31", t.expr(src, "x 2147483520 +", gray31), 2147483520u);
+    t.check("32 bit saturation", t.expr(src, "x 1e10 +", gray32), 0xFFFFFFFFu);
+    t.check("32 bit above 2^31", t.expr(src, "x 3000000000 +", gray32), 3000000000u);
+    t.check("32 bit below 2^32", t.expr(src, "x 4294967040 +", gray32), 4294967040u);
+    t.check("32 bit negative", t.expr(src, "x 5 -", gray32), 0u);
+    t.vsapi->freeNode(src);
+}
+
+// Ternaries with an expensive operand, computed behind a branch (branch=1)
+// and by selecting per pixel (branch=0), whose outputs are never 0. X keeps
+// them out of lookup tables.
+void testBranch(Test &t) {
+    const int gray8 = t.formatID(stInteger, 8);
+    const char *exprs[] = {
+        "x X + 100 > x 0.01 * exp 1 + 3 ?",
+        "x X + 100 > 3 x 0.01 * exp 1 + ?",
+    };
+    const struct {
+        const char *name, *src;
+    } sources[] = {
+        { "all true", "200" },
+        { "all false", "0" },
+        { "mixed", "X 4 *" },
+    };
+    for (const auto &s : sources) {
+        VSNode *src = t.source(s.src);
+        if (!src)
+            continue;
+        for (const char *e : exprs) {
+            const std::string what = std::string{ e } + " (" + s.name + ")";
+            const std::vector<uint32_t> selected = t.expr(src, e, gray8, { { "branch", 0 } });
+            if (selected.empty())
+                continue;
+            for (uint32_t v : selected) {
+                if (v == 0) {
+                    fprintf(stderr, "%s: zero output\n", what.c_str());
+                    t.failures++;
+                    break;
+                }
+            }
+            t.check(what, t.expr(src, e, gray8, { { "branch", 1 } }), selected);
+        }
+        t.vsapi->freeNode(src);
+    }
+}
+
+// Separable convolutions, which run as a horizontal and a vertical pass,
+// against the same kernels written out as relative accesses. The weights sum
+// to powers of two, so that both add up to the same samples.
+void testConvolution(Test &t) {
+    VSNode *src = t.source("X 3 * Y 20 * +");
+    if (!src)
+        return;
+    const int gray8 = t.formatID(stInteger, 8);
+    const struct {
+        const char *expr;
+        std::vector<int> row;
+        const char *suffix;
+    } kernels[] = {
+        { "x[conv:1,2,1]", { 1, 2, 1 }, "" },
+        { "x[conv:1,4,6,4,1]:m", { 1, 4, 6, 4, 1 }, ":m" },
+        { "x[conv:1,2,1;2,4,2;1,2,1]:c", { 1, 2, 1 }, ":c" },
+    };
+    for (const auto &k : kernels) {
+        const int r = static_cast<int>(k.row.size()) / 2;
+        std::string expanded;
+        int total = 0;
+        for (int j = -r; j <= r; j++) {
+            for (int i = -r; i <= r; i++) {
+                const int w = k.row[i + r] * k.row[j + r];
+                expanded += "x[" + std::to_string(i) + "," + std::to_string(j) + "]" + k.suffix + " " + std::to_string(w) + " * ";
+                if (total)
+                    expanded += "+ ";
+                total += w;
+            }
+        }
+        expanded += std::to_string(total) + " /";
+        for (int mirror = 0; mirror < 2; mirror++) {
+            const std::string what = std::string{ k.expr } + " (boundary=" + std::to_string(mirror) + ")";
+            const std::vector<uint32_t> expected = t.expr(src, expanded.c_str(), gray8, { { "boundary", mirror } });
+            t.check(what, t.expr(src, k.expr, gray8, { { "boundary", mirror } }), expected);
+        }
+    }
+    t.vsapi->freeNode(src);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s plugin\n", argv[0]);
+        return 1;
+    }
+    const VSAPI *vsapi = getVapourSynthAPI(VAPOURSYNTH_API_VERSION);
+    if (!vsapi) {
+        fprintf(stderr, "failed to initialize VapourSynth\n");
+        return 1;
+    }
+    VSCore *core = vsapi->createCore(ccfDisableAutoLoading);
+    VSPlugin *std = vsapi->getPluginByID("com.vapoursynth.std", core);
+    VSMap *args = vsapi->createMap();
+    vsapi->mapSetData(args, "path", argv[1], -1, dtUtf8, maReplace);
+    VSMap *ret = vsapi->invoke(std, "LoadPlugin", args);
+    vsapi->freeMap(args);
+    if (const char *err = vsapi->mapGetError(ret)) {
+        fprintf(stderr, "%s\n", err);
+        vsapi->freeMap(ret);
+        vsapi->freeCore(core);
+        return 1;
+    }
+    vsapi->freeMap(ret);
+
+    Test t{ vsapi, core, std, vsapi->getPluginByID("info.akarin.vsplugin", core) };
+    testHighBitDepth(t);
+    testBranch(t);
+    testConvolution(t);
+
+    vsapi->freeCore(core);
+    if (t.failures)
+        fprintf(stderr, "%d check(s) failed\n", t.failures);
+    return t.failures ? 1 : 0;
+}
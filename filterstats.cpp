@@ -0,0 +1,96 @@
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <new>
+
+#include "filterstats.h"
+
+struct FilterStats {
+    const char *filter;
+    std::atomic<int64_t> frames{ 0 }, time{ 0 }, maxTime{ 0 }, bytes{ 0 }, cacheHits{ 0 }, gpuWait{ 0 };
+    std::list<FilterStats *>::iterator self;
+};
+
+namespace {
+
+std::mutex registryLock;
+std::list<FilterStats *> registry; // in creation order
+
+void add(std::atomic<int64_t> &counter, int64_t v) {
+    counter.fetch_add(v, std::memory_order_relaxed);
+}
+
+} // namespace
+
+FilterStats *filterStatsCreate(const char *filter) {
+    auto s = new (std::nothrow) FilterStats;
+    if (!s)
+        return nullptr;
+    s->filter = filter;
+    std::lock_guard<std::mutex> guard(registryLock);
+    s->self = registry.insert(registry.end(), s);
+    return s;
+}
+
+void filterStatsFree(FilterStats *s) {
+    if (!s)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(registryLock);
+        registry.erase(s->self);
+    }
+    delete s;
+}
+
+int64_t filterStatsNow(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void filterStatsFrame(FilterStats *s, int64_t start, int served) {
+    if (!s)
+        return;
+    const int64_t t = filterStatsNow() - start;
+    if (served)
+        add(s->frames, 1);
+    add(s->time, t);
+    int64_t max = s->maxTime.load(std::memory_order_relaxed);
+    while (t > max && !s->maxTime.compare_exchange_weak(max, t, std::memory_order_relaxed))
+        ;
+}
+
+void filterStatsBytes(FilterStats *s, int64_t bytes) {
+    if (s)
+        add(s->bytes, bytes);
+}
+
+void filterStatsCacheHits(FilterStats *s, int64_t hits) {
+    if (s)
+        add(s->cacheHits, hits);
+}
+
+void filterStatsGpuWait(FilterStats *s, int64_t ns) {
+    if (s)
+        add(s->gpuWait, ns);
+}
+
+int64_t filterStatsFrameSize(const VSFrame *f, const VSAPI *vsapi) {
+    int64_t size = 0;
+    for (int p = 0; p < vsapi->getVideoFrameFormat(f)->numPlanes; p++)
+        size += (int64_t)vsapi->getStride(f, p) * vsapi->getFrameHeight(f, p);
+    return size;
+}
+
+void filterStatsReport(VSMap *out, const VSAPI *vsapi) {
+    std::lock_guard<std::mutex> guard(registryLock);
+    for (const auto s : registry) {
+        auto load = [](const std::atomic<int64_t> &c) { return c.load(std::memory_order_relaxed); };
+        vsapi->mapSetData(out, "filter", s->filter, -1, dtUtf8, maAppend);
+        vsapi->mapSetInt(out, "frames", load(s->frames), maAppend);
+        vsapi->mapSetFloat(out, "time", load(s->time) * 1e-9, maAppend);
+        vsapi->mapSetFloat(out, "max_time", load(s->maxTime) * 1e-9, maAppend);
+        vsapi->mapSetInt(out, "bytes", load(s->bytes), maAppend);
+        vsapi->mapSetInt(out, "cache_hits", load(s->cacheHits), maAppend);
+        vsapi->mapSetFloat(out, "gpu_wait", load(s->gpuWait) * 1e-9, maAppend);
+    }
+}
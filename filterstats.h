@@ -0,0 +1,90 @@
+#ifndef FILTERSTATS_H
+#define FILTERSTATS_H
+
+#include <stdint.h>
+
+#include "VapourSynth4.h"
+
+// Counters kept by every filter instance of the plugin and reported by
+// akarin.Stats(). They are relaxed atomics, so they are always on. All
+// functions accept a null FilterStats and then do nothing.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct FilterStats FilterStats;
+
+// Registers an instance of the filter named filter, which must outlive it
+// (i.e. be a literal). Returns null if out of memory.
+FilterStats *filterStatsCreate(const char *filter);
+void filterStatsFree(FilterStats *s);
+
+// A monotonic clock, in nanoseconds.
+int64_t filterStatsNow(void);
+
+// Records a getFrame call made at start (a filterStatsNow() value), which
+// returned a frame if served.
+void filterStatsFrame(FilterStats *s, int64_t start, int served);
+// Records memory allocated by the instance: the frames it creates and its
+// device buffers.
+void filterStatsBytes(FilterStats *s, int64_t bytes);
+// Records compiled code found in a cache instead of being compiled.
+void filterStatsCacheHits(FilterStats *s, int64_t hits);
+// Records time spent waiting for the GPU, in nanoseconds.
+void filterStatsGpuWait(FilterStats *s, int64_t ns);
+
+// The bytes of the planes of f.
+int64_t filterStatsFrameSize(const VSFrame *f, const VSAPI *vsapi);
+
+// Sets filter, frames, time, max_time, bytes, cache_hits and gpu_wait in out,
+// with one element per live instance in creation order. time and max_time are
+// the total and longest getFrame call, in seconds, counting the calls that
+// only request frames too.
+void filterStatsReport(VSMap *out, const VSAPI *vsapi);
+
+#ifdef __cplusplus
+}
+
+#include "scratch.h"
+
+// The FilterStats of an instance, as a member of its instance data.
+class ScopedFilterStats {
+public:
+    explicit ScopedFilterStats(const char *filter) : s(filterStatsCreate(filter)) {}
+    ~ScopedFilterStats() { filterStatsFree(s); }
+    ScopedFilterStats(const ScopedFilterStats &) = delete;
+    ScopedFilterStats &operator=(const ScopedFilterStats &) = delete;
+    operator FilterStats *() const { return s; }
+
+private:
+    FilterStats *s;
+};
+
+// The getFrame GetFrame, recording its calls in the member perf of the Data
+// it is given, to be passed to createVideoFilter instead of it. What the call
+// allocates from the scratch arena is freed once it returns.
+template<typename Data, VSFilterGetFrame GetFrame>
+const VSFrame *VS_CC timedGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    ScratchScope scratch;
+    const int64_t start = filterStatsNow();
+    const VSFrame *f = GetFrame(n, activationReason, instanceData, frameData, frameCtx, core, vsapi);
+    filterStatsFrame(static_cast<Data *>(instanceData)->perf, start, f != nullptr);
+    return f;
+}
+
+// Records the time until it goes out of scope as GPU wait of s.
+class GpuWaitTimer {
+public:
+    explicit GpuWaitTimer(FilterStats *s) : s(s), start(filterStatsNow()) {}
+    ~GpuWaitTimer() { filterStatsGpuWait(s, filterStatsNow() - start); }
+    GpuWaitTimer(const GpuWaitTimer &) = delete;
+    GpuWaitTimer &operator=(const GpuWaitTimer &) = delete;
+
+private:
+    FilterStats *s;
+    int64_t start;
+};
+#endif
+
+#endif // FILTERSTATS_H
@@ -19,6 +19,7 @@ typedef struct CUfunc_st *CUfunction; /**< CUDA function */
 typedef struct CUstream_st *CUstream; /**< CUDA stream */
 typedef struct CUevent_st *CUevent;   /**< CUDA event */
 typedef struct CUarray_st *CUarray;
+typedef void (*CUhostFn)(void *userData);
 
 typedef enum {
     CUDA_SUCCESS = 0,
@@ -182,6 +183,12 @@ typedef enum CUmemorytype_enum {
 // cuMemHostAlloc flags
 #define CU_MEMHOSTALLOC_WRITECOMBINED 0x04
 
+// cuStreamCreate flags
+#define CU_STREAM_NON_BLOCKING 0x01
+
+// cuEventCreate flags
+#define CU_EVENT_DISABLE_TIMING 0x02
+
 typedef struct CUDA_MEMCPY3D_st {
     size_t srcXInBytes;         /**< Source X in bytes */
     size_t srcY;                /**< Source Y */
@@ -260,6 +267,8 @@ CUDA_FN(CUresult, cuDeviceGet, (CUdevice * device, int ordinal));
 CUDA_FN(CUresult, cuDeviceGetAttribute, (int *, CUdevice_attribute attrib, CUdevice dev));
 CUDA_FN(CUresult, cuDeviceGetName, (char *, int len, CUdevice dev));
 CUDA_FN(CUresult, cuDeviceTotalMem, (size_t *, CUdevice dev));
+CUDA_FN(CUresult, cuDevicePrimaryCtxRetain, (CUcontext *pctx, CUdevice dev));
+CUDA_FN(CUresult, cuDevicePrimaryCtxRelease, (CUdevice dev));
 CUDA_FN_3020(CUresult, cuCtxCreate, cuCtxCreate_v2, (CUcontext * pctx, unsigned int flags, CUdevice dev));
 CUDA_FN_4000(CUresult, cuCtxDestroy, cuCtxDestroy_v2, (CUcontext pctx));
 CUDA_FN(CUresult, cuCtxGetFlags, (unsigned int * flags));
@@ -276,16 +285,28 @@ CUDA_FN(CUresult, cuModuleLoadData, (CUmodule * module, const void *image));
 CUDA_FN(CUresult, cuModuleLoadDataEx, (CUmodule * module, const void *image, unsigned int numOptions, CUjit_option *options, void **optionValues));
 CUDA_FN(CUresult, cuModuleUnload, (CUmodule module));
 CUDA_FN(CUresult, cuModuleGetFunction, (CUfunction * hfunc, CUmodule hmod, const char *name));
+CUDA_FN(CUresult, cuLaunchKernel, (CUfunction f, unsigned int gridDimX, unsigned int gridDimY, unsigned int gridDimZ, unsigned int blockDimX, unsigned int blockDimY, unsigned int blockDimZ, unsigned int sharedMemBytes, CUstream hStream, void **kernelParams, void **extra));
 CUDA_FN_3020(CUresult, cuMemAlloc, cuMemAlloc_v2, (CUdeviceptr * dptr, size_t bytesize));
 CUDA_FN_3020(CUresult, cuMemFree, cuMemFree_v2, (CUdeviceptr dptr));
+CUDA_FN_3020(CUresult, cuMemGetInfo, cuMemGetInfo_v2, (size_t *free, size_t *total));
 CUDA_FN(CUresult, cuMemHostAlloc, (void** pp, size_t bytesize, unsigned int flags));
 CUDA_FN(CUresult, cuMemFreeHost, (void* p));
 CUDA_FN_3020(CUresult, cuMemcpyHtoD, cuMemcpyHtoD_v2, (CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount));
 CUDA_FN_3020(CUresult, cuMemcpyDtoH, cuMemcpyDtoH_v2, (void *dstHost, CUdeviceptr srcDevice, size_t ByteCount));
 CUDA_FN_3020(CUresult, cuMemcpyDtoD, cuMemcpyDtoD_v2, (CUdeviceptr dstHost, CUdeviceptr srcDevice, size_t ByteCount));
+CUDA_FN_3020(CUresult, cuMemcpyHtoDAsync, cuMemcpyHtoDAsync_v2, (CUdeviceptr dstDevice, const void *srcHost, size_t ByteCount, CUstream hStream));
+CUDA_FN_3020(CUresult, cuMemcpyDtoHAsync, cuMemcpyDtoHAsync_v2, (void *dstHost, CUdeviceptr srcDevice, size_t ByteCount, CUstream hStream));
 CUDA_FN(CUresult, cuMemcpy2DAsync_v2, (const CUDA_MEMCPY2D* pCopy, CUstream hStream));
 
+CUDA_FN(CUresult, cuStreamCreate, (CUstream *phStream, unsigned int Flags));
+CUDA_FN_4000(CUresult, cuStreamDestroy, cuStreamDestroy_v2, (CUstream hStream));
 CUDA_FN(CUresult, cuStreamSynchronize, (CUstream hStream));
+CUDA_FN(CUresult, cuLaunchHostFunc, (CUstream hStream, CUhostFn fn, void *userData));
+CUDA_FN(CUresult, cuStreamWaitEvent, (CUstream hStream, CUevent hEvent, unsigned int Flags));
+CUDA_FN(CUresult, cuEventCreate, (CUevent *phEvent, unsigned int Flags));
+CUDA_FN_4000(CUresult, cuEventDestroy, cuEventDestroy_v2, (CUevent hEvent));
+CUDA_FN(CUresult, cuEventRecord, (CUevent hEvent, CUstream hStream));
+CUDA_FN(CUresult, cuEventSynchronize, (CUevent hEvent));
 
 CUDA_FN(CUresult, cuMemsetD8Async, (CUdeviceptr devPtr, int value, size_t count, CUstream st));
 
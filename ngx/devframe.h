@@ -0,0 +1,89 @@
+#ifndef DEVFRAME_H
+#define DEVFRAME_H
+
+// Frames that DLVFX and DLISR leave on the GPU with gpu_output=True, so that
+// a chain of them uploads and downloads each frame only once.
+//
+// The planes of such a frame are not written; the output is kept in device
+// memory instead, attached to the frame as the function property
+// _AkarinDeviceFrame, which frees it along with the frame. A filter taking a
+// frame with it copies the planes from there rather than from the host, as
+// long as the frame still has the planes it was attached to, i.e. it has at
+// most gone through filters that only pass frames on or change properties.
+//
+// Include after cuda.h.
+
+#include <cstdint>
+
+#include "VapourSynth4.h"
+#include "VSHelper4.h"
+
+#define DEVICE_FRAME_PROP "_AkarinDeviceFrame"
+
+struct DeviceFrame {
+    CUcontext ctx;     // that ptr was allocated in
+    int primary;       // if not -1, the device whose primary context ctx is, retained by the frame
+    CUdeviceptr ptr;
+    size_t offset[3], pitch[3], rowBytes[3], rows[3];
+    VSVideoFormat format;
+    int width, height;
+    const void *plane0; // the first plane of the frame it is attached to
+
+    DeviceFrame() : ctx(nullptr), primary(-1), ptr(nullptr), offset(), pitch(), rowBytes(), rows(), format(), width(0), height(0), plane0(nullptr) {}
+    ~DeviceFrame() {
+        if (ptr) {
+            cuCtxPushCurrent_v2(ctx);
+            cuMemFree_v2(ptr);
+            cuCtxPopCurrent_v2(nullptr);
+        }
+        if (primary >= 0)
+            cuDevicePrimaryCtxRelease(primary);
+    }
+};
+
+static void VS_CC deviceFrameCall(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    vsapi->mapSetInt(out, "frame", reinterpret_cast<intptr_t>(userData), maReplace);
+}
+
+static void VS_CC deviceFrameFree(void *userData) {
+    delete static_cast<DeviceFrame *>(userData);
+}
+
+// Attaches df to f, which takes ownership of it, or, if df is nullptr, drops
+// the device frame f inherited from the frame its properties came from.
+static void setDeviceFrame(VSFrame *f, DeviceFrame *df, VSCore *core, const VSAPI *vsapi) {
+    VSMap *props = vsapi->getFramePropertiesRW(f);
+    if (!df) {
+        vsapi->mapDeleteKey(props, DEVICE_FRAME_PROP);
+        return;
+    }
+    df->format = *vsapi->getVideoFrameFormat(f);
+    df->width = vsapi->getFrameWidth(f, 0);
+    df->height = vsapi->getFrameHeight(f, 0);
+    df->plane0 = vsapi->getReadPtr(f, 0);
+    VSFunction *fn = vsapi->createFunction(deviceFrameCall, df, deviceFrameFree, core);
+    vsapi->mapConsumeFunction(props, DEVICE_FRAME_PROP, fn, maReplace);
+}
+
+// Returns the device frame of f, or nullptr if it has none that still holds
+// its content. It lives as long as f.
+static const DeviceFrame *findDeviceFrame(const VSFrame *f, const VSAPI *vsapi) {
+    int err;
+    VSFunction *fn = vsapi->mapGetFunction(vsapi->getFramePropertiesRO(f), DEVICE_FRAME_PROP, 0, &err);
+    if (!fn)
+        return nullptr;
+    VSMap *in = vsapi->createMap(), *out = vsapi->createMap();
+    vsapi->callFunction(fn, in, out);
+    auto df = reinterpret_cast<const DeviceFrame *>(vsapi->mapGetInt(out, "frame", 0, &err));
+    if (err)
+        df = nullptr;
+    vsapi->freeMap(in);
+    vsapi->freeMap(out);
+    vsapi->freeFunction(fn);
+    if (df && (df->plane0 != vsapi->getReadPtr(f, 0) || !vsh::isSameVideoFormat(&df->format, vsapi->getVideoFrameFormat(f)) ||
+               df->width != vsapi->getFrameWidth(f, 0) || df->height != vsapi->getFrameHeight(f, 0)))
+        df = nullptr;
+    return df;
+}
+
+#endif // DEVFRAME_H
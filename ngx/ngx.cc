@@ -1,4 +1,5 @@
 #include <filesystem>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <utility>
@@ -19,7 +20,9 @@ static const wchar_t *dllPath(const wchar_t *suffix);
 #define CUDA_DLL L"nvcuda.dll","nvcuda.dll",autoDllErrors
 #endif
 #include "cuda.h"
+#include "devframe.h"
 #include "ngx.h"
+#include "../filterstats.h"
 
 #define CK_NGX(x) do { \
     int r = (x); \
@@ -60,17 +63,340 @@ static const wchar_t *dllPath(const wchar_t *suffix) {
 }
 #endif
 
+// Converts between the planar RGB of the clip, one plane after the other,
+// and the packed float RGB of the feature, which takes 0-255. The planes hold
+// u8, u16, f16 or f32 samples (p_type 0 to 3), multiplied by p_factor when
+// packed and divided by it, rounded and clamped to p_max when unpacked. The
+// source of ngx_unpack is p_pixel bytes from one pixel to the next and p_plane
+// bytes from one component to the next, so that it also takes planar float.
+// One thread per pixel.
+//
+// ngx_blend adds a packed tile of the feature output to planar float RGB,
+// weighted by linear ramps across its overlap with the neighbouring tiles.
+// The weights of overlapping tiles add up to one.
+static const char packKernels[] = R"ptx(
+.version 6.0
+.target sm_50
+.address_size 64
+
+.visible .entry ngx_pack(
+    .param .u64 p_src, .param .u64 p_dst, .param .u32 p_count,
+    .param .u32 p_type, .param .f32 p_factor)
+{
+    .reg .pred %p<8>;
+    .reg .b16 %h<2>;
+    .reg .b32 %r<12>;
+    .reg .b64 %rd<8>;
+    .reg .f32 %f<8>;
+
+    mov.u32 %r1, %ctaid.x;
+    mov.u32 %r2, %ntid.x;
+    mov.u32 %r3, %tid.x;
+    mad.lo.u32 %r4, %r1, %r2, %r3;
+    ld.param.u32 %r5, [p_count];
+    setp.ge.u32 %p1, %r4, %r5;
+    @%p1 bra PACK_DONE;
+
+    ld.param.u32 %r6, [p_type];
+    setp.eq.u32 %p2, %r6, 0;
+    setp.eq.u32 %p3, %r6, 1;
+    setp.eq.u32 %p4, %r6, 2;
+    setp.eq.u32 %p5, %r6, 3;
+    mov.u32 %r7, 2;
+    @%p2 mov.u32 %r7, 1;
+    @%p5 mov.u32 %r7, 4;
+
+    ld.param.u64 %rd1, [p_src];
+    cvta.to.global.u64 %rd1, %rd1;
+    mul.wide.u32 %rd2, %r4, %r7;
+    add.u64 %rd1, %rd1, %rd2;
+    mul.wide.u32 %rd3, %r5, %r7;
+    ld.param.u64 %rd4, [p_dst];
+    cvta.to.global.u64 %rd4, %rd4;
+    mul.wide.u32 %rd5, %r4, 12;
+    add.u64 %rd4, %rd4, %rd5;
+    ld.param.f32 %f2, [p_factor];
+
+    mov.u32 %r8, 0;
+PACK_PLANE:
+    @%p2 ld.global.u8 %r9, [%rd1];
+    @%p3 ld.global.u16 %r9, [%rd1];
+    @%p4 ld.global.b16 %h1, [%rd1];
+    @%p5 ld.global.f32 %f1, [%rd1];
+    @%p2 cvt.rn.f32.u32 %f1, %r9;
+    @%p3 cvt.rn.f32.u32 %f1, %r9;
+    @%p4 cvt.f32.f16 %f1, %h1;
+    mul.rn.f32 %f1, %f1, %f2;
+    st.global.f32 [%rd4], %f1;
+    add.u64 %rd1, %rd1, %rd3;
+    add.u64 %rd4, %rd4, 4;
+    add.u32 %r8, %r8, 1;
+    setp.lt.u32 %p6, %r8, 3;
+    @%p6 bra PACK_PLANE;
+PACK_DONE:
+    ret;
+}
+
+.visible .entry ngx_unpack(
+    .param .u64 p_src, .param .u64 p_dst, .param .u32 p_count,
+    .param .u32 p_type, .param .f32 p_factor, .param .f32 p_max,
+    .param .u32 p_pixel, .param .u32 p_plane)
+{
+    .reg .pred %p<8>;
+    .reg .b16 %h<2>;
+    .reg .b32 %r<12>;
+    .reg .b64 %rd<8>;
+    .reg .f32 %f<8>;
+
+    mov.u32 %r1, %ctaid.x;
+    mov.u32 %r2, %ntid.x;
+    mov.u32 %r3, %tid.x;
+    mad.lo.u32 %r4, %r1, %r2, %r3;
+    ld.param.u32 %r5, [p_count];
+    setp.ge.u32 %p1, %r4, %r5;
+    @%p1 bra UNPACK_DONE;
+
+    ld.param.u32 %r6, [p_type];
+    setp.eq.u32 %p2, %r6, 0;
+    setp.eq.u32 %p3, %r6, 1;
+    setp.eq.u32 %p4, %r6, 2;
+    setp.eq.u32 %p5, %r6, 3;
+    setp.lt.u32 %p7, %r6, 2;
+    mov.u32 %r7, 2;
+    @%p2 mov.u32 %r7, 1;
+    @%p5 mov.u32 %r7, 4;
+
+    ld.param.u64 %rd1, [p_src];
+    cvta.to.global.u64 %rd1, %rd1;
+    ld.param.u32 %r10, [p_pixel];
+    mul.wide.u32 %rd2, %r4, %r10;
+    add.u64 %rd1, %rd1, %rd2;
+    ld.param.u32 %r11, [p_plane];
+    cvt.u64.u32 %rd6, %r11;
+    ld.param.u64 %rd4, [p_dst];
+    cvta.to.global.u64 %rd4, %rd4;
+    mul.wide.u32 %rd5, %r4, %r7;
+    add.u64 %rd4, %rd4, %rd5;
+    mul.wide.u32 %rd3, %r5, %r7;
+    ld.param.f32 %f2, [p_factor];
+    ld.param.f32 %f3, [p_max];
+
+    mov.u32 %r8, 0;
+UNPACK_PLANE:
+    ld.global.f32 %f1, [%rd1];
+    div.rn.f32 %f1, %f1, %f2;
+    @%p7 min.f32 %f1, %f1, %f3;
+    @%p7 cvt.rni.u32.f32 %r9, %f1;
+    @%p2 st.global.u8 [%rd4], %r9;
+    @%p3 st.global.u16 [%rd4], %r9;
+    @%p4 cvt.rn.f16.f32 %h1, %f1;
+    @%p4 st.global.b16 [%rd4], %h1;
+    @%p5 st.global.f32 [%rd4], %f1;
+    add.u64 %rd1, %rd1, %rd6;
+    add.u64 %rd4, %rd4, %rd3;
+    add.u32 %r8, %r8, 1;
+    setp.lt.u32 %p6, %r8, 3;
+    @%p6 bra UNPACK_PLANE;
+UNPACK_DONE:
+    ret;
+}
+
+.visible .entry ngx_blend(
+    .param .u64 p_tile, .param .u32 p_tw, .param .u32 p_th,
+    .param .u64 p_dst, .param .u32 p_dw, .param .u32 p_dh,
+    .param .u32 p_ox, .param .u32 p_oy,
+    .param .f32 p_l, .param .f32 p_il, .param .f32 p_r, .param .f32 p_ir,
+    .param .f32 p_t, .param .f32 p_it, .param .f32 p_b, .param .f32 p_ib)
+{
+    .reg .pred %p<2>;
+    .reg .b32 %r<16>;
+    .reg .b64 %rd<12>;
+    .reg .f32 %f<12>;
+
+    mov.u32 %r1, %ctaid.x;
+    mov.u32 %r2, %ntid.x;
+    mov.u32 %r3, %tid.x;
+    mad.lo.u32 %r4, %r1, %r2, %r3;
+    mov.u32 %r1, %ctaid.y;
+    mov.u32 %r2, %ntid.y;
+    mov.u32 %r3, %tid.y;
+    mad.lo.u32 %r5, %r1, %r2, %r3;
+    ld.param.u32 %r6, [p_tw];
+    ld.param.u32 %r7, [p_th];
+    setp.ge.u32 %p1, %r4, %r6;
+    setp.ge.or.u32 %p1, %r5, %r7, %p1;
+    @%p1 bra BLEND_DONE;
+
+    cvt.rn.f32.u32 %f1, %r4;
+    add.f32 %f1, %f1, 0f3F000000;
+    cvt.rn.f32.u32 %f2, %r5;
+    add.f32 %f2, %f2, 0f3F000000;
+    ld.param.f32 %f3, [p_l];
+    ld.param.f32 %f4, [p_il];
+    sub.f32 %f5, %f1, %f3;
+    mul.f32 %f5, %f5, %f4;
+    cvt.sat.f32.f32 %f5, %f5;
+    ld.param.f32 %f3, [p_r];
+    ld.param.f32 %f4, [p_ir];
+    sub.f32 %f6, %f3, %f1;
+    mul.f32 %f6, %f6, %f4;
+    cvt.sat.f32.f32 %f6, %f6;
+    mul.f32 %f5, %f5, %f6;
+    ld.param.f32 %f3, [p_t];
+    ld.param.f32 %f4, [p_it];
+    sub.f32 %f6, %f2, %f3;
+    mul.f32 %f6, %f6, %f4;
+    cvt.sat.f32.f32 %f6, %f6;
+    mul.f32 %f5, %f5, %f6;
+    ld.param.f32 %f3, [p_b];
+    ld.param.f32 %f4, [p_ib];
+    sub.f32 %f6, %f3, %f2;
+    mul.f32 %f6, %f6, %f4;
+    cvt.sat.f32.f32 %f6, %f6;
+    mul.f32 %f5, %f5, %f6;
+
+    ld.param.u64 %rd1, [p_tile];
+    cvta.to.global.u64 %rd1, %rd1;
+    mad.lo.u32 %r8, %r5, %r6, %r4;
+    mul.wide.u32 %rd2, %r8, 12;
+    add.u64 %rd1, %rd1, %rd2;
+
+    ld.param.u64 %rd5, [p_dst];
+    cvta.to.global.u64 %rd5, %rd5;
+    ld.param.u32 %r9, [p_dw];
+    ld.param.u32 %r10, [p_dh];
+    ld.param.u32 %r11, [p_ox];
+    ld.param.u32 %r12, [p_oy];
+    add.u32 %r13, %r4, %r11;
+    add.u32 %r14, %r5, %r12;
+    mad.lo.u32 %r15, %r14, %r9, %r13;
+    mul.wide.u32 %rd6, %r15, 4;
+    add.u64 %rd5, %rd5, %rd6;
+    mul.wide.u32 %rd7, %r9, %r10;
+    shl.b64 %rd7, %rd7, 2;
+
+    ld.global.f32 %f7, [%rd1];
+    ld.global.f32 %f8, [%rd5];
+    fma.rn.f32 %f8, %f7, %f5, %f8;
+    st.global.f32 [%rd5], %f8;
+    add.u64 %rd5, %rd5, %rd7;
+    ld.global.f32 %f7, [%rd1+4];
+    ld.global.f32 %f8, [%rd5];
+    fma.rn.f32 %f8, %f7, %f5, %f8;
+    st.global.f32 [%rd5], %f8;
+    add.u64 %rd5, %rd5, %rd7;
+    ld.global.f32 %f7, [%rd1+8];
+    ld.global.f32 %f8, [%rd5];
+    fma.rn.f32 %f8, %f7, %f5, %f8;
+    st.global.f32 [%rd5], %f8;
+BLEND_DONE:
+    ret;
+}
+)ptx";
+
+// The sample types of the kernels.
+enum { NGX_U8, NGX_U16, NGX_F16, NGX_F32 };
+
+static int sampleType(const VSVideoFormat &f) {
+    if (f.sampleType == stFloat)
+        return f.bytesPerSample == 2 ? NGX_F16 : NGX_F32;
+    return f.bytesPerSample == 1 ? NGX_U8 : NGX_U16;
+}
+
+// The factor between the samples of f and the 0-255 of the feature.
+static float sampleFactor(const VSVideoFormat &f) {
+    return f.sampleType == stFloat ? 255.0f : 255.0f / float((1 << f.bitsPerSample) - 1);
+}
+
+// One tile of a tiled frame: where it is cut from the input and where it goes
+// in the output, and the ramps of its weight across the overlaps with its
+// neighbours, in output pixels from its origin. The ramps of edges without a
+// neighbour lie far outside the tile.
+struct NgxTile {
+    unsigned x, y, outX, outY;
+    float left, leftInv, right, rightInv, top, topInv, bottom, bottomInv;
+};
+
+// The tiles along one dimension.
+struct NgxSpan {
+    unsigned in;
+    float rise, riseInv, fall, fallInv;
+};
+
+// Spreads the fewest tiles that cover size pixels, overlapping by at least
+// overlap, evenly. Each seam ramps over overlap pixels around the middle of
+// the overlap of the two tiles, which then never reaches a third.
+static std::vector<NgxSpan> tileSpans(unsigned size, unsigned tile, unsigned overlap, int scale) {
+    const unsigned n = size <= tile ? 1 : (size - overlap + tile - overlap - 1) / (tile - overlap);
+    std::vector<NgxSpan> spans(n);
+    for (unsigned i = 0; i < n; i++) {
+        auto &s = spans[i];
+        s.in = n == 1 ? 0 : unsigned(uint64_t(i) * (size - tile) / (n - 1));
+        s.rise = -1e9f;
+        s.fall = 1e9f;
+        s.riseInv = s.fallInv = 1;
+        if (i > 0) {
+            auto &prev = spans[i - 1];
+            const double end = double(prev.in + tile) * scale, start = double(s.in) * scale, mid = (start + end) / 2;
+            const double width = std::max(1.0, std::min(double(overlap) * scale, end - start));
+            s.rise = float(mid - width / 2 - start);
+            prev.fall = float(mid + width / 2 - double(prev.in) * scale);
+            s.riseInv = prev.fallInv = float(1 / width);
+        }
+    }
+    return spans;
+}
+
 static void *cudaMalloc(size_t size) {
     void *ptr = nullptr;
     CK_CUDA(cuMemAlloc_v2(&ptr, size));
     return ptr;
 }
 
+// One feature instance with its own parameter block, buffers and stream,
+// used by one frame at a time.
+//
+// The planes of a frame, one after the other, are staged as they are in
+// pinned memory. Each tile of it is copied to in_planes and packed into inp
+// on stream, and the output in outp unpacked into out_planes or, if there are
+// several tiles, blended into blended, which is unpacked once complete.
+struct NgxStream {
+    NVSDK_NGX_Parameter *param;
+    NVSDK_NGX_Handle *DUHandle;
+
+    void *in_host, *out_host;
+    CUdeviceptr in_planes, out_planes;
+    CUdeviceptr inp, outp;
+    CUdeviceptr blended; // of tiled frames, the planar float output
+    CUstream stream;
+    CUevent packed, evaluated;
+
+    NgxStream() : param(nullptr), DUHandle(nullptr), in_host(nullptr), out_host(nullptr), in_planes(nullptr), out_planes(nullptr), inp(nullptr), outp(nullptr), blended(nullptr), stream(nullptr), packed(nullptr), evaluated(nullptr) {}
+    // Called with the context of the filter current.
+    void release() {
+        if (packed) CK_CUDA(cuEventDestroy_v2(packed));
+        if (evaluated) CK_CUDA(cuEventDestroy_v2(evaluated));
+        if (stream) CK_CUDA(cuStreamDestroy_v2(stream));
+        if (in_host) CK_CUDA(cuMemFreeHost(in_host));
+        if (out_host) CK_CUDA(cuMemFreeHost(out_host));
+        if (in_planes) CK_CUDA(cuMemFree_v2(in_planes));
+        if (out_planes) CK_CUDA(cuMemFree_v2(out_planes));
+        if (inp) CK_CUDA(cuMemFree_v2(inp));
+        if (outp) CK_CUDA(cuMemFree_v2(outp));
+        if (blended) CK_CUDA(cuMemFree_v2(blended));
+        if (DUHandle) CK_NGX(NVSDK_NGX_CUDA_ReleaseFeature(DUHandle));
+    }
+};
+
 struct NgxData {
+    // The NGX API is not thread safe, so its calls are serialized; the copies
+    // and conversions of the streams run concurrently.
     std::mutex lock;
+    std::condition_variable streamFree;
 
     VSNode *node;
-    VSVideoInfo vi;
+    VSVideoInfo vi; // of the output
+    VSVideoFormat in_format;
     int scale;
 
     typedef float T;
@@ -83,27 +409,133 @@ struct NgxData {
     uint64_t out_image_row_bytes() const { return pixel_size() * out_image_width(); }
     uint64_t in_size() const  { return in_image_height()  * in_image_row_bytes(); }
     uint64_t out_size() const { return out_image_height() * out_image_row_bytes(); }
+    // The planes are uploaded and downloaded in the formats of the clips.
+    uint64_t in_row() const  { return in_image_width() * in_format.bytesPerSample; }
+    uint64_t out_row() const { return out_image_width() * vi.format.bytesPerSample; }
+    uint64_t in_planes_size() const  { return 3 * in_image_height() * in_row(); }
+    uint64_t out_planes_size() const { return 3 * out_image_height() * out_row(); }
+
+    // The feature is created for tile_width x tile_height input pixels, the
+    // whole frame unless tile says otherwise, so its memory does not grow with
+    // the frame.
+    std::vector<NgxTile> tiles;
+    unsigned tile_width, tile_height;
+    bool tiled() const { return tiles.size() > 1; }
+    uint64_t tile_pixels() const     { return uint64_t(tile_width) * tile_height; }
+    uint64_t tile_out_pixels() const { return tile_pixels() * scale * scale; }
 
-    NVSDK_NGX_Parameter *param;
-    NVSDK_NGX_Handle *DUHandle;
     CUcontext ctx;
+    CUmodule module;
+    CUfunction pack, unpack, blend;
+
+    bool gpu_output; // leave the output on the GPU, see devframe.h
+
+    int num_streams;
+    std::unique_ptr<NgxStream[]> streams;
+    std::vector<NgxStream *> freeStreams; // guarded by lock
+
+    ScopedFilterStats perf{ "DLISR" };
+
+    // Creates the feature and the buffers of s, with ctx current.
+    void allocate(NgxStream &s) {
+        NV_new_Parameter(&s.param);
+        s.param->Set(NVSDK_NGX_Parameter_Width, (uint64_t)tile_width);
+        s.param->Set(NVSDK_NGX_Parameter_Height, (uint64_t)tile_height);
+        s.param->Set(NVSDK_NGX_Parameter_Scale, scale);
+        CK_NGX(NVSDK_NGX_CUDA_CreateFeature(NVSDK_NGX_Feature_ImageSuperResolution, s.param, &s.DUHandle));
+
+        CK_CUDA(cuMemHostAlloc(&s.in_host, in_planes_size(), CU_MEMHOSTALLOC_WRITECOMBINED));
+        CK_CUDA(cuMemHostAlloc(&s.out_host, out_planes_size(), 0));
+        s.in_planes = cudaMalloc(3 * tile_pixels() * in_format.bytesPerSample);
+        s.out_planes = cudaMalloc(out_planes_size());
+        s.inp = cudaMalloc(tile_pixels() * pixel_size());
+        s.outp = cudaMalloc(tile_out_pixels() * pixel_size());
+        if (tiled())
+            s.blended = cudaMalloc(out_size());
+        filterStatsBytes(perf, in_planes_size() + 2 * out_planes_size() + 3 * tile_pixels() * in_format.bytesPerSample +
+                         (tile_pixels() + tile_out_pixels()) * pixel_size() + (tiled() ? out_size() : 0));
+        // The feature runs on the legacy default stream; the events order it
+        // with the copies, which a non-blocking stream lets overlap with the
+        // other streams.
+        CK_CUDA(cuStreamCreate(&s.stream, CU_STREAM_NON_BLOCKING));
+        CK_CUDA(cuEventCreate(&s.packed, CU_EVENT_DISABLE_TIMING));
+        CK_CUDA(cuEventCreate(&s.evaluated, CU_EVENT_DISABLE_TIMING));
+    }
 
-    std::vector<uint8_t> in_host, out_host;
-    CUdeviceptr inp, outp;
-    void allocate() {
-        in_host.resize(in_size());
-        out_host.resize(out_size());
-        inp = cudaMalloc(in_size());
-        outp = cudaMalloc(out_size());
+    // Uploads the input of tile t of the frame staged in s, or copies it from
+    // df if the frame is on the GPU, and packs it.
+    void packTile(NgxStream *s, const NgxTile &t, const DeviceFrame *df) {
+        const size_t bps = in_format.bytesPerSample, in_plane = in_row() * in_image_height();
+        for (int plane = 0; plane < 3; plane++) {
+            CUDA_MEMCPY2D mcp2d {};
+            if (df) {
+                mcp2d.srcMemoryType = CU_MEMORYTYPE_UNIFIED;
+                mcp2d.srcDevice = (CUdeviceptr)(static_cast<uint8_t*>(df->ptr) + df->offset[plane] + t.y * df->pitch[plane] + t.x * bps);
+                mcp2d.srcPitch = df->pitch[plane];
+            } else {
+                mcp2d.srcMemoryType = CU_MEMORYTYPE_HOST;
+                mcp2d.srcHost = static_cast<uint8_t*>(s->in_host) + plane * in_plane + t.y * in_row() + t.x * bps;
+                mcp2d.srcPitch = in_row();
+            }
+            mcp2d.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+            mcp2d.dstDevice = (CUdeviceptr)(static_cast<uint8_t*>(s->in_planes) + plane * tile_pixels() * bps);
+            mcp2d.dstPitch = tile_width * bps;
+            mcp2d.WidthInBytes = tile_width * bps;
+            mcp2d.Height = tile_height;
+            CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, s->stream));
+        }
+        CUdeviceptr src = s->in_planes, dst = s->inp;
+        unsigned count = tile_pixels(), type = sampleType(in_format);
+        float factor = sampleFactor(in_format);
+        void *args[] = { &src, &dst, &count, &type, &factor };
+        launch(pack, count, s->stream, args);
+    }
+
+    // Unpacks the whole output from src, packed or planar float.
+    void unpackOutput(CUstream stream, CUdeviceptr src, CUdeviceptr dst, bool planar) {
+        unsigned count = out_image_width() * out_image_height(), type = sampleType(vi.format);
+        float factor = sampleFactor(vi.format), max = vi.format.sampleType == stFloat ? 0 : float((1 << vi.format.bitsPerSample) - 1);
+        unsigned pixel = planar ? sizeof(T) : pixel_size(), plane = planar ? count * sizeof(T) : sizeof(T);
+        void *args[] = { &src, &dst, &count, &type, &factor, &max, &pixel, &plane };
+        launch(unpack, count, stream, args);
+    }
+
+    void blendTile(NgxStream *s, const NgxTile &t) {
+        CUdeviceptr tile = s->outp, dst = s->blended;
+        unsigned tw = tile_width * scale, th = tile_height * scale, dw = out_image_width(), dh = out_image_height(), ox = t.outX, oy = t.outY;
+        float l = t.left, il = t.leftInv, r = t.right, ir = t.rightInv, top = t.top, it = t.topInv, b = t.bottom, ib = t.bottomInv;
+        void *args[] = { &tile, &tw, &th, &dst, &dw, &dh, &ox, &oy, &l, &il, &r, &ir, &top, &it, &b, &ib };
+        CK_CUDA(cuLaunchKernel(blend, (tw + 31) / 32, (th + 7) / 8, 1, 32, 8, 1, 0, s->stream, args, nullptr));
+    }
+
+    // One thread per pixel, in blocks of 256.
+    static void launch(CUfunction fn, unsigned count, CUstream stream, void **args) {
+        CK_CUDA(cuLaunchKernel(fn, (count + 255) / 256, 1, 1, 256, 1, 1, 0, stream, args, nullptr));
+    }
+
+    NgxStream *acquire() {
+        std::unique_lock<std::mutex> guard(lock);
+        streamFree.wait(guard, [this]() { return !freeStreams.empty(); });
+        NgxStream *s = freeStreams.back();
+        freeStreams.pop_back();
+        return s;
+    }
+
+    void release(NgxStream *s) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            freeStreams.push_back(s);
+        }
+        streamFree.notify_one();
     }
 
-    NgxData() : node(nullptr), vi(), scale(0), param(nullptr), DUHandle(nullptr), ctx(nullptr), inp(nullptr), outp(nullptr) {}
+    NgxData() : node(nullptr), vi(), in_format(), scale(0), tile_width(0), tile_height(0), ctx(nullptr), module(nullptr), pack(nullptr), unpack(nullptr), blend(nullptr), gpu_output(false), num_streams(0) {}
     ~NgxData() {
         if (ctx) {
             CK_CUDA(cuCtxPushCurrent_v2(ctx));
-            if (inp) CK_CUDA(cuMemFree_v2(inp));
-            if (outp) CK_CUDA(cuMemFree_v2(outp));
-            if (DUHandle) CK_NGX(NVSDK_NGX_CUDA_ReleaseFeature(DUHandle));
+            for (int i = 0; i < num_streams; i++)
+                streams[i].release();
+            if (module) CK_CUDA(cuModuleUnload(module));
             cuCtxPopCurrent_v2(nullptr);
         }
     }
@@ -117,64 +549,89 @@ static const VSFrame *VS_CC ngxGetFrame(int n, int activationReason, void *insta
     } else if (activationReason == arAllFramesReady) {
         const VSFrame *src = vsapi->getFrameFilter(n, d->node, frameCtx);
 
-        const VSVideoFormat fi = d->vi.format;
+        const VSVideoFormat &fi = d->vi.format;
         assert(vsapi->getFrameHeight(src, 0) == (int)d->in_image_height());
         assert(vsapi->getFrameWidth(src, 0) == (int)d->in_image_width());
         int planes[3] = { 0, 1, 2 };
         const VSFrame *srcf[3] = { nullptr, nullptr, nullptr };
         VSFrame *dst = vsapi->newVideoFrame2(&fi, d->out_image_width(), d->out_image_height(), srcf, planes, src, core);
 
-        // The NGX API is not thread safe.
-        std::lock_guard<std::mutex> lock(d->lock);
-        CK_CUDA(cuCtxPushCurrent_v2(d->ctx));
-
-        auto params = d->param;
-        params->Set(NVSDK_NGX_Parameter_Width, (uint64_t)d->in_image_width());
-        params->Set(NVSDK_NGX_Parameter_Height, (uint64_t)d->in_image_height());
-        params->Set(NVSDK_NGX_Parameter_Scale, d->scale);
-
-        // Create the feature
-        //CK_NGX(NVSDK_NGX_CUDA_CreateFeature(NVSDK_NGX_Feature_ImageSuperResolution, params, &d->DUHandle));
+        NgxStream *s = d->acquire();
 
-        void *in_image_dev_ptr = d->inp;
-        void *out_image_dev_ptr = d->outp;;
+        const DeviceFrame *in = findDeviceFrame(src, vsapi);
+        const size_t in_row = d->in_row(), in_plane = in_row * d->in_image_height();
+        uint8_t *host = static_cast<uint8_t*>(s->in_host);
+        for (int plane = 0; plane < 3 && !in; plane++)
+            vsh::bitblt(host + plane * in_plane, in_row, vsapi->getReadPtr(src, plane), vsapi->getStride(src, plane), in_row, d->in_image_height());
 
-        uint8_t *host = d->in_host.data();
-        typedef float T;
-        const T factor = 255.0f;
-        for (int plane = 0; plane < 3; plane++) {
-            const size_t stride = vsapi->getStride(src, plane);
-            const uint8_t *ptr = (uint8_t*)vsapi->getReadPtr(src, plane);
-            for (size_t i = 0; i < d->in_image_height(); i++)
-                for (size_t j = 0; j < d->in_image_width(); j++)
-                    *(T*)&host[i * d->in_image_row_bytes() + j * d->pixel_size() + plane * sizeof(T)] = *(T*)&ptr[i * stride + j * sizeof(T)] * factor;
+        CK_CUDA(cuCtxPushCurrent_v2(d->ctx));
+        const size_t out_row = d->out_row(), out_plane = out_row * d->out_image_height();
+        DeviceFrame *out = nullptr;
+        CUdeviceptr out_planes = s->out_planes;
+        if (d->gpu_output) {
+            out = new DeviceFrame;
+            out->ctx = d->ctx;
+            CK_CUDA(cuMemAlloc_v2(&out->ptr, d->out_planes_size()));
+            filterStatsBytes(d->perf, d->out_planes_size());
+            for (int plane = 0; plane < 3; plane++) {
+                out->offset[plane] = plane * out_plane;
+                out->pitch[plane] = out->rowBytes[plane] = out_row;
+                out->rows[plane] = d->out_image_height();
+            }
+            out_planes = out->ptr;
         }
-        CK_CUDA(cuMemcpyHtoD_v2(in_image_dev_ptr, host, d->in_size()));
-
-        // Pass the pointers to the GPU allocations to the
-        // parameter block along with the format and size.
-        params->Set(NVSDK_NGX_Parameter_Color_SizeInBytes, d->in_size());
-        params->Set(NVSDK_NGX_Parameter_Color_Format, NVSDK_NGX_Buffer_Format_RGB32F);
-        params->Set(NVSDK_NGX_Parameter_Color, in_image_dev_ptr);
-        params->Set(NVSDK_NGX_Parameter_Output_SizeInBytes, d->out_size());
-        params->Set(NVSDK_NGX_Parameter_Output_Format, NVSDK_NGX_Buffer_Format_RGB32F);
-        params->Set(NVSDK_NGX_Parameter_Output, out_image_dev_ptr);
-
-        // Execute the feature.
-        CK_NGX(NVSDK_NGX_CUDA_EvaluateFeature(d->DUHandle, params, nullptr));
-
-        host = d->out_host.data();
-        CK_CUDA(cuMemcpyDtoH_v2(host, out_image_dev_ptr, d->out_size()));
-        for (int plane = 0; plane < 3; plane++) {
-            const size_t stride = vsapi->getStride(dst, plane);
-            uint8_t *ptr = (uint8_t*)vsapi->getWritePtr(dst, plane);
-            for (size_t i = 0; i < d->out_image_height(); i++)
-                for (size_t j = 0; j < d->out_image_width(); j++)
-                    *(T*)&ptr[i * stride + j * sizeof(T)] = *(T*)&host[i * d->out_image_row_bytes() + j * d->pixel_size() + plane * sizeof(T)] / factor;
+        if (d->tiled())
+            CK_CUDA(cuMemsetD8Async(s->blended, 0, d->out_size(), s->stream));
+        for (const auto &t : d->tiles) {
+            d->packTile(s, t, in);
+            CK_CUDA(cuEventRecord(s->packed, s->stream));
+
+            {
+                std::lock_guard<std::mutex> lock(d->lock);
+                CK_CUDA(cuStreamWaitEvent(nullptr, s->packed, 0));
+
+                // Pass the pointers to the GPU allocations to the
+                // parameter block along with the format and size.
+                auto params = s->param;
+                params->Set(NVSDK_NGX_Parameter_Width, (uint64_t)d->tile_width);
+                params->Set(NVSDK_NGX_Parameter_Height, (uint64_t)d->tile_height);
+                params->Set(NVSDK_NGX_Parameter_Scale, d->scale);
+                params->Set(NVSDK_NGX_Parameter_Color_SizeInBytes, d->tile_pixels() * d->pixel_size());
+                params->Set(NVSDK_NGX_Parameter_Color_Format, NVSDK_NGX_Buffer_Format_RGB32F);
+                params->Set(NVSDK_NGX_Parameter_Color, s->inp);
+                params->Set(NVSDK_NGX_Parameter_Output_SizeInBytes, d->tile_out_pixels() * d->pixel_size());
+                params->Set(NVSDK_NGX_Parameter_Output_Format, NVSDK_NGX_Buffer_Format_RGB32F);
+                params->Set(NVSDK_NGX_Parameter_Output, s->outp);
+
+                // Execute the feature.
+                CK_NGX(NVSDK_NGX_CUDA_EvaluateFeature(s->DUHandle, params, nullptr));
+                CK_CUDA(cuEventRecord(s->evaluated, nullptr));
+            }
+
+            CK_CUDA(cuStreamWaitEvent(s->stream, s->evaluated, 0));
+            if (d->tiled())
+                d->blendTile(s, t);
+        }
+        if (d->tiled())
+            d->unpackOutput(s->stream, s->blended, out_planes, true);
+        else
+            d->unpackOutput(s->stream, s->outp, out_planes, false);
+        host = static_cast<uint8_t*>(s->out_host);
+        if (!out)
+            CK_CUDA(cuMemcpyDtoHAsync_v2(host, s->out_planes, d->out_planes_size(), s->stream));
+        {
+            GpuWaitTimer wait(d->perf);
+            CK_CUDA(cuStreamSynchronize(s->stream));
         }
-
         cuCtxPopCurrent_v2(nullptr);
 
+        if (!out)
+            filterStatsBytes(d->perf, filterStatsFrameSize(dst, vsapi));
+        for (int plane = 0; plane < 3 && !out; plane++)
+            vsh::bitblt(vsapi->getWritePtr(dst, plane), vsapi->getStride(dst, plane), host + plane * out_plane, out_row, out_row, d->out_image_height());
+        setDeviceFrame(dst, out, core, vsapi);
+
+        d->release(s);
         vsapi->freeFrame(src);
         return dst;
     }
@@ -216,8 +673,20 @@ static void VS_CC ngxCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         }
         if (d->vi.format.numPlanes != 3 || d->vi.format.colorFamily != cfRGB)
             throw std::runtime_error("input clip must be RGB format");
-        if (d->vi.format.sampleType != stFloat || d->vi.format.bitsPerSample != 32)
-            throw std::runtime_error("input clip must be 32-bit float format");
+        const auto &f = d->vi.format;
+        if (f.sampleType == stFloat ? f.bitsPerSample != 16 && f.bitsPerSample != 32 : f.bitsPerSample > 16)
+            throw std::runtime_error("input clip must be 8-16 bit integer, 16-bit float or 32-bit float format");
+        d->in_format = f;
+
+        int output_depth = vsh::int64ToIntS(vsapi->mapGetInt(in, "output_depth", 0, &err));
+        if (!err) {
+            if (output_depth == 32)
+                vsapi->queryVideoFormat(&d->vi.format, cfRGB, stFloat, 32, 0, 0, core);
+            else if (output_depth >= 8 && output_depth <= 16)
+                vsapi->queryVideoFormat(&d->vi.format, cfRGB, stInteger, output_depth, 0, 0, core);
+            else
+                throw std::runtime_error("unsupported output_depth: only 8-16 (integer) or 32 (float) are supported");
+        }
 
         int scale = vsh::int64ToIntS(vsapi->mapGetInt(in, "scale", 0, &err));
         if (err) scale = 2;
@@ -227,6 +696,39 @@ static void VS_CC ngxCreate(const VSMap *in, VSMap *out, void *userData, VSCore
 
         devid = vsh::int64ToIntS(vsapi->mapGetInt(in, "device_id", 0, &err));
         if (err) devid = 0;
+
+        d->tile_width = d->vi.width;
+        d->tile_height = d->vi.height;
+        if (int n = vsapi->mapNumElements(in, "tile"); n >= 0) {
+            if (n != 2)
+                throw std::runtime_error("tile must have two elements, the width and the height");
+            const int tw = vsh::int64ToIntS(vsapi->mapGetInt(in, "tile", 0, nullptr));
+            const int th = vsh::int64ToIntS(vsapi->mapGetInt(in, "tile", 1, nullptr));
+            if (tw < 32 || th < 32)
+                throw std::runtime_error("tile must be at least 32x32");
+            d->tile_width = std::min(tw, d->vi.width);
+            d->tile_height = std::min(th, d->vi.height);
+        }
+        int overlap = vsh::int64ToIntS(vsapi->mapGetInt(in, "tile_overlap", 0, &err));
+        if (err) overlap = 16;
+        if (overlap < 0)
+            throw std::runtime_error("tile_overlap must not be negative");
+        const bool tileX = d->tile_width < (unsigned)d->vi.width, tileY = d->tile_height < (unsigned)d->vi.height;
+        if ((tileX && overlap * 3 >= (int)d->tile_width) || (tileY && overlap * 3 >= (int)d->tile_height))
+            throw std::runtime_error("tile_overlap is too large for the tiles");
+        const auto xs = tileSpans(d->vi.width, d->tile_width, overlap, d->scale);
+        const auto ys = tileSpans(d->vi.height, d->tile_height, overlap, d->scale);
+        for (const auto &y : ys)
+            for (const auto &x : xs)
+                d->tiles.push_back({ x.in, y.in, x.in * d->scale, y.in * d->scale, x.rise, x.riseInv, x.fall, x.fallInv, y.rise, y.riseInv, y.fall, y.fallInv });
+
+        int num_streams = vsh::int64ToIntS(vsapi->mapGetInt(in, "num_streams", 0, &err));
+        if (err) num_streams = 1;
+        if (num_streams < 1)
+            throw std::runtime_error("num_streams must be at least 1");
+        d->num_streams = num_streams;
+
+        d->gpu_output = !!vsapi->mapGetInt(in, "gpu_output", 0, &err);
     } catch (std::runtime_error &e) {
         if (d->node)
             vsapi->freeNode(d->node);
@@ -250,32 +752,40 @@ static void VS_CC ngxCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         return true;
     }();
     (void) inited;
-    NV_new_Parameter(&d->param);
+    NVSDK_NGX_Parameter *param = nullptr;
+    NV_new_Parameter(&param);
 
-    d->param->Set(NVSDK_NGX_Parameter_Width, d->in_image_width());
-    d->param->Set(NVSDK_NGX_Parameter_Height, d->in_image_height());
-    d->param->Set(NVSDK_NGX_Parameter_Scale, d->scale);
+    param->Set(NVSDK_NGX_Parameter_Width, (uint64_t)d->tile_width);
+    param->Set(NVSDK_NGX_Parameter_Height, (uint64_t)d->tile_height);
+    param->Set(NVSDK_NGX_Parameter_Scale, d->scale);
 
     // Get the scratch buffer size and create the scratch allocation.
     size_t byteSize{ 0u };
-    CK_NGX(NVSDK_NGX_CUDA_GetScratchBufferSize(NVSDK_NGX_Feature_ImageSuperResolution, d->param, &byteSize));
+    CK_NGX(NVSDK_NGX_CUDA_GetScratchBufferSize(NVSDK_NGX_Feature_ImageSuperResolution, param, &byteSize));
     if (byteSize != 0) // should request none.
         abort();
 
-    // Create the feature
+    // Create the features, one per stream, sharing one context.
     CUdevice dev = 0;
     CK_CUDA(cuInit(0));
     CK_CUDA(cuDeviceGet(&dev, devid));
     CK_CUDA(cuCtxCreate_v2(&d->ctx, 0, dev));
-    CK_NGX(NVSDK_NGX_CUDA_CreateFeature(NVSDK_NGX_Feature_ImageSuperResolution, d->param, &d->DUHandle));
     CK_CUDA(cuCtxGetCurrent(&d->ctx));
-    d->allocate();
+    CK_CUDA(cuModuleLoadData(&d->module, packKernels));
+    CK_CUDA(cuModuleGetFunction(&d->pack, d->module, "ngx_pack"));
+    CK_CUDA(cuModuleGetFunction(&d->unpack, d->module, "ngx_unpack"));
+    CK_CUDA(cuModuleGetFunction(&d->blend, d->module, "ngx_blend"));
+    d->streams.reset(new NgxStream[d->num_streams]);
+    for (int i = 0; i < d->num_streams; i++) {
+        d->allocate(d->streams[i]);
+        d->freeStreams.push_back(&d->streams[i]);
+    }
     CK_CUDA(cuCtxPopCurrent_v2(nullptr));
 
     VSFilterDependency deps[] = {{d->node, rpStrictSpatial}};
 
     const VSVideoInfo *vi = &d->vi;
-    vsapi->createVideoFilter(out, "DLISR", vi, ngxGetFrame, ngxFree, fmParallel, deps, 1, d.release(), core);
+    vsapi->createVideoFilter(out, "DLISR", vi, timedGetFrame<NgxData, ngxGetFrame>, ngxFree, fmParallel, deps, 1, d.release(), core);
 }
 
 //////////////////////////////////////////
@@ -287,5 +797,5 @@ void VS_CC ngxInitialize(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
 VS_EXTERNAL_API(void) VS_CC VapourSynthPluginInit(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
     vsapi->configPlugin("info.akarin.plugin", "akarin2", "Experimental Nvidia DLISR plugin", VAPOURSYNTH_API_VERSION, 1, plugin);
 #endif
-    vsapi->registerFunction("DLISR", "clip:vnode;scale:int:opt;device_id:int:opt;", "clip:vnode", ngxCreate, nullptr, plugin);
+    vsapi->registerFunction("DLISR", "clip:vnode;scale:int:opt;device_id:int:opt;num_streams:int:opt;output_depth:int:opt;tile:int[]:opt;tile_overlap:int:opt;gpu_output:int:opt;", "clip:vnode", ngxCreate, nullptr, plugin);
 }
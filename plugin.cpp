@@ -2,8 +2,11 @@
 
 #include "VapourSynth4.h"
 
+#include "filterstats.h"
 #include "plugin.h"
+#include "propsnapshot.h"
 #include "version.h"
+#include "workpool.h"
 
 #include "expr/internalfilters.h"
 #include "ngx/internalfilters.h"
@@ -21,9 +24,18 @@ void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *c
 {
     for (auto f: versionFuncs)
         f(in, out, user_data, core, vsapi);
+    int64_t hits, misses;
+    propSnapshotStats(hits, misses);
+    vsapi->mapSetInt(out, "prop_snapshot_hits", hits, maReplace);
+    vsapi->mapSetInt(out, "prop_snapshot_misses", misses, maReplace);
     vsapi->mapSetData(out, "version", VERSION, -1, dtUtf8, maAppend);
 }
 
+void VS_CC statsCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi)
+{
+    filterStatsReport(out, vsapi);
+}
+
 VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
     vsapi->configPlugin(
         "info.akarin.vsplugin",
@@ -40,6 +52,14 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "version:data;"
         "expr_backend:data;"
         "expr_features:data[];"
+        "expr_cache_hits:int:opt;"
+        "expr_cache_misses:int:opt;"
+        "expr_cache_evictions:int:opt;"
+        "expr_cache_evicted_bytes:int:opt;"
+        "expr_cache_bytes:int:opt;"
+        "expr_cache_entries:int:opt;"
+        "prop_snapshot_hits:int;"
+        "prop_snapshot_misses:int;"
         "select_features:data[];"
         "text_features:data[];"
         "tmpl_features:data[];",
@@ -47,6 +67,21 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         nullptr,
         plugin
     );
+    vsapi->registerFunction(
+        "Stats",
+        "",
+        "filter:data[]:opt;"
+        "frames:int[]:opt;"
+        "time:float[]:opt;"
+        "max_time:float[]:opt;"
+        "bytes:int[]:opt;"
+        "cache_hits:int[]:opt;"
+        "gpu_wait:float[]:opt;",
+        statsCreate,
+        nullptr,
+        plugin
+    );
+    workPoolInit();
     exprInitialize(plugin, vsapi);
 #ifdef HAVE_NGX
     ngxInitialize(plugin, vsapi);
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include "propsnapshot.h"
+
+PropSnapshot::PropSnapshot(const VSMap *map, const VSAPI *vsapi) {
+    const int numKeys = vsapi->mapNumKeys(map);
+    props.reserve(numKeys);
+    for (int i = 0; i < numKeys; i++) {
+        const char *key = vsapi->mapGetKey(map, i);
+        PropValue &v = props[key];
+        v.type = vsapi->mapGetType(map, key);
+        v.count = vsapi->mapNumElements(map, key);
+        if (v.type == ptInt) {
+            const int64_t *p = vsapi->mapGetIntArray(map, key, nullptr);
+            v.ints.assign(p, p + v.count);
+        } else if (v.type == ptFloat) {
+            const double *p = vsapi->mapGetFloatArray(map, key, nullptr);
+            v.floats.assign(p, p + v.count);
+        } else if (v.type == ptData) {
+            for (int j = 0; j < v.count; j++)
+                v.data.emplace_back(vsapi->mapGetData(map, key, j, nullptr), vsapi->mapGetDataSize(map, key, j, nullptr));
+        }
+    }
+}
+
+namespace {
+
+// Enough for every filter of a graph to find the frames of the requests
+// in flight, and small, as snapshots are only a few KB each.
+constexpr size_t cacheCapacity = 256;
+
+struct Entry {
+    VSNode *node;
+    int n;
+    std::shared_ptr<const PropSnapshot> snapshot;
+};
+
+std::mutex cacheLock;
+std::list<Entry> lru; // most recently used first
+std::map<std::pair<VSNode *, int>, std::list<Entry>::iterator> index;
+std::atomic<int64_t> hits{ 0 }, misses{ 0 };
+
+} // namespace
+
+void propSnapshotRelease(const std::vector<VSNode *> &nodes) {
+    std::list<Entry> dropped; // the snapshots are freed unlocked
+    std::lock_guard<std::mutex> guard(cacheLock);
+    for (auto it = lru.begin(); it != lru.end();) {
+        auto next = std::next(it);
+        if (std::find(nodes.begin(), nodes.end(), it->node) != nodes.end()) {
+            index.erase({ it->node, it->n });
+            dropped.splice(dropped.end(), lru, it);
+        }
+        it = next;
+    }
+}
+
+std::shared_ptr<const PropSnapshot> propSnapshot(const FrameKey &key, const VSFrame *f, const VSAPI *vsapi) {
+    const auto k = std::make_pair(key.node, key.n);
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        auto it = index.find(k);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return it->second->snapshot;
+        }
+    }
+
+    // Decoded unlocked; if another thread got there first its copy is kept.
+    misses.fetch_add(1, std::memory_order_relaxed);
+    auto snapshot = std::make_shared<const PropSnapshot>(vsapi->getFramePropertiesRO(f), vsapi);
+    std::shared_ptr<const PropSnapshot> evicted; // freed unlocked
+    std::lock_guard<std::mutex> guard(cacheLock);
+    if (index.count(k))
+        return snapshot;
+    lru.push_front({ key.node, key.n, snapshot });
+    index.emplace(k, lru.begin());
+    if (lru.size() > cacheCapacity) {
+        evicted = std::move(lru.back().snapshot);
+        index.erase({ lru.back().node, lru.back().n });
+        lru.pop_back();
+    }
+    return snapshot;
+}
+
+void propSnapshotStats(int64_t &h, int64_t &m) {
+    h = hits.load(std::memory_order_relaxed);
+    m = misses.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,93 @@
+#ifndef PROPSNAPSHOT_H
+#define PROPSNAPSHOT_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "VapourSynth4.h"
+#include "scratch.h"
+
+// One property of a PropSnapshot. Only the array of its type is filled in;
+// count is the number of elements of frame, node and function properties.
+struct PropValue {
+    int type = ptUnset;
+    int count = 0;
+    std::vector<int64_t> ints;
+    std::vector<double> floats;
+    std::vector<std::string> data;
+};
+
+// The properties of a frame, decoded once and shared by every filter of the
+// plugin that reads them (Text, Tmpl, Expr, Select and PropExpr).
+class PropSnapshot {
+public:
+    PropSnapshot(const VSMap *map, const VSAPI *vsapi);
+
+    // Returns nullptr if key is not set.
+    const PropValue *find(const std::string &key) const {
+        auto it = props.find(key);
+        return it == props.end() ? nullptr : &it->second;
+    }
+
+private:
+    std::unordered_map<std::string, PropValue> props;
+};
+
+// Frame n of node. The frames of a node are the same whoever requests them,
+// so this identifies the properties without referencing the frame itself.
+struct FrameKey {
+    VSNode *node;
+    int n;
+};
+
+// Built per request, so kept in the scratch arena.
+using FrameKeys = ScratchVector<FrameKey>;
+
+// The keys of frame n of every node.
+inline FrameKeys frameKeys(const std::vector<VSNode *> &nodes, int n) {
+    FrameKeys keys;
+    keys.reserve(nodes.size());
+    for (auto node : nodes)
+        keys.push_back({ node, n });
+    return keys;
+}
+
+// Filter instances using snapshots drop the entries of the nodes they key
+// them by in their free function, before freeing those nodes. The cache holds
+// no references, so a node cannot outlive its readers through it; as every
+// reader of a node holds a reference to it, its entries are gone before the
+// node can be freed and a new one mistaken for it.
+void propSnapshotRelease(const std::vector<VSNode *> &nodes);
+
+// Returns the snapshot of f, which must be frame key.n of key.node, decoding
+// it unless another filter has already done so.
+std::shared_ptr<const PropSnapshot> propSnapshot(const FrameKey &key, const VSFrame *f, const VSAPI *vsapi);
+
+// Lookups that found the snapshot decoded by an earlier read and lookups that
+// had to decode it (see Version).
+void propSnapshotStats(int64_t &hits, int64_t &misses);
+
+// The snapshots of the frames of one request, fetched on first use. frames
+// holds the frame of every key and must outlive it.
+class PropSnapshots {
+public:
+    PropSnapshots(FrameKeys keys, const VSFrame *const *frames, const VSAPI *vsapi) :
+        keys(std::move(keys)), frames(frames), vsapi(vsapi), snapshots(this->keys.size()) {}
+
+    const PropSnapshot &operator[](size_t i) {
+        if (!snapshots[i])
+            snapshots[i] = propSnapshot(keys[i], frames[i], vsapi);
+        return *snapshots[i];
+    }
+
+private:
+    const FrameKeys keys;
+    const VSFrame *const *frames;
+    const VSAPI *vsapi;
+    ScratchVector<std::shared_ptr<const PropSnapshot>> snapshots;
+};
+
+#endif
@@ -0,0 +1,13 @@
+#include "scratch.h"
+
+ScratchMark scratchMark(void) {
+    return scratchArena().mark();
+}
+
+void scratchRelease(ScratchMark m) {
+    scratchArena().release(m);
+}
+
+void *scratchAlloc(size_t size) {
+    return scratchArena().allocate(size, ScratchArena::chunkAlign);
+}
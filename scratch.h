@@ -0,0 +1,149 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+// Per-thread memory for the transient buffers of a getFrame call. Allocations
+// bump a pointer through chunks that are kept for the lifetime of the thread;
+// timedGetFrame opens a ScratchScope around every call, which hands all of it
+// back at once, so a frame only reaches malloc while the chunks still grow.
+//
+// Anything allocated here must not outlive the getFrame call, so frameData,
+// instance data and thread_local buffers keep using the heap.
+//
+// C filters (Cambi) take the place of timedGetFrame with scratchMark and
+// scratchRelease around their getFrame, and allocate with scratchAlloc.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ScratchMark {
+    size_t chunk;
+    size_t used;
+} ScratchMark;
+
+// The position of the arena of the calling thread.
+ScratchMark scratchMark(void);
+// Frees what the calling thread allocated since m was taken.
+void scratchRelease(ScratchMark m);
+// Allocates size bytes aligned to 64 from the arena of the calling thread.
+void *scratchAlloc(size_t size);
+
+#ifdef __cplusplus
+}
+
+#include <cassert>
+#include <cstddef>
+#include <map>
+#include <new>
+#include <vector>
+
+class ScratchArena {
+public:
+    // Alignment of the chunks, and so the largest one an allocation can ask for.
+    static constexpr size_t chunkAlign = 64;
+    static constexpr size_t chunkSize = 64 << 10;
+
+    using Mark = ScratchMark;
+
+    ScratchArena() = default;
+    ScratchArena(const ScratchArena &) = delete;
+    ScratchArena &operator=(const ScratchArena &) = delete;
+    ~ScratchArena() {
+        for (auto &c : chunks)
+            ::operator delete(c.data, std::align_val_t(chunkAlign));
+    }
+
+    void *allocate(size_t size, size_t align) {
+        assert(align <= chunkAlign && (align & (align - 1)) == 0);
+        size_t offset = (used + align - 1) & ~(align - 1);
+        if (current < chunks.size() && offset + size <= chunks[current].size) {
+            used = offset + size;
+            return chunks[current].data + offset;
+        }
+        // On to the next chunk, unless the current one is still empty.
+        const size_t next = current < chunks.size() && used > 0 ? current + 1 : current;
+        if (next == chunks.size() || chunks[next].size < size) {
+            const size_t bytes = size > chunkSize ? (size + chunkAlign - 1) & ~(chunkAlign - 1) : chunkSize;
+            Chunk c = { static_cast<std::byte *>(::operator new(bytes, std::align_val_t(chunkAlign))), bytes };
+            chunks.insert(chunks.begin() + next, c);
+        }
+        current = next;
+        used = size;
+        return chunks[current].data;
+    }
+
+    // Only gives the memory back if p is the last allocation, as when a
+    // vector grows right after it was allocated.
+    void deallocate(void *p, size_t size) {
+        if (current < chunks.size() && static_cast<std::byte *>(p) + size == chunks[current].data + used)
+            used = static_cast<std::byte *>(p) - chunks[current].data;
+    }
+
+    Mark mark() const { return { current, used }; }
+    // Frees everything allocated since m was taken.
+    void release(Mark m) {
+        current = m.chunk;
+        used = m.used;
+    }
+
+private:
+    struct Chunk {
+        std::byte *data;
+        size_t size;
+    };
+    std::vector<Chunk> chunks;
+    size_t current = 0, used = 0;
+};
+
+// The arena of the calling thread.
+inline ScratchArena &scratchArena() {
+    thread_local ScratchArena arena;
+    return arena;
+}
+
+// Frees what the thread allocated from its arena while it was in scope.
+class ScratchScope {
+public:
+    ScratchScope() : arena(scratchArena()), m(arena.mark()) {}
+    ~ScratchScope() { arena.release(m); }
+    ScratchScope(const ScratchScope &) = delete;
+    ScratchScope &operator=(const ScratchScope &) = delete;
+
+private:
+    ScratchArena &arena;
+    ScratchArena::Mark m;
+};
+
+// Allocates from the arena of the thread that constructed it (or the
+// allocator it was copied from), so containers may be read by other threads
+// but only grow on the owning one.
+template<typename T>
+class ScratchAllocator {
+public:
+    using value_type = T;
+
+    ScratchAllocator() noexcept : arena(&scratchArena()) {}
+    template<typename U>
+    ScratchAllocator(const ScratchAllocator<U> &other) noexcept : arena(other.arena) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T *p, size_t n) noexcept { arena->deallocate(p, n * sizeof(T)); }
+
+    template<typename U>
+    bool operator==(const ScratchAllocator<U> &other) const noexcept { return arena == other.arena; }
+
+private:
+    template<typename U> friend class ScratchAllocator;
+    ScratchArena *arena;
+};
+
+template<typename T>
+using ScratchVector = std::vector<T, ScratchAllocator<T>>;
+
+template<typename K, typename V, typename Compare = std::less<K>>
+using ScratchMap = std::map<K, V, Compare, ScratchAllocator<std::pair<const K, V>>>;
+#endif
+
+#endif // SCRATCH_H
@@ -147,6 +147,7 @@ public:
     Range,
     Round,
     Sort,
+    Sum,
     Upper,
     Super,
     Join,
@@ -189,6 +190,7 @@ private:
       {std::make_pair("range", 1), FunctionData {Operation::Range}},
       {std::make_pair("round", 2), FunctionData {Operation::Round}},
       {std::make_pair("sort", 1), FunctionData {Operation::Sort}},
+      {std::make_pair("sum", 1), FunctionData {Operation::Sum}},
       {std::make_pair("upper", 1), FunctionData {Operation::Upper}},
       {std::make_pair("super", 0), FunctionData {Operation::Super}},
       {std::make_pair("super", 1), FunctionData {Operation::Super}},
@@ -2092,6 +2094,10 @@ public:
   virtual ~json_like() {}
   virtual bool contains(const json::json_pointer &ptr) const = 0;
   virtual const json &operator[](const json::json_pointer &ptr) const = 0;
+  // Computes op (Length, Max, Min, Sum, or Join with separator arg) of the
+  // array at ptr into result without materialising it as json. Returns false
+  // to have the renderer apply op to operator[] instead.
+  virtual bool reduce(const json::json_pointer &, FunctionStorage::Operation, const json *, json &) const { return false; }
 };
 
 class json_: public json_like {
@@ -2223,6 +2229,16 @@ class Renderer : public NodeVisitor {
     return result;
   }
 
+  // Lets the data input compute op when the first argument of node is a plain
+  // variable (not a loop one), see json_like::reduce.
+  bool reduce_data(const FunctionNode& node, Op op, const json* arg, json& result) {
+    const auto data_node = node.arguments.empty() ? nullptr : dynamic_cast<const DataNode*>(node.arguments[0].get());
+    if (!data_node || additional_data.contains(data_node->ptr)) {
+      return false;
+    }
+    return data_input->reduce(data_node->ptr, op, arg, result);
+  }
+
   template <bool throw_not_found = true> Arguments get_argument_vector(const FunctionNode& node) {
     const size_t N = node.arguments.size();
     for (auto a : node.arguments) {
@@ -2432,6 +2448,11 @@ class Renderer : public NodeVisitor {
       data_eval_stack.push(result);
     } break;
     case Op::Length: {
+      json reduced;
+      if (reduce_data(node, Op::Length, nullptr, reduced)) {
+        make_result(std::move(reduced));
+        break;
+      }
       const auto val = get_arguments<1>(node)[0];
       if (val->is_string()) {
         make_result(val->get_ref<const json::string_t&>().length());
@@ -2445,11 +2466,21 @@ class Renderer : public NodeVisitor {
       make_result(std::move(result));
     } break;
     case Op::Max: {
+      json reduced;
+      if (reduce_data(node, Op::Max, nullptr, reduced)) {
+        make_result(std::move(reduced));
+        break;
+      }
       const auto args = get_arguments<1>(node);
       const auto result = std::max_element(args[0]->begin(), args[0]->end());
       data_eval_stack.push(&(*result));
     } break;
     case Op::Min: {
+      json reduced;
+      if (reduce_data(node, Op::Min, nullptr, reduced)) {
+        make_result(std::move(reduced));
+        break;
+      }
       const auto args = get_arguments<1>(node);
       const auto result = std::min_element(args[0]->begin(), args[0]->end());
       data_eval_stack.push(&(*result));
@@ -2478,6 +2509,32 @@ class Renderer : public NodeVisitor {
       data_tmp_stack.push_back(result_ptr);
       data_eval_stack.push(result_ptr.get());
     } break;
+    case Op::Sum: {
+      json reduced;
+      if (reduce_data(node, Op::Sum, nullptr, reduced)) {
+        make_result(std::move(reduced));
+        break;
+      }
+      const auto val = get_arguments<1>(node)[0];
+      json::number_integer_t int_sum = 0;
+      json::number_float_t float_sum = 0;
+      bool is_float = false;
+      for (const auto& value : *val) {
+        if (value.is_number_integer()) {
+          int_sum += value.get<json::number_integer_t>();
+        } else if (value.is_number()) {
+          float_sum += value.get<json::number_float_t>();
+          is_float = true;
+        } else {
+          throw_renderer_error("sum needs numbers, but found " + value.dump(), node);
+        }
+      }
+      if (is_float) {
+        make_result(float_sum + int_sum);
+      } else {
+        make_result(int_sum);
+      }
+    } break;
     case Op::Upper: {
       auto result = get_arguments<1>(node)[0]->get<json::string_t>();
       std::transform(result.begin(), result.end(), result.begin(), [](char c) { return static_cast<char>(::toupper(c)); });
@@ -2538,6 +2595,13 @@ class Renderer : public NodeVisitor {
       make_result(nullptr);
     } break;
     case Op::Join: {
+      if (dynamic_cast<const DataNode*>(node.arguments[0].get())) {
+        json reduced;
+        if (reduce_data(node, Op::Join, get_arguments<1, 1>(node)[0], reduced)) {
+          make_result(std::move(reduced));
+          break;
+        }
+      }
       const auto args = get_arguments<2>(node);
       const auto separator = args[1]->get<json::string_t>();
       std::ostringstream os;
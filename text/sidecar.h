@@ -0,0 +1,202 @@
+#ifndef TEXT_SIDECAR_H
+#define TEXT_SIDECAR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <VapourSynth4.h>
+
+// Streams one line per frame to a JSONL or CSV file, in frame order.
+//
+// Frames finish out of order under fmParallel, so lines wait until all
+// earlier frames have been written. Frames that are never requested would
+// stall that forever, so past maxPending waiting lines the earliest one is
+// written anyway and the gap is skipped. A background thread does the file
+// I/O so that the filters only append to a memory buffer. If a write fails
+// (e.g. the disk is full), that is logged once and the rest of the lines are
+// dropped, so the file ends at the last complete flush.
+class SidecarWriter {
+public:
+    enum Format { Jsonl, Csv };
+
+    // Throws std::runtime_error if the file cannot be opened.
+    SidecarWriter(const std::string &path, Format format, std::vector<std::string> columns, const VSAPI *vsapi, VSCore *core):
+        format(format), columns(std::move(columns)), path(path), vsapi(vsapi), core(core) {
+        file = std::fopen(path.c_str(), "wb");
+        if (!file)
+            throw std::runtime_error("cannot open sidecar file " + path);
+        if (format == Csv) {
+            buffer = "n";
+            for (const auto &c : this->columns) {
+                buffer += ',';
+                appendCsv(buffer, c);
+            }
+            buffer += '\n';
+        }
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~SidecarWriter() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto &p : pending)
+                buffer += p.second;
+            pending.clear();
+            closing = true;
+        }
+        wake.notify_one();
+        thread.join();
+        if (std::fclose(file) != 0 && !failed)
+            fail();
+    }
+
+    SidecarWriter(const SidecarWriter &) = delete;
+    SidecarWriter &operator=(const SidecarWriter &) = delete;
+
+    static Format parseFormat(const std::string &name) {
+        if (name == "jsonl")
+            return Jsonl;
+        if (name == "csv")
+            return Csv;
+        throw std::runtime_error("unknown sidecar format " + name + " (must be jsonl or csv)");
+    }
+
+    // Records the values (one per column) of frame n. Frames already written,
+    // e.g. requested again by a previewer, are ignored.
+    void write(int n, const std::vector<std::string_view> &values) {
+        std::string line;
+        if (format == Jsonl) {
+            line = "{\"n\":" + std::to_string(n);
+            for (size_t i = 0; i < columns.size(); i++) {
+                line += ',';
+                appendJson(line, columns[i]);
+                line += ':';
+                appendJson(line, values[i]);
+            }
+            line += "}\n";
+        } else {
+            line = std::to_string(n);
+            for (const auto &v : values) {
+                line += ',';
+                appendCsv(line, v);
+            }
+            line += '\n';
+        }
+
+        bool flush;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (failed || n < next || !pending.emplace(n, std::move(line)).second)
+                return;
+            while (!pending.empty() && (pending.begin()->first == next || pending.size() > maxPending)) {
+                buffer += pending.begin()->second;
+                next = pending.begin()->first + 1;
+                pending.erase(pending.begin());
+            }
+            flush = buffer.size() >= flushSize;
+        }
+        if (flush)
+            wake.notify_one();
+    }
+
+private:
+    static constexpr size_t maxPending = 1024;
+    static constexpr size_t flushSize = 1 << 16;
+
+    const Format format;
+    const std::vector<std::string> columns;
+    const std::string path;
+    const VSAPI *vsapi;
+    VSCore *core;
+    FILE *file;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::map<int, std::string> pending; // guarded by lock
+    std::string buffer; // guarded by lock
+    int next = 0; // guarded by lock
+    bool closing = false; // guarded by lock
+    bool failed = false; // guarded by lock, and only set by the writer thread
+    std::thread thread;
+
+    // Writes the buffer out whenever it fills up, and at least once a second.
+    void run() {
+        std::string out;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait_for(guard, std::chrono::seconds(1), [this]() { return closing || buffer.size() >= flushSize; });
+            out.swap(buffer);
+            bool done = closing;
+            guard.unlock();
+            bool ok = true;
+            if (!out.empty()) {
+                ok = std::fwrite(out.data(), 1, out.size(), file) == out.size() && std::fflush(file) == 0;
+                out.clear();
+            }
+            if (!ok)
+                fail();
+            if (done || !ok)
+                return;
+            guard.lock();
+        }
+    }
+
+    // Stops all further writes after the first failed one.
+    void fail() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            failed = true;
+            pending.clear();
+            buffer.clear();
+        }
+        vsapi->logMessage(mtWarning, ("failed to write sidecar file " + path + ", it is incomplete").c_str(), core);
+    }
+
+    static void appendJson(std::string &dst, std::string_view s) {
+        static const char hex[] = "0123456789abcdef";
+        dst += '"';
+        for (char ch : s) {
+            unsigned char c = static_cast<unsigned char>(ch);
+            switch (c) {
+            case '"': dst += "\\\""; break;
+            case '\\': dst += "\\\\"; break;
+            case '\n': dst += "\\n"; break;
+            case '\r': dst += "\\r"; break;
+            case '\t': dst += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    dst += "\\u00";
+                    dst += hex[c >> 4];
+                    dst += hex[c & 15];
+                } else {
+                    dst += ch;
+                }
+            }
+        }
+        dst += '"';
+    }
+
+    static void appendCsv(std::string &dst, std::string_view s) {
+        if (s.find_first_of(",\"\r\n") == std::string_view::npos) {
+            dst += s;
+            return;
+        }
+        dst += '"';
+        for (char c : s) {
+            if (c == '"')
+                dst += '"';
+            dst += c;
+        }
+        dst += '"';
+    }
+};
+
+#endif // TEXT_SIDECAR_H
@@ -20,9 +20,13 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 #include <functional>
 #include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
 #include <vector>
@@ -43,8 +47,12 @@
 #include "fmt/ranges.h"
 
 #include "filtershared.h"
+#include "sidecar.h"
 #include "ter-116n.h"
+#include "../filterstats.h"
 #include "../plugin.h"
+#include "../propsnapshot.h"
+#include "../scratch.h"
 
 #define STRINGER_IMPL
 #include "stringer.h"
@@ -61,58 +69,69 @@ const int margin_h = 16;
 const int margin_v = 16;
 
 namespace {
-typedef std::vector<std::string> stringlist;
+// The lines of one getFrame call.
+typedef ScratchVector<std::string> stringlist;
 } // namespace
 
-static void scrawl_character_int(unsigned char c, uint8_t *image, int stride, int dest_x, int dest_y, int bitsPerSample, int scale, bool full) {
-    int black = full ? 0 : (16 << (bitsPerSample - 8));
-    int white = full ? ((1L << bitsPerSample) - 1) : (235 << (bitsPerSample - 8));
-    int x, y;
-    if (bitsPerSample == 8) {
-        for (y = 0; y < character_height * scale; y++) {
-            for (x = 0; x < character_width * scale; x++) {
-                if (__font_bitmap__[c * character_height + y/scale] & (1 << (7 - x/scale))) {
-                    image[dest_y*stride + dest_x + x] = white;
-                } else {
-                    image[dest_y*stride + dest_x + x] = black;
-                }
-            }
+namespace {
 
-            dest_y++;
-        }
-    } else {
-        for (y = 0; y < character_height * scale; y++) {
-            for (x = 0; x < character_width * scale; x++) {
-                if (__font_bitmap__[c * character_height + y/scale] & (1 << (7 - x/scale))) {
-                    reinterpret_cast<uint16_t *>(image)[dest_y*stride/2 + dest_x + x] = white;
-                } else {
-                    reinterpret_cast<uint16_t *>(image)[dest_y*stride/2 + dest_x + x] = black;
+// The font pre-rendered for one sample format and scale: every glyph row is
+// stretched horizontally and converted to samples once, so drawing a
+// character is a memcpy per output row.
+struct GlyphAtlas {
+    size_t rowSize; // in bytes
+    int scale;
+    std::vector<uint8_t> rows; // [256][character_height][rowSize]
+
+    GlyphAtlas(const VSVideoFormat &format, bool full, int scale): rowSize(static_cast<size_t>(character_width) * scale * format.bytesPerSample), scale(scale), rows(256 * character_height * rowSize) {
+        for (int c = 0; c < 256; c++) {
+            for (int y = 0; y < character_height; y++) {
+                uint8_t *row = rows.data() + (c * character_height + y) * rowSize;
+                for (int x = 0; x < character_width * scale; x++) {
+                    bool set = __font_bitmap__[c * character_height + y] & (1 << (7 - x / scale));
+                    if (format.sampleType == stFloat) {
+                        reinterpret_cast<float *>(row)[x] = set ? 1.0f : 0.0f;
+                    } else {
+                        int black = full ? 0 : (16 << (format.bitsPerSample - 8));
+                        int white = full ? ((1L << format.bitsPerSample) - 1) : (235 << (format.bitsPerSample - 8));
+                        if (format.bytesPerSample == 1)
+                            row[x] = set ? white : black;
+                        else
+                            reinterpret_cast<uint16_t *>(row)[x] = set ? white : black;
+                    }
                 }
             }
-
-            dest_y++;
         }
     }
-}
 
+    void blit(unsigned char c, uint8_t *image, ptrdiff_t stride, int dest_x, int dest_y, int bytesPerSample) const {
+        image += dest_y * stride + dest_x * bytesPerSample;
+        for (int y = 0; y < character_height * scale; y++, image += stride)
+            memcpy(image, rows.data() + (c * character_height + y / scale) * rowSize, rowSize);
+    }
+};
 
-static void scrawl_character_float(unsigned char c, uint8_t *image, int stride, int dest_x, int dest_y, int scale) {
-    float white = 1.0f;
-    float black = 0.0f;
-    int x, y;
+// Atlases of the formats and ranges seen so far; built at create time for
+// constant formats, otherwise on first use.
+class GlyphAtlasCache {
+    std::mutex lock;
+    std::vector<std::pair<uint64_t, std::unique_ptr<GlyphAtlas>>> atlases;
 
-    for (y = 0; y < character_height * scale; y++) {
-        for (x = 0; x < character_width * scale; x++) {
-            if (__font_bitmap__[c * character_height + y/scale] & (1 << (7 - x/scale))) {
-                reinterpret_cast<float *>(image)[dest_y*stride/4 + dest_x + x] = white;
-            } else {
-                reinterpret_cast<float *>(image)[dest_y*stride/4 + dest_x + x] = black;
-            }
+public:
+    const GlyphAtlas &get(const VSVideoFormat &format, bool full, int scale) {
+        uint64_t key = (static_cast<uint64_t>(format.sampleType) << 32) | (format.bitsPerSample << 1) | (full && format.sampleType == stInteger);
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto &a : atlases) {
+            if (a.first == key)
+                return *a.second;
         }
-
-        dest_y++;
+        atlases.emplace_back(key, std::make_unique<GlyphAtlas>(format, full, scale));
+        return *atlases.back().second;
     }
-}
+};
+
+} // namespace
+
 
 static void sanitise_text(std::string& txt) {
     for (size_t i = 0; i < txt.length(); i++) {
@@ -187,135 +206,344 @@ static stringlist split_text(const std::string& txt, int width, int height, int
 }
 
 
-static void scrawl_text(std::string txt, int alignment, int scale, VSFrame *frame, const VSAPI *vsapi) {
-    const VSVideoFormat *frame_format = vsapi->getVideoFrameFormat(frame);
-    int width = vsapi->getFrameWidth(frame, 0);
-    int height = vsapi->getFrameHeight(frame, 0);
-
-    sanitise_text(txt);
-
-    stringlist lines = split_text(txt, width - margin_h*2, height - margin_v*2, scale);
-
-    int start_x = 0;
-    int start_y = 0;
-
+// The column at which something extent pixels wide starts in an area of the
+// given width.
+static int align_x(int alignment, int width, int extent, int margin) {
     switch (alignment) {
-    case 7:
+    case 2:
+    case 5:
     case 8:
+        return (width - extent) / 2;
+    case 3:
+    case 6:
     case 9:
-        start_y = margin_v;
-        break;
+        return width - extent - margin;
+    default:
+        return margin;
+    }
+}
+
+// The row at which something extent pixels high starts in an area of the
+// given height.
+static int align_y(int alignment, int height, int extent, int margin) {
+    switch (alignment) {
     case 4:
     case 5:
     case 6:
-        start_y = (height - static_cast<int>(lines.size())*character_height*scale) / 2;
-        break;
+        return (height - extent) / 2;
     case 1:
     case 2:
     case 3:
-        start_y = height - static_cast<int>(lines.size())*character_height*scale - margin_v;
-        break;
+        return height - extent - margin;
+    default:
+        return margin;
     }
+}
+
+// Sets a w x h block of samples starting at (x, y) to value (integer formats)
+// or fvalue (float).
+static void fill_rect(uint8_t *image, ptrdiff_t stride, int bytesPerSample, int x, int y, int w, int h, int value, float fvalue) {
+    for (int row = y; row < y + h; row++) {
+        uint8_t *p = image + row * stride;
+        if (bytesPerSample == 1)
+            memset(p + x, value, w);
+        else if (bytesPerSample == 2)
+            vs_memset16(reinterpret_cast<uint16_t *>(p) + x, value, w);
+        else
+            vs_memset_float(reinterpret_cast<float *>(p) + x, fvalue, w);
+    }
+}
+
+namespace {
+
+// Laid out lines with their glyphs already converted to samples, so that
+// drawing them is a memcpy per row and line. Chroma under the text is left
+// neutral, as it takes no samples of its own.
+struct TextStrip {
+    struct Line {
+        int x, y, width; // in luma pixels
+        std::vector<uint8_t> samples; // character_height * scale rows of width samples
+    };
+    std::vector<Line> lines;
+};
+
+} // namespace
 
+// Lays out lines in an image of the given width, starting at row start_y and
+// aligned horizontally within margin of its edges.
+static TextStrip build_strip(const stringlist &lines, int alignment, int scale, const GlyphAtlas &atlas, const VSVideoFormat &format, int width, int start_y, int margin) {
+    TextStrip strip;
     for (const auto &iter : lines) {
-        switch (alignment) {
-        case 1:
-        case 4:
-        case 7:
-            start_x = margin_h;
-            break;
-        case 2:
-        case 5:
-        case 8:
-            start_x = (width - static_cast<int>(iter.size())*character_width*scale) / 2;
-            break;
-        case 3:
-        case 6:
-        case 9:
-            start_x = width - static_cast<int>(iter.size())*character_width*scale - margin_h;
-            break;
-        }
-
-        for (size_t i = 0; i < iter.size(); i++) {
-            int dest_x = start_x + static_cast<int>(i)*character_width*scale;
-            int dest_y = start_y;
-
-            if (frame_format->colorFamily == cfRGB) {
-                for (int plane = 0; plane < frame_format->numPlanes; plane++) {
-                    uint8_t *image = vsapi->getWritePtr(frame, plane);
-                    int stride = vsapi->getStride(frame, plane);
-
-                    if (frame_format->sampleType == stInteger) {
-                        scrawl_character_int(iter[i], image, stride, dest_x, dest_y, frame_format->bitsPerSample, scale, true);
-                    } else {
-                        scrawl_character_float(iter[i], image, stride, dest_x, dest_y, scale);
-                    }
-                }
-            } else {
-                for (int plane = 0; plane < frame_format->numPlanes; plane++) {
-                    uint8_t *image = vsapi->getWritePtr(frame, plane);
-                    int stride = vsapi->getStride(frame, plane);
-
-                    if (plane == 0) {
-                        if (frame_format->sampleType == stInteger) {
-                            const VSMap *m = vsapi->getFramePropertiesRO(frame);
-                            int err;
-                            bool full = vsapi->mapGetInt(m, "_ColorRange", 0, &err) == 0;
-                            if (err) full = false; // for YUV, assuming limited unless specified otherwise
-                            scrawl_character_int(iter[i], image, stride, dest_x, dest_y, frame_format->bitsPerSample, scale, full);
-                        } else {
-                            scrawl_character_float(iter[i], image, stride, dest_x, dest_y, scale);
-                        }
-                    } else {
-                        int sub_w = scale * character_width  >> frame_format->subSamplingW;
-                        int sub_h = scale * character_height >> frame_format->subSamplingH;
-                        int sub_dest_x = dest_x >> frame_format->subSamplingW;
-                        int sub_dest_y = dest_y >> frame_format->subSamplingH;
-                        int y;
-
-                        if (frame_format->bitsPerSample == 8) {
-                            for (y = 0; y < sub_h; y++) {
-                                memset(image + (y+sub_dest_y)*stride + sub_dest_x, 128, sub_w);
-                            }
-                        } else if (frame_format->bitsPerSample <= 16) {
-                            for (y = 0; y < sub_h; y++) {
-                                vs_memset16(reinterpret_cast<uint16_t *>(image) + (y+sub_dest_y)*stride/2 + sub_dest_x, 128 << (frame_format->bitsPerSample - 8), sub_w);
-                            }
-                        } else {
-                            for (y = 0; y < sub_h; y++) {
-                                vs_memset_float(reinterpret_cast<float *>(image) + (y+sub_dest_y)*stride/4 + sub_dest_x, 0.0f, sub_w);
-                            }
-                        }
-                    } // if plane
-                } // for plane in planes
-            } // if colorFamily
-        } // for i in line
+        TextStrip::Line line;
+        line.width = static_cast<int>(iter.size()) * character_width * scale;
+        line.x = align_x(alignment, width, line.width, margin);
+        line.y = start_y;
+        const ptrdiff_t stride = static_cast<ptrdiff_t>(line.width) * format.bytesPerSample;
+        line.samples.resize(stride * character_height * scale);
+        for (size_t i = 0; i < iter.size(); i++)
+            atlas.blit(iter[i], line.samples.data(), stride, static_cast<int>(i) * character_width * scale, 0, format.bytesPerSample);
+        if (line.width > 0)
+            strip.lines.push_back(std::move(line));
         start_y += character_height * scale;
-    } // for iter in lines
+    }
+    return strip;
+}
+
+static void draw_strip(const TextStrip &strip, int scale, const VSVideoFormat *frame_format, uint8_t *const images[3], const int strides[3]) {
+    const int bytesPerSample = frame_format->bytesPerSample;
+    const int rows = character_height * scale;
+
+    for (const auto &line : strip.lines) {
+        const size_t rowSize = static_cast<size_t>(line.width) * bytesPerSample;
+        for (int plane = 0; plane < frame_format->numPlanes; plane++) {
+            uint8_t *image = images[plane];
+            int stride = strides[plane];
+
+            if (frame_format->colorFamily == cfRGB || plane == 0) {
+                for (int y = 0; y < rows; y++)
+                    memcpy(image + (line.y + y) * stride + line.x * bytesPerSample, line.samples.data() + y * rowSize, rowSize);
+            } else {
+                int sub_w = scale * character_width >> frame_format->subSamplingW;
+                int sub_h = rows >> frame_format->subSamplingH;
+                int neutral = frame_format->sampleType == stFloat ? 0 : 128 << (frame_format->bitsPerSample - 8);
+                fill_rect(image, stride, bytesPerSample, line.x >> frame_format->subSamplingW, line.y >> frame_format->subSamplingH,
+                          line.width / (character_width * scale) * sub_w, sub_h, neutral, 0.0f);
+            }
+        }
+    }
+}
+
+// Whether frame is full range: always for RGB, for YUV and GRAY only if
+// _ColorRange says so.
+static bool is_full_range(const VSFrame *frame, const VSAPI *vsapi) {
+    if (vsapi->getVideoFrameFormat(frame)->colorFamily == cfRGB)
+        return true;
+    int err;
+    bool full = vsapi->mapGetInt(vsapi->getFramePropertiesRO(frame), "_ColorRange", 0, &err) == 0;
+    return full && !err;
+}
+
+// The strip of txt on a frame of the given size and format. The strips drawn
+// last are kept per thread, since overlays tend to repeat the same string for
+// long runs of frames, which then skip sanitise_text and split_text as well.
+static const TextStrip &text_strip(const std::string &txt, int alignment, int scale, GlyphAtlasCache &atlases, const VSVideoFormat &format, bool full, int width, int height) {
+    struct Entry {
+        std::string text;
+        int alignment, scale, width, height;
+        int colorFamily, sampleType, bitsPerSample, subSamplingW, subSamplingH;
+        bool full;
+        TextStrip strip;
+    };
+    constexpr size_t capacity = 8;
+    thread_local std::list<Entry> lru; // most recently used first
+
+    for (auto it = lru.begin(); it != lru.end(); ++it) {
+        if (it->text == txt && it->alignment == alignment && it->scale == scale && it->width == width && it->height == height &&
+                it->colorFamily == format.colorFamily && it->sampleType == format.sampleType && it->bitsPerSample == format.bitsPerSample &&
+                it->subSamplingW == format.subSamplingW && it->subSamplingH == format.subSamplingH && it->full == full) {
+            lru.splice(lru.begin(), lru, it);
+            return lru.front().strip;
+        }
+    }
+
+    std::string sanitised = txt;
+    sanitise_text(sanitised);
+    stringlist lines = split_text(sanitised, width - margin_h*2, height - margin_v*2, scale);
+    int start_y = align_y(alignment, height, static_cast<int>(lines.size())*character_height*scale, margin_v);
+    TextStrip strip = build_strip(lines, alignment, scale, atlases.get(format, full, scale), format, width, start_y, margin_h);
+
+    if (lru.size() >= capacity)
+        lru.pop_back();
+    lru.push_front({ txt, alignment, scale, width, height, format.colorFamily, format.sampleType, format.bitsPerSample,
+                     format.subSamplingW, format.subSamplingH, full, std::move(strip) });
+    return lru.front().strip;
+}
+
+static void scrawl_text(const std::string &txt, int alignment, int scale, GlyphAtlasCache &atlases, VSFrame *frame, const VSAPI *vsapi) {
+    const VSVideoFormat *frame_format = vsapi->getVideoFrameFormat(frame);
+    int width = vsapi->getFrameWidth(frame, 0);
+    int height = vsapi->getFrameHeight(frame, 0);
+
+    const TextStrip &strip = text_strip(txt, alignment, scale, atlases, *frame_format, is_full_range(frame, vsapi), width, height);
+    if (strip.lines.empty())
+        return;
+
+    // Planes of a copied frame are shared with the source until their write
+    // pointer is requested, so only ask for them once there is something to draw.
+    uint8_t *images[3] = {};
+    int strides[3] = {};
+    for (int plane = 0; plane < frame_format->numPlanes; plane++) {
+        images[plane] = vsapi->getWritePtr(frame, plane);
+        strides[plane] = static_cast<int>(vsapi->getStride(frame, plane));
+    }
+    draw_strip(strip, scale, frame_format, images, strides);
 }
 
+// Renders txt, laid out as scrawl_text would on src, into a frame just large
+// enough for its lines (rounded up to the subsampling). The _Alpha property
+// holds a mask that is opaque over the character cells, and TextX/TextY the
+// position at which scrawl_text would have drawn the frame on src.
+static const VSFrame *render_overlay(std::string txt, int alignment, int scale, GlyphAtlasCache &atlases, const VSFrame *src, VSCore *core, const VSAPI *vsapi) {
+    const VSVideoFormat *frame_format = vsapi->getVideoFrameFormat(src);
+    int width = vsapi->getFrameWidth(src, 0);
+    int height = vsapi->getFrameHeight(src, 0);
+
+    sanitise_text(txt);
+
+    stringlist lines = split_text(txt, width - margin_h*2, height - margin_v*2, scale);
+    int columns = 0;
+    for (const auto &line : lines)
+        columns = std::max(columns, static_cast<int>(line.size()));
+    const int text_w = columns * character_width * scale;
+    const int text_h = columns ? static_cast<int>(lines.size()) * character_height * scale : 0;
+    const int sub_w = 1 << frame_format->subSamplingW, sub_h = 1 << frame_format->subSamplingH;
+    const int w = (std::max(text_w, 1) + sub_w - 1) / sub_w * sub_w;
+    const int h = (std::max(text_h, 1) + sub_h - 1) / sub_h * sub_h;
+
+    const bool full = is_full_range(src, vsapi);
+    const int bits = frame_format->bitsPerSample;
+    const int bytesPerSample = frame_format->bytesPerSample;
+    VSFrame *dst = vsapi->newVideoFrame(frame_format, w, h, nullptr, core);
+    uint8_t *images[3] = {};
+    int strides[3] = {};
+    for (int plane = 0; plane < frame_format->numPlanes; plane++) {
+        images[plane] = vsapi->getWritePtr(dst, plane);
+        strides[plane] = static_cast<int>(vsapi->getStride(dst, plane));
+        const bool chroma = plane > 0 && frame_format->colorFamily != cfRGB;
+        const int value = chroma ? 128 << (bits - 8) : full ? 0 : 16 << (bits - 8);
+        fill_rect(images[plane], strides[plane], bytesPerSample, 0, 0, vsapi->getFrameWidth(dst, plane), vsapi->getFrameHeight(dst, plane), value, 0.0f);
+    }
+
+    VSVideoFormat alpha_format;
+    vsapi->queryVideoFormat(&alpha_format, cfGray, frame_format->sampleType, bits, 0, 0, core);
+    VSFrame *alpha = vsapi->newVideoFrame(&alpha_format, w, h, nullptr, core);
+    uint8_t *mask = vsapi->getWritePtr(alpha, 0);
+    const ptrdiff_t mask_stride = vsapi->getStride(alpha, 0);
+    fill_rect(mask, mask_stride, bytesPerSample, 0, 0, w, h, 0, 0.0f);
+
+    if (columns) {
+        draw_strip(build_strip(lines, alignment, scale, atlases.get(*frame_format, full, scale), *frame_format, w, 0, 0), scale, frame_format, images, strides);
+        int y = 0;
+        for (const auto &line : lines) {
+            const int line_w = static_cast<int>(line.size()) * character_width * scale;
+            fill_rect(mask, mask_stride, bytesPerSample, align_x(alignment, w, line_w, 0), y, line_w, character_height * scale, (1 << bits) - 1, 1.0f);
+            y += character_height * scale;
+        }
+    }
+
+    VSMap *props = vsapi->getFramePropertiesRW(dst);
+    if (frame_format->colorFamily != cfRGB)
+        vsapi->mapSetInt(props, "_ColorRange", full ? 0 : 1, maReplace);
+    vsapi->mapSetInt(props, "TextX", columns ? align_x(alignment, width, text_w, margin_h) : 0, maReplace);
+    vsapi->mapSetInt(props, "TextY", columns ? align_y(alignment, height, text_h, margin_v) : 0, maReplace);
+    vsapi->mapConsumeFrame(props, "_Alpha", alpha, maReplace);
+    return dst;
+}
+
+namespace {
+
+// The last overlay rendered, reused as long as neither the text nor the
+// geometry, format or range of the source change.
+class OverlayCache {
+    std::mutex lock;
+    std::string text;
+    int width = 0, height = 0;
+    uint32_t format = 0;
+    bool full = false;
+    const VSFrame *frame = nullptr;
+
+public:
+    const VSFrame *get(const std::string &txt, int alignment, int scale, GlyphAtlasCache &atlases, const VSFrame *src, VSCore *core, const VSAPI *vsapi) {
+        const VSVideoFormat *ff = vsapi->getVideoFrameFormat(src);
+        const int w = vsapi->getFrameWidth(src, 0), h = vsapi->getFrameHeight(src, 0);
+        const uint32_t id = vsapi->queryVideoFormatID(ff->colorFamily, ff->sampleType, ff->bitsPerSample, ff->subSamplingW, ff->subSamplingH, core);
+        const bool f = is_full_range(src, vsapi);
+        std::lock_guard<std::mutex> guard(lock);
+        if (!frame || txt != text || w != width || h != height || id != format || f != full) {
+            if (frame)
+                vsapi->freeFrame(frame);
+            frame = render_overlay(txt, alignment, scale, atlases, src, core, vsapi);
+            text = txt;
+            width = w;
+            height = h;
+            format = id;
+            full = f;
+        }
+        return vsapi->addFrameRef(frame);
+    }
+
+    void clear(const VSAPI *vsapi) {
+        if (frame)
+            vsapi->freeFrame(frame);
+        frame = nullptr;
+    }
+};
+
+} // namespace
+
 
 namespace {
 
+// Properties with a dedicated presentation, resolved once by name.
+enum class PropKind { Generic, Enum, PictType };
+
 struct PropAccess {
     std::string id;
     std::string name;
     int index;
-    PropAccess(const std::string &id, int index, const std::string &name): id(id), name(name), index(index) {}
+    PropKind kind = PropKind::Generic;
+    std::string (*toString)(int) = nullptr; // for PropKind::Enum
+    PropAccess(const std::string &id, int index, const std::string &name): id(id), name(name), index(index) {
+        static const std::pair<const char *, std::string (*)(int)> enums[] = {
+            { "_Matrix", matrixToString },
+            { "_Primaries", primariesToString },
+            { "_Transfer", transferToString },
+            { "_ColorRange", rangeToString },
+            { "_ChromaLocation", chromaLocationToString },
+            { "_FieldBased", fieldBasedToString },
+        };
+        for (const auto &e : enums) {
+            if (name == e.first) {
+                kind = PropKind::Enum;
+                toString = e.second;
+            }
+        }
+        if (name == "_PictType")
+            kind = PropKind::PictType;
+    }
 };
 
-typedef struct {
+// The format string split at its replacement fields, so that a frame only
+// formats each field on its own instead of reparsing the whole string.
+struct FormatProgram {
+    struct Field {
+        int pa; // index into TextData::pa, or -1 for the builtin N
+        std::string format; // "{:spec}"
+    };
+    bool compiled = false; // otherwise the whole string goes through vformat_to
+    std::vector<std::string> literals; // fields.size() + 1 chunks around the fields
+    std::vector<Field> fields;
+};
+
+struct TextData {
     std::vector<VSNode *> nodes;
     const VSVideoInfo *vi;
 
     std::string text;
     std::vector<PropAccess> pa;
+    FormatProgram program;
     std::string propName;
     int alignment;
     int scale;
     bool vspipe;
     bool strict;
-} TextData;
+    bool overlay;
+    VSVideoInfo overlayVi; // the clip's, without dimensions
+    OverlayCache overlays;
+    GlyphAtlasCache atlases;
+    std::unique_ptr<SidecarWriter> sidecar;
+    ScopedFilterStats perf{ "Text" };
+};
 
 struct CustomValue {
     int val;
@@ -376,6 +604,34 @@ template <> struct formatter<MissingValue>: public formatter<int>, formatter<str
 FMT_END_NAMESPACE
 
 using dynamic_format_arg_store = fmt::dynamic_format_arg_store<fmt::format_context>;
+// The formatted text of a frame.
+using TextBuffer = fmt::basic_memory_buffer<char, fmt::inline_buffer_size, ScratchAllocator<char>>;
+
+// Returns the named argument ids referenced by f (including those nested in
+// format specs), in order of first appearance, using the same name rules as
+// the bundled fmt.
+static std::vector<std::string> scanFormatIds(const std::string &f) {
+    auto isNameStart = [](char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_'; };
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < f.size(); i++) {
+        if (f[i] != '{')
+            continue;
+        if (i + 1 < f.size() && f[i + 1] == '{') {
+            i++;
+            continue;
+        }
+        size_t end = i + 1;
+        if (end == f.size() || !isNameStart(f[end]))
+            continue;
+        while (end < f.size() && (isNameStart(f[end]) || ('0' <= f[end] && f[end] <= '9') || f[end] == '.'))
+            end++;
+        std::string id = f.substr(i + 1, end - i - 1);
+        if (id != "N" && std::find(ids.begin(), ids.end(), id) == ids.end())
+            ids.push_back(std::move(id));
+        i = end - 1;
+    }
+    return ids;
+}
 
 std::vector<PropAccess> checkFormatString(const std::string f) {
     struct bitbucket {
@@ -398,20 +654,26 @@ std::vector<PropAccess> checkFormatString(const std::string f) {
         return idx;
     };
     std::smatch match;
+    auto addId = [&](const std::string &id) {
+        store.push_back(fmt::arg(id.c_str(), CustomValue(1.0, matrixToString)));
+        if (std::regex_match(id, match, framePropRe)) {
+            auto clip = match[1].str(), name = match[2].str();
+            int clipi = extractClipId(clip);
+            pa.emplace_back(id, clipi, name);
+        } else {
+            pa.emplace_back(id, 0, id);
+        }
+    };
+    // All ids are found in one scan, so the validation below normally parses
+    // f only once; missing_arg remains as a fallback for anything it missed.
+    for (const auto &id : scanFormatIds(f))
+        addId(id);
     while (1) {
         bitbucket null;
         try {
             vformat_to(std::back_inserter(null), f, store);
         } catch (fmt::missing_arg &e) {
-            std::string id = e.what();
-            store.push_back(fmt::arg(id.c_str(), CustomValue(1.0, matrixToString)));
-            if (std::regex_match(id, match, framePropRe)) {
-                auto clip = match[1].str(), name = match[2].str();
-                int clipi = extractClipId(clip);
-                pa.emplace_back(id, clipi, name);
-            } else {
-                pa.emplace_back(id, 0, id);
-            }
+            addId(e.what());
             continue;
         } catch (fmt::format_error &e) {
             throw e;
@@ -431,72 +693,146 @@ public:
     const T *end() const { return ptr + n; }
 };
 
-static void pushArg(const PropAccess &pa, dynamic_format_arg_store &store, const std::vector<const VSMap *> &maps, const VSAPI *vsapi) {
-    const VSMap *map = maps[pa.index];
-    int err;
-#define CHECK_ARG(pname, pfunc) do { \
-    if (pa.name == pname) { \
-        int val = vsh::int64ToIntS(vsapi->mapGetInt(map, pname, 0, &err)); \
-        if (err) val = -1; \
-        store.push_back(fmt::arg(pa.id.c_str(), CustomValue(val, pfunc))); \
-        return; \
-    } \
-    } while (0)
-
-    CHECK_ARG("_Matrix", matrixToString);
-    CHECK_ARG("_Primaries", primariesToString);
-    CHECK_ARG("_Transfer", transferToString);
-    CHECK_ARG("_ColorRange", rangeToString);
-    CHECK_ARG("_ChromaLocation", chromaLocationToString);
-    CHECK_ARG("_FieldBased", fieldBasedToString);
-#undef CHECK_ARG
-
-    if (pa.name == "_PictType") {
-        const char *picttype = vsapi->mapGetData(map, "_PictType", 0, &err);
-        store.push_back(fmt::arg(pa.id.c_str(), picttype ? picttype : "Unknown"));
+// Reads the property of pa from props and passes it to f as the type it is formatted as.
+template<typename F>
+static void visitArg(const PropAccess &pa, const PropSnapshot &props, F &&f) {
+    if (pa.kind == PropKind::Enum) {
+        const PropValue *p = props.find(pa.name);
+        int val = p && p->type == ptInt && p->count > 0 ? vsh::int64ToIntS(p->ints[0]) : -1;
+        CustomValue v(val, pa.toString);
+        f(v);
         return;
     }
 
-    const char *key = pa.name.c_str();
-    auto type = vsapi->mapGetType(map, key);
+    if (pa.kind == PropKind::PictType) {
+        const PropValue *p = props.find("_PictType");
+        const char *v = p && p->type == ptData && p->count > 0 ? p->data[0].c_str() : "Unknown";
+        f(v);
+        return;
+    }
+
+    const PropValue *p = props.find(pa.name);
+    auto type = p ? p->type : ptUnset;
     switch (type) {
     case ptInt: {
-        int n = vsapi->mapNumElements(map, key);
-        if (n == 1)
-            store.push_back(fmt::arg(pa.id.c_str(), vsapi->mapGetInt(map, key, 0, nullptr)));
-        else
-            store.push_back(fmt::arg(pa.id.c_str(), vector_view<int64_t>(vsapi->mapGetIntArray(map, key, nullptr), n)));
+        if (p->count == 1) {
+            int64_t v = p->ints[0];
+            f(v);
+        } else {
+            vector_view<int64_t> v(p->ints.data(), p->count);
+            f(v);
+        }
         break;
     }
     case ptFloat: {
-        int n = vsapi->mapNumElements(map, key);
-        if (n == 1)
-            store.push_back(fmt::arg(pa.id.c_str(), vsapi->mapGetFloat(map, key, 0, nullptr)));
-        else
-            store.push_back(fmt::arg(pa.id.c_str(), vector_view<double>(vsapi->mapGetFloatArray(map, key, nullptr), n)));
+        if (p->count == 1) {
+            double v = p->floats[0];
+            f(v);
+        } else {
+            vector_view<double> v(p->floats.data(), p->count);
+            f(v);
+        }
         break;
     }
-    case ptData:
-        store.push_back(fmt::arg(pa.id.c_str(), vsapi->mapGetData(map, key, 0, nullptr)));
+    case ptData: {
+        const char *v = p->count > 0 ? p->data[0].c_str() : "";
+        f(v);
         break;
-    case ptUnset:
-        store.push_back(fmt::arg(pa.id.c_str(), MissingValue("<missing key>")));
+    }
+    case ptUnset: {
+        MissingValue v("<missing key>");
+        f(v);
         break;
-    case ptVideoNode:
-        store.push_back(fmt::arg(pa.id.c_str(), MissingValue("<node")));
+    }
+    case ptVideoNode: {
+        MissingValue v("<node");
+        f(v);
         break;
-    case ptVideoFrame:
-        store.push_back(fmt::arg(pa.id.c_str(), MissingValue("<frame>")));
+    }
+    case ptVideoFrame: {
+        MissingValue v("<frame>");
+        f(v);
         break;
-    case ptFunction:
-        store.push_back(fmt::arg(pa.id.c_str(), MissingValue("<func>")));
+    }
+    case ptFunction: {
+        MissingValue v("<func>");
+        f(v);
         break;
+    }
     default:
-        throw std::runtime_error(fmt::format("propGetType({}) returned {}, should not happen", key, type));
+        throw std::runtime_error(fmt::format("propGetType({}) returned {}, should not happen", pa.name, type));
         break;
     }
 }
 
+static void pushArg(const PropAccess &pa, dynamic_format_arg_store &store, PropSnapshots &props) {
+    visitArg(pa, props[pa.index], [&](const auto &v) { store.push_back(fmt::arg(pa.id.c_str(), v)); });
+}
+
+// Splits f into literal chunks and named fields. Strings using automatic or
+// positional indexing or nested replacement fields (e.g. a dynamic width)
+// are left uncompiled and keep going through vformat_to.
+static FormatProgram compileFormatString(const std::string &f, const std::vector<PropAccess> &pa) {
+    FormatProgram prog;
+    std::string literal;
+    size_t i = 0;
+    while (i < f.size()) {
+        if (f[i] == '{' && i + 1 < f.size() && f[i + 1] == '{') {
+            literal += '{';
+            i += 2;
+        } else if (f[i] == '}' && i + 1 < f.size() && f[i + 1] == '}') {
+            literal += '}';
+            i += 2;
+        } else if (f[i] == '{') {
+            size_t end = f.find_first_of(":}", i + 1);
+            if (end == std::string::npos)
+                return FormatProgram();
+            std::string id = f.substr(i + 1, end - i - 1);
+            std::string spec;
+            if (f[end] == ':') {
+                size_t specEnd = f.find_first_of("{}", end + 1);
+                if (specEnd == std::string::npos || f[specEnd] == '{')
+                    return FormatProgram();
+                spec = f.substr(end + 1, specEnd - end - 1);
+                end = specEnd;
+            }
+
+            FormatProgram::Field field { -1, "{:" + spec + "}" };
+            if (id != "N") {
+                auto it = std::find_if(pa.begin(), pa.end(), [&](const PropAccess &p) { return p.id == id; });
+                if (it == pa.end())
+                    return FormatProgram();
+                field.pa = static_cast<int>(it - pa.begin());
+            }
+            prog.literals.push_back(std::move(literal));
+            literal.clear();
+            prog.fields.push_back(std::move(field));
+            i = end + 1;
+        } else {
+            literal += f[i++];
+        }
+    }
+    prog.literals.push_back(std::move(literal));
+    prog.compiled = true;
+    return prog;
+}
+
+// Formats every field of a compiled program with the properties of frame n.
+static void runFormatProgram(const FormatProgram &prog, const std::vector<PropAccess> &pas, int n, PropSnapshots &props, TextBuffer &out) {
+    auto it = std::back_inserter(out);
+    for (size_t i = 0; i < prog.fields.size(); i++) {
+        out.append(prog.literals[i]);
+        const auto &field = prog.fields[i];
+        if (field.pa < 0) {
+            fmt::vformat_to(it, field.format, fmt::make_format_args(n));
+            continue;
+        }
+        const PropAccess &pa = pas[field.pa];
+        visitArg(pa, props[pa.index], [&](const auto &v) { fmt::vformat_to(it, field.format, fmt::make_format_args(v)); });
+    }
+    out.append(prog.literals.back());
+}
+
 bool isVspipe() {
     static bool vspipe = []() -> bool {
 #ifdef _WIN32
@@ -530,9 +866,9 @@ static const VSFrame *VS_CC textGetFrame(int n, int activationReason, void *inst
         for (auto node: d->nodes)
             vsapi->requestFrameFilter(n, node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
-        std::vector<const VSFrame *> srcs;
+        ScratchVector<const VSFrame *> srcs;
         const VSFrame *src = nullptr;
-        auto out = fmt::memory_buffer();
+        TextBuffer out;
         try {
             for (auto node: d->nodes) {
                 auto f = vsapi->getFrameFilter(n, node, frameCtx);
@@ -545,20 +881,20 @@ static const VSFrame *VS_CC textGetFrame(int n, int activationReason, void *inst
             }
 
             src = srcs[0];
-            std::vector<const VSMap *> maps(srcs.size(), nullptr);
+            PropSnapshots props(frameKeys(d->nodes, n), srcs.data(), vsapi);
 
-            dynamic_format_arg_store store;
-            store.push_back(fmt::arg("N", n)); // builtin
+            try {
+                if (d->program.compiled) {
+                    runFormatProgram(d->program, d->pa, n, props, out);
+                } else {
+                    dynamic_format_arg_store store;
+                    store.push_back(fmt::arg("N", n)); // builtin
 
-            for (const auto &pa: d->pa) {
-                int index = pa.index;
-                if (maps[index] == nullptr)
-                    maps[index] = vsapi->getFramePropertiesRO(srcs[index]);
-                pushArg(pa, store, maps, vsapi);
-            }
+                    for (const auto &pa: d->pa)
+                        pushArg(pa, store, props);
 
-            try {
-                vformat_to(std::back_inserter(out), d->text, store);
+                    vformat_to(std::back_inserter(out), d->text, store);
+                }
             } catch (fmt::format_error &e) {
                 if (d->strict) throw;
                 fmt::format_to(std::back_inserter(out), "{{format error: {}}}", e.what());
@@ -580,9 +916,22 @@ static const VSFrame *VS_CC textGetFrame(int n, int activationReason, void *inst
             return nullptr;
         }
 
+        // copyFrame only references the planes of src: the property-only path never
+        // duplicates them, and drawing copies just the planes it writes to.
+        if (d->sidecar)
+            d->sidecar->write(n, { std::string_view(out.data(), out.size()) });
+
+        if (d->overlay) {
+            const VSFrame *overlay = d->overlays.get(std::string(out.data(), out.size()), d->alignment, d->scale, d->atlases, src, core, vsapi);
+            for (auto f: srcs)
+                vsapi->freeFrame(f);
+            return overlay;
+        }
+
         VSFrame *dst = vsapi->copyFrame(src, core);
         if (d->propName.size() == 0 && (d->vspipe || !isVspipe())) {
-            scrawl_text(std::string(out.data(), out.size()), d->alignment, d->scale, dst, vsapi);
+            scrawl_text(std::string(out.data(), out.size()), d->alignment, d->scale, d->atlases, dst, vsapi);
+            filterStatsBytes(d->perf, filterStatsFrameSize(dst, vsapi));
         } else {
             VSMap *map = vsapi->getFramePropertiesRW(dst);
             vsapi->mapSetData(map, d->propName.c_str(), out.data(), out.size(), dtUtf8, maReplace);
@@ -600,8 +949,10 @@ static const VSFrame *VS_CC textGetFrame(int n, int activationReason, void *inst
 
 static void VS_CC textFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     TextData *d = static_cast<TextData *>(instanceData);
+    propSnapshotRelease(d->nodes);
     for (auto p: d->nodes)
         vsapi->freeNode(p);
+    d->overlays.clear(vsapi);
     delete d;
 }
 
@@ -638,6 +989,7 @@ static void VS_CC textCreate(const VSMap *in, VSMap *out, void *userData, VSCore
 
         d->text = vsapi->mapGetData(in, "text", 0, nullptr);
         d->pa = checkFormatString(d->text);
+        d->program = compileFormatString(d->text, d->pa);
 
         for (const auto &pa: d->pa) {
             if (pa.index < 0 || pa.index >= d->nodes.size())
@@ -649,6 +1001,29 @@ static void VS_CC textCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             d->propName = propName;
         d->vspipe = vsapi->mapGetInt(in, "vspipe", 0, &err);
         d->strict = vsapi->mapGetInt(in, "strict", 0, &err);
+        d->overlay = vsapi->mapGetInt(in, "overlay", 0, &err);
+        if (d->overlay && !d->propName.empty())
+            throw std::runtime_error("Text: overlay and prop are mutually exclusive");
+        d->overlayVi = *d->vi;
+        d->overlayVi.width = 0;
+        d->overlayVi.height = 0;
+
+        const char *sidecar = vsapi->mapGetData(in, "sidecar", 0, &err);
+        if (sidecar) {
+            const char *format = vsapi->mapGetData(in, "sidecar_format", 0, &err);
+            std::string column = d->propName.empty() ? "text" : d->propName;
+            try {
+                d->sidecar = std::make_unique<SidecarWriter>(sidecar, SidecarWriter::parseFormat(format ? format : "jsonl"), std::vector<std::string>{ column }, vsapi, core);
+            } catch (std::runtime_error &e) {
+                throw std::runtime_error(std::string("Text: ") + e.what());
+            }
+        }
+
+        if (vsh::isConstantVideoFormat(d->vi) && d->scale > 0) {
+            d->atlases.get(d->vi->format, true, d->scale);
+            if (d->vi->format.colorFamily != cfRGB)
+                d->atlases.get(d->vi->format, false, d->scale);
+        }
     } catch (std::runtime_error &e) {
         for (auto p: d->nodes)
             vsapi->freeNode(p);
@@ -665,8 +1040,8 @@ static void VS_CC textCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         [&](auto *node) { return VSFilterDependency{node, rpStrictSpatial}; }
     );
 
-    const VSVideoInfo *vi = d->vi;
-    vsapi->createVideoFilter(out, "Text", vi, textGetFrame, textFree, fmParallel, deps.data(), deps.size(), d.release(), core);
+    const VSVideoInfo *vi = d->overlay ? &d->overlayVi : d->vi;
+    vsapi->createVideoFilter(out, "Text", vi, timedGetFrame<TextData, textGetFrame>, textFree, fmParallel, deps.data(), deps.size(), d.release(), core);
 }
 
 static void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi)
@@ -689,7 +1064,10 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "scale:int:opt;"
         "prop:data:opt;"
         "strict:int:opt;"
-        "vspipe:int:opt;",
+        "vspipe:int:opt;"
+        "overlay:int:opt;"
+        "sidecar:data:opt;"
+        "sidecar_format:data:opt;",
         "clip:vnode;",
         textCreate,
         nullptr,
@@ -4,6 +4,9 @@
 #include <functional>
 #include <iterator>
 #include <map>
+#include <numeric>
+#include <ostream>
+#include <streambuf>
 #include <regex>
 #include <string>
 #include <vector>
@@ -12,34 +15,110 @@
 #include <VSHelper4.h>
 
 #include "inja/inja.hpp"
+#include "sidecar.h"
 
+#include "../filterstats.h"
 #include "../plugin.h"
+#include "../propsnapshot.h"
+#include "../scratch.h"
 
 static const std::string clipNamePrefix { "src" };
 
 static std::vector<std::string> features = {
     "x.property", "{{N}}",
     clipNamePrefix + "0", clipNamePrefix + "26",
+    "sum",
 };
 
 namespace {
 
 using json = nlohmann::json;
-typedef std::function<bool (const json::json_pointer &)> contains_type;
-typedef std::function<const json &(const json::json_pointer &)> get_type;
-class data_provider: public inja::json_like {
-    const contains_type fcontains;
-    const get_type fget;
 
-public:
-    data_provider(const contains_type &c, const get_type &g): fcontains(c), fget(g) {}
-    virtual ~data_provider() {}
+// How a JSON pointer maps to the frames, resolved once at create time.
+struct Binding {
+    enum Kind { Null, Builtin, Prop } kind = Null;
+    int clip = 0;
+    std::string name;
+    int index = -1; // element index, or -1 for the whole property (summed if an array)
+    std::string error; // thrown when the pointer is evaluated
+    std::string indexError; // thrown when the pointer is evaluated on an array property
+};
+
+static Binding resolveBinding(const json::json_pointer &ptr, size_t numClips) {
+    static const json::json_pointer builtinN("/N");
+    Binding b;
+    if (ptr == builtinN) {
+        b.kind = Binding::Builtin;
+        return b;
+    }
+
+    auto &tokens = ptr.reference_tokens;
+    if (tokens.size() < 2) return b;
+    b.kind = Binding::Prop;
+    const std::string &clip = tokens[0];
+    b.name = tokens[1];
+    if (clip.size() == 1) {
+        b.clip = clip[0] >= 'x' ? clip[0] - 'x' : clip[0] - 'a' + 3;
+    } else {
+        try {
+            b.clip = std::stoi(clip.substr(clipNamePrefix.size()));
+        } catch (...) {
+            b.error = "invalid clip name: " + clip;
+            return b;
+        }
+    }
+    if (b.clip < 0 || static_cast<size_t>(b.clip) >= numClips)
+        b.error = ptr.to_string() + " clip out of range";
+    if (tokens.size() >= 3) {
+        try {
+            b.index = std::stoi(tokens[2]);
+        } catch (...) {
+            b.indexError = "invalid array index: " + tokens[2];
+        }
+    }
+    return b;
+}
+
+// Collects the data pointers a template can reference directly.
+class PointerCollector : public inja::NodeVisitor {
+    void visit(const inja::BlockNode &node) {
+        for (auto &n : node.nodes)
+            n->accept(*this);
+    }
+    void visit(const inja::TextNode &) {}
+    void visit(const inja::ExpressionNode &) {}
+    void visit(const inja::LiteralNode &) {}
+    void visit(const inja::DataNode &node) { ptrs.push_back(node.ptr); }
+    void visit(const inja::FunctionNode &node) {
+        for (auto &n : node.arguments)
+            n->accept(*this);
+    }
+    void visit(const inja::ExpressionListNode &node) { node.root->accept(*this); }
+    void visit(const inja::StatementNode &) {}
+    void visit(const inja::ForStatementNode &) {}
+    void visit(const inja::ForArrayStatementNode &node) {
+        node.condition.accept(*this);
+        node.body.accept(*this);
+    }
+    void visit(const inja::ForObjectStatementNode &node) {
+        node.condition.accept(*this);
+        node.body.accept(*this);
+    }
+    void visit(const inja::IfStatementNode &node) {
+        node.condition.accept(*this);
+        node.true_statement.accept(*this);
+        node.false_statement.accept(*this);
+    }
+    void visit(const inja::IncludeStatementNode &) {}
+    void visit(const inja::ExtendsStatementNode &) {}
+    void visit(const inja::BlockStatementNode &node) { node.block.accept(*this); }
+    void visit(const inja::SetStatementNode &node) { node.expression.accept(*this); }
 
-    virtual bool contains(const json::json_pointer &ptr) const override { return fcontains(ptr); }
-    virtual const json &operator[](const json::json_pointer &ptr) const override { return fget(ptr); }
+public:
+    std::vector<json::json_pointer> ptrs;
 };
 
-typedef struct {
+struct TmplData {
     std::vector<VSNode *> nodes;
     const VSVideoInfo *vi;
 
@@ -48,7 +127,178 @@ typedef struct {
 
     inja::Environment env;
     std::vector<inja::Template> tmpl;
-} TmplData;
+
+    std::vector<Binding> bindings; // of the pointers found in tmpl
+    std::map<json::json_pointer, size_t> bindingIndex;
+
+    std::unique_ptr<SidecarWriter> sidecar;
+    ScopedFilterStats perf{ "Tmpl" };
+};
+
+// Evaluates the bound pointers on demand, at most once per frame. Pointers
+// computed at render time (e.g. by included templates) are resolved on the fly.
+class frame_provider: public inja::json_like {
+    const TmplData *d;
+    int n;
+    const ScratchVector<const VSFrame *> &srcs;
+    const VSAPI *vsapi;
+    mutable PropSnapshots props;
+    mutable ScratchVector<json> values;
+    mutable ScratchVector<bool> ready;
+    mutable ScratchMap<json::json_pointer, json> dynamic;
+
+    json evaluate(const Binding &b) const {
+        if (b.kind == Binding::Builtin) return n;
+        if (b.kind == Binding::Null) return nullptr;
+        if (!b.error.empty()) throw std::runtime_error(b.error);
+
+        const PropValue *p = props[b.clip].find(b.name);
+
+        json val = nullptr;
+        int type = p ? p->type : ptUnset;
+        int numElements = p ? p->count : 0;
+        auto index = [&]() -> int {
+            if (!b.indexError.empty()) throw std::runtime_error(b.indexError);
+            return b.index < 0 ? 0 : b.index;
+        };
+        const bool whole = b.index < 0 && b.indexError.empty();
+        if (whole && numElements > 1 && (type == ptInt || type == ptFloat || type == ptData)) {
+            // Converted in one go rather than appended element by element.
+            if (type == ptInt)
+                val = p->ints;
+            else if (type == ptFloat)
+                val = p->floats;
+            else
+                val = p->data;
+        } else if (type == ptInt) {
+            int idx = index();
+            if (idx < numElements)
+                val = p->ints[idx];
+        } else if (type == ptFloat) {
+            int idx = index();
+            if (idx < numElements)
+                val = p->floats[idx];
+        } else if (type == ptData) {
+            int idx = index();
+            if (idx < numElements)
+                val = p->data[idx];
+        } else if (type == ptVideoFrame || type == ptVideoNode || type == ptFunction) {
+            std::string text = std::to_string(numElements) + (type == ptVideoFrame ? " frame" : type == ptVideoNode ? " node" : " function");
+            if (numElements != 1)
+                text += 's';
+            val = text;
+        }
+        return val;
+    }
+
+    const json &get(const json::json_pointer &ptr) const {
+        auto it = d->bindingIndex.find(ptr);
+        if (it != d->bindingIndex.end()) {
+            size_t i = it->second;
+            if (!ready[i]) {
+                values[i] = evaluate(d->bindings[i]);
+                ready[i] = true;
+            }
+            return values[i];
+        }
+        auto dit = dynamic.find(ptr);
+        if (dit == dynamic.end())
+            dit = dynamic.emplace(ptr, evaluate(resolveBinding(ptr, srcs.size()))).first;
+        return dit->second;
+    }
+
+public:
+    frame_provider(const TmplData *d, int n, const ScratchVector<const VSFrame *> &srcs, const VSAPI *vsapi):
+        d(d), n(n), srcs(srcs), vsapi(vsapi), props(frameKeys(d->nodes, n), srcs.data(), vsapi), values(d->bindings.size()), ready(d->bindings.size(), false) {}
+    virtual ~frame_provider() {}
+
+    virtual bool contains(const json::json_pointer &ptr) const override { return get(ptr) != nullptr; }
+    virtual const json &operator[](const json::json_pointer &ptr) const override { return get(ptr); }
+
+    // Aggregates of array properties straight from the snapshot, e.g. for
+    // length(x.Hist) or sum(x.Hist), so that large arrays read that way are
+    // never converted to json.
+    virtual bool reduce(const json::json_pointer &ptr, inja::FunctionStorage::Operation op, const json *arg, json &result) const override {
+        using Op = inja::FunctionStorage::Operation;
+        auto it = d->bindingIndex.find(ptr);
+        const Binding b = it != d->bindingIndex.end() ? d->bindings[it->second] : resolveBinding(ptr, srcs.size());
+        if (b.kind != Binding::Prop || !b.error.empty() || b.index >= 0 || !b.indexError.empty())
+            return false;
+        const PropValue *p = props[b.clip].find(b.name);
+        if (!p || p->count < 2)
+            return false; // not an array, see evaluate()
+
+        auto apply = [&](const auto &arr) -> bool {
+            switch (op) {
+            case Op::Length:
+                result = arr.size();
+                return true;
+            case Op::Max:
+                result = *std::max_element(arr.begin(), arr.end());
+                return true;
+            case Op::Min:
+                result = *std::min_element(arr.begin(), arr.end());
+                return true;
+            case Op::Join: {
+                const auto separator = arg->get<json::string_t>();
+                std::string s;
+                for (size_t i = 0; i < arr.size(); i++) {
+                    if (i)
+                        s += separator;
+                    if constexpr (std::is_same_v<std::decay_t<decltype(arr[i])>, std::string>)
+                        s += arr[i];
+                    else
+                        s += json(arr[i]).dump();
+                }
+                result = std::move(s);
+                return true;
+            }
+            default:
+                return false;
+            }
+        };
+        if (p->type == ptInt) {
+            if (op == Op::Sum) {
+                result = std::accumulate(p->ints.begin(), p->ints.end(), json::number_integer_t(0));
+                return true;
+            }
+            return apply(p->ints);
+        }
+        if (p->type == ptFloat) {
+            if (op == Op::Sum) {
+                result = std::accumulate(p->floats.begin(), p->floats.end(), json::number_float_t(0));
+                return true;
+            }
+            return apply(p->floats);
+        }
+        if (p->type == ptData && op != Op::Sum)
+            return apply(p->data);
+        return false;
+    }
+};
+
+// Appends everything written to the stream to a string, so that a render
+// reuses the capacity of its destination.
+class string_appender: public std::streambuf {
+    std::string *s = nullptr;
+
+protected:
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof())
+            s->push_back(traits_type::to_char_type(c));
+        return c;
+    }
+    std::streamsize xsputn(const char *p, std::streamsize count) override {
+        s->append(p, static_cast<size_t>(count));
+        return count;
+    }
+
+public:
+    void reset(std::string *dst) {
+        s = dst;
+        s->clear();
+    }
+};
 
 static const VSFrame *VS_CC tmplGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     TmplData *d = static_cast<TmplData *>(instanceData);
@@ -57,9 +307,14 @@ static const VSFrame *VS_CC tmplGetFrame(int n, int activationReason, void *inst
         for (auto node: d->nodes)
             vsapi->requestFrameFilter(n, node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
-        std::vector<const VSFrame *> srcs;
+        ScratchVector<const VSFrame *> srcs;
         const VSFrame *src = nullptr;
-        std::vector<std::string> out(d->tmpl.size());
+        // Rendered texts, kept per thread so their buffers are reused across frames.
+        thread_local std::vector<std::string> out;
+        thread_local string_appender buf;
+        thread_local std::ostream os(&buf);
+        if (out.size() < d->tmpl.size())
+            out.resize(d->tmpl.size());
         try {
             for (auto node: d->nodes) {
                 auto f = vsapi->getFrameFilter(n, node, frameCtx);
@@ -67,127 +322,13 @@ static const VSFrame *VS_CC tmplGetFrame(int n, int activationReason, void *inst
             }
 
             src = srcs[0];
-            std::vector<const VSMap *> maps(srcs.size(), nullptr);
-
-            auto extractClipId = [](const std::string &name) -> int {
-                if (name.size() == 1)
-                    return name[0] >= 'x' ? name[0] - 'x' : name[0] - 'a' + 3;
-                int idx = -1;
-                try {
-                    idx = std::stoi(name.substr(clipNamePrefix.size()));
-                } catch (...) {
-                    throw std::runtime_error("invalid clip name: " + name);
-                }
-                return idx;
-            };
-            auto extractIndex = [](const std::string &str) -> int {
-                int idx = -1;
-                try {
-                    idx = std::stoi(str);
-                } catch (...) {
-                    throw std::runtime_error("invalid array index: " + str);
-                }
-                return idx;
-            };
-
-            static const std::map<json::json_pointer, std::function<json(int, const std::vector<VSNode *> &, const VSAPI *)>> builtins = {
-                { json::json_pointer("/N"), [](int n, const std::vector<VSNode *> &ns, const VSAPI *) -> json { return n; } },
-            };
-
-            std::map<json::json_pointer, json> cache;
-            cache.emplace(json::json_pointer(""), nullptr);
-            auto fget = [&](const json::json_pointer &ptr) -> const json& {
-                auto it = cache.find(ptr);
-                if (it != cache.end()) return it->second;
-
-                json val = nullptr;
-                {
-                    auto it = builtins.find(ptr);
-                    if (it != builtins.end()) {
-                        val = it->second(n, d->nodes, vsapi);
-                        return cache[ptr] = val;
-                    }
-                }
+            frame_provider prov(d, n, srcs, vsapi);
 
-                auto &tokens = ptr.reference_tokens;
-                if (tokens.size() < 2) return cache[json::json_pointer("")];
-                auto clip = tokens[0], pname = tokens[1];
-                int index = extractClipId(clip);
-                if (index >= maps.size())
-                    throw std::runtime_error(ptr.to_string() + " clip out of range");
-                if (maps[index] == nullptr)
-                    maps[index] = vsapi->getFramePropertiesRO(srcs[index]);
-                const VSMap *map = maps[index];
-
-                char type = vsapi->mapGetType(map, pname.c_str());
-                int numElements = vsapi->mapNumElements(map, pname.c_str());
-                if (type == ptInt) {
-                    const int64_t *intArr = vsapi->mapGetIntArray(map, pname.c_str(), nullptr);
-                    if (tokens.size() == 2 && numElements > 1) {
-                        for (int i = 0; i < numElements; i++)
-                            val += intArr[i];
-                    } else {
-                        int idx = tokens.size() < 3 ? 0 : extractIndex(tokens[2]);
-                        if (idx < numElements)
-                            val = intArr[idx];
-                    }
-                } else if (type == ptFloat) {
-                    const double *floatArr = vsapi->mapGetFloatArray(map, pname.c_str(), nullptr);
-                    if (tokens.size() == 2 && numElements > 1) {
-                        for (int i = 0; i < numElements; i++)
-                            val += floatArr[i];
-                    } else {
-                        int idx = tokens.size() < 3 ? 0 : extractIndex(tokens[2]);
-                        if (idx < numElements)
-                            val = floatArr[idx];
-                    }
-                } else if (type == ptData) {
-                    if (tokens.size() == 2 && numElements > 1) {
-                        for (int idx = 0; idx < numElements; idx++) {
-                            const char *value = vsapi->mapGetData(map, pname.c_str(), idx, nullptr);
-                            int size = vsapi->mapGetDataSize(map, pname.c_str(), idx, nullptr);
-                            val += std::string(value, size);
-                        }
-                    } else {
-                        int idx = tokens.size() < 3 ? 0 : extractIndex(tokens[2]);
-                        if (idx < numElements) {
-                            const char *value = vsapi->mapGetData(map, pname.c_str(), idx, nullptr);
-                            int size = vsapi->mapGetDataSize(map, pname.c_str(), idx, nullptr);
-                            val = std::string(value, size);
-                        }
-                    }
-                } else if (type == ptVideoFrame) {
-                    std::string text = std::to_string(numElements) + " frame";
-                    if (numElements != 1)
-                        text += 's';
-                    val = text;
-                } else if (type == ptVideoNode) {
-                    std::string text = std::to_string(numElements) + " node";
-                    if (numElements != 1)
-                        text += 's';
-                    val = text;
-                } else if (type == ptFunction) {
-                    std::string text = std::to_string(numElements) + " function";
-                    if (numElements != 1)
-                        text += 's';
-                    val = text;
-                } else if (type == ptUnset) {
-                    return cache[json::json_pointer("")];
-                }
-                return cache[ptr] = val;
-            };
-
-            data_provider prov(
-                [&](const json::json_pointer &ptr) -> bool {
-                    auto &x = fget(ptr);
-                    return x != nullptr;
-                },
-                fget
-            );
-
-            for (int i = 0; i < d->tmpl.size(); i++) {
+            for (size_t i = 0; i < d->tmpl.size(); i++) {
                 try {
-                    out[i] = d->env.render(d->tmpl[i], prov);
+                    buf.reset(&out[i]);
+                    os.clear();
+                    d->env.render_to(os, d->tmpl[i], prov);
                 } catch (inja::InjaError &e) {
                     inja::InjaError e2(e.type, std::string("[prop ") + d->propName[i] + "] " + e.message, e.location);
                     /*if (d->strict)*/ throw e2;
@@ -201,10 +342,15 @@ static const VSFrame *VS_CC tmplGetFrame(int n, int activationReason, void *inst
             return nullptr;
         }
 
-        VSFrame *dst = vsapi->copyFrame(src, core);
+        // Only properties are set, so the planes of src are referenced as is.
+        const VSFrame *planeSrc[3] = { src, src, src };
+        const int planes[3] = { 0, 1, 2 };
+        VSFrame *dst = vsapi->newVideoFrame2(vsapi->getVideoFrameFormat(src), vsapi->getFrameWidth(src, 0), vsapi->getFrameHeight(src, 0), planeSrc, planes, src, core);
         VSMap *map = vsapi->getFramePropertiesRW(dst);
-        for (int i = 0; i < out.size(); i++)
+        for (size_t i = 0; i < d->tmpl.size(); i++)
             vsapi->mapSetData(map, d->propName[i].c_str(), out[i].data(), out[i].size(), dtUtf8, maReplace);
+        if (d->sidecar)
+            d->sidecar->write(n, std::vector<std::string_view>(out.begin(), out.begin() + d->tmpl.size()));
 
         for (auto f: srcs)
             vsapi->freeFrame(f);
@@ -218,6 +364,7 @@ static const VSFrame *VS_CC tmplGetFrame(int n, int activationReason, void *inst
 
 static void VS_CC tmplFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     TmplData *d = static_cast<TmplData *>(instanceData);
+    propSnapshotRelease(d->nodes);
     for (auto p: d->nodes)
         vsapi->freeNode(p);
     delete d;
@@ -247,6 +394,21 @@ static void VS_CC tmplCreate(const VSMap *in, VSMap *out, void *userData, VSCore
                 throw e2;
             }
         }
+
+        PointerCollector collector;
+        for (const auto &t : d->tmpl)
+            t.root.accept(collector);
+        for (const auto &ptr : collector.ptrs) {
+            if (d->bindingIndex.emplace(ptr, d->bindings.size()).second)
+                d->bindings.push_back(resolveBinding(ptr, d->nodes.size()));
+        }
+
+        int err;
+        const char *sidecar = vsapi->mapGetData(in, "sidecar", 0, &err);
+        if (sidecar) {
+            const char *format = vsapi->mapGetData(in, "sidecar_format", 0, &err);
+            d->sidecar = std::make_unique<SidecarWriter>(sidecar, SidecarWriter::parseFormat(format ? format : "jsonl"), d->propName, vsapi, core);
+        }
     } catch (std::runtime_error &e) {
         for (auto p: d->nodes)
             vsapi->freeNode(p);
@@ -266,7 +428,7 @@ static void VS_CC tmplCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     );
 
     const VSVideoInfo *vi = d->vi;
-    vsapi->createVideoFilter(out, "Tmpl", vi, tmplGetFrame, tmplFree, fmParallel, deps.data(), deps.size(), d.release(), core);
+    vsapi->createVideoFilter(out, "Tmpl", vi, timedGetFrame<TmplData, tmplGetFrame>, tmplFree, fmParallel, deps.data(), deps.size(), d.release(), core);
 }
 
 static void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi) {
@@ -286,7 +448,9 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
     vsapi->registerFunction("Tmpl",
         "clips:vnode[];"
         "prop:data[];"
-        "text:data[];",
+        "text:data[];"
+        "sidecar:data:opt;"
+        "sidecar_format:data:opt;",
         "clip:vnode",
         tmplCreate, nullptr, plugin);
 }
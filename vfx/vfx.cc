@@ -1,9 +1,17 @@
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <numeric>
 #include <utility>
 #include <string>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 #include <stdio.h>
 #include <assert.h>
@@ -18,6 +26,8 @@ static std::vector<std::string> autoDllErrors;
 #define CUDA_DLL L"nvcuda.dll","nvcuda.dll",autoDllErrors
 #endif
 #include "../ngx/cuda.h"
+#include "../ngx/devframe.h"
+#include "../filterstats.h"
 
 #include "nvvfx/include/nvCVStatus.h"
 #include "nvvfx/include/nvCVImage.h"
@@ -38,28 +48,560 @@ static std::vector<std::string> autoDllErrors;
     } \
 } while (0)
 
-struct VfxData {
-    std::mutex lock;
+// Conversions between planar 8-16 bit YUV and the planar BGR float images of
+// the effect, compiled by the driver on first use. Chroma is upsampled by
+// sample replication and downsampled by averaging each block of pixels.
+static const char yuvKernels[] = R"ptx(
+.version 6.0
+.target sm_50
+.address_size 64
 
-    int num_streams;
+.visible .entry vfx_yuv_to_rgb(
+    .param .u64 p_y, .param .u64 p_u, .param .u64 p_v,
+    .param .u32 p_pitch, .param .u32 p_cpitch,
+    .param .u32 p_w, .param .u32 p_h,
+    .param .u32 p_ssw, .param .u32 p_ssh, .param .u32 p_wide,
+    .param .u64 p_dst, .param .u32 p_dpitch,
+    .param .f32 p_ys, .param .f32 p_yo, .param .f32 p_cs, .param .f32 p_co,
+    .param .f32 p_rv, .param .f32 p_gu, .param .f32 p_gv, .param .f32 p_bu)
+{
+    .reg .pred %p<4>;
+    .reg .b32 %r<20>;
+    .reg .b64 %rd<16>;
+    .reg .f32 %f<16>;
+
+    mov.u32 %r1, %ctaid.x;
+    mov.u32 %r2, %ntid.x;
+    mov.u32 %r3, %tid.x;
+    mad.lo.u32 %r4, %r1, %r2, %r3;
+    mov.u32 %r1, %ctaid.y;
+    mov.u32 %r2, %ntid.y;
+    mov.u32 %r3, %tid.y;
+    mad.lo.u32 %r5, %r1, %r2, %r3;
+    ld.param.u32 %r6, [p_w];
+    ld.param.u32 %r7, [p_h];
+    setp.ge.u32 %p1, %r4, %r6;
+    setp.ge.or.u32 %p1, %r5, %r7, %p1;
+    @%p1 bra Y2R_DONE;
+
+    ld.param.u32 %r8, [p_ssw];
+    ld.param.u32 %r9, [p_ssh];
+    ld.param.u32 %r10, [p_wide];
+    setp.ne.u32 %p2, %r10, 0;
+    shr.u32 %r11, %r4, %r8;
+    shr.u32 %r12, %r5, %r9;
+    shl.b32 %r13, %r4, %r10;
+    shl.b32 %r14, %r11, %r10;
+    ld.param.u32 %r15, [p_pitch];
+    ld.param.u32 %r16, [p_cpitch];
+    mul.wide.u32 %rd1, %r5, %r15;
+    cvt.u64.u32 %rd2, %r13;
+    add.u64 %rd1, %rd1, %rd2;
+    mul.wide.u32 %rd3, %r12, %r16;
+    cvt.u64.u32 %rd4, %r14;
+    add.u64 %rd3, %rd3, %rd4;
+
+    ld.param.u64 %rd5, [p_y];
+    cvta.to.global.u64 %rd5, %rd5;
+    add.u64 %rd5, %rd5, %rd1;
+    ld.param.u64 %rd6, [p_u];
+    cvta.to.global.u64 %rd6, %rd6;
+    add.u64 %rd6, %rd6, %rd3;
+    ld.param.u64 %rd7, [p_v];
+    cvta.to.global.u64 %rd7, %rd7;
+    add.u64 %rd7, %rd7, %rd3;
+    @%p2 ld.global.u16 %r17, [%rd5];
+    @!%p2 ld.global.u8 %r17, [%rd5];
+    @%p2 ld.global.u16 %r18, [%rd6];
+    @!%p2 ld.global.u8 %r18, [%rd6];
+    @%p2 ld.global.u16 %r19, [%rd7];
+    @!%p2 ld.global.u8 %r19, [%rd7];
+
+    cvt.rn.f32.u32 %f1, %r17;
+    cvt.rn.f32.u32 %f2, %r18;
+    cvt.rn.f32.u32 %f3, %r19;
+    ld.param.f32 %f4, [p_ys];
+    ld.param.f32 %f5, [p_yo];
+    ld.param.f32 %f6, [p_cs];
+    ld.param.f32 %f7, [p_co];
+    fma.rn.f32 %f1, %f1, %f4, %f5;
+    fma.rn.f32 %f2, %f2, %f6, %f7;
+    fma.rn.f32 %f3, %f3, %f6, %f7;
+    ld.param.f32 %f8, [p_rv];
+    ld.param.f32 %f9, [p_gu];
+    ld.param.f32 %f10, [p_gv];
+    ld.param.f32 %f11, [p_bu];
+    fma.rn.f32 %f12, %f3, %f8, %f1;
+    fma.rn.f32 %f13, %f3, %f10, %f1;
+    fma.rn.f32 %f13, %f2, %f9, %f13;
+    fma.rn.f32 %f14, %f2, %f11, %f1;
+    cvt.sat.f32.f32 %f12, %f12;
+    cvt.sat.f32.f32 %f13, %f13;
+    cvt.sat.f32.f32 %f14, %f14;
+
+    ld.param.u64 %rd8, [p_dst];
+    cvta.to.global.u64 %rd8, %rd8;
+    ld.param.u32 %r15, [p_dpitch];
+    mul.wide.u32 %rd9, %r5, %r15;
+    mul.wide.u32 %rd10, %r4, 4;
+    add.u64 %rd9, %rd9, %rd10;
+    add.u64 %rd8, %rd8, %rd9;
+    mul.wide.u32 %rd11, %r7, %r15;
+    st.global.f32 [%rd8], %f14;
+    add.u64 %rd8, %rd8, %rd11;
+    st.global.f32 [%rd8], %f13;
+    add.u64 %rd8, %rd8, %rd11;
+    st.global.f32 [%rd8], %f12;
+Y2R_DONE:
+    ret;
+}
+
+.visible .entry vfx_rgb_to_yuv(
+    .param .u64 p_src, .param .u32 p_spitch,
+    .param .u32 p_w, .param .u32 p_h,
+    .param .u32 p_ssw, .param .u32 p_ssh, .param .u32 p_wide,
+    .param .u64 p_y, .param .u64 p_u, .param .u64 p_v,
+    .param .u32 p_pitch, .param .u32 p_cpitch,
+    .param .f32 p_kr, .param .f32 p_kg, .param .f32 p_kb,
+    .param .f32 p_ys, .param .f32 p_yo, .param .f32 p_cs, .param .f32 p_co,
+    .param .f32 p_ub, .param .f32 p_vr, .param .f32 p_max)
+{
+    .reg .pred %p<4>;
+    .reg .b32 %r<32>;
+    .reg .b64 %rd<16>;
+    .reg .f32 %f<24>;
+
+    mov.u32 %r1, %ctaid.x;
+    mov.u32 %r2, %ntid.x;
+    mov.u32 %r3, %tid.x;
+    mad.lo.u32 %r4, %r1, %r2, %r3;
+    mov.u32 %r1, %ctaid.y;
+    mov.u32 %r2, %ntid.y;
+    mov.u32 %r3, %tid.y;
+    mad.lo.u32 %r5, %r1, %r2, %r3;
+    ld.param.u32 %r6, [p_w];
+    ld.param.u32 %r7, [p_h];
+    ld.param.u32 %r8, [p_ssw];
+    ld.param.u32 %r9, [p_ssh];
+    ld.param.u32 %r10, [p_wide];
+    shr.u32 %r11, %r6, %r8;
+    shr.u32 %r12, %r7, %r9;
+    setp.ge.u32 %p1, %r4, %r11;
+    setp.ge.or.u32 %p1, %r5, %r12, %p1;
+    @%p1 bra R2Y_DONE;
+
+    setp.ne.u32 %p2, %r10, 0;
+    mov.u32 %r13, 1;
+    shl.b32 %r13, %r13, %r8;
+    mov.u32 %r14, 1;
+    shl.b32 %r14, %r14, %r9;
+    shl.b32 %r15, %r4, %r8;
+    shl.b32 %r16, %r5, %r9;
+
+    ld.param.u64 %rd1, [p_src];
+    cvta.to.global.u64 %rd1, %rd1;
+    ld.param.u32 %r17, [p_spitch];
+    mul.wide.u32 %rd2, %r7, %r17;
+    ld.param.u64 %rd3, [p_y];
+    cvta.to.global.u64 %rd3, %rd3;
+    ld.param.u32 %r18, [p_pitch];
+    ld.param.f32 %f1, [p_kr];
+    ld.param.f32 %f2, [p_kg];
+    ld.param.f32 %f3, [p_kb];
+    ld.param.f32 %f4, [p_ys];
+    ld.param.f32 %f5, [p_yo];
+    ld.param.f32 %f6, [p_max];
+    mov.f32 %f7, 0f00000000;
+    mov.f32 %f8, 0f00000000;
+    mov.f32 %f9, 0f00000000;
+
+    mov.u32 %r19, 0;
+R2Y_ROW:
+    add.u32 %r20, %r16, %r19;
+    mov.u32 %r21, 0;
+R2Y_COL:
+    add.u32 %r22, %r15, %r21;
+    mul.wide.u32 %rd4, %r20, %r17;
+    mul.wide.u32 %rd5, %r22, 4;
+    add.u64 %rd4, %rd4, %rd5;
+    add.u64 %rd4, %rd1, %rd4;
+    ld.global.f32 %f10, [%rd4];
+    add.u64 %rd4, %rd4, %rd2;
+    ld.global.f32 %f11, [%rd4];
+    add.u64 %rd4, %rd4, %rd2;
+    ld.global.f32 %f12, [%rd4];
+    add.f32 %f7, %f7, %f12;
+    add.f32 %f8, %f8, %f11;
+    add.f32 %f9, %f9, %f10;
+    mul.f32 %f13, %f12, %f1;
+    fma.rn.f32 %f13, %f11, %f2, %f13;
+    fma.rn.f32 %f13, %f10, %f3, %f13;
+    fma.rn.f32 %f13, %f13, %f4, %f5;
+    max.f32 %f13, %f13, 0f00000000;
+    min.f32 %f13, %f13, %f6;
+    cvt.rni.u32.f32 %r23, %f13;
+    mul.wide.u32 %rd6, %r20, %r18;
+    shl.b32 %r24, %r22, %r10;
+    cvt.u64.u32 %rd7, %r24;
+    add.u64 %rd6, %rd6, %rd7;
+    add.u64 %rd6, %rd3, %rd6;
+    @%p2 st.global.u16 [%rd6], %r23;
+    @!%p2 st.global.u8 [%rd6], %r23;
+    add.u32 %r21, %r21, 1;
+    setp.lt.u32 %p3, %r21, %r13;
+    @%p3 bra R2Y_COL;
+    add.u32 %r19, %r19, 1;
+    setp.lt.u32 %p3, %r19, %r14;
+    @%p3 bra R2Y_ROW;
+
+    mul.lo.u32 %r25, %r13, %r14;
+    cvt.rn.f32.u32 %f14, %r25;
+    rcp.rn.f32 %f14, %f14;
+    mul.f32 %f7, %f7, %f14;
+    mul.f32 %f8, %f8, %f14;
+    mul.f32 %f9, %f9, %f14;
+    mul.f32 %f15, %f7, %f1;
+    fma.rn.f32 %f15, %f8, %f2, %f15;
+    fma.rn.f32 %f15, %f9, %f3, %f15;
+    sub.f32 %f16, %f9, %f15;
+    sub.f32 %f17, %f7, %f15;
+    ld.param.f32 %f18, [p_ub];
+    ld.param.f32 %f19, [p_vr];
+    ld.param.f32 %f20, [p_cs];
+    ld.param.f32 %f21, [p_co];
+    mul.f32 %f16, %f16, %f18;
+    mul.f32 %f17, %f17, %f19;
+    fma.rn.f32 %f16, %f16, %f20, %f21;
+    fma.rn.f32 %f17, %f17, %f20, %f21;
+    max.f32 %f16, %f16, 0f00000000;
+    min.f32 %f16, %f16, %f6;
+    max.f32 %f17, %f17, 0f00000000;
+    min.f32 %f17, %f17, %f6;
+    cvt.rni.u32.f32 %r26, %f16;
+    cvt.rni.u32.f32 %r27, %f17;
+
+    ld.param.u32 %r28, [p_cpitch];
+    mul.wide.u32 %rd8, %r5, %r28;
+    shl.b32 %r29, %r4, %r10;
+    cvt.u64.u32 %rd9, %r29;
+    add.u64 %rd8, %rd8, %rd9;
+    ld.param.u64 %rd10, [p_u];
+    cvta.to.global.u64 %rd10, %rd10;
+    add.u64 %rd10, %rd10, %rd8;
+    ld.param.u64 %rd11, [p_v];
+    cvta.to.global.u64 %rd11, %rd11;
+    add.u64 %rd11, %rd11, %rd8;
+    @%p2 st.global.u16 [%rd10], %r26;
+    @!%p2 st.global.u8 [%rd10], %r26;
+    @%p2 st.global.u16 [%rd11], %r27;
+    @!%p2 st.global.u8 [%rd11], %r27;
+R2Y_DONE:
+    ret;
+}
+)ptx";
+
+// Blends a tile of the effect output into the output frame, both planar BGR
+// float, weighted by linear ramps across its overlap with the neighbouring
+// tiles. The weights of overlapping tiles add up to one, so the output frame
+// starts out zeroed.
+static const char tileKernels[] = R"ptx(
+.version 6.0
+.target sm_50
+.address_size 64
+
+.visible .entry vfx_tile_blend(
+    .param .u64 p_tile, .param .u32 p_tpitch, .param .u32 p_tw, .param .u32 p_th,
+    .param .u64 p_dst, .param .u32 p_dpitch, .param .u32 p_dh,
+    .param .u32 p_ox, .param .u32 p_oy,
+    .param .f32 p_l, .param .f32 p_il, .param .f32 p_r, .param .f32 p_ir,
+    .param .f32 p_t, .param .f32 p_it, .param .f32 p_b, .param .f32 p_ib)
+{
+    .reg .pred %p<2>;
+    .reg .b32 %r<16>;
+    .reg .b64 %rd<12>;
+    .reg .f32 %f<12>;
+
+    mov.u32 %r1, %ctaid.x;
+    mov.u32 %r2, %ntid.x;
+    mov.u32 %r3, %tid.x;
+    mad.lo.u32 %r4, %r1, %r2, %r3;
+    mov.u32 %r1, %ctaid.y;
+    mov.u32 %r2, %ntid.y;
+    mov.u32 %r3, %tid.y;
+    mad.lo.u32 %r5, %r1, %r2, %r3;
+    ld.param.u32 %r6, [p_tw];
+    ld.param.u32 %r7, [p_th];
+    setp.ge.u32 %p1, %r4, %r6;
+    setp.ge.or.u32 %p1, %r5, %r7, %p1;
+    @%p1 bra TB_DONE;
+
+    cvt.rn.f32.u32 %f1, %r4;
+    add.f32 %f1, %f1, 0f3F000000;
+    cvt.rn.f32.u32 %f2, %r5;
+    add.f32 %f2, %f2, 0f3F000000;
+    ld.param.f32 %f3, [p_l];
+    ld.param.f32 %f4, [p_il];
+    sub.f32 %f5, %f1, %f3;
+    mul.f32 %f5, %f5, %f4;
+    cvt.sat.f32.f32 %f5, %f5;
+    ld.param.f32 %f3, [p_r];
+    ld.param.f32 %f4, [p_ir];
+    sub.f32 %f6, %f3, %f1;
+    mul.f32 %f6, %f6, %f4;
+    cvt.sat.f32.f32 %f6, %f6;
+    mul.f32 %f5, %f5, %f6;
+    ld.param.f32 %f3, [p_t];
+    ld.param.f32 %f4, [p_it];
+    sub.f32 %f6, %f2, %f3;
+    mul.f32 %f6, %f6, %f4;
+    cvt.sat.f32.f32 %f6, %f6;
+    mul.f32 %f5, %f5, %f6;
+    ld.param.f32 %f3, [p_b];
+    ld.param.f32 %f4, [p_ib];
+    sub.f32 %f6, %f3, %f2;
+    mul.f32 %f6, %f6, %f4;
+    cvt.sat.f32.f32 %f6, %f6;
+    mul.f32 %f5, %f5, %f6;
+
+    ld.param.u64 %rd1, [p_tile];
+    cvta.to.global.u64 %rd1, %rd1;
+    ld.param.u32 %r8, [p_tpitch];
+    mul.wide.u32 %rd2, %r5, %r8;
+    mul.wide.u32 %rd3, %r4, 4;
+    add.u64 %rd2, %rd2, %rd3;
+    add.u64 %rd1, %rd1, %rd2;
+    mul.wide.u32 %rd4, %r7, %r8;
+
+    ld.param.u64 %rd5, [p_dst];
+    cvta.to.global.u64 %rd5, %rd5;
+    ld.param.u32 %r9, [p_dpitch];
+    ld.param.u32 %r10, [p_dh];
+    ld.param.u32 %r11, [p_ox];
+    ld.param.u32 %r12, [p_oy];
+    add.u32 %r13, %r4, %r11;
+    add.u32 %r14, %r5, %r12;
+    mul.wide.u32 %rd6, %r14, %r9;
+    mul.wide.u32 %rd7, %r13, 4;
+    add.u64 %rd6, %rd6, %rd7;
+    add.u64 %rd5, %rd5, %rd6;
+    mul.wide.u32 %rd8, %r10, %r9;
+
+    ld.global.f32 %f7, [%rd1];
+    ld.global.f32 %f8, [%rd5];
+    fma.rn.f32 %f8, %f7, %f5, %f8;
+    st.global.f32 [%rd5], %f8;
+    add.u64 %rd1, %rd1, %rd4;
+    add.u64 %rd5, %rd5, %rd8;
+    ld.global.f32 %f7, [%rd1];
+    ld.global.f32 %f8, [%rd5];
+    fma.rn.f32 %f8, %f7, %f5, %f8;
+    st.global.f32 [%rd5], %f8;
+    add.u64 %rd1, %rd1, %rd4;
+    add.u64 %rd5, %rd5, %rd8;
+    ld.global.f32 %f7, [%rd1];
+    ld.global.f32 %f8, [%rd5];
+    fma.rn.f32 %f8, %f7, %f5, %f8;
+    st.global.f32 [%rd5], %f8;
+TB_DONE:
+    ret;
+}
+)ptx";
+
+// Where the three planes of a frame are in a staging buffer.
+struct VfxPlanes {
+    size_t offset[3], pitch[3], rowBytes[3], rows[3];
+
+    void init(size_t width, size_t height, int ssw, int ssh, int bytesPerSample, size_t lumaPitch, size_t chromaPitch) {
+        for (int plane = 0; plane < 3; plane++) {
+            rowBytes[plane] = (plane ? width >> ssw : width) * bytesPerSample;
+            rows[plane] = plane ? height >> ssh : height;
+            pitch[plane] = plane ? chromaPitch : lumaPitch;
+            offset[plane] = plane ? offset[plane - 1] + pitch[plane - 1] * rows[plane - 1] : 0;
+        }
+    }
+    size_t size() const { return offset[2] + pitch[2] * rows[2]; }
+};
+
+static size_t alignPitch(size_t rowBytes) {
+    return (rowBytes + 255) & ~(size_t)255;
+}
+
+// One tile of a tiled frame: where it is cut from the effect input and where
+// it is blended into the effect output, and the ramps of its weight across
+// the overlaps with its neighbours, in output pixels from its origin. The
+// ramps of edges without a neighbour lie far outside the tile.
+struct VfxTile {
+    unsigned x, y, outX, outY;
+    float left, leftInv, right, rightInv, top, topInv, bottom, bottomInv;
+};
+
+// The tiles along one dimension.
+struct VfxSpan {
+    unsigned in, out;
+    float rise, riseInv, fall, fallInv;
+};
+
+// The tile size along a dimension of size pixels that needs the fewest tiles
+// of at most maxTile pixels, overlapping by overlap, made a multiple of align.
+static unsigned tileSize(unsigned size, unsigned maxTile, unsigned align, unsigned overlap) {
+    const unsigned n = (size - overlap + maxTile - overlap - 1) / (maxTile - overlap);
+    unsigned tile = std::min(maxTile, ((size + (n - 1) * overlap + n - 1) / n + align - 1) / align * align);
+    if (tile > size)
+        tile = size / align * align;
+    return tile;
+}
+
+// Spreads the tiles evenly over size pixels. Every origin but the last, which
+// is flush with the end, is a multiple of granularity so that it maps to a
+// whole output pixel. Each seam ramps over at most overlap pixels around the
+// middle of the overlap of the two tiles, which then never reaches a third.
+static std::vector<VfxSpan> tileSpans(unsigned size, unsigned tile, unsigned outSize, unsigned outTile, double scale, unsigned overlap, unsigned granularity) {
+    const unsigned n = size <= tile ? 1 : (size - overlap + tile - overlap - 1) / (tile - overlap);
+    std::vector<VfxSpan> spans(n);
+    for (unsigned i = 0; i < n; i++) {
+        auto &s = spans[i];
+        if (i + 1 == n) {
+            s.in = size - tile;
+            s.out = outSize - outTile;
+        } else {
+            s.in = unsigned(uint64_t(i) * (size - tile) / (n - 1) / granularity * granularity);
+            s.out = unsigned(std::llround(s.in * scale));
+        }
+        s.rise = -1e9f;
+        s.fall = 1e9f;
+        s.riseInv = s.fallInv = 1;
+        if (i > 0) {
+            auto &prev = spans[i - 1];
+            const double end = prev.out + outTile, mid = (s.out + end) / 2;
+            const double width = std::max(1.0, std::min(overlap * scale, end - s.out));
+            s.rise = float(mid - width / 2 - s.out);
+            prev.fall = float(mid + width / 2 - prev.out);
+            s.riseInv = prev.fallInv = float(1 / width);
+        }
+    }
+    return spans;
+}
+
+// The smallest number of input pixels that scale to a whole number of output
+// pixels.
+static unsigned scaleGranularity(double scale) {
+    for (unsigned g = 1; g <= 8; g++)
+        if (std::fabs(g * scale - std::llround(g * scale)) < 1e-6)
+            return g;
+    return 1;
+}
+
+// The host and device buffers of one batch of frames in flight. Every
+// stream has num_buffers of them, so that the upload of one batch, the effect
+// on the next and the download of a third can run concurrently. The frames
+// of a batch follow each other in the buffers, laid out as in srcPlanes and
+// dstPlanes.
+struct VfxSlot {
+    CUdeviceptr srcDev, dstDev;
+    std::unique_ptr<NvCVImage[]> srcTmp, dstTmp; // of RGB clips, views of the frames in srcDev and dstDev
+    void *srcCpuBuf, *dstCpuBuf;
+    CUevent uploaded, processed;
+
+    VfxSlot() : srcDev(nullptr), dstDev(nullptr), srcCpuBuf(nullptr), dstCpuBuf(nullptr), uploaded(nullptr), processed(nullptr) {}
+    ~VfxSlot() {
+        if (uploaded) cuEventDestroy_v2(uploaded);
+        if (processed) cuEventDestroy_v2(processed);
+        srcTmp.reset();
+        dstTmp.reset();
+        if (srcDev) cuMemFree_v2(srcDev);
+        if (dstDev) cuMemFree_v2(dstDev);
+        if (srcCpuBuf) cuMemFreeHost(srcCpuBuf);
+        if (dstCpuBuf) cuMemFreeHost(dstCpuBuf);
+    }
+};
+
+// One frame of a job. dst is either the slot's pinned buffer or, with
+// zero_copy, the output frame, and likewise for src. Either may be a device
+// frame instead (see devframe.h).
+struct VfxFrameIO {
+    const char *src[3];
+    size_t srcPitch[3];
+    char *dst[3];
+    size_t dstPitch[3];
+    bool srcOnGpu, dstOnGpu;
+    int matrix;      // of YUV clips, from _Matrix
+    bool fullRange;  // of YUV clips, from _ColorRange
+};
+
+// Consecutive frames, at most batch of them, whose host input is ready,
+// waiting for the submission thread of their stream. done is set once the
+// output of all of them has been copied to dst.
+struct VfxJob {
+    VfxSlot *slot;
+    std::vector<VfxFrameIO> frames;
+    std::promise<void> done;
+};
+
+enum { OP_AR, OP_SUPERRES, OP_DENOISE };
+
+struct VfxData {
+    int num_buffers;
+    bool zero_copy;
+    int batch;
+    bool gpu_output; // leave the output on the GPU, see devframe.h
+    FilterStats *perf; // of the VfxFilter
 
     VSNode *node;
     VSVideoInfo vi;
+    int op;
     double scale;
     double strength;
     int output_depth;
+    VSVideoFormat out_format;
+    std::string model_dir;
 
     int in_width, in_height;
+    NvCVImage_ComponentType src_ct, dst_ct;
+
+    // YUV clips are uploaded as they are and converted on the effect stream.
+    bool yuv;
+    VfxPlanes srcPlanes, dstPlanes;
+    CUmodule module;
+    CUfunction toRgb, toYuv;
+
+    // Frames the effect cannot take whole are cut into tiles of tile_width x
+    // tile_height that it can, batch of which are run at once.
+    std::vector<VfxTile> tiles; // empty unless tiled
+    unsigned tile_width, tile_height, tile_out_width, tile_out_height;
+    CUmodule tileModule;
+    CUfunction blend;
+    CUdeviceptr tileSrcBuf, tileDstBuf;
+    std::unique_ptr<NvCVImage[]> tileSrcImg, tileDstImg;
+
+    // The CUDA device of the stream, or -1 for whichever is current when it
+    // loads, and its primary context, retained while the stream lives.
+    int device;
+    CUdevice cuDevice;
+    CUcontext primary;
 
     NvVFX_Handle vfx;
-    CUstream stream;
+    CUcontext context;
+    CUstream stream;   // runs the effect
+    CUstream upload;   // host to device copies
+    CUstream download; // device to host copies
     CUdeviceptr state;
 
     float srcTransferFactor, dstTransferFactor;
-    NvCVImage srcGpuImg;
-    NvCVImage dstGpuImg;
-    NvCVImage srcTmpImg, dstTmpImg;
-    void *srcCpuBuf, *dstCpuBuf;
+    // The effect input and output of batch frames, one after the other; the
+    // effect is given the first view.
+    CUdeviceptr srcGpuBuf, dstGpuBuf;
+    std::unique_ptr<NvCVImage[]> srcGpuImg, dstGpuImg;
+
+    std::unique_ptr<VfxSlot[]> slots;
+    std::vector<VfxSlot *> freeSlots; // guarded by VfxFilter::lock
+
+    // Jobs are queued by the frame threads and submitted to the GPU, in
+    // order, by one thread per stream, which thereby owns the effect.
+    std::thread submitter;
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+    std::deque<VfxJob *> queue; // guarded by queueLock
+    bool stopping; // guarded by queueLock
 
     typedef float T;
     uint64_t in_image_width() const   { return in_width; }
@@ -67,114 +609,704 @@ struct VfxData {
     uint64_t in_image_height() const  { return in_height; }
     uint64_t out_image_height() const { return vi.height; }
 
-    VfxData() : node(nullptr), vi(), scale(0), strength(0), vfx(nullptr), stream(nullptr), state(nullptr) {}
+    VfxData() : num_buffers(0), zero_copy(false), batch(1), gpu_output(false), perf(nullptr), node(nullptr), vi(), op(0), scale(0), strength(0), yuv(false), module(nullptr), toRgb(nullptr), toYuv(nullptr), tile_width(0), tile_height(0), tile_out_width(0), tile_out_height(0), tileModule(nullptr), blend(nullptr), tileSrcBuf(nullptr), tileDstBuf(nullptr), device(-1), cuDevice(0), primary(nullptr), vfx(nullptr), context(nullptr), stream(nullptr), upload(nullptr), download(nullptr), state(nullptr), srcGpuBuf(nullptr), dstGpuBuf(nullptr), stopping(false) {}
     ~VfxData() {
+        if (submitter.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(queueLock);
+                stopping = true;
+            }
+            queueReady.notify_one();
+            submitter.join();
+        }
+        if (context)
+            cuCtxPushCurrent_v2(context);
+        slots.reset();
+        if (module) cuModuleUnload(module);
+        if (tileModule) cuModuleUnload(tileModule);
         if (vfx) NvVFX_DestroyEffect(vfx);
         if (stream) NvVFX_CudaStreamDestroy(stream);
+        if (upload) NvVFX_CudaStreamDestroy(upload);
+        if (download) NvVFX_CudaStreamDestroy(download);
         if (state) cuMemFree_v2(state);
-        NvCVImage_Dealloc(&srcGpuImg);
-        NvCVImage_Dealloc(&dstGpuImg);
-        NvCVImage_Dealloc(&srcTmpImg);
-        NvCVImage_Dealloc(&dstTmpImg);
-        cuMemFreeHost(srcCpuBuf);
-        cuMemFreeHost(dstCpuBuf);
+        srcGpuImg.reset();
+        dstGpuImg.reset();
+        if (srcGpuBuf) cuMemFree_v2(srcGpuBuf);
+        if (dstGpuBuf) cuMemFree_v2(dstGpuBuf);
+        tileSrcImg.reset();
+        tileDstImg.reset();
+        if (tileSrcBuf) cuMemFree_v2(tileSrcBuf);
+        if (tileDstBuf) cuMemFree_v2(tileDstBuf);
+        if (context)
+            cuCtxPopCurrent_v2(nullptr);
+        if (primary)
+            cuDevicePrimaryCtxRelease(cuDevice);
+    }
+
+    void load(int index);
+
+    void enqueue(VfxJob *job) {
+        {
+            std::lock_guard<std::mutex> guard(queueLock);
+            queue.push_back(job);
+        }
+        queueReady.notify_one();
+    }
+
+private:
+    void submit(VfxJob *job);
+    void convertToRgb(VfxJob *job, int k);
+    void convertToYuv(VfxJob *job, int k);
+    void runTiles(int count);
+
+    void run() {
+        CK_CUDA(cuCtxSetCurrent(context));
+        std::unique_lock<std::mutex> guard(queueLock);
+        while (true) {
+            queueReady.wait(guard, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            VfxJob *job = queue.front();
+            queue.pop_front();
+            guard.unlock();
+            submit(job);
+            guard.lock();
+        }
     }
 };
 
-static const VSFrame *VS_CC vfxGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    VfxData *ds = static_cast<VfxData *>(instanceData);
+// The output of a batch, kept until every frame of it has been requested.
+// The first of its frames to be requested runs the batch.
+struct VfxBatch {
+    const VSAPI *vsapi;
+    uint64_t serial; // for eviction, oldest first
+    int taken;       // guarded by VfxFilter::lock
+    std::promise<void> promise;
+    std::shared_future<void> ready;
+    std::vector<const VSFrame *> frames;
 
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, ds->node, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        for (int i = 0; i <= ds->num_streams; ++i) {
-            auto d = i < ds->num_streams ? ds + i : ds + rand() % ds->num_streams;
-            std::unique_lock<std::mutex> lock(d->lock, std::defer_lock);
-            if (i < ds->num_streams) {
-                if (!lock.try_lock()) continue;
-            } else {
-                lock.lock();
+    VfxBatch(const VSAPI *vsapi, uint64_t serial) : vsapi(vsapi), serial(serial), taken(0), ready(promise.get_future().share()) {}
+    ~VfxBatch() {
+        for (auto frame : frames)
+            vsapi->freeFrame(frame);
+    }
+};
+
+// Hands the frames to the streams. Stream i runs on device i % num_devices,
+// and the frames go to the devices in turn, affinity consecutive frames at a
+// time. A frame takes a slot of the loaded stream of its device with the
+// least outstanding work, i.e. the most free slots, and waits for the first
+// slot of one of them to free up if there is none. The slots bound the number
+// of queued jobs.
+struct VfxFilter {
+    int num_streams;
+    std::unique_ptr<VfxData[]> streams;
+    int num_devices;
+    int affinity;
+
+    std::mutex lock;
+    std::condition_variable slotFree;
+    // The streams of each device are loaded in order, the first one by
+    // vfxCreate and the others once all loaded streams of the device are
+    // busy. The k-th stream of device j is stream j + k * num_devices.
+    std::vector<int> loaded;
+    std::vector<int> usable; // lowered if a stream fails to load
+    bool loading;
+
+    // With batch > 1, the batches run or running by first frame. Frames
+    // that are never requested, e.g. after a seek, would keep theirs forever,
+    // so past maxBatches the oldest batch is dropped.
+    int batch;
+    size_t maxBatches;
+    uint64_t serial;
+    std::map<int, std::shared_ptr<VfxBatch>> batches;
+
+    ScopedFilterStats perf{ "DLVFX" };
+
+    VfxFilter(int num_streams, int num_devices) : num_streams(num_streams), streams(new VfxData[num_streams]), num_devices(num_devices), affinity(1),
+        loaded(num_devices), usable(num_devices), loading(false), batch(1), maxBatches(0), serial(0) {
+        for (int j = 0; j < num_devices; ++j)
+            usable[j] = (num_streams - j + num_devices - 1) / num_devices;
+    }
+
+    // Takes a slot for frame n.
+    VfxData *acquire(int n, VfxSlot *&slot) {
+        const int dev = n / affinity % num_devices;
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            VfxData *best = nullptr;
+            for (int k = 0; k < loaded[dev]; ++k) {
+                auto d = &streams[dev + k * num_devices];
+                if (!d->freeSlots.empty() && (!best || d->freeSlots.size() > best->freeSlots.size()))
+                    best = d;
+            }
+            if (best) {
+                slot = best->freeSlots.back();
+                best->freeSlots.pop_back();
+                return best;
             }
+            if (loaded[dev] < usable[dev] && !loading) {
+                // Other frames keep waiting for slots while this one loads.
+                const int index = dev + loaded[dev] * num_devices;
+                loading = true;
+                guard.unlock();
+                bool ok = true;
+                try {
+                    streams[index].load(index);
+                } catch (std::runtime_error &e) {
+                    // The streams already loaded can still do the work.
+                    fprintf(stderr, "DLVFX: unable to load stream %d, using the %d loaded on its device: %s\n", index, loaded[dev], e.what());
+                    ok = false;
+                }
+                guard.lock();
+                loading = false;
+                if (ok)
+                    loaded[dev]++;
+                else
+                    usable[dev] = loaded[dev];
+                continue;
+            }
+            slotFree.wait(guard);
+        }
+    }
 
-            const VSFrame *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+    void release(VfxData *d, VfxSlot *slot) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            d->freeSlots.push_back(slot);
+        }
+        // The waiters may be waiting for another device.
+        slotFree.notify_all();
+    }
 
-            // TODO: can be refactored out to function creation.
-            VSVideoFormat fi;
-            vsapi->queryVideoFormat(&fi, cfRGB, d->output_depth == 32 ? stFloat : stInteger, d->output_depth, 0, 0, core);
+    // Returns the batch starting at first, and whether the caller is to run
+    // it.
+    std::shared_ptr<VfxBatch> findBatch(int first, bool &run, const VSAPI *vsapi) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto &b = batches[first];
+        run = !b;
+        if (!run)
+            return b;
+        b = std::make_shared<VfxBatch>(vsapi, serial++);
+        auto result = b;
+        if (batches.size() > maxBatches) {
+            auto oldest = batches.begin();
+            for (auto it = batches.begin(); it != batches.end(); ++it)
+                if (it->second->serial < oldest->second->serial)
+                    oldest = it;
+            batches.erase(oldest);
+        }
+        return result;
+    }
 
-            assert(vsapi->getFrameHeight(src, 0) == (int)d->in_image_height());
-            assert(vsapi->getFrameWidth(src, 0) == (int)d->in_image_width());
-            int planes[3] = { 0, 1, 2 };
-            const VSFrame *srcf[3] = { nullptr, nullptr, nullptr };
-            VSFrame *dst = vsapi->newVideoFrame2(&fi, d->out_image_width(), d->out_image_height(), srcf, planes, src, core);
+    // Called once per frame taken from b, dropping it once all have been.
+    void takeFromBatch(int first, const std::shared_ptr<VfxBatch> &b) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (++b->taken < (int)b->frames.size())
+            return;
+        auto it = batches.find(first);
+        if (it != batches.end() && it->second == b)
+            batches.erase(it);
+    }
+};
 
-            auto host = static_cast<char*>(d->srcCpuBuf);
-            for (int plane = 0; plane < 3; plane++) {
-                const auto stride = vsapi->getStride(src, plane);
-                const auto *ptr = vsapi->getReadPtr(src, plane);
-                const size_t w = d->in_image_width(), h = d->in_image_height();
-                const auto pitch = d->srcTmpImg.pitch;
-                vsh::bitblt(host + pitch * h * plane, pitch, ptr, stride, w * d->vi.format.bytesPerSample, h);
+// Creates and loads the effect of a stream along with its buffers, logging
+// how long that took and how much memory it needs.
+void VfxData::load(int index) {
+    const NvVFX_EffectSelector selectors[] = { NVVFX_FX_ARTIFACT_REDUCTION, NVVFX_FX_SUPER_RES, NVVFX_FX_DENOISING };
+    const auto start = std::chrono::steady_clock::now();
+
+    // The effect takes the current context, so the primary context of the
+    // device is made current while the stream loads and the caller gets its
+    // own back afterwards.
+    struct ContextScope {
+        bool pushed;
+        explicit ContextScope(CUcontext ctx) : pushed(ctx != nullptr) {
+            if (pushed)
+                CK_CUDA(cuCtxPushCurrent_v2(ctx));
+        }
+        ~ContextScope() {
+            if (pushed)
+                cuCtxPopCurrent_v2(nullptr);
+        }
+    };
+    if (device >= 0 && !primary) {
+        CK_CUDA(cuDeviceGet(&cuDevice, device));
+        CK_CUDA(cuDevicePrimaryCtxRetain(&primary, cuDevice));
+    }
+    ContextScope scope(primary);
+
+    size_t freeBefore = 0, freeAfter = 0, total = 0;
+    CK_CUDA(cuMemGetInfo_v2(&freeBefore, &total));
+
+    NvCV_Status r = NvVFX_CreateEffect(selectors[op], &vfx);
+    if (r != NVCV_SUCCESS) {
+        const char *err = NvCV_GetErrorStringFromCode(r);
+        fprintf(stderr, "NvVFX_CreateEffect failed: %x (%s)\n", r, err);
+        throw std::runtime_error("unable to create effect: " + std::string(err));
+    }
+
+    CK_VFX(NvVFX_CudaStreamCreate(&stream));
+    CK_CUDA(cuCtxGetCurrent(&context));
+    CK_VFX(NvVFX_SetCudaStream(vfx, NVVFX_CUDA_STREAM, stream));
+    CK_VFX(NvVFX_CudaStreamCreate(&upload));
+    CK_VFX(NvVFX_CudaStreamCreate(&download));
+
+    if (op == OP_AR || op == OP_SUPERRES) {
+        r = NvVFX_SetU32(vfx, NVVFX_STRENGTH, int(strength));
+        if (r != NVCV_SUCCESS)
+            r = NvVFX_SetU32(vfx, NVVFX_MODE, int(strength));
+    } else if (op == OP_DENOISE)
+        r = NvVFX_SetF32(vfx, NVVFX_STRENGTH, strength);
+    else
+        throw std::runtime_error("unknown op " + std::to_string(op));
+    if (r != NVCV_SUCCESS) {
+        const char *err = NvCV_GetErrorStringFromCode(r);
+        fprintf(stderr, "NvVFX set strength failed: %x (%s)\n", r, err);
+        throw std::runtime_error("failed to set strength: " + std::string(err));
+    }
+
+    r = NvVFX_SetString(vfx, NVVFX_MODEL_DIRECTORY, model_dir.c_str());
+    if (r != NVCV_SUCCESS) {
+        fprintf(stderr, "NvVFX set model directory to %s failed: %x (%s)\n", model_dir.c_str(), r, NvCV_GetErrorStringFromCode(r));
+        throw std::runtime_error("unable to set model directory " + model_dir);
+    }
+
+    // Planar BGR images of batch frames, one after the other, as the SDK
+    // expects of batched input and output.
+    const size_t srcGpuPitch = alignPitch(in_image_width() * sizeof(float)), dstGpuPitch = alignPitch(out_image_width() * sizeof(float));
+    const size_t srcGpuSize = srcGpuPitch * in_image_height() * 3, dstGpuSize = dstGpuPitch * out_image_height() * 3;
+    CK_CUDA(cuMemAlloc_v2(&srcGpuBuf, batch * srcGpuSize));
+    CK_CUDA(cuMemAlloc_v2(&dstGpuBuf, batch * dstGpuSize));
+    srcGpuImg.reset(new NvCVImage[batch]);
+    dstGpuImg.reset(new NvCVImage[batch]);
+    for (int k = 0; k < batch; ++k) {
+        CK_VFX(NvCVImage_Init(&srcGpuImg[k], in_image_width(), in_image_height(), srcGpuPitch, static_cast<char*>(srcGpuBuf) + k * srcGpuSize, NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU));
+        CK_VFX(NvCVImage_Init(&dstGpuImg[k], out_image_width(), out_image_height(), dstGpuPitch, static_cast<char*>(dstGpuBuf) + k * dstGpuSize, NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU));
+    }
+
+    if (!tiles.empty()) {
+        CK_CUDA(cuModuleLoadData(&tileModule, tileKernels));
+        CK_CUDA(cuModuleGetFunction(&blend, tileModule, "vfx_tile_blend"));
+        const size_t srcTilePitch = alignPitch(tile_width * sizeof(float)), dstTilePitch = alignPitch(tile_out_width * sizeof(float));
+        const size_t srcTileSize = srcTilePitch * tile_height * 3, dstTileSize = dstTilePitch * tile_out_height * 3;
+        CK_CUDA(cuMemAlloc_v2(&tileSrcBuf, batch * srcTileSize));
+        CK_CUDA(cuMemAlloc_v2(&tileDstBuf, batch * dstTileSize));
+        tileSrcImg.reset(new NvCVImage[batch]);
+        tileDstImg.reset(new NvCVImage[batch]);
+        for (int k = 0; k < batch; ++k) {
+            CK_VFX(NvCVImage_Init(&tileSrcImg[k], tile_width, tile_height, srcTilePitch, static_cast<char*>(tileSrcBuf) + k * srcTileSize, NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU));
+            CK_VFX(NvCVImage_Init(&tileDstImg[k], tile_out_width, tile_out_height, dstTilePitch, static_cast<char*>(tileDstBuf) + k * dstTileSize, NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU));
+        }
+    }
+
+    if (yuv) {
+        CK_CUDA(cuModuleLoadData(&module, yuvKernels));
+        CK_CUDA(cuModuleGetFunction(&toRgb, module, "vfx_yuv_to_rgb"));
+        CK_CUDA(cuModuleGetFunction(&toYuv, module, "vfx_rgb_to_yuv"));
+        const int ssw = vi.format.subSamplingW, ssh = vi.format.subSamplingH;
+        srcPlanes.init(in_image_width(), in_image_height(), ssw, ssh, vi.format.bytesPerSample,
+                       alignPitch(in_image_width() * vi.format.bytesPerSample), alignPitch((in_image_width() >> ssw) * vi.format.bytesPerSample));
+        dstPlanes.init(out_image_width(), out_image_height(), ssw, ssh, out_format.bytesPerSample,
+                       alignPitch(out_image_width() * out_format.bytesPerSample), alignPitch((out_image_width() >> ssw) * out_format.bytesPerSample));
+    } else {
+        const size_t srcPitch = alignPitch(in_image_width() * vi.format.bytesPerSample), dstPitch = alignPitch(out_image_width() * (output_depth / 8));
+        srcPlanes.init(in_image_width(), in_image_height(), 0, 0, vi.format.bytesPerSample, srcPitch, srcPitch);
+        dstPlanes.init(out_image_width(), out_image_height(), 0, 0, output_depth / 8, dstPitch, dstPitch);
+    }
+
+    slots.reset(new VfxSlot[num_buffers]);
+    for (int j = 0; j < num_buffers; ++j) {
+        auto slot = &slots[j];
+        CK_CUDA(cuMemAlloc_v2(&slot->srcDev, batch * srcPlanes.size()));
+        CK_CUDA(cuMemAlloc_v2(&slot->dstDev, batch * dstPlanes.size()));
+        if (!yuv) {
+            slot->srcTmp.reset(new NvCVImage[batch]);
+            slot->dstTmp.reset(new NvCVImage[batch]);
+            for (int k = 0; k < batch; ++k) {
+                CK_VFX(NvCVImage_Init(&slot->srcTmp[k], in_image_width(), in_image_height(), srcPlanes.pitch[0],
+                                      static_cast<char*>(slot->srcDev) + k * srcPlanes.size(), NVCV_RGB, src_ct, NVCV_PLANAR, NVCV_GPU));
+                CK_VFX(NvCVImage_Init(&slot->dstTmp[k], out_image_width(), out_image_height(), dstPlanes.pitch[0],
+                                      static_cast<char*>(slot->dstDev) + k * dstPlanes.size(), NVCV_RGB, dst_ct, NVCV_PLANAR, NVCV_GPU));
             }
+        }
+        if (!zero_copy) {
+            CK_CUDA(cuMemHostAlloc(&slot->srcCpuBuf, batch * srcPlanes.size(), CU_MEMHOSTALLOC_WRITECOMBINED));
+            CK_CUDA(cuMemHostAlloc(&slot->dstCpuBuf, batch * dstPlanes.size(), 0));
+        }
+        CK_CUDA(cuEventCreate(&slot->uploaded, CU_EVENT_DISABLE_TIMING));
+        CK_CUDA(cuEventCreate(&slot->processed, CU_EVENT_DISABLE_TIMING));
+        freeSlots.push_back(slot);
+    }
 
-            {
-                CUDA_MEMCPY2D mcp2d {};
+    CK_VFX(NvVFX_SetImage(vfx, NVVFX_INPUT_IMAGE, tiles.empty() ? &srcGpuImg[0] : &tileSrcImg[0]));
+    CK_VFX(NvVFX_SetImage(vfx, NVVFX_OUTPUT_IMAGE, tiles.empty() ? &dstGpuImg[0] : &tileDstImg[0]));
+
+    if (batch > 1) {
+        r = NvVFX_SetU32(vfx, NVVFX_MODEL_BATCH, batch);
+        if (r != NVCV_SUCCESS) {
+            const char *err = NvCV_GetErrorStringFromCode(r);
+            fprintf(stderr, "NvVFX set model batch failed: %x (%s)\n", r, err);
+            throw std::runtime_error("effect does not support batch " + std::to_string(batch) + ": " + std::string(err));
+        }
+    }
+
+    if (op == OP_DENOISE) {
+        unsigned int stateSizeInBytes = 0;
+        CK_VFX(NvVFX_GetU32(vfx, NVVFX_STATE_SIZE, &stateSizeInBytes));
+        CK_CUDA(cuMemAlloc_v2(&state, stateSizeInBytes));
+        CK_CUDA(cuMemsetD8Async(state, 0, stateSizeInBytes, stream));
+        void *stateArray[1] = { state };
+        CK_VFX(NvVFX_SetObject(vfx, NVVFX_STATE, (void*)stateArray));
+    }
+
+    CK_VFX(NvVFX_Load(vfx));
+
+    CK_CUDA(cuStreamSynchronize(stream));
+    CK_CUDA(cuMemGetInfo_v2(&freeAfter, &total));
+    const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    const double host = zero_copy ? 0 : (double)num_buffers * batch * (srcPlanes.size() + dstPlanes.size());
+    const std::string where = device >= 0 ? " on device " + std::to_string(device) : "";
+    fprintf(stderr, "DLVFX: stream %d loaded%s in %.0f ms, using %.1f MiB of GPU memory and %.1f MiB of pinned host memory\n",
+            index, where.c_str(), ms, (double)(freeBefore > freeAfter ? freeBefore - freeAfter : 0) / 1048576, host / 1048576);
+    filterStatsBytes(perf, (freeBefore > freeAfter ? freeBefore - freeAfter : 0) + (int64_t)host);
+
+    submitter = std::thread([this]() { run(); });
+}
+
+// Queues the upload, the effect and the download of a job on their streams,
+// ordered by the events of its slot, so that they overlap with those of the
+// neighbouring jobs.
+void VfxData::submit(VfxJob *job) {
+    VfxSlot *slot = job->slot;
+    const int count = job->frames.size();
+    for (int k = 0; k < count; k++) {
+        const auto &io = job->frames[k];
+        for (int plane = 0; plane < 3; plane++) {
+            CUDA_MEMCPY2D mcp2d {};
+            if (io.srcOnGpu) {
+                // Possibly of another context or device.
+                mcp2d.srcMemoryType = CU_MEMORYTYPE_UNIFIED;
+                mcp2d.srcDevice = (CUdeviceptr)io.src[plane];
+            } else {
                 mcp2d.srcMemoryType = CU_MEMORYTYPE_HOST;
-                mcp2d.srcHost = host;
-                mcp2d.srcPitch = (size_t)d->srcTmpImg.pitch;
+                mcp2d.srcHost = io.src[plane];
+            }
+            mcp2d.srcPitch = io.srcPitch[plane];
+            mcp2d.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+            mcp2d.dstDevice = (CUdeviceptr)(static_cast<char*>(slot->srcDev) + k * srcPlanes.size() + srcPlanes.offset[plane]);
+            mcp2d.dstPitch = srcPlanes.pitch[plane];
+            mcp2d.WidthInBytes = srcPlanes.rowBytes[plane];
+            mcp2d.Height = srcPlanes.rows[plane];
+            CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, upload));
+        }
+    }
+    CK_CUDA(cuEventRecord(slot->uploaded, upload));
+
+    CK_CUDA(cuStreamWaitEvent(stream, slot->uploaded, 0));
+    for (int k = 0; k < count; k++) {
+        if (yuv)
+            convertToRgb(job, k);
+        else
+            CK_VFX(NvCVImage_Transfer(&slot->srcTmp[k], &srcGpuImg[k], srcTransferFactor, stream, nullptr));
+    }
+    if (!tiles.empty())
+        runTiles(count);
+    else {
+        if (batch > 1)
+            CK_VFX(NvVFX_SetU32(vfx, NVVFX_BATCH_SIZE, count));
+        CK_VFX(NvVFX_Run(vfx, 1));
+    }
+    for (int k = 0; k < count; k++) {
+        if (yuv)
+            convertToYuv(job, k);
+        else
+            CK_VFX(NvCVImage_Transfer(&dstGpuImg[k], &slot->dstTmp[k], dstTransferFactor, stream, nullptr));
+    }
+    CK_CUDA(cuEventRecord(slot->processed, stream));
+
+    CK_CUDA(cuStreamWaitEvent(download, slot->processed, 0));
+    for (int k = 0; k < count; k++) {
+        const auto &io = job->frames[k];
+        for (int plane = 0; plane < 3; plane++) {
+            CUDA_MEMCPY2D mcp2d {};
+            mcp2d.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+            mcp2d.srcDevice = (CUdeviceptr)(static_cast<char*>(slot->dstDev) + k * dstPlanes.size() + dstPlanes.offset[plane]);
+            mcp2d.srcPitch = dstPlanes.pitch[plane];
+            if (io.dstOnGpu) {
                 mcp2d.dstMemoryType = CU_MEMORYTYPE_DEVICE;
-                mcp2d.dstDevice = (CUdeviceptr)d->srcTmpImg.pixels;
-                mcp2d.dstPitch = (size_t)d->srcTmpImg.pitch;
-                mcp2d.WidthInBytes = (size_t)d->in_image_width() * d->vi.format.bytesPerSample;
-                mcp2d.Height = d->in_image_height() * 3;
-                CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, d->stream));
+                mcp2d.dstDevice = (CUdeviceptr)io.dst[plane];
+            } else {
+                mcp2d.dstMemoryType = CU_MEMORYTYPE_HOST;
+                mcp2d.dstHost = io.dst[plane];
             }
+            mcp2d.dstPitch = io.dstPitch[plane];
+            mcp2d.WidthInBytes = dstPlanes.rowBytes[plane];
+            mcp2d.Height = dstPlanes.rows[plane];
+            CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, download));
+        }
+    }
+    CK_CUDA(cuLaunchHostFunc(download, [](void *job) { static_cast<VfxJob *>(job)->done.set_value(); }, job));
+}
 
-            CK_VFX(NvCVImage_Transfer(&d->srcTmpImg, &d->srcGpuImg, d->srcTransferFactor, d->stream, nullptr));
-            CK_VFX(NvVFX_Run(d->vfx, 1));
-            CK_VFX(NvCVImage_Transfer(&d->dstGpuImg, &d->dstTmpImg, d->dstTransferFactor, d->stream, nullptr));
+// Launches one thread per pixel (or per chroma sample) in 32x8 blocks.
+static void launch(CUfunction fn, unsigned width, unsigned height, CUstream stream, void **args) {
+    CK_CUDA(cuLaunchKernel(fn, (width + 31) / 32, (height + 7) / 8, 1, 32, 8, 1, 0, stream, args, nullptr));
+}
 
-            host = static_cast<char*>(d->dstCpuBuf);
-            {
+// Runs the effect on the tiles of the first count frames of the effect input,
+// batch tiles at a time, and blends them into the effect output.
+void VfxData::runTiles(int count) {
+    CK_CUDA(cuMemsetD8Async(dstGpuBuf, 0, count * dstGpuImg[0].pitch * out_image_height() * 3, stream));
+    const int total = count * tiles.size();
+    for (int start = 0; start < total; start += batch) {
+        const int n = std::min(batch, total - start);
+        for (int j = 0; j < n; j++) {
+            const auto &t = tiles[(start + j) % tiles.size()];
+            const auto &src = srcGpuImg[(start + j) / tiles.size()];
+            for (int plane = 0; plane < 3; plane++) {
                 CUDA_MEMCPY2D mcp2d {};
                 mcp2d.srcMemoryType = CU_MEMORYTYPE_DEVICE;
-                mcp2d.srcDevice = (CUdeviceptr)d->dstTmpImg.pixels;
-                mcp2d.srcPitch = (size_t)d->dstTmpImg.pitch;
-                mcp2d.dstMemoryType = CU_MEMORYTYPE_HOST;
-                mcp2d.dstHost = host;
-                mcp2d.dstPitch = (size_t)d->dstTmpImg.pitch;
-                mcp2d.WidthInBytes = (size_t)d->out_image_width() * d->output_depth / 8;
-                mcp2d.Height = d->out_image_height() * 3;
-                CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, d->stream));
+                mcp2d.srcDevice = (CUdeviceptr)(static_cast<char*>(src.pixels) + (plane * in_image_height() + t.y) * src.pitch + t.x * sizeof(float));
+                mcp2d.srcPitch = src.pitch;
+                mcp2d.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+                mcp2d.dstDevice = (CUdeviceptr)(static_cast<char*>(tileSrcImg[j].pixels) + plane * tile_height * tileSrcImg[j].pitch);
+                mcp2d.dstPitch = tileSrcImg[j].pitch;
+                mcp2d.WidthInBytes = tile_width * sizeof(float);
+                mcp2d.Height = tile_height;
+                CK_CUDA(cuMemcpy2DAsync_v2(&mcp2d, stream));
             }
+        }
+        if (batch > 1)
+            CK_VFX(NvVFX_SetU32(vfx, NVVFX_BATCH_SIZE, n));
+        CK_VFX(NvVFX_Run(vfx, 1));
+        for (int j = 0; j < n; j++) {
+            const auto &t = tiles[(start + j) % tiles.size()];
+            const auto &dst = dstGpuImg[(start + j) / tiles.size()];
+            void *tile = tileDstImg[j].pixels, *out = dst.pixels;
+            unsigned tpitch = tileDstImg[j].pitch, tw = tile_out_width, th = tile_out_height;
+            unsigned dpitch = dst.pitch, dh = out_image_height(), ox = t.outX, oy = t.outY;
+            float l = t.left, il = t.leftInv, r = t.right, ir = t.rightInv, top = t.top, it = t.topInv, b = t.bottom, ib = t.bottomInv;
+            void *args[] = { &tile, &tpitch, &tw, &th, &out, &dpitch, &dh, &ox, &oy, &l, &il, &r, &ir, &top, &it, &b, &ib };
+            launch(blend, tw, th, stream, args);
+        }
+    }
+}
+
+// Kr and Kb of the supported matrices; anything else is treated as BT.709.
+static void yuvWeights(int matrix, float &kr, float &kb) {
+    switch (matrix) {
+    case 5: case 6: kr = 0.299f; kb = 0.114f; break;
+    case 9: case 10: kr = 0.2627f; kb = 0.0593f; break;
+    default: kr = 0.2126f; kb = 0.0722f; break;
+    }
+}
+
+void VfxData::convertToRgb(VfxJob *job, int k) {
+    const auto &io = job->frames[k];
+    const int bits = vi.format.bitsPerSample;
+    const float peak = float((1 << bits) - 1);
+    float ys, yo, cs, co;
+    if (io.fullRange) {
+        ys = cs = 1.0f / peak;
+        yo = 0;
+        co = -float(1 << (bits - 1)) / peak;
+    } else {
+        ys = 1.0f / float(219 << (bits - 8));
+        yo = -float(16 << (bits - 8)) * ys;
+        cs = 1.0f / float(224 << (bits - 8));
+        co = -float(128 << (bits - 8)) * cs;
+    }
+    float kr, kb;
+    yuvWeights(io.matrix, kr, kb);
+    const float kg = 1 - kr - kb;
+    float rv = 2 * (1 - kr), gu = -2 * kb * (1 - kb) / kg, gv = -2 * kr * (1 - kr) / kg, bu = 2 * (1 - kb);
 
-            CK_CUDA(cuStreamSynchronize(d->stream));
+    char *base = static_cast<char*>(job->slot->srcDev) + k * srcPlanes.size();
+    void *py = base + srcPlanes.offset[0], *pu = base + srcPlanes.offset[1], *pv = base + srcPlanes.offset[2];
+    unsigned pitch = srcPlanes.pitch[0], cpitch = srcPlanes.pitch[1];
+    unsigned w = in_image_width(), h = in_image_height();
+    unsigned ssw = vi.format.subSamplingW, ssh = vi.format.subSamplingH, wide = vi.format.bytesPerSample > 1;
+    void *dst = srcGpuImg[k].pixels;
+    unsigned dpitch = srcGpuImg[k].pitch;
+    void *args[] = { &py, &pu, &pv, &pitch, &cpitch, &w, &h, &ssw, &ssh, &wide, &dst, &dpitch,
+                     &ys, &yo, &cs, &co, &rv, &gu, &gv, &bu };
+    launch(toRgb, w, h, stream, args);
+}
+
+void VfxData::convertToYuv(VfxJob *job, int k) {
+    const auto &io = job->frames[k];
+    const int bits = out_format.bitsPerSample;
+    float peak = float((1 << bits) - 1);
+    float ys, yo, cs, co;
+    if (io.fullRange) {
+        ys = cs = peak;
+        yo = 0;
+        co = float(1 << (bits - 1));
+    } else {
+        ys = float(219 << (bits - 8));
+        yo = float(16 << (bits - 8));
+        cs = float(224 << (bits - 8));
+        co = float(128 << (bits - 8));
+    }
+    float kr, kb;
+    yuvWeights(io.matrix, kr, kb);
+    float kg = 1 - kr - kb, ub = 0.5f / (1 - kb), vr = 0.5f / (1 - kr);
+
+    void *src = dstGpuImg[k].pixels;
+    unsigned spitch = dstGpuImg[k].pitch;
+    unsigned w = out_image_width(), h = out_image_height();
+    unsigned ssw = out_format.subSamplingW, ssh = out_format.subSamplingH, wide = out_format.bytesPerSample > 1;
+    char *base = static_cast<char*>(job->slot->dstDev) + k * dstPlanes.size();
+    void *py = base + dstPlanes.offset[0], *pu = base + dstPlanes.offset[1], *pv = base + dstPlanes.offset[2];
+    unsigned pitch = dstPlanes.pitch[0], cpitch = dstPlanes.pitch[1];
+    void *args[] = { &src, &spitch, &w, &h, &ssw, &ssh, &wide, &py, &pu, &pv, &pitch, &cpitch,
+                     &kr, &kg, &kb, &ys, &yo, &cs, &co, &ub, &vr, &peak };
+    launch(toYuv, w >> ssw, h >> ssh, stream, args);
+}
+
+// Runs frames first to first + count - 1 of the clip, which must all have
+// been requested, as one job.
+static std::vector<const VSFrame *> vfxProcess(VfxFilter *f, int first, int count, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    VfxSlot *slot = nullptr;
+    VfxData *d = f->acquire(first, slot);
+
+    VfxJob job{ slot, std::vector<VfxFrameIO>(count) };
+    std::vector<const VSFrame *> srcs(count);
+    std::vector<VSFrame *> dsts(count);
+    std::vector<DeviceFrame *> outs(count);
+    const auto &in = d->srcPlanes, &out = d->dstPlanes;
+    for (int k = 0; k < count; k++) {
+        const VSFrame *src = srcs[k] = vsapi->getFrameFilter(first + k, d->node, frameCtx);
 
+        assert(vsapi->getFrameHeight(src, 0) == (int)d->in_image_height());
+        assert(vsapi->getFrameWidth(src, 0) == (int)d->in_image_width());
+        int planes[3] = { 0, 1, 2 };
+        const VSFrame *srcf[3] = { nullptr, nullptr, nullptr };
+        VSFrame *dst = dsts[k] = vsapi->newVideoFrame2(&d->out_format, d->out_image_width(), d->out_image_height(), srcf, planes, src, core);
+
+        auto &io = job.frames[k];
+        const DeviceFrame *srcDf = findDeviceFrame(src, vsapi);
+        DeviceFrame *dstDf = nullptr;
+        if (d->gpu_output) {
+            dstDf = outs[k] = new DeviceFrame;
+            dstDf->ctx = d->context;
+            CK_CUDA(cuCtxPushCurrent_v2(d->context));
+            CK_CUDA(cuMemAlloc_v2(&dstDf->ptr, out.size()));
+            filterStatsBytes(f->perf, out.size());
+            if (d->primary) {
+                CUcontext primary;
+                CK_CUDA(cuDevicePrimaryCtxRetain(&primary, d->cuDevice));
+                dstDf->primary = d->cuDevice;
+            }
+            cuCtxPopCurrent_v2(nullptr);
             for (int plane = 0; plane < 3; plane++) {
-                const auto stride = vsapi->getStride(dst, plane);
-                auto *ptr = vsapi->getWritePtr(dst, plane);
-                const size_t w = d->out_image_width(), h = d->out_image_height();
-                const auto pitch = d->dstTmpImg.pitch;
-                vsh::bitblt(ptr, stride, host + pitch * h * plane, pitch, w * d->output_depth / 8, h);
+                dstDf->offset[plane] = out.offset[plane];
+                dstDf->pitch[plane] = out.pitch[plane];
+                dstDf->rowBytes[plane] = out.rowBytes[plane];
+                dstDf->rows[plane] = out.rows[plane];
+            }
+        }
+        io.srcOnGpu = srcDf != nullptr;
+        io.dstOnGpu = dstDf != nullptr;
+        for (int plane = 0; plane < 3; plane++) {
+            const char *ptr = reinterpret_cast<const char *>(vsapi->getReadPtr(src, plane));
+            const size_t stride = vsapi->getStride(src, plane);
+            if (srcDf) {
+                io.src[plane] = static_cast<const char*>(srcDf->ptr) + srcDf->offset[plane];
+                io.srcPitch[plane] = srcDf->pitch[plane];
+            } else if (d->zero_copy) {
+                io.src[plane] = ptr;
+                io.srcPitch[plane] = stride;
+            } else {
+                char *host = static_cast<char*>(slot->srcCpuBuf) + k * in.size() + in.offset[plane];
+                vsh::bitblt(host, in.pitch[plane], ptr, stride, in.rowBytes[plane], in.rows[plane]);
+                io.src[plane] = host;
+                io.srcPitch[plane] = in.pitch[plane];
+            }
+            if (dstDf) {
+                io.dst[plane] = static_cast<char*>(dstDf->ptr) + dstDf->offset[plane];
+                io.dstPitch[plane] = dstDf->pitch[plane];
+            } else if (d->zero_copy) {
+                io.dst[plane] = reinterpret_cast<char *>(vsapi->getWritePtr(dst, plane));
+                io.dstPitch[plane] = vsapi->getStride(dst, plane);
+            } else {
+                io.dst[plane] = static_cast<char*>(slot->dstCpuBuf) + k * out.size() + out.offset[plane];
+                io.dstPitch[plane] = out.pitch[plane];
             }
+        }
 
-            vsapi->freeFrame(src);
-            lock.unlock();
-            return dst;
+        io.matrix = 1;
+        io.fullRange = false;
+        if (d->yuv) {
+            const VSMap *props = vsapi->getFramePropertiesRO(src);
+            int err;
+            int64_t matrix = vsapi->mapGetInt(props, "_Matrix", 0, &err);
+            if (!err)
+                io.matrix = int(matrix);
+            io.fullRange = vsapi->mapGetInt(props, "_ColorRange", 0, &err) == 0 && !err;
         }
     }
+    auto done = job.done.get_future();
+    d->enqueue(&job);
+    {
+        GpuWaitTimer wait(f->perf);
+        done.wait();
+    }
+
+    for (int k = 0; k < count; k++) {
+        const auto &io = job.frames[k];
+        if (!io.dstOnGpu)
+            filterStatsBytes(f->perf, filterStatsFrameSize(dsts[k], vsapi));
+        for (int plane = 0; plane < 3 && !d->zero_copy && !io.dstOnGpu; plane++)
+            vsh::bitblt(vsapi->getWritePtr(dsts[k], plane), vsapi->getStride(dsts[k], plane), io.dst[plane], io.dstPitch[plane], out.rowBytes[plane], out.rows[plane]);
+        setDeviceFrame(dsts[k], outs[k], core, vsapi);
+    }
+
+    f->release(d, slot);
+    for (auto src : srcs)
+        vsapi->freeFrame(src);
+    return std::vector<const VSFrame *>(dsts.begin(), dsts.end());
+}
+
+static const VSFrame *VS_CC vfxGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    VfxFilter *f = static_cast<VfxFilter *>(instanceData);
+
+    // Frames are run in batches of consecutive frames, starting at multiples
+    // of batch, and every frame of a batch requests all of its input.
+    const int first = n - n % f->batch;
+    const int count = std::min(f->batch, f->streams[0].vi.numFrames - first);
+
+    if (activationReason == arInitial) {
+        for (int i = first; i < first + count; i++)
+            vsapi->requestFrameFilter(i, f->streams[0].node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        if (f->batch == 1)
+            return vfxProcess(f, n, 1, frameCtx, core, vsapi)[0];
+
+        bool run;
+        auto b = f->findBatch(first, run, vsapi);
+        if (run) {
+            b->frames = vfxProcess(f, first, count, frameCtx, core, vsapi);
+            b->promise.set_value();
+        }
+        b->ready.wait();
+        const VSFrame *dst = vsapi->addFrameRef(b->frames[n - first]);
+        f->takeFromBatch(first, b);
+        return dst;
+    }
 
     return nullptr;
 }
 
 static void VS_CC vfxFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    VfxData *ds = static_cast<VfxData *>(instanceData);
-    for (int i = 0; i < ds->num_streams; ++i) {
-        auto d = ds + i;
+    VfxFilter *f = static_cast<VfxFilter *>(instanceData);
+    for (int i = 0; i < f->num_streams; ++i) {
+        auto d = &f->streams[i];
         vsapi->freeNode(d->node);
     }
 
-    delete[] ds;
+    delete f;
 }
 
 static void VS_CC vfxCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
@@ -184,17 +1316,76 @@ static void VS_CC vfxCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             return;
     }
     int err;
+    std::vector<int> devices;
+    if (int n = vsapi->mapNumElements(in, "device_id"); n > 0) {
+        int count = 0;
+        if (cuInit(0) != CUDA_SUCCESS || cuDeviceGetCount(&count) != CUDA_SUCCESS) {
+            vsapi->mapSetError(out, "DLVFX: unable to initialize CUDA.");
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            const int id = vsh::int64ToIntS(vsapi->mapGetInt(in, "device_id", i, nullptr));
+            if (id < 0 || id >= count) {
+                vsapi->mapSetError(out, ("DLVFX: device_id " + std::to_string(id) + " is out of range, there are " + std::to_string(count) + " devices.").c_str());
+                return;
+            }
+            devices.push_back(id);
+        }
+    } else
+        devices.push_back(-1);
+    const int num_devices = devices.size();
+
     auto num_streams = vsh::int64ToIntS(vsapi->mapGetInt(in, "num_streams", 0, &err));
-    if (err) num_streams = 1;
+    if (err) num_streams = num_devices;
+    if (num_streams < num_devices) {
+        vsapi->mapSetError(out, "DLVFX: num_streams must be at least the number of devices.");
+        return;
+    }
+    auto affinity = vsh::int64ToIntS(vsapi->mapGetInt(in, "affinity", 0, &err));
+    if (err) affinity = 1;
+    if (affinity < 1) {
+        vsapi->mapSetError(out, "DLVFX: affinity must be at least 1.");
+        return;
+    }
+    auto num_buffers = vsh::int64ToIntS(vsapi->mapGetInt(in, "num_buffers", 0, &err));
+    if (err) num_buffers = 3;
+    if (num_buffers < 1) {
+        vsapi->mapSetError(out, "DLVFX: num_buffers must be at least 1.");
+        return;
+    }
+
+    const bool zero_copy = !!vsapi->mapGetInt(in, "zero_copy", 0, &err);
+    const bool gpu_output = !!vsapi->mapGetInt(in, "gpu_output", 0, &err);
+
+    auto tile_overlap = vsh::int64ToIntS(vsapi->mapGetInt(in, "tile_overlap", 0, &err));
+    if (err) tile_overlap = 16;
+    if (tile_overlap < 0) {
+        vsapi->mapSetError(out, "DLVFX: tile_overlap must not be negative.");
+        return;
+    }
+
+    auto batch = vsh::int64ToIntS(vsapi->mapGetInt(in, "batch", 0, &err));
+    if (err) batch = 1;
+    if (batch < 1) {
+        vsapi->mapSetError(out, "DLVFX: batch must be at least 1.");
+        return;
+    }
 
-    std::unique_ptr<VfxData[]> ds(new VfxData[num_streams]);
+    std::unique_ptr<VfxFilter> f(new VfxFilter(num_streams, num_devices));
+    auto ds = f->streams.get();
+    f->affinity = affinity;
+    f->batch = batch;
+    f->maxBatches = 2 * num_streams * num_buffers;
 
     for (int i = 0; i < num_streams; ++i) {
         auto d = &ds[i];
-        d->num_streams = num_streams;
+        d->num_buffers = num_buffers;
+        d->zero_copy = zero_copy;
+        d->gpu_output = gpu_output;
+        d->perf = f->perf;
+        d->batch = batch;
+        d->device = devices[i % num_devices];
         size_t op = ~0U;
-        enum { OP_AR, OP_SUPERRES, OP_DENOISE };
-        const NvVFX_EffectSelector selectors[] = { NVVFX_FX_ARTIFACT_REDUCTION, NVVFX_FX_SUPER_RES, NVVFX_FX_DENOISING };
         try {
             if (autoDllErrors.size() > 0) {
                 std::string error, last;
@@ -214,13 +1405,17 @@ static void VS_CC vfxCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             if (!vsh::isConstantVideoFormat(&d->vi)) {
                 throw std::runtime_error("Only clips with constant format and dimensions allowed");
             }
-            if (d->vi.format.numPlanes != 3 || d->vi.format.colorFamily != cfRGB)
-                throw std::runtime_error("input clip must be RGB format");
+            if (d->vi.format.numPlanes != 3 || (d->vi.format.colorFamily != cfRGB && d->vi.format.colorFamily != cfYUV))
+                throw std::runtime_error("input clip must be RGB or YUV format");
+            d->yuv = d->vi.format.colorFamily == cfYUV;
 
             op = vsh::int64ToIntS(vsapi->mapGetInt(in, "op", 0, &err));
             if (err) throw std::runtime_error("op is required argument");
-            if (op >= sizeof selectors / sizeof selectors[0])
+            if (op > (size_t)OP_DENOISE)
                 throw std::runtime_error("op is out of range.");
+            d->op = op;
+            if (op == OP_DENOISE && batch > 1)
+                throw std::runtime_error("batch is not supported by denoising, which depends on the previous frame");
 
             if (op != OP_SUPERRES)
                 d->scale = 1;
@@ -241,107 +1436,124 @@ static void VS_CC vfxCreate(const VSMap *in, VSMap *out, void *userData, VSCore
                 modelDir = getenv("MODEL_DIR");
             if (modelDir == nullptr)
                 modelDir = "C:\\Program Files\\NVIDIA Corporation\\NVIDIA Video Effects\\models";
-            fprintf(stderr, "MODEL_DIR = %s\n", modelDir);
+            if (i == 0)
+                fprintf(stderr, "MODEL_DIR = %s\n", modelDir);
+            d->model_dir = modelDir;
 
-            NvCV_Status r = NvVFX_CreateEffect(selectors[op], &d->vfx);
-            if (r != NVCV_SUCCESS) {
-                const char *err = NvCV_GetErrorStringFromCode(r);
-                fprintf(stderr, "NvVFX_CreateEffect failed: %x (%s)\n", r, err);
-                throw std::runtime_error("unable to create effect: " + std::string(err));
+            d->in_width = d->vi.width;
+            d->in_height = d->vi.height;
+            d->vi.width *= d->scale;
+            d->vi.height *= d->scale;
+
+            if (op != OP_DENOISE) {
+                // The largest input the effect takes, from the SDK's limits:
+                // super resolution outputs at most 2160 lines.
+                int maxTileW = 2048, maxTileH = 1080;
+                if (op == OP_SUPERRES) {
+                    maxTileH = std::min(1080, int(2160 / d->scale));
+                    maxTileW = maxTileH * 16 / 9 / 128 * 128;
+                }
+                if (int n = vsapi->mapNumElements(in, "tile_size"); n >= 0) {
+                    if (n != 2)
+                        throw std::runtime_error("tile_size must have two elements, the width and the height");
+                    maxTileW = vsh::int64ToIntS(vsapi->mapGetInt(in, "tile_size", 0, nullptr));
+                    maxTileH = vsh::int64ToIntS(vsapi->mapGetInt(in, "tile_size", 1, nullptr));
+                    if (maxTileW < 256 || maxTileW % 128 || maxTileH < 90)
+                        throw std::runtime_error("tile_size must be at least 256x90, with a width that is a multiple of 128");
+                }
+
+                const unsigned g = scaleGranularity(d->scale), overlap = std::max<unsigned>(tile_overlap, g);
+                const unsigned align = std::lcm(128u, g);
+                const bool tileX = d->in_width % 128 || d->in_width > maxTileW, tileY = d->in_height > maxTileH;
+                if (tileX || tileY) {
+                    if (d->in_width < 256 || d->in_height < 90)
+                        throw std::runtime_error("clip is too small to be tiled");
+                    if ((tileX && maxTileW / align * align <= overlap) || (tileY && maxTileH / g * g <= overlap))
+                        throw std::runtime_error("tile_overlap is too large for the tiles");
+                    d->tile_width = tileX ? tileSize(d->in_width, maxTileW / align * align, align, overlap) : d->in_width;
+                    d->tile_height = tileY ? tileSize(d->in_height, maxTileH / g * g, g, overlap) : d->in_height;
+                    if (d->tile_width < 256 || d->tile_height < 90)
+                        throw std::runtime_error("clip is too small to be tiled");
+                    if ((tileX && overlap * 3 >= d->tile_width) || (tileY && overlap * 3 >= d->tile_height))
+                        throw std::runtime_error("tile_overlap is too large for the tiles");
+                    d->tile_out_width = tileX ? unsigned(std::llround(d->tile_width * d->scale)) : d->vi.width;
+                    d->tile_out_height = tileY ? unsigned(std::llround(d->tile_height * d->scale)) : d->vi.height;
+                    const auto xs = tileSpans(d->in_width, d->tile_width, d->vi.width, d->tile_out_width, d->scale, overlap, g);
+                    const auto ys = tileSpans(d->in_height, d->tile_height, d->vi.height, d->tile_out_height, d->scale, overlap, g);
+                    for (const auto &y : ys)
+                        for (const auto &x : xs)
+                            d->tiles.push_back({ x.in, y.in, x.out, y.out, x.rise, x.riseInv, x.fall, x.fallInv, y.rise, y.riseInv, y.fall, y.fallInv });
+                    if (i == 0)
+                        fprintf(stderr, "DLVFX: cutting %dx%d frames into %d tiles of %ux%u\n", d->in_width, d->in_height, (int)d->tiles.size(), d->tile_width, d->tile_height);
+                }
             }
 
-            CK_VFX(NvVFX_CudaStreamCreate(&d->stream));
-            CK_VFX(NvVFX_SetCudaStream(d->vfx, NVVFX_CUDA_STREAM, d->stream));
-
-            if (op == OP_AR || op == OP_SUPERRES) {
-                r = NvVFX_SetU32(d->vfx, NVVFX_STRENGTH, int(d->strength));
-                if (r != NVCV_SUCCESS)
-                    r = NvVFX_SetU32(d->vfx, NVVFX_MODE, int(d->strength));
-            } else if (op == OP_DENOISE)
-                r = NvVFX_SetF32(d->vfx, NVVFX_STRENGTH, d->strength);
-            else
-                throw std::runtime_error("unknown op " + std::to_string(op));
-            if (r != NVCV_SUCCESS) {
-                const char *err = NvCV_GetErrorStringFromCode(r);
-                fprintf(stderr, "NvVFX set strength failed: %x (%s)\n", r, err);
-                throw std::runtime_error("failed to set strength: " + std::string(err));
+            if (auto bps = d->vi.format.bitsPerSample, st = d->vi.format.sampleType; d->yuv) {
+                if (st != stInteger || bps > 16)
+                    throw std::runtime_error("YUV clips must be 8-16 bit integer format");
+            } else if (bps == 32 && st == stFloat) {
+                d->src_ct = NVCV_F32;
+                d->srcTransferFactor = 1.0f;
+            } else if (bps == 8 && st == stInteger) {
+                d->src_ct = NVCV_U8;
+                d->srcTransferFactor = 1.0f/255.0f;
+            } else {
+                throw std::runtime_error("unsupported clip format");
             }
 
-            r = NvVFX_SetString(d->vfx, NVVFX_MODEL_DIRECTORY, modelDir);
-            if (r != NVCV_SUCCESS) {
-                fprintf(stderr, "NvVFX set model directory to %s failed: %x (%s)\n", modelDir, r, NvCV_GetErrorStringFromCode(r));
-                throw std::runtime_error("unable to set model directory " + std::string(modelDir));
+            int output_depth = vsh::int64ToIntS(vsapi->mapGetInt(in, "output_depth", 0, &err));
+            if (err) output_depth = d->vi.format.bitsPerSample;
+            d->output_depth = output_depth;
+            if (d->yuv) {
+                if (output_depth < 8 || output_depth > 16)
+                    throw std::runtime_error("unsupported output_depth: only 8-16 are supported for YUV clips");
+                if (d->vi.width % (1 << d->vi.format.subSamplingW) || d->vi.height % (1 << d->vi.format.subSamplingH))
+                    throw std::runtime_error("scaled dimensions must be a multiple of the chroma subsampling");
+                vsapi->queryVideoFormat(&d->out_format, cfYUV, stInteger, output_depth, d->vi.format.subSamplingW, d->vi.format.subSamplingH, core);
+            } else if (output_depth == 32) {
+                d->dst_ct = NVCV_F32;
+                d->dstTransferFactor = 1.0f;
+            } else if (output_depth == 8) {
+                d->dst_ct = NVCV_U8;
+                d->dstTransferFactor = 255.0f;;
+            } else {
+                throw std::runtime_error("unsupported output_depth: only 8 (RGB24) or 32 (RGBS) are supported");
             }
+            if (!d->yuv)
+                vsapi->queryVideoFormat(&d->out_format, cfRGB, output_depth == 32 ? stFloat : stInteger, output_depth, 0, 0, core);
         } catch (std::runtime_error &e) {
             if (d->node)
                 vsapi->freeNode(d->node);
             vsapi->mapSetError(out, (std::string{ "DLVFX: " } + e.what()).c_str());
             return;
         }
+    }
 
-        d->in_width = d->vi.width;
-        d->in_height = d->vi.height;
-        d->vi.width *= d->scale;
-        d->vi.height *= d->scale;
-
-        NvCVImage_ComponentType src_ct, dst_ct;
-        if (auto bps = d->vi.format.bitsPerSample, st = d->vi.format.sampleType; bps == 32 && st == stFloat) {
-            src_ct = NVCV_F32;
-	    d->srcTransferFactor = 1.0f;
-        } else if (bps == 8 && st == stInteger) {
-            src_ct = NVCV_U8;
-	    d->srcTransferFactor = 1.0f/255.0f;
-        } else {
-            throw std::runtime_error("unsupported clip format");
-        }
-
-        int output_depth = vsh::int64ToIntS(vsapi->mapGetInt(in, "output_depth", 0, &err));
-        if (err) output_depth = d->vi.format.bitsPerSample;
-        d->output_depth = output_depth;
-        if (output_depth == 32) {
-            dst_ct = NVCV_F32;
-	    d->dstTransferFactor = 1.0f;
-        } else if (output_depth == 8) {
-            dst_ct = NVCV_U8;
-	    d->dstTransferFactor = 255.0f;;
-        } else {
-            throw std::runtime_error("unsupported output_depth: only 8 (RGB24) or 32 (RGBS) are supported");
-	}
-
-        CK_VFX(NvCVImage_Alloc(&d->srcTmpImg, d->in_image_width(), d->in_image_height(), NVCV_RGB, src_ct, NVCV_PLANAR, NVCV_GPU, 0));
-        CK_VFX(NvCVImage_Alloc(&d->srcGpuImg, d->in_image_width(), d->in_image_height(), NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU, 0));
-        CK_VFX(NvCVImage_Alloc(&d->dstTmpImg, d->out_image_width(), d->out_image_height(), NVCV_RGB, dst_ct, NVCV_PLANAR, NVCV_GPU, 0));
-        CK_VFX(NvCVImage_Alloc(&d->dstGpuImg, d->out_image_width(), d->out_image_height(), NVCV_BGR, NVCV_F32, NVCV_PLANAR, NVCV_GPU, 0));
-
-        CK_CUDA(cuMemHostAlloc(&d->srcCpuBuf, d->srcTmpImg.pitch * d->in_image_height() * 3, CU_MEMHOSTALLOC_WRITECOMBINED));
-        CK_CUDA(cuMemHostAlloc(&d->dstCpuBuf, d->dstTmpImg.pitch * d->out_image_height() * 3, 0));
-
-        CK_VFX(NvVFX_SetImage(d->vfx, NVVFX_INPUT_IMAGE, &d->srcGpuImg));
-        CK_VFX(NvVFX_SetImage(d->vfx, NVVFX_OUTPUT_IMAGE, &d->dstGpuImg));
-
-        if (op == OP_DENOISE) {
-            unsigned int stateSizeInBytes = 0;
-            CK_VFX(NvVFX_GetU32(d->vfx, NVVFX_STATE_SIZE, &stateSizeInBytes));
-            CK_CUDA(cuMemAlloc_v2(&d->state, stateSizeInBytes));
-            CK_CUDA(cuMemsetD8Async(d->state, 0, stateSizeInBytes, d->stream));
-            void *stateArray[1] = { d->state };
-            CK_VFX(NvVFX_SetObject(d->vfx, NVVFX_STATE, (void*)stateArray));
+    // Only the first stream of each device is loaded up front, so that errors
+    // in the model setup surface here.
+    try {
+        for (int j = 0; j < num_devices; ++j) {
+            ds[j].load(j);
+            f->loaded[j] = 1;
         }
-
-        CK_VFX(NvVFX_Load(d->vfx));
+    } catch (std::runtime_error &e) {
+        for (int i = 0; i < num_streams; ++i)
+            vsapi->freeNode(ds[i].node);
+        vsapi->mapSetError(out, (std::string{ "DLVFX: " } + e.what()).c_str());
+        return;
     }
 
     // Copy a video info object and set its format to the expected output format.
     VSVideoInfo outputVideoInfo = ds[0].vi;
-    vsapi->queryVideoFormat(&outputVideoInfo.format, cfRGB, ds[0].output_depth == 32 ? stFloat : stInteger, ds[0].output_depth, 0, 0, core);
+    outputVideoInfo.format = ds[0].out_format;
 
     std::vector<VSFilterDependency> deps;
     deps.reserve(num_streams);
     for (auto i = 0; i < num_streams; i++) {
-        deps.emplace_back(ds[i].node, rpStrictSpatial);
+        deps.emplace_back(ds[i].node, batch > 1 ? rpGeneral : rpStrictSpatial);
     }
 
-    vsapi->createVideoFilter(out, "DLVFX", &outputVideoInfo, vfxGetFrame, vfxFree, fmParallel, deps.data(), deps.size(), ds.release(), core);
+    vsapi->createVideoFilter(out, "DLVFX", &outputVideoInfo, timedGetFrame<VfxFilter, vfxGetFrame>, vfxFree, fmParallel, deps.data(), deps.size(), f.release(), core);
 }
 
 //////////////////////////////////////////
@@ -353,5 +1565,5 @@ void VS_CC vfxInitialize(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
 VS_EXTERNAL_API(void) VapourSynthPluginInit(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
     vsapi->configPlugin("info.akarin.plugin", "akarin2", "Experimental Nvidia Maxine plugin", VAPOURSYNTH_API_VERSION, 1, plugin);
 #endif
-    vsapi->registerFunction("DLVFX", "clip:vnode;op:int;scale:float:opt;strength:float:opt;output_depth:int:opt;num_streams:int:opt;model_dir:data:opt;", "clip:vnode", vfxCreate, nullptr, plugin);
+    vsapi->registerFunction("DLVFX", "clip:vnode;op:int;scale:float:opt;strength:float:opt;output_depth:int:opt;num_streams:int:opt;device_id:int[]:opt;affinity:int:opt;num_buffers:int:opt;zero_copy:int:opt;gpu_output:int:opt;batch:int:opt;tile_size:int[]:opt;tile_overlap:int:opt;model_dir:data:opt;", "clip:vnode", vfxCreate, nullptr, plugin);
 }
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "workpool.h"
+
+namespace {
+
+struct Batch {
+    void (*fn)(void *, int);
+    void *ctx;
+    int count;
+    std::atomic<int> next{ 0 };
+    std::atomic<int> remaining;
+    std::mutex lock;
+    std::condition_variable done;
+
+    Batch(void (*fn)(void *, int), void *ctx, int count) : fn(fn), ctx(ctx), count(count), remaining(count) {}
+
+    void work() {
+        for (int i = next++; i < count; i = next++) {
+            fn(ctx, i);
+            if (--remaining == 0) {
+                std::lock_guard<std::mutex> guard(lock);
+                done.notify_all();
+            }
+        }
+    }
+};
+
+// Intentionally leaked: the workers must outlive every filter instance.
+std::mutex &poolLock = *new std::mutex;
+std::condition_variable &poolWake = *new std::condition_variable;
+std::deque<std::shared_ptr<Batch>> &queue = *new std::deque<std::shared_ptr<Batch>>; // guarded by poolLock
+int workers = 0; // guarded by poolLock
+bool fixed = false; // set from AKARIN_THREADS, guarded by poolLock
+
+void loop() {
+    for (;;) {
+        std::shared_ptr<Batch> batch;
+        {
+            std::unique_lock<std::mutex> guard(poolLock);
+            poolWake.wait(guard, [] { return !queue.empty(); });
+            batch = std::move(queue.front());
+            queue.pop_front();
+        }
+        batch->work();
+    }
+}
+
+// Must be called with poolLock held.
+void grow(int n) {
+    for (; workers < n; workers++)
+        std::thread(loop).detach();
+}
+
+} // namespace
+
+void workPoolInit(void) {
+    const char *v = std::getenv("AKARIN_THREADS");
+    if (!v || !*v)
+        return;
+    std::lock_guard<std::mutex> guard(poolLock);
+    fixed = true;
+    grow(std::clamp(std::atoi(v), 0, 256));
+}
+
+void workPoolReserve(VSCore *core, const VSAPI *vsapi) {
+    VSCoreInfo info;
+    vsapi->getCoreInfo(core, &info);
+    std::lock_guard<std::mutex> guard(poolLock);
+    if (!fixed)
+        grow(std::max(info.numThreads, 2) - 1);
+}
+
+void workPoolRun(int count, void (*fn)(void *ctx, int i), void *ctx) {
+    if (count <= 1) {
+        if (count == 1)
+            fn(ctx, 0);
+        return;
+    }
+    auto batch = std::make_shared<Batch>(fn, ctx, count);
+    {
+        std::lock_guard<std::mutex> guard(poolLock);
+        for (int i = 1; i < std::min(count, workers + 1); i++)
+            queue.push_back(batch);
+    }
+    poolWake.notify_all();
+    batch->work();
+    std::unique_lock<std::mutex> guard(batch->lock);
+    batch->done.wait(guard, [&] { return batch->remaining == 0; });
+}
@@ -0,0 +1,40 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include "VapourSynth4.h"
+
+// One set of worker threads shared by every filter of the plugin for the work
+// within a frame, e.g. the strips of Expr and the c-value strips of Cambi, so
+// that filters do not each start their own. The calling thread always takes
+// part in its own loop, so a frame makes progress even when every worker is
+// busy with other frames, and loops may be nested.
+
+#ifdef __cplusplus
+#include <functional>
+
+extern "C" {
+#endif
+
+// Reads AKARIN_THREADS, which fixes the number of workers, when the plugin is
+// loaded.
+void workPoolInit(void);
+
+// Unless AKARIN_THREADS is set, grows the pool to one worker less than the
+// thread count of core. Called by the filters using the pool when created.
+void workPoolReserve(VSCore *core, const VSAPI *vsapi);
+
+// Calls fn(ctx, i) for every 0 <= i < count and returns once all calls have
+// finished. Idle workers take the next index of whichever loop is running, so
+// uneven items balance out.
+void workPoolRun(int count, void (*fn)(void *ctx, int i), void *ctx);
+
+#ifdef __cplusplus
+}
+
+inline void parallelFor(int count, const std::function<void(int)> &fn) {
+    workPoolRun(count, [](void *ctx, int i) { (*static_cast<const std::function<void(int)> *>(ctx))(i); },
+                const_cast<std::function<void(int)> *>(&fn));
+}
+#endif
+
+#endif // WORKPOOL_H